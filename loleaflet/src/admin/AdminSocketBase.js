@@ -19,12 +19,25 @@ var AdminSocketBase = Base.extend({
 			this.socket = new WebSocket(host);
 			this.socket.onopen = this.onSocketOpen.bind(this);
 			this.socket.onclose = this.onSocketClose.bind(this);
-			this.socket.onmessage = this.onSocketMessage.bind(this);
+			this.socket.onmessage = this._onBatchMessage.bind(this);
 			this.socket.onerror = this.onSocketError.bind(this);
 			this.socket.binaryType = 'arraybuffer';
 		}
 	},
 
+	// The notifications piling up are sent in one 'batch' frame, a line each.
+	_onBatchMessage: function(e) {
+		if (typeof e.data !== 'string' || !e.data.startsWith('batch\n')) {
+			this.onSocketMessage(e);
+			return;
+		}
+
+		var messages = e.data.split('\n');
+		for (var i = 1; i < messages.length; i++) {
+			this.onSocketMessage({data: messages[i]});
+		}
+	},
+
 	onSocketOpen: function() {
 		/* Implemented by child */
 	},
@@ -19,7 +19,7 @@ var AdminSocketOverview = AdminSocketBase.extend({
 	},
 
 	onSocketOpen: function() {
-		this.socket.send('documents');
+		this.socket.send('documents sort=cpu');
 		this.socket.send('subscribe adddoc rmdoc');
 
 		this._getBasicStats();
@@ -78,9 +78,9 @@ var AdminSocketOverview = AdminSocketBase.extend({
 
 		var tableContainer = document.getElementById('doclist');
 		var rowContainer;
-		var pidEle, nameEle, viewsEle, memEle, sDocTimeEle, docEle, aEle;
+		var pidEle, nameEle, viewsEle, memEle, sDocTimeEle, placementEle, cpuEle, renderEle, docEle, aEle;
 		var nViews, nTotalViews;
-		var docProps, sPid, sName, sViews, sMem, sDocTime;
+		var docProps, sPid, sName, sViews, sMem, sDocTime, sPlacement, sCpu, sRender;
 		if (textMsg.startsWith('documents')) {
 			var documents = textMsg.substring('documents'.length);
 			documents = documents.trim().split('\n');
@@ -94,6 +94,9 @@ var AdminSocketOverview = AdminSocketBase.extend({
 				sViews = docProps[2];
 				sMem = docProps[3];
 				sDocTime = docProps[4];
+				sPlacement = docProps[5] || '-';
+				sCpu = docProps[6] || '0';
+				sRender = docProps[8] || '0';
 				if (sName === '0') {
 					continue;
 				}
@@ -123,6 +126,18 @@ var AdminSocketOverview = AdminSocketBase.extend({
 				sDocTimeEle.value = parseInt(sDocTime);
 				sDocTimeEle.innerHTML = Util.humanizeSecs(sDocTime);
 				rowContainer.appendChild(sDocTimeEle);
+
+				placementEle = document.createElement('td');
+				placementEle.innerHTML = sPlacement;
+				rowContainer.appendChild(placementEle);
+
+				cpuEle = document.createElement('td');
+				cpuEle.innerHTML = sCpu + '%';
+				rowContainer.appendChild(cpuEle);
+
+				renderEle = document.createElement('td');
+				renderEle.innerHTML = Util.humanizeSecs(Math.round(parseInt(sRender) / 1000));
+				rowContainer.appendChild(renderEle);
 			}
 		}
 		else if (textMsg.startsWith('adddoc')) {
@@ -167,6 +182,19 @@ var AdminSocketOverview = AdminSocketBase.extend({
 				sDocTimeEle.innerHTML = Util.humanizeSecs(0);
 				rowContainer.appendChild(sDocTimeEle);
 
+				// Only in the documents list, refreshed on reload.
+				placementEle = document.createElement('td');
+				placementEle.innerHTML = '-';
+				rowContainer.appendChild(placementEle);
+
+				cpuEle = document.createElement('td');
+				cpuEle.innerHTML = '-';
+				rowContainer.appendChild(cpuEle);
+
+				renderEle = document.createElement('td');
+				renderEle.innerHTML = '-';
+				rowContainer.appendChild(renderEle);
+
 				var totalUsersEle = document.getElementById('active_docs_count');
 				totalUsersEle.innerHTML = parseInt(totalUsersEle.innerHTML) + 1;
 
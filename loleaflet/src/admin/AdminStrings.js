@@ -15,6 +15,9 @@ var strPid = _('PID');
 var strDocument = _('Document');
 var strNumberOfViews = _('Number of views');
 var strElapsedTime = _('Elapsed time');
+var strPlacement = _('Placement');
+var strCpu = _('CPU');
+var strRenderTime = _('Render time');
 var strKill = _('Kill');
 var strGraphs = _('Graphs');
 var strSave = _('Save');
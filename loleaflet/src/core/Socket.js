@@ -4,7 +4,7 @@
 
 /* global _ vex */
 L.Socket = L.Class.extend({
-	ProtocolVersionNumber: '0.1',
+	ProtocolVersionNumber: '0.4',
 
 	initialize: function (map) {
 		this._map = map;
@@ -124,6 +124,11 @@ L.Socket = L.Class.extend({
 			textMsg = String.fromCharCode.apply(null, imgBytes.subarray(0, index));
 		}
 
+		if (textMsg.startsWith('tilecombine:')) {
+			this._onTileCombinedMsg(textMsg, imgBytes, index);
+			return;
+		}
+
 		var command = this.parseServerCmd(textMsg);
 		if (textMsg.startsWith('loolserver ')) {
 			// This must be the first message, unless we reconnect.
@@ -181,7 +186,7 @@ L.Socket = L.Class.extend({
 			//FIXME: We should get statusindicator when saving too, no?
 			this._map.showBusy('Connecting...', false);
 		}
-		else if (!textMsg.startsWith('tile:') && !textMsg.startsWith('renderfont:')) {
+		else if (!textMsg.startsWith('tile:') && !textMsg.startsWith('tiledelta:') && !textMsg.startsWith('renderfont:')) {
 			// log the tile msg separately as we need the tile coordinates
 			L.Log.log(textMsg, L.INCOMING);
 			if (imgBytes !== undefined) {
@@ -270,12 +275,63 @@ L.Socket = L.Class.extend({
 			this._map._fireInitComplete('statusindicatorfinish');
 			return;
 		}
+		else if (textMsg.startsWith('transferprogress:')) {
+			var transfer = textMsg.substring('transferprogress:'.length).trim().split(' ');
+			var percent = parseInt(transfer[1]);
+			if (percent >= 100) {
+				this._map.hideBusy();
+			}
+			else {
+				this._map.showBusy(transfer[0] === 'upload' ? _('Uploading...') : _('Downloading...'), true);
+				this._map._progressBar.setValue(percent);
+			}
+			return;
+		}
 
 		if (this._map._docLayer) {
 			this._map._docLayer._onMessage(textMsg, img);
 		}
 	},
 
+	// Splits a 'tilecombine:' message into the 'tile:' messages it carries.
+	// The images follow the text in the order of the imgsize list.
+	_onTileCombinedMsg: function (textMsg, imgBytes, index) {
+		var tokens = textMsg.split(' ');
+		var positionsX = [];
+		var positionsY = [];
+		var sizes = [];
+		var params = '';
+		for (var i = 1; i < tokens.length; i++) {
+			if (tokens[i].startsWith('tileposx=')) {
+				positionsX = tokens[i].substring(9).split(',');
+			}
+			else if (tokens[i].startsWith('tileposy=')) {
+				positionsY = tokens[i].substring(9).split(',');
+			}
+			else if (tokens[i].startsWith('imgsize=')) {
+				sizes = tokens[i].substring(8).split(',');
+			}
+			else if (tokens[i].startsWith('solid=')) {
+				// Per-tile; the tile layer has no use for it.
+				continue;
+			}
+			else if (tokens[i] !== '') {
+				params += ' ' + tokens[i];
+			}
+		}
+
+		var offset = index + 1;
+		for (var t = 0; t < sizes.length; t++) {
+			var size = parseInt(sizes[t]);
+			var tileMsg = 'tile:' + params + ' tileposx=' + positionsX[t] + ' tileposy=' + positionsY[t];
+			var img = 'data:image/png;base64,' + window.btoa(this._utf8ToString(imgBytes.subarray(offset, offset + size)));
+			offset += size;
+			if (this._map._docLayer) {
+				this._map._docLayer._onMessage(tileMsg, img);
+			}
+		}
+	},
+
 	_onSocketError: function () {
 		this.hideBusy();
 		// Let onclose (_onSocketClose) report errors.
@@ -368,6 +424,21 @@ L.Socket = L.Class.extend({
 			else if (tokens[i].substring(0, 5) === 'font=') {
 				command.font = window.decodeURIComponent(tokens[i].substring(5));
 			}
+			else if (tokens[i].substring(0, 4) === 'ver=') {
+				command.ver = parseInt(tokens[i].substring(4));
+			}
+			else if (tokens[i].substring(0, 7) === 'deltax=') {
+				command.deltaX = parseInt(tokens[i].substring(7));
+			}
+			else if (tokens[i].substring(0, 7) === 'deltay=') {
+				command.deltaY = parseInt(tokens[i].substring(7));
+			}
+			else if (tokens[i].substring(0, 11) === 'deltawidth=') {
+				command.deltaWidth = parseInt(tokens[i].substring(11));
+			}
+			else if (tokens[i].substring(0, 12) === 'deltaheight=') {
+				command.deltaHeight = parseInt(tokens[i].substring(12));
+			}
 		}
 		if (command.tileWidth && command.tileHeight && this._map._docLayer) {
 			var defaultZoom = this._map.options.zoom;
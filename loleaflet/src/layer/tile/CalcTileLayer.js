@@ -33,6 +33,8 @@ L.CalcTileLayer = L.TileLayer.extend({
 
 		var tilePositionsX = '';
 		var tilePositionsY = '';
+		var baseVersions = '';
+		var hasBaseVersions = false;
 		var needsNewTiles = false;
 
 		for (var key in this._tiles) {
@@ -56,6 +58,12 @@ L.CalcTileLayer = L.TileLayer.extend({
 						tilePositionsY += ',';
 					}
 					tilePositionsY += tileTopLeft.y;
+					var baseVersion = this._getTileBaseVersion(key);
+					if (baseVersions !== '') {
+						baseVersions += ',';
+					}
+					baseVersions += baseVersion;
+					hasBaseVersions = hasBaseVersions || baseVersion >= 0;
 					needsNewTiles = true;
 				}
 				else {
@@ -76,6 +84,9 @@ L.CalcTileLayer = L.TileLayer.extend({
 				'tileposy=' + tilePositionsY + ' ' +
 				'tilewidth=' + this._tileWidthTwips + ' ' +
 				'tileheight=' + this._tileHeightTwips;
+			if (hasBaseVersions) {
+				message += ' basever=' + baseVersions;
+			}
 
 			this._map._socket.sendMessage(message, '');
 		}
@@ -690,6 +690,17 @@ L.GridLayer = L.Layer.extend({
 		}
 	},
 
+	// The version of the image the tile holds, for the server to send it
+	// the changes to that image only. -1 when it has none of its own yet:
+	// created empty, with a placeholder, or its changes still being drawn.
+	_getTileBaseVersion: function (key) {
+		var tile = this._tiles[key];
+		if (!tile || !(tile._ver > 0) || (tile._deltas && tile._deltas.length > 0)) {
+			return -1;
+		}
+		return tile._ver;
+	},
+
 	_isValidTile: function (coords) {
 		if (coords.x < 0 || coords.y < 0) {
 			return false;
@@ -24,6 +24,8 @@ L.ImpressTileLayer = L.TileLayer.extend({
 
 		var tilePositionsX = '';
 		var tilePositionsY = '';
+		var baseVersions = '';
+		var hasBaseVersions = false;
 		var needsNewTiles = false;
 
 		for (var key in this._tiles) {
@@ -47,6 +49,12 @@ L.ImpressTileLayer = L.TileLayer.extend({
 						tilePositionsY += ',';
 					}
 					tilePositionsY += tileTopLeft.y;
+					var baseVersion = this._getTileBaseVersion(key);
+					if (baseVersions !== '') {
+						baseVersions += ',';
+					}
+					baseVersions += baseVersion;
+					hasBaseVersions = hasBaseVersions || baseVersion >= 0;
 					needsNewTiles = true;
 				}
 				else {
@@ -67,6 +75,9 @@ L.ImpressTileLayer = L.TileLayer.extend({
 				'tileposy=' + tilePositionsY + ' ' +
 				'tilewidth=' + this._tileWidthTwips + ' ' +
 				'tileheight=' + this._tileHeightTwips;
+			if (hasBaseVersions) {
+				message += ' basever=' + baseVersions;
+			}
 
 			this._map._socket.sendMessage(message, '');
 		}
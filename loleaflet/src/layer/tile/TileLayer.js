@@ -337,6 +337,9 @@ L.TileLayer = L.GridLayer.extend({
 		else if (textMsg.startsWith('tile:')) {
 			this._onTileMsg(textMsg, img);
 		}
+		else if (textMsg.startsWith('tiledelta:')) {
+			this._onTileDeltaMsg(textMsg, img);
+		}
 		else if (textMsg.startsWith('unocommandresult:')) {
 			this._onUnoCommandResultMsg(textMsg);
 		}
@@ -753,6 +756,9 @@ L.TileLayer = L.GridLayer.extend({
 					this._map.fire('statusindicator', {statusType: 'alltilesloaded'});
 				}
 			}
+			// The whole tile supersedes any deltas still being applied.
+			tile._deltas = [];
+			tile._ver = command.ver;
 			tile.el.src = img;
 		}
 		else if (command.preFetch === 'true') {
@@ -761,6 +767,70 @@ L.TileLayer = L.GridLayer.extend({
 		L.Log.log(textMsg, L.INCOMING, key);
 	},
 
+	// Only the changed area of a tile we have, to draw over it.
+	_onTileDeltaMsg: function (textMsg, img) {
+		var command = this._map._socket.parseServerCmd(textMsg);
+		var coords = this._twipsToCoords(command);
+		coords.z = command.zoom;
+		coords.part = command.part;
+		var key = this._tileCoordsToKey(coords);
+		var tile = this._tiles[key];
+		if (tile) {
+			if (tile._invalidCount > 0) {
+				tile._invalidCount -= 1;
+			}
+			if (command.deltaWidth > 0 && command.deltaHeight > 0) {
+				// Applied in order, each over the result of the previous one.
+				tile._deltas = tile._deltas || [];
+				tile._deltas.push({x: command.deltaX, y: command.deltaY, ver: command.ver, img: img});
+				if (tile._deltas.length === 1) {
+					this._applyTileDelta(tile);
+				}
+			}
+		}
+		L.Log.log(textMsg, L.INCOMING, key);
+	},
+
+	_applyTileDelta: function (tile) {
+		var delta = tile._deltas[0];
+		var base = new Image();
+		var patch = new Image();
+		var loaded = 0;
+		var onLoad = L.bind(function () {
+			if (++loaded < 2) {
+				return;
+			}
+			if (tile._deltas[0] !== delta) {
+				// Superseded by a whole tile.
+				return;
+			}
+			var canvas = document.createElement('canvas');
+			canvas.width = base.width;
+			canvas.height = base.height;
+			var context = canvas.getContext('2d');
+			context.drawImage(base, 0, 0);
+			context.clearRect(delta.x, delta.y, patch.width, patch.height);
+			context.drawImage(patch, delta.x, delta.y);
+			tile.el.src = canvas.toDataURL('image/png');
+			tile._ver = delta.ver;
+			tile._deltas.shift();
+			if (tile._deltas.length > 0) {
+				this._applyTileDelta(tile);
+			}
+		}, this);
+		var onError = function () {
+			// Give up on these, until the next whole tile, which isn't to be a delta.
+			tile._deltas = [];
+			tile._ver = undefined;
+		};
+		base.onload = onLoad;
+		patch.onload = onLoad;
+		base.onerror = onError;
+		patch.onerror = onError;
+		base.src = tile.el.src;
+		patch.src = delta.img;
+	},
+
 	_tileOnLoad: function (done, tile) {
 		done(null, tile);
 	},
@@ -25,6 +25,8 @@ L.WriterTileLayer = L.TileLayer.extend({
 
 		var tilePositionsX = '';
 		var tilePositionsY = '';
+		var baseVersions = '';
+		var hasBaseVersions = false;
 		var needsNewTiles = false;
 
 		for (var key in this._tiles) {
@@ -48,6 +50,12 @@ L.WriterTileLayer = L.TileLayer.extend({
 						tilePositionsY += ',';
 					}
 					tilePositionsY += tileTopLeft.y;
+					var baseVersion = this._getTileBaseVersion(key);
+					if (baseVersions !== '') {
+						baseVersions += ',';
+					}
+					baseVersions += baseVersion;
+					hasBaseVersions = hasBaseVersions || baseVersion >= 0;
 					needsNewTiles = true;
 				}
 				else {
@@ -71,6 +79,9 @@ L.WriterTileLayer = L.TileLayer.extend({
 				'tileposy=' + tilePositionsY + ' ' +
 				'tilewidth=' + this._tileWidthTwips + ' ' +
 				'tileheight=' + this._tileHeightTwips;
+			if (hasBaseVersions) {
+				message += ' basever=' + baseVersions;
+			}
 
 			this._map._socket.sendMessage(message, '');
 		}
@@ -29,14 +29,17 @@
 
 #include "AdminModel.hpp"
 #include "Auth.hpp"
+#include "Command.hpp"
 #include "Common.hpp"
 #include "FileServer.hpp"
 #include "IoUtil.hpp"
 #include "LOOLProtocol.hpp"
 #include "LOOLWSD.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
 #include "Storage.hpp"
 #include "TileCache.hpp"
+#include "Trace.hpp"
 #include "Unit.hpp"
 #include "Util.hpp"
 
@@ -65,9 +68,11 @@ bool AdminRequestHandler::adminCommandHandler(const std::vector<char>& payload)
         tokens[0] == "active_users_count" ||
         tokens[0] == "active_docs_count" ||
         tokens[0] == "mem_stats" ||
-        tokens[0] == "cpu_stats" )
+        tokens[0] == "cpu_stats" ||
+        tokens[0] == "session_queues" ||
+        tokens[0] == "kit_memory")
     {
-        const std::string responseFrame = tokens[0] + " " + model.query(tokens[0]);
+        const std::string responseFrame = tokens[0] + " " + model.query(firstLine);
         sendTextFrame(responseFrame);
     }
     else if (tokens[0] == "subscribe" && tokens.count() > 1)
@@ -90,6 +95,56 @@ bool AdminRequestHandler::adminCommandHandler(const std::vector<char>& payload)
         std::string responseFrame = "total_mem " + std::to_string(totalMem);
         sendTextFrame(responseFrame);
     }
+    else if (tokens[0] == "tile_cache_stats")
+    {
+        const std::string responseFrame = tokens[0] + " " + TileCache::getMemoryCacheStats();
+        sendTextFrame(responseFrame);
+    }
+    else if (tokens[0] == "prespawn_stats")
+    {
+        const std::string responseFrame = tokens[0] + " " + LOOLWSD::getPrespawnStats();
+        sendTextFrame(responseFrame);
+    }
+    else if (tokens[0] == "memory_pressure")
+    {
+        const std::string responseFrame = tokens[0] + " " + LOOLWSD::getMemoryPressureStats();
+        sendTextFrame(responseFrame);
+    }
+    else if (tokens[0] == "wopi_stats")
+    {
+        const std::string responseFrame = tokens[0] + " " + WopiStorage::getStats();
+        sendTextFrame(responseFrame);
+    }
+    else if (tokens[0] == "convert_stats")
+    {
+        const std::string responseFrame = tokens[0] + " " + LOOLWSD::getConvertStats();
+        sendTextFrame(responseFrame);
+    }
+    else if (tokens[0] == "save_stats")
+    {
+        const std::string responseFrame = tokens[0] + " " + LOOLWSD::getSaveStats();
+        sendTextFrame(responseFrame);
+    }
+    else if (tokens[0] == "tile_cache_disk_stats")
+    {
+        const std::string responseFrame = tokens[0] + " " + LOOLWSD::getTileCacheQuotaStats();
+        sendTextFrame(responseFrame);
+    }
+    else if (tokens[0] == "deflate_stats")
+    {
+        const std::string responseFrame = tokens[0] + " " + LOOLWSD::getDeflateStats();
+        sendTextFrame(responseFrame);
+    }
+    else if (tokens[0] == "cluster_stats")
+    {
+        const std::string responseFrame = tokens[0] + " " + LOOLWSD::getClusterStats();
+        sendTextFrame(responseFrame);
+    }
+    else if (tokens[0] == "trace_dump")
+    {
+        const std::string responseFrame = tokens[0] + " " + Trace::dumpJson();
+        sendTextFrame(responseFrame);
+    }
     else if (tokens[0] == "kill" && tokens.count() == 2)
     {
         try
@@ -179,6 +234,8 @@ bool AdminRequestHandler::adminCommandHandler(const std::vector<char>& payload)
 void AdminRequestHandler::handleWSRequests(HTTPServerRequest& request, HTTPServerResponse& response, int sessionId)
 {
     _adminWs = std::make_shared<WebSocket>(request, response);
+    // Not to hold up the notifications of the others for long, when not reading.
+    _adminWs->setSendTimeout(Poco::Timespan(AdminSendTimeoutSecs, 0));
 
     {
         std::unique_lock<std::mutex> modelLock(_admin->getLock());
@@ -230,6 +287,18 @@ void AdminRequestHandler::handleRequest(HTTPServerRequest& request, HTTPServerRe
 
             handleWSRequests(request, response, sessionId);
         }
+        else if (pathTokens.count() >= 2 && pathTokens[1] == "metrics")
+        {
+            // Scrapers authenticate with the admin credentials, by Basic auth.
+            if (!FileServerRequestHandler::isAdminLoggedIn(request, response))
+                throw Poco::Net::NotAuthenticatedException("Invalid admin login");
+
+            const std::string metrics = Metrics::instance().serialize();
+            response.setContentType("text/plain; version=0.0.4");
+            response.set("Cache-Control", "no-cache");
+            response.setContentLength(metrics.size());
+            response.send() << metrics;
+        }
     }
     catch(const Poco::Net::NotAuthenticatedException& exc)
     {
@@ -260,6 +329,75 @@ Admin::Admin() :
 
     _cpuStatsTask = new CpuStats(this);
     _cpuStatsTimer.schedule(_cpuStatsTask, _cpuStatsTaskInterval, _cpuStatsTaskInterval);
+
+    _notifyTask = new NotifyTask(this);
+    _notifyTimer.schedule(_notifyTask, NotifyTaskInterval, NotifyTaskInterval);
+
+    // Observed by the kits, and merged in as DocumentBroker receives them.
+    Metrics& metrics = Metrics::instance();
+    metrics.histogram("loolkit_paint_seconds", "Painting tiles by LibreOfficeKit.");
+    metrics.histogram("loolkit_png_encode_seconds", "Encoding a tile to PNG.");
+    metrics.histogram("loolkit_document_load_seconds", "Loading a document in LibreOfficeKit.");
+    metrics.counter("loolkit_mouse_moves_coalesced_total", "The mouse moves dropped for the next one of the view.");
+    metrics.counter("loolkit_render_previews_total", "The renders over their time budget previewed at a lower resolution first.");
+
+    metrics.addLabelledCallback("loolwsd_messages_total", "The messages of the clients and the kits handled, by command.",
+                                "counter", "command", []()
+                                {
+                                    std::vector<std::pair<std::string, double>> counts;
+                                    const auto commandCounts = LOOLProtocol::getCommandCounts();
+                                    for (size_t i = 0; i < LOOLProtocol::Commands::Count; ++i)
+                                    {
+                                        const uint64_t count = commandCounts[i];
+                                        if (count > 0)
+                                        {
+                                            const auto command = static_cast<LOOLProtocol::Command>(i);
+                                            counts.emplace_back(command == LOOLProtocol::Command::Unknown ? "unknown" :
+                                                                LOOLProtocol::getCommandName(command), count);
+                                        }
+                                    }
+
+                                    return counts;
+                                });
+
+    metrics.addCallback("loolwsd_tile_memory_cache_hits_total", "The tiles found in the memory caches.",
+                        "counter", []() { return TileCache::getMemoryCacheHits(); });
+    metrics.addCallback("loolwsd_tile_memory_cache_misses_total", "The tiles not found in the memory caches.",
+                        "counter", []() { return TileCache::getMemoryCacheMisses(); });
+    metrics.addCallback("loolwsd_tile_memory_cache_hit_ratio", "The share of the tiles found in the memory caches.",
+                        "gauge", []()
+                        {
+                            const double hits = TileCache::getMemoryCacheHits();
+                            const double misses = TileCache::getMemoryCacheMisses();
+                            return hits + misses > 0 ? hits / (hits + misses) : 0.;
+                        });
+    metrics.addCallback("loolwsd_tile_memory_cache_bytes", "The size of the memory caches.",
+                        "gauge", []() { return TileCache::getMemoryCacheTotalSize(); });
+
+    metrics.addCallback("loolwsd_session_queue_depth", "The messages queued for the client sessions.",
+                        "gauge", [this]()
+                        {
+                            std::unique_lock<std::mutex> modelLock(_modelMutex);
+                            return _model.getSessionQueueDepth();
+                        });
+    metrics.addCallback("loolwsd_session_queue_dropped", "The messages dropped by the client sessions alive.",
+                        "gauge", [this]()
+                        {
+                            std::unique_lock<std::mutex> modelLock(_modelMutex);
+                            return _model.getSessionQueueDropped();
+                        });
+    metrics.addCallback("loolwsd_active_views", "The views open on all documents.",
+                        "gauge", [this]()
+                        {
+                            std::unique_lock<std::mutex> modelLock(_modelMutex);
+                            return _model.getTotalActiveViews();
+                        });
+    metrics.addCallback("loolwsd_kit_memory_kb", "The memory of the kits, by PSS.",
+                        "gauge", [this]()
+                        {
+                            std::unique_lock<std::mutex> modelLock(_modelMutex);
+                            return _model.getTotalMemoryUsage();
+                        });
 }
 
 Admin::~Admin()
@@ -268,6 +406,7 @@ Admin::~Admin()
 
     _memStatsTask->cancel();
     _cpuStatsTask->cancel();
+    _notifyTask->cancel();
 }
 
 void Admin::addDoc(const std::string& docKey, Poco::Process::PID pid, const std::string& filename, const std::string& sessionId)
@@ -288,10 +427,29 @@ void Admin::rmDoc(const std::string& docKey)
     _model.removeDocument(docKey);
 }
 
+void Admin::notify(const std::string& message)
+{
+    std::unique_lock<std::mutex> modelLock(_modelMutex);
+    _model.notify(message);
+}
+
+void Admin::addRenderTime(const std::string& docKey, const uint64_t count, const double ms)
+{
+    std::unique_lock<std::mutex> modelLock(_modelMutex);
+    _model.addRenderTime(docKey, count, ms);
+}
+
+void Admin::addSessionQueue(const std::string& sessionId, const std::shared_ptr<BasicTileQueue>& queue)
+{
+    std::unique_lock<std::mutex> modelLock(_modelMutex);
+    _model.addSessionQueue(sessionId, queue);
+}
+
 void MemoryStats::run()
 {
     std::unique_lock<std::mutex> modelLock(_admin->getLock());
     AdminModel& model = _admin->getModel();
+    model.sampleMemory();
     const auto totalMem = _admin->getTotalMemoryUsage(model);
 
     if (totalMem != _lastTotalMemory)
@@ -301,13 +459,52 @@ void MemoryStats::run()
 
     _lastTotalMemory = totalMem;
     model.addMemStats(totalMem);
+
+    // Shedding reports to the model, and unloading removes from it.
+    modelLock.unlock();
+    LOOLWSD::handleMemoryPressure(totalMem);
 }
 
 void CpuStats::run()
 {
-    //TODO: Implement me
-    //std::unique_lock<std::mutex> modelLock(_admin->getLock());
-    //model.addCpuStats(totalMem);
+    std::unique_lock<std::mutex> modelLock(_admin->getLock());
+    AdminModel& model = _admin->getModel();
+    model.addCpuStats(model.sampleCpu());
+}
+
+void NotifyTask::run()
+{
+    std::vector<AdminModel::Notification> notifications;
+    {
+        std::unique_lock<std::mutex> modelLock(_admin->getLock());
+        notifications = _admin->getModel().takeNotifications();
+    }
+
+    // Unlocked, a slow console holds up only the notifications.
+    for (const auto& notification : notifications)
+    {
+        if (notification.drop)
+        {
+            IoUtil::shutdownWebSocket(notification.ws);
+            continue;
+        }
+
+        try
+        {
+            notification.ws->sendFrame(notification.frame.data(), notification.frame.size());
+        }
+        catch (const Poco::Exception& exc)
+        {
+            Log::warn() << "Dropping admin subscriber " << notification.sessionId
+                        << " failing to be notified: " << exc.displayText() << Log::end;
+            {
+                std::unique_lock<std::mutex> modelLock(_admin->getLock());
+                _admin->getModel().removeSubscriber(notification.sessionId);
+            }
+
+            IoUtil::shutdownWebSocket(notification.ws);
+        }
+    }
 }
 
 void Admin::rescheduleMemTimer(unsigned interval)
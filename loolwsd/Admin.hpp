@@ -44,6 +44,8 @@ private:
     Admin* _admin;
     std::shared_ptr<Poco::Net::WebSocket> _adminWs;
     int _sessionId;
+
+    static constexpr long AdminSendTimeoutSecs = 5;
 };
 
 /// An admin command processor.
@@ -72,8 +74,17 @@ public:
     /// Remove the document with all views. Used on termination or catastrophic failure.
     void rmDoc(const std::string& docKey);
 
+    /// Adds the paints reported by the kit of the document, for the documents query.
+    void addRenderTime(const std::string& docKey, uint64_t count, double ms);
+
+    /// Reports the input queue of the client session in the session_queues query.
+    void addSessionQueue(const std::string& sessionId, const std::shared_ptr<BasicTileQueue>& queue);
+
     void setForKitPid(const int forKitPid) { _forKitPid = forKitPid; }
 
+    /// Sends the message to the consoles subscribed to its first token.
+    void notify(const std::string& message);
+
     /// Callers must ensure that modelMutex is acquired
     AdminModel& getModel();
 
@@ -108,6 +119,11 @@ private:
     Poco::Util::Timer _cpuStatsTimer;
     Poco::Util::TimerTask::Ptr _cpuStatsTask;
     unsigned _cpuStatsTaskInterval = 5000;
+
+    Poco::Util::Timer _notifyTimer;
+    Poco::Util::TimerTask::Ptr _notifyTask;
+    /// How long the notifications pile up before being sent.
+    static constexpr unsigned NotifyTaskInterval = 250;
 };
 
 class MemoryStats : public Poco::Util::TimerTask
@@ -135,7 +151,8 @@ private:
 class CpuStats : public Poco::Util::TimerTask
 {
 public:
-    CpuStats(Admin* /*admin*/)
+    CpuStats(Admin* admin)
+        : _admin(admin)
     {
         Log::debug("Cpu stat ctor");
     }
@@ -148,6 +165,22 @@ public:
     void run() override;
 
 private:
+    Admin* _admin;
+};
+
+/// Sends the notifications queued in the model, in one frame per subscriber.
+class NotifyTask : public Poco::Util::TimerTask
+{
+public:
+    NotifyTask(Admin* admin)
+        : _admin(admin)
+    {
+    }
+
+    void run() override;
+
+private:
+    Admin* _admin;
 };
 
 #endif
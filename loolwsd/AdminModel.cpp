@@ -10,22 +10,38 @@
 #include "AdminModel.hpp"
 #include "config.h"
 
+#include <algorithm>
+#include <functional>
 #include <memory>
 #include <set>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include <Poco/Net/WebSocket.h>
 #include <Poco/Process.h>
 #include <Poco/StringTokenizer.h>
 #include <Poco/URI.h>
 
+#include "KitPlacement.hpp"
+#include "LOOLProtocol.hpp"
 #include "Log.hpp"
+#include "MessageQueue.hpp"
 #include "Unit.hpp"
 #include "Util.hpp"
 
 using Poco::StringTokenizer;
 
+namespace
+{
+    /// The kits are placed by ForKit, the nodes only serve to tell which.
+    const std::vector<KitPlacement::Node>& getNumaNodes()
+    {
+        static const auto nodes = KitPlacement::readNodes();
+        return nodes;
+    }
+}
+
 /////////////////
 // Document Impl
 ////////////////
@@ -57,27 +73,63 @@ int Document::expireView(const std::string& sessionId)
     return _activeViews;
 }
 
+void Document::sampleMemory(bool exact, unsigned tick)
+{
+    _rss = Util::getResidentMemory(_pid);
+    if (!exact)
+        return;
+
+    Util::MemoryStats memory;
+    if (Util::getMemoryStats(_pid, memory))
+    {
+        _memory = memory;
+        _memoryExact = true;
+    }
+    else
+    {
+        // Not dumpable or gone, count it all as its own.
+        _memory = Util::MemoryStats();
+        _memory.rss = _memory.pss = _memory.uss = _rss;
+        _memoryExact = false;
+    }
+
+    _rss = _memory.rss;
+    _memoryTick = tick;
+}
+
+void Document::sampleCpu()
+{
+    const auto now = std::chrono::steady_clock::now();
+    const long cpuTime = Util::getCpuTime(_pid);
+    if (cpuTime >= 0 && _cpuTime >= 0)
+    {
+        const auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - _cpuSampleTime).count();
+        _cpuPercent = (elapsedMs > 0 ? std::max(cpuTime - _cpuTime, 0L) * 100 / elapsedMs : 0);
+    }
+
+    _cpuTime = cpuTime;
+    _cpuSampleTime = now;
+}
+
 ///////////////////
 // Subscriber Impl
 //////////////////
-bool Subscriber::notify(const std::string& message)
+bool Subscriber::enqueue(const std::string& message)
 {
     StringTokenizer tokens(message, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
 
-    if (_subscriptions.find(tokens[0]) == _subscriptions.end())
+    if (tokens.count() == 0 || _subscriptions.find(tokens[0]) == _subscriptions.end())
         return true;
 
-    auto webSocket = _ws.lock();
-    if (webSocket)
-    {
-        UnitWSD::get().onAdminNotifyMessage(message);
-        webSocket->sendFrame(message.data(), message.length());
-        return true;
-    }
-    else
-    {
-        return false;
-    }
+    _queued.push_back(message);
+    return _queued.size() <= MaxQueued;
+}
+
+std::vector<std::string> Subscriber::takeQueued()
+{
+    std::vector<std::string> queued;
+    queued.swap(_queued);
+    return queued;
 }
 
 bool  Subscriber::subscribe(const std::string& command)
@@ -101,7 +153,7 @@ std::string AdminModel::query(const std::string& command)
 
     if (tokens[0] == "documents")
     {
-        return getDocuments();
+        return getDocuments(command);
     }
     else if (tokens[0] == "active_users_count")
     {
@@ -127,6 +179,14 @@ std::string AdminModel::query(const std::string& command)
     {
         return std::to_string(_cpuStatsSize);
     }
+    else if (tokens[0] == "session_queues")
+    {
+        return getSessionQueues();
+    }
+    else if (tokens[0] == "kit_memory")
+    {
+        return getKitMemory();
+    }
 
     return std::string("");
 }
@@ -140,12 +200,36 @@ unsigned AdminModel::getTotalMemoryUsage()
         if (it.second.isExpired())
             continue;
 
-        totalMem += Util::getMemoryUsage(it.second.getPid());
+        totalMem += it.second.getPss();
     }
 
     return totalMem;
 }
 
+void AdminModel::sampleMemory()
+{
+    ++_memoryTick;
+
+    // The longest unsampled first.
+    std::vector<Document*> documents;
+    for (auto& it: _documents)
+    {
+        if (!it.second.isExpired())
+            documents.push_back(&it.second);
+    }
+
+    std::sort(documents.begin(), documents.end(),
+              [](const Document* lhs, const Document* rhs)
+              {
+                  return lhs->getMemorySampleTick() < rhs->getMemorySampleTick();
+              });
+
+    for (size_t i = 0; i < documents.size(); ++i)
+    {
+        documents[i]->sampleMemory(i < ExactMemorySamplesPerTick, _memoryTick);
+    }
+}
+
 void AdminModel::subscribe(int nSessionId, std::shared_ptr<Poco::Net::WebSocket>& ws)
 {
     const auto ret = _subscribers.emplace(nSessionId, Subscriber(nSessionId, ws));
@@ -201,6 +285,30 @@ void AdminModel::addCpuStats(unsigned cpuUsage)
     notify(oss.str());
 }
 
+unsigned AdminModel::sampleCpu()
+{
+    unsigned total = 0;
+    for (auto& it: _documents)
+    {
+        if (it.second.isExpired())
+            continue;
+
+        it.second.sampleCpu();
+        total += it.second.getCpuPercent();
+    }
+
+    return total;
+}
+
+void AdminModel::addRenderTime(const std::string& docKey, const uint64_t count, const double ms)
+{
+    auto docIt = _documents.find(docKey);
+    if (docIt != _documents.end())
+    {
+        docIt->second.addRenderTime(count, ms);
+    }
+}
+
 void AdminModel::setCpuStatsSize(unsigned size)
 {
     int wasteValuesLen = _cpuStats.size() - size;
@@ -235,18 +343,57 @@ void AdminModel::setMemStatsSize(unsigned size)
 
 void AdminModel::notify(const std::string& message)
 {
+    for (auto& it : _subscribers)
+    {
+        if (!it.second.enqueue(message) && !it.second.isExpired())
+        {
+            Log::warn() << "Admin subscriber " << it.first << " has "
+                        << Subscriber::MaxQueued << " notifications queued, dropping it." << Log::end;
+            it.second.expire();
+        }
+    }
+}
+
+std::vector<AdminModel::Notification> AdminModel::takeNotifications()
+{
+    std::vector<Notification> notifications;
     auto it = std::begin(_subscribers);
     while (it != std::end(_subscribers))
     {
-        if (!it->second.notify(message))
+        auto ws = it->second.getWebSocket();
+        const bool drop = it->second.isExpired();
+        const auto messages = it->second.takeQueued();
+        if (ws && (drop || !messages.empty()))
+        {
+            // Several in one frame, a line each, after a "batch" line.
+            std::string frame = (messages.size() == 1 ? messages[0] : "batch");
+            for (size_t i = 0; i < messages.size(); ++i)
+            {
+                if (!drop)
+                {
+                    UnitWSD::get().onAdminNotifyMessage(messages[i]);
+                }
+
+                if (messages.size() > 1)
+                {
+                    frame += '\n' + messages[i];
+                }
+            }
+
+            notifications.push_back(Notification{ it->first, ws, frame, drop });
+        }
+
+        if (!ws || drop)
         {
             it = _subscribers.erase(it);
         }
         else
         {
-            it++;
+            ++it;
         }
     }
+
+    return notifications;
 }
 
 void AdminModel::addDocument(const std::string& docKey, Poco::Process::PID pid,
@@ -254,9 +401,14 @@ void AdminModel::addDocument(const std::string& docKey, Poco::Process::PID pid,
 {
     const auto ret = _documents.emplace(docKey, Document(docKey, pid, filename));
     ret.first->second.addView(sessionId);
+    if (ret.second)
+    {
+        ret.first->second.sampleMemory(true, _memoryTick);
+        ret.first->second.setPlacement(KitPlacement::describe(pid, getNumaNodes()));
+    }
 
     // Notify the subscribers
-    unsigned memUsage = Util::getMemoryUsage(pid);
+    unsigned memUsage = ret.first->second.getPss();
     std::ostringstream oss;
     std::string encodedFilename;
     Poco::URI::encode(filename, " ", encodedFilename);
@@ -312,6 +464,20 @@ void AdminModel::removeDocument(const std::string& docKey)
     }
 }
 
+void AdminModel::addSessionQueue(const std::string& sessionId, const std::shared_ptr<BasicTileQueue>& queue)
+{
+    // Forget the sessions gone since.
+    for (auto it = _sessionQueues.begin(); it != _sessionQueues.end(); )
+    {
+        if (it->second.expired())
+            it = _sessionQueues.erase(it);
+        else
+            ++it;
+    }
+
+    _sessionQueues[sessionId] = queue;
+}
+
 std::string AdminModel::getMemStats()
 {
     std::string response;
@@ -348,19 +514,53 @@ unsigned AdminModel::getTotalActiveViews()
     return nTotalViews;
 }
 
-std::string AdminModel::getDocuments()
+std::string AdminModel::getDocuments(const std::string& command)
 {
-    std::ostringstream oss;
+    std::vector<const Document*> documents;
     for (auto& it: _documents)
     {
-        if (it.second.isExpired())
-            continue;
+        if (!it.second.isExpired())
+            documents.push_back(&it.second);
+    }
+
+    // The heaviest first.
+    StringTokenizer tokens(command, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+    std::string sort;
+    if (tokens.count() > 1 && LOOLProtocol::getTokenString(tokens[1], "sort", sort))
+    {
+        std::function<double(const Document*)> key;
+        if (sort == "views")
+            key = [](const Document* doc) { return doc->getActiveViews(); };
+        else if (sort == "mem")
+            key = [](const Document* doc) { return doc->getPss(); };
+        else if (sort == "time")
+            key = [](const Document* doc) { return doc->getElapsedTime(); };
+        else if (sort == "cpu")
+            key = [](const Document* doc) { return doc->getCpuPercent(); };
+        else if (sort == "cputime")
+            key = [](const Document* doc) { return doc->getCpuTime(); };
+        else if (sort == "render")
+            key = [](const Document* doc) { return doc->getRenderMs(); };
+
+        if (key)
+        {
+            std::stable_sort(documents.begin(), documents.end(),
+                             [&key](const Document* lhs, const Document* rhs)
+                             {
+                                 return key(lhs) > key(rhs);
+                             });
+        }
+    }
 
-        std::string sPid = std::to_string(it.second.getPid());
-        std::string sFilename = it.second.getFilename();
-        std::string sViews = std::to_string(it.second.getActiveViews());
-        std::string sMem = std::to_string(Util::getMemoryUsage(it.second.getPid()));
-        std::string sElapsed = std::to_string(it.second.getElapsedTime());
+    std::ostringstream oss;
+    for (const auto doc : documents)
+    {
+        std::string sPid = std::to_string(doc->getPid());
+        std::string sFilename = doc->getFilename();
+        std::string sViews = std::to_string(doc->getActiveViews());
+        std::string sMem = std::to_string(doc->getPss());
+        std::string sElapsed = std::to_string(doc->getElapsedTime());
+        const std::string& sPlacement = doc->getPlacement();
 
         std::string encodedFilename;
         Poco::URI::encode(sFilename, " ", encodedFilename);
@@ -368,7 +568,75 @@ std::string AdminModel::getDocuments()
             << encodedFilename << " "
             << sViews << " "
             << sMem << " "
-            << sElapsed << " \n ";
+            << sElapsed << " "
+            << sPlacement << " "
+            << doc->getCpuPercent() << " "
+            << doc->getCpuTime() << " "
+            << static_cast<uint64_t>(doc->getRenderMs()) << " "
+            << doc->getRenderCount() << " \n ";
+    }
+
+    return oss.str();
+}
+
+std::string AdminModel::getSessionQueues()
+{
+    std::ostringstream oss;
+    for (auto& it: _sessionQueues)
+    {
+        const auto queue = it.second.lock();
+        if (!queue)
+            continue;
+
+        oss << it.first << " "
+            << queue->size() << " "
+            << queue->getDroppedCount() << " \n ";
+    }
+
+    return oss.str();
+}
+
+size_t AdminModel::getSessionQueueDepth()
+{
+    size_t depth = 0;
+    for (auto& it: _sessionQueues)
+    {
+        const auto queue = it.second.lock();
+        if (queue)
+            depth += queue->size();
+    }
+
+    return depth;
+}
+
+size_t AdminModel::getSessionQueueDropped()
+{
+    size_t dropped = 0;
+    for (auto& it: _sessionQueues)
+    {
+        const auto queue = it.second.lock();
+        if (queue)
+            dropped += queue->getDroppedCount();
+    }
+
+    return dropped;
+}
+
+std::string AdminModel::getKitMemory()
+{
+    std::ostringstream oss;
+    for (auto& it: _documents)
+    {
+        if (it.second.isExpired())
+            continue;
+
+        oss << it.second.getPid() << " "
+            << it.second.getPss() << " "
+            << it.second.getUss() << " "
+            << it.second.getShared() << " "
+            << it.second.getRss() << " "
+            << (it.second.isMemoryExact() && it.second.getMemorySampleTick() == _memoryTick ? "exact" : "estimated")
+            << " \n ";
     }
 
     return oss.str();
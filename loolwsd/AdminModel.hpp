@@ -10,9 +10,14 @@
 #ifndef INCLUDED_ADMINMODEL_HPP
 #define INCLUDED_ADMINMODEL_HPP
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <map>
 #include <memory>
 #include <set>
 #include <string>
+#include <vector>
 
 #include <Poco/Net/WebSocket.h>
 #include <Poco/Process.h>
@@ -71,6 +76,59 @@ public:
 
     const std::map<std::string, View>& getViews() const { return _views; }
 
+    /// Reads the memory of the kit, from its smaps if exact, else only
+    /// its resident size, on which the last exact sample is extrapolated.
+    void sampleMemory(bool exact, unsigned tick);
+
+    /// The proportional memory in KB, the shared pages divided among the kits.
+    size_t getPss() const { return extrapolate(_memory.pss); }
+
+    /// The memory freed if the kit goes.
+    size_t getUss() const { return extrapolate(_memory.uss); }
+
+    size_t getShared() const { return _memory.shared; }
+
+    size_t getRss() const { return _rss; }
+
+    /// Whether the above come from smaps as of the last sample.
+    bool isMemoryExact() const { return _memoryExact; }
+
+    /// The tick of the last exact sample, 0 if none.
+    unsigned getMemorySampleTick() const { return _memoryTick; }
+
+    /// The NUMA node and CPUs the kit is pinned to, as "<node>:<cpulist>", "-" if not.
+    const std::string& getPlacement() const { return _placement; }
+
+    void setPlacement(const std::string& placement) { _placement = placement; }
+
+    /// Reads the CPU time of the kit, for the share of a core it used since the last sample.
+    void sampleCpu();
+
+    /// The percents of a core used between the last two samples.
+    unsigned getCpuPercent() const { return _cpuPercent; }
+
+    /// The CPU time used by the kit, in ms.
+    long getCpuTime() const { return std::max(_cpuTime, 0L); }
+
+    /// Counts the tiles painted by the kit, as it reports them.
+    void addRenderTime(uint64_t count, double ms)
+    {
+        _renderCount += count;
+        _renderMs += ms;
+    }
+
+    uint64_t getRenderCount() const { return _renderCount; }
+
+    double getRenderMs() const { return _renderMs; }
+
+private:
+    /// What the kit grew by since the last exact sample is private, its heap mostly.
+    size_t extrapolate(size_t sampled) const
+    {
+        const long value = static_cast<long>(sampled) + static_cast<long>(_rss) - static_cast<long>(_memory.rss);
+        return std::max(value, 0L);
+    }
+
 private:
     const std::string _docKey;
     const Poco::Process::PID _pid;
@@ -83,11 +141,31 @@ private:
 
     std::time_t _start;
     std::time_t _end = 0;
+
+    /// As of the last exact sample, or the resident size only if smaps isn't readable.
+    Util::MemoryStats _memory;
+    /// The current resident size.
+    size_t _rss = 0;
+    bool _memoryExact = false;
+    unsigned _memoryTick = 0;
+    std::string _placement = "-";
+
+    /// As of the last sample, -1 before the first.
+    long _cpuTime = -1;
+    std::chrono::steady_clock::time_point _cpuSampleTime;
+    unsigned _cpuPercent = 0;
+
+    uint64_t _renderCount = 0;
+    double _renderMs = 0;
 };
 
 class Subscriber
 {
 public:
+    /// A console that hasn't been sent as many, over the intervals
+    /// of the admin thread, is stalled, and disconnected.
+    static constexpr size_t MaxQueued = 1000;
+
     Subscriber(int sessionId, std::shared_ptr<Poco::Net::WebSocket>& ws)
         : _sessionId(sessionId),
           _ws(ws),
@@ -101,7 +179,14 @@ public:
         Log::info("Subscriber dtor.");
     }
 
-    bool notify(const std::string& message);
+    /// Queues the message if subscribed to its first token.
+    /// False once too many are queued, the console not reading them.
+    bool enqueue(const std::string& message);
+
+    /// The messages queued since the last call, to send in one frame.
+    std::vector<std::string> takeQueued();
+
+    std::shared_ptr<Poco::Net::WebSocket> getWebSocket() const { return _ws.lock(); }
 
     bool subscribe(const std::string& command);
 
@@ -119,10 +204,14 @@ private:
 
     std::set<std::string> _subscriptions;
 
+    std::vector<std::string> _queued;
+
     std::time_t _start;
     std::time_t _end = 0;
 };
 
+class BasicTileQueue;
+
 class AdminModel
 {
 public:
@@ -141,6 +230,10 @@ public:
     /// Returns memory consumed by all active loolkit processes
     unsigned getTotalMemoryUsage();
 
+    /// Samples the memory of the kits: the resident size of each, which is cheap,
+    /// and the smaps of the few sampled the longest ago, which is not.
+    void sampleMemory();
+
     void subscribe(int sessionId, std::shared_ptr<Poco::Net::WebSocket>& ws);
     void subscribe(int sessionId, const std::string& command);
 
@@ -154,36 +247,80 @@ public:
 
     void addCpuStats(unsigned cpuUsage);
 
+    /// Samples the CPU time of the kits, returning the percents of a core they used.
+    unsigned sampleCpu();
+
+    /// Adds the paints reported by the kit of the document.
+    void addRenderTime(const std::string& docKey, uint64_t count, double ms);
+
     void setCpuStatsSize(unsigned size);
 
     void setMemStatsSize(unsigned size);
 
+    /// Queues the message for the subscribers to it, to be sent by the
+    /// admin thread, so that those raising the events never wait for the consoles.
     void notify(const std::string& message);
 
+    /// The messages queued for a subscriber, in one frame.
+    struct Notification
+    {
+        int sessionId;
+        std::shared_ptr<Poco::Net::WebSocket> ws;
+        std::string frame;
+        /// Too slow, to be disconnected rather than sent to.
+        bool drop;
+    };
+
+    /// Takes the messages queued for each subscriber, forgetting
+    /// those gone, and those too slow, which are to be disconnected.
+    std::vector<Notification> takeNotifications();
+
+    /// Forgets the subscriber, after failing to send to it.
+    void removeSubscriber(int sessionId) { _subscribers.erase(sessionId); }
+
     void addDocument(const std::string& docKey, Poco::Process::PID pid, const std::string& filename, const std::string& sessionId);
 
     void removeDocument(const std::string& docKey, const std::string& sessionId);
     void removeDocument(const std::string& docKey);
 
+    /// Reports the depth of the queue of the client session, while it lives.
+    void addSessionQueue(const std::string& sessionId, const std::shared_ptr<BasicTileQueue>& queue);
+
+    /// The messages queued for, and dropped by, the client sessions alive.
+    size_t getSessionQueueDepth();
+    size_t getSessionQueueDropped();
+
+    unsigned getTotalActiveViews();
+
 private:
 
     std::string getMemStats();
 
     std::string getCpuStats();
 
-    unsigned getTotalActiveViews();
+    /// Sorted by the column named by sort=<column>, in the command, if any.
+    std::string getDocuments(const std::string& command);
+
+    std::string getSessionQueues();
 
-    std::string getDocuments();
+    std::string getKitMemory();
 
 private:
     std::map<int, Subscriber> _subscribers;
     std::map<std::string, Document> _documents;
+    std::map<std::string, std::weak_ptr<BasicTileQueue>> _sessionQueues;
 
     std::list<unsigned> _memStats;
     unsigned _memStatsSize = 100;
 
     std::list<unsigned> _cpuStats;
     unsigned _cpuStatsSize = 100;
+
+    unsigned _memoryTick = 0;
+
+    /// Reading smaps walks all the mappings of a kit, so only
+    /// as many kits are read at each tick, in turn.
+    static constexpr size_t ExactMemorySamplesPerTick = 8;
 };
 
 #endif
@@ -0,0 +1,373 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_ASSETCACHE_HPP
+#define INCLUDED_ASSETCACHE_HPP
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <Poco/DeflatingStream.h>
+#include <Poco/DigestEngine.h>
+#include <Poco/SHA1Engine.h>
+
+/// The static files of the file server, read once at startup with their
+/// compressed variants, so that serving them is neither a disk read nor a
+/// compression per request. Each variant has a strong ETag, for the clients
+/// to revalidate rather than download again. The files are those of the
+/// disk when loaded: changing them needs a restart.
+class AssetCache
+{
+public:
+    /// The parts of a page, split on its %PLACEHOLDERS% once, to fill them in per request.
+    class Template
+    {
+    public:
+        Template() {}
+
+        explicit Template(const std::string& text)
+        {
+            size_t literal = 0;
+            size_t pos = 0;
+            while ((pos = text.find('%', pos)) != std::string::npos)
+            {
+                const auto end = text.find('%', pos + 1);
+                if (end == std::string::npos)
+                {
+                    break;
+                }
+
+                const auto name = text.substr(pos + 1, end - pos - 1);
+                if (name.empty() || name.find_first_not_of("ABCDEFGHIJKLMNOPQRSTUVWXYZ_") != std::string::npos)
+                {
+                    // Not a placeholder, but the next may start at end.
+                    pos = end;
+                    continue;
+                }
+
+                _parts.push_back(Part{ text.substr(literal, pos - literal), name });
+                literal = pos = end + 1;
+            }
+
+            _parts.push_back(Part{ text.substr(literal), std::string() });
+        }
+
+        /// The placeholders not in values are left as they are.
+        std::string render(const std::map<std::string, std::string>& values) const
+        {
+            std::string result;
+            for (const auto& part : _parts)
+            {
+                result += part._text;
+                if (!part._name.empty())
+                {
+                    const auto it = values.find(part._name);
+                    result += (it != values.end() ? it->second : '%' + part._name + '%');
+                }
+            }
+
+            return result;
+        }
+
+    private:
+        struct Part
+        {
+            std::string _text;
+            /// The placeholder that follows _text, if any.
+            std::string _name;
+        };
+
+        std::vector<Part> _parts;
+    };
+
+    struct Asset
+    {
+        std::string _mimeType;
+        std::string _content;
+        /// Empty when not smaller than _content.
+        std::string _gzip;
+        /// Only if built next to the file, as "<file>.br".
+        std::string _brotli;
+        std::string _etag;
+        Template _template;
+
+        /// The body to send to a client accepting acceptEncoding, setting
+        /// encoding to its Content-Encoding, empty if none.
+        const std::string& select(const std::string& acceptEncoding, std::string& encoding) const
+        {
+            if (!_brotli.empty() && accepts(acceptEncoding, "br"))
+            {
+                encoding = "br";
+                return _brotli;
+            }
+
+            if (!_gzip.empty() && accepts(acceptEncoding, "gzip"))
+            {
+                encoding = "gzip";
+                return _gzip;
+            }
+
+            encoding.clear();
+            return _content;
+        }
+
+        /// Each variant has its own, as their bytes differ.
+        std::string getETag(const std::string& encoding) const
+        {
+            return encoding.empty() ? _etag : _etag.substr(0, _etag.size() - 1) + '-' + encoding + '"';
+        }
+    };
+
+    AssetCache() :
+        _bytes(0),
+        _gzipBytes(0),
+        _hits(0),
+        _notModified(0),
+        _misses(0)
+    {
+    }
+
+    AssetCache(const AssetCache&) = delete;
+    AssetCache& operator=(const AssetCache&) = delete;
+
+    /// Reads the files under root + dir, keeping them by dir and their path
+    /// below it, as requested. Those larger than maxFileBytes are left out.
+    void load(const std::string& root, const std::string& dir, const size_t maxFileBytes)
+    {
+        scan(root, dir, maxFileBytes);
+    }
+
+    /// The asset at path, if loaded. They don't change after loading,
+    /// and are looked up without locking.
+    const Asset* find(const std::string& path)
+    {
+        const auto it = _assets.find(path);
+        if (it == _assets.end())
+        {
+            ++_misses;
+            return nullptr;
+        }
+
+        ++_hits;
+        return &it->second;
+    }
+
+    /// Whether the If-None-Match of a request matches etag.
+    bool isNotModified(const std::string& ifNoneMatch, const std::string& etag)
+    {
+        std::istringstream iss(ifNoneMatch);
+        std::string tag;
+        while (std::getline(iss, tag, ','))
+        {
+            tag = trim(tag);
+            if (tag.compare(0, 2, "W/") == 0)
+            {
+                // Only the strong ones are given out, but the comparison is weak.
+                tag = tag.substr(2);
+            }
+
+            if (tag == etag || tag == "*")
+            {
+                ++_notModified;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    size_t size() const { return _assets.size(); }
+
+    std::string getStats() const
+    {
+        std::ostringstream oss;
+        oss << "assets=" << _assets.size()
+            << " bytes=" << _bytes
+            << " gzip_bytes=" << _gzipBytes
+            << " hits=" << _hits
+            << " not_modified=" << _notModified
+            << " misses=" << _misses;
+        return oss.str();
+    }
+
+    static std::string getMimeType(const std::string& path)
+    {
+        const auto dot = path.find_last_of('.');
+        const std::string ext = (dot != std::string::npos ? path.substr(dot + 1) : std::string());
+        if (ext == "js")
+            return "application/javascript";
+        else if (ext == "css")
+            return "text/css";
+        else if (ext == "html")
+            return "text/html";
+        else if (ext == "svg")
+            return "image/svg+xml";
+        else if (ext == "json")
+            return "application/json";
+        else if (ext == "png")
+            return "image/png";
+        else if (ext == "gif")
+            return "image/gif";
+
+        return "text/plain";
+    }
+
+    /// Whether the Accept-Encoding header accepts coding, by name, not by a q of 0.
+    static bool accepts(const std::string& acceptEncoding, const std::string& coding)
+    {
+        std::istringstream iss(acceptEncoding);
+        std::string item;
+        while (std::getline(iss, item, ','))
+        {
+            const auto semicolon = item.find(';');
+            if (trim(item.substr(0, semicolon)) != coding)
+            {
+                continue;
+            }
+
+            if (semicolon == std::string::npos)
+            {
+                return true;
+            }
+
+            const auto q = item.find("q=", semicolon);
+            return q == std::string::npos || std::atof(item.c_str() + q + 2) > 0;
+        }
+
+        return false;
+    }
+
+private:
+    void scan(const std::string& root, const std::string& dir, const size_t maxFileBytes)
+    {
+        DIR* handle = opendir((root + dir).c_str());
+        if (!handle)
+        {
+            return;
+        }
+
+        while (struct dirent* entry = readdir(handle))
+        {
+            const std::string name = entry->d_name;
+            const std::string path = dir + '/' + name;
+            struct stat st;
+            if (name[0] == '.' || stat((root + path).c_str(), &st) != 0)
+            {
+                continue;
+            }
+
+            if (S_ISDIR(st.st_mode))
+            {
+                scan(root, path, maxFileBytes);
+            }
+            else if (S_ISREG(st.st_mode) && static_cast<size_t>(st.st_size) <= maxFileBytes &&
+                     !hasSuffix(name, ".br") && !hasSuffix(name, ".gz"))
+            {
+                add(root, path);
+            }
+        }
+
+        closedir(handle);
+    }
+
+    void add(const std::string& root, const std::string& path)
+    {
+        Asset asset;
+        if (!readFile(root + path, asset._content))
+        {
+            return;
+        }
+
+        asset._mimeType = getMimeType(path);
+        readFile(root + path + ".br", asset._brotli);
+
+        // The images are compressed already.
+        if (asset._mimeType.compare(0, 6, "image/") != 0 || asset._mimeType == "image/svg+xml")
+        {
+            asset._gzip = compress(asset._content);
+            if (asset._gzip.size() >= asset._content.size())
+            {
+                asset._gzip.clear();
+            }
+        }
+
+        Poco::SHA1Engine digestEngine;
+        digestEngine.update(asset._content.data(), asset._content.size());
+        asset._etag = '"' + Poco::DigestEngine::digestToHex(digestEngine.digest()) + '"';
+
+        if (asset._mimeType == "text/html")
+        {
+            asset._template = Template(asset._content);
+        }
+
+        _bytes += asset._content.size();
+        _gzipBytes += asset._gzip.size();
+        _assets[path] = std::move(asset);
+    }
+
+    static std::string compress(const std::string& data)
+    {
+        std::ostringstream oss;
+        Poco::DeflatingOutputStream deflater(oss, Poco::DeflatingStreamBuf::STREAM_GZIP, 9);
+        deflater.write(data.data(), data.size());
+        deflater.close();
+        return oss.str();
+    }
+
+    static bool readFile(const std::string& path, std::string& data)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+        {
+            return false;
+        }
+
+        std::ostringstream oss;
+        oss << file.rdbuf();
+        data = oss.str();
+        return !file.bad();
+    }
+
+    static bool hasSuffix(const std::string& s, const std::string& suffix)
+    {
+        return s.size() >= suffix.size() && s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    static std::string trim(const std::string& s)
+    {
+        const auto first = s.find_first_not_of(" \t");
+        if (first == std::string::npos)
+        {
+            return std::string();
+        }
+
+        return s.substr(first, s.find_last_not_of(" \t") - first + 1);
+    }
+
+private:
+    std::map<std::string, Asset> _assets;
+    size_t _bytes;
+    size_t _gzipBytes;
+    std::atomic<size_t> _hits;
+    std::atomic<size_t> _notModified;
+    std::atomic<size_t> _misses;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -11,10 +11,16 @@
 #include "config.h"
 
 #include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
 #include <string>
 
 #include <Poco/Base64Decoder.h>
 #include <Poco/Base64Encoder.h>
+#include <Poco/Crypto/DigestEngine.h>
 #include <Poco/Crypto/RSADigestEngine.h>
 #include <Poco/Crypto/RSAKey.h>
 #include <Poco/Dynamic/Var.h>
@@ -36,6 +42,69 @@ using Poco::Base64Decoder;
 using Poco::Base64Encoder;
 using Poco::OutputLineEndingConverter;
 
+namespace
+{
+    /// The tokens verified, by their cache key, with their expiry, for the
+    /// requests of the admin console, which send the same each time.
+    std::mutex VerifiedTokensMutex;
+    std::map<std::string, std::time_t> VerifiedTokens;
+    const size_t MaxVerifiedTokens = 64;
+
+    std::string getDigest(const std::string& data)
+    {
+        Poco::Crypto::DigestEngine engine("SHA256");
+        engine.update(data);
+        return Poco::DigestEngine::digestToHex(engine.digest());
+    }
+
+    /// A token is verified with a key, for an audience: it is only
+    /// found again for both, lest an agent trust another's tokens.
+    std::string getCacheKey(const std::string& keyDigest, const std::string& aud,
+                            const std::string& accessToken)
+    {
+        return getDigest(keyDigest + '\n' + aud + '\n' + accessToken);
+    }
+
+    bool findVerifiedToken(const std::string& cacheKey)
+    {
+        std::unique_lock<std::mutex> lock(VerifiedTokensMutex);
+        const auto it = VerifiedTokens.find(cacheKey);
+        if (it == VerifiedTokens.end())
+        {
+            return false;
+        }
+
+        if (Poco::Timestamp().epochTime() > it->second)
+        {
+            VerifiedTokens.erase(it);
+            return false;
+        }
+
+        return true;
+    }
+
+    void addVerifiedToken(const std::string& cacheKey, const std::time_t expiry)
+    {
+        std::unique_lock<std::mutex> lock(VerifiedTokensMutex);
+        if (VerifiedTokens.size() >= MaxVerifiedTokens)
+        {
+            // The one expiring first goes.
+            auto first = VerifiedTokens.begin();
+            for (auto it = VerifiedTokens.begin(); it != VerifiedTokens.end(); ++it)
+            {
+                if (it->second < first->second)
+                {
+                    first = it;
+                }
+            }
+
+            VerifiedTokens.erase(first);
+        }
+
+        VerifiedTokens[cacheKey] = expiry;
+    }
+}
+
 //////////////
 // JWTAuth Impl
 //////////////
@@ -92,8 +161,35 @@ const std::string JWTAuth::getAccessToken()
     return jwtToken;
 }
 
+std::string JWTAuth::getKeyDigest(const std::string& keyPath)
+{
+    // The file, not the key parsed from it, which is what the cache spares.
+    std::ifstream file(keyPath, std::ios::binary);
+    std::ostringstream ostr;
+    ostr << file.rdbuf();
+    return getDigest(ostr.str());
+}
+
+bool JWTAuth::isVerified(const std::string& keyPath, const std::string& aud,
+                         const std::string& accessToken)
+{
+    return findVerifiedToken(getCacheKey(getKeyDigest(keyPath), aud, accessToken));
+}
+
+void JWTAuth::clearVerified()
+{
+    std::unique_lock<std::mutex> lock(VerifiedTokensMutex);
+    VerifiedTokens.clear();
+}
+
 bool JWTAuth::verify(const std::string& accessToken)
 {
+    const std::string cacheKey = getCacheKey(_keyDigest, _aud, accessToken);
+    if (findVerifiedToken(cacheKey))
+    {
+        return true;
+    }
+
     Poco::StringTokenizer tokens(accessToken, ".", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
 
     try
@@ -143,6 +239,8 @@ bool JWTAuth::verify(const std::string& accessToken)
             Log::info("JWTAuth:verify: JWT expired; curtime:" + std::to_string(curtime) + ", exp:" + std::to_string(decodedExptime));
             return false;
         }
+
+        addVerifiedToken(cacheKey, decodedExptime);
     }
     catch(Poco::Exception& exc)
     {
@@ -36,14 +36,26 @@ public:
           _sub(sub),
           _aud(aud),
           _key(Poco::Crypto::RSAKey("", keyPath)),
-          _digestEngine(_key, "SHA256")
+          _digestEngine(_key, "SHA256"),
+          _keyDigest(getKeyDigest(keyPath))
     {    }
 
     const std::string getAccessToken() override;
 
     bool verify(const std::string& accessToken) override;
 
+    /// Whether the token was verified before with the key at keyPath, for
+    /// the audience aud, and hasn't expired, which neither needs the key
+    /// loaded nor its signature computed again.
+    static bool isVerified(const std::string& keyPath, const std::string& aud,
+                           const std::string& accessToken);
+
+    /// Forgets the tokens verified, for them to be verified again.
+    static void clearVerified();
+
 private:
+    static std::string getKeyDigest(const std::string& keyPath);
+
     const std::string createHeader();
 
     const std::string createPayload();
@@ -59,6 +71,7 @@ private:
 
     const Poco::Crypto::RSAKey _key;
     Poco::Crypto::RSADigestEngine _digestEngine;
+    const std::string _keyDigest;
 };
 
 class OAuth : public AuthBase
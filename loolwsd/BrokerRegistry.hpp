@@ -0,0 +1,199 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_BROKERREGISTRY_HPP
+#define INCLUDED_BROKERREGISTRY_HPP
+
+#include <array>
+#include <exception>
+#include <functional>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/// The brokers of the open documents, by docKey.
+/// The keys are spread over shards, each with its own lock, so that
+/// unrelated documents don't contend. A document being opened is
+/// registered up front, with a future that those asking for the same
+/// document meanwhile wait on, while others go ahead in parallel.
+template <typename T>
+class BrokerRegistry
+{
+public:
+    typedef std::shared_ptr<T> Ptr;
+    typedef std::function<Ptr()> Opener;
+
+    BrokerRegistry() = default;
+    BrokerRegistry(const BrokerRegistry&) = delete;
+    BrokerRegistry& operator=(const BrokerRegistry&) = delete;
+
+    /// Returns the broker of key, or nullptr if there is none
+    /// or it's still being opened.
+    Ptr find(const std::string& key)
+    {
+        Shard& shard = getShard(key);
+        std::unique_lock<std::mutex> lock(shard._mutex);
+        const auto it = shard._entries.find(key);
+        return (it != shard._entries.end() ? it->second._broker : nullptr);
+    }
+
+    /// Returns the broker of key, calling open() for one, without holding
+    /// any lock, if there is none. Meanwhile those asking for the same key
+    /// wait for it and get what open() returns or throws. Nothing is
+    /// registered if open() throws or returns nullptr.
+    /// opened tells whether this call is the one that opened it.
+    Ptr findOrOpen(const std::string& key, const Opener& open, bool& opened)
+    {
+        opened = false;
+        Shard& shard = getShard(key);
+        std::promise<Ptr> promise;
+        {
+            std::unique_lock<std::mutex> lock(shard._mutex);
+            auto it = shard._entries.find(key);
+            if (it != shard._entries.end())
+            {
+                if (it->second._broker)
+                {
+                    return it->second._broker;
+                }
+
+                // Being opened, wait outside of the lock.
+                auto opening = it->second._opening;
+                lock.unlock();
+                return opening.get();
+            }
+
+            Entry entry;
+            entry._opening = promise.get_future().share();
+            shard._entries.emplace(key, entry);
+        }
+
+        Ptr broker;
+        try
+        {
+            broker = open();
+        }
+        catch (...)
+        {
+            {
+                std::unique_lock<std::mutex> lock(shard._mutex);
+                shard._entries.erase(key);
+            }
+
+            promise.set_exception(std::current_exception());
+            throw;
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(shard._mutex);
+            if (broker)
+            {
+                shard._entries[key]._broker = broker;
+            }
+            else
+            {
+                shard._entries.erase(key);
+            }
+        }
+
+        promise.set_value(broker);
+        opened = (broker != nullptr);
+        return broker;
+    }
+
+    /// Registers the broker, unless key is taken already.
+    bool insert(const std::string& key, const Ptr& broker)
+    {
+        Shard& shard = getShard(key);
+        std::unique_lock<std::mutex> lock(shard._mutex);
+        Entry entry;
+        entry._broker = broker;
+        return shard._entries.emplace(key, entry).second;
+    }
+
+    /// Unregisters key, only if it still has this broker: it may have gone
+    /// and been replaced by a new one meanwhile.
+    bool erase(const std::string& key, const Ptr& broker)
+    {
+        Shard& shard = getShard(key);
+        std::unique_lock<std::mutex> lock(shard._mutex);
+        const auto it = shard._entries.find(key);
+        if (it != shard._entries.end() && it->second._broker == broker)
+        {
+            shard._entries.erase(it);
+            return true;
+        }
+
+        return false;
+    }
+
+    /// Returns the brokers open at the time, to iterate without locking.
+    std::vector<Ptr> getAll()
+    {
+        std::vector<Ptr> brokers;
+        for (auto& shard : _shards)
+        {
+            std::unique_lock<std::mutex> lock(shard._mutex);
+            for (const auto& pair : shard._entries)
+            {
+                if (pair.second._broker)
+                {
+                    brokers.push_back(pair.second._broker);
+                }
+            }
+        }
+
+        return brokers;
+    }
+
+    /// Counts those being opened too.
+    size_t size()
+    {
+        size_t count = 0;
+        for (auto& shard : _shards)
+        {
+            std::unique_lock<std::mutex> lock(shard._mutex);
+            count += shard._entries.size();
+        }
+
+        return count;
+    }
+
+    bool empty() { return size() == 0; }
+
+private:
+    struct Entry
+    {
+        /// Set once opened.
+        Ptr _broker;
+        std::shared_future<Ptr> _opening;
+    };
+
+    struct Shard
+    {
+        std::mutex _mutex;
+        std::map<std::string, Entry> _entries;
+    };
+
+    Shard& getShard(const std::string& key)
+    {
+        return _shards[std::hash<std::string>()(key) % ShardCount];
+    }
+
+private:
+    static constexpr size_t ShardCount = 16;
+    std::array<Shard, ShardCount> _shards;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
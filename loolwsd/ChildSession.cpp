@@ -10,8 +10,13 @@
 #include "ChildSession.hpp"
 #include "config.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <set>
 #include <thread>
+#include <vector>
 
 #include <Poco/Exception.h>
 #include <Poco/JSON/Object.h>
@@ -24,6 +29,7 @@
 #include <Poco/StringTokenizer.h>
 #include <Poco/URI.h>
 
+#include "Command.hpp"
 #include "Common.hpp"
 #include "LOKitHelper.hpp"
 #include "LOOLProtocol.hpp"
@@ -65,28 +71,41 @@ public:
 class CallbackWorker: public Runnable
 {
 public:
-    CallbackWorker(NotificationQueue& queue, ChildSession& session):
+    CallbackWorker(NotificationQueue& queue, ChildSession& session, const unsigned coalesceMs):
         _queue(queue),
         _session(session),
-        _stop(false)
+        _coalesceMs(coalesceMs),
+        _stop(false),
+        _superseded(0)
     {
     }
 
+    /// Whether the callback reports a state, of which only the latest matters.
+    static bool isStateCallback(const int nType)
+    {
+        return (nType == LOK_CALLBACK_INVALIDATE_VISIBLE_CURSOR ||
+                nType == LOK_CALLBACK_CURSOR_VISIBLE ||
+                nType == LOK_CALLBACK_CELL_CURSOR ||
+                nType == LOK_CALLBACK_CELL_FORMULA ||
+                nType == LOK_CALLBACK_GRAPHIC_SELECTION ||
+                nType == LOK_CALLBACK_TEXT_SELECTION ||
+                nType == LOK_CALLBACK_TEXT_SELECTION_START ||
+                nType == LOK_CALLBACK_TEXT_SELECTION_END ||
+                nType == LOK_CALLBACK_DOCUMENT_SIZE_CHANGED);
+    }
+
     void callback(const int nType, const std::string& rPayload)
     {
         auto lock = _session.getLock();
 
+        // Including those that came while this one was queued.
+        const auto invalidations = (nType == LOK_CALLBACK_INVALIDATE_TILES
+                                    ? _session.takeInvalidations()
+                                    : std::vector<std::string>());
+
         // Cache important notifications to replay them when our client
         // goes inactive and loses them.
-        if (nType == LOK_CALLBACK_INVALIDATE_VISIBLE_CURSOR ||
-            nType == LOK_CALLBACK_CURSOR_VISIBLE ||
-            nType == LOK_CALLBACK_CELL_CURSOR ||
-            nType == LOK_CALLBACK_CELL_FORMULA ||
-            nType == LOK_CALLBACK_GRAPHIC_SELECTION ||
-            nType == LOK_CALLBACK_TEXT_SELECTION ||
-            nType == LOK_CALLBACK_TEXT_SELECTION_START ||
-            nType == LOK_CALLBACK_TEXT_SELECTION_END ||
-            nType == LOK_CALLBACK_DOCUMENT_SIZE_CHANGED)
+        if (isStateCallback(nType))
         {
             _session.setDocState(nType, rPayload);
         }
@@ -132,37 +151,53 @@ public:
                                    ? 0
                                    : lokitDoc->pClass->getPart(lokitDoc);
 
-                StringTokenizer tokens(rPayload, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
-                if (tokens.count() == 4)
+                // All in one message, for wsd to invalidate its cache once,
+                // and render again at once what the clients show of them.
+                std::string message;
+                for (const auto& invalidation : invalidations)
                 {
-                    int x, y, width, height;
-                    try
+                    if (!message.empty())
                     {
-                        x = std::stoi(tokens[0]);
-                        y = std::stoi(tokens[1]);
-                        width = std::stoi(tokens[2]);
-                        height = std::stoi(tokens[3]);
+                        message += '\n';
                     }
-                    catch (const std::out_of_range&)
+
+                    StringTokenizer tokens(invalidation, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+                    if (tokens.count() == 4)
                     {
-                        // something went wrong, invalidate everything
-                        Log::warn("Ignoring integer values out of range: " + rPayload);
-                        x = 0;
-                        y = 0;
-                        width = INT_MAX;
-                        height = INT_MAX;
+                        int x, y, width, height;
+                        try
+                        {
+                            x = std::stoi(tokens[0]);
+                            y = std::stoi(tokens[1]);
+                            width = std::stoi(tokens[2]);
+                            height = std::stoi(tokens[3]);
+                        }
+                        catch (const std::out_of_range&)
+                        {
+                            // something went wrong, invalidate everything
+                            Log::warn("Ignoring integer values out of range: " + invalidation);
+                            x = 0;
+                            y = 0;
+                            width = INT_MAX;
+                            height = INT_MAX;
+                        }
+
+                        message += "invalidatetiles:"
+                                   " part=" + std::to_string(curPart) +
+                                   " x=" + std::to_string(x) +
+                                   " y=" + std::to_string(y) +
+                                   " width=" + std::to_string(width) +
+                                   " height=" + std::to_string(height);
+                    }
+                    else
+                    {
+                        message += "invalidatetiles: " + invalidation;
                     }
-
-                    _session.sendTextFrame("invalidatetiles:"
-                                           " part=" + std::to_string(curPart) +
-                                           " x=" + std::to_string(x) +
-                                           " y=" + std::to_string(y) +
-                                           " width=" + std::to_string(width) +
-                                           " height=" + std::to_string(height));
                 }
-                else
+
+                if (!message.empty())
                 {
-                    _session.sendTextFrame("invalidatetiles: " + rPayload);
+                    _session.sendTextFrame(message);
                 }
             }
             break;
@@ -249,32 +284,44 @@ public:
         while (!_stop && !TerminationFlag)
         {
             Notification::Ptr aNotification(_queue.waitDequeueNotification());
-            if (!_stop && !TerminationFlag && aNotification)
+            if (_stop || TerminationFlag || !aNotification)
             {
-                CallbackNotification::Ptr aCallbackNotification = aNotification.cast<CallbackNotification>();
-                assert(aCallbackNotification);
+                break;
+            }
 
-                const auto nType = aCallbackNotification->_nType;
-                try
-                {
-                    callback(nType, aCallbackNotification->_aPayload);
-                }
-                catch (const Exception& exc)
+            std::vector<CallbackNotification::Ptr> batch;
+            batch.push_back(aNotification.cast<CallbackNotification>());
+            assert(batch.back());
+            collect(batch);
+            if (_stop || TerminationFlag)
+            {
+                break;
+            }
+
+            // Skip the states that a later callback of the batch replaces.
+            std::vector<bool> superseded(batch.size(), false);
+            std::set<int> latest;
+            for (size_t i = batch.size(); i-- > 0; )
+            {
+                const int nType = batch[i]->_nType;
+                if (isStateCallback(nType) && !latest.insert(nType).second)
                 {
-                    Log::error() << "CallbackWorker::run: Exception while handling callback [" << LOKitHelper::kitCallbackTypeToString(nType) << "]: "
-                                 << exc.displayText()
-                                 << (exc.nested() ? " (" + exc.nested()->displayText() + ")" : "")
-                                 << Log::end;
+                    superseded[i] = true;
+                    ++_superseded;
                 }
-                catch (const std::exception& exc)
+            }
+
+            for (size_t i = 0; i < batch.size(); ++i)
+            {
+                if (!superseded[i])
                 {
-                    Log::error("CallbackWorker::run: Exception while handling callback [" + LOKitHelper::kitCallbackTypeToString(nType) + "]: " + exc.what());
+                    dispatch(batch[i]->_nType, batch[i]->_aPayload);
                 }
             }
-            else
-                break;
         }
 
+        Log::debug() << "STATISTICS: skipped " << _superseded << " superseded callbacks in "
+                     << _session.getName() << "." << Log::end;
         Log::debug("Thread finished.");
     }
 
@@ -285,16 +332,73 @@ public:
     }
 
 private:
+    /// Adds the callbacks already queued, and those coming within the
+    /// coalescing window, to the batch.
+    void collect(std::vector<CallbackNotification::Ptr>& batch)
+    {
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(_coalesceMs);
+        while (!_stop && batch.size() < MaxBatchSize)
+        {
+            Notification::Ptr aNotification(_queue.dequeueNotification());
+            if (!aNotification)
+            {
+                const auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                           deadline - std::chrono::steady_clock::now()).count();
+                if (remaining <= 0)
+                {
+                    break;
+                }
+
+                aNotification = _queue.waitDequeueNotification(remaining);
+                if (!aNotification)
+                {
+                    break;
+                }
+            }
+
+            CallbackNotification::Ptr aCallbackNotification = aNotification.cast<CallbackNotification>();
+            assert(aCallbackNotification);
+            batch.push_back(aCallbackNotification);
+        }
+    }
+
+    void dispatch(const int nType, const std::string& rPayload)
+    {
+        try
+        {
+            callback(nType, rPayload);
+        }
+        catch (const Exception& exc)
+        {
+            Log::error() << "CallbackWorker::run: Exception while handling callback [" << LOKitHelper::kitCallbackTypeToString(nType) << "]: "
+                         << exc.displayText()
+                         << (exc.nested() ? " (" + exc.nested()->displayText() + ")" : "")
+                         << Log::end;
+        }
+        catch (const std::exception& exc)
+        {
+            Log::error("CallbackWorker::run: Exception while handling callback [" + LOKitHelper::kitCallbackTypeToString(nType) + "]: " + exc.what());
+        }
+    }
+
+    /// Bounds the latency of the first callback of a burst.
+    static constexpr size_t MaxBatchSize = 256;
+
     NotificationQueue& _queue;
     ChildSession& _session;
+    const unsigned _coalesceMs;
     volatile bool _stop;
+    size_t _superseded;
 };
 
+constexpr size_t CallbackWorker::MaxBatchSize;
+
 std::recursive_mutex ChildSession::Mutex;
 
 ChildSession::ChildSession(const std::string& id,
                            std::shared_ptr<WebSocket> ws,
                            const std::string& jailId,
+                           const unsigned callbackCoalesceMs,
                            OnLoadCallback onLoad,
                            OnUnloadCallback onUnload) :
     LOOLSession(id, Kind::ToMaster, ws),
@@ -303,7 +407,9 @@ ChildSession::ChildSession(const std::string& id,
     _viewId(0),
     _onLoad(onLoad),
     _onUnload(onUnload),
-    _callbackWorker(new CallbackWorker(_callbackQueue, *this))
+    _callbackWorker(new CallbackWorker(_callbackQueue, *this, callbackCoalesceMs)),
+    _invalidateAll(false),
+    _coalescedInvalidations(0)
 {
     Log::info("ChildSession ctor [" + getName() + "].");
 
@@ -319,6 +425,9 @@ ChildSession::~ChildSession()
     // Wait for the callback worker to finish.
     _callbackWorker->stop();
     _callbackThread.join();
+
+    Log::debug() << "STATISTICS: coalesced " << _coalescedInvalidations
+                 << " tile invalidations in " << getName() << "." << Log::end;
 }
 
 void ChildSession::disconnect()
@@ -341,7 +450,8 @@ bool ChildSession::_handleInput(const char *buffer, int length)
     const std::string firstLine = getFirstLine(buffer, length);
     StringTokenizer tokens(firstLine, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
 
-    if (tokens.count() > 0 && tokens[0] == "useractive" && _loKitDocument != nullptr)
+    const Command command = getCommand(buffer, length);
+    if (command == Command::UserActive && _loKitDocument != nullptr)
     {
         Log::debug("Handling message after inactivity of " + std::to_string(getInactivityMS()) + "ms.");
 
@@ -393,33 +503,27 @@ bool ChildSession::_handleInput(const char *buffer, int length)
         }
     }
 
-    if (LOOLProtocol::tokenIndicatesUserInteraction(tokens[0]))
+    if (isUserInteraction(command))
     {
         // Keep track of timestamps of incoming client messages that indicate user activity.
         updateLastActivityTime();
     }
 
-    if (tokens[0] == "dummymsg")
+    // Those handled whether a document is loaded or not.
+    switch (command)
     {
+    case Command::DummyMsg:
         // Just to update the activity of a view-only client.
         return true;
-    }
-    else if (tokens[0] == "canceltiles")
-    {
+    case Command::CancelTiles:
         // This command makes sense only on the command queue level.
         // Shouldn't get this here.
         return true;
-    }
-    else if (tokens[0] == "commandvalues")
-    {
+    case Command::CommandValues:
         return getCommandValues(buffer, length, tokens);
-    }
-    else if (tokens[0] == "partpagerectangles")
-    {
+    case Command::PartPageRectangles:
         return getPartPageRectangles(buffer, length);
-    }
-    else if (tokens[0] == "load")
-    {
+    case Command::Load:
         if (_isDocLoaded)
         {
             sendTextFrame("error: cmd=load kind=docalreadyloaded");
@@ -433,12 +537,15 @@ bool ChildSession::_handleInput(const char *buffer, int length)
         }
 
         return _isDocLoaded;
+    default:
+        break;
     }
-    else if (!_isDocLoaded)
+
+    if (!_isDocLoaded)
     {
         // Be forgiving to these messages while we load.
-        if (tokens[0] == "useractive" ||
-            tokens[0] == "userinactive")
+        if (command == Command::UserActive ||
+            command == Command::UserInactive)
         {
             return true;
         }
@@ -446,128 +553,71 @@ bool ChildSession::_handleInput(const char *buffer, int length)
         sendTextFrame("error: cmd=" + tokens[0] + " kind=nodocloaded");
         return false;
     }
-    else if (tokens[0] == "renderfont")
+
+    switch (command)
     {
+    case Command::RenderFont:
         sendFontRendering(buffer, length, tokens);
-    }
-    else if (tokens[0] == "setclientpart")
-    {
+        break;
+    case Command::SetClientPart:
         return setClientPart(buffer, length, tokens);
-    }
-    else if (tokens[0] == "setpage")
-    {
+    case Command::SetPage:
         return setPage(buffer, length, tokens);
-    }
-    else if (tokens[0] == "status")
-    {
+    case Command::Status:
         return getStatus(buffer, length);
-    }
-    else if (tokens[0] == "tile" || tokens[0] == "tilecombine")
-    {
+    case Command::Tile:
+    case Command::TileCombine:
         assert(!"Tile traffic should go through the DocumentBroker-LoKit WS.");
-    }
-    else
-    {
-        // All other commands are such that they always require a LibreOfficeKitDocument session,
-        // i.e. need to be handled in a child process.
-
-        assert(tokens[0] == "clientzoom" ||
-               tokens[0] == "clientvisiblearea" ||
-               tokens[0] == "downloadas" ||
-               tokens[0] == "getchildid" ||
-               tokens[0] == "gettextselection" ||
-               tokens[0] == "paste" ||
-               tokens[0] == "insertfile" ||
-               tokens[0] == "key" ||
-               tokens[0] == "mouse" ||
-               tokens[0] == "uno" ||
-               tokens[0] == "selecttext" ||
-               tokens[0] == "selectgraphic" ||
-               tokens[0] == "resetselection" ||
-               tokens[0] == "saveas" ||
-               tokens[0] == "useractive" ||
-               tokens[0] == "userinactive" ||
-               tokens[0] == "editlock:");
-
-        if (tokens[0] == "clientzoom")
-        {
-            return clientZoom(buffer, length, tokens);
-        }
-        else if (tokens[0] == "clientvisiblearea")
-        {
-            return clientVisibleArea(buffer, length, tokens);
-        }
-        else if (tokens[0] == "downloadas")
-        {
-            return downloadAs(buffer, length, tokens);
-        }
-        else if (tokens[0] == "getchildid")
-        {
-            return getChildId();
-        }
-        else if (tokens[0] == "gettextselection")
-        {
-            return getTextSelection(buffer, length, tokens);
-        }
-        else if (tokens[0] == "paste")
-        {
-            return paste(buffer, length, tokens);
-        }
-        else if (tokens[0] == "insertfile")
-        {
-            return insertFile(buffer, length, tokens);
-        }
-        else if (tokens[0] == "key")
-        {
-            return keyEvent(buffer, length, tokens);
-        }
-        else if (tokens[0] == "mouse")
-        {
-            return mouseEvent(buffer, length, tokens);
-        }
-        else if (tokens[0] == "uno")
-        {
-            return unoCommand(buffer, length, tokens);
-        }
-        else if (tokens[0] == "selecttext")
-        {
-            return selectText(buffer, length, tokens);
-        }
-        else if (tokens[0] == "selectgraphic")
-        {
-            return selectGraphic(buffer, length, tokens);
-        }
-        else if (tokens[0] == "resetselection")
-        {
-            return resetSelection(buffer, length, tokens);
-        }
-        else if (tokens[0] == "saveas")
-        {
-            return saveAs(buffer, length, tokens);
-        }
-        else if (tokens[0] == "useractive")
-        {
-            setIsActive(true);
-        }
-        else if (tokens[0] == "userinactive")
-        {
-            setIsActive(false);
-        }
-        else if (tokens[0] == "editlock:")
-        {
-            // Nothing for us to do but to let the
-            // client know about the edit lock state.
-            // Yes, this is echoed back because it's better
-            // to do this on each child's queue and thread
-            // than for WSD to potentially stall while notifying
-            // each client with the edit lock state.
-            Log::trace("Echoing back [" + firstLine + "].");
-            return sendTextFrame(firstLine);
-        }
-        else
-        {
-            assert(!"Unknown command token.");
-        }
+        break;
+
+    // All other commands are such that they always require a LibreOfficeKitDocument session,
+    // i.e. need to be handled in a child process.
+    case Command::ClientZoom:
+        return clientZoom(buffer, length, tokens);
+    case Command::ClientVisibleArea:
+        return clientVisibleArea(buffer, length, tokens);
+    case Command::DownloadAs:
+        return downloadAs(buffer, length, tokens);
+    case Command::GetChildId:
+        return getChildId();
+    case Command::GetTextSelection:
+        return getTextSelection(buffer, length, tokens);
+    case Command::Paste:
+        return paste(buffer, length, tokens);
+    case Command::InsertFile:
+        return insertFile(buffer, length, tokens);
+    case Command::Key:
+        return keyEvent(buffer, length, tokens);
+    case Command::Mouse:
+        return mouseEvent(buffer, length, tokens);
+    case Command::Uno:
+        return unoCommand(buffer, length, tokens);
+    case Command::SelectText:
+        return selectText(buffer, length, tokens);
+    case Command::SelectGraphic:
+        return selectGraphic(buffer, length, tokens);
+    case Command::ResetSelection:
+        return resetSelection(buffer, length, tokens);
+    case Command::SaveAs:
+        return saveAs(buffer, length, tokens);
+    case Command::UserActive:
+        setIsActive(true);
+        break;
+    case Command::UserInactive:
+        setIsActive(false);
+        break;
+    case Command::EditLockMessage:
+        // Nothing for us to do but to let the
+        // client know about the edit lock state.
+        // Yes, this is echoed back because it's better
+        // to do this on each child's queue and thread
+        // than for WSD to potentially stall while notifying
+        // each client with the edit lock state.
+        Log::trace("Echoing back [" + firstLine + "].");
+        return sendTextFrame(firstLine);
+    default:
+        assert(!"Unknown command token.");
+        break;
     }
 
     return true;
@@ -697,8 +747,9 @@ bool ChildSession::getCommandValues(const char* /*buffer*/, int /*length*/, Stri
     if (_multiView)
         _loKitDocument->setView(_viewId);
 
+    // Streamed, the lists of some commands being large.
     char* ptrValues = _loKitDocument->getCommandValues(command.c_str());
-    bool success = sendTextFrame("commandvalues: " + std::string(ptrValues));
+    bool success = sendTextFrame("commandvalues: ", ptrValues, std::strlen(ptrValues));
     std::free(ptrValues);
     return success;
 }
@@ -824,9 +875,10 @@ bool ChildSession::getTextSelection(const char* /*buffer*/, int /*length*/, Stri
     if (_multiView)
         _loKitDocument->setView(_viewId);
 
+    // Streamed, the selection being of any size.
     char *textSelection = _loKitDocument->getTextSelection(mimeType.c_str(), nullptr);
 
-    sendTextFrame("textselectioncontent: " + std::string(textSelection));
+    sendTextFrame("textselectioncontent: ", textSelection, std::strlen(textSelection));
 
     free(textSelection);
     return true;
@@ -1159,8 +1211,124 @@ bool ChildSession::setPage(const char* /*buffer*/, int /*length*/, StringTokeniz
     return true;
 }
 
+namespace
+{
+    /// Parses the "x, y, width, height" of a tile invalidation.
+    bool parseInvalidation(const std::string& payload, int64_t& left, int64_t& top, int64_t& right, int64_t& bottom)
+    {
+        StringTokenizer tokens(payload, " ,", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+        if (tokens.count() != 4)
+        {
+            return false;
+        }
+
+        try
+        {
+            left = std::stoll(tokens[0]);
+            top = std::stoll(tokens[1]);
+            right = left + std::stoll(tokens[2]);
+            bottom = top + std::stoll(tokens[3]);
+        }
+        catch (const std::exception&)
+        {
+            return false;
+        }
+
+        return true;
+    }
+
+    /// Sets merged to the bounds of the two invalidations, if they overlap.
+    bool mergeInvalidations(const std::string& first, const std::string& second, std::string& merged)
+    {
+        int64_t left, top, right, bottom;
+        int64_t secondLeft, secondTop, secondRight, secondBottom;
+        if (!parseInvalidation(first, left, top, right, bottom) ||
+            !parseInvalidation(second, secondLeft, secondTop, secondRight, secondBottom))
+        {
+            return false;
+        }
+
+        const bool overlap = (left < secondRight && secondLeft < right &&
+                              top < secondBottom && secondTop < bottom);
+        const bool contains = (left <= secondLeft && top <= secondTop &&
+                               right >= secondRight && bottom >= secondBottom);
+        const bool contained = (secondLeft <= left && secondTop <= top &&
+                                secondRight >= right && secondBottom >= bottom);
+        if (!overlap && !contains && !contained)
+        {
+            return false;
+        }
+
+        left = std::min(left, secondLeft);
+        top = std::min(top, secondTop);
+        right = std::max(right, secondRight);
+        bottom = std::max(bottom, secondBottom);
+        merged = std::to_string(left) + ", " + std::to_string(top) + ", " +
+                 std::to_string(right - left) + ", " + std::to_string(bottom - top);
+        return true;
+    }
+}
+
+bool ChildSession::coalesceInvalidation(const std::string& payload)
+{
+    std::unique_lock<std::mutex> lock(_invalidationsMutex);
+
+    const bool queued = !_invalidations.empty();
+    if (payload.compare(0, 5, "EMPTY") == 0)
+    {
+        // The whole document, nothing else matters.
+        _invalidations.assign(1, payload);
+        _invalidateAll = true;
+    }
+    else if (!_invalidateAll)
+    {
+        // Grow it by the pending ones it overlaps, until none does.
+        std::string merged = payload;
+        for (bool grown = true; grown; )
+        {
+            grown = false;
+            for (auto it = _invalidations.begin(); it != _invalidations.end(); ++it)
+            {
+                std::string bounds;
+                if (mergeInvalidations(*it, merged, bounds))
+                {
+                    merged = bounds;
+                    _invalidations.erase(it);
+                    grown = true;
+                    break;
+                }
+            }
+        }
+
+        _invalidations.push_back(merged);
+    }
+
+    if (queued)
+    {
+        ++_coalescedInvalidations;
+    }
+
+    return queued;
+}
+
+std::vector<std::string> ChildSession::takeInvalidations()
+{
+    std::unique_lock<std::mutex> lock(_invalidationsMutex);
+
+    std::vector<std::string> invalidations;
+    invalidations.swap(_invalidations);
+    _invalidateAll = false;
+    return invalidations;
+}
+
 void ChildSession::loKitCallback(const int nType, const char *pPayload)
 {
+    if (nType == LOK_CALLBACK_INVALIDATE_TILES && coalesceInvalidation(pPayload ? pPayload : "(nil)"))
+    {
+        // Sent with the one already queued.
+        return;
+    }
+
     auto pNotif = new CallbackNotification(nType, pPayload ? pPayload : "(nil)");
     _callbackQueue.enqueueNotification(pNotif);
 }
@@ -11,6 +11,8 @@
 #define INCLUDED_CHILDSESSION_HPP
 
 #include <mutex>
+#include <string>
+#include <vector>
 
 #include <Poco/Thread.h>
 #include <Poco/NotificationQueue.h>
@@ -33,9 +35,12 @@ public:
     ///                 a new view) or nullptr (when first view).
     /// jailId The JailID of the jail root directory,
     //         used by downloadas to construct jailed path.
+    /// callbackCoalesceMs How long to wait for more LOK callbacks, to send
+    ///                    only the latest states and merged invalidations.
     ChildSession(const std::string& id,
                  std::shared_ptr<Poco::Net::WebSocket> ws,
                  const std::string& jailId,
+                 const unsigned callbackCoalesceMs,
                  OnLoadCallback onLoad,
                  OnUnloadCallback onUnload);
     virtual ~ChildSession();
@@ -56,6 +61,14 @@ public:
 
     void setDocState(const int type, const std::string& payload) { _lastDocStates[type] = payload; }
 
+    /// Merges a tile invalidation into those waiting for the callback worker,
+    /// overlapping ones into their bounds.
+    /// Returns true when one is already queued, which will send this one too.
+    bool coalesceInvalidation(const std::string& payload);
+
+    /// Takes the invalidations to send, as LOK_CALLBACK_INVALIDATE_TILES payloads.
+    std::vector<std::string> takeInvalidations();
+
  protected:
     bool loadDocument(const char *buffer, int length, Poco::StringTokenizer& tokens);
 
@@ -98,6 +111,13 @@ private:
     Poco::Thread _callbackThread;
     Poco::NotificationQueue _callbackQueue;
 
+    /// Invalidations not yet sent, none overlapping another.
+    std::mutex _invalidationsMutex;
+    std::vector<std::string> _invalidations;
+    /// Whether _invalidations holds a whole-document one.
+    bool _invalidateAll;
+    size_t _coalescedInvalidations;
+
     /// Synchronize _loKitDocument acess.
     /// This should be owned by Document.
     static std::recursive_mutex Mutex;
@@ -18,7 +18,9 @@
 #include <Poco/URI.h>
 #include <Poco/URIStreamOpener.h>
 
+#include "Command.hpp"
 #include "Common.hpp"
+#include "FontCache.hpp"
 #include "IoUtil.hpp"
 #include "LOOLProtocol.hpp"
 #include "LOOLSession.hpp"
@@ -26,8 +28,10 @@
 #include "Log.hpp"
 #include "PrisonerSession.hpp"
 #include "Rectangle.hpp"
+#include "Startup.hpp"
 #include "Storage.hpp"
 #include "TileCache.hpp"
+#include "Trace.hpp"
 #include "Util.hpp"
 
 using namespace LOOLProtocol;
@@ -43,9 +47,13 @@ ClientSession::ClientSession(const std::string& id,
     _queue(queue),
     _haveEditLock(std::getenv("LOK_VIEW_CALLBACK")),
     _loadFailed(false),
-    _loadPart(-1)
+    _loadPart(-1),
+    _clientMinorVersion(0)
 {
     Log::info("ClientSession ctor [" + getName() + "].");
+
+    // Over SSL, the frames go through Poco, to be encrypted.
+    _gatherFrames = !LOOLWSD::SSLEnabled;
 }
 
 ClientSession::~ClientSession()
@@ -62,65 +70,53 @@ bool ClientSession::_handleInput(const char *buffer, int length)
     StringTokenizer tokens(firstLine, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
     Log::trace(getName() + ": handling [" + firstLine + "].");
 
-    if (LOOLProtocol::tokenIndicatesUserInteraction(tokens[0]))
+    const Command command = getCommand(buffer, length);
+    countCommand(command);
+    if (isUserInteraction(command))
     {
         // Keep track of timestamps of incoming client messages that indicate user activity.
         updateLastActivityTime();
     }
 
-    if (tokens[0] == "loolclient")
+    if (command == Command::LoolClient)
     {
         const auto versionTuple = ParseVersion(tokens[1]);
         if (std::get<0>(versionTuple) != ProtocolMajorVersionNumber ||
-            std::get<1>(versionTuple) != ProtocolMinorVersionNumber)
+            std::get<1>(versionTuple) < 0 ||
+            static_cast<unsigned>(std::get<1>(versionTuple)) > ProtocolMinorVersionNumber)
         {
             sendTextFrame("error: cmd=loolclient kind=badversion");
             return false;
         }
 
+        _clientMinorVersion = std::get<1>(versionTuple);
+        _announceLargeFrames = (_clientMinorVersion < static_cast<int>(ProtocolLargeFramesMinorVersionNumber));
+
         return sendTextFrame("loolserver " + GetProtocolVersion());
     }
 
-    if (tokens[0] == "takeedit")
+    if (command == Command::TakeEdit)
     {
+        if (!_docBroker->resume())
+        {
+            return false;
+        }
+
         _docBroker->takeEditLock(getId());
         return true;
     }
-    else if (tokens[0] == "load")
+    else if (command == Command::Load)
     {
         if (_docURL != "")
         {
             sendTextFrame("error: cmd=load kind=docalreadyloaded");
             return false;
         }
+
+        Startup::record(Startup::Phase::LoadRequest);
         return loadDocument(buffer, length, tokens);
     }
-    else if (tokens[0] != "canceltiles" &&
-             tokens[0] != "clientzoom" &&
-             tokens[0] != "clientvisiblearea" &&
-             tokens[0] != "commandvalues" &&
-             tokens[0] != "downloadas" &&
-             tokens[0] != "getchildid" &&
-             tokens[0] != "gettextselection" &&
-             tokens[0] != "paste" &&
-             tokens[0] != "insertfile" &&
-             tokens[0] != "key" &&
-             tokens[0] != "mouse" &&
-             tokens[0] != "partpagerectangles" &&
-             tokens[0] != "renderfont" &&
-             tokens[0] != "requestloksession" &&
-             tokens[0] != "resetselection" &&
-             tokens[0] != "saveas" &&
-             tokens[0] != "selectgraphic" &&
-             tokens[0] != "selecttext" &&
-             tokens[0] != "setclientpart" &&
-             tokens[0] != "setpage" &&
-             tokens[0] != "status" &&
-             tokens[0] != "tile" &&
-             tokens[0] != "tilecombine" &&
-             tokens[0] != "uno" &&
-             tokens[0] != "useractive" &&
-             tokens[0] != "userinactive")
+    else if (!isClientCommand(command))
     {
         sendTextFrame("error: cmd=" + tokens[0] + " kind=unknown");
         return false;
@@ -130,34 +126,33 @@ bool ClientSession::_handleInput(const char *buffer, int length)
         sendTextFrame("error: cmd=" + tokens[0] + " kind=nodocloaded");
         return false;
     }
-    else if (tokens[0] == "canceltiles")
+    else if (command == Command::CancelTiles)
     {
-        if (!_peer.expired())
-        {
-            return forwardToPeer(_peer, buffer, length);
-        }
+        // Those still queued here are gone already, see BasicTileQueue.
+        _docBroker->cancelTileRequests(shared_from_this(), [](const TileDesc&) { return true; });
+        return true;
     }
-    else if (tokens[0] == "commandvalues")
+    else if (command == Command::CommandValues)
     {
         return getCommandValues(buffer, length, tokens);
     }
-    else if (tokens[0] == "partpagerectangles")
+    else if (command == Command::PartPageRectangles)
     {
         return getPartPageRectangles(buffer, length);
     }
-    else if (tokens[0] == "renderfont")
+    else if (command == Command::RenderFont)
     {
         return sendFontRendering(buffer, length, tokens);
     }
-    else if (tokens[0] == "status")
+    else if (command == Command::Status)
     {
         return getStatus(buffer, length);
     }
-    else if (tokens[0] == "tile")
+    else if (command == Command::Tile)
     {
         return sendTile(buffer, length, tokens);
     }
-    else if (tokens[0] == "tilecombine")
+    else if (command == Command::TileCombine)
     {
         return sendCombinedTiles(buffer, length, tokens);
     }
@@ -166,6 +161,54 @@ bool ClientSession::_handleInput(const char *buffer, int length)
         // All other commands are such that they always require a
         // LibreOfficeKitDocument session, i.e. need to be handled in
         // a child process.
+        int tilePixelWidth, tilePixelHeight, tileTwipWidth, tileTwipHeight;
+        if (command == Command::ClientZoom && tokens.count() == 5 &&
+            getTokenInteger(tokens[1], "tilepixelwidth", tilePixelWidth) &&
+            getTokenInteger(tokens[2], "tilepixelheight", tilePixelHeight) &&
+            getTokenInteger(tokens[3], "tiletwipwidth", tileTwipWidth) &&
+            getTokenInteger(tokens[4], "tiletwipheight", tileTwipHeight))
+        {
+            // The tiles of the previous zoom no longer show.
+            _docBroker->cancelTileRequests(shared_from_this(),
+                [=](const TileDesc& tile)
+                {
+                    return (static_cast<int64_t>(tile.getWidth()) * tileTwipWidth !=
+                            static_cast<int64_t>(tile.getTileWidth()) * tilePixelWidth ||
+                            static_cast<int64_t>(tile.getHeight()) * tileTwipHeight !=
+                            static_cast<int64_t>(tile.getTileHeight()) * tilePixelHeight);
+                });
+
+            std::unique_lock<std::mutex> lock(_viewMutex);
+            _view._tilePixelWidth = tilePixelWidth;
+            _view._tilePixelHeight = tilePixelHeight;
+            _view._tileTwipWidth = tileTwipWidth;
+            _view._tileTwipHeight = tileTwipHeight;
+        }
+
+        int x, y, width, height;
+        if (command == Command::ClientVisibleArea && tokens.count() == 5 &&
+            getTokenInteger(tokens[1], "x", x) &&
+            getTokenInteger(tokens[2], "y", y) &&
+            getTokenInteger(tokens[3], "width", width) &&
+            getTokenInteger(tokens[4], "height", height))
+        {
+            std::unique_lock<std::mutex> lock(_viewMutex);
+            _view._visibleArea = TileInvalidation::Area(0, x, y, width, height);
+        }
+
+        if (command == Command::UserInactive && _docBroker->isHibernated())
+        {
+            // Nothing to tell the kit, which is gone.
+            return true;
+        }
+
+        // A hibernated document is loaded again first, which this waits for.
+        if (!_docBroker->resume())
+        {
+            Log::error(getName() + " failed to resume the document to handle [" + tokens[0] + "].");
+            return false;
+        }
+
         if (_peer.expired())
         {
             Log::error(getName() + " has no peer to handle [" + tokens[0] + "].");
@@ -173,19 +216,19 @@ bool ClientSession::_handleInput(const char *buffer, int length)
         }
 
         // Allow 'downloadas' for all kinds of views irrespective of editlock
-        if (!isEditLocked() && tokens[0] != "downloadas" &&
-            tokens[0] != "userinactive" && tokens[0] != "useractive")
+        if (!isEditLocked() && command != Command::DownloadAs &&
+            command != Command::UserInactive && command != Command::UserActive)
         {
             std::string dummyFrame = "dummymsg";
             return forwardToPeer(_peer, dummyFrame.c_str(), dummyFrame.size());
         }
-        else if (tokens[0] != "requestloksession")
+        else if (command != Command::RequestLokSession)
         {
             return forwardToPeer(_peer, buffer, length);
         }
         else
         {
-            assert(tokens[0] == "requestloksession");
+            assert(command == Command::RequestLokSession);
             return true;
         }
     }
@@ -193,6 +236,42 @@ bool ClientSession::_handleInput(const char *buffer, int length)
     return false;
 }
 
+bool ClientSession::isClientCommand(const Command command)
+{
+    switch (command)
+    {
+    case Command::CancelTiles:
+    case Command::ClientZoom:
+    case Command::ClientVisibleArea:
+    case Command::CommandValues:
+    case Command::DownloadAs:
+    case Command::GetChildId:
+    case Command::GetTextSelection:
+    case Command::Paste:
+    case Command::InsertFile:
+    case Command::Key:
+    case Command::Mouse:
+    case Command::PartPageRectangles:
+    case Command::RenderFont:
+    case Command::RequestLokSession:
+    case Command::ResetSelection:
+    case Command::SaveAs:
+    case Command::SelectGraphic:
+    case Command::SelectText:
+    case Command::SetClientPart:
+    case Command::SetPage:
+    case Command::Status:
+    case Command::Tile:
+    case Command::TileCombine:
+    case Command::Uno:
+    case Command::UserActive:
+    case Command::UserInactive:
+        return true;
+    default:
+        return false;
+    }
+}
+
 bool ClientSession::loadDocument(const char* /*buffer*/, int /*length*/, StringTokenizer& tokens)
 {
     if (tokens.count() < 2)
@@ -202,28 +281,11 @@ bool ClientSession::loadDocument(const char* /*buffer*/, int /*length*/, StringT
         return false;
     }
 
-    Log::info("Requesting document load from child.");
     try
     {
         std::string timestamp;
         parseDocOptions(tokens, _loadPart, timestamp);
-
-        std::ostringstream oss;
-        oss << "load";
-        oss << " url=" << _docBroker->getPublicUri().toString();
-        oss << " jail=" << _docBroker->getJailedUri().toString();
-
-        if (_loadPart >= 0)
-            oss << " part=" + std::to_string(_loadPart);
-
-        if (_haveDocPassword)
-            oss << " password=" << _docPassword;
-
-        if (!_docOptions.empty())
-            oss << " options=" << _docOptions;
-
-        const auto loadRequest = oss.str();
-        return forwardToPeer(_peer, loadRequest.c_str(), loadRequest.size());
+        return sendLoadRequest();
     }
     catch (const Poco::SyntaxException&)
     {
@@ -233,6 +295,28 @@ bool ClientSession::loadDocument(const char* /*buffer*/, int /*length*/, StringT
     return false;
 }
 
+bool ClientSession::sendLoadRequest()
+{
+    Log::info("Requesting document load from child.");
+
+    std::ostringstream oss;
+    oss << "load";
+    oss << " url=" << _docBroker->getPublicUri().toString();
+    oss << " jail=" << _docBroker->getJailedUri().toString();
+
+    if (_loadPart >= 0)
+        oss << " part=" + std::to_string(_loadPart);
+
+    if (_haveDocPassword)
+        oss << " password=" << _docPassword;
+
+    if (!_docOptions.empty())
+        oss << " options=" << _docOptions;
+
+    const auto loadRequest = oss.str();
+    return forwardToPeer(_peer, loadRequest.c_str(), loadRequest.size());
+}
+
 bool ClientSession::getStatus(const char *buffer, int length)
 {
     const std::string status = _docBroker->tileCache().getTextFile("status.txt");
@@ -249,10 +333,39 @@ bool ClientSession::getStatus(const char *buffer, int length)
     return forwardToPeer(_peer, buffer, length);
 }
 
+void ClientSession::detachPeer()
+{
+    auto peer = _peer.lock();
+    if (peer)
+    {
+        peer->setPeer(nullptr);
+    }
+
+    _peer.reset();
+}
+
+bool ClientSession::reload()
+{
+    if (_docURL.empty())
+    {
+        // Never loaded, nothing to do.
+        return true;
+    }
+
+    Log::info(getName() + " reloading the document.");
+    return sendLoadRequest();
+}
+
 bool ClientSession::setEditLock(const bool value)
 {
     // Update the sate and forward to child.
     markEditLock(value);
+    if (_peer.expired())
+    {
+        // Hibernated, the new kit only needs the state.
+        return true;
+    }
+
     const auto msg = "editlock: " + std::to_string(isEditLocked());
     const auto mv = std::getenv("LOK_VIEW_CALLBACK") ? "1" : "0";
     Log::debug("Forwarding [" + msg + "] to set editlock to " + std::to_string(value) + ". MultiView: " + mv);
@@ -298,6 +411,14 @@ bool ClientSession::sendFontRendering(const char *buffer, int length, StringToke
 
     const std::string response = "renderfont: " + Poco::cat(std::string(" "), tokens.begin() + 1, tokens.end()) + "\n";
 
+    // The fonts are the same for all the documents.
+    const auto preview = FontCache::instance().lookup(FontCache::getName(font));
+    if (preview)
+    {
+        return sendBinaryFrame({ IoUtil::getBuffer(response.data(), response.size()),
+                                 IoUtil::getBuffer(preview->data(), preview->size()) });
+    }
+
     std::vector<char> output;
     output.resize(response.size());
     std::memcpy(output.data(), response.data(), response.size());
@@ -324,6 +445,20 @@ bool ClientSession::sendTile(const char * /*buffer*/, int /*length*/, StringToke
     try
     {
         auto tileDesc = TileDesc::parse(tokens);
+        if (tileDesc.getTraceId() < 0)
+        {
+            tileDesc.setTraceId(LOOLWSD::sampleTileTrace());
+        }
+
+        if (canReceiveTileDeltas())
+        {
+            // The version of the image of the tile the client holds, if any.
+            int baseVersion = -1;
+            getTokenInteger(tokens, "basever", baseVersion);
+            setHeldTileVersion(TileCache::cacheFileName(tileDesc), baseVersion);
+        }
+
+        Trace::record(tileDesc.getTraceId(), Trace::Stage::ClientRequest);
         _docBroker->handleTileRequest(tileDesc, shared_from_this());
     }
     catch (const std::exception& exc)
@@ -340,6 +475,26 @@ bool ClientSession::sendCombinedTiles(const char* /*buffer*/, int /*length*/, St
     try
     {
         auto tileCombined = TileCombined::parse(tokens);
+        if (tileCombined.getTraceId() < 0)
+        {
+            tileCombined.setTraceId(LOOLWSD::sampleTileTrace());
+        }
+
+        if (canReceiveTileDeltas())
+        {
+            // The versions of the images of the tiles the client holds, -1 for those it doesn't.
+            std::string baseVersions;
+            getTokenString(tokens, "basever", baseVersions);
+            IntegerListReader reader(baseVersions.data(), baseVersions.data() + baseVersions.size());
+            for (const auto& tile : tileCombined.getTiles())
+            {
+                int baseVersion = -1;
+                reader.next(baseVersion);
+                setHeldTileVersion(TileCache::cacheFileName(tile), baseVersion);
+            }
+        }
+
+        Trace::record(tileCombined.getTraceId(), Trace::Stage::ClientRequest);
         _docBroker->handleTileCombinedRequest(tileCombined, shared_from_this());
     }
     catch (const std::exception& exc)
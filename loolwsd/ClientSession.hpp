@@ -10,8 +10,15 @@
 #ifndef INCLUDED_CLIENTSSESSION_HPP
 #define INCLUDED_CLIENTSSESSION_HPP
 
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "Command.hpp"
 #include "LOOLSession.hpp"
 #include "MessageQueue.hpp"
+#include "SessionRecord.hpp"
+#include "TileInvalidation.hpp"
 
 class DocumentBroker;
 class PrisonerSession;
@@ -33,6 +40,14 @@ public:
     void setPeer(const std::shared_ptr<PrisonerSession>& peer) { _peer = peer; }
     bool shutdownPeer(Poco::UInt16 statusCode, const std::string& message);
 
+    /// Forgets the peer, and the peer us, so that the client stays
+    /// connected when the kit goes, to hibernate.
+    void detachPeer();
+    bool hasPeer() const { return !_peer.expired(); }
+
+    /// Loads the document again, as the client did, into a new kit.
+    bool reload();
+
     /**
      * Return the URL of the saved-as document when it's ready. If called
      * before it's ready, the call blocks till then.
@@ -62,11 +77,83 @@ public:
 
     std::shared_ptr<DocumentBroker> getDocumentBroker() const { return _docBroker; }
 
+    /// Records the messages of the client, as they come, into record.
+    void setRecord(const std::shared_ptr<SessionRecord>& record) { _record = record; }
+
+    void recordInput(const std::vector<char>& payload)
+    {
+        if (_record)
+        {
+            _record->record(payload.data(), payload.size());
+        }
+    }
+
+    /// Whether the client understands 'tilecombine:' responses.
+    bool canReceiveCombinedTiles() const
+    {
+        return _clientMinorVersion >= static_cast<int>(LOOLProtocol::ProtocolCombinedTilesMinorVersionNumber);
+    }
+
+    /// Whether the client applies 'tiledelta:' responses.
+    bool canReceiveTileDeltas() const
+    {
+        return _clientMinorVersion >= static_cast<int>(LOOLProtocol::ProtocolTileDeltasMinorVersionNumber);
+    }
+
+    /// Records the tile image last sent, by tile cache name: the version
+    /// of its message, which the client tells back while it holds the
+    /// image, and the version of the render it is.
+    void setTileVersion(const std::string& cachedName, const int version, const int renderVersion)
+    {
+        std::unique_lock<std::mutex> lock(_tileVersionsMutex);
+        _tileVersions[cachedName] = SentTile{ version, renderVersion };
+    }
+
+    /// Forgets the tile image last sent unless the client, requesting the
+    /// tile, tells it holds it still by the version of its message. -1 when
+    /// it holds none, having dropped the image of the tile out of view.
+    void setHeldTileVersion(const std::string& cachedName, const int version)
+    {
+        std::unique_lock<std::mutex> lock(_tileVersionsMutex);
+        const auto it = _tileVersions.find(cachedName);
+        if (it != _tileVersions.end() && (version < 0 || it->second.version != version))
+        {
+            _tileVersions.erase(it);
+        }
+    }
+
+    /// Forgets the tile image last sent, replaced by one that is no render.
+    void resetTileVersion(const std::string& cachedName)
+    {
+        std::unique_lock<std::mutex> lock(_tileVersionsMutex);
+        _tileVersions.erase(cachedName);
+    }
+
+    /// The render version of the tile image the client holds, -1 when not known.
+    int getTileVersion(const std::string& cachedName)
+    {
+        std::unique_lock<std::mutex> lock(_tileVersionsMutex);
+        const auto it = _tileVersions.find(cachedName);
+        return (it != _tileVersions.end() ? it->second.renderVersion : -1);
+    }
+
+    /// What the client shows, as it last told, for the tiles of it
+    /// invalidated to be rendered again ahead of its asking for them.
+    TileInvalidation::View getView()
+    {
+        std::unique_lock<std::mutex> lock(_viewMutex);
+        return _view;
+    }
+
 private:
 
     virtual bool _handleInput(const char *buffer, int length) override;
 
+    /// Whether the command is one a client may send once loaded.
+    static bool isClientCommand(LOOLProtocol::Command command);
+
     bool loadDocument(const char *buffer, int length, Poco::StringTokenizer& tokens);
+    bool sendLoadRequest();
 
     bool getStatus(const char *buffer, int length);
     bool getCommandValues(const char *buffer, int length, Poco::StringTokenizer& tokens);
@@ -97,6 +184,26 @@ private:
     /// Marks if document loading failed.
     bool _loadFailed;
     int _loadPart;
+
+    /// The minor protocol version the client announced, 0 if none.
+    int _clientMinorVersion;
+
+    /// A tile image sent: the version of its message and of its render.
+    struct SentTile
+    {
+        int version;
+        int renderVersion;
+    };
+
+    /// What the client has of each tile, for sending deltas.
+    std::mutex _tileVersionsMutex;
+    std::unordered_map<std::string, SentTile> _tileVersions;
+
+    /// Set before the messages of the client flow.
+    std::shared_ptr<SessionRecord> _record;
+
+    std::mutex _viewMutex;
+    TileInvalidation::View _view;
 };
 
 #endif
@@ -0,0 +1,390 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_CLUSTER_HPP
+#define INCLUDED_CLUSTER_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// The nodes of wsd behind a load balancer, that agree on where each
+/// document is loaded, for all its clients to edit the same. The key of a
+/// document is hashed, consistently, to its owner among the nodes up: the
+/// others proxy their clients to it. The owner places the new documents on
+/// the node, up, with the most room, by the loads the nodes exchange, and
+/// keeps that placement while clients are proxied there.
+class Cluster
+{
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    /// What a node can take, as it reports it.
+    struct Load
+    {
+        Load() :
+            _spareKits(0),
+            _freeKb(-1),
+            _documents(0)
+        {
+        }
+
+        /// The kits prespawned, waiting for a document.
+        size_t _spareKits;
+        /// The memory left under the limit, -1 without limit.
+        int64_t _freeKb;
+        size_t _documents;
+
+        std::string serialize() const
+        {
+            std::ostringstream oss;
+            oss << "spare_kits=" << _spareKits
+                << " free_kb=" << _freeKb
+                << " documents=" << _documents;
+            return oss.str();
+        }
+
+        /// Returns false unless all the values are given.
+        static bool parse(const std::string& text, Load& load)
+        {
+            std::istringstream iss(text);
+            std::string item;
+            int found = 0;
+            while (iss >> item)
+            {
+                const auto equal = item.find('=');
+                if (equal == std::string::npos)
+                {
+                    continue;
+                }
+
+                const std::string name = item.substr(0, equal);
+                const char* value = item.c_str() + equal + 1;
+                if (name == "spare_kits")
+                {
+                    load._spareKits = std::strtoul(value, nullptr, 10);
+                    found |= 1;
+                }
+                else if (name == "free_kb")
+                {
+                    load._freeKb = std::strtoll(value, nullptr, 10);
+                    found |= 2;
+                }
+                else if (name == "documents")
+                {
+                    load._documents = std::strtoul(value, nullptr, 10);
+                    found |= 4;
+                }
+            }
+
+            return found == 7;
+        }
+
+        /// Whether it can load a document at once, with memory to spare.
+        bool hasRoom() const
+        {
+            return _spareKits > 0 && (_freeKb < 0 || _freeKb >= MinFreeKb);
+        }
+    };
+
+    /// self is the URI of this node, among those of members. A node not
+    /// heard of for downAfterMs is down, until heard of again.
+    Cluster(const std::string& self, const std::vector<std::string>& members,
+            const int downAfterMs, const size_t replicas = Replicas) :
+        _self(self),
+        _downAfterMs(downAfterMs),
+        _replicas(replicas)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        for (const auto& member : members)
+        {
+            // Up until told otherwise, so that all agree from the start.
+            _nodes[member]._heard = now;
+        }
+
+        _nodes[self]._heard = now;
+        buildRing();
+    }
+
+    Cluster(const Cluster&) = delete;
+    Cluster& operator=(const Cluster&) = delete;
+
+    const std::string& getSelf() const { return _self; }
+
+    /// The other nodes, to poll.
+    std::vector<std::string> getPeers() const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        std::vector<std::string> peers;
+        for (const auto& it : _nodes)
+        {
+            if (it.first != _self)
+            {
+                peers.push_back(it.first);
+            }
+        }
+
+        return peers;
+    }
+
+    /// The node is up, with the load it reported.
+    void setLoad(const std::string& node, const Load& load, const TimePoint now)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto it = _nodes.find(node);
+        if (it == _nodes.end())
+        {
+            return;
+        }
+
+        it->second._load = load;
+        it->second._heard = now;
+        if (!it->second._up)
+        {
+            it->second._up = true;
+            buildRing();
+        }
+    }
+
+    /// The node failed to answer, so is down, its documents owned by others.
+    void setDown(const std::string& node)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto it = _nodes.find(node);
+        if (it != _nodes.end() && node != _self && it->second._up)
+        {
+            it->second._up = false;
+            buildRing();
+        }
+    }
+
+    /// Downs the nodes not heard of for long enough, and forgets the
+    /// placements released for long enough that their documents are unloaded.
+    void expire(const TimePoint now)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        bool changed = false;
+        for (auto& it : _nodes)
+        {
+            if (it.first != _self && it.second._up && getMs(it.second._heard, now) > _downAfterMs)
+            {
+                it.second._up = false;
+                changed = true;
+            }
+        }
+
+        if (changed)
+        {
+            buildRing();
+        }
+
+        for (auto it = _placements.begin(); it != _placements.end(); )
+        {
+            if (it->second._refs == 0 && getMs(it->second._released, now) > PlacementKeepMs)
+            {
+                it = _placements.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+    }
+
+    bool isUp(const std::string& node) const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto it = _nodes.find(node);
+        return (it != _nodes.end() && it->second._up);
+    }
+
+    /// The node, up, that decides where the document is loaded.
+    std::string getOwner(const std::string& docKey) const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto it = _ring.lower_bound(hash(docKey));
+        if (it == _ring.end())
+        {
+            it = _ring.begin();
+        }
+
+        return (it != _ring.end() ? it->second : _self);
+    }
+
+    /// The node to load the document, as the owner: where it was placed
+    /// if still up, else the one with the most room. Held until released.
+    std::string place(const std::string& docKey, const TimePoint now)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        auto& placement = _placements[docKey];
+        const auto node = _nodes.find(placement._node);
+        if (node == _nodes.end() || !node->second._up)
+        {
+            placement._node = choose(docKey);
+        }
+
+        ++placement._refs;
+        placement._released = now;
+        return placement._node;
+    }
+
+    void release(const std::string& docKey, const TimePoint now)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto it = _placements.find(docKey);
+        if (it != _placements.end() && it->second._refs > 0)
+        {
+            --it->second._refs;
+            it->second._released = now;
+        }
+    }
+
+    /// The nodes, with their loads, for the admin console.
+    std::string getStats() const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        std::ostringstream oss;
+        oss << "self=" << _self << " placements=" << _placements.size();
+        for (const auto& it : _nodes)
+        {
+            oss << "\n" << it.first << (it.second._up ? " up " : " down ") << it.second._load.serialize();
+        }
+
+        return oss.str();
+    }
+
+    /// FNV-1a, the same on every node, unlike std::hash.
+    static uint64_t hash(const std::string& key)
+    {
+        uint64_t value = 14695981039346656037ull;
+        for (const char c : key)
+        {
+            value = (value ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        }
+
+        // Mixes the last bytes into the high bits, which order the ring.
+        value ^= value >> 33;
+        value *= 0xff51afd7ed558ccdull;
+        value ^= value >> 33;
+        return value;
+    }
+
+private:
+    struct Node
+    {
+        Node() : _up(true) {}
+
+        bool _up;
+        TimePoint _heard;
+        Load _load;
+    };
+
+    struct Placement
+    {
+        Placement() : _refs(0) {}
+
+        std::string _node;
+        size_t _refs;
+        TimePoint _released;
+    };
+
+    static int64_t getMs(const TimePoint from, const TimePoint to)
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(to - from).count();
+    }
+
+    /// Each node up at replicas points on the ring, to split the keys evenly.
+    void buildRing()
+    {
+        _ring.clear();
+        for (const auto& it : _nodes)
+        {
+            if (it.second._up)
+            {
+                for (size_t i = 0; i < _replicas; ++i)
+                {
+                    _ring.emplace(hash(it.first + '#' + std::to_string(i)), it.first);
+                }
+            }
+        }
+    }
+
+    /// The node up with room and the fewest documents, then the most memory
+    /// free, in the order of the ring from the key. This one when none has room.
+    std::string choose(const std::string& docKey) const
+    {
+        std::vector<std::string> order;
+        auto it = _ring.lower_bound(hash(docKey));
+        for (size_t i = 0; i < _ring.size(); ++i, ++it)
+        {
+            if (it == _ring.end())
+            {
+                it = _ring.begin();
+            }
+
+            if (std::find(order.begin(), order.end(), it->second) == order.end())
+            {
+                order.push_back(it->second);
+            }
+        }
+
+        const Node* best = nullptr;
+        std::string bestName = _self;
+        for (const auto& name : order)
+        {
+            const Node& node = _nodes.find(name)->second;
+            if (!node._load.hasRoom())
+            {
+                continue;
+            }
+
+            if (!best || node._load._documents < best->_load._documents ||
+                (node._load._documents == best->_load._documents &&
+                 getFreeKb(node._load) > getFreeKb(best->_load)))
+            {
+                best = &node;
+                bestName = name;
+            }
+        }
+
+        return bestName;
+    }
+
+    static int64_t getFreeKb(const Load& load)
+    {
+        return (load._freeKb < 0 ? INT64_MAX : load._freeKb);
+    }
+
+private:
+    /// Points per node on the ring.
+    static constexpr size_t Replicas = 64;
+    /// The memory a node must have left to take a document.
+    static constexpr int64_t MinFreeKb = 256 * 1024;
+    /// How long a placement outlives its last client proxied, for the
+    /// document to unload, or for its node to register it, when local.
+    static constexpr int64_t PlacementKeepMs = 60 * 1000;
+
+    const std::string _self;
+    const int _downAfterMs;
+    const size_t _replicas;
+    std::map<std::string, Node> _nodes;
+    std::map<uint64_t, std::string> _ring;
+    std::map<std::string, Placement> _placements;
+    mutable std::mutex _mutex;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
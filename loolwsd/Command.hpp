@@ -0,0 +1,255 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_COMMAND_HPP
+#define INCLUDED_COMMAND_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace LOOLProtocol
+{
+    /// The verbs of the protocol that the sessions handle: the first tokens
+    /// of the messages, those ending with ':' being sent by the kits.
+    enum class Command : unsigned char
+    {
+        Unknown,
+        CancelTiles,
+        ClientVisibleArea,
+        ClientZoom,
+        CommandValues,
+        DownloadAs,
+        DummyMsg,
+        GetChildId,
+        GetTextSelection,
+        InsertFile,
+        Key,
+        Load,
+        LoolClient,
+        Mouse,
+        PartPageRectangles,
+        Paste,
+        RenderFont,
+        RequestLokSession,
+        ResetSelection,
+        SaveAs,
+        SelectGraphic,
+        SelectText,
+        SetClientPart,
+        SetPage,
+        Status,
+        TakeEdit,
+        Tile,
+        TileCombine,
+        Uno,
+        UserActive,
+        UserInactive,
+        CommandValuesMessage,
+        CurPartMessage,
+        EditLockMessage,
+        ErrorMessage,
+        InvalidateCursorMessage,
+        InvalidateTilesMessage,
+        PartPageRectanglesMessage,
+        RenderFontMessage,
+        SaveAsMessage,
+        StateChangedMessage,
+        StatusMessage,
+        TileMessage,
+        UnoCommandResultMessage,
+        Count
+    };
+
+    /// The table of the commands, by a perfect hash of their names, built at
+    /// compile time: a message is classified by hashing its first token once,
+    /// and comparing it to the one name of its slot.
+    namespace Commands
+    {
+        /// In the order of Command.
+        constexpr const char* Names[] =
+        {
+            "",
+            "canceltiles",
+            "clientvisiblearea",
+            "clientzoom",
+            "commandvalues",
+            "downloadas",
+            "dummymsg",
+            "getchildid",
+            "gettextselection",
+            "insertfile",
+            "key",
+            "load",
+            "loolclient",
+            "mouse",
+            "partpagerectangles",
+            "paste",
+            "renderfont",
+            "requestloksession",
+            "resetselection",
+            "saveas",
+            "selectgraphic",
+            "selecttext",
+            "setclientpart",
+            "setpage",
+            "status",
+            "takeedit",
+            "tile",
+            "tilecombine",
+            "uno",
+            "useractive",
+            "userinactive",
+            "commandvalues:",
+            "curpart:",
+            "editlock:",
+            "error:",
+            "invalidatecursor:",
+            "invalidatetiles:",
+            "partpagerectangles:",
+            "renderfont:",
+            "saveas:",
+            "statechanged:",
+            "status:",
+            "tile:",
+            "unocommandresult:"
+        };
+
+        constexpr size_t Count = static_cast<size_t>(Command::Count);
+        static_assert(sizeof(Names) / sizeof(Names[0]) == Count, "A name per command.");
+
+        constexpr size_t length(const char* name)
+        {
+            return (*name ? 1 + length(name + 1) : 0);
+        }
+
+        constexpr size_t maxLength(const size_t i = 1, const size_t max = 0)
+        {
+            return (i == Count ? max : maxLength(i + 1, length(Names[i]) > max ? length(Names[i]) : max));
+        }
+
+        /// The longest name, longer tokens being unknown.
+        constexpr size_t MaxLength = maxLength();
+
+        /// FNV-1a, from a basis for which the names hash to distinct slots.
+        constexpr uint32_t Basis = 2166136261u + 14;
+        constexpr size_t Slots = 256;
+
+        constexpr uint32_t hash(const char* data, const size_t size, const uint32_t value = Basis)
+        {
+            return (size == 0 ? value : hash(data + 1, size - 1, (value ^ static_cast<unsigned char>(*data)) * 16777619u));
+        }
+
+        constexpr size_t getSlot(const char* name)
+        {
+            return hash(name, length(name)) % Slots;
+        }
+
+        /// Whether no other name hashes to the slot of the ith.
+        constexpr bool isAlone(const size_t i, const size_t j = 1)
+        {
+            return (j == Count || ((j == i || getSlot(Names[j]) != getSlot(Names[i])) && isAlone(i, j + 1)));
+        }
+
+        constexpr bool isPerfect(const size_t i = 1)
+        {
+            return (i == Count || (isAlone(i) && isPerfect(i + 1)));
+        }
+
+        static_assert(isPerfect(), "Two commands hash to the same slot: change the Basis.");
+
+        /// The command hashing to the slot, Unknown if none.
+        constexpr Command getCommandAt(const size_t slot, const size_t i = 1)
+        {
+            return (i == Count ? Command::Unknown :
+                    getSlot(Names[i]) == slot ? static_cast<Command>(i) : getCommandAt(slot, i + 1));
+        }
+
+        template <size_t... I> struct Indices {};
+        template <size_t N, size_t... I> struct MakeIndices : MakeIndices<N - 1, N - 1, I...> {};
+        template <size_t... I> struct MakeIndices<0, I...> { typedef Indices<I...> Type; };
+
+        struct Table
+        {
+            Command commands[Slots];
+        };
+
+        template <size_t... I>
+        constexpr Table makeTable(Indices<I...>)
+        {
+            return Table{ { getCommandAt(I)... } };
+        }
+
+        constexpr Table CommandTable = makeTable(MakeIndices<Slots>::Type());
+    }
+
+    /// The command of a message, by its first token, without allocating.
+    inline Command getCommand(const char* message, const size_t length)
+    {
+        size_t size = 0;
+        while (size < length && message[size] != ' ' && message[size] != '\n')
+        {
+            if (++size > Commands::MaxLength)
+            {
+                return Command::Unknown;
+            }
+        }
+
+        const Command command = Commands::CommandTable.commands[Commands::hash(message, size) % Commands::Slots];
+        const char* name = Commands::Names[static_cast<size_t>(command)];
+        return (std::strncmp(name, message, size) == 0 && name[size] == '\0' ? command : Command::Unknown);
+    }
+
+    inline const char* getCommandName(const Command command)
+    {
+        return (command < Command::Count ? Commands::Names[static_cast<size_t>(command)] : "");
+    }
+
+    /// Whether the message comes from a user interacting with the document:
+    /// not rendering nor status, nor anything unknown.
+    inline bool isUserInteraction(const Command command)
+    {
+        switch (command)
+        {
+        case Command::Unknown:
+        case Command::CancelTiles:
+        case Command::Status:
+        case Command::Tile:
+        case Command::TileCombine:
+        case Command::InvalidateTilesMessage:
+        case Command::StateChangedMessage:
+        case Command::StatusMessage:
+        case Command::TileMessage:
+        case Command::Count:
+            return false;
+        default:
+            return true;
+        }
+    }
+
+    /// The messages that wsd handled, by command, for its metrics.
+    inline std::atomic<uint64_t>* getCommandCounts()
+    {
+        static std::atomic<uint64_t> counts[Commands::Count];
+        return counts;
+    }
+
+    inline void countCommand(const Command command)
+    {
+        if (command < Command::Count)
+        {
+            getCommandCounts()[static_cast<size_t>(command)].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+}
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -27,9 +27,13 @@ constexpr int COMMAND_TIMEOUT_MS = 5000;
 constexpr int READ_BUFFER_SIZE = 2048;
 /// Size after which messages will be sent preceded with
 /// 'nextmessage' frame to let the receiver know in advance
-/// the size of larger coming message. All messages up to this
-/// size are considered small messages.
+/// the size of larger coming message, for the peers that
+/// need it. All messages up to this size are considered
+/// small messages.
 constexpr int SMALL_MESSAGE_SIZE = READ_BUFFER_SIZE / 2;
+/// The most bytes of a message streamed in a frame: larger
+/// ones are sent in fragments, that no peer needs to join.
+constexpr int MESSAGE_FRAGMENT_SIZE = READ_BUFFER_SIZE * 32;
 
 constexpr auto FIFO_LOOLWSD = "loolwsdfifo";
 constexpr auto FIFO_PATH = "pipe";
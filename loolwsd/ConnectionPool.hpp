@@ -0,0 +1,175 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_CONNECTIONPOOL_HPP
+#define INCLUDED_CONNECTIONPOOL_HPP
+
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+/// Keeps the sessions to each host open between the requests, so that
+/// the next request to it is spared the DNS, TCP and TLS handshakes.
+/// A session is given back only once its response is read whole, and
+/// is dropped once idle for long enough that the host may have closed it.
+template <typename Session>
+class ConnectionPool
+{
+public:
+    typedef std::unique_ptr<Session> SessionPtr;
+    typedef std::function<SessionPtr(const std::string& key)> Factory;
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    /// maxIdlePerKey of 0 keeps none, as without a pool.
+    ConnectionPool(const Factory& factory, const size_t maxIdlePerKey, const int idleTimeoutMs) :
+        _factory(factory),
+        _maxIdlePerKey(maxIdlePerKey),
+        _idleTimeoutMs(idleTimeoutMs),
+        _created(0),
+        _reused(0)
+    {
+    }
+
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    void setLimits(const size_t maxIdlePerKey, const int idleTimeoutMs)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _maxIdlePerKey = maxIdlePerKey;
+        _idleTimeoutMs = idleTimeoutMs;
+    }
+
+    /// The session used last to key, if still fresh, else a new one.
+    /// reused tells which, as the host may have closed it nonetheless.
+    SessionPtr acquire(const std::string& key, const TimePoint now, bool& reused)
+    {
+        reused = false;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            auto it = _idle.find(key);
+            if (it != _idle.end())
+            {
+                auto& idle = it->second;
+                expire(idle, now);
+                if (!idle.empty())
+                {
+                    auto session = std::move(idle.back()._session);
+                    idle.pop_back();
+                    if (idle.empty())
+                    {
+                        _idle.erase(it);
+                    }
+
+                    ++_reused;
+                    reused = true;
+                    return session;
+                }
+
+                _idle.erase(it);
+            }
+
+            ++_created;
+        }
+
+        // Connecting is up to the session, outside of the lock.
+        return _factory(key);
+    }
+
+    /// Keeps the session for the next request to key.
+    void release(const std::string& key, SessionPtr session, const TimePoint now)
+    {
+        if (!session)
+        {
+            return;
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_maxIdlePerKey == 0)
+        {
+            return;
+        }
+
+        auto& idle = _idle[key];
+        expire(idle, now);
+        while (idle.size() >= _maxIdlePerKey)
+        {
+            idle.pop_front();
+        }
+
+        Idle entry;
+        entry._session = std::move(session);
+        entry._since = now;
+        idle.push_back(std::move(entry));
+    }
+
+    size_t getIdleCount()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        size_t count = 0;
+        for (const auto& pair : _idle)
+        {
+            count += pair.second.size();
+        }
+
+        return count;
+    }
+
+    std::string getStats()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        size_t idleCount = 0;
+        for (const auto& pair : _idle)
+        {
+            idleCount += pair.second.size();
+        }
+
+        std::ostringstream oss;
+        oss << "hosts=" << _idle.size()
+            << " idle=" << idleCount
+            << " created=" << _created
+            << " reused=" << _reused;
+        return oss.str();
+    }
+
+private:
+    struct Idle
+    {
+        SessionPtr _session;
+        TimePoint _since;
+    };
+
+    /// Drops the sessions idle for too long, the oldest being first.
+    void expire(std::deque<Idle>& idle, const TimePoint now)
+    {
+        while (!idle.empty() &&
+               std::chrono::duration_cast<std::chrono::milliseconds>(now - idle.front()._since).count() >= _idleTimeoutMs)
+        {
+            idle.pop_front();
+        }
+    }
+
+private:
+    const Factory _factory;
+    std::mutex _mutex;
+    size_t _maxIdlePerKey;
+    int _idleTimeoutMs;
+    std::map<std::string, std::deque<Idle>> _idle;
+    size_t _created;
+    size_t _reused;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
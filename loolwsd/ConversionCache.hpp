@@ -0,0 +1,267 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_CONVERSIONCACHE_HPP
+#define INCLUDED_CONVERSIONCACHE_HPP
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <Poco/DigestEngine.h>
+#include <Poco/SHA1Engine.h>
+
+/// Keeps the results of the conversions on disk, by the content converted, the
+/// format and the options, so that converting the same again serves the result
+/// kept instead. The least recently used go first once over maxBytes.
+/// The file times keep the order across restarts.
+class ConversionCache
+{
+public:
+    /// maxBytes of 0 keeps none.
+    ConversionCache(const std::string& root, const size_t maxBytes) :
+        _root(root),
+        _maxBytes(maxBytes),
+        _bytes(0),
+        _hits(0),
+        _misses(0),
+        _evicted(0)
+    {
+        mkdir(_root.c_str(), S_IRWXU);
+        scan();
+    }
+
+    ConversionCache(const ConversionCache&) = delete;
+    ConversionCache& operator=(const ConversionCache&) = delete;
+
+    /// The key of converting the file at path to format, with options;
+    /// empty if the file can't be read.
+    static std::string getKey(const std::string& path, const std::string& format, const std::string& options)
+    {
+        std::ifstream file(path, std::ios::binary);
+        if (!file)
+        {
+            return std::string();
+        }
+
+        Poco::SHA1Engine digestEngine;
+        std::vector<char> buffer(64 * 1024);
+        while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0)
+        {
+            digestEngine.update(buffer.data(), file.gcount());
+        }
+
+        if (file.bad())
+        {
+            return std::string();
+        }
+
+        // Not to be confused with another format or options.
+        const std::string params = '\n' + format + '\n' + options;
+        digestEngine.update(params.data(), params.size());
+        return Poco::DigestEngine::digestToHex(digestEngine.digest());
+    }
+
+    /// The path of the result kept for key, empty if none.
+    std::string find(const std::string& key)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto it = _entries.find(key);
+        if (it == _entries.end())
+        {
+            ++_misses;
+            return std::string();
+        }
+
+        ++_hits;
+        _lru.splice(_lru.end(), _lru, it->second._lru);
+        const auto path = getPath(key);
+        utime(path.c_str(), nullptr);
+        return path;
+    }
+
+    /// Keeps a copy of the result at path for key, a link if on the same filesystem.
+    bool add(const std::string& key, const std::string& path)
+    {
+        struct stat st;
+        if (_maxBytes == 0 || key.empty() || stat(path.c_str(), &st) != 0 ||
+            static_cast<size_t>(st.st_size) > _maxBytes)
+        {
+            return false;
+        }
+
+        // Whole or not at all, for the hits meanwhile.
+        const auto cachePath = getPath(key);
+        const auto tempPath = cachePath + ".tmp" + std::to_string(getpid()) + '_' + std::to_string(st.st_ino);
+        if (link(path.c_str(), tempPath.c_str()) != 0 && !copy(path, tempPath))
+        {
+            ::unlink(tempPath.c_str());
+            return false;
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (rename(tempPath.c_str(), cachePath.c_str()) != 0)
+        {
+            ::unlink(tempPath.c_str());
+            return false;
+        }
+
+        utime(cachePath.c_str(), nullptr);
+        remove(key);
+        insert(key, st.st_size);
+        evict();
+        return true;
+    }
+
+    size_t size()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _entries.size();
+    }
+
+    std::string getStats()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        std::ostringstream oss;
+        oss << "entries=" << _entries.size()
+            << " bytes=" << _bytes
+            << " hits=" << _hits
+            << " misses=" << _misses
+            << " evicted=" << _evicted;
+        return oss.str();
+    }
+
+private:
+    struct Entry
+    {
+        size_t _size;
+        std::list<std::string>::iterator _lru;
+    };
+
+    std::string getPath(const std::string& key) const
+    {
+        return _root + '/' + key;
+    }
+
+    /// Takes the entries left from before, the oldest first, and those partly written out.
+    void scan()
+    {
+        std::vector<std::pair<time_t, std::string>> found;
+        if (DIR* dir = opendir(_root.c_str()))
+        {
+            while (struct dirent* entry = readdir(dir))
+            {
+                const std::string name = entry->d_name;
+                struct stat st;
+                if (name[0] == '.' || stat(getPath(name).c_str(), &st) != 0 || !S_ISREG(st.st_mode))
+                {
+                    continue;
+                }
+
+                if (name.find(".tmp") != std::string::npos)
+                {
+                    ::unlink(getPath(name).c_str());
+                    continue;
+                }
+
+                found.emplace_back(st.st_mtime, name);
+            }
+
+            closedir(dir);
+        }
+
+        std::sort(found.begin(), found.end());
+        for (const auto& it : found)
+        {
+            struct stat st;
+            if (stat(getPath(it.second).c_str(), &st) == 0)
+            {
+                insert(it.second, st.st_size);
+            }
+        }
+
+        evict();
+    }
+
+    void insert(const std::string& key, const size_t size)
+    {
+        Entry& entry = _entries[key];
+        entry._size = size;
+        entry._lru = _lru.insert(_lru.end(), key);
+        _bytes += size;
+    }
+
+    void remove(const std::string& key)
+    {
+        const auto it = _entries.find(key);
+        if (it != _entries.end())
+        {
+            _bytes -= it->second._size;
+            _lru.erase(it->second._lru);
+            _entries.erase(it);
+        }
+    }
+
+    /// Drops the least recently used until within the limit.
+    void evict()
+    {
+        while (_bytes > _maxBytes && !_lru.empty())
+        {
+            const auto key = _lru.front();
+            ::unlink(getPath(key).c_str());
+            remove(key);
+            ++_evicted;
+        }
+    }
+
+    static bool copy(const std::string& fromPath, const std::string& toPath)
+    {
+        std::ifstream from(fromPath, std::ios::binary);
+        std::ofstream to(toPath, std::ios::binary | std::ios::trunc);
+        if (!from || !to)
+        {
+            return false;
+        }
+
+        if (from.peek() != std::ifstream::traits_type::eof())
+        {
+            to << from.rdbuf();
+        }
+
+        to.close();
+        return !to.fail();
+    }
+
+private:
+    const std::string _root;
+    const size_t _maxBytes;
+    std::mutex _mutex;
+    std::map<std::string, Entry> _entries;
+    /// The keys, the least recently used first.
+    std::list<std::string> _lru;
+    size_t _bytes;
+    size_t _hits;
+    size_t _misses;
+    size_t _evicted;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,147 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_CONVERSIONQUEUE_HPP
+#define INCLUDED_CONVERSIONQUEUE_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+/// Admits the conversions a few at a time, in the order they came, so that
+/// a batch of them takes no more kits than allowed, however long it is.
+/// Those coming once the queue is full, or waiting for too long, are turned away.
+class ConversionQueue
+{
+public:
+    ConversionQueue(const size_t maxRunning, const size_t maxQueued) :
+        _maxRunning(std::max<size_t>(maxRunning, 1)),
+        _maxQueued(maxQueued),
+        _running(0),
+        _nextTicket(0),
+        _done(0),
+        _failed(0),
+        _rejected(0),
+        _totalQueueMs(0),
+        _maxQueueMs(0),
+        _totalConvertMs(0),
+        _maxConvertMs(0)
+    {
+    }
+
+    ConversionQueue(const ConversionQueue&) = delete;
+    ConversionQueue& operator=(const ConversionQueue&) = delete;
+
+    void setLimits(const size_t maxRunning, const size_t maxQueued)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _maxRunning = std::max<size_t>(maxRunning, 1);
+        _maxQueued = maxQueued;
+        _cv.notify_all();
+    }
+
+    /// Waits for the turn of the caller, up to timeoutMs, setting queueMs to the wait.
+    /// Returns false if the queue is full or the turn didn't come, else leave() must follow.
+    bool enter(const int timeoutMs, size_t& queueMs)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_running + _waiting.size() >= _maxRunning + _maxQueued)
+        {
+            ++_rejected;
+            return false;
+        }
+
+        const size_t ticket = _nextTicket++;
+        _waiting.push_back(ticket);
+        const bool admitted = _cv.wait_for(lock, std::chrono::milliseconds(timeoutMs),
+                                           [this, ticket]() { return _waiting.front() == ticket && _running < _maxRunning; });
+        if (!admitted)
+        {
+            _waiting.erase(std::find(_waiting.begin(), _waiting.end(), ticket));
+            ++_rejected;
+
+            // The next may have been waiting behind us.
+            _cv.notify_all();
+            return false;
+        }
+
+        _waiting.pop_front();
+        ++_running;
+        queueMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+        _totalQueueMs += queueMs;
+        _maxQueueMs = std::max(_maxQueueMs, queueMs);
+
+        // Another slot may be free for the next.
+        _cv.notify_all();
+        return true;
+    }
+
+    /// Once the conversion admitted is over, after convertMs.
+    void leave(const bool success, const size_t convertMs)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        --_running;
+        ++(success ? _done : _failed);
+        _totalConvertMs += convertMs;
+        _maxConvertMs = std::max(_maxConvertMs, convertMs);
+        _cv.notify_all();
+    }
+
+    /// The conversions waiting for their turn.
+    size_t getQueued()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _waiting.size();
+    }
+
+    std::string getStats()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        const size_t admitted = _done + _failed + _running;
+        const size_t finished = _done + _failed;
+        std::ostringstream oss;
+        oss << "running=" << _running
+            << " queued=" << _waiting.size()
+            << " done=" << _done
+            << " failed=" << _failed
+            << " rejected=" << _rejected
+            << " queue_ms_avg=" << (admitted > 0 ? _totalQueueMs / admitted : 0)
+            << " queue_ms_max=" << _maxQueueMs
+            << " convert_ms_avg=" << (finished > 0 ? _totalConvertMs / finished : 0)
+            << " convert_ms_max=" << _maxConvertMs;
+        return oss.str();
+    }
+
+private:
+    std::mutex _mutex;
+    std::condition_variable _cv;
+    size_t _maxRunning;
+    size_t _maxQueued;
+    size_t _running;
+    /// The tickets of those waiting, in the order they came.
+    std::deque<size_t> _waiting;
+    size_t _nextTicket;
+    size_t _done;
+    size_t _failed;
+    size_t _rejected;
+    size_t _totalQueueMs;
+    size_t _maxQueueMs;
+    size_t _totalConvertMs;
+    size_t _maxConvertMs;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -10,51 +10,78 @@
 #include "DocumentBroker.hpp"
 #include "config.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <thread>
 #include <fstream>
 
 #include <Poco/Path.h>
 #include <Poco/SHA1Engine.h>
+#include <Poco/StringTokenizer.h>
 
+#include "Admin.hpp"
 #include "ClientSession.hpp"
 #include "Exceptions.hpp"
+#include "FontCache.hpp"
+#include "IoUtil.hpp"
 #include "LOOLProtocol.hpp"
 #include "LOOLWSD.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
 #include "PrisonerSession.hpp"
+#include "Startup.hpp"
 #include "Storage.hpp"
 #include "TileCache.hpp"
+#include "Trace.hpp"
+#include "TileCoalescer.hpp"
 #include "Unit.hpp"
+#include "UserMessages.hpp"
+#include "Util.hpp"
 
 using namespace LOOLProtocol;
 
+using Poco::StringTokenizer;
+
 void ChildProcess::socketProcessor()
 {
     IoUtil::SocketProcessor(_ws,
-        [this](const std::vector<char>& payload)
-        {
-            if (UnitWSD::get().filterChildMessage(payload))
-            {
-                return true;
-            }
+        [this](const std::vector<char>& payload) { return this->handleInput(payload); },
+        []() { },
+        [this]() { return !!this->_stop; },
+        _wakeup);
+}
 
-            auto docBroker = this->_docBroker.lock();
-            if (docBroker)
-            {
-                return docBroker->handleInput(payload);
-            }
+bool ChildProcess::handleInput(const std::vector<char>& payload)
+{
+    if (UnitWSD::get().filterChildMessage(payload))
+    {
+        return true;
+    }
 
-            Log::warn() << "Child " << this->_pid << " has no DocumentBroker to handle message: ["
-                        << LOOLProtocol::getAbbreviatedMessage(payload) << "]." << Log::end;
-            return true;
-        },
-        []() { },
-        [this]() { return !!this->_stop; });
+    auto docBroker = _docBroker.lock();
+    if (docBroker)
+    {
+        return docBroker->handleInput(payload);
+    }
+
+    Log::warn() << "Child " << _pid << " has no DocumentBroker to handle message: ["
+                << LOOLProtocol::getAbbreviatedMessage(payload) << "]." << Log::end;
+    return true;
 }
 
 namespace
 {
 
+Histogram& StorageLoadTime = Metrics::instance().histogram("loolwsd_storage_load_seconds",
+                                                           "Getting a document from storage into the jail.");
+Histogram& SaveTime = Metrics::instance().histogram("loolwsd_document_save_seconds",
+                                                    "From requesting a save until it is in storage.");
+std::atomic<uint64_t>& SaveFailures = Metrics::instance().counter("loolwsd_document_save_failures_total",
+                                                                  "The saves that failed.");
+std::atomic<uint64_t>& TilesRenderedAhead = Metrics::instance().counter("loolwsd_tiles_rendered_ahead_total",
+                                                                        "The invalidated tiles rendered again before the clients asked for them.");
+
 /// Returns the cache path for a given document URI.
 std::string getCachePath(const std::string& uri)
 {
@@ -66,6 +93,30 @@ std::string getCachePath(const std::string& uri)
             Poco::DigestEngine::digestToHex(digestEngine.digest()).insert(3, "/").insert(2, "/").insert(1, "/"));
 }
 
+/// Returns the hash of the file's content, empty if it can't be read.
+std::string getFileHash(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return std::string();
+    }
+
+    Poco::SHA1Engine digestEngine;
+    std::vector<char> buffer(64 * 1024);
+    while (file.read(buffer.data(), buffer.size()) || file.gcount() > 0)
+    {
+        digestEngine.update(buffer.data(), file.gcount());
+    }
+
+    if (file.bad())
+    {
+        return std::string();
+    }
+
+    return Poco::DigestEngine::digestToHex(digestEngine.digest());
+}
+
 }
 
 Poco::URI DocumentBroker::sanitizeURI(const std::string& uri)
@@ -108,15 +159,31 @@ DocumentBroker::DocumentBroker(const Poco::URI& uriPublic,
     _childProcess(childProcess),
     _lastSaveTime(std::chrono::steady_clock::now()),
     _markToDestroy(false),
+    _isHibernated(false),
+    _isResuming(false),
+    _isResumeStarted(false),
     _cursorPosX(0),
     _cursorPosY(0),
     _isLoaded(false),
     _isModified(false),
-    _tileVersion(0)
+    _tileVersion(0),
+    _tileCombinedRenderRequests(0),
+    _tileCombinedRenders(0),
+    _isSaving(false),
+    _isSaveRequested(false),
+    _saveCount(0),
+    _saveFailures(0),
+    _saveMerged(0),
+    _lastSaveMs(0),
+    _maxSaveMs(0),
+    _saveSkipped(0),
+    _saveSkippedBytes(0)
 {
     assert(!_docKey.empty());
     assert(!_childRoot.empty());
 
+    TileCacheQuota::instance().open(_cacheRoot, std::time(nullptr));
+
     Log::info("DocumentBroker [" + _uriPublic.toString() + "] created. DocKey: [" + _docKey + "]");
 }
 
@@ -140,6 +207,7 @@ void DocumentBroker::validate(const Poco::URI& uri)
 bool DocumentBroker::load(const std::string& jailId)
 {
     Log::debug("Loading from URI: " + _uriPublic.toString());
+    const auto start = std::chrono::steady_clock::now();
 
     std::unique_lock<std::mutex> lock(_mutex);
 
@@ -172,20 +240,67 @@ bool DocumentBroker::load(const std::string& jailId)
         const auto fileInfo = storage->getFileInfo(_uriPublic);
         _filename = fileInfo._filename;
 
+        // Called here, with the lock held.
+        storage->setProgressHandler([this](const std::string& operation, size_t done, size_t total)
+                                    {
+                                        sendTransferProgress(operation, done, total);
+                                    });
         const auto localPath = storage->loadStorageFileToLocal();
         _uriJailed = Poco::URI(Poco::URI("file://"), localPath);
 
         // Use the local temp file's timestamp.
         _lastFileModifiedTime = Poco::File(storage->getLocalRootPath()).getLastModified();
-        _tileCache.reset(new TileCache(_uriPublic.toString(), _lastFileModifiedTime, _cacheRoot));
+        _lastUploadedHash = getFileHash(storage->getLocalRootPath());
+        if (_tileCache && _isResuming && fileInfo._modifiedTime != _hibernatedModifiedTime)
+        {
+            // Changed in Storage meanwhile, the tiles the clients have are stale too.
+            Log::warn("Doc [" + _docKey + "] modified in Storage while hibernated.");
+            const std::string message = "invalidatetiles: EMPTY";
+            _tileCache->invalidateTiles(message);
+            _tileCache->saveLastModified(_lastFileModifiedTime);
+            for (auto& sessionIt : _sessions)
+            {
+                sessionIt.second->sendTextFrame(message);
+            }
+        }
+
+        // Resuming, the tiles are still good and serve the clients until the kit is ready.
+        if (!_tileCache)
+        {
+            _tileCache.reset(new TileCache(_uriPublic.toString(), _lastFileModifiedTime, _cacheRoot,
+                                           LOOLWSD::TileCacheMemoryLimit, LOOLWSD::TileCacheStore,
+                                           LOOLWSD::TileRecompressionLevel, LOOLWSD::getTileBlobsPath()));
+        }
 
         _storage.reset(storage.release());
+        StorageLoadTime.observe(std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - start).count() / 1000.);
         return true;
     }
 
     return false;
 }
 
+void DocumentBroker::setLoaded()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    _isLoaded = true;
+
+    if (_isResuming)
+    {
+        // The kit is ready for the renders requested meanwhile.
+        Log::info() << "Doc [" << _docKey << "] resumed, sending "
+                    << _pendingRenderRequests.size() << " pending render requests." << Log::end;
+        _isResuming = false;
+        for (const auto& request : _pendingRenderRequests)
+        {
+            _childProcess->getWebSocket()->sendFrame(request.data(), request.size());
+        }
+
+        _pendingRenderRequests.clear();
+    }
+}
+
 bool DocumentBroker::save()
 {
     std::unique_lock<std::mutex> lock(_saveMutex);
@@ -202,18 +317,42 @@ bool DocumentBroker::save()
                      << "]. File last modified "
                      << _lastFileModifiedTime.elapsed() / 1000000
                      << " seconds ago." << Log::end;
+        ++_saveSkipped;
         return true;
     }
 
-    Log::debug("Saving to URI [" + uri + "].");
-
     assert(_storage && _tileCache);
+
+    // Saved again as it was, e.g. after undoing all the edits, or for only the view changing.
+    const auto localPath = _storage->getLocalRootPath();
+    const auto newHash = getFileHash(localPath);
+    if (!newHash.empty() && newHash == _lastUploadedHash)
+    {
+        Log::debug("Skipping saving to URI [" + uri + "], its content is that uploaded last.");
+        ++_saveSkipped;
+        _saveSkippedBytes += Poco::File(localPath).getSize();
+        _isModified = false;
+        _tileCache->setUnsavedChanges(false);
+        _lastFileModifiedTime = newFileModifiedTime;
+        _tileCache->saveLastModified(_lastFileModifiedTime);
+        _lastSaveTime = std::chrono::steady_clock::now();
+        _saveCV.notify_all();
+        return true;
+    }
+
+    Log::debug("Saving to URI [" + uri + "].");
+    _storage->setProgressHandler([this](const std::string& operation, size_t done, size_t total)
+                                 {
+                                     std::lock_guard<std::mutex> sessionsLock(_mutex);
+                                     sendTransferProgress(operation, done, total);
+                                 });
     if (_storage->saveLocalFileToStorage())
     {
         _isModified = false;
         _tileCache->setUnsavedChanges(false);
         const auto fileInfo = _storage->getFileInfo(_uriPublic);
         _lastFileModifiedTime = newFileModifiedTime;
+        _lastUploadedHash = newHash;
         _tileCache->saveLastModified(_lastFileModifiedTime);
         _lastSaveTime = std::chrono::steady_clock::now();
         Log::debug("Saved to URI [" + uri + "] and updated tile cache.");
@@ -225,6 +364,90 @@ bool DocumentBroker::save()
     return false;
 }
 
+void DocumentBroker::requestSave()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (_isSaving)
+    {
+        // The one under way may not have the latest, save once more after it.
+        if (!_isSaveRequested)
+        {
+            _isSaveRequested = true;
+            _saveRequestTime = std::chrono::steady_clock::now();
+        }
+        else
+        {
+            ++_saveMerged;
+        }
+
+        Log::debug("Save of doc [" + _docKey + "] requested while saving, queued.");
+        return;
+    }
+
+    _isSaving = true;
+    _saveRequestTime = std::chrono::steady_clock::now();
+    lock.unlock();
+
+    auto docBroker = shared_from_this();
+    LOOLWSD::postSave([docBroker]() { docBroker->runSave(); });
+}
+
+void DocumentBroker::runSave()
+{
+    for (;;)
+    {
+        bool success = false;
+        try
+        {
+            success = save();
+        }
+        catch (const std::exception& exc)
+        {
+            Log::error("Failed to save doc [" + _docKey + "]: " + exc.what());
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                    std::chrono::steady_clock::now() - _saveRequestTime).count();
+        _lastSaveMs = elapsedMs;
+        _maxSaveMs = std::max(_maxSaveMs, _lastSaveMs);
+        ++_saveCount;
+        SaveTime.observe(elapsedMs);
+        if (!success)
+        {
+            ++_saveFailures;
+            ++SaveFailures;
+        }
+
+        const std::string message = "docsave " + std::to_string(getPid()) + ' ' +
+                                    (success ? "ok " : "failed ") + std::to_string(_lastSaveMs);
+        const bool again = _isSaveRequested;
+        _isSaveRequested = false;
+        _isSaving = again;
+        lock.unlock();
+
+        Admin::instance().notify(message);
+        if (!again)
+        {
+            return;
+        }
+    }
+}
+
+std::string DocumentBroker::getSaveStats() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    std::ostringstream oss;
+    oss << "saves=" << _saveCount
+        << " failures=" << _saveFailures
+        << " merged=" << _saveMerged
+        << " skipped=" << _saveSkipped
+        << " skipped_bytes=" << _saveSkippedBytes
+        << " last_ms=" << _lastSaveMs
+        << " max_ms=" << _maxSaveMs;
+    return oss.str();
+}
+
 bool DocumentBroker::autoSave(const bool force, const size_t waitTimeoutMs)
 {
     std::unique_lock<std::mutex> lock(_mutex);
@@ -248,13 +471,7 @@ bool DocumentBroker::autoSave(const bool force, const size_t waitTimeoutMs)
     }
     else if (_isModified)
     {
-        // Find the most recent activity.
-        double inactivityTimeMs = std::numeric_limits<double>::max();
-        for (auto& sessionIt: _sessions)
-        {
-            inactivityTimeMs = std::min(sessionIt.second->getInactivityMS(), inactivityTimeMs);
-        }
-
+        const auto inactivityTimeMs = getInactivityTimeMs();
         Log::trace("Most recent activity was " + std::to_string((int)inactivityTimeMs) + " ms ago.");
         const auto timeSinceLastSaveMs = getTimeSinceLastSaveMs();
         Log::trace("Time since last save is " + std::to_string((int)timeSinceLastSaveMs) + " ms.");
@@ -306,6 +523,322 @@ bool DocumentBroker::sendUnoSave()
     return false;
 }
 
+double DocumentBroker::getInactivityTimeMs() const
+{
+    Util::assertIsLocked(_mutex);
+
+    // Find the most recent activity.
+    double inactivityTimeMs = std::numeric_limits<double>::max();
+    for (auto& sessionIt: _sessions)
+    {
+        inactivityTimeMs = std::min(sessionIt.second->getInactivityMS(), inactivityTimeMs);
+    }
+
+    return inactivityTimeMs;
+}
+
+bool DocumentBroker::trimKitMemory()
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_isLoaded || !_childProcess || _sessions.empty())
+    {
+        return false;
+    }
+
+    const auto now = std::chrono::steady_clock::now();
+    const double sinceTrimMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - _lastKitTrimTime).count();
+    if (_lastKitTrimTime != std::chrono::steady_clock::time_point() &&
+        getInactivityTimeMs() >= sinceTrimMs)
+    {
+        // Nothing rendered since.
+        return false;
+    }
+
+    const std::string message = "trimmemory";
+    Log::debug("DocBroker to Child: " + message);
+    _childProcess->getWebSocket()->sendFrame(message.data(), message.size());
+    _lastKitTrimTime = now;
+    return true;
+}
+
+void DocumentBroker::prerenderFonts()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (!_childProcess)
+    {
+        return;
+    }
+
+    Log::info("Asking the kit of doc [" + _docKey + "] to render the previews of the fonts.");
+    sendRenderRequest("renderfonts");
+}
+
+size_t DocumentBroker::prerenderThumbnails(const int thumbnailSize)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (!_isLoaded || _isHibernated || _isResuming || !_childProcess || _sessions.empty() ||
+        thumbnailSize <= 0 || getInactivityTimeMs() < ThumbnailIdleMs)
+    {
+        return 0;
+    }
+
+    {
+        auto tilesBeingRenderedLock = _tileCache->getTilesBeingRenderedLock();
+        if (_tileCache->hasTilesBeingRendered())
+        {
+            // Busy, or those of the last time are not back yet.
+            return 0;
+        }
+    }
+
+    LibreOfficeKitDocumentType type;
+    int parts = 0;
+    int currentPart = 0;
+    int width = 0;
+    int height = 0;
+    // The names of the parts follow, a line each.
+    const std::string status = LOOLProtocol::getFirstLine(_tileCache->getTextFile("status.txt"));
+    if (status.empty() || !LOOLProtocol::parseStatus(status, type, parts, currentPart, width, height) ||
+        type != LOK_DOCTYPE_PRESENTATION || width <= 0 || height <= 0)
+    {
+        return 0;
+    }
+
+    // Fit in a square, as loleaflet asks for them.
+    const int thumbnailWidth = (width >= height ? thumbnailSize
+                                                : static_cast<int>(std::lround(static_cast<double>(thumbnailSize) * width / height)));
+    const int thumbnailHeight = (width >= height ? static_cast<int>(std::lround(static_cast<double>(thumbnailSize) * height / width))
+                                                 : thumbnailSize);
+
+    size_t requested = 0;
+    for (int part = 0; part < parts; ++part)
+    {
+        TileDesc tile(part, thumbnailWidth, thumbnailHeight, 0, 0, width, height, -1, 0, part);
+        if (_tileCache->hasTile(tile))
+        {
+            continue;
+        }
+
+        // No one to send it to, but the viewers asking meanwhile.
+        tile.setVersion(++_tileVersion);
+        _tileCache->isTileBeingRenderedIfSoSubscribe(tile, nullptr);
+        sendRenderRequest("tile " + tile.serialize());
+        ++requested;
+    }
+
+    if (requested > 0)
+    {
+        Log::info() << "Prerendering " << requested << " thumbnails of the " << parts
+                    << " slides of doc [" << _docKey << "]." << Log::end;
+    }
+
+    return requested;
+}
+
+size_t DocumentBroker::renderInvalidatedTiles(const std::vector<TileInvalidation::Area>& areas,
+                                              const TileInvalidation::View& view)
+{
+    const auto visibleTiles = TileInvalidation::getVisibleTiles(areas, view, MaxRenderedAheadTiles);
+    if (visibleTiles.empty())
+    {
+        return 0;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    const int version = ++_tileVersion;
+    std::vector<TileDesc> tiles;
+    for (const auto& area : visibleTiles)
+    {
+        TileDesc tile(area._part, view._tilePixelWidth, view._tilePixelHeight,
+                      area._x, area._y, area._width, area._height, version);
+
+        // No one to send it to, but the view asking for it next.
+        if (!_tileCache->hasTile(tile) && _tileCache->isTileBeingRenderedIfSoSubscribe(tile, nullptr) == version)
+        {
+            tiles.push_back(tile);
+        }
+    }
+
+    if (tiles.empty())
+    {
+        return 0;
+    }
+
+    // All of the same size, and by part already.
+    size_t paints = 0;
+    for (auto first = tiles.begin(); first != tiles.end(); )
+    {
+        const auto last = std::find_if(first, tiles.end(),
+                                       [first](const TileDesc& tile) { return tile.getPart() != first->getPart(); });
+        auto tileCombined = TileCombined::parse(first->serialize("tilecombine"));
+        for (const auto& group : TileCoalescer::coalesce(std::vector<TileDesc>(first, last), MaxCombinedRenderPixels))
+        {
+            tileCombined.getTiles() = group;
+            sendRenderRequest("tilecombine " + tileCombined.serialize());
+            ++paints;
+        }
+
+        first = last;
+    }
+
+    TilesRenderedAhead += tiles.size();
+    Log::debug() << "Rendering ahead " << tiles.size() << " invalidated tiles in " << paints
+                 << " paints for doc [" << _docKey << "]." << Log::end;
+    return tiles.size();
+}
+
+bool DocumentBroker::unload(const std::string& reason)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (!_isLoaded || _isModified || _markToDestroy || _sessions.empty())
+    {
+        return false;
+    }
+
+    Log::info("Unloading doc [" + _docKey + "]: " + reason + ".");
+    for (auto& sessionIt: _sessions)
+    {
+        // The session goes as if the client closed it, and with the last the document.
+        sessionIt.second->shutdown(Poco::Net::WebSocket::WS_ENDPOINT_GOING_AWAY, reason);
+    }
+
+    _markToDestroy = true;
+    return true;
+}
+
+bool DocumentBroker::hibernate()
+{
+    std::unique_lock<std::mutex> resumeLock(_resumeMutex);
+
+    std::shared_ptr<ChildProcess> childProcess;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (_isHibernated || !_isLoaded || _isModified || _isSaving || _markToDestroy ||
+            _sessions.empty() || !_storage || !_childProcess)
+        {
+            return false;
+        }
+
+        {
+            // The renders under way would never come.
+            std::unique_lock<std::mutex> tileBeingRenderedLock(_tileCache->getTilesBeingRenderedLock());
+            if (_tileCache->hasTilesBeingRendered())
+            {
+                return false;
+            }
+        }
+
+        _hibernatedModifiedTime = _storage->getFileInfo(_uriPublic)._modifiedTime;
+
+        Log::info() << "Hibernating doc [" << _docKey << "], idle for "
+                    << static_cast<size_t>(getInactivityTimeMs() / 1000) << " s." << Log::end;
+        for (auto& sessionIt : _sessions)
+        {
+            sessionIt.second->detachPeer();
+        }
+
+        // The local copy goes with the jail.
+        _storage.reset();
+        _isLoaded = false;
+        _isHibernated = true;
+        _isResumeStarted = false;
+        childProcess = std::move(_childProcess);
+    }
+
+    childProcess->close(true);
+    return true;
+}
+
+bool DocumentBroker::resume()
+{
+    std::unique_lock<std::mutex> resumeLock(_resumeMutex);
+    if (!_isHibernated)
+    {
+        return isAlive();
+    }
+
+    Log::info("Resuming doc [" + _docKey + "].");
+    auto childProcess = LOOLWSD::getNewChild();
+    if (!childProcess)
+    {
+        Log::error("Failed to get a new child to resume doc [" + _docKey + "].");
+        std::lock_guard<std::mutex> lock(_mutex);
+        _isResumeStarted = false;
+        return false;
+    }
+
+    childProcess->setDocumentBroker(shared_from_this());
+
+    std::vector<std::shared_ptr<ClientSession>> sessions;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _childProcess = childProcess;
+        _isHibernated = false;
+        _isResuming = true;
+        for (auto& sessionIt : _sessions)
+        {
+            const std::string message = "session " + sessionIt.first + " " + _docKey + "\n";
+            Log::debug("DocBroker to Child: " + message.substr(0, message.length() - 1));
+            _childProcess->getWebSocket()->sendFrame(message.data(), message.size());
+            sessions.push_back(sessionIt.second);
+        }
+    }
+
+    // Each session connects from the kit, which loads the document anew.
+    bool resumed = true;
+    for (auto& session : sessions)
+    {
+        if (!LOOLWSD::waitForChildSession(session->getId()) || !session->reload())
+        {
+            Log::error(session->getName() + " failed to connect to the resumed doc [" + _docKey + "].");
+            resumed = false;
+            break;
+        }
+    }
+
+    if (!resumed)
+    {
+        // The clients reconnect and load it as usual.
+        for (auto& session : sessions)
+        {
+            session->shutdown(Poco::Net::WebSocket::WS_ENDPOINT_GOING_AWAY, SERVICE_UNAVALABLE_INTERNAL_ERROR);
+        }
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        _markToDestroy = true;
+        _isResuming = false;
+
+        // The renders requested meanwhile will never come, nor go to their subscribers.
+        if (_tileCache)
+        {
+            std::unique_lock<std::mutex> tileBeingRenderedLock(_tileCache->getTilesBeingRenderedLock());
+            for (const auto& request : _pendingRenderRequests)
+            {
+                const auto command = LOOLProtocol::getFirstToken(request);
+                if (command == "tile")
+                {
+                    _tileCache->forgetTileBeingRendered(TileDesc::parse(request));
+                }
+                else if (command == "tilecombine")
+                {
+                    const auto tileCombined = TileCombined::parse(request);
+                    for (const auto& tile : tileCombined.getTiles())
+                    {
+                        _tileCache->forgetTileBeingRendered(tile);
+                    }
+                }
+            }
+        }
+
+        Log::info() << "Dropping " << _pendingRenderRequests.size()
+                    << " pending render requests of doc [" << _docKey << "]." << Log::end;
+        _pendingRenderRequests.clear();
+    }
+
+    return resumed;
+}
+
 std::string DocumentBroker::getJailRoot() const
 {
     assert(!_jailId.empty());
@@ -330,6 +863,11 @@ size_t DocumentBroker::addSession(std::shared_ptr<ClientSession>& session)
     const std::string aMessage = "session " + id + " " + _docKey + "\n";
 
     std::lock_guard<std::mutex> lock(_mutex);
+    if (_isHibernated)
+    {
+        // The caller must resume first.
+        throw std::runtime_error("Adding a session to hibernated doc [" + _docKey + "].");
+    }
 
     // Request a new session from the child kit.
     Log::debug("DocBroker to Child: " + aMessage.substr(0, aMessage.length() - 1));
@@ -397,9 +935,23 @@ size_t DocumentBroker::removeSession(const std::string& id)
     return _sessions.size();
 }
 
+void DocumentBroker::post(WorkQueue::Task task)
+{
+    std::unique_lock<std::mutex> lock(_workQueueMutex);
+    if (!_workQueue)
+    {
+        _workQueue.reset(new WorkQueue("doc_work"));
+    }
+
+    _workQueue->post(std::move(task));
+}
+
 bool DocumentBroker::handleInput(const std::vector<char>& payload)
 {
-    Log::trace("DocumentBroker got child message: [" + LOOLProtocol::getAbbreviatedMessage(payload) + "].");
+    if (Log::traceEnabled())
+    {
+        Log::trace("DocumentBroker got child message: [" + LOOLProtocol::getAbbreviatedMessage(payload) + "].");
+    }
 
     const auto command = LOOLProtocol::getFirstToken(payload);
     if (command == "tile:")
@@ -410,6 +962,53 @@ bool DocumentBroker::handleInput(const std::vector<char>& payload)
     {
        handleTileCombinedResponse(payload);
     }
+    else if (command == "tiledelta:")
+    {
+        handleTileDeltaResponse(payload);
+    }
+    else if (command == "tilepreview:")
+    {
+        handleTilePreviewResponse(payload);
+    }
+    else if (command == "renderfont:")
+    {
+        handleFontResponse(payload);
+    }
+    else if (command == "trace:")
+    {
+        const std::string message(payload.data(), payload.size());
+        Trace::mergeEvents(message.substr(command.size()));
+    }
+    else if (command == "startup:")
+    {
+        const std::string message(payload.data(), payload.size());
+        Startup::merge(message.substr(command.size()));
+
+        // Measured from here, the kit having no /proc in its jail.
+        Util::MemoryStats stats;
+        if (Util::getMemoryStats(getPid(), stats))
+        {
+            Startup::recordKitMemory(stats.uss, stats.pss);
+        }
+    }
+    else if (command == "metrics:")
+    {
+        const std::string message(payload.data(), payload.size());
+        if (Metrics::instance().mergeDeltas(message.substr(command.size())) == 0)
+        {
+            Log::warn("Bad metrics from child: [" + message + "].");
+        }
+
+        // The paints of this document, for the admin console.
+        const std::string paint = " loolkit_paint_seconds=";
+        const auto pos = message.find(paint);
+        Histogram paints;
+        if (pos != std::string::npos &&
+            paints.mergeDelta(message.substr(pos + paint.size(), message.find(' ', pos + 1) - pos - paint.size())))
+        {
+            Admin::instance().addRenderTime(_docKey, paints.getCount(), paints.getSumMs());
+        }
+    }
 
     return true;
 }
@@ -421,9 +1020,12 @@ void DocumentBroker::handleTileRequest(TileDesc& tile,
 
     tile.setVersion(++_tileVersion);
     const auto tileMsg = tile.serialize();
-    Log::trace() << "Tile request for " << tile.serialize() << Log::end;
+    if (Log::traceEnabled())
+    {
+        Log::trace() << "Tile request for " << tile.serialize() << Log::end;
+    }
 
-    std::unique_ptr<std::fstream> cachedTile = _tileCache->lookupTile(tile);
+    const auto cachedTile = _tileCache->lookupTile(tile);
     if (cachedTile)
     {
 #if ENABLE_DEBUG
@@ -432,31 +1034,114 @@ void DocumentBroker::handleTileRequest(TileDesc& tile,
         const std::string response = tile.serialize("tile:") + "\n";
 #endif
 
-        std::vector<char> output;
-        output.reserve(4 * tile.getWidth() * tile.getHeight());
-        output.resize(response.size());
-        std::memcpy(output.data(), response.data(), response.size());
-
-        assert(cachedTile->is_open());
-        cachedTile->seekg(0, std::ios_base::end);
-        size_t pos = output.size();
-        std::streamsize size = cachedTile->tellg();
-        output.resize(pos + size);
-        cachedTile->seekg(0, std::ios_base::beg);
-        cachedTile->read(output.data() + pos, size);
-        cachedTile->close();
-
-        session->sendBinaryFrame(output.data(), output.size());
+        // Sent from the cache, which the shared tile keeps alive meanwhile.
+        session->sendBinaryFrame({ IoUtil::getBuffer(response.data(), response.size()),
+                                   IoUtil::getBuffer(cachedTile->data(), cachedTile->size()) });
+        session->setTileVersion(TileCache::cacheFileName(tile), tile.getVersion(), _tileCache->getRenderVersion(tile));
+        Trace::record(tile.getTraceId(), Trace::Stage::CacheHit);
         return;
     }
 
-    if (tileCache().isTileBeingRenderedIfSoSubscribe(tile, session) > 0)
+    if (LOOLWSD::TilePlaceholders && tile.getId() < 0)
+    {
+        sendPlaceholders({ tile }, session);
+    }
+
+    const int ver = tileCache().isTileBeingRenderedIfSoSubscribe(tile, session);
+    if (ver > 0)
     {
         Log::debug() << "Sending render request for tile (" << tile.getPart() << ',' << tile.getTilePosX() << ',' << tile.getTilePosY() << ")." << Log::end;
 
+        // A stalled render is requested again as the version the cache waits for.
+        tile.setVersion(ver);
+
         // Forward to child to render.
-        const std::string request = "tile " + tile.serialize();
-        _childProcess->getWebSocket()->sendFrame(request.data(), request.size());
+        sendRenderRequest("tile " + tile.serialize());
+        Trace::record(tile.getTraceId(), Trace::Stage::RenderRequest);
+    }
+}
+
+void DocumentBroker::sendCachedTiles(const TileCombined& tileCombined,
+                                     const std::vector<TileDesc>& tiles,
+                                     const std::vector<TileCache::Tile>& data,
+                                     const std::shared_ptr<ClientSession>& session)
+{
+    if (tiles.empty())
+    {
+        return;
+    }
+
+    // All sent as of the version of the request.
+    for (const auto& tile : tiles)
+    {
+        session->setTileVersion(TileCache::cacheFileName(tile), tileCombined.getVersion(),
+                                _tileCache->getRenderVersion(tile));
+    }
+
+    if (tiles.size() > 1 && session->canReceiveCombinedTiles())
+    {
+        // One frame with all the images back to back, in the order of imgsize.
+        TileCombined combined(tileCombined);
+        combined.getTiles() = tiles;
+#if ENABLE_DEBUG
+        const std::string response = combined.serialize("tilecombine:") + " renderid=cached\n";
+#else
+        const std::string response = combined.serialize("tilecombine:") + "\n";
+#endif
+
+        std::vector<iovec> buffers;
+        buffers.reserve(data.size() + 1);
+        buffers.push_back(IoUtil::getBuffer(response.data(), response.size()));
+        for (const auto& tile : data)
+        {
+            buffers.push_back(IoUtil::getBuffer(tile->data(), tile->size()));
+        }
+
+        session->sendBinaryFrame(buffers);
+        return;
+    }
+
+    for (size_t i = 0; i < tiles.size(); ++i)
+    {
+        TileDesc tile(tiles[i]);
+        tile.setVersion(tileCombined.getVersion());
+#if ENABLE_DEBUG
+        const std::string response = tile.serialize("tile:") + " renderid=cached\n";
+#else
+        const std::string response = tile.serialize("tile:") + "\n";
+#endif
+
+        session->sendBinaryFrame({ IoUtil::getBuffer(response.data(), response.size()),
+                                   IoUtil::getBuffer(data[i]->data(), data[i]->size()) });
+    }
+}
+
+void DocumentBroker::sendPlaceholders(const std::vector<TileDesc>& tiles,
+                                      const std::shared_ptr<ClientSession>& session)
+{
+    if (tiles.empty())
+    {
+        return;
+    }
+
+    const auto placeholders = _tileCache->getPlaceholders(tiles);
+    for (size_t i = 0; i < tiles.size(); ++i)
+    {
+        if (!placeholders[i])
+        {
+            continue;
+        }
+
+        // Older than any render, for the client to replace it. Nor the
+        // base of a delta: the render is to be sent whole.
+        session->resetTileVersion(TileCache::cacheFileName(tiles[i]));
+        TileDesc placeholder(tiles[i]);
+        placeholder.setVersion(0);
+        placeholder.setImgSize(placeholders[i]->size());
+        const std::string response = placeholder.serialize("tile:") + "\n";
+
+        session->sendBinaryFrame({ IoUtil::getBuffer(response.data(), response.size()),
+                                   IoUtil::getBuffer(placeholders[i]->data(), placeholders[i]->size()) });
     }
 }
 
@@ -466,100 +1151,185 @@ void DocumentBroker::handleTileCombinedRequest(TileCombined& tileCombined,
     std::unique_lock<std::mutex> lock(_mutex);
 
     tileCombined.setVersion(++_tileVersion);
-    Log::trace() << "TileCombined request for " << tileCombined.serialize() << Log::end;
+    if (Log::traceEnabled())
+    {
+        Log::trace() << "TileCombined request for " << tileCombined.serialize() << Log::end;
+    }
 
     // Satisfy as many tiles from the cache.
-    // The rest, group by rows.
-    std::map<int, std::vector<TileDesc>> rows;
+    // The rest, group into rectangles to render.
+    std::vector<TileDesc> residualTiles;
+    std::vector<TileDesc> cachedTiles;
+    std::vector<TileCache::Tile> cachedData;
+    std::vector<TileDesc> missingTiles;
     for (auto& tile : tileCombined.getTiles())
     {
-        std::unique_ptr<std::fstream> cachedTile = _tileCache->lookupTile(tile);
+        const auto cachedTile = _tileCache->lookupTile(tile);
         if (cachedTile)
         {
-            //TODO: Combine.
-#if ENABLE_DEBUG
-            const std::string response = tile.serialize("tile:") + " renderid=cached\n";
-#else
-            const std::string response = tile.serialize("tile:") + "\n";
-#endif
-
-            std::vector<char> output;
-            output.reserve(4 * tile.getWidth() * tile.getHeight());
-            output.resize(response.size());
-            std::memcpy(output.data(), response.data(), response.size());
-
-            assert(cachedTile->is_open());
-            cachedTile->seekg(0, std::ios_base::end);
-            size_t pos = output.size();
-            std::streamsize size = cachedTile->tellg();
-            output.resize(pos + size);
-            cachedTile->seekg(0, std::ios_base::beg);
-            cachedTile->read(output.data() + pos, size);
-            cachedTile->close();
-
-            session->sendBinaryFrame(output.data(), output.size());
-            continue;
+            tile.setImgSize(cachedTile->size());
+            cachedTiles.emplace_back(tile);
+            cachedData.emplace_back(cachedTile);
         }
         else
         {
-            tile.setVersion(_tileVersion);
-            const auto ver = tileCache().isTileBeingRenderedIfSoSubscribe(tile, session);
-            if (ver <= 0)
-            {
-                // Already rendering. Skip.
-                continue;
-            }
-            else
-            if (_cursorPosX >= tile.getTilePosX() && _cursorPosX <= tile.getTilePosX() + tile.getTileWidth() &&
-                _cursorPosY >= tile.getTilePosY() && _cursorPosY <= tile.getTilePosY() + tile.getTileHeight())
-            {
-                // If this tile is right under the cursor, give it priority.
-                const auto req = tile.serialize("tile");
-                Log::debug() << "Priority tile request: " << req << Log::end;
-                _childProcess->getWebSocket()->sendFrame(req.data(), req.size());
-
-                // No need to process with the group anymore.
-                continue;
-            }
+            missingTiles.emplace_back(tile);
         }
+    }
+
+    sendCachedTiles(tileCombined, cachedTiles, cachedData, session);
+    if (!cachedTiles.empty())
+    {
+        Trace::record(tileCombined.getTraceId(), Trace::Stage::CacheHit);
+    }
 
-        const auto tilePosY = tile.getTilePosY();
-        auto it = rows.lower_bound(tilePosY);
-        if (it != rows.end())
+    // Before any render is requested, which could be back first.
+    if (LOOLWSD::TilePlaceholders && tileCombined.getId() < 0)
+    {
+        sendPlaceholders(missingTiles, session);
+    }
+
+    for (auto& tile : missingTiles)
+    {
+        tile.setVersion(_tileVersion);
+        const auto ver = tileCache().isTileBeingRenderedIfSoSubscribe(tile, session);
+        if (ver <= 0)
+        {
+            // Already rendering. Skip.
+            continue;
+        }
+        else if (ver != tile.getVersion())
         {
-            it->second.emplace_back(tile);
+            // Stalled, requested again apart, as the version the cache waits for.
+            tile.setVersion(ver);
+            sendRenderRequest(tile.serialize("tile"));
+            continue;
         }
         else
+        if (_cursorPosX >= tile.getTilePosX() && _cursorPosX <= tile.getTilePosX() + tile.getTileWidth() &&
+            _cursorPosY >= tile.getTilePosY() && _cursorPosY <= tile.getTilePosY() + tile.getTileHeight())
         {
-            rows.emplace_hint(it, tilePosY, std::vector<TileDesc>({ tile }));
+            // If this tile is right under the cursor, give it priority.
+            const auto req = tile.serialize("tile");
+            Log::debug() << "Priority tile request: " << req << Log::end;
+            sendRenderRequest(req);
+            Trace::record(tile.getTraceId(), Trace::Stage::RenderRequest);
+
+            // No need to process with the group anymore.
+            continue;
         }
+
+        residualTiles.emplace_back(tile);
     }
 
-    if (rows.empty())
+    if (residualTiles.empty())
     {
         // Done.
         return;
     }
 
+    const auto groups = TileCoalescer::coalesce(residualTiles, MaxCombinedRenderPixels);
+
+    ++_tileCombinedRenderRequests;
+    _tileCombinedRenders += groups.size();
+    Log::debug() << "STATISTICS: tilecombine of " << residualTiles.size() << " tiles rendered in "
+                 << groups.size() << " paints, "
+                 << static_cast<double>(_tileCombinedRenders) / _tileCombinedRenderRequests
+                 << " paints per request on average." << Log::end;
+
     auto& tiles = tileCombined.getTiles();
-    for (auto& row : rows)
+    for (const auto& group : groups)
     {
-        tiles = row.second;
+        tiles = group;
         const auto tileMsg = tileCombined.serialize();
         Log::debug() << "TileCombined residual request for " << tileMsg << Log::end;
 
         // Forward to child to render.
-        const std::string request = "tilecombine " + tileMsg;
+        sendRenderRequest("tilecombine " + tileMsg);
+        Trace::record(tileCombined.getTraceId(), Trace::Stage::RenderRequest);
+    }
+}
+
+void DocumentBroker::cancelTileRequests(const std::shared_ptr<ClientSession>& session,
+                                        const std::function<bool(const TileDesc&)>& isObsolete)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    const auto versions = tileCache().cancelTiles(session, isObsolete);
+    if (versions.empty())
+    {
+        return;
+    }
+
+    // After the requests it cancels, before any later one, on the same socket.
+    std::string request = "canceltiles ver=";
+    for (size_t i = 0; i < versions.size(); ++i)
+    {
+        request += (i > 0 ? "," : "") + std::to_string(versions[i]);
+    }
+
+    Log::debug("Cancelling the render requests of " + session->getName() + ": " + request);
+    sendRenderRequest(request);
+}
+
+void DocumentBroker::sendTransferProgress(const std::string& operation, const size_t done, const size_t total)
+{
+    Util::assertIsLocked(_mutex);
+
+    const std::string message = "transferprogress: " + operation + " " + std::to_string(done * 100 / total);
+    for (auto& sessionIt : _sessions)
+    {
+        sessionIt.second->sendTextFrame(message);
+    }
+}
+
+void DocumentBroker::sendRenderRequest(const std::string& request)
+{
+    Util::assertIsLocked(_mutex);
+
+    if (!_isHibernated && !_isResuming)
+    {
         _childProcess->getWebSocket()->sendFrame(request.data(), request.size());
+        return;
+    }
+
+    _pendingRenderRequests.push_back(request);
+    if (_isHibernated && !_isResumeStarted)
+    {
+        // Not on this thread, which goes on serving the cached tiles meanwhile.
+        _isResumeStarted = true;
+        auto docBroker = shared_from_this();
+        std::thread([docBroker]()
+            {
+                Util::setThreadName("doc_resume");
+                docBroker->resume();
+            }).detach();
     }
 }
 
+void DocumentBroker::handleFontResponse(const std::vector<char>& payload)
+{
+    const std::string firstLine = getFirstLine(payload);
+    StringTokenizer tokens(firstLine, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+    std::string font;
+    if (firstLine.size() >= payload.size() ||
+        !getTokenString(tokens, "font", font))
+    {
+        Log::error("Bad font preview from child: [" + firstLine + "].");
+        return;
+    }
+
+    const auto offset = firstLine.size() + 1;
+    FontCache::instance().add(FontCache::getName(font), payload.data() + offset, payload.size() - offset);
+}
+
 void DocumentBroker::handleTileResponse(const std::vector<char>& payload)
 {
     const std::string firstLine = getFirstLine(payload);
     try
     {
         auto tile = TileDesc::parse(firstLine);
+        Trace::record(tile.getTraceId(), Trace::Stage::BrokerResponse);
         const auto buffer = payload.data();
         const auto length = payload.size();
 
@@ -590,11 +1360,15 @@ void DocumentBroker::handleTileResponse(const std::vector<char>& payload)
 void DocumentBroker::handleTileCombinedResponse(const std::vector<char>& payload)
 {
     const std::string firstLine = getFirstLine(payload);
-    Log::debug("Handling tile combined: " + firstLine);
+    if (Log::debugEnabled())
+    {
+        Log::debug("Handling tile combined: " + firstLine);
+    }
 
     try
     {
         auto tileCombined = TileCombined::parse(firstLine);
+        Trace::record(tileCombined.getTraceId(), Trace::Stage::BrokerResponse);
         const auto buffer = payload.data();
         const auto length = payload.size();
         auto offset = firstLine.size() + 1;
@@ -625,6 +1399,58 @@ void DocumentBroker::handleTileCombinedResponse(const std::vector<char>& payload
     }
 }
 
+void DocumentBroker::handleTileDeltaResponse(const std::vector<char>& payload)
+{
+    const std::string firstLine = getFirstLine(payload);
+    try
+    {
+        StringTokenizer tokens(firstLine, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+        const auto tile = TileDesc::parse(tokens);
+
+        int baseVersion = -1;
+        for (size_t i = 0; i < tokens.count(); ++i)
+        {
+            if (getTokenInteger(tokens[i], "basever", baseVersion))
+            {
+                break;
+            }
+        }
+
+        // Passed on as is, to the clients that have the base.
+        tileCache().saveTileDelta(tile, baseVersion, payload.data(), payload.size());
+    }
+    catch (const std::exception& exc)
+    {
+        Log::error("Failed to process tile delta [" + firstLine + "]: " + exc.what() + ".");
+    }
+}
+
+void DocumentBroker::handleTilePreviewResponse(const std::vector<char>& payload)
+{
+    const std::string firstLine = getFirstLine(payload);
+    try
+    {
+        const auto tileCombined = TileCombined::parse(firstLine);
+        auto offset = firstLine.size() + 1;
+        for (const auto& tile : tileCombined.getTiles())
+        {
+            if (offset + tile.getImgSize() > payload.size())
+            {
+                Log::error("Truncated tile preview [" + firstLine + "].");
+                return;
+            }
+
+            // Not cached: only for those waiting for the tile in full.
+            tileCache().notifyPreview(tile, payload.data() + offset, tile.getImgSize());
+            offset += tile.getImgSize();
+        }
+    }
+    catch (const std::exception& exc)
+    {
+        Log::error("Failed to process tile preview [" + firstLine + "]: " + exc.what() + ".");
+    }
+}
+
 bool DocumentBroker::canDestroy()
 {
     std::unique_lock<std::mutex> lock(_mutex);
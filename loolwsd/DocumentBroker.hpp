@@ -15,19 +15,25 @@
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <functional>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <vector>
 
+#include <Poco/Timestamp.h>
 #include <Poco/URI.h>
 #include <Poco/Net/WebSocket.h>
 
 #include "IoUtil.hpp"
 #include "Log.hpp"
+#include "SocketPoll.hpp"
 #include "TileCache.hpp"
+#include "TileCacheQuota.hpp"
 #include "Util.hpp"
+#include "WorkQueue.hpp"
 
 // Forwards.
 class StorageBase;
@@ -40,12 +46,27 @@ class ChildProcess
 public:
     /// @param pid is the process ID of the child.
     /// @param ws is the control WebSocket to the child.
-    ChildProcess(const Poco::Process::PID pid, const std::shared_ptr<Poco::Net::WebSocket>& ws) :
+    /// @param poll, if given, watches the WebSocket instead of a thread of its own.
+    ChildProcess(const Poco::Process::PID pid, const std::shared_ptr<Poco::Net::WebSocket>& ws,
+                 const std::shared_ptr<SocketPoll>& poll = nullptr) :
         _pid(pid),
         _ws(ws),
+        _poll(poll),
         _stop(false)
     {
-        _thread = std::thread([this]() { this->socketProcessor(); });
+        if (poll)
+        {
+            poll->add(_ws,
+                      [this](const std::vector<char>& payload) { return this->handleInput(payload); },
+                      []() { },
+                      []() { });
+        }
+        else
+        {
+            _wakeup = std::make_shared<IoUtil::Wakeup>();
+            _thread = std::thread([this]() { this->socketProcessor(); });
+        }
+
         Log::info("ChildProcess ctor [" + std::to_string(_pid) + "].");
     }
 
@@ -70,8 +91,23 @@ public:
     void close(const bool rude)
     {
         _stop = true;
+        if (_wakeup)
+        {
+            _wakeup->wake();
+        }
+
+        auto poll = _poll.lock();
+        if (poll && _ws)
+        {
+            poll->remove(_ws);
+        }
+
         IoUtil::shutdownWebSocket(_ws);
-        _thread.join();
+        if (_thread.joinable())
+        {
+            _thread.join();
+        }
+
         _ws.reset();
         if (_pid != -1)
         {
@@ -110,11 +146,17 @@ public:
 private:
     void socketProcessor();
 
+    /// Handles a message of the child, returns false to stop.
+    bool handleInput(const std::vector<char>& payload);
+
 private:
     Poco::Process::PID _pid;
     std::shared_ptr<Poco::Net::WebSocket> _ws;
+    std::weak_ptr<SocketPoll> _poll;
     std::weak_ptr<DocumentBroker> _docBroker;
     std::thread _thread;
+    /// Wakes up _thread to stop.
+    std::shared_ptr<IoUtil::Wakeup> _wakeup;
     std::atomic<bool> _stop;
 };
 
@@ -125,7 +167,7 @@ class ClientSession;
 /// in jail and brokering loading it from Storage
 /// and saving it back.
 /// Contains URI, physical path, etc.
-class DocumentBroker
+class DocumentBroker : public std::enable_shared_from_this<DocumentBroker>
 {
 public:
 
@@ -146,6 +188,10 @@ public:
         Log::info() << "~DocumentBroker [" << _uriPublic.toString()
                     << "] destroyed with " << getSessionsCount()
                     << " sessions left." << Log::end;
+
+        // Its cache is done with once its tiles are.
+        _tileCache.reset();
+        TileCacheQuota::instance().close(_cacheRoot, std::time(nullptr));
     }
 
     void validate(const Poco::URI& uri);
@@ -153,10 +199,18 @@ public:
     /// Loads a document from the public URI into the jail.
     bool load(const std::string& jailId);
     bool isLoaded() const { return _isLoaded; }
-    void setLoaded() { _isLoaded = true; }
+    void setLoaded();
 
     /// Save the document to Storage if needs persisting.
     bool save();
+
+    /// Saves the document on the threads saving the documents, instead of the
+    /// caller's. One save at a time: those requested while saving are merged
+    /// into a single one after it, as the first may have missed the latest edits.
+    void requestSave();
+
+    /// The saves done, failed, merged, skipped and how long they took, for the admin console.
+    std::string getSaveStats() const;
     bool isModified() const { return _isModified; }
     void setModified(const bool value);
 
@@ -176,6 +230,7 @@ public:
     const std::string& getFilename() const { return _filename; };
     TileCache& tileCache() { return *_tileCache; }
     bool isAlive() const { return _childProcess && _childProcess->isAlive(); }
+    Poco::Process::PID getPid() const { return _childProcess ? _childProcess->getPid() : -1; }
     size_t getSessionsCount() const
     {
         std::lock_guard<std::mutex> lock(_mutex);
@@ -189,6 +244,52 @@ public:
         return std::chrono::duration_cast<std::chrono::milliseconds>(duration).count();
     }
 
+    /// @return the time in milliseconds since the last activity in any session.
+    double getIdleTimeMs() const
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        return getInactivityTimeMs();
+    }
+
+    /// Asks the kit to release the memory it keeps for rendering,
+    /// unless it did already and the document was idle since.
+    /// Returns true if asked.
+    bool trimKitMemory();
+
+    /// Has the kit render the previews of all the fonts, in the background,
+    /// for the server-wide FontCache.
+    void prerenderFonts();
+
+    /// Requests the thumbnails of all the slides of a presentation not cached,
+    /// as the slide sorter of the clients asks for them, once the document is
+    /// idle and nothing else is rendering. They are previews, rendered in the
+    /// background by the kit, and kept in the tile cache for the next viewers.
+    /// Returns the number requested.
+    size_t prerenderThumbnails(const int thumbnailSize);
+
+    /// Renders again the tiles of the areas the kit invalidated together that
+    /// the view shows, in as few paints as it can, without waiting for the
+    /// client to ask for them, one round trip later, when they are cached or
+    /// coming. Returns the number requested.
+    size_t renderInvalidatedTiles(const std::vector<TileInvalidation::Area>& areas,
+                                  const TileInvalidation::View& view);
+
+    /// Terminates the kit of the idle document, keeping the sessions and the
+    /// tile cache, which serves them meanwhile. Only if it's loaded and not
+    /// modified, as nothing is saved. Returns true if hibernated.
+    bool hibernate();
+    bool isHibernated() const { return _isHibernated; }
+
+    /// Loads a hibernated document again, into a new kit, for the sessions
+    /// to go on there. Blocks until done, or another thread is done resuming.
+    /// Returns false if not hibernated and there is no kit, or on failure.
+    bool resume();
+
+    /// Closes the sessions so that the document goes, like when the last
+    /// view is closed. Only if it's loaded and not modified, as nothing
+    /// is saved. Returns true if closing.
+    bool unload(const std::string& reason);
+
     std::string getJailRoot() const;
 
     /// Ignore input events from all web socket sessions
@@ -202,6 +303,10 @@ public:
     /// Removes a session by ID. Returns the new number of sessions.
     size_t removeSession(const std::string& id);
 
+    /// Held while a session goes out, so that of those leaving
+    /// together only the last saves and tears down the document.
+    std::mutex& getSessionRemovalMutex() { return _sessionRemovalMutex; }
+
     /// Invalidate the cursor position.
     void invalidateCursor(const int x, const int y)
     {
@@ -214,8 +319,17 @@ public:
     void handleTileCombinedRequest(TileCombined& tileCombined,
                                    const std::shared_ptr<ClientSession>& session);
 
+    /// Drops the subscriptions of the session to the tiles being rendered that
+    /// isObsolete tells it no longer wants, and has the kit cancel the requests
+    /// left without subscribers, which it has not rendered yet.
+    void cancelTileRequests(const std::shared_ptr<ClientSession>& session,
+                            const std::function<bool(const TileDesc&)>& isObsolete);
+
     void handleTileResponse(const std::vector<char>& payload);
     void handleTileCombinedResponse(const std::vector<char>& payload);
+    void handleTileDeltaResponse(const std::vector<char>& payload);
+    void handleTilePreviewResponse(const std::vector<char>& payload);
+    void handleFontResponse(const std::vector<char>& payload);
 
     // Called when the last view is going out.
     bool canDestroy();
@@ -223,14 +337,41 @@ public:
 
     bool handleInput(const std::vector<char>& payload);
 
+    /// Runs the task on the thread of this document, after those posted before.
+    void post(WorkQueue::Task task);
+
 private:
 
     /// Sends the .uno:Save command to LoKit.
     bool sendUnoSave();
 
+    /// Sends the render request to the kit, or keeps it for when the
+    /// document is resumed, starting that.
+    void sendRenderRequest(const std::string& request);
+
+    /// Saves until no save is requested meanwhile.
+    void runSave();
+
+    /// Tells the sessions how far the document is downloaded or uploaded.
+    void sendTransferProgress(const std::string& operation, size_t done, size_t total);
+
+    double getInactivityTimeMs() const;
+
     /// Saves the document to Storage (assuming LO Core saved to local copy).
     bool saveToStorage();
 
+    /// Sends the tiles of tileCombined found in the cache, combined
+    /// into a single 'tilecombine:' frame when the client supports it.
+    void sendCachedTiles(const TileCombined& tileCombined,
+                         const std::vector<TileDesc>& tiles,
+                         const std::vector<TileCache::Tile>& data,
+                         const std::shared_ptr<ClientSession>& session);
+
+    /// Sends the session, at once, the placeholders of the tiles it is to wait for,
+    /// scaled from those cached at another zoom. See TileCache::getPlaceholders.
+    void sendPlaceholders(const std::vector<TileDesc>& tiles,
+                          const std::shared_ptr<ClientSession>& session);
+
 private:
     const Poco::URI _uriPublic;
     const std::string _docKey;
@@ -241,11 +382,22 @@ private:
     std::string _jailId;
     std::string _filename;
     std::chrono::steady_clock::time_point _lastSaveTime;
+    std::chrono::steady_clock::time_point _lastKitTrimTime;
     Poco::Timestamp _lastFileModifiedTime;
     std::map<std::string, std::shared_ptr<ClientSession>> _sessions;
     std::unique_ptr<StorageBase> _storage;
     std::unique_ptr<TileCache> _tileCache;
     std::atomic<bool> _markToDestroy;
+    std::atomic<bool> _isHibernated;
+    /// Loaded into a new kit, until it's ready. Guarded by _mutex.
+    bool _isResuming;
+    bool _isResumeStarted;
+    /// The renders requested meanwhile. Guarded by _mutex.
+    std::vector<std::string> _pendingRenderRequests;
+    /// When the document was last modified in Storage, as of hibernating.
+    Poco::Timestamp _hibernatedModifiedTime;
+    /// Held while hibernating or resuming.
+    std::mutex _resumeMutex;
     int _cursorPosX;
     int _cursorPosY;
     bool _isLoaded;
@@ -253,13 +405,48 @@ private:
     mutable std::mutex _mutex;
     std::condition_variable _saveCV;
     std::mutex _saveMutex;
+    std::mutex _sessionRemovalMutex;
 
     /// Versioning is used to prevent races between
     /// painting and invalidation.
     std::atomic<size_t> _tileVersion;
 
+    /// The tilecombine requests that needed rendering, and the paints
+    /// they took, to tell how well the renders are coalesced.
+    size_t _tileCombinedRenderRequests;
+    size_t _tileCombinedRenders;
+
+    /// Saving on the threads saving the documents, and whether to save again
+    /// once done. Guarded by _mutex, as are the stats below.
+    bool _isSaving;
+    bool _isSaveRequested;
+    /// When the save pending was first requested.
+    std::chrono::steady_clock::time_point _saveRequestTime;
+    size_t _saveCount;
+    size_t _saveFailures;
+    size_t _saveMerged;
+    size_t _lastSaveMs;
+    size_t _maxSaveMs;
+    /// The saves found nothing to upload, by timestamp or content, and
+    /// the bytes not uploaded. Counted by save(), under _saveMutex.
+    std::atomic<size_t> _saveSkipped;
+    std::atomic<size_t> _saveSkippedBytes;
+    /// The hash of the content in Storage, as last downloaded or uploaded.
+    std::string _lastUploadedHash;
+
+    /// Budget of a single combined render, in pixels.
+    static constexpr size_t MaxCombinedRenderPixels = 16 * 256 * 256;
+    /// The tiles of a view rendered again ahead at most, those of a few screens.
+    static constexpr size_t MaxRenderedAheadTiles = 256;
+
     static constexpr auto IdleSaveDurationMs = 30 * 1000;
+    static constexpr auto ThumbnailIdleMs = 5 * 1000;
     static constexpr auto AutoSaveDurationMs = 300 * 1000;
+
+    /// Started by the first post(). Last, to go first, as its
+    /// pending tasks may still use the above.
+    std::mutex _workQueueMutex;
+    std::unique_ptr<WorkQueue> _workQueue;
 };
 
 #endif
@@ -0,0 +1,159 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_EXPIRINGCACHE_HPP
+#define INCLUDED_EXPIRINGCACHE_HPP
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+/// Keeps the values for a short while, for the lookups repeated meanwhile,
+/// like those of many clients opening the same document at once.
+/// At most maxEntries are kept, the oldest going first once full.
+template <typename T>
+class ExpiringCache
+{
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    /// ttlMs of 0 disables it.
+    ExpiringCache(const int ttlMs, const size_t maxEntries) :
+        _ttlMs(ttlMs),
+        _maxEntries(maxEntries),
+        _hits(0),
+        _misses(0)
+    {
+    }
+
+    void setLimits(const int ttlMs, const size_t maxEntries)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _ttlMs = ttlMs;
+        _maxEntries = maxEntries;
+        if (_ttlMs <= 0)
+        {
+            _entries.clear();
+        }
+    }
+
+    /// Sets value and returns true if key has one still fresh.
+    bool get(const std::string& key, T& value, const TimePoint now)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto it = _entries.find(key);
+        if (it != _entries.end())
+        {
+            if (!isExpired(it->second, now))
+            {
+                value = it->second._value;
+                ++_hits;
+                return true;
+            }
+
+            _entries.erase(it);
+        }
+
+        ++_misses;
+        return false;
+    }
+
+    void put(const std::string& key, const T& value, const TimePoint now)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_ttlMs <= 0 || _maxEntries == 0)
+        {
+            return;
+        }
+
+        if (_entries.size() >= _maxEntries && _entries.find(key) == _entries.end())
+        {
+            evict(now);
+        }
+
+        Entry& entry = _entries[key];
+        entry._value = value;
+        entry._time = now;
+    }
+
+    /// For when the value is known to have changed.
+    void erase(const std::string& key)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _entries.erase(key);
+    }
+
+    size_t size()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _entries.size();
+    }
+
+    std::string getStats()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        std::ostringstream oss;
+        oss << "entries=" << _entries.size()
+            << " hits=" << _hits
+            << " misses=" << _misses;
+        return oss.str();
+    }
+
+private:
+    struct Entry
+    {
+        T _value;
+        TimePoint _time;
+    };
+
+    bool isExpired(const Entry& entry, const TimePoint now) const
+    {
+        return std::chrono::duration_cast<std::chrono::milliseconds>(now - entry._time).count() >= _ttlMs;
+    }
+
+    /// Drops the expired entries, or the oldest if none is.
+    void evict(const TimePoint now)
+    {
+        auto oldest = _entries.end();
+        for (auto it = _entries.begin(); it != _entries.end(); )
+        {
+            if (isExpired(it->second, now))
+            {
+                it = _entries.erase(it);
+                continue;
+            }
+
+            if (oldest == _entries.end() || it->second._time < oldest->second._time)
+            {
+                oldest = it;
+            }
+
+            ++it;
+        }
+
+        if (_entries.size() >= _maxEntries && oldest != _entries.end())
+        {
+            _entries.erase(oldest);
+        }
+    }
+
+private:
+    std::mutex _mutex;
+    int _ttlMs;
+    size_t _maxEntries;
+    std::map<std::string, Entry> _entries;
+    size_t _hits;
+    size_t _misses;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
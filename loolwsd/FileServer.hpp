@@ -12,6 +12,7 @@
 
 #include "config.h"
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -36,6 +37,7 @@
 #include <Poco/Util/ServerApplication.h>
 #include <Poco/Util/Timer.h>
 
+#include "AssetCache.hpp"
 #include "Common.hpp"
 #include "LOOLWSD.hpp"
 
@@ -56,6 +58,10 @@ using Poco::Util::Application;
 class FileServerRequestHandler: public HTTPRequestHandler
 {
 public:
+    FileServerRequestHandler(AssetCache& assetCache) :
+        _assetCache(assetCache)
+    {
+    }
 
     /// Evaluate if the cookie exists, and if not, ask for the credentials.
     static bool isAdminLoggedIn(HTTPServerRequest& request, HTTPServerResponse& response)
@@ -71,6 +77,11 @@ public:
                 throw Poco::Net::NotAuthenticatedException("Missing JWT");
 
             const std::string jwtToken = request["Cookie"].substr(pos + 1);
+            if (JWTAuth::isVerified(sslKeyPath, "admin", jwtToken))
+            {
+                return true;
+            }
+
             Log::info("Verifying JWT token: " + jwtToken);
             JWTAuth authAgent(sslKeyPath, "admin", "admin", "admin");
             if (authAgent.verify(jwtToken))
@@ -156,19 +167,19 @@ public:
                 if (extPoint == std::string::npos)
                     throw Poco::FileNotFoundException("Invalid file.");
 
-                const std::string fileType = endPoint.substr(extPoint + 1);
-                std::string mimeType;
-                if (fileType == "js")
-                    mimeType = "application/javascript";
-                else if (fileType == "css")
-                    mimeType = "text/css";
-                else if (fileType == "html")
-                    mimeType = "text/html";
-                else if (fileType == "svg")
-                    mimeType = "image/svg+xml";
-                else
-                    mimeType = "text/plain";
+                const auto asset = _assetCache.find(getRequestPathname(request));
+                if (asset)
+                {
+                    // Versioned, the URI changes with the content; the rest is revalidated.
+                    const bool isVersioned = (requestSegments.size() > 1 && requestSegments[1] == LOOLWSD_VERSION_HASH);
+                    const bool isAdmin = (endPoint.compare(0, 5, "admin") == 0);
+                    sendAsset(request, response, *asset,
+                              isAdmin ? "private, no-cache" :
+                              isVersioned ? "public, max-age=31536000, immutable" : "no-cache");
+                    return;
+                }
 
+                const std::string mimeType = AssetCache::getMimeType(endPoint);
                 response.setContentType(mimeType);
                 response.sendFile(filepath, mimeType);
             }
@@ -213,32 +224,77 @@ private:
         return path;
     }
 
+    void sendAsset(HTTPServerRequest& request, HTTPServerResponse& response,
+                   const AssetCache::Asset& asset, const std::string& cacheControl)
+    {
+        std::string encoding;
+        const std::string& body = asset.select(request.get("Accept-Encoding", ""), encoding);
+        const std::string etag = asset.getETag(encoding);
+
+        response.set("ETag", etag);
+        response.set("Cache-Control", cacheControl);
+        response.set("Vary", "Accept-Encoding");
+        if (_assetCache.isNotModified(request.get("If-None-Match", ""), etag))
+        {
+            response.setStatusAndReason(HTTPResponse::HTTP_NOT_MODIFIED);
+            response.setContentLength(0);
+            response.send();
+            return;
+        }
+
+        if (!encoding.empty())
+        {
+            response.set("Content-Encoding", encoding);
+        }
+
+        response.setContentType(asset._mimeType);
+        response.setContentLength(body.size());
+        response.setChunkedTransferEncoding(false);
+        response.send().write(body.data(), body.size());
+    }
+
     void preprocessFile(HTTPServerRequest& request, HTTPServerResponse& response)
     {
         HTMLForm form(request, request.stream());
 
         const auto host = (LOOLWSD::SSLEnabled ? "wss://" : "ws://") + (LOOLWSD::ServerName.empty() ? request.getHost() : LOOLWSD::ServerName);
-        const auto path = Poco::Path(LOOLWSD::FileServerRoot, getRequestPathname(request));
+        const auto pathname = getRequestPathname(request);
 
-        Log::debug("Preprocessing file: " + path.toString());
+        std::map<std::string, std::string> values;
+        values["ACCESS_TOKEN"] = form.get("access_token", "");
+        values["ACCESS_TOKEN_TTL"] = form.get("access_token_ttl", "");
+        values["HOST"] = host;
+        values["VERSION"] = LOOLWSD_VERSION_HASH;
 
         std::string preprocess;
-        FileInputStream file(path.toString());
-        StreamCopier::copyToString(file, preprocess);
-        file.close();
+        const auto asset = _assetCache.find(pathname);
+        if (asset)
+        {
+            preprocess = asset->_template.render(values);
+        }
+        else
+        {
+            const auto path = Poco::Path(LOOLWSD::FileServerRoot, pathname);
+            Log::debug("Preprocessing file: " + path.toString());
 
-        Poco::replaceInPlace(preprocess, std::string("%ACCESS_TOKEN%"), form.get("access_token", ""));
-        Poco::replaceInPlace(preprocess, std::string("%ACCESS_TOKEN_TTL%"), form.get("access_token_ttl", ""));
-        Poco::replaceInPlace(preprocess, std::string("%HOST%"), host);
-        Poco::replaceInPlace(preprocess, std::string("%VERSION%"), std::string(LOOLWSD_VERSION_HASH));
+            FileInputStream file(path.toString());
+            StreamCopier::copyToString(file, preprocess);
+            file.close();
+            preprocess = AssetCache::Template(preprocess).render(values);
+        }
 
         response.setContentType("text/html");
+        // Has the access token of the request.
+        response.set("Cache-Control", "no-store");
         response.setContentLength(preprocess.length());
         response.setChunkedTransferEncoding(false);
 
         std::ostream& ostr = response.send();
         ostr << preprocess;
     }
+
+private:
+    AssetCache& _assetCache;
 };
 
 class FileServer
@@ -247,6 +303,10 @@ public:
     FileServer()
     {
         Log::info("File server ctor.");
+
+        // The largest of loleaflet are a few MB.
+        _assetCache.load(LOOLWSD::FileServerRoot, "/loleaflet/dist", 32 * 1024 * 1024);
+        Log::info("File server assets loaded: " + _assetCache.getStats());
     }
 
     ~FileServer()
@@ -256,8 +316,11 @@ public:
 
     FileServerRequestHandler* createRequestHandler()
     {
-        return new FileServerRequestHandler();
+        return new FileServerRequestHandler(_assetCache);
     }
+
+private:
+    AssetCache _assetCache;
 };
 
 #endif
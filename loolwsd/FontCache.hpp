@@ -0,0 +1,111 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_FONTCACHE_HPP
+#define INCLUDED_FONTCACHE_HPP
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <Poco/URI.h>
+
+/// The previews of the fonts, as PNG, shared by all the documents: the fonts
+/// are those of the system template, the same in every jail. Built once in
+/// the background by the kit of the first document loaded, and completed with
+/// those any document renders, they are served from memory, without the kits.
+class FontCache
+{
+public:
+    typedef std::shared_ptr<const std::vector<char>> Preview;
+
+    static FontCache& instance()
+    {
+        static FontCache fontCache;
+        return fontCache;
+    }
+
+    /// maxBytes bounds the previews kept, which are never evicted.
+    explicit FontCache(const size_t maxBytes = MaxBytes) :
+        _maxBytes(maxBytes),
+        _bytes(0),
+        _building(false)
+    {
+    }
+
+    FontCache(const FontCache&) = delete;
+    FontCache& operator=(const FontCache&) = delete;
+
+    /// The name of a font as requested, URI-encoded, as kept.
+    static std::string getName(const std::string& encodedName)
+    {
+        std::string name;
+        Poco::URI::decode(encodedName, name);
+        return name;
+    }
+
+    /// Returns true once only, for the kit asking first to build the cache.
+    bool startBuilding()
+    {
+        return !_building.exchange(true);
+    }
+
+    /// Keeps the preview of the font, unless kept already or over the limit.
+    /// Returns true if kept.
+    bool add(const std::string& name, const char* data, const size_t size)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (name.empty() || size == 0 || _bytes + size > _maxBytes ||
+            _previews.find(name) != _previews.end())
+        {
+            return false;
+        }
+
+        _previews.emplace(name, std::make_shared<const std::vector<char>>(data, data + size));
+        _bytes += size;
+        return true;
+    }
+
+    /// The preview of the font, null if not kept.
+    Preview lookup(const std::string& name) const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto it = _previews.find(name);
+        return (it != _previews.end() ? it->second : nullptr);
+    }
+
+    size_t size() const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _previews.size();
+    }
+
+    size_t getBytes() const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _bytes;
+    }
+
+private:
+    /// A few hundred fonts, of some KB each.
+    static constexpr size_t MaxBytes = 16 * 1024 * 1024;
+
+    const size_t _maxBytes;
+    size_t _bytes;
+    std::atomic<bool> _building;
+    std::map<std::string, Preview> _previews;
+    mutable std::mutex _mutex;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -10,14 +10,23 @@
 #include "IoUtil.hpp"
 #include "config.h"
 
+#include <sys/eventfd.h>
 #include <sys/poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <iomanip>
+#include <limits>
 #include <mutex>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 
 #include <Poco/Net/NetException.h>
@@ -31,6 +40,7 @@
 #include "LOOLProtocol.hpp"
 #include "Log.hpp"
 #include "Util.hpp"
+#include "WebSocketDeflate.hpp"
 
 using Poco::Net::Socket;
 using Poco::Net::WebSocket;
@@ -38,54 +48,534 @@ using Poco::Net::WebSocket;
 namespace IoUtil
 {
 
+namespace
+{
+
+/// The largest a message compressed by a client may inflate to, short of a bomb.
+constexpr size_t MaxInflatedSize = 64 * 1024 * 1024;
+
+/// Handles the PING and PONG frames, returns false for the others.
+bool handleControlFrame(WebSocket& socket, const char* data, const int n, const int flags)
+{
+    if ((flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_PING)
+    {
+        // Technically, we should send back a PONG control frame. However Firefox (probably) or
+        // Node.js (possibly) doesn't like that and closes the socket when we do.
+        socket.sendFrame("pong", strlen("pong"));
+        return true;
+    }
+    else if ((flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_PONG)
+    {
+        // In case we do send pongs in the future.
+        return true;
+    }
+    else if (((flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_TEXT ||
+              (flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_BINARY) &&
+             n == 4 && memcmp(data, "pong", 4) == 0)
+    {
+        // Ignore what we send above. Be lenient, also ignore binary "pong" frames.
+        return true;
+    }
+
+    return false;
+}
+
+/// Waits for fd to be readable, the wakeup, when given, or the termination.
+/// The termination is only watched until it first wakes us up: the caller
+/// may well carry on regardless.
+/// Returns the poll events of fd, 0 when woken up or on timeout, <0 on error.
+int waitForInput(const int fd, const std::shared_ptr<Wakeup>& wakeup,
+                 bool& watchTermination, const int timeoutMs)
+{
+    struct pollfd fds[3];
+    fds[0].fd = fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    nfds_t count = 1;
+
+    const int wakeupIndex = (wakeup ? count++ : -1);
+    if (wakeup)
+    {
+        fds[wakeupIndex].fd = wakeup->getFd();
+        fds[wakeupIndex].events = POLLIN;
+        fds[wakeupIndex].revents = 0;
+    }
+
+    const int terminationFd = (watchTermination ? Util::getTerminationFd() : -1);
+    const int terminationIndex = (terminationFd >= 0 ? count++ : -1);
+    if (terminationFd >= 0)
+    {
+        fds[terminationIndex].fd = terminationFd;
+        fds[terminationIndex].events = POLLIN;
+        fds[terminationIndex].revents = 0;
+    }
+
+    const int ready = poll(fds, count, timeoutMs);
+    if (ready < 0)
+    {
+        return (errno == EINTR ? 0 : ready);
+    }
+
+    if (wakeupIndex >= 0 && fds[wakeupIndex].revents)
+    {
+        wakeup->clear();
+    }
+
+    if (terminationIndex >= 0 && fds[terminationIndex].revents)
+    {
+        watchTermination = false;
+    }
+
+    return fds[0].revents;
+}
+
+}
+
+Wakeup::Wakeup() :
+    _fd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK))
+{
+    if (_fd < 0)
+    {
+        Log::syserror("Failed to create wakeup eventfd.");
+        throw std::runtime_error("Failed to create wakeup eventfd.");
+    }
+}
+
+Wakeup::~Wakeup()
+{
+    close(_fd);
+}
+
+void Wakeup::wake()
+{
+    const uint64_t one = 1;
+    if (write(_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    {
+        Log::signalLog("Failed to write to wakeup eventfd.\n");
+    }
+}
+
+void Wakeup::clear()
+{
+    uint64_t count = 0;
+    while (read(_fd, &count, sizeof(count)) > 0)
+    {
+    }
+}
+
 int receiveFrame(WebSocket& socket, void* buffer, int length, int& flags)
 {
     while (true)
     {
         int n = socket.receiveFrame(buffer, length, flags);
-        if ((flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_PING)
+        if (!handleControlFrame(socket, static_cast<char*>(buffer), n, flags))
         {
-            // Technically, we should send back a PONG control frame. However Firefox (probably) or
-            // Node.js (possibly) doesn't like that and closes the socket when we do.
-            socket.sendFrame("pong", strlen("pong"));
+            return n;
         }
-        else if ((flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_PONG)
+    }
+}
+
+#if POCO_VERSION >= 0x01070000
+int receiveFrame(WebSocket& socket, Poco::Buffer<char>& buffer, int& flags)
+{
+    const auto oldSize = buffer.size();
+    while (true)
+    {
+        int n = socket.receiveFrame(buffer, flags);
+        if (!handleControlFrame(socket, buffer.begin() + oldSize, n, flags))
         {
-            // In case we do send pongs in the future.
+            return n;
         }
-        else if (((flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_TEXT ||
-                  (flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_BINARY) &&
-                 n == 4 && memcmp((char*)buffer, "pong", 4) == 0)
+
+        buffer.resize(oldSize);
+    }
+}
+#endif
+
+void sendFrame(WebSocket& socket, const char* buffer, int length, int flags, bool announceLarge)
+{
+    if (announceLarge && length > SMALL_MESSAGE_SIZE)
+    {
+        const std::string nextmessage = "nextmessage: size=" + std::to_string(length);
+        socket.sendFrame(nextmessage.data(), nextmessage.size());
+    }
+
+    socket.sendFrame(buffer, length, flags);
+}
+
+size_t writeFrameHeader(unsigned char* header, const int flags, const uint64_t length)
+{
+    header[0] = static_cast<unsigned char>(flags);
+    if (length < 126)
+    {
+        header[1] = static_cast<unsigned char>(length);
+        return 2;
+    }
+
+    // The extended lengths are in network order.
+    const int bytes = (length <= std::numeric_limits<uint16_t>::max() ? 2 : 8);
+    header[1] = (bytes == 2 ? 126 : 127);
+    for (int i = 0; i < bytes; ++i)
+    {
+        header[2 + i] = static_cast<unsigned char>(length >> (8 * (bytes - 1 - i)));
+    }
+
+    return 2 + bytes;
+}
+
+size_t parseFrame(const char* data, const size_t size, int& flags, std::vector<char>& payload)
+{
+    const unsigned char* header = reinterpret_cast<const unsigned char*>(data);
+    if (size < 2)
+    {
+        return 0;
+    }
+
+    // The extended lengths are in network order, the mask follows them.
+    const bool masked = (header[1] & 0x80);
+    uint64_t length = (header[1] & 0x7f);
+    const size_t bytes = (length == 126 ? 2 : length == 127 ? 8 : 0);
+    const size_t headerSize = 2 + bytes + (masked ? 4 : 0);
+    if (size < headerSize)
+    {
+        return 0;
+    }
+
+    if (bytes > 0)
+    {
+        length = 0;
+        for (size_t i = 0; i < bytes; ++i)
         {
-            // Ignore what we send above. Be lenient, also ignore binary "pong" frames.
+            length = (length << 8) | header[2 + i];
         }
-        else
+    }
+
+    // Poco counts the bytes of a frame in an int.
+    if (length > static_cast<uint64_t>(std::numeric_limits<int>::max()))
+    {
+        throw Poco::Net::WebSocketException("Frame of " + std::to_string(length) + " bytes is too large.",
+                                            WebSocket::WS_ERR_PAYLOAD_TOO_BIG);
+    }
+
+    if (size - headerSize < length)
+    {
+        return 0;
+    }
+
+    flags = header[0];
+    const auto oldSize = payload.size();
+    payload.insert(payload.end(), data + headerSize, data + headerSize + length);
+    if (masked)
+    {
+        const unsigned char* mask = header + headerSize - 4;
+        for (size_t i = 0; i < length; ++i)
         {
-            return n;
+            payload[oldSize + i] ^= mask[i % 4];
+        }
+    }
+
+    return headerSize + length;
+}
+
+void sendFrame(WebSocket& socket, const std::vector<iovec>& buffers, int flags, bool announceLarge, bool direct)
+{
+    size_t length = 0;
+    for (const auto& buffer : buffers)
+    {
+        length += buffer.iov_len;
+    }
+
+    if (!direct)
+    {
+        std::vector<char> frame;
+        frame.reserve(length);
+        for (const auto& buffer : buffers)
+        {
+            const char* data = static_cast<const char*>(buffer.iov_base);
+            frame.insert(frame.end(), data, data + buffer.iov_len);
+        }
+
+        sendFrame(socket, frame.data(), frame.size(), flags, announceLarge);
+        return;
+    }
+
+    if (announceLarge && length > SMALL_MESSAGE_SIZE)
+    {
+        const std::string nextmessage = "nextmessage: size=" + std::to_string(length);
+        socket.sendFrame(nextmessage.data(), nextmessage.size());
+    }
+
+    unsigned char header[MaxFrameHeaderSize];
+    std::vector<iovec> frame;
+    frame.reserve(buffers.size() + 1);
+    frame.push_back(iovec{ header, writeFrameHeader(header, flags, length) });
+    frame.insert(frame.end(), buffers.begin(), buffers.end());
+
+    const int fd = socket.impl()->sockfd();
+    size_t index = 0;
+    while (index < frame.size())
+    {
+        msghdr message;
+        std::memset(&message, 0, sizeof(message));
+        message.msg_iov = &frame[index];
+        message.msg_iovlen = std::min<size_t>(frame.size() - index, IOV_MAX);
+
+        const ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+        {
+            continue;
+        }
+
+        if (sent <= 0)
+        {
+            // Past the header, the peer can only close.
+            throw Poco::Net::NetException("sendmsg failed: " + std::string(std::strerror(errno)));
+        }
+
+        // Skips what was sent, in part of a buffer maybe.
+        size_t left = sent;
+        while (index < frame.size() && left >= frame[index].iov_len)
+        {
+            left -= frame[index].iov_len;
+            ++index;
+        }
+
+        if (index < frame.size())
+        {
+            frame[index].iov_base = static_cast<char*>(frame[index].iov_base) + left;
+            frame[index].iov_len -= left;
         }
     }
 }
 
+MessageReader::MessageReader(WebSocket& socket) :
+    _socket(socket),
+#if POCO_VERSION >= 0x01070000
+    _buffer(READ_BUFFER_SIZE * 100),
+#endif
+    _flags(0),
+    _lastSize(0),
+    _continuation(false),
+    _announcedSize(0),
+    _relaying(false),
+    _compressed(false),
+    _inputPos(0)
+{
+}
+
+MessageReader::~MessageReader()
+{
+    if (_relaying)
+    {
+        Log::warn("Relayed message cut short.");
+        _relay(std::vector<char>(), false, true);
+    }
+}
+
+int MessageReader::receive(std::vector<char>& payload, const int maxSize)
+{
+#if POCO_VERSION >= 0x01070000
+    (void)maxSize;
+    _buffer.resize(0);
+    const int n = receiveFrame(_socket, _buffer, _flags);
+    if (n > 0)
+    {
+        payload.insert(payload.end(), _buffer.begin(), _buffer.begin() + n);
+    }
+#else
+    const auto oldSize = payload.size();
+    payload.resize(oldSize + maxSize);
+    const int n = receiveFrame(_socket, payload.data() + oldSize, maxSize, _flags);
+    payload.resize(oldSize + (n > 0 ? n : 0));
+#endif
+    return n;
+}
+
+int MessageReader::read(std::vector<char>& payload)
+{
+    int maxSize = std::max<int>(payload.capacity(), READ_BUFFER_SIZE * 100);
+    if (_continuation)
+    {
+        maxSize = MESSAGE_FRAGMENT_SIZE;
+    }
+    else if (_announcedSize > 0)
+    {
+        maxSize = _announcedSize;
+    }
+
+    _lastSize = receive(payload, maxSize);
+    if (_lastSize <= 0)
+    {
+        return close(payload);
+    }
+
+    return assemble(payload);
+}
+
+void MessageReader::feed(const char* data, const size_t size)
+{
+    if (_inputPos > 0)
+    {
+        _input.erase(_input.begin(), _input.begin() + _inputPos);
+        _inputPos = 0;
+    }
+
+    _input.insert(_input.end(), data, data + size);
+}
+
+int MessageReader::next(std::vector<char>& payload)
+{
+    while (true)
+    {
+        const auto oldSize = payload.size();
+        const size_t size = parseFrame(_input.data() + _inputPos, _input.size() - _inputPos, _flags, payload);
+        if (size == 0)
+        {
+            // The rest of the frame is yet to come.
+            return 0;
+        }
+
+        _inputPos += size;
+        _lastSize = static_cast<int>(payload.size() - oldSize);
+        if (handleControlFrame(_socket, payload.data() + oldSize, _lastSize, _flags))
+        {
+            payload.resize(oldSize);
+            continue;
+        }
+
+        const int result = assemble(payload);
+        if (result < 0 || (result > 0 && !payload.empty()))
+        {
+            return result;
+        }
+    }
+}
+
+int MessageReader::close(std::vector<char>& payload)
+{
+    if (_continuation)
+    {
+        Log::warn("Connection closed while reading multiframe message.");
+    }
+
+    if (_relaying)
+    {
+        // What was relayed ends here, for the peer to send other messages.
+        _relaying = false;
+        _relay(std::vector<char>(), false, true);
+        payload.resize(0);
+    }
+
+    _continuation = false;
+    _announcedSize = 0;
+    _compressed = false;
+    return -1;
+}
+
+int MessageReader::assemble(std::vector<char>& payload)
+{
+    if ((_flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_CLOSE)
+    {
+        return close(payload);
+    }
+
+    if (!_continuation && !_relaying)
+    {
+        // Only the first frame of a message tells.
+        _compressed = (_deflate && (_flags & WebSocket::FRAME_FLAG_RSV1));
+    }
+
+    const bool final = ((_flags & WebSocket::FrameFlags::FRAME_FLAG_FIN) == WebSocket::FrameFlags::FRAME_FLAG_FIN);
+    if (_relaying || (!final && !_continuation && _announcedSize == 0 && _relay && !_compressed))
+    {
+        // Relayed as it comes, the payload holds one fragment at most.
+        if (_relaying)
+        {
+            _relay(payload, false, final);
+            _relaying = !final;
+            payload.resize(0);
+        }
+        else if (_relay(payload, true, false))
+        {
+            _relaying = true;
+            payload.resize(0);
+        }
+
+        if (payload.empty())
+        {
+            _continuation = !final;
+            return 0;
+        }
+    }
+
+    if (!final)
+    {
+        // One WS message split into multiple frames.
+        _continuation = true;
+        return 0;
+    }
+
+    if (_compressed)
+    {
+        _compressed = false;
+        if (!_deflate->decompress(payload, MaxInflatedSize))
+        {
+            Log::error("Invalid compressed message of " + std::to_string(payload.size()) + " bytes.");
+            _continuation = false;
+            _announcedSize = 0;
+            return -1;
+        }
+    }
+
+    if (_continuation || _announcedSize > 0)
+    {
+        _continuation = false;
+        _announcedSize = 0;
+        return 1;
+    }
+
+    if (payload.size() > 12 && std::memcmp(payload.data(), "nextmessage:", 12) == 0)
+    {
+        // Older peers announce large messages, read the follow-up
+        // message and handle that only.
+        int size = 0;
+        const std::string firstLine = LOOLProtocol::getFirstLine(payload);
+        Poco::StringTokenizer tokens(firstLine, " ", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
+        if (tokens.count() == 2 &&
+            tokens[0] == "nextmessage:" && LOOLProtocol::getTokenInteger(tokens[1], "size", size) && size > 0)
+        {
+            payload.resize(0);
+            _announcedSize = size;
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
 // Synchronously process WebSocket requests and dispatch to handler.
 // Handler returns false to end.
 void SocketProcessor(const std::shared_ptr<WebSocket>& ws,
                      const std::function<bool(const std::vector<char>&)>& handler,
                      const std::function<void()>& closeFrame,
-                     const std::function<bool()>& stopPredicate)
+                     const std::function<bool()>& stopPredicate,
+                     const std::shared_ptr<Wakeup>& wakeup,
+                     const MessageReader::Relay& relay,
+                     const std::shared_ptr<WebSocketDeflate>& deflate)
 {
     Log::info("SocketProcessor starting.");
 
-    // Timeout given is in microseconds.
-    static const Poco::Timespan waitTime(POLL_TIMEOUT_MS * 1000);
     try
     {
         ws->setReceiveTimeout(0);
 
-        int flags = 0;
-        int n = 0;
         bool stop = false;
+        bool watchTermination = true;
         std::vector<char> payload(READ_BUFFER_SIZE * 100);
         payload.resize(0);
+        MessageReader reader(*ws);
+        reader.setRelay(relay);
+        reader.setDeflate(deflate);
 
         for (;;)
         {
@@ -96,70 +586,41 @@ void SocketProcessor(const std::shared_ptr<WebSocket>& ws,
                 break;
             }
 
-            if (!ws->poll(waitTime, Poco::Net::Socket::SELECT_READ) ||
-                stopPredicate())
-            {
-                // Wait some more.
-                continue;
-            }
-
-            payload.resize(payload.capacity());
-            n = receiveFrame(*ws, payload.data(), payload.capacity(), flags);
-            payload.resize(n > 0 ? n : 0);
-
-            if (n <= 0 || ((flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_CLOSE))
+            // Data buffered above the socket, by SSL say, wouldn't wake us up.
+            if (ws->available() <= 0)
             {
-                closeFrame();
-                Log::warn("Connection closed.");
-                break;
-            }
-
-            assert(n > 0);
+                const int fd = ws->impl()->sockfd();
+                if (fd < 0)
+                {
+                    Log::warn("Socket closed.");
+                    break;
+                }
 
-            const std::string firstLine = LOOLProtocol::getFirstLine(payload);
-            if ((flags & WebSocket::FrameFlags::FRAME_FLAG_FIN) != WebSocket::FrameFlags::FRAME_FLAG_FIN)
-            {
-                // One WS message split into multiple frames.
-                while (true)
+                const int events = waitForInput(fd, wakeup, watchTermination, -1);
+                if (events < 0)
                 {
-                    char buffer[READ_BUFFER_SIZE * 10];
-                    n = ws->receiveFrame(buffer, sizeof(buffer), flags);
-                    if (n <= 0 || (flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_CLOSE)
-                    {
-                        closeFrame();
-                        Log::warn("Connection closed while reading multiframe message.");
-                        break;
-                    }
-
-                    payload.insert(payload.end(), buffer, buffer + n);
-                    if ((flags & WebSocket::FrameFlags::FRAME_FLAG_FIN) == WebSocket::FrameFlags::FRAME_FLAG_FIN)
-                    {
-                        // No more frames.
-                        break;
-                    }
+                    Log::syserror("Failed to poll the socket.");
+                    break;
                 }
-            }
-            else
-            {
-                int size = 0;
-                Poco::StringTokenizer tokens(firstLine, " ", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
-                if (tokens.count() == 2 &&
-                    tokens[0] == "nextmessage:" && LOOLProtocol::getTokenInteger(tokens[1], "size", size) && size > 0)
+                else if (events == 0 || stopPredicate())
                 {
-                    // Check if it is a "nextmessage:" and in that case read the large
-                    // follow-up message separately, and handle that only.
-                    payload.resize(size);
-
-                    n = ws->receiveFrame(payload.data(), size, flags);
+                    // Woken up, check again.
+                    continue;
                 }
             }
 
-            if (n <= 0 || (flags & WebSocket::FRAME_OP_BITMASK) == WebSocket::FRAME_OP_CLOSE)
+            const int result = reader.read(payload);
+            if (result < 0)
             {
                 closeFrame();
                 Log::warn("Connection closed.");
                 break;
             }
+            else if (result == 0)
+            {
+                // The rest of the message is yet to come.
+                continue;
+            }
 
             // Call the handler.
             const auto success = handler(payload);
@@ -172,8 +633,9 @@ void SocketProcessor(const std::shared_ptr<WebSocket>& ws,
             }
         }
 
+        const int flags = reader.getFlags();
         Log::info() << "SocketProcessor finishing. TerminationFlag: " << stop
-                     << ", n: " << n
+                     << ", n: " << reader.getLastSize()
                      << ", payload size: " << payload.size()
                      << ", flags: " << std::hex << flags << Log::end;
 
@@ -258,7 +720,8 @@ ssize_t readFIFO(int pipe, char* buffer, ssize_t size)
 /// Returns 0 for timeout, <0 for error, and >0 on success.
 /// On success, line will contain the read message.
 int PipeReader::readLine(std::string& line,
-                         const std::function<bool()>& stopPredicate)
+                         const std::function<bool()>& stopPredicate,
+                         const int timeoutMs)
 {
     const char *endOfLine = static_cast<const char *>(std::memchr(_data.data(), '\n', _data.size()));
     if (endOfLine != nullptr)
@@ -271,10 +734,7 @@ int PipeReader::readLine(std::string& line,
         return 1;
     }
 
-    // Poll in short intervals to check for stop condition.
-    const auto pollTimeoutMs = 500;
-    auto maxPollCount = POLL_TIMEOUT_MS / pollTimeoutMs;
-    while (maxPollCount-- > 0)
+    for (;;)
     {
         if (stopPredicate())
         {
@@ -282,22 +742,24 @@ int PipeReader::readLine(std::string& line,
             return -1;
         }
 
-        struct pollfd pipe;
-        pipe.fd = _pipe;
-        pipe.events = POLLIN;
-        pipe.revents = 0;
-        const int ready = poll(&pipe, 1, pollTimeoutMs);
-        if (ready == 0)
+        const int events = waitForInput(_pipe, nullptr, _watchTermination, timeoutMs);
+        if (events == 0)
         {
-            // Timeout.
-            continue;
+            // Timeout, unless woken up to stop.
+            if (stopPredicate())
+            {
+                Log::info() << "Stop requested for pipe: " << _name << '.' << Log::end;
+                return -1;
+            }
+
+            return 0;
         }
-        else if (ready < 0)
+        else if (events < 0)
         {
             // error.
-            return ready;
+            return events;
         }
-        else if (pipe.revents & (POLLIN | POLLPRI))
+        else if (events & (POLLIN | POLLPRI))
         {
             char buffer[READ_BUFFER_SIZE];
             const auto bytes = readFIFO(_pipe, buffer, sizeof(buffer));
@@ -326,14 +788,11 @@ int PipeReader::readLine(std::string& line,
                 Log::trace() << "data appended to pipe: " << _name << ", data: " << _data << Log::end;
             }
         }
-        else if (pipe.revents & (POLLERR | POLLHUP | POLLNVAL))
+        else if (events & (POLLERR | POLLHUP | POLLNVAL))
         {
             return -1;
         }
     }
-
-    // Timeout.
-    return 0;
 }
 
 }
@@ -13,26 +13,180 @@
 #include <functional>
 #include <string>
 #include <memory>
+#include <vector>
 
 #include <sys/poll.h>
+#include <sys/uio.h>
 
+#include <Poco/Buffer.h>
 #include <Poco/Net/WebSocket.h>
 #include <Poco/Logger.h>
+#include <Poco/Version.h>
+
+class WebSocketDeflate;
 
 namespace IoUtil
 {
+    /// Whether we read frames of any size, growing the buffer as needed, so that
+    /// our own processes needn't announce the large ones with 'nextmessage:'.
+    /// Poco 1.7 is the first to receive a frame into a growable buffer.
+#if POCO_VERSION >= 0x01070000
+    constexpr bool CanReceiveLargeFrames = true;
+#else
+    constexpr bool CanReceiveLargeFrames = false;
+#endif
+
     // Wrapper for WebSocket::receiveFrame() that handles PING frames (by replying with a
     // "pseudo-PONG" frame, see protocol.txt) and PONG frames. Also our "pseudo-PONG" frames are
     // ignored.
     // Should we also factor out the handling of non-final and continuation frames into this?
     int receiveFrame(Poco::Net::WebSocket& socket, void* buffer, int length, int& flags);
 
+#if POCO_VERSION >= 0x01070000
+    /// As above, appending the frame to the buffer, whatever its size.
+    int receiveFrame(Poco::Net::WebSocket& socket, Poco::Buffer<char>& buffer, int& flags);
+#endif
+
+    /// Sends a frame, announcing it first with a 'nextmessage:' frame when
+    /// it is large and the peer needs to know the size to receive it.
+    void sendFrame(Poco::Net::WebSocket& socket, const char* buffer, int length, int flags, bool announceLarge);
+
+    /// As above, the frame being the buffers back to back. When direct, on the
+    /// plain socket of a server, the kernel gathers them, without a copy into
+    /// one buffer, here or in Poco. Not over SSL, which encrypts in userspace.
+    void sendFrame(Poco::Net::WebSocket& socket, const std::vector<iovec>& buffers, int flags,
+                   bool announceLarge, bool direct);
+
+    /// A buffer of a frame to gather, which is only read.
+    inline iovec getBuffer(const char* data, const size_t size)
+    {
+        return iovec{ const_cast<char*>(data), size };
+    }
+
+    /// The most bytes the header of a frame takes, unmasked.
+    constexpr size_t MaxFrameHeaderSize = 10;
+
+    /// Writes the header of an unmasked frame of length bytes with the flags
+    /// (FIN and opcode, as Poco has them) into header. Returns its size.
+    size_t writeFrameHeader(unsigned char* header, int flags, uint64_t length);
+
+    /// Parses the frame, masked or not, at the front of the size bytes at data,
+    /// appending its payload, unmasked, to payload, and setting flags as Poco
+    /// does. Returns the bytes the frame took, or 0 while it is incomplete.
+    size_t parseFrame(const char* data, size_t size, int& flags, std::vector<char>& payload);
+
+    /// Assembles the messages of a WebSocket from its frames, reading one
+    /// frame per call, so that it can be driven by a poll on the socket.
+    /// Joins the messages split into several frames and reads those
+    /// announced with 'nextmessage:'.
+    /// Alternatively, the frames are parsed from the bytes the caller reads,
+    /// which needn't wait for more in the middle of a frame.
+    class MessageReader
+    {
+    public:
+        /// Gets the fragments of a message as they come, the first asked
+        /// whether to relay the message. Returns false to have it joined.
+        typedef std::function<bool(const std::vector<char>& fragment, bool first, bool final)> Relay;
+
+        MessageReader(Poco::Net::WebSocket& socket);
+        /// Ends the message being relayed, if any.
+        ~MessageReader();
+
+        /// Relays the messages in fragments that the relay takes, each fragment
+        /// read into the payload then dropped, instead of joining them there.
+        void setRelay(const Relay& relay) { _relay = relay; }
+
+        /// Inflates the messages compressed by the peer, with the
+        /// permessage-deflate extension negotiated, joined first.
+        void setDeflate(const std::shared_ptr<WebSocketDeflate>& deflate) { _deflate = deflate; }
+
+        /// Reads the next frame into the payload.
+        /// Returns 1 when the payload holds a complete message, 0 while more
+        /// frames are expected and -1 once the connection is closed.
+        int read(std::vector<char>& payload);
+
+        /// Takes the bytes read off the plain socket, for next() to parse.
+        void feed(const char* data, const size_t size);
+
+        /// Parses the next frames fed into the payload, without blocking.
+        /// Returns as read() does, and 0 also once the bytes fed are used up.
+        int next(std::vector<char>& payload);
+
+        /// The flags and the size of the last frame read.
+        int getFlags() const { return _flags; }
+        int getLastSize() const { return _lastSize; }
+
+    private:
+        /// Appends the next frame to the payload. Without CanReceiveLargeFrames,
+        /// the frame must fit in maxSize bytes.
+        int receive(std::vector<char>& payload, const int maxSize);
+
+        /// Adds the frame just read to the message in the payload.
+        int assemble(std::vector<char>& payload);
+
+        /// Ends the message being read, the connection being closed.
+        int close(std::vector<char>& payload);
+
+    private:
+        Poco::Net::WebSocket& _socket;
+#if POCO_VERSION >= 0x01070000
+        /// Reused, and grown to the largest frame.
+        Poco::Buffer<char> _buffer;
+#endif
+        int _flags;
+        int _lastSize;
+        /// Whether the last frame was not the final one of its message.
+        bool _continuation;
+        /// The size of the message announced by 'nextmessage:', if any.
+        int _announcedSize;
+        Relay _relay;
+        /// Whether the message being read is relayed.
+        bool _relaying;
+        std::shared_ptr<WebSocketDeflate> _deflate;
+        /// Whether the message being read is compressed.
+        bool _compressed;
+        /// The bytes fed, from _inputPos on not parsed yet.
+        std::vector<char> _input;
+        size_t _inputPos;
+    };
+
+    /// Wakes up a SocketProcessor or a PipeReader blocked waiting for input,
+    /// for it to check its stop predicate again. Whoever makes the predicate
+    /// true wakes it up, so that it needn't check periodically. Termination,
+    /// see Util::setTerminationFlag(), wakes them all up anyway.
+    class Wakeup
+    {
+    public:
+        Wakeup();
+        ~Wakeup();
+
+        Wakeup(const Wakeup&) = delete;
+        Wakeup& operator=(const Wakeup&) = delete;
+
+        /// Async-signal-safe.
+        void wake();
+
+        /// Consumes the pending wakeups, done by the one woken up.
+        void clear();
+
+        int getFd() const { return _fd; }
+
+    private:
+        const int _fd;
+    };
+
     /// Synchronously process WebSocket requests and dispatch to handler.
-    /// Handler returns false to end.
+    /// Handler returns false to end. Blocks until there is input, or
+    /// until woken up, to check stopPredicate.
+    /// The messages the relay takes, if given, are not passed to the handler.
+    /// Those compressed are inflated with deflate, if given.
     void SocketProcessor(const std::shared_ptr<Poco::Net::WebSocket>& ws,
                          const std::function<bool(const std::vector<char>&)>& handler,
                          const std::function<void()>& closeFrame,
-                         const std::function<bool()>& stopPredicate);
+                         const std::function<bool()>& stopPredicate,
+                         const std::shared_ptr<Wakeup>& wakeup = nullptr,
+                         const MessageReader::Relay& relay = nullptr,
+                         const std::shared_ptr<WebSocketDeflate>& deflate = nullptr);
 
     /// Call WebSocket::shutdown() ignoring Poco::IOException.
     void shutdownWebSocket(const std::shared_ptr<Poco::Net::WebSocket>& ws);
@@ -51,22 +205,27 @@ namespace IoUtil
     public:
         PipeReader(const std::string& name, const int pipe) :
             _name(name),
-            _pipe(pipe)
+            _pipe(pipe),
+            _watchTermination(true)
         {
         }
 
         const std::string& getName() const { return _name; }
 
-        /// Reads a single line from the pipe.
-        /// Returns 0 for timeout, <0 for error, and >0 on success.
+        /// Reads a single line from the pipe, waiting at most timeoutMs
+        /// for more data, or for ever if negative.
+        /// Returns 0 for timeout, <0 for error or stop, and >0 on success.
         /// On success, line will contain the read message.
         int readLine(std::string& line,
-                     const std::function<bool()>& stopPredicate);
+                     const std::function<bool()>& stopPredicate,
+                     const int timeoutMs = -1);
 
     private:
         const std::string _name;
         const int _pipe;
         std::string _data;
+        /// Until woken up by the termination once.
+        bool _watchTermination;
     };
 }
 
@@ -0,0 +1,140 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "JailTemplate.hpp"
+#include "config.h"
+
+#include <unistd.h>
+#include <utime.h>
+
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+
+#include "Log.hpp"
+
+namespace
+{
+    /// The one being walked, nftw() has no room for it.
+    JailTemplate* Walking = nullptr;
+
+    /// Whether path is in the subtree at prefix, which ends with a '/'.
+    bool isUnder(const std::string& path, const std::string& prefix)
+    {
+        return !prefix.empty() && path.compare(0, prefix.size(), prefix) == 0;
+    }
+}
+
+JailTemplate::JailTemplate(const std::string& source, const std::set<std::string>& skipped) :
+    _source(source),
+    _directoryCount(0),
+    _skipped(skipped)
+{
+    if (!_source.empty() && _source.back() == '/')
+        _source.pop_back();
+
+    assert(Walking == nullptr);
+    Walking = this;
+    if (nftw(source.c_str(), addEntry, 10, FTW_ACTIONRETVAL) == -1)
+        Log::error("JailTemplate: nftw() failed for '" + source + "'");
+    Walking = nullptr;
+
+    Log::info() << "JailTemplate: " << _source << " has " << getDirectoryCount()
+                << " directories and " << getFileCount() << " files." << Log::end;
+}
+
+int JailTemplate::addEntry(const char* path, const struct stat* st, int type, struct FTW* /*ftw*/)
+{
+    JailTemplate& self = *Walking;
+    if (strcmp(path, self._source.c_str()) == 0)
+        return FTW_CONTINUE;
+
+    assert(path[self._source.size()] == '/');
+    const char* relativePath = path + self._source.size() + 1;
+
+    switch (type)
+    {
+    case FTW_F:
+    case FTW_SLN:
+        self._entries.push_back(Entry{ relativePath, false, 0, 0 });
+        break;
+    case FTW_D:
+        if (self._skipped.find(relativePath) != self._skipped.end())
+        {
+            Log::trace("skip redundant paths " + std::string(relativePath));
+            return FTW_SKIP_SUBTREE;
+        }
+
+        self._entries.push_back(Entry{ relativePath, true, st->st_atime, st->st_mtime });
+        ++self._directoryCount;
+        break;
+    case FTW_DNR:
+        Log::error("Cannot read directory '" + std::string(path) + "'");
+        return FTW_STOP;
+    case FTW_NS:
+        Log::error("nftw: stat failed for '" + std::string(path) + "'");
+        return FTW_STOP;
+    default:
+        Log::error("nftw: unexpected type: '" + std::to_string(type));
+        assert(false);
+        break;
+    }
+
+    return FTW_CONTINUE;
+}
+
+bool JailTemplate::link(const std::string& destination, const std::set<std::string>& skipped) const
+{
+    // The subtree being left out, entries come in the order walked.
+    std::string skipping;
+    for (const auto& entry : _entries)
+    {
+        if (isUnder(entry._path, skipping))
+        {
+            continue;
+        }
+
+        const std::string newPath = destination + '/' + entry._path;
+        if (entry._isDirectory)
+        {
+            if (skipped.find(entry._path) != skipped.end())
+            {
+                skipping = entry._path + '/';
+                continue;
+            }
+
+            if (mkdir(newPath.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) == -1 && errno != EEXIST)
+            {
+                Log::syserror("mkdir(\"" + newPath + "\") failed.");
+                return false;
+            }
+
+            struct utimbuf ut;
+            ut.actime = entry._atime;
+            ut.modtime = entry._mtime;
+            if (utime(newPath.c_str(), &ut) == -1)
+            {
+                Log::syserror("utime(\"" + newPath + "\") failed.");
+            }
+        }
+        else
+        {
+            const std::string oldPath = _source + '/' + entry._path;
+            if (::link(oldPath.c_str(), newPath.c_str()) == -1)
+            {
+                Log::syserror("link(\"" + oldPath + "\",\"" + newPath + "\") failed.");
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
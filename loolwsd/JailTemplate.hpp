@@ -0,0 +1,61 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_JAILTEMPLATE_HPP
+#define INCLUDED_JAILTEMPLATE_HPP
+
+#include <ftw.h>
+#include <sys/stat.h>
+
+#include <set>
+#include <string>
+#include <vector>
+
+/// The tree of a template to hard-link into the jails.
+/// It's walked once, by ForKit, and each kit forked after only
+/// creates the directories and links the files, without stat-ing
+/// the whole template over again.
+class JailTemplate
+{
+public:
+    /// Walks the source, leaving out the subtrees at the skipped relative paths.
+    JailTemplate(const std::string& source, const std::set<std::string>& skipped);
+
+    /// Creates the directories under destination and links the files into them,
+    /// leaving out the subtrees at the skipped relative paths too.
+    /// Returns false if any fails.
+    bool link(const std::string& destination, const std::set<std::string>& skipped) const;
+
+    const std::string& getSource() const { return _source; }
+    size_t getDirectoryCount() const { return _directoryCount; }
+    size_t getFileCount() const { return _entries.size() - _directoryCount; }
+
+private:
+    struct Entry
+    {
+        /// Relative to the source.
+        std::string _path;
+        bool _isDirectory;
+        time_t _atime;
+        time_t _mtime;
+    };
+
+    static int addEntry(const char* path, const struct stat* st, int type, struct FTW* ftw);
+
+private:
+    std::string _source;
+    /// In the order walked, so directories come before their contents.
+    std::vector<Entry> _entries;
+    size_t _directoryCount;
+    std::set<std::string> _skipped;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,301 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_KITPLACEMENT_HPP
+#define INCLUDED_KITPLACEMENT_HPP
+
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// Chooses the CPUs, of a single NUMA node, that each new kit is
+/// pinned to, by the number of kits on them already. The threads
+/// of the kit inherit it, and its memory is allocated on that node,
+/// instead of the scheduler migrating it across the nodes.
+class KitPlacement
+{
+public:
+    struct Node
+    {
+        int _id;
+        std::vector<int> _cpus;
+    };
+
+    struct Placement
+    {
+        Placement() : _node(-1) {}
+
+        /// -1 when not placed.
+        int _node;
+        std::vector<int> _cpus;
+    };
+
+    /// cpusPerKit of 0 gives the kits all the CPUs of the node.
+    KitPlacement(const std::vector<Node>& nodes, const size_t cpusPerKit) :
+        _nodes(nodes),
+        _cpusPerKit(cpusPerKit)
+    {
+    }
+
+    const std::vector<Node>& getNodes() const { return _nodes; }
+
+    /// The node with the fewest kits, and its CPUs with the fewest kits.
+    Placement choose() const
+    {
+        Placement placement;
+        size_t nodeKits = 0;
+        for (const auto& node : _nodes)
+        {
+            const size_t kits = getKitCount(node._id);
+            if (!node._cpus.empty() && (placement._node < 0 || kits < nodeKits))
+            {
+                placement._node = node._id;
+                nodeKits = kits;
+            }
+        }
+
+        for (const auto& node : _nodes)
+        {
+            if (node._id != placement._node)
+            {
+                continue;
+            }
+
+            placement._cpus = node._cpus;
+            if (_cpusPerKit > 0 && _cpusPerKit < node._cpus.size())
+            {
+                // The least used first, in order otherwise.
+                std::stable_sort(placement._cpus.begin(), placement._cpus.end(),
+                                 [this](const int a, const int b) { return getCpuKitCount(a) < getCpuKitCount(b); });
+                placement._cpus.resize(_cpusPerKit);
+                std::sort(placement._cpus.begin(), placement._cpus.end());
+            }
+        }
+
+        return placement;
+    }
+
+    void add(const pid_t pid, const Placement& placement)
+    {
+        if (placement._node >= 0)
+        {
+            _kits[pid] = placement;
+        }
+    }
+
+    void remove(const pid_t pid)
+    {
+        _kits.erase(pid);
+    }
+
+    size_t getKitCount(const int node) const
+    {
+        return std::count_if(_kits.begin(), _kits.end(),
+                             [node](const std::pair<const pid_t, Placement>& kit) { return kit.second._node == node; });
+    }
+
+    /// Pins the calling process, and the threads it creates after, to the placement.
+    static bool apply(const Placement& placement)
+    {
+        if (placement._node < 0)
+        {
+            return false;
+        }
+
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (const int cpu : placement._cpus)
+        {
+            CPU_SET(cpu, &cpus);
+        }
+
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) != 0)
+        {
+            return false;
+        }
+
+        // Preferred rather than bound, to fall back on the others once the node is full.
+        const size_t bits = 8 * sizeof(unsigned long);
+        std::vector<unsigned long> nodes(placement._node / bits + 1, 0);
+        nodes[placement._node / bits] |= 1UL << (placement._node % bits);
+        return syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodes.data(), nodes.size() * bits + 1) == 0;
+    }
+
+    /// The NUMA nodes of the host, a single one with all the CPUs without NUMA.
+    static std::vector<Node> readNodes()
+    {
+        std::vector<Node> nodes;
+        const std::string root = "/sys/devices/system/node";
+        DIR* dir = opendir(root.c_str());
+        if (dir)
+        {
+            while (struct dirent* entry = readdir(dir))
+            {
+                const std::string name = entry->d_name;
+                if (name.size() > 4 && name.compare(0, 4, "node") == 0 &&
+                    name.find_first_not_of("0123456789", 4) == std::string::npos)
+                {
+                    Node node;
+                    node._id = std::atoi(name.c_str() + 4);
+                    node._cpus = parseCpuList(readLine(root + '/' + name + "/cpulist"));
+                    nodes.push_back(node);
+                }
+            }
+
+            closedir(dir);
+        }
+
+        if (nodes.empty())
+        {
+            Node node;
+            node._id = 0;
+            node._cpus = parseCpuList(readLine("/sys/devices/system/cpu/online"));
+            nodes.push_back(node);
+        }
+
+        std::sort(nodes.begin(), nodes.end(), [](const Node& a, const Node& b) { return a._id < b._id; });
+        return nodes;
+    }
+
+    /// Where pid runs, as "<node>:<cpulist>", or "-" if it may run on any CPU.
+    static std::string describe(const pid_t pid, const std::vector<Node>& nodes)
+    {
+        std::ifstream file("/proc/" + std::to_string(pid) + "/status");
+        std::string line;
+        std::vector<int> cpus;
+        const std::string key = "Cpus_allowed_list:";
+        while (std::getline(file, line))
+        {
+            if (line.compare(0, key.size(), key) == 0)
+            {
+                const auto start = line.find_first_not_of(" \t", key.size());
+                cpus = parseCpuList(start != std::string::npos ? line.substr(start) : std::string());
+                break;
+            }
+        }
+
+        return describe(cpus, nodes);
+    }
+
+    static std::string describe(const std::vector<int>& cpus, const std::vector<Node>& nodes)
+    {
+        if (cpus.empty())
+        {
+            return "-";
+        }
+
+        size_t allCpus = 0;
+        int node = -1;
+        for (const auto& it : nodes)
+        {
+            allCpus += it._cpus.size();
+            if (std::includes(it._cpus.begin(), it._cpus.end(), cpus.begin(), cpus.end()))
+            {
+                node = it._id;
+            }
+        }
+
+        if (node < 0 || (nodes.size() == 1 && cpus.size() >= allCpus))
+        {
+            // Not pinned, or across nodes.
+            return "-";
+        }
+
+        return std::to_string(node) + ':' + toCpuList(cpus);
+    }
+
+    /// Parses the "0-3,8,10-11" lists of the kernel, sorted.
+    static std::vector<int> parseCpuList(const std::string& list)
+    {
+        std::vector<int> cpus;
+        std::istringstream iss(list);
+        std::string range;
+        while (std::getline(iss, range, ','))
+        {
+            const auto dash = range.find('-');
+            const int first = std::atoi(range.c_str());
+            const int last = (dash != std::string::npos ? std::atoi(range.c_str() + dash + 1) : first);
+            if (range.find_first_of("0123456789") == std::string::npos || last < first)
+            {
+                continue;
+            }
+
+            for (int cpu = first; cpu <= last; ++cpu)
+            {
+                cpus.push_back(cpu);
+            }
+        }
+
+        std::sort(cpus.begin(), cpus.end());
+        cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+        return cpus;
+    }
+
+    static std::string toCpuList(const std::vector<int>& cpus)
+    {
+        std::ostringstream oss;
+        for (size_t i = 0; i < cpus.size(); )
+        {
+            size_t last = i;
+            while (last + 1 < cpus.size() && cpus[last + 1] == cpus[last] + 1)
+            {
+                ++last;
+            }
+
+            oss << (i > 0 ? "," : "") << cpus[i];
+            if (last > i)
+            {
+                oss << '-' << cpus[last];
+            }
+
+            i = last + 1;
+        }
+
+        return oss.str();
+    }
+
+private:
+    size_t getCpuKitCount(const int cpu) const
+    {
+        return std::count_if(_kits.begin(), _kits.end(),
+                             [cpu](const std::pair<const pid_t, Placement>& kit)
+                             {
+                                 return std::find(kit.second._cpus.begin(), kit.second._cpus.end(), cpu) != kit.second._cpus.end();
+                             });
+    }
+
+    static std::string readLine(const std::string& path)
+    {
+        std::ifstream file(path);
+        std::string line;
+        std::getline(file, line);
+        return line;
+    }
+
+private:
+    std::vector<Node> _nodes;
+    size_t _cpusPerKit;
+    /// The placement of each live kit.
+    std::map<pid_t, Placement> _kits;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
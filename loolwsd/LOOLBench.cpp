@@ -0,0 +1,271 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Poco/File.h>
+#include <Poco/Util/Application.h>
+#include <Poco/Util/HelpFormatter.h>
+#include <Poco/Util/Option.h>
+#include <Poco/Util/OptionSet.h>
+
+#include "JailTemplate.hpp"
+#include "MessageQueue.hpp"
+#include "Util.hpp"
+
+using Poco::Util::Application;
+using Poco::Util::HelpFormatter;
+using Poco::Util::Option;
+using Poco::Util::OptionSet;
+
+/** Microbenchmarks of the server internals, run by name. */
+class Bench: public Poco::Util::Application
+{
+public:
+    Bench();
+    ~Bench() {}
+
+    unsigned _messages;
+    unsigned _jails;
+    std::string _jailSource;
+    std::string _jailRoot;
+
+protected:
+    void defineOptions(Poco::Util::OptionSet& options) override;
+    void handleOption(const std::string& name, const std::string& value) override;
+    int  main(const std::vector<std::string>& args) override;
+
+private:
+    /// Compares the MessageQueue variants under contention.
+    void benchQueue();
+
+    /// Returns the time, in ms, for the producers to pass _messages through the queue.
+    double runQueue(MessageQueue& queue, const unsigned producers);
+
+    /// Compares setting up the jails of the kits with and without a prepared template.
+    void benchJail();
+
+    /// Returns the average time, in ms, for setup to fill a jail.
+    double runJails(const std::function<bool(const std::string&)>& setup);
+};
+
+Bench::Bench() :
+    _messages(1000000),
+    _jails(10)
+{
+}
+
+void Bench::defineOptions(OptionSet& optionSet)
+{
+    Application::defineOptions(optionSet);
+
+    optionSet.addOption(Option("help", "", "Display help information on command line arguments.")
+                        .required(false).repeatable(false));
+    optionSet.addOption(Option("messages", "", "number of messages per run")
+                        .required(false).repeatable(false)
+                        .argument("count"));
+    optionSet.addOption(Option("jails", "", "number of jails per run")
+                        .required(false).repeatable(false)
+                        .argument("count"));
+    optionSet.addOption(Option("jailsource", "", "template to link into the jails, systemplate say")
+                        .required(false).repeatable(false)
+                        .argument("directory"));
+    optionSet.addOption(Option("jailroot", "", "where to create the jails, on the file system of the template")
+                        .required(false).repeatable(false)
+                        .argument("directory"));
+}
+
+void Bench::handleOption(const std::string& optionName,
+                         const std::string& value)
+{
+    Application::handleOption(optionName, value);
+
+    if (optionName == "help")
+    {
+        HelpFormatter helpFormatter(options());
+        helpFormatter.setCommand(commandName());
+        helpFormatter.setUsage("OPTIONS [queue] [jail]");
+        helpFormatter.setHeader("LibreOffice On-Line microbenchmarks.");
+        helpFormatter.format(std::cout);
+        std::exit(Application::EXIT_OK);
+    }
+    else if (optionName == "messages")
+        _messages = std::max(std::stoi(value), 1);
+    else if (optionName == "jails")
+        _jails = std::max(std::stoi(value), 1);
+    else if (optionName == "jailsource")
+        _jailSource = value;
+    else if (optionName == "jailroot")
+        _jailRoot = value;
+}
+
+double Bench::runQueue(MessageQueue& queue, const unsigned producers)
+{
+    // A typical high-rate input message.
+    const std::string message = "mouse type=move x=1234 y=5678 count=1 buttons=0 modifier=0";
+    const unsigned perProducer = _messages / producers;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    std::vector<std::thread> threads;
+    for (unsigned i = 0; i < producers; ++i)
+    {
+        threads.emplace_back([&queue, &message, perProducer]()
+            {
+                for (unsigned j = 0; j < perProducer; ++j)
+                {
+                    queue.put(message);
+                }
+            });
+    }
+
+    size_t bytes = 0;
+    for (unsigned i = 0; i < perProducer * producers; ++i)
+    {
+        bytes += queue.get().size();
+    }
+
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    if (bytes != message.size() * perProducer * producers)
+    {
+        std::cerr << "Lost messages.\n";
+        std::exit(Application::EXIT_SOFTWARE);
+    }
+
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / 1000.;
+}
+
+void Bench::benchQueue()
+{
+    std::cout << "queue: " << _messages << " messages, one consumer\n";
+    std::cout << std::setw(10) << "producers"
+              << std::setw(16) << "MessageQueue"
+              << std::setw(20) << "MPSCMessageQueue" << "\n";
+
+    for (const unsigned producers : { 1, 4, 16 })
+    {
+        MessageQueue locked;
+        const double lockedMs = runQueue(locked, producers);
+
+        MPSCMessageQueue lockFree;
+        const double lockFreeMs = runQueue(lockFree, producers);
+
+        std::cout << std::fixed << std::setprecision(1)
+                  << std::setw(10) << producers
+                  << std::setw(13) << lockedMs << " ms"
+                  << std::setw(17) << lockFreeMs << " ms\n";
+    }
+}
+
+double Bench::runJails(const std::function<bool(const std::string&)>& setup)
+{
+    double totalMs = 0;
+    for (unsigned i = 0; i < _jails; ++i)
+    {
+        const std::string jailPath = _jailRoot + "/bench-jail-" + std::to_string(i);
+        Poco::File(jailPath).createDirectories();
+
+        const auto start = std::chrono::steady_clock::now();
+        const bool success = setup(jailPath);
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+
+        Util::removeFile(jailPath, true);
+        if (!success)
+        {
+            std::cerr << "Failed to set up the jail at " << jailPath << ".\n";
+            std::exit(Application::EXIT_SOFTWARE);
+        }
+
+        totalMs += std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / 1000.;
+    }
+
+    return totalMs / _jails;
+}
+
+void Bench::benchJail()
+{
+    if (_jailSource.empty() || _jailRoot.empty())
+    {
+        std::cout << "jail: skipped, needs --jailsource and --jailroot\n";
+        return;
+    }
+
+    std::cout << "jail: " << _jails << " jails of " << _jailSource << "\n";
+    const std::set<std::string> none;
+
+    // As each kit used to, walking the template for itself.
+    const double walkingMs = runJails([this, &none](const std::string& jailPath)
+        {
+            const JailTemplate jailTemplate(_jailSource, none);
+            return jailTemplate.link(jailPath, none);
+        });
+
+    // As ForKit does now, once.
+    const auto start = std::chrono::steady_clock::now();
+    const JailTemplate jailTemplate(_jailSource, none);
+    const double templateMs = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count() / 1000.;
+
+    const double linkingMs = runJails([&jailTemplate, &none](const std::string& jailPath)
+        {
+            return jailTemplate.link(jailPath, none);
+        });
+
+    std::cout << std::fixed << std::setprecision(1)
+              << "  " << jailTemplate.getDirectoryCount() << " directories, "
+              << jailTemplate.getFileCount() << " files\n"
+              << "  walking per kit: " << std::setw(8) << walkingMs << " ms per jail\n"
+              << "  template:        " << std::setw(8) << linkingMs << " ms per jail, "
+              << templateMs << " ms once to walk\n";
+}
+
+int Bench::main(const std::vector<std::string>& args)
+{
+    const bool all = args.empty();
+    for (const auto& arg : args)
+    {
+        if (arg != "queue" && arg != "jail")
+        {
+            std::cerr << "Unknown benchmark: " << arg << "\n";
+            return Application::EXIT_USAGE;
+        }
+    }
+
+    if (all || std::find(args.begin(), args.end(), "queue") != args.end())
+    {
+        benchQueue();
+    }
+
+    if (all || std::find(args.begin(), args.end(), "jail") != args.end())
+    {
+        benchJail();
+    }
+
+    return Application::EXIT_OK;
+}
+
+POCO_APP_MAIN(Bench)
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
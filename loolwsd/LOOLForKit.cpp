@@ -18,11 +18,13 @@
 #include <sys/types.h>
 #include <sys/wait.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
 #include <map>
+#include <memory>
 #include <set>
 
 #include <Poco/Path.h>
@@ -33,8 +35,12 @@
 
 #include "Common.hpp"
 #include "IoUtil.hpp"
+#include "KitPlacement.hpp"
 #include "LOOLKit.hpp"
 #include "Log.hpp"
+#include "Png.hpp"
+#include "Prefault.hpp"
+#include "Startup.hpp"
 #include "Unit.hpp"
 #include "Util.hpp"
 #include "security.h"
@@ -47,6 +53,19 @@ using Poco::Util::Application;
 
 static bool NoCapsForKit = false;
 static std::string UnitTestLibrary;
+static unsigned RenderThreads = 1;
+static unsigned CallbackCoalesceMs = 0;
+static unsigned PrefetchPercent = 0;
+static unsigned RenderBudgetMs = 0;
+static unsigned KitMaxDocuments = 1;
+static unsigned KitMaxMemoryGrowthKb = 0;
+static png::EncodeOptions TileEncoding;
+static bool TileDeltas = false;
+static bool PlaceKits = false;
+static unsigned CpusPerKit = 0;
+static bool PrefaultImage = false;
+static bool PrefaultHugePages = false;
+static std::unique_ptr<KitPlacement> Placement;
 static std::atomic<unsigned> ForkCounter( 0 );
 
 static std::map<Process::PID, std::string> childJails;
@@ -68,7 +87,8 @@ public:
     bool pollAndDispatch()
     {
         std::string line;
-        const auto ready = readLine(line, [](){ return TerminationFlag; });
+        // Wake up regularly anyway, to reap the children and retry spawning.
+        const auto ready = readLine(line, [](){ return TerminationFlag; }, POLL_TIMEOUT_MS);
         if (ready == 0)
         {
             // Timeout.
@@ -124,6 +144,10 @@ static void cleanupChildren()
             Log::info("Child " + std::to_string(exitedChildPid) + " has exited, removing its jail '" + childJails[exitedChildPid] + "'");
             Util::removeFile(childJails[exitedChildPid], true);
             childJails.erase(exitedChildPid);
+            if (Placement)
+            {
+                Placement->remove(exitedChildPid);
+            }
         }
         else
         {
@@ -139,6 +163,8 @@ static int createLibreOfficeKit(const std::string& childRoot,
 {
     Log::debug("Forking a loolkit process.");
 
+    const auto placement = (Placement ? Placement->choose() : KitPlacement::Placement());
+
     Process::PID pid;
     if (!(pid = fork()))
     {
@@ -146,6 +172,13 @@ static int createLibreOfficeKit(const std::string& childRoot,
         // (but pipeFd is a pipe, not a socket...?)
         close(pipeFd);
 
+        // Before any thread is created, so that all stay there.
+        if (placement._node >= 0 && !KitPlacement::apply(placement))
+        {
+            Log::syserror("Failed to place kit on node " + std::to_string(placement._node) +
+                          ", CPUs " + KitPlacement::toCpuList(placement._cpus) + ".");
+        }
+
         UnitKit::get().postFork();
 
         // child
@@ -157,7 +190,8 @@ static int createLibreOfficeKit(const std::string& childRoot,
             Thread::sleep(std::stoul(std::getenv("SLEEPKITFORDEBUGGER")) * 1000);
         }
 
-        lokit_main(childRoot, sysTemplate, loTemplate, loSubPath, NoCapsForKit);
+        lokit_main(childRoot, sysTemplate, loTemplate, loSubPath, NoCapsForKit, RenderThreads, TileEncoding, TileDeltas,
+                   CallbackCoalesceMs, PrefetchPercent, RenderBudgetMs, KitMaxDocuments, KitMaxMemoryGrowthKb);
     }
     else
     {
@@ -170,6 +204,12 @@ static int createLibreOfficeKit(const std::string& childRoot,
         {
             Log::info("Forked kit [" + std::to_string(pid) + "].");
             childJails[pid] = childRoot + std::to_string(pid);
+            if (Placement)
+            {
+                Log::debug() << "Placed kit [" << pid << "] on node " << placement._node << ", CPUs "
+                             << KitPlacement::toCpuList(placement._cpus) << "." << Log::end;
+                Placement->add(pid, placement);
+            }
         }
 
         UnitKit::get().launchedKit(pid);
@@ -189,6 +229,8 @@ static void printArgumentHelp()
 
 int main(int argc, char** argv)
 {
+    Startup::record(Startup::Phase::ForKitStart);
+
     if (!hasCorrectUID("loolforkit"))
         return Application::EXIT_SOFTWARE;
 
@@ -250,6 +292,71 @@ int main(int argc, char** argv)
             eq = std::strchr(cmd, '=');
             ClientPortNumber = std::stoll(std::string(eq+1));
         }
+        else if (std::strstr(cmd, "--renderthreads=") == cmd)
+        {
+            eq = std::strchr(cmd, '=');
+            RenderThreads = std::max(1, std::stoi(std::string(eq+1)));
+        }
+        else if (std::strstr(cmd, "--callbackcoalescems=") == cmd)
+        {
+            eq = std::strchr(cmd, '=');
+            CallbackCoalesceMs = std::max(0, std::stoi(std::string(eq+1)));
+        }
+        else if (std::strstr(cmd, "--prefetchpercent=") == cmd)
+        {
+            eq = std::strchr(cmd, '=');
+            PrefetchPercent = std::min(100, std::max(0, std::stoi(std::string(eq+1))));
+        }
+        else if (std::strstr(cmd, "--renderbudgetms=") == cmd)
+        {
+            eq = std::strchr(cmd, '=');
+            RenderBudgetMs = std::max(0, std::stoi(std::string(eq+1)));
+        }
+        else if (std::strstr(cmd, "--kitmaxdocuments=") == cmd)
+        {
+            eq = std::strchr(cmd, '=');
+            KitMaxDocuments = std::max(1, std::stoi(std::string(eq+1)));
+        }
+        else if (std::strstr(cmd, "--kitmaxmemorygrowthkb=") == cmd)
+        {
+            eq = std::strchr(cmd, '=');
+            KitMaxMemoryGrowthKb = std::max(0, std::stoi(std::string(eq+1)));
+        }
+        else if (std::strstr(cmd, "--tilecompression=") == cmd)
+        {
+            eq = std::strchr(cmd, '=');
+            TileEncoding.compressionLevel = std::stoi(std::string(eq+1));
+        }
+        else if (std::strstr(cmd, "--tilefilters=") == cmd)
+        {
+            eq = std::strchr(cmd, '=');
+            TileEncoding.filters = png::EncodeOptions::parseFilters(std::string(eq+1));
+        }
+        else if (std::strstr(cmd, "--tilepalette") == cmd)
+        {
+            TileEncoding.palette = true;
+        }
+        else if (std::strstr(cmd, "--tiledeltas") == cmd)
+        {
+            TileDeltas = true;
+        }
+        else if (std::strstr(cmd, "--placekits") == cmd)
+        {
+            PlaceKits = true;
+        }
+        else if (std::strstr(cmd, "--cpusperkit=") == cmd)
+        {
+            eq = std::strchr(cmd, '=');
+            CpusPerKit = std::max(0, std::stoi(std::string(eq+1)));
+        }
+        else if (std::strstr(cmd, "--prefault") == cmd)
+        {
+            PrefaultImage = true;
+        }
+        else if (std::strstr(cmd, "--hugepages") == cmd)
+        {
+            PrefaultHugePages = true;
+        }
         else if (std::strstr(cmd, "--version") == cmd)
         {
             Util::displayVersionInfo("loolforkit");
@@ -303,8 +410,30 @@ int main(int argc, char** argv)
     if (!globalPreinit(loTemplate))
         std::_Exit(Application::EXIT_SOFTWARE);
 
+    Startup::record(Startup::Phase::GlobalPreinit);
     Log::info("Preinit stage OK.");
 
+    if (PrefaultImage)
+    {
+        // Once here, rather than in every kit after the fork.
+        const auto stats = Prefault::warm(loTemplate, PrefaultHugePages);
+        Startup::record(Startup::Phase::Prefault);
+        Log::info("Prefaulted the image of LibreOffice: " + stats.toString());
+    }
+
+    if (!NoCapsForKit)
+    {
+        // Once for all the kits, which only link the files then.
+        prepareJailTemplates(sysTemplate, loTemplate);
+    }
+
+    if (PlaceKits)
+    {
+        Placement.reset(new KitPlacement(KitPlacement::readNodes(), CpusPerKit));
+        Log::info() << "Placing kits on " << Placement->getNodes().size() << " NUMA nodes, "
+                    << CpusPerKit << " CPUs each (0 for all of the node)." << Log::end;
+    }
+
     // We must have at least one child, more are created dynamically.
     if (createLibreOfficeKit(childRoot, sysTemplate, loTemplate, loSubPath) < 0)
     {
@@ -12,25 +12,36 @@
  */
 
 #include <dlfcn.h>
-#include <ftw.h>
 #include <limits.h>
 #include <malloc.h>
 #include <stdlib.h>
 #include <sys/capability.h>
+#include <sys/resource.h>
 #include <unistd.h>
-#include <utime.h>
 
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <condition_variable>
 #include <cstdlib>
+#include <deque>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <limits>
 #include <memory>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
 
 #define LOK_USE_UNSTABLE_API
 #include <LibreOfficeKit/LibreOfficeKitInit.h>
 
 #include <Poco/Exception.h>
+#include <Poco/JSON/Object.h>
+#include <Poco/JSON/Parser.h>
 #include <Poco/Net/HTTPClientSession.h>
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/Net/HTTPResponse.h>
@@ -46,13 +57,19 @@
 #include "ChildSession.hpp"
 #include "Common.hpp"
 #include "IoUtil.hpp"
+#include "JailTemplate.hpp"
 #include "LOKitHelper.hpp"
 #include "LOOLProtocol.hpp"
 #include "LibreOfficeKit.hpp"
 #include "Log.hpp"
+#include "Metrics.hpp"
 #include "Png.hpp"
 #include "QueueHandler.hpp"
 #include "Rectangle.hpp"
+#include "RenderBudget.hpp"
+#include "Startup.hpp"
+#include "Trace.hpp"
+#include "TaskPool.hpp"
 #include "TileDesc.hpp"
 #include "Unit.hpp"
 #include "UserMessages.hpp"
@@ -83,106 +100,36 @@ using Poco::URI;
 
 namespace
 {
-    typedef enum { COPY_ALL, COPY_LO, COPY_NO_USR } LinkOrCopyType;
-    LinkOrCopyType linkOrCopyType;
-    std::string sourceForLinkOrCopy;
-    Path destinationForLinkOrCopy;
+    /// Walked by ForKit, for the kits forked after it to only link.
+    std::unique_ptr<JailTemplate> sysJailTemplate;
+    std::unique_ptr<JailTemplate> loJailTemplate;
 
-    bool shouldCopyDir(const char *path)
+    /// What the documents don't need from the LO installation.
+    const std::set<std::string> loSkippedPaths =
     {
-        switch (linkOrCopyType)
-        {
-        case COPY_NO_USR:
-            // bind mounted.
-            return strcmp(path,"usr");
-        case COPY_LO:
-            return
-                strcmp(path, "program/wizards") &&
-                strcmp(path, "sdk") &&
-                strcmp(path, "share/basic") &&
-                strcmp(path, "share/gallery") &&
-                strcmp(path, "share/Scripts") &&
-                strcmp(path, "share/template") &&
-                strcmp(path, "share/config/wizard") &&
-                strcmp(path, "share/config/wizard");
-        default: // COPY_ALL
-            return true;
-        }
-    }
-
-    int linkOrCopyFunction(const char *fpath,
-                           const struct stat* /*sb*/,
-                           int typeflag,
-                           struct FTW* /*ftwbuf*/)
+        "program/wizards",
+        "sdk",
+        "share/basic",
+        "share/gallery",
+        "share/Scripts",
+        "share/template",
+        "share/config/wizard"
+    };
+
+    /// How often the kit sends wsd its metrics, at most.
+    const std::chrono::seconds metricsInterval(5);
+
+    /// The mouse moves of the views dropped for the next, since last sent to wsd.
+    std::atomic<uint64_t> coalescedMouseMoves(0);
+
+    /// The renders previewed at a lower resolution, since last sent to wsd.
+    std::atomic<uint64_t> renderPreviews(0);
+
+    /// The peak resident memory of the process, without /proc in the jail.
+    long getPeakMemoryKb()
     {
-        if (strcmp(fpath, sourceForLinkOrCopy.c_str()) == 0)
-            return 0;
-
-        assert(fpath[strlen(sourceForLinkOrCopy.c_str())] == '/');
-        const char *relativeOldPath = fpath + strlen(sourceForLinkOrCopy.c_str()) + 1;
-        Path newPath(destinationForLinkOrCopy, Path(relativeOldPath));
-
-        switch (typeflag)
-        {
-        case FTW_F:
-        case FTW_SLN:
-            File(newPath.parent()).createDirectories();
-            if (link(fpath, newPath.toString().c_str()) == -1)
-            {
-                Log::syserror("link(\"" + std::string(fpath) + "\",\"" + newPath.toString() +
-                           "\") failed. Exiting.");
-                std::_Exit(Application::EXIT_SOFTWARE);
-            }
-            break;
-        case FTW_D:
-            {
-                struct stat st;
-                if (stat(fpath, &st) == -1)
-                {
-                    Log::syserror("stat(\"" + std::string(fpath) + "\") failed.");
-                    return 1;
-                }
-                if (!shouldCopyDir(relativeOldPath))
-                {
-                    Log::trace("skip redundant paths " + std::string(relativeOldPath));
-                    return FTW_SKIP_SUBTREE;
-                }
-                File(newPath).createDirectories();
-                struct utimbuf ut;
-                ut.actime = st.st_atime;
-                ut.modtime = st.st_mtime;
-                if (utime(newPath.toString().c_str(), &ut) == -1)
-                {
-                    Log::syserror("utime(\"" + newPath.toString() + "\") failed.");
-                    return 1;
-                }
-            }
-            break;
-        case FTW_DNR:
-            Log::error("Cannot read directory '" + std::string(fpath) + "'");
-            return 1;
-        case FTW_NS:
-            Log::error("nftw: stat failed for '" + std::string(fpath) + "'");
-            return 1;
-        default:
-            Log::error("nftw: unexpected type: '" + std::to_string(typeflag));
-            assert(false);
-            break;
-        }
-        return 0;
-    }
-
-    void linkOrCopy(const std::string& source,
-                    const Path& destination,
-                    LinkOrCopyType type)
-    {
-        linkOrCopyType = type;
-        sourceForLinkOrCopy = source;
-        if (sourceForLinkOrCopy.back() == '/')
-            sourceForLinkOrCopy.pop_back();
-        destinationForLinkOrCopy = destination;
-        if (nftw(source.c_str(), linkOrCopyFunction, 10, FTW_ACTIONRETVAL) == -1)
-            Log::error("linkOrCopy: nftw() failed for '" + source + "'");
+        struct rusage usage;
+        return (getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0);
     }
 
     void dropCapability(cap_value_t capability)
@@ -226,12 +173,18 @@ namespace
 class Connection: public Runnable
 {
 public:
+    /// @param finishedWakeup is woken up once we're finished.
     Connection(std::shared_ptr<ChildSession> session,
-               std::shared_ptr<WebSocket> ws) :
+               std::shared_ptr<WebSocket> ws,
+               const std::shared_ptr<TileQueue>& renderQueue,
+               const std::shared_ptr<IoUtil::Wakeup>& finishedWakeup) :
         _session(session),
         _ws(ws),
+        _renderQueue(renderQueue),
+        _finishedWakeup(finishedWakeup),
         _stop(false),
-        _joined(false)
+        _joined(false),
+        _finished(false)
     {
         Log::info("Connection ctor in child for " + _session->getId());
     }
@@ -253,7 +206,7 @@ public:
 
     bool isRunning()
     {
-        return _thread.isRunning();
+        return _thread.isRunning() && !_finished;
     }
 
     void stop()
@@ -280,26 +233,67 @@ public:
 
         try
         {
-            auto queue = std::make_shared<TileQueue>();
-            QueueHandler handler(queue, _session, "kit_queue_" + _session->getId());
+            // The input of this view not handled yet, which the renders yield to.
+            std::atomic<size_t> pendingInput(0);
+            const auto inputHandled = [&pendingInput, this](const MessageQueue::Payload& message)
+                {
+                    if (TileQueue::isInput(message))
+                    {
+                        --pendingInput;
+                        _renderQueue->inputHandled();
+                    }
+                };
+
+            // Tiles go to the document's render queue, this is only input.
+            // Only the last of the moves queued while dragging matters to LOK.
+            auto queue = std::make_shared<MPSCMessageQueue>(1024,
+                [&inputHandled](const MessageQueue::Payload& message, const MessageQueue::Payload& next)
+                {
+                    if (!MPSCMessageQueue::isSupersededMove(message, next))
+                    {
+                        return false;
+                    }
+
+                    ++coalescedMouseMoves;
+                    inputHandled(message);
+                    return true;
+                });
+            auto wakeup = std::make_shared<IoUtil::Wakeup>();
+            QueueHandler handler(queue, _session, "kit_queue_" + _session->getId(), wakeup, inputHandled);
 
             Thread queueHandlerThread;
             queueHandlerThread.start(handler);
             std::shared_ptr<ChildSession> session = _session;
 
             IoUtil::SocketProcessor(_ws,
-                [&queue](const std::vector<char>& payload)
+                [&queue, &pendingInput, this](const std::vector<char>& payload)
                 {
+                    updateView(payload);
+                    if (TileQueue::isInput(payload))
+                    {
+                        ++pendingInput;
+                        _renderQueue->inputQueued();
+                    }
+
                     queue->put(payload);
                     return true;
                 },
                 [&session]() { session->closeFrame(); },
-                [&queueHandlerThread]() { return TerminationFlag || !queueHandlerThread.isRunning(); });
+                [&handler]() { return TerminationFlag || handler.isFinished(); },
+                wakeup);
 
             queue->clear();
-            queue->put("eof");
+            if (!handler.isFinished())
+            {
+                // A full queue would block us with no one to empty it.
+                queue->put("eof");
+            }
+
             queueHandlerThread.join();
 
+            // What was cleared, or left when the handler finished, will never be handled.
+            _renderQueue->inputHandled(pendingInput.exchange(0));
+
             if (session->isCloseFrame())
             {
                 Log::trace("Normal close handshake.");
@@ -326,16 +320,62 @@ public:
             Log::error("Connection::run:: Unexpected exception");
         }
 
+        _finished = true;
+        _finishedWakeup->wake();
+
         Log::debug("Thread finished.");
     }
 
+private:
+    /// Lets the renders favour the tiles this view shows, and prefetch those around them.
+    void updateView(const std::vector<char>& payload)
+    {
+        const std::string firstLine = getFirstLine(payload);
+        const bool visibleArea = (firstLine.compare(0, 18, "clientvisiblearea ") == 0);
+        if (!visibleArea && firstLine.compare(0, 11, "clientzoom ") != 0)
+        {
+            return;
+        }
+
+        StringTokenizer tokens(firstLine, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+        int x;
+        int y;
+        int width;
+        int height;
+        if (visibleArea && tokens.count() == 5 &&
+            getTokenInteger(tokens[1], "x", x) &&
+            getTokenInteger(tokens[2], "y", y) &&
+            getTokenInteger(tokens[3], "width", width) &&
+            getTokenInteger(tokens[4], "height", height))
+        {
+            _renderQueue->updateVisibleArea(Util::decodeId(_session->getId()), x, y, width, height);
+        }
+
+        int tilePixelWidth;
+        int tilePixelHeight;
+        int tileTwipWidth;
+        int tileTwipHeight;
+        if (!visibleArea && tokens.count() == 5 &&
+            getTokenInteger(tokens[1], "tilepixelwidth", tilePixelWidth) &&
+            getTokenInteger(tokens[2], "tilepixelheight", tilePixelHeight) &&
+            getTokenInteger(tokens[3], "tiletwipwidth", tileTwipWidth) &&
+            getTokenInteger(tokens[4], "tiletwipheight", tileTwipHeight))
+        {
+            _renderQueue->updateZoom(Util::decodeId(_session->getId()), tilePixelWidth, tilePixelHeight,
+                                     tileTwipWidth, tileTwipHeight);
+        }
+    }
+
 private:
     Thread _thread;
     std::shared_ptr<ChildSession> _session;
     std::shared_ptr<WebSocket> _ws;
+    std::shared_ptr<TileQueue> _renderQueue;
+    std::shared_ptr<IoUtil::Wakeup> _finishedWakeup;
     std::atomic<bool> _stop;
     std::mutex _threadMutex;
     std::atomic<bool> _joined;
+    std::atomic<bool> _finished;
 };
 
 /// A document container.
@@ -356,7 +396,15 @@ public:
     Document(const std::shared_ptr<lok::Office>& loKit,
              const std::string& jailId,
              const std::string& docKey,
-             const std::string& url)
+             const std::string& url,
+             const unsigned renderThreads,
+             const png::EncodeOptions& tileEncoding,
+             const bool tileDeltas,
+             const unsigned callbackCoalesceMs,
+             const unsigned prefetchPercent,
+             const unsigned renderBudgetMs,
+             const std::shared_ptr<WebSocket>& ws,
+             const std::shared_ptr<IoUtil::Wakeup>& controlWakeup)
       : _multiView(std::getenv("LOK_VIEW_CALLBACK")),
         _loKit(loKit),
         _jailId(jailId),
@@ -367,11 +415,30 @@ public:
         _isDocPasswordProtected(false),
         _docPasswordType(PasswordType::ToView),
         _isLoading(0),
-        _clientViews(0)
+        _clientViews(0),
+        _tileEncoding(tileEncoding),
+        _tileDeltas(tileDeltas),
+        _callbackCoalesceMs(callbackCoalesceMs),
+        _prefetchPercent(std::min(prefetchPercent, 100U)),
+        _invalidations(0),
+        _renderBudget(renderBudgetMs),
+        _ws(ws),
+        _controlWakeup(controlWakeup),
+        _tileQueue(std::make_shared<TileQueue>()),
+        _metricsTime(std::chrono::steady_clock::now()),
+        _nextPrefetch(std::chrono::steady_clock::now())
     {
         Log::info("Document ctor for url [" + _url + "] on child [" + _jailId +
-                  "] LOK_VIEW_CALLBACK=" + std::to_string(_multiView) + ".");
+                  "] LOK_VIEW_CALLBACK=" + std::to_string(_multiView) +
+                  " renderThreads=" + std::to_string(renderThreads) + ".");
         assert(_loKit && _loKit->get());
+
+        if (renderThreads > 1)
+        {
+            _encodePool.reset(new TaskPool("png_encoder", renderThreads));
+        }
+
+        _renderThread = std::thread([this]() { renderQueuedTiles(); });
     }
 
     ~Document()
@@ -379,6 +446,11 @@ public:
         Log::info("~Document dtor for url [" + _url + "] on child [" + _jailId +
                   "]. There are " + std::to_string(_clientViews) + " views.");
 
+        // Stop rendering, dropping what's left.
+        _tileQueue->clear();
+        _tileQueue->put("eof");
+        _renderThread.join();
+
         // Flag all connections to stop.
         for (auto aIterator : _connections)
         {
@@ -415,6 +487,22 @@ public:
 
     const std::string& getUrl() const { return _url; }
 
+    /// Gives the template the kit loaded ahead, at templateUri, for the
+    /// document to take if it turns out to be a new copy of it.
+    void setPreloaded(const std::shared_ptr<lok::Document>& preloaded, const std::string& templateUri)
+    {
+        _preloaded = preloaded;
+        _preloadedUri = templateUri;
+    }
+
+    /// Queues a 'tile' or 'tilecombine' request for the render thread,
+    /// which renders those closest to what the views show first.
+    /// A 'canceltiles' removes those of the versions it lists at once.
+    void queueTileRequest(const std::vector<char>& payload)
+    {
+        _tileQueue->put(payload);
+    }
+
     bool createSession(const std::string& sessionId, const unsigned intSessionId)
     {
         std::unique_lock<std::mutex> lock(_mutex);
@@ -451,12 +539,12 @@ public:
             auto ws = std::make_shared<WebSocket>(cs, request, response);
             ws->setReceiveTimeout(0);
 
-            auto session = std::make_shared<ChildSession>(sessionId, ws, _jailId,
+            auto session = std::make_shared<ChildSession>(sessionId, ws, _jailId, _callbackCoalesceMs,
                            [this](const std::string& id, const std::string& uri, const std::string& docPassword,
                                   const std::string& renderOpts, bool haveDocPassword) { return onLoad(id, uri, docPassword, renderOpts, haveDocPassword); },
                            [this](const std::string& id) { onUnload(id); });
 
-            auto thread = std::make_shared<Connection>(session, ws);
+            auto thread = std::make_shared<Connection>(session, ws, _tileQueue, _controlWakeup);
             const auto aInserted = _connections.emplace(intSessionId, thread);
             if (aInserted.second)
             {
@@ -488,7 +576,8 @@ public:
             std::unique_lock<std::mutex> lock(_mutex, std::defer_lock);
             if (!lock.try_lock())
             {
-                // Not a good time, try later.
+                // Not a good time, try later: soon, as no one else would tell.
+                _controlWakeup->wake();
                 return -1;
             }
 
@@ -565,6 +654,52 @@ public:
     void renderTile(StringTokenizer& tokens, const std::shared_ptr<Poco::Net::WebSocket>& ws)
     {
         auto tile = TileDesc::parse(tokens);
+        Trace::record(tile.getTraceId(), Trace::Stage::RenderStart);
+
+        const size_t pixmapSize = 4 * tile.getWidth() * tile.getHeight();
+        unsigned char* pixmap = getPixmap(pixmapSize);
+
+        LibreOfficeKitTileMode mode;
+        {
+            // Input queued meanwhile goes first, the lock not being fair.
+            if (!_tileQueue->waitForInputHandled(std::chrono::milliseconds(TileQueue::MaxInputWaitMs)))
+            {
+                Log::debug("Rendering with input of the views still pending.");
+            }
+
+            // Only hold the lock, which input handling waits on, while in LOK.
+            std::unique_lock<std::recursive_mutex> lock(ChildSession::getLock());
+            if (!_loKitDocument)
+            {
+                Log::error("Tile rendering requested before loading document.");
+                return;
+            }
+
+            Timestamp timestamp;
+            _loKitDocument->paintPartTile(pixmap, tile.getPart(),
+                                          tile.getWidth(), tile.getHeight(),
+                                          tile.getTilePosX(), tile.getTilePosY(),
+                                          tile.getTileWidth(), tile.getTileHeight());
+            _paintMs.observe(timestamp.elapsed() / 1000.);
+            Trace::record(tile.getTraceId(), Trace::Stage::Painted);
+            Log::trace() << "paintTile at (" << tile.getPart() << ',' << tile.getTilePosX() << ',' << tile.getTilePosY()
+                         << ") rendered in " << (timestamp.elapsed()/1000.) << " ms" << Log::end;
+            mode = static_cast<LibreOfficeKitTileMode>(_loKitDocument->getTileMode());
+        }
+
+        sendStartupPhases(ws);
+        trimSolidTiles();
+        uint32_t colour = 0;
+        const std::vector<char>* solidTile = nullptr;
+        if (png::isUniform(pixmap, 0, 0, tile.getWidth(), tile.getHeight(), tile.getWidth(), colour))
+        {
+            solidTile = getSolidTile(pixmap, 0, 0, tile.getWidth(), tile.getHeight(),
+                                     tile.getWidth(), tile.getHeight(), colour, mode);
+            tile.setSolid(solidTile != nullptr);
+        }
+
+        TileChange change;
+        const bool hasChange = (_tileDeltas && updateRenderedTile(tile, pixmap, 0, 0, tile.getWidth(), change));
 
         // Send back the request with all optional parameters given in the request.
         const auto tileMsg = tile.serialize("tile:");
@@ -574,31 +709,16 @@ public:
         const std::string response = tileMsg + "\n";
 #endif
 
-        std::vector<char> output;
-        output.reserve(response.size() + (4 * tile.getWidth() * tile.getHeight()));
-        output.resize(response.size());
-        std::memcpy(output.data(), response.data(), response.size());
-
-        std::vector<unsigned char> pixmap;
-        pixmap.resize(output.capacity());
+        std::vector<char>& output = _tileBuffer;
+        output.clear();
+        output.reserve(response.size() + (solidTile ? solidTile->size() : pixmapSize));
+        output.insert(output.end(), response.begin(), response.end());
 
-        std::unique_lock<std::recursive_mutex> lock(ChildSession::getLock());
-        if (!_loKitDocument)
+        if (solidTile)
         {
-            Log::error("Tile rendering requested before loading document.");
-            return;
+            output.insert(output.end(), solidTile->begin(), solidTile->end());
         }
-
-        Timestamp timestamp;
-        _loKitDocument->paintPartTile(pixmap.data(), tile.getPart(),
-                                      tile.getWidth(), tile.getHeight(),
-                                      tile.getTilePosX(), tile.getTilePosY(),
-                                      tile.getTileWidth(), tile.getTileHeight());
-        Log::trace() << "paintTile at (" << tile.getPart() << ',' << tile.getTilePosX() << ',' << tile.getTilePosY()
-                     << ") rendered in " << (timestamp.elapsed()/1000.) << " ms" << Log::end;
-        const auto mode = static_cast<LibreOfficeKitTileMode>(_loKitDocument->getTileMode());
-
-        if (!png::encodeBufferToPNG(pixmap.data(), tile.getWidth(), tile.getHeight(), output, mode))
+        else if (!encodeBufferToPNG(pixmap, tile.getWidth(), tile.getHeight(), output, mode))
         {
             //FIXME: Return error.
             //sendTextFrame("error: cmd=tile kind=failure");
@@ -606,20 +726,37 @@ public:
             return;
         }
 
-        const auto length = output.size();
-        if (length > SMALL_MESSAGE_SIZE)
+        Trace::record(tile.getTraceId(), Trace::Stage::Encoded);
+
+        if (hasChange && (!solidTile || change.width == 0))
         {
-            const std::string nextmessage = "nextmessage: size=" + std::to_string(length);
-            ws->sendFrame(nextmessage.data(), nextmessage.size());
+            if (_deltaBuffers.empty())
+            {
+                _deltaBuffers.resize(1);
+            }
+
+            if (encodeTileDelta(pixmap, 0, 0, tile.getWidth(), tile.getHeight(), change, mode, _deltaBuffers[0]))
+            {
+                sendTileDelta(ws, tile, change, _deltaBuffers[0], output.size() - response.size());
+            }
         }
 
-        Log::trace("Sending render-tile response for: " + response);
-        ws->sendFrame(output.data(), length, WebSocket::FRAME_BINARY);
+        if (Log::traceEnabled())
+        {
+            Log::trace("Sending render-tile response for: " + response);
+        }
+
+        IoUtil::sendFrame(*ws, output.data(), output.size(), WebSocket::FRAME_BINARY, !IoUtil::CanReceiveLargeFrames);
+        Trace::record(tile.getTraceId(), Trace::Stage::KitSent);
     }
 
-    void renderCombinedTiles(StringTokenizer& tokens, const std::shared_ptr<Poco::Net::WebSocket>& ws)
+    /// A prefetch is only sent if no tile was invalidated since it was painted,
+    /// not to be cached over the invalidation, and makes no deltas.
+    void renderCombinedTiles(StringTokenizer& tokens, const std::shared_ptr<Poco::Net::WebSocket>& ws,
+                             const bool prefetch = false)
     {
         auto tileCombined = TileCombined::parse(tokens);
+        Trace::record(tileCombined.getTraceId(), Trace::Stage::RenderStart);
         auto& tiles = tileCombined.getTiles();
 
         Util::Rectangle renderArea;
@@ -648,75 +785,819 @@ public:
         const int pixmapWidth = tilesByX * tileCombined.getWidth();
         const int pixmapHeight = tilesByY * tileCombined.getHeight();
         const size_t pixmapSize = 4 * pixmapWidth * pixmapHeight;
-        std::vector<unsigned char> pixmap(pixmapSize, 0);
 
-        std::unique_lock<std::recursive_mutex> lock(ChildSession::getLock());
-        if (!_loKitDocument)
+        // Previewed first if the last renders of the area took too long.
+        std::vector<std::string> budgetKeys;
+        if (!prefetch && _renderBudget.getBudgetMs() > 0)
         {
-            Log::error("Tile rendering requested before loading document.");
-            return;
-        }
+            double estimateMs = 0;
+            for (const auto& tile : tiles)
+            {
+                budgetKeys.push_back(RenderBudget::getKey(tile.getPart(), tile.getTilePosX(), tile.getTilePosY(),
+                                                          tile.getTileWidth(), tile.getTileHeight()));
+                estimateMs += _renderBudget.estimate(budgetKeys.back());
+            }
 
-        Timestamp timestamp;
-        _loKitDocument->paintPartTile(pixmap.data(), tileCombined.getPart(),
-                                      pixmapWidth, pixmapHeight,
-                                      renderArea.getLeft(), renderArea.getTop(),
-                                      renderArea.getWidth(), renderArea.getHeight());
-        Log::debug() << "paintTile (combined) called, tile at [" << renderArea.getLeft() << ", " << renderArea.getTop() << "]"
-                     << " (" << renderArea.getWidth() << ", " << renderArea.getHeight() << ") rendered in "
-                     << double(timestamp.elapsed())/1000 <<  " ms." << Log::end;
-        const auto mode = static_cast<LibreOfficeKitTileMode>(_loKitDocument->getTileMode());
+            const int scale = _renderBudget.getScale(estimateMs);
+            if (scale > 1)
+            {
+                Log::debug() << "Previewing at 1/" << scale << " the render estimated at " << estimateMs
+                             << " ms, over the budget of " << _renderBudget.getBudgetMs() << " ms." << Log::end;
+                sendRenderPreview(tileCombined, renderArea, tileRecs, pixmapWidth, pixmapHeight, scale, ws);
+            }
+        }
 
-        std::vector<char> output;
-        output.reserve(pixmapWidth * pixmapHeight * 4);
+        unsigned char* pixmap = getPixmap(pixmapSize);
 
-        size_t tileIndex = 0;
-        for (Util::Rectangle& tileRect : tileRecs)
+        LibreOfficeKitTileMode mode;
+        uint64_t invalidations = 0;
         {
-            const int positionX = (tileRect.getLeft() - renderArea.getLeft()) / tileCombined.getTileWidth();
-            const int positionY = (tileRect.getTop() - renderArea.getTop())  / tileCombined.getTileHeight();
+            // Input queued meanwhile goes first, the lock not being fair.
+            if (!_tileQueue->waitForInputHandled(std::chrono::milliseconds(TileQueue::MaxInputWaitMs)))
+            {
+                Log::debug("Rendering with input of the views still pending.");
+            }
 
-            const auto oldSize = output.size();
-            const auto pixelWidth = tileCombined.getWidth();
-            const auto pixelHeight = tileCombined.getHeight();
-            if (!png::encodeSubBufferToPNG(pixmap.data(), positionX * pixelWidth, positionY * pixelHeight,
-                                           pixelWidth, pixelHeight, pixmapWidth, pixmapHeight, output, mode))
+            // Only hold the lock, which input handling waits on, while in LOK.
+            std::unique_lock<std::recursive_mutex> lock(ChildSession::getLock());
+            if (!_loKitDocument)
             {
-                //FIXME: Return error.
-                //sendTextFrame("error: cmd=tile kind=failure");
-                Log::error("Failed to encode tile into PNG.");
+                Log::error("Tile rendering requested before loading document.");
                 return;
             }
 
-            const auto imgSize = output.size() - oldSize;
-            Log::trace() << "Encoded tile #" << tileIndex << " in " << imgSize << " bytes." << Log::end;
-            tiles[tileIndex++].setImgSize(imgSize);
+            invalidations = _invalidations;
+
+            Timestamp timestamp;
+            _loKitDocument->paintPartTile(pixmap, tileCombined.getPart(),
+                                          pixmapWidth, pixmapHeight,
+                                          renderArea.getLeft(), renderArea.getTop(),
+                                          renderArea.getWidth(), renderArea.getHeight());
+            _paintMs.observe(timestamp.elapsed() / 1000.);
+            for (const auto& key : budgetKeys)
+            {
+                _renderBudget.record(key, timestamp.elapsed() / 1000. / budgetKeys.size());
+            }
+
+            Trace::record(tileCombined.getTraceId(), Trace::Stage::Painted);
+            Log::debug() << "paintTile (combined) called, tile at [" << renderArea.getLeft() << ", " << renderArea.getTop() << "]"
+                         << " (" << renderArea.getWidth() << ", " << renderArea.getHeight() << ") rendered in "
+                         << double(timestamp.elapsed())/1000 <<  " ms." << Log::end;
+            mode = static_cast<LibreOfficeKitTileMode>(_loKitDocument->getTileMode());
         }
 
+        sendStartupPhases(ws);
+
 #if ENABLE_DEBUG
-        const auto tileMsg = tileCombined.serialize("tilecombine:") + " renderid=" + Util::UniqueId() + "\n";
+        const std::string renderId = " renderid=" + Util::UniqueId();
 #else
-        const auto tileMsg = tileCombined.serialize("tilecombine:") + "\n";
+        const std::string renderId;
 #endif
-        Log::trace("Sending back painted tiles for " + tileMsg);
 
-        std::vector<char> response;
-        response.resize(tileMsg.size() + output.size());
-        std::copy(tileMsg.begin(), tileMsg.end(), response.begin());
-        std::copy(output.begin(), output.end(), response.begin() + tileMsg.size());
+        const auto pixelWidth = tileCombined.getWidth();
+        const auto pixelHeight = tileCombined.getHeight();
+        const auto getTileOffset = [&](const size_t index, int& startX, int& startY)
+            {
+                Util::Rectangle tileRect = tileRecs[index];
+                startX = (tileRect.getLeft() - renderArea.getLeft()) / tileCombined.getTileWidth() * pixelWidth;
+                startY = (tileRect.getTop() - renderArea.getTop()) / tileCombined.getTileHeight() * pixelHeight;
+            };
+
+        // Find the single-colour tiles up front, so that the
+        // encoding below, which may be parallel, only reads them.
+        trimSolidTiles();
+        std::vector<const std::vector<char>*> solidTiles(tileRecs.size(), nullptr);
+        for (size_t tileIndex = 0; tileIndex < tileRecs.size(); ++tileIndex)
+        {
+            int startX = 0;
+            int startY = 0;
+            getTileOffset(tileIndex, startX, startY);
+            uint32_t colour = 0;
+            if (png::isUniform(pixmap, startX, startY, pixelWidth, pixelHeight, pixmapWidth, colour))
+            {
+                solidTiles[tileIndex] = getSolidTile(pixmap, startX, startY, pixelWidth, pixelHeight,
+                                                     pixmapWidth, pixmapHeight, colour, mode);
+                tiles[tileIndex].setSolid(solidTiles[tileIndex] != nullptr);
+            }
+        }
+
+        // And what changed in each since its last render, for deltas.
+        std::vector<TileChange> changes(tileRecs.size());
+        std::vector<char> hasChanges(tileRecs.size(), false);
+        if (_tileDeltas && !prefetch)
+        {
+            if (_deltaBuffers.size() < tileRecs.size())
+            {
+                _deltaBuffers.resize(tileRecs.size());
+            }
+
+            for (size_t tileIndex = 0; tileIndex < tileRecs.size(); ++tileIndex)
+            {
+                int startX = 0;
+                int startY = 0;
+                getTileOffset(tileIndex, startX, startY);
+                hasChanges[tileIndex] = (updateRenderedTile(tiles[tileIndex], pixmap, startX, startY, pixmapWidth,
+                                                            changes[tileIndex]) &&
+                                         (!solidTiles[tileIndex] || changes[tileIndex].width == 0));
+            }
+        }
+
+        // The header goes in front of the images, but its imgsize list is
+        // only known once they are encoded. Leave room for the longest one.
+        for (auto& tile : tiles)
+        {
+            tile.setImgSize(std::numeric_limits<int>::max());
+        }
+
+        const size_t headerRoom = tileCombined.serialize("tilecombine:").size() + renderId.size() + 1;
+        std::vector<char>& output = _tileBuffer;
+        output.clear();
+        output.reserve(headerRoom + pixmapSize);
+        output.resize(headerRoom);
+
+        const auto encodeTile = [&](const size_t index, std::vector<char>& buffer)
+            {
+                if (solidTiles[index])
+                {
+                    buffer.insert(buffer.end(), solidTiles[index]->begin(), solidTiles[index]->end());
+                    return true;
+                }
+
+                int startX = 0;
+                int startY = 0;
+                getTileOffset(index, startX, startY);
+                Timestamp timestamp;
+                const bool success = png::encodeSubBufferToPNG(pixmap, startX, startY,
+                                                               pixelWidth, pixelHeight, pixmapWidth, pixmapHeight,
+                                                               buffer, mode, _tileEncoding);
+                _encodeMs.observe(timestamp.elapsed() / 1000.);
+                return success;
+            };
+
+        // A delta that fails to encode is just not sent.
+        const auto encodeDelta = [&](const size_t index)
+            {
+                int startX = 0;
+                int startY = 0;
+                getTileOffset(index, startX, startY);
+                if (hasChanges[index] &&
+                    !encodeTileDelta(pixmap, startX, startY, pixmapWidth, pixmapHeight,
+                                     changes[index], mode, _deltaBuffers[index]))
+                {
+                    hasChanges[index] = false;
+                }
+            };
+
+        if (_encodePool && tileRecs.size() > 1)
+        {
+            // Encode each tile into its own buffer in parallel,
+            // then append them in order, to match the imgsize list.
+            if (_encodeBuffers.size() < tileRecs.size())
+            {
+                _encodeBuffers.resize(tileRecs.size());
+            }
+
+            std::vector<char> encoded(tileRecs.size(), false);
+            std::vector<TaskPool::Task> tasks;
+            tasks.reserve(tileRecs.size());
+            for (size_t i = 0; i < tileRecs.size(); ++i)
+            {
+                _encodeBuffers[i].clear();
+                tasks.emplace_back([&, i]()
+                    {
+                        encoded[i] = encodeTile(i, _encodeBuffers[i]);
+                        encodeDelta(i);
+                    });
+            }
+
+            _encodePool->run(tasks);
+
+            for (size_t tileIndex = 0; tileIndex < tileRecs.size(); ++tileIndex)
+            {
+                if (!encoded[tileIndex])
+                {
+                    //FIXME: Return error.
+                    //sendTextFrame("error: cmd=tile kind=failure");
+                    Log::error("Failed to encode tile into PNG.");
+                    return;
+                }
+
+                const auto& buffer = _encodeBuffers[tileIndex];
+                output.insert(output.end(), buffer.begin(), buffer.end());
+                Log::trace() << "Encoded tile #" << tileIndex << " in " << buffer.size() << " bytes." << Log::end;
+                tiles[tileIndex].setImgSize(buffer.size());
+            }
+        }
+        else
+        {
+            for (size_t tileIndex = 0; tileIndex < tileRecs.size(); ++tileIndex)
+            {
+                const auto oldSize = output.size();
+                if (!encodeTile(tileIndex, output))
+                {
+                    //FIXME: Return error.
+                    //sendTextFrame("error: cmd=tile kind=failure");
+                    Log::error("Failed to encode tile into PNG.");
+                    return;
+                }
+
+                const auto imgSize = output.size() - oldSize;
+                Log::trace() << "Encoded tile #" << tileIndex << " in " << imgSize << " bytes." << Log::end;
+                tiles[tileIndex].setImgSize(imgSize);
+                encodeDelta(tileIndex);
+            }
+        }
+
+        Trace::record(tileCombined.getTraceId(), Trace::Stage::Encoded);
+
+        // The deltas go first, to be at hand when the tiles arrive.
+        for (size_t tileIndex = 0; tileIndex < tileRecs.size(); ++tileIndex)
+        {
+            if (hasChanges[tileIndex])
+            {
+                sendTileDelta(ws, tiles[tileIndex], changes[tileIndex], _deltaBuffers[tileIndex],
+                              tiles[tileIndex].getImgSize());
+            }
+        }
+
+        const auto tileMsg = tileCombined.serialize("tilecombine:") + renderId + "\n";
+        if (Log::traceEnabled())
+        {
+            Log::trace("Sending back painted tiles for " + tileMsg);
+        }
+
+        assert(tileMsg.size() <= headerRoom);
+        const auto offset = headerRoom - tileMsg.size();
+        std::memcpy(output.data() + offset, tileMsg.data(), tileMsg.size());
+
+        // No input is handled, so nothing invalidated, until it is sent.
+        std::unique_lock<std::recursive_mutex> lock(ChildSession::getLock(), std::defer_lock);
+        if (prefetch)
+        {
+            lock.lock();
+            if (_invalidations != invalidations)
+            {
+                Log::debug("Dropping prefetched tiles invalidated meanwhile: " + tileMsg);
+                return;
+            }
+        }
+
+        IoUtil::sendFrame(*ws, output.data() + offset, output.size() - offset, WebSocket::FRAME_BINARY,
+                          !IoUtil::CanReceiveLargeFrames);
+        Trace::record(tileCombined.getTraceId(), Trace::Stage::KitSent);
+    }
+
+    /// Paints the area at 1/scale of the resolution of the tiles, and sends
+    /// them scaled back up, for wsd to pass on to the clients waiting for
+    /// them, as previews until the tiles in full come.
+    void sendRenderPreview(const TileCombined& tileCombined, const Util::Rectangle& renderArea,
+                           const std::vector<Util::Rectangle>& tileRecs,
+                           const int pixmapWidth, const int pixmapHeight, const int scale,
+                           const std::shared_ptr<Poco::Net::WebSocket>& ws)
+    {
+        const int previewWidth = std::max(1, pixmapWidth / scale);
+        const int previewHeight = std::max(1, pixmapHeight / scale);
+        _previewPixmap.assign(4 * previewWidth * previewHeight, 0);
+
+        LibreOfficeKitTileMode mode;
+        {
+            std::unique_lock<std::recursive_mutex> lock(ChildSession::getLock());
+            if (!_loKitDocument)
+            {
+                return;
+            }
+
+            Timestamp timestamp;
+            _loKitDocument->paintPartTile(_previewPixmap.data(), tileCombined.getPart(),
+                                          previewWidth, previewHeight,
+                                          renderArea.getLeft(), renderArea.getTop(),
+                                          renderArea.getWidth(), renderArea.getHeight());
+            Log::debug() << "Preview painted at " << previewWidth << "x" << previewHeight << " in "
+                         << timestamp.elapsed() / 1000. << " ms." << Log::end;
+            mode = static_cast<LibreOfficeKitTileMode>(_loKitDocument->getTileMode());
+        }
+
+        unsigned char* pixmap = getPixmap(4 * pixmapWidth * pixmapHeight);
+        RenderBudget::upscale(_previewPixmap.data(), previewWidth, previewHeight, pixmap, pixmapWidth, pixmapHeight);
+
+        TileCombined preview(tileCombined);
+        auto& tiles = preview.getTiles();
+        std::vector<char>& images = _tileBuffer;
+        images.clear();
+        for (size_t tileIndex = 0; tileIndex < tileRecs.size(); ++tileIndex)
+        {
+            const int startX = (tileRecs[tileIndex].getLeft() - renderArea.getLeft()) / tileCombined.getTileWidth() * tileCombined.getWidth();
+            const int startY = (tileRecs[tileIndex].getTop() - renderArea.getTop()) / tileCombined.getTileHeight() * tileCombined.getHeight();
+            const auto oldSize = images.size();
+            if (!png::encodeSubBufferToPNG(pixmap, startX, startY, tileCombined.getWidth(), tileCombined.getHeight(),
+                                           pixmapWidth, pixmapHeight, images, mode, _tileEncoding))
+            {
+                Log::error("Failed to encode preview tile into PNG.");
+                return;
+            }
+
+            tiles[tileIndex].setImgSize(images.size() - oldSize);
+        }
+
+        const auto header = preview.serialize("tilepreview:") + "\n";
+        std::vector<char> output;
+        output.reserve(header.size() + images.size());
+        output.insert(output.end(), header.begin(), header.end());
+        output.insert(output.end(), images.begin(), images.end());
+        IoUtil::sendFrame(*ws, output.data(), output.size(), WebSocket::FRAME_BINARY, !IoUtil::CanReceiveLargeFrames);
+        ++renderPreviews;
+    }
+
+    /// Renders, while idle, the tiles the views are likely to scroll to next, for
+    /// wsd to cache as any other, within the share of the render thread allowed.
+    void prefetchTiles()
+    {
+        const auto start = std::chrono::steady_clock::now();
+        if (start < _nextPrefetch)
+        {
+            return;
+        }
+
+        long docWidth = 0;
+        long docHeight = 0;
+        {
+            std::unique_lock<std::recursive_mutex> lock(ChildSession::getLock());
+            if (!_loKitDocument)
+            {
+                return;
+            }
+
+            _loKitDocument->getDocumentSize(&docWidth, &docHeight);
+        }
+
+        const std::string request = _tileQueue->getPrefetchRequest(docWidth, docHeight);
+        if (request.empty())
+        {
+            return;
+        }
+
+        Log::debug("Prefetching: " + request);
+        StringTokenizer tokens(request, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+        renderCombinedTiles(tokens, _ws, true);
+
+        // Then idle for long enough to keep prefetching within its share.
+        const auto now = std::chrono::steady_clock::now();
+        _nextPrefetch = now + (now - start) * (100 - _prefetchPercent) / _prefetchPercent;
+    }
+
+    /// Takes the names of all the fonts, to render their previews while idle.
+    void queueFonts()
+    {
+        std::string values;
+        {
+            std::unique_lock<std::recursive_mutex> lock(ChildSession::getLock());
+            if (!_loKitDocument)
+            {
+                return;
+            }
+
+            char* ptrValues = _loKitDocument->getCommandValues(".uno:CharFontName");
+            if (ptrValues)
+            {
+                values = ptrValues;
+            }
+
+            std::free(ptrValues);
+        }
+
+        Poco::JSON::Parser parser;
+        const auto result = parser.parse(values);
+        const auto& object = result.extract<Poco::JSON::Object::Ptr>();
+        const auto fonts = object->getObject("commandValues");
+        std::vector<std::string> names;
+        if (fonts)
+        {
+            fonts->getNames(names);
+        }
+
+        _fontsToRender.assign(names.begin(), names.end());
+        Log::info() << "Rendering the previews of " << _fontsToRender.size() << " fonts while idle." << Log::end;
+    }
+
+    /// Renders, while idle, the preview of the next font queued, for wsd to
+    /// keep for all the documents.
+    void renderNextFont()
+    {
+        if (_fontsToRender.empty())
+        {
+            return;
+        }
+
+        const std::string font = _fontsToRender.front();
+        _fontsToRender.pop_front();
+
+        int width = 0;
+        int height = 0;
+        unsigned char* ptrFont = nullptr;
+        {
+            std::unique_lock<std::recursive_mutex> lock(ChildSession::getLock());
+            if (!_loKitDocument)
+            {
+                _fontsToRender.clear();
+                return;
+            }
+
+            ptrFont = _loKitDocument->renderFont(font.c_str(), &width, &height);
+        }
 
-        const auto length = response.size();
-        if (length > SMALL_MESSAGE_SIZE)
+        // As the clients request it, encoded.
+        std::string encodedFont;
+        URI::encode(font, "=&+", encodedFont);
+        const std::string response = "renderfont: font=" + encodedFont + "\n";
+        std::vector<char> output(response.begin(), response.end());
+        const bool encoded = (ptrFont && png::encodeBufferToPNG(ptrFont, width, height, output, LOK_TILEMODE_RGBA));
+        std::free(ptrFont);
+        if (!encoded)
         {
-            const std::string nextmessage = "nextmessage: size=" + std::to_string(length);
-            ws->sendFrame(nextmessage.data(), nextmessage.size());
+            Log::warn("Failed to render the preview of font [" + font + "].");
+            return;
         }
 
-        ws->sendFrame(response.data(), length, WebSocket::FRAME_BINARY);
+        IoUtil::sendFrame(*_ws, output.data(), output.size(), WebSocket::FRAME_BINARY,
+                          !IoUtil::CanReceiveLargeFrames);
     }
 
 private:
 
+    /// What changed in a tile since the render it is a delta of.
+    struct TileChange
+    {
+        int baseVersion;
+        /// The changed area in pixels, empty when nothing did.
+        int x;
+        int y;
+        int width;
+        int height;
+    };
+
+    bool encodeBufferToPNG(unsigned char* pixmap, int width, int height,
+                           std::vector<char>& output, const LibreOfficeKitTileMode mode)
+    {
+        Timestamp timestamp;
+        const bool success = png::encodeBufferToPNG(pixmap, width, height, output, mode, _tileEncoding);
+        _encodeMs.observe(timestamp.elapsed() / 1000.);
+        return success;
+    }
+
+    /// Sends wsd the durations observed, and the stages of the traced
+    /// requests, since the last time, every few seconds.
+    void sendMetrics()
+    {
+        const auto now = std::chrono::steady_clock::now();
+        if (now - _metricsTime < metricsInterval)
+        {
+            return;
+        }
+
+        _metricsTime = now;
+        std::string message;
+        const std::pair<const char*, Histogram*> histograms[] = {
+            { "loolkit_paint_seconds", &_paintMs },
+            { "loolkit_png_encode_seconds", &_encodeMs },
+            { "loolkit_document_load_seconds", &_loadMs }
+        };
+        for (const auto& it : histograms)
+        {
+            const auto delta = it.second->takeDelta();
+            if (!delta.empty())
+            {
+                message += ' ' + std::string(it.first) + '=' + delta;
+            }
+        }
+
+        const auto coalesced = coalescedMouseMoves.exchange(0);
+        if (coalesced > 0)
+        {
+            message += " loolkit_mouse_moves_coalesced_total=" + std::to_string(coalesced);
+        }
+
+        const auto previews = renderPreviews.exchange(0);
+        if (previews > 0)
+        {
+            message += " loolkit_render_previews_total=" + std::to_string(previews);
+        }
+
+        if (!message.empty())
+        {
+            message = "metrics:" + message;
+            _ws->sendFrame(message.data(), message.size());
+        }
+
+        const std::string events = Trace::takeEvents();
+        if (!events.empty())
+        {
+            message = "trace:" + events;
+            IoUtil::sendFrame(*_ws, message.data(), message.size(), WebSocket::FRAME_TEXT,
+                              !IoUtil::CanReceiveLargeFrames);
+        }
+    }
+
+    /// Sends wsd the phases of the startup of the kit once, with its first paint,
+    /// ahead of the tile.
+    static void sendStartupPhases(const std::shared_ptr<Poco::Net::WebSocket>& ws)
+    {
+        if (Startup::record(Startup::Phase::FirstPaint))
+        {
+            const std::string message = "startup:" + Startup::serialize();
+            ws->sendFrame(message.data(), message.size());
+        }
+    }
+
+    /// Returns the reused pixmap buffer, grown to at least size bytes and cleared.
+    unsigned char* getPixmap(const size_t size)
+    {
+        if (_pixmap.size() < size)
+        {
+            _pixmap.resize(size);
+        }
+
+        std::memset(_pixmap.data(), 0, size);
+        return _pixmap.data();
+    }
+
+    /// Returns the encoded image of a single-colour tile of the pixmap,
+    /// encoding it only the first time that colour and size are seen.
+    const std::vector<char>* getSolidTile(unsigned char* pixmap, int startX, int startY,
+                                          int width, int height, int bufferWidth, int bufferHeight,
+                                          const uint32_t colour, const LibreOfficeKitTileMode mode)
+    {
+        const auto key = std::make_tuple(colour, width, height, static_cast<int>(mode));
+        auto it = _solidTiles.find(key);
+        if (it == _solidTiles.end())
+        {
+            std::vector<char> encoded;
+            if (!png::encodeSubBufferToPNG(pixmap, startX, startY, width, height,
+                                           bufferWidth, bufferHeight, encoded, mode, _tileEncoding))
+            {
+                return nullptr;
+            }
+
+            it = _solidTiles.emplace(key, std::move(encoded)).first;
+        }
+
+        return &it->second;
+    }
+
+    /// The key of a tile in _renderedTiles.
+    static std::string getRenderedTileKey(const TileDesc& tile)
+    {
+        std::ostringstream oss;
+        oss << tile.getPart() << '_' << tile.getWidth() << 'x' << tile.getHeight() << '.'
+            << tile.getTilePosX() << ',' << tile.getTilePosY() << '.'
+            << tile.getTileWidth() << 'x' << tile.getTileHeight();
+        return oss.str();
+    }
+
+    /// Compares a rendered tile, at startX, startY in the pixmap, with its
+    /// last render, then keeps it as the base of the next delta.
+    /// Returns false when there is no earlier render to make a delta against.
+    bool updateRenderedTile(const TileDesc& tile, const unsigned char* pixmap,
+                            int startX, int startY, int bufferWidth, TileChange& change)
+    {
+        const std::string key = getRenderedTileKey(tile);
+        const int width = tile.getWidth();
+        const int height = tile.getHeight();
+
+        bool hasChange = false;
+        auto it = _renderedTiles.find(key);
+        if (it == _renderedTiles.end())
+        {
+            if (_renderedTiles.size() >= MaxRenderedTiles)
+            {
+                // Forget the oldest.
+                _renderedTiles.erase(_renderedTilesOrder.front());
+                _renderedTilesOrder.pop_front();
+            }
+
+            it = _renderedTiles.emplace(key, RenderedTile()).first;
+            _renderedTilesOrder.push_back(key);
+        }
+        else if (it->second.version >= 0 && tile.getVersion() >= 0)
+        {
+            change.baseVersion = it->second.version;
+            change.x = change.y = change.width = change.height = 0;
+            png::getChangedArea(it->second.pixels.data(), pixmap, startX, startY, width, height, bufferWidth,
+                                change.x, change.y, change.width, change.height);
+            hasChange = true;
+        }
+
+        RenderedTile& rendered = it->second;
+        rendered.version = tile.getVersion();
+        rendered.pixels.resize(width * height * 4);
+        for (int y = 0; y < height; ++y)
+        {
+            std::memcpy(rendered.pixels.data() + y * width * 4,
+                        pixmap + ((startY + y) * bufferWidth * 4) + (startX * 4), width * 4);
+        }
+
+        return hasChange;
+    }
+
+    /// Encodes the changed area of a tile, at startX, startY in the pixmap.
+    /// Leaves the output empty when nothing changed.
+    bool encodeTileDelta(unsigned char* pixmap, int startX, int startY, int bufferWidth, int bufferHeight,
+                         const TileChange& change, const LibreOfficeKitTileMode mode, std::vector<char>& output)
+    {
+        output.clear();
+        return (change.width == 0 ||
+                png::encodeSubBufferToPNG(pixmap, startX + change.x, startY + change.y,
+                                          change.width, change.height, bufferWidth, bufferHeight,
+                                          output, mode, _tileEncoding));
+    }
+
+    /// Sends the delta of a tile to wsd, ahead of the tile, unless the tile is as small.
+    void sendTileDelta(const std::shared_ptr<Poco::Net::WebSocket>& ws, TileDesc tile,
+                       const TileChange& change, const std::vector<char>& delta, const size_t tileSize)
+    {
+        if (delta.size() >= tileSize)
+        {
+            return;
+        }
+
+        tile.setImgSize(delta.size());
+        tile.setSolid(false);
+        const std::string response = tile.serialize("tiledelta:") +
+                                     " basever=" + std::to_string(change.baseVersion) +
+                                     " deltax=" + std::to_string(change.x) +
+                                     " deltay=" + std::to_string(change.y) +
+                                     " deltawidth=" + std::to_string(change.width) +
+                                     " deltaheight=" + std::to_string(change.height) + "\n";
+
+        std::vector<char> output;
+        output.reserve(response.size() + delta.size());
+        output.insert(output.end(), response.begin(), response.end());
+        output.insert(output.end(), delta.begin(), delta.end());
+
+        Log::trace() << "Sending tile delta of " << delta.size() << " bytes instead of "
+                     << tileSize << ": " << response << Log::end;
+        IoUtil::sendFrame(*ws, output.data(), output.size(), WebSocket::FRAME_BINARY, !IoUtil::CanReceiveLargeFrames);
+    }
+
+    /// Bounds the solid tile images kept. Not while any are referenced.
+    void trimSolidTiles()
+    {
+        if (_solidTiles.size() > MaxSolidTiles)
+        {
+            _solidTiles.clear();
+        }
+    }
+
+    /// Releases what is kept between renders, as wsd asks under memory pressure.
+    /// LOK has no call to release its own caches, so this is what we have.
+    void trimMemory()
+    {
+        size_t released = _pixmap.capacity() + _tileBuffer.capacity();
+        std::vector<unsigned char>().swap(_pixmap);
+        std::vector<char>().swap(_tileBuffer);
+        for (const auto& buffer : _encodeBuffers)
+            released += buffer.capacity();
+        for (const auto& buffer : _deltaBuffers)
+            released += buffer.capacity();
+        _encodeBuffers.clear();
+        _deltaBuffers.clear();
+
+        // The next renders of these tiles are sent whole, not as deltas.
+        for (const auto& pair : _renderedTiles)
+            released += pair.second.pixels.capacity();
+        _renderedTiles.clear();
+        _renderedTilesOrder.clear();
+        _solidTiles.clear();
+
+        // Give the freed heap back to the system, with what LOK freed lately.
+        malloc_trim(0);
+
+        Log::info() << "Trimmed memory, released " << released / 1024 << " KB of render buffers." << Log::end;
+    }
+
+    /// Renders the queued requests until the queue gets an 'eof'.
+    void renderQueuedTiles()
+    {
+        Util::setThreadName("kit_render");
+
+        Log::debug("Thread started.");
+
+        while (true)
+        {
+            const bool idleWork = (_prefetchPercent > 0 || !_fontsToRender.empty());
+            const auto input = (idleWork ? _tileQueue->get(std::chrono::milliseconds(PrefetchIdleMs))
+                                         : _tileQueue->get());
+            if (input.empty())
+            {
+                try
+                {
+                    if (!_fontsToRender.empty())
+                    {
+                        renderNextFont();
+                    }
+                    else if (_prefetchPercent > 0)
+                    {
+                        prefetchTiles();
+                    }
+                }
+                catch (const std::exception& exc)
+                {
+                    Log::error("Document::renderQueuedTiles: Exception while idle: " + std::string(exc.what()));
+                }
+
+                continue;
+            }
+
+            const std::string message(input.data(), input.size());
+            StringTokenizer tokens(message, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+            if (tokens.count() == 0)
+            {
+                continue;
+            }
+
+            if (tokens[0] == "eof")
+            {
+                Log::info("Received EOF. Finishing.");
+                break;
+            }
+
+            try
+            {
+                if (tokens[0] == "tile")
+                {
+                    renderTile(tokens, _ws);
+                }
+                else if (tokens[0] == "tilecombine")
+                {
+                    renderCombinedTiles(tokens, _ws);
+                }
+                else if (tokens[0] == "droptile" || tokens[0] == "droptilecombine")
+                {
+                    declineTiles(tokens, _ws);
+                }
+                else if (tokens[0] == "trimmemory")
+                {
+                    trimMemory();
+                }
+                else if (tokens[0] == "renderfonts")
+                {
+                    queueFonts();
+                }
+                else if (tokens[0] == "canceltiles")
+                {
+                    Log::debug() << "STATISTICS: " << _tileQueue->getCancelledCount()
+                                 << " tile requests cancelled so far." << Log::end;
+                }
+
+                sendMetrics();
+            }
+            catch (const std::exception& exc)
+            {
+                Log::error("Document::renderQueuedTiles: Exception: " + std::string(exc.what()));
+            }
+        }
+
+        Log::debug("Thread finished.");
+    }
+
+    /// Replies without an image, for wsd to forget the request.
+    void declineTiles(StringTokenizer& tokens, const std::shared_ptr<Poco::Net::WebSocket>& ws)
+    {
+        const std::string response = (tokens[0] == "droptile"
+                                      ? TileDesc::parse(tokens).serialize("tile:")
+                                      : TileCombined::parse(tokens).serialize("tilecombine:"));
+        Log::debug("Declining stale request: " + response);
+        ws->sendFrame(response.data(), response.size());
+    }
+
+    /// Parses the "x, y, width, height" payload of a cursor callback.
+    static bool parseCursor(const char* payload, int& x, int& y, int& width, int& height)
+    {
+        if (payload == nullptr)
+        {
+            return false;
+        }
+
+        StringTokenizer tokens(payload, ",", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+        if (tokens.count() != 4)
+        {
+            return false;
+        }
+
+        try
+        {
+            x = std::stoi(tokens[0]);
+            y = std::stoi(tokens[1]);
+            width = std::stoi(tokens[2]);
+            height = std::stoi(tokens[3]);
+        }
+        catch (const std::exception&)
+        {
+            return false;
+        }
+
+        return true;
+    }
+
     static void ViewCallback(int , const char* , void* )
     {
         //TODO: Delegate the callback.
@@ -743,8 +1624,26 @@ private:
             return;
         }
 
+        if (nType == LOK_CALLBACK_INVALIDATE_TILES)
+        {
+            ++self->_invalidations;
+        }
+
+        int x;
+        int y;
+        int width;
+        int height;
+        const bool isCursor = ((nType == LOK_CALLBACK_INVALIDATE_VISIBLE_CURSOR ||
+                                nType == LOK_CALLBACK_CELL_CURSOR) &&
+                               parseCursor(pPayload, x, y, width, height));
+
         for (auto& it: self->_connections)
         {
+            if (isCursor)
+            {
+                self->_tileQueue->updateCursorPosition(it.first, x, y, width, height);
+            }
+
             if (it.second->isRunning())
             {
                 auto session = it.second->getSession();
@@ -815,6 +1714,7 @@ private:
 
         Log::info("Session " + sessionId + " is unloading. Erasing connection.");
         _connections.erase(it);
+        _tileQueue->removeView(intSessionId);
         --_clientViews;
         Log::info("Session " + sessionId + " is unloading. " + std::to_string(_clientViews) + " views will remain.");
 
@@ -870,7 +1770,14 @@ private:
             _isDocPasswordProtected = false;
 
             Log::debug("Calling lokit::documentLoad.");
-            _loKitDocument = _loKit->documentLoad(uri.c_str());
+            Timestamp timestamp;
+            _loKitDocument = takePreloaded(uri);
+            if (!_loKitDocument)
+            {
+                _loKitDocument = _loKit->documentLoad(uri.c_str());
+            }
+
+            _loadMs.observe(timestamp.elapsed() / 1000.);
             Log::debug("Returned lokit::documentLoad.");
 
             if (!_loKitDocument || !_loKitDocument->get())
@@ -901,6 +1808,7 @@ private:
                 return nullptr;
             }
 
+            Startup::record(Startup::Phase::DocumentLoad);
             if (_multiView)
             {
                 Log::info("Loading view to document from URI: [" + uri + "] for session [" + sessionId + "].");
@@ -945,6 +1853,45 @@ private:
         return _loKitDocument;
     }
 
+    /// Takes the template loaded ahead if the document at uri, next to it, is a
+    /// copy of it. The document is then a link to the template, which is saved.
+    std::shared_ptr<lok::Document> takePreloaded(const std::string& uri)
+    {
+        const auto preloaded = _preloaded;
+        _preloaded.reset();
+        if (!preloaded)
+        {
+            return nullptr;
+        }
+
+        const auto path = URI(uri).getPath();
+        const auto templatePath = URI(_preloadedUri).getPath();
+        if (Path(path).parent().toString() != Path(templatePath).parent().toString() ||
+            readFile(path) != readFile(templatePath))
+        {
+            Log::info("Document [" + uri + "] is not a new copy of [" + _preloadedUri + "], loading it.");
+            return nullptr;
+        }
+
+        const auto linkPath = path + ".link";
+        if (symlink(Path(templatePath).getFileName().c_str(), linkPath.c_str()) == -1 ||
+            rename(linkPath.c_str(), path.c_str()) == -1)
+        {
+            Log::syserror("Failed to link [" + path + "] to its template.");
+            unlink(linkPath.c_str());
+            return nullptr;
+        }
+
+        Log::info("Document [" + uri + "] is a new copy of [" + _preloadedUri + "], loaded already.");
+        return preloaded;
+    }
+
+    static std::string readFile(const std::string& path)
+    {
+        std::ifstream file(path, std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
 private:
 
     const bool _multiView;
@@ -955,6 +1902,9 @@ private:
     std::string _jailedUrl;
 
     std::shared_ptr<lok::Document> _loKitDocument;
+    /// The template loaded ahead, until the first load.
+    std::shared_ptr<lok::Document> _preloaded;
+    std::string _preloadedUri;
 
     // Document password provided
     std::string _docPassword;
@@ -970,8 +1920,78 @@ private:
     std::atomic_size_t _isLoading;
     std::map<unsigned, std::shared_ptr<Connection>> _connections;
     std::atomic_size_t _clientViews;
+
+    /// Buffers reused across renders, which are done one at a time
+    /// on the render thread.
+    std::vector<unsigned char> _pixmap;
+    std::vector<char> _tileBuffer;
+
+    /// How interactive renders are compressed.
+    const png::EncodeOptions _tileEncoding;
+
+    /// Encodes the tiles of a combined render in parallel,
+    /// each into its own buffer. Null when single-threaded.
+    std::unique_ptr<TaskPool> _encodePool;
+    std::vector<std::vector<char>> _encodeBuffers;
+
+    /// The encoded images of the single-colour tiles, by colour, size and mode.
+    std::map<std::tuple<uint32_t, int, int, int>, std::vector<char>> _solidTiles;
+    static constexpr size_t MaxSolidTiles = 64;
+
+    /// Whether to send the changed area of re-rendered tiles too.
+    const bool _tileDeltas;
+
+    /// How long the sessions wait for more LOK callbacks to coalesce.
+    const unsigned _callbackCoalesceMs;
+
+    /// The share of the time of the render thread, in percent, spent prefetching at most.
+    const unsigned _prefetchPercent;
+    /// How long the render thread waits for a request before prefetching,
+    /// or rendering the next font preview.
+    static constexpr int PrefetchIdleMs = 100;
+    /// The fonts whose previews are left to render, by the render thread only.
+    std::deque<std::string> _fontsToRender;
+    /// Counts the tile invalidations, for prefetches not to outlive one.
+    std::atomic<uint64_t> _invalidations;
+
+    /// The time the tiles took to render, to preview those over the budget.
+    RenderBudget _renderBudget;
+    std::vector<unsigned char> _previewPixmap;
+
+    /// The last render of a tile, the base of its next delta.
+    struct RenderedTile
+    {
+        RenderedTile() : version(-1) {}
+
+        int version;
+        std::vector<unsigned char> pixels;
+    };
+
+    /// The last renders of the most recently rendered tiles, oldest first.
+    std::unordered_map<std::string, RenderedTile> _renderedTiles;
+    std::deque<std::string> _renderedTilesOrder;
+    static constexpr size_t MaxRenderedTiles = 64;
+    std::vector<std::vector<char>> _deltaBuffers;
+
+    /// The socket to wsd, which only the render thread sends tiles on.
+    const std::shared_ptr<WebSocket> _ws;
+    /// Wakes up the processing of _ws when a session ends, to check whether to discard us.
+    const std::shared_ptr<IoUtil::Wakeup> _controlWakeup;
+    std::shared_ptr<TileQueue> _tileQueue;
+
+    /// The durations observed since last sent to wsd.
+    Histogram _paintMs;
+    Histogram _encodeMs;
+    Histogram _loadMs;
+    std::chrono::steady_clock::time_point _metricsTime;
+    /// When the render thread may prefetch again, to keep within its share.
+    std::chrono::steady_clock::time_point _nextPrefetch;
+
+    std::thread _renderThread;
 };
 
+constexpr int Document::PrefetchIdleMs;
+
 namespace {
     void symlinkPathToJail(const Path& jailPath, const std::string &loTemplate,
                            const std::string &loSubPath)
@@ -993,14 +2013,31 @@ namespace {
     }
 }
 
+void prepareJailTemplates(const std::string& sysTemplate, const std::string& loTemplate)
+{
+    sysJailTemplate.reset(new JailTemplate(sysTemplate, std::set<std::string>()));
+    loJailTemplate.reset(new JailTemplate(loTemplate, loSkippedPaths));
+}
+
 void lokit_main(const std::string& childRoot,
                 const std::string& sysTemplate,
                 const std::string& loTemplate,
                 const std::string& loSubPath,
-                bool noCapabilities)
+                bool noCapabilities,
+                unsigned renderThreads,
+                const png::EncodeOptions& tileEncoding,
+                bool tileDeltas,
+                unsigned callbackCoalesceMs,
+                unsigned prefetchPercent,
+                unsigned renderBudgetMs,
+                unsigned maxDocuments,
+                unsigned maxMemoryGrowthKb)
 {
-    // Reinitialize logging when forked.
-    Log::initialize("kit");
+    Startup::record(Startup::Phase::Fork);
+
+    // Reinitialize logging when forked. ForKit logs synchronously,
+    // as it forks, the kit has a writer of its own.
+    Log::initialize("kit", true);
     Util::rng::reseed();
 
     assert(!childRoot.empty());
@@ -1008,7 +2045,7 @@ void lokit_main(const std::string& childRoot,
     assert(!loTemplate.empty());
     assert(!loSubPath.empty());
 
-    // We only host a single document in our lifetime.
+    // We host a single document at a time, and at most maxDocuments in our lifetime.
     std::shared_ptr<Document> document;
 
     // Ideally this will be a random ID, but forkit will cleanup
@@ -1034,6 +2071,7 @@ void lokit_main(const std::string& childRoot,
         {
             instdir_path = "/" + loSubPath + "/program";
 
+            const auto jailSetupStart = std::chrono::steady_clock::now();
             jailPath = Path::forDirectory(childRoot + "/" + jailId);
             Log::info("Jail path: " + jailPath.toString());
             File(jailPath).createDirectories();
@@ -1056,6 +2094,12 @@ void lokit_main(const std::string& childRoot,
             File(jailLOInstallation).createDirectory();
 
             // Copy (link) LO installation and other necessary files into it from the template.
+            if (!sysJailTemplate || !loJailTemplate)
+            {
+                Log::warn("Jail templates not prepared by ForKit, walking them.");
+                prepareJailTemplates(sysTemplate, loTemplate);
+            }
+
             bool bLoopMounted = false;
             if (getenv("LOOL_BIND_MOUNT"))
             {
@@ -1071,9 +2115,15 @@ void lokit_main(const std::string& childRoot,
                 bLoopMounted = !system(mountCommand.c_str());
                 Log::debug("Initialized jail bind mount.");
             }
-            linkOrCopy(sysTemplate, jailPath,
-                       bLoopMounted ? COPY_NO_USR : COPY_ALL);
-            linkOrCopy(loTemplate, jailLOInstallation, COPY_LO);
+            // The bind mounted /usr is left out.
+            const std::set<std::string> sysSkippedPaths =
+                (bLoopMounted ? std::set<std::string>{ "usr" } : std::set<std::string>());
+            if (!sysJailTemplate->link(jailPath.toString(), sysSkippedPaths) ||
+                !loJailTemplate->link(jailLOInstallation.toString(), std::set<std::string>()))
+            {
+                Log::error("Failed to link the jail files. Exiting.");
+                std::_Exit(Application::EXIT_SOFTWARE);
+            }
 
             // We need this because sometimes the hostname is not resolved
             const auto networkFiles = {"/etc/host.conf", "/etc/hosts", "/etc/nsswitch.conf", "/etc/resolv.conf"};
@@ -1087,7 +2137,9 @@ void lokit_main(const std::string& childRoot,
                 }
             }
 
-            Log::debug("Initialized jail files.");
+            const auto jailSetupMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - jailSetupStart).count();
+            Log::info("Initialized jail files in " + std::to_string(jailSetupMs) + " ms.");
 
             // Create the urandom and random devices
             File(Path(jailPath, "/dev")).createDirectory();
@@ -1129,6 +2181,8 @@ void lokit_main(const std::string& childRoot,
             instdir_path = "/" + loTemplate + "/program";
         }
 
+        Startup::record(Startup::Phase::JailLink);
+
         std::shared_ptr<lok::Office> loKit;
         {
             const char *instdir = instdir_path.c_str();
@@ -1148,87 +2202,163 @@ void lokit_main(const std::string& childRoot,
         }
 
         assert(loKit && loKit->get());
+        Startup::record(Startup::Phase::KitReady);
         Log::info("Process is ready.");
 
-        // Open websocket connection between the child process and WSD.
-        HTTPClientSession cs("127.0.0.1", MasterPortNumber);
-        cs.setTimeout(0);
-        HTTPRequest request(HTTPRequest::HTTP_GET, std::string(NEW_CHILD_URI) + "pid=" + pid);
-        HTTPResponse response;
-        auto ws = std::make_shared<WebSocket>(cs, request, response);
-        ws->setReceiveTimeout(0);
-
-        const std::string socketName = "ChildControllerWS";
-        IoUtil::SocketProcessor(ws,
-                [&socketName, &ws, &document, &loKit](const std::vector<char>& data)
-                {
-                    std::string message(data.data(), data.size());
+        const auto readyPeakKb = getPeakMemoryKb();
+        for (unsigned documents = 0; ; )
+        {
+            // Open websocket connection between the child process and WSD.
+            HTTPClientSession cs("127.0.0.1", MasterPortNumber);
+            cs.setTimeout(0);
+            HTTPRequest request(HTTPRequest::HTTP_GET, std::string(NEW_CHILD_URI) + "pid=" + pid +
+                                                       "&served=" + std::to_string(documents));
+            HTTPResponse response;
+            auto ws = std::make_shared<WebSocket>(cs, request, response);
+            ws->setReceiveTimeout(0);
 
-                    if (UnitKit::get().filterKitMessage(ws, message))
-                        return true;
+            // Set once the document has no one left, to recycle or finish.
+            bool discarded = false;
 
-                    Log::debug(socketName + ": recv [" + LOOLProtocol::getAbbreviatedMessage(message) + "].");
-                    StringTokenizer tokens(message, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+            // A template loaded ahead, for the new document made of it.
+            std::shared_ptr<lok::Document> preloaded;
+            std::string preloadedUri;
 
-                    // Note: Syntax or parsing errors here are unexpected and fatal.
-                    if (TerminationFlag)
+            const std::string socketName = "ChildControllerWS";
+            auto controlWakeup = std::make_shared<IoUtil::Wakeup>();
+            IoUtil::SocketProcessor(ws,
+                    [&socketName, &ws, &document, &loKit, renderThreads, &tileEncoding, tileDeltas, callbackCoalesceMs, prefetchPercent, renderBudgetMs, &controlWakeup, &discarded, &preloaded, &preloadedUri](const std::vector<char>& data)
                     {
-                        Log::debug("Too late, we're going down");
-                    }
-                    else if (tokens[0] == "session")
-                    {
-                        const std::string& sessionId = tokens[1];
-                        const unsigned intSessionId = Util::decodeId(sessionId);
-                        const std::string& docKey = tokens[2];
+                        std::string message(data.data(), data.size());
 
-                        std::string url;
-                        URI::decode(docKey, url);
-                        Log::info("New session [" + sessionId + "] request on url [" + url + "].");
+                        if (UnitKit::get().filterKitMessage(ws, message))
+                            return true;
 
-                        if (!document)
+                        if (Log::debugEnabled())
                         {
-                            document = std::make_shared<Document>(loKit, jailId, docKey, url);
+                            Log::debug(socketName + ": recv [" + LOOLProtocol::getAbbreviatedMessage(message) + "].");
                         }
 
-                        // Validate and create session.
-                        if (!(url == document->getUrl() &&
-                            document->createSession(sessionId, intSessionId)))
+                        StringTokenizer tokens(message, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+
+                        // Note: Syntax or parsing errors here are unexpected and fatal.
+                        if (TerminationFlag || discarded)
                         {
-                            Log::debug("CreateSession failed.");
+                            Log::debug("Too late, we're going down");
                         }
-                    }
-                    else if (tokens[0] == "tile")
-                    {
-                        if (document)
+                        else if (tokens[0] == "session")
                         {
-                            document->renderTile(tokens, ws);
+                            const std::string& sessionId = tokens[1];
+                            const unsigned intSessionId = Util::decodeId(sessionId);
+                            const std::string& docKey = tokens[2];
+
+                            std::string url;
+                            URI::decode(docKey, url);
+                            Log::info("New session [" + sessionId + "] request on url [" + url + "].");
+
+                            if (!document)
+                            {
+                                document = std::make_shared<Document>(loKit, jailId, docKey, url, renderThreads,
+                                                                      tileEncoding, tileDeltas, callbackCoalesceMs,
+                                                                      prefetchPercent, renderBudgetMs, ws, controlWakeup);
+                                if (preloaded)
+                                {
+                                    document->setPreloaded(preloaded, preloadedUri);
+                                    preloaded.reset();
+                                }
+                            }
+
+                            // Validate and create session.
+                            if (!(url == document->getUrl() &&
+                                document->createSession(sessionId, intSessionId)))
+                            {
+                                Log::debug("CreateSession failed.");
+                            }
                         }
-                    }
-                    else if (tokens[0] == "tilecombine")
-                    {
-                        if (document)
+                        else if (tokens[0] == "preload" && tokens.count() == 2 && !document)
                         {
-                            document->renderCombinedTiles(tokens, ws);
+                            // Loaded while spare, as documentLoad does at the first load.
+                            Log::info("Preloading template [" + tokens[1] + "].");
+                            Timestamp timestamp;
+                            auto lock(loKit->getLock());
+                            preloaded = loKit->documentLoad(tokens[1].c_str());
+                            if (preloaded && preloaded->get())
+                            {
+                                preloadedUri = tokens[1];
+                                Log::info("Preloaded template [" + tokens[1] + "] in " +
+                                          std::to_string(timestamp.elapsed() / 1000) + " ms.");
+                            }
+                            else
+                            {
+                                Log::error("Failed to preload template [" + tokens[1] + "].");
+                                preloaded.reset();
+                            }
                         }
-                    }
-                    else if (document && document->canDiscard())
-                    {
-                        TerminationFlag = true;
-                    }
-                    else
+                        else if (tokens[0] == "tile" || tokens[0] == "tilecombine" || tokens[0] == "trimmemory" ||
+                                 tokens[0] == "canceltiles" || tokens[0] == "renderfonts")
+                        {
+                            // Rendering keeps the buffers to trim, so to the same thread.
+                            if (document)
+                            {
+                                int traceId = -1;
+                                if ((tokens[0] == "tile" || tokens[0] == "tilecombine") &&
+                                    LOOLProtocol::getTokenInteger(tokens, "trace", traceId))
+                                {
+                                    Trace::record(traceId, Trace::Stage::KitReceived);
+                                }
+
+                                document->queueTileRequest(data);
+                            }
+                        }
+                        else if (document && document->canDiscard())
+                        {
+                            discarded = true;
+                        }
+                        else
+                        {
+                            Log::info("Bad or unknown token [" + tokens[0] + "]");
+                        }
+
+                        return true;
+                    },
+                    []() {},
+                    [&document, &discarded]()
                     {
-                        Log::info("Bad or unknown token [" + tokens[0] + "]");
-                    }
+                        if (document && document->canDiscard())
+                            discarded = true;
+                        return TerminationFlag || discarded;
+                    },
+                    controlWakeup);
+
+            // WSD may have closed on us before we noticed.
+            if (!discarded && !TerminationFlag && document)
+            {
+                discarded = document->canDiscard();
+            }
 
-                    return true;
-                },
-                []() {},
-                [&document]()
-                {
-                    if (document && document->canDiscard())
-                        TerminationFlag = true;
-                    return TerminationFlag;
-                });
+            ++documents;
+            const auto growthKb = getPeakMemoryKb() - readyPeakKb;
+            if (TerminationFlag || !discarded || documents >= maxDocuments ||
+                growthKb > static_cast<long>(maxMemoryGrowthKb))
+            {
+                Log::info() << "Finishing after " << documents << " documents, grown by "
+                            << growthKb << " KB." << Log::end;
+                Util::setTerminationFlag();
+                break;
+            }
+
+            // Closed cleanly, reset and offer ourselves for another document.
+            document.reset();
+            IoUtil::shutdownWebSocket(ws);
+            if (bRunInsideJail && !jailPath.isRelative())
+            {
+                Log::info("Removing '" + std::string(JAILED_DOCUMENT_ROOT) + "' to recycle.");
+                Util::removeFile(std::string(JAILED_DOCUMENT_ROOT), true);
+            }
+
+            Log::info() << "Recycling after " << documents << " documents, grown by "
+                        << growthKb << " KB." << Log::end;
+        }
 
         // Clean up jail if we created one
         if (bRunInsideJail && !jailPath.isRelative())
@@ -1268,6 +2398,7 @@ void lokit_main(const std::string& childRoot,
     // backtrace.
     sleep(1);
     Log::info("Process finished.");
+    Log::shutdown();
     std::_Exit(Application::EXIT_OK);
 }
 
@@ -9,11 +9,27 @@
 #ifndef INCLUDED_LOOLKIT_HPP
 #define INCLUDED_LOOLKIT_HPP
 
+namespace png
+{
+    struct EncodeOptions;
+}
+
 void lokit_main(const std::string& childRoot,
                 const std::string& sysTemplate,
                 const std::string& loTemplate,
                 const std::string& loSubPath,
-                bool noCapabilities);
+                bool noCapabilities,
+                unsigned renderThreads,
+                const png::EncodeOptions& tileEncoding,
+                bool tileDeltas,
+                unsigned callbackCoalesceMs,
+                unsigned prefetchPercent,
+                unsigned renderBudgetMs,
+                unsigned maxDocuments,
+                unsigned maxMemoryGrowthKb);
+
+/// Walks the templates of the jails once, for the kits forked after to only link them.
+void prepareJailTemplates(const std::string& sysTemplate, const std::string& loTemplate);
 
 bool globalPreinit(const std::string &loTemplate);
 
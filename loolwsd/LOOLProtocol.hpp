@@ -10,8 +10,12 @@
 #ifndef INCLUDED_LOOLPROTOCOL_HPP
 #define INCLUDED_LOOLPROTOCOL_HPP
 
+#include <cctype>
+#include <cstdint>
 #include <cstring>
+#include <limits>
 #include <map>
+#include <stdexcept>
 #include <string>
 
 #include <Poco/StringTokenizer.h>
@@ -24,7 +28,16 @@ namespace LOOLProtocol
     // Protocol Version Number.
     // See protocol.txt.
     constexpr unsigned ProtocolMajorVersionNumber = 0;
-    constexpr unsigned ProtocolMinorVersionNumber = 1;
+    constexpr unsigned ProtocolMinorVersionNumber = 4;
+
+    // First minor version whose clients accept 'tilecombine:' responses.
+    constexpr unsigned ProtocolCombinedTilesMinorVersionNumber = 2;
+
+    // First minor version whose clients apply 'tiledelta:' responses.
+    constexpr unsigned ProtocolTileDeltasMinorVersionNumber = 3;
+
+    // First minor version whose clients read large messages without a 'nextmessage:' first.
+    constexpr unsigned ProtocolLargeFramesMinorVersionNumber = 4;
 
     inline
     std::string GetProtocolVersion()
@@ -49,6 +62,172 @@ namespace LOOLProtocol
     bool getTokenString(const Poco::StringTokenizer& tokens, const std::string& name, std::string& value);
     bool getTokenKeyword(const Poco::StringTokenizer& tokens, const std::string& name, const std::map<std::string, int>& map, int& value);
 
+    /// Parses the integer at the start of [begin, end), like std::stoi does
+    /// with a string, but without allocating: leading whitespace is skipped
+    /// and anything after the digits ignored.
+    /// Returns false when there is no integer, throws std::out_of_range
+    /// when it doesn't fit.
+    inline
+    bool parseInteger(const char *begin, const char *end, int& value)
+    {
+        const char *pos = begin;
+        while (pos != end && std::isspace(static_cast<unsigned char>(*pos)))
+        {
+            ++pos;
+        }
+
+        bool negative = false;
+        if (pos != end && (*pos == '-' || *pos == '+'))
+        {
+            negative = (*pos == '-');
+            ++pos;
+        }
+
+        if (pos == end || *pos < '0' || *pos > '9')
+        {
+            return false;
+        }
+
+        const int64_t limit = static_cast<int64_t>(std::numeric_limits<int>::max()) + (negative ? 1 : 0);
+        int64_t result = 0;
+        for (; pos != end && *pos >= '0' && *pos <= '9'; ++pos)
+        {
+            result = result * 10 + (*pos - '0');
+            if (result > limit)
+            {
+                throw std::out_of_range("Integer out of range.");
+            }
+        }
+
+        value = static_cast<int>(negative ? -result : result);
+        return true;
+    }
+
+    /// Trims the whitespace around [begin, end), as StringTokenizer::TOK_TRIM does.
+    inline
+    void trim(const char *&begin, const char *&end)
+    {
+        while (begin != end && std::isspace(static_cast<unsigned char>(*begin)))
+        {
+            ++begin;
+        }
+
+        while (end != begin && std::isspace(static_cast<unsigned char>(*(end - 1))))
+        {
+            --end;
+        }
+    }
+
+    /// Calls func(name, nameEnd, value, valueEnd) for each name=value token of
+    /// the space-separated message, in order, skipping the tokens without '='.
+    template <typename Func>
+    void forEachNameValue(const char *message, const size_t length, Func func)
+    {
+        const char *const end = message + length;
+        const char *pos = message;
+        while (pos != end)
+        {
+            const char *tokenEnd = static_cast<const char *>(std::memchr(pos, ' ', end - pos));
+            if (tokenEnd == nullptr)
+            {
+                tokenEnd = end;
+            }
+
+            const char *begin = pos;
+            const char *last = tokenEnd;
+            trim(begin, last);
+            const char *equals = static_cast<const char *>(std::memchr(begin, '=', last - begin));
+            if (equals != nullptr)
+            {
+                func(begin, equals, equals + 1, last);
+            }
+
+            pos = (tokenEnd == end ? end : tokenEnd + 1);
+        }
+    }
+
+    /// True if [name, nameEnd) is the given literal.
+    template <size_t N>
+    bool nameEquals(const char *name, const char *nameEnd, const char (&literal)[N])
+    {
+        return (static_cast<size_t>(nameEnd - name) == N - 1 && std::memcmp(name, literal, N - 1) == 0);
+    }
+
+    /// Reads the integers of a comma-separated list in turn, without allocating.
+    /// Items are trimmed and the empty ones skipped, as with StringTokenizer.
+    class IntegerListReader
+    {
+    public:
+        IntegerListReader(const char *begin, const char *end) :
+            _pos(begin),
+            _end(end)
+        {
+        }
+
+        /// Returns false at the end of the list.
+        /// Throws std::invalid_argument for an item that isn't an integer.
+        bool next(int& value)
+        {
+            while (_pos != _end)
+            {
+                const char *itemEnd = static_cast<const char *>(std::memchr(_pos, ',', _end - _pos));
+                if (itemEnd == nullptr)
+                {
+                    itemEnd = _end;
+                }
+
+                const char *begin = _pos;
+                const char *last = itemEnd;
+                _pos = (itemEnd == _end ? _end : itemEnd + 1);
+
+                trim(begin, last);
+                if (begin != last)
+                {
+                    if (!parseInteger(begin, last, value))
+                    {
+                        throw std::invalid_argument("Invalid integer in list.");
+                    }
+
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+    private:
+        const char *_pos;
+        const char *const _end;
+    };
+
+    /// Appends the decimal representation of value, without a temporary string.
+    inline
+    void appendInteger(std::string& output, const int value)
+    {
+        char buffer[12];
+        char *pos = buffer + sizeof(buffer);
+        int64_t remaining = value;
+        const bool negative = (remaining < 0);
+        if (negative)
+        {
+            remaining = -remaining;
+        }
+
+        do
+        {
+            *--pos = static_cast<char>('0' + remaining % 10);
+            remaining /= 10;
+        }
+        while (remaining != 0);
+
+        if (negative)
+        {
+            *--pos = '-';
+        }
+
+        output.append(pos, buffer + sizeof(buffer) - pos);
+    }
+
     // Functions that parse messages. All return false if parsing fails
     bool parseStatus(const std::string& message, LibreOfficeKitDocumentType& type, int& nParts, int& currentPart, int& width, int& height);
 
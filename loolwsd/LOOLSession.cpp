@@ -15,6 +15,7 @@
 #include <ftw.h>
 #include <utime.h>
 
+#include <algorithm>
 #include <cassert>
 #include <cstring>
 #include <fstream>
@@ -39,6 +40,7 @@
 #include "Log.hpp"
 #include "TileCache.hpp"
 #include "Util.hpp"
+#include "WebSocketDeflate.hpp"
 
 using namespace LOOLProtocol;
 
@@ -59,9 +61,13 @@ LOOLSession::LOOLSession(const std::string& id, const Kind kind,
     _isDocLoaded(false),
     _isDocPasswordProtected(false),
     _isCloseFrame(false),
+    _announceLargeFrames(kind == Kind::ToClient || !IoUtil::CanReceiveLargeFrames),
+    _gatherFrames(false),
     _disconnected(false),
     _isActive(true),
-    _lastActivityTime(std::chrono::steady_clock::now())
+    _lastActivityTime(std::chrono::steady_clock::now()),
+    _sendingFragments(false),
+    _compressingFragments(false)
 {
     // Only a post request can have a null ws.
     if (_kind != Kind::ToClient)
@@ -82,19 +88,20 @@ bool LOOLSession::sendTextFrame(const std::string& text)
         return false;
     }
 
-    Log::trace(getName() + " Send: " + getAbbreviatedMessage(text.c_str(), text.size()));
+    if (Log::traceEnabled())
+    {
+        Log::trace(getName() + " Send: " + getAbbreviatedMessage(text.c_str(), text.size()));
+    }
+
     try
     {
-        std::unique_lock<std::mutex> lock(_mutex);
+        auto lock = lockSend();
 
-        const int length = text.size();
-        if ( length > SMALL_MESSAGE_SIZE )
+        if (!sendCompressed(text.data(), text.size(), WebSocket::FRAME_TEXT))
         {
-            const std::string nextmessage = "nextmessage: size=" + std::to_string(length);
-            _ws->sendFrame(nextmessage.data(), nextmessage.size());
+            IoUtil::sendFrame(*_ws, text.data(), text.size(), WebSocket::FRAME_TEXT, _announceLargeFrames);
         }
 
-        _ws->sendFrame(text.data(), length);
         return true;
     }
     catch (const Exception& exc)
@@ -115,18 +122,21 @@ bool LOOLSession::sendBinaryFrame(const char *buffer, int length)
         return false;
     }
 
-    Log::trace(getName() + " Send: " + std::to_string(length) + " bytes");
+    if (Log::traceEnabled())
+    {
+        Log::trace(getName() + " Send: " + std::to_string(length) + " bytes");
+    }
+
     try
     {
-        std::unique_lock<std::mutex> lock(_mutex);
+        auto lock = lockSend();
 
-        if ( length > SMALL_MESSAGE_SIZE )
+        // The messages of the kits forwarded, text but for the images.
+        if (!sendCompressed(buffer, length, WebSocket::FRAME_BINARY))
         {
-            const std::string nextmessage = "nextmessage: size=" + std::to_string(length);
-            _ws->sendFrame(nextmessage.data(), nextmessage.size());
+            IoUtil::sendFrame(*_ws, buffer, length, WebSocket::FRAME_BINARY, _announceLargeFrames);
         }
 
-        _ws->sendFrame(buffer, length, WebSocket::FRAME_BINARY);
         return true;
     }
     catch (const Exception& exc)
@@ -139,6 +149,171 @@ bool LOOLSession::sendBinaryFrame(const char *buffer, int length)
     return false;
 }
 
+bool LOOLSession::sendBinaryFrame(const std::vector<iovec>& buffers)
+{
+    size_t length = 0;
+    for (const auto& buffer : buffers)
+    {
+        length += buffer.iov_len;
+    }
+
+    if (!_ws || _ws->poll(Poco::Timespan(0), Socket::SelectMode::SELECT_ERROR))
+    {
+        Log::error(getName() + ": Bad socket while sending binary frame of " + std::to_string(length) + " bytes.");
+        return false;
+    }
+
+    if (Log::traceEnabled())
+    {
+        Log::trace(getName() + " Send: " + std::to_string(length) + " bytes in " +
+                   std::to_string(buffers.size()) + " buffers");
+    }
+
+    try
+    {
+        auto lock = lockSend();
+
+        IoUtil::sendFrame(*_ws, buffers, WebSocket::FRAME_BINARY, _announceLargeFrames, _gatherFrames);
+        return true;
+    }
+    catch (const Exception& exc)
+    {
+        Log::error() << "LOOLSession::sendBinaryFrame: "
+                     << "Exception: " << exc.displayText()
+                     << (exc.nested() ? "( " + exc.nested()->displayText() + ")" : "");
+    }
+
+    return false;
+}
+
+bool LOOLSession::sendTextFrame(const std::string& prefix, const char* data, const size_t size)
+{
+    if (prefix.size() + size <= static_cast<size_t>(MESSAGE_FRAGMENT_SIZE))
+    {
+        return sendTextFrame(prefix + std::string(data, size));
+    }
+
+    if (!_ws || _ws->poll(Poco::Timespan(0), Socket::SelectMode::SELECT_ERROR))
+    {
+        Log::error(getName() + ": Bad socket while sending [" + prefix + "] of " + std::to_string(size) + " bytes.");
+        return false;
+    }
+
+    Log::trace() << getName() << " Send: " << prefix << size << " bytes in fragments" << Log::end;
+
+    try
+    {
+        auto lock = lockSend();
+
+        // The first fragment with the prefix, the rest straight from the data.
+        std::vector<char> first;
+        first.reserve(MESSAGE_FRAGMENT_SIZE);
+        first.insert(first.end(), prefix.begin(), prefix.end());
+        const size_t firstSize = std::min(size, MESSAGE_FRAGMENT_SIZE - first.size());
+        first.insert(first.end(), data, data + firstSize);
+        const bool compress = (_deflate != nullptr);
+        sendPart(first.data(), first.size(), WebSocket::FRAME_OP_TEXT, compress, true, false);
+
+        for (size_t offset = firstSize; offset < size; offset += MESSAGE_FRAGMENT_SIZE)
+        {
+            const size_t length = std::min<size_t>(size - offset, MESSAGE_FRAGMENT_SIZE);
+            const bool final = (offset + length == size);
+            sendPart(data + offset, length, WebSocket::FRAME_OP_CONT | (final ? WebSocket::FRAME_FLAG_FIN : 0),
+                     compress, false, final);
+        }
+
+        return true;
+    }
+    catch (const Exception& exc)
+    {
+        Log::error() << "LOOLSession::sendTextFrame: "
+                     << "Exception: " << exc.displayText()
+                     << (exc.nested() ? "( " + exc.nested()->displayText() + ")" : "");
+    }
+
+    return false;
+}
+
+bool LOOLSession::sendFragment(const char* data, const int length, const bool first, const bool final)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (first)
+    {
+        _fragmentsSentCV.wait(lock, [this]() { return !_sendingFragments; });
+        _sendingFragments = true;
+        _compressingFragments = (_deflate != nullptr);
+    }
+
+    bool success = false;
+    try
+    {
+        if (_ws)
+        {
+            const int flags = (first ? WebSocket::FRAME_OP_TEXT : WebSocket::FRAME_OP_CONT);
+            sendPart(data, length, flags | (final ? WebSocket::FRAME_FLAG_FIN : 0), _compressingFragments, first, final);
+            success = true;
+        }
+    }
+    catch (const Exception& exc)
+    {
+        Log::error() << "LOOLSession::sendFragment: "
+                     << "Exception: " << exc.displayText()
+                     << (exc.nested() ? "( " + exc.nested()->displayText() + ")" : "");
+    }
+
+    if (final)
+    {
+        _sendingFragments = false;
+        _fragmentsSentCV.notify_all();
+    }
+
+    return success;
+}
+
+std::unique_lock<std::mutex> LOOLSession::lockSend()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _fragmentsSentCV.wait(lock, [this]() { return !_sendingFragments; });
+    return lock;
+}
+
+bool LOOLSession::sendCompressed(const char* data, const size_t size, const int flags)
+{
+    if (!_deflate || !_deflate->isCompressible(data, size) || !_deflate->compress(data, size, _deflated))
+    {
+        return false;
+    }
+
+    if (_announceLargeFrames && size > SMALL_MESSAGE_SIZE)
+    {
+        // The size the client gets.
+        const std::string nextmessage = "nextmessage: size=" + std::to_string(size);
+        _ws->sendFrame(nextmessage.data(), nextmessage.size());
+    }
+
+    _ws->sendFrame(_deflated.data(), static_cast<int>(_deflated.size()), flags | WebSocket::FRAME_FLAG_RSV1);
+    return true;
+}
+
+void LOOLSession::sendPart(const char* data, const size_t size, const int flags,
+                           const bool compress, const bool first, const bool final)
+{
+    if (!compress)
+    {
+        _ws->sendFrame(data, static_cast<int>(size), flags);
+        return;
+    }
+
+    // The fragments of a message compressed are parts of one stream.
+    if (!_deflate->compressPart(data, size, _deflated, final))
+    {
+        throw IOException("Failed to compress a fragment of " + std::to_string(size) + " bytes.");
+    }
+
+    _ws->sendFrame(_deflated.data(), static_cast<int>(_deflated.size()),
+                   flags | (first ? WebSocket::FRAME_FLAG_RSV1 : 0));
+}
+
 void LOOLSession::parseDocOptions(const StringTokenizer& tokens, int& part, std::string& timestamp)
 {
     // First token is the "load" command itself.
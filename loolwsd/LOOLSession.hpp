@@ -12,9 +12,13 @@
 
 #include <atomic>
 #include <cassert>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <ostream>
+#include <vector>
+
+#include <sys/uio.h>
 
 #include <Poco/Net/WebSocket.h>
 #include <Poco/Buffer.h>
@@ -28,6 +32,8 @@
 #include "TileCache.hpp"
 #include "Log.hpp"
 
+class WebSocketDeflate;
+
 class LOOLSession
 {
 public:
@@ -44,6 +50,25 @@ public:
     bool sendTextFrame(const std::string& text);
     bool sendBinaryFrame(const char *buffer, int length);
 
+    /// Sends the buffers back to back as one binary frame, without copying
+    /// them into one first where the socket allows.
+    bool sendBinaryFrame(const std::vector<iovec>& buffers);
+
+    /// Sends the prefix then the data as one text message, in fragments of
+    /// MESSAGE_FRAGMENT_SIZE at most when large, without joining them first.
+    bool sendTextFrame(const std::string& prefix, const char* data, size_t size);
+
+    /// Sends a fragment of a text message relayed as it comes. Other messages
+    /// wait for the final fragment, not to be sent in the middle.
+    bool sendFragment(const char* data, int length, bool first, bool final);
+
+    /// Whether large messages are announced with 'nextmessage:', and so can't be streamed.
+    bool isAnnouncingLargeFrames() const { return _announceLargeFrames; }
+
+    /// Compresses the messages worth it, the peer having negotiated permessage-deflate.
+    void setDeflate(const std::shared_ptr<WebSocketDeflate>& deflate) { _deflate = deflate; }
+    const std::shared_ptr<WebSocketDeflate>& getDeflate() const { return _deflate; }
+
     bool handleInput(const char *buffer, int length);
 
     /// Invoked when we want to disconnect a session.
@@ -56,6 +81,8 @@ public:
     {
         if (_ws)
         {
+            // Not in the middle of a frame being sent.
+            std::unique_lock<std::mutex> lock(_mutex);
             _ws->shutdown(statusCode, message);
         }
     }
@@ -154,6 +181,15 @@ private:
 
     virtual bool _handleInput(const char *buffer, int length) = 0;
 
+protected:
+    /// Whether large frames are announced with 'nextmessage:'. Our own
+    /// processes don't need it, clients do unless their protocol says otherwise.
+    std::atomic<bool> _announceLargeFrames;
+
+    /// Whether frames may be written to the socket directly, gathered from
+    /// their buffers: only to clients, when not over SSL.
+    bool _gatherFrames;
+
 private:
     /// A session ID specific to an end-to-end connection (from user to lokit).
     std::string _id;
@@ -166,7 +202,27 @@ private:
 
     std::chrono::steady_clock::time_point _lastActivityTime;
 
+    /// Locks the socket to send a message, once the one relayed in fragments, if any, is sent.
+    std::unique_lock<std::mutex> lockSend();
+
+    /// Sends the message compressed, if negotiated and worth it, else
+    /// returns false. Requires the lock of sending.
+    bool sendCompressed(const char* data, size_t size, int flags);
+
+    /// Sends a frame of a message in fragments, compressed if compress.
+    /// Requires the lock of sending.
+    void sendPart(const char* data, size_t size, int flags, bool compress, bool first, bool final);
+
     std::mutex _mutex;
+    /// Whether a message relayed in fragments is being sent, under _mutex.
+    bool _sendingFragments;
+    /// Whether that message is compressed, under _mutex.
+    bool _compressingFragments;
+    std::condition_variable _fragmentsSentCV;
+
+    /// With permessage-deflate, the context, and the message last compressed, by the one sending.
+    std::shared_ptr<WebSocketDeflate> _deflate;
+    std::vector<char> _deflated;
 
     static constexpr auto InactivityThresholdMS = 120 * 1000;
 };
@@ -10,12 +10,22 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
 #include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <random>
+#include <thread>
+#include <vector>
 
+#include <Poco/CountingStream.h>
+#include <Poco/File.h>
 #include <Poco/Net/HTMLForm.h>
 #include <Poco/Net/NetException.h>
 #include <Poco/Net/HTTPClientSession.h>
@@ -26,14 +36,14 @@
 #include <Poco/Net/SSLManager.h>
 #include <Poco/Net/KeyConsoleHandler.h>
 #include <Poco/Net/AcceptCertificateHandler.h>
+#include <Poco/NullStream.h>
+#include <Poco/Path.h>
 #include <Poco/StreamCopier.h>
 #include <Poco/URI.h>
 #include <Poco/Process.h>
 #include <Poco/StringTokenizer.h>
-#include <Poco/Thread.h>
 #include <Poco/Timespan.h>
 #include <Poco/Timestamp.h>
-#include <Poco/URI.h>
 #include <Poco/Util/Application.h>
 #include <Poco/Util/HelpFormatter.h>
 #include <Poco/Util/Option.h>
@@ -43,10 +53,122 @@
 #include "LOOLProtocol.hpp"
 #include "Util.hpp"
 
-#include <Poco/Util/Application.h>
-#include <Poco/Util/OptionSet.h>
+/// The conversions to run, taken by the workers as they go, and how they went.
+class Batch
+{
+public:
+    struct Job
+    {
+        std::string _document;
+        unsigned _attempt;
+    };
+
+    Batch(const std::vector<std::string>& documents, const unsigned repeat, const unsigned retries) :
+        _retries(retries),
+        _succeeded(0),
+        _failed(0),
+        _retried(0),
+        _uploadBytes(0),
+        _downloadBytes(0)
+    {
+        for (unsigned i = 0; i < repeat; ++i)
+        {
+            for (const auto& document : documents)
+            {
+                _jobs.push_back(Job{ document, 0 });
+            }
+        }
+    }
 
-/** Simple command-line tool for file format conversion. */
+    bool take(Job& job)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_jobs.empty())
+        {
+            return false;
+        }
+
+        job = _jobs.front();
+        _jobs.pop_front();
+        return true;
+    }
+
+    void succeeded(const double latencyMs, const size_t uploadBytes, const size_t downloadBytes)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        ++_succeeded;
+        _latenciesMs.push_back(latencyMs);
+        _uploadBytes += uploadBytes;
+        _downloadBytes += downloadBytes;
+    }
+
+    /// Queues the job again, unless out of retries.
+    void failed(const Job& job, const std::string& error)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        ++_errors[error];
+        if (job._attempt < _retries)
+        {
+            ++_retried;
+            _jobs.push_back(Job{ job._document, job._attempt + 1 });
+        }
+        else
+        {
+            ++_failed;
+            std::cerr << "Failed to convert " << job._document << ": " << error << "\n";
+        }
+    }
+
+    bool isFailed()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _failed > 0;
+    }
+
+    void report(std::ostream& os, const double elapsedSecs)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        std::sort(_latenciesMs.begin(), _latenciesMs.end());
+        const auto percentile = [this](const double p)
+            {
+                if (_latenciesMs.empty())
+                {
+                    return 0.0;
+                }
+
+                const size_t index = std::min(_latenciesMs.size() - 1, static_cast<size_t>(p * _latenciesMs.size()));
+                return _latenciesMs[index];
+            };
+
+        os << std::fixed << std::setprecision(1)
+           << "Conversions: " << _succeeded << " succeeded, " << _failed << " failed, "
+           << _retried << " retried, in " << elapsedSecs << " s.\n"
+           << "Throughput: " << (elapsedSecs > 0 ? _succeeded / elapsedSecs : 0) << " conversions/s, "
+           << (elapsedSecs > 0 ? _uploadBytes / elapsedSecs / 1024 : 0) << " KB/s up, "
+           << (elapsedSecs > 0 ? _downloadBytes / elapsedSecs / 1024 : 0) << " KB/s down.\n"
+           << "Latency ms: p50 " << percentile(0.50) << ", p95 " << percentile(0.95)
+           << ", p99 " << percentile(0.99) << ", max " << (_latenciesMs.empty() ? 0 : _latenciesMs.back()) << ".\n";
+        for (const auto& error : _errors)
+        {
+            os << "Error: " << error.first << ": " << error.second << "\n";
+        }
+    }
+
+private:
+    std::mutex _mutex;
+    std::deque<Job> _jobs;
+    const unsigned _retries;
+    size_t _succeeded;
+    size_t _failed;
+    size_t _retried;
+    size_t _uploadBytes;
+    size_t _downloadBytes;
+    std::vector<double> _latenciesMs;
+    /// By kind: the HTTP status, or the exception.
+    std::map<std::string, size_t> _errors;
+};
+
+/** Command-line tool for file format conversion, and for benchmarking it. */
 class Tool: public Poco::Util::Application
 {
 public:
@@ -54,6 +176,9 @@ public:
     ~Tool() {}
 
     unsigned    _numWorkers;
+    unsigned    _pipelineDepth;
+    unsigned    _repeat;
+    unsigned    _retries;
     std::string _serverURI;
     std::string _destinationFormat;
     std::string _destinationDir;
@@ -70,94 +195,182 @@ using namespace LOOLProtocol;
 using Poco::Net::HTTPClientSession;
 using Poco::Net::HTTPRequest;
 using Poco::Net::HTTPResponse;
-using Poco::Runnable;
-using Poco::Thread;
 using Poco::URI;
 using Poco::Util::Application;
 using Poco::Util::HelpFormatter;
 using Poco::Util::Option;
 using Poco::Util::OptionSet;
 
-class Worker: public Runnable
+/// Converts the jobs of the batch, each worker on its own keep-alive
+/// connections. With a pipeline depth above 1, the next documents are
+/// uploaded, each on a connection of its own, while the server converts
+/// the first, whose result is downloaded meanwhile.
+class Worker
 {
 public:
-    Tool& _app;
-    std::vector< std::string > _files;
-    Worker(Tool& app, const std::vector< std::string > & files) :
-        _app(app), _files(files)
+    Worker(Tool& app, Batch& batch) :
+        _app(app),
+        _batch(batch),
+        _sessions(std::max(app._pipelineDepth, 1u))
     {
     }
 
-    void run() override
+    void run()
     {
-        for (const auto& i : _files)
-            convertFile(i);
+        std::deque<InFlight> inFlight;
+        Batch::Job job;
+        for (;;)
+        {
+            // Upload as many as the pipeline takes.
+            while (inFlight.size() < _sessions.size() && _batch.take(job))
+            {
+                InFlight request;
+                request._job = job;
+                request._session = getFreeSession(inFlight);
+                if (upload(request))
+                {
+                    inFlight.push_back(request);
+                }
+            }
+
+            if (inFlight.empty())
+            {
+                break;
+            }
+
+            download(inFlight.front());
+            inFlight.pop_front();
+        }
     }
 
-    void convertFile(const std::string& document)
+private:
+    struct InFlight
     {
-        std::cerr << "convert file " << document << "\n";
+        Batch::Job _job;
+        size_t _session;
+        size_t _uploadBytes;
+        std::chrono::steady_clock::time_point _start;
+    };
 
-        Poco::URI uri(_app._serverURI);
+    size_t getFreeSession(const std::deque<InFlight>& inFlight) const
+    {
+        for (size_t i = 0; i < _sessions.size(); ++i)
+        {
+            if (std::none_of(inFlight.begin(), inFlight.end(), [i](const InFlight& request) { return request._session == i; }))
+            {
+                return i;
+            }
+        }
 
-        Poco::Net::HTTPClientSession *session;
-        if (_app._serverURI.compare(0, 5, "https"))
-            session = new Poco::Net::HTTPSClientSession(uri.getHost(), uri.getPort());
-        else
-            session = new Poco::Net::HTTPClientSession(uri.getHost(), uri.getPort());
+        return 0;
+    }
 
-        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, "/convert-to");
+    /// Gives the server, or the network, a moment before trying again.
+    static void backOff(const Batch::Job& job)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100 << std::min(job._attempt, 5u)));
+    }
+
+    HTTPClientSession& getSession(const size_t index)
+    {
+        auto& session = _sessions[index];
+        if (!session)
+        {
+            Poco::URI uri(_app._serverURI);
+            if (uri.getScheme() == "https")
+                session.reset(new Poco::Net::HTTPSClientSession(uri.getHost(), uri.getPort()));
+            else
+                session.reset(new Poco::Net::HTTPClientSession(uri.getHost(), uri.getPort()));
+
+            session->setKeepAlive(true);
+        }
+
+        return *session;
+    }
+
+    bool upload(InFlight& request)
+    {
+        const auto& document = request._job._document;
+        request._start = std::chrono::steady_clock::now();
+        try
+        {
+            Poco::Net::HTTPRequest httpRequest(Poco::Net::HTTPRequest::HTTP_POST, "/convert-to", Poco::Net::HTTPMessage::HTTP_1_1);
+            httpRequest.setKeepAlive(true);
 
-        try {
             Poco::Net::HTMLForm form;
             form.setEncoding(Poco::Net::HTMLForm::ENCODING_MULTIPART);
             form.set("format", _app._destinationFormat);
             form.addPart("data", new Poco::Net::FilePartSource(document));
-            form.prepareSubmit(request);
+            form.prepareSubmit(httpRequest);
 
             // If this results in a Poco::Net::ConnectionRefusedException, loolwsd is not running.
-            form.write(session->sendRequest(request));
+            Poco::CountingOutputStream counter(getSession(request._session).sendRequest(httpRequest));
+            form.write(counter);
+            counter.flush();
+            request._uploadBytes = counter.chars();
+            return true;
         }
-        catch (const Poco::Exception &e)
+        catch (const Poco::Exception& exc)
         {
-            std::cerr << "Failed to write data: " << e.name() <<
-                  " " << e.message() << "\n";
-            return;
+            _sessions[request._session].reset();
+            _batch.failed(request._job, "upload " + exc.name());
+            backOff(request._job);
+            return false;
         }
+    }
 
-        Poco::Net::HTTPResponse response;
-
-        try {
-            std::cerr << "try to get response\n";
-
+    void download(InFlight& request)
+    {
+        const auto& document = request._job._document;
+        try
+        {
             // receiveResponse() resulted in a Poco::Net::NoMessageException.
-            std::istream& responseStream = session->receiveResponse(response);
-
-            std::cerr << "Get response\n";
-
-            Poco::Path path(document);
-            std::string outPath = _app._destinationDir + "/" + path.getBaseName() + "." + _app._destinationFormat;
-            std::ofstream fileStream(outPath);
-
-            std::cerr << "write to " << outPath << "\n";
-
-            Poco::StreamCopier::copyStream(responseStream, fileStream);
-
-            std::cerr << "Copied stream\n";
+            Poco::Net::HTTPResponse response;
+            std::istream& responseStream = getSession(request._session).receiveResponse(response);
+
+            // Read whole, for the connection to be reused.
+            std::unique_ptr<std::ostream> out;
+            if (response.getStatus() == HTTPResponse::HTTP_OK && !_app._destinationDir.empty())
+            {
+                Poco::Path path(document);
+                const std::string outPath = _app._destinationDir + "/" + path.getBaseName() + "." + _app._destinationFormat;
+                out.reset(new std::ofstream(outPath, std::ios::binary));
+            }
+            else
+            {
+                out.reset(new Poco::NullOutputStream());
+            }
+
+            const auto downloadBytes = Poco::StreamCopier::copyStream(responseStream, *out);
+            if (response.getStatus() != HTTPResponse::HTTP_OK)
+            {
+                _batch.failed(request._job, "HTTP " + std::to_string(response.getStatus()));
+                return;
+            }
+
+            const auto latency = std::chrono::steady_clock::now() - request._start;
+            _batch.succeeded(std::chrono::duration<double, std::milli>(latency).count(),
+                             request._uploadBytes, downloadBytes);
         }
-        catch (const Poco::Exception &e)
+        catch (const Poco::Exception& exc)
         {
-            std::cerr << "Exception converting: " << e.name() <<
-                  " " << e.message() << "\n";
-            return;
+            _sessions[request._session].reset();
+            _batch.failed(request._job, "download " + exc.name());
+            backOff(request._job);
         }
-
-        delete session;
     }
+
+private:
+    Tool& _app;
+    Batch& _batch;
+    std::vector<std::unique_ptr<HTTPClientSession>> _sessions;
 };
 
 Tool::Tool() :
     _numWorkers(4),
+    _pipelineDepth(1),
+    _repeat(1),
+    _retries(2),
 #if ENABLE_SSL
     _serverURI("https://127.0.0.1:" + std::to_string(DEFAULT_CLIENT_PORT_NUMBER)),
 #else
@@ -176,11 +389,20 @@ void Tool::defineOptions(OptionSet& optionSet)
     optionSet.addOption(Option("extension", "", "file format extension to convert to")
                         .required(false).repeatable(false)
                         .argument("format"));
-    optionSet.addOption(Option("outdir", "", "output directory for converted files")
+    optionSet.addOption(Option("outdir", "", "output directory for converted files, discarded if none")
                         .required(false).repeatable(false).argument("outdir"));
     optionSet.addOption(Option("parallelism", "", "number of simultaneous threads to use")
                         .required(false).repeatable(false)
                         .argument("threads"));
+    optionSet.addOption(Option("pipeline", "", "number of conversions each thread has under way, each on a connection")
+                        .required(false).repeatable(false)
+                        .argument("depth"));
+    optionSet.addOption(Option("repeat", "", "number of times each file is converted")
+                        .required(false).repeatable(false)
+                        .argument("count"));
+    optionSet.addOption(Option("retries", "", "number of times a failed conversion is tried again")
+                        .required(false).repeatable(false)
+                        .argument("count"));
     optionSet.addOption(Option("server", "", "URI of LOOL server")
                         .required(false).repeatable(false)
                         .argument("uri"));
@@ -209,7 +431,13 @@ void Tool::handleOption(const std::string& optionName,
         _destinationDir = value;
     else if (optionName == "parallelism")
         _numWorkers = std::max(std::stoi(value), 1);
-    else if (optionName == "uri")
+    else if (optionName == "pipeline")
+        _pipelineDepth = std::max(std::stoi(value), 1);
+    else if (optionName == "repeat")
+        _repeat = std::max(std::stoi(value), 1);
+    else if (optionName == "retries")
+        _retries = std::max(std::stoi(value), 0);
+    else if (optionName == "server")
         _serverURI = value;
     else if (optionName == "no-check-certificate")
     {
@@ -222,29 +450,26 @@ void Tool::handleOption(const std::string& optionName,
 
 int Tool::main(const std::vector<std::string>& args)
 {
-    std::vector<std::unique_ptr<Thread>> clients(_numWorkers);
+    Batch batch(args, _repeat, _retries);
+    const auto start = std::chrono::steady_clock::now();
 
-    size_t chunk = (args.size() + _numWorkers - 1) / _numWorkers;
-    size_t offset = 0;
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
     for (unsigned i = 0; i < _numWorkers; i++)
     {
-        clients[i].reset(new Thread());
-        size_t toCopy = std::min(args.size() - offset, chunk);
-        if (toCopy > 0)
-        {
-            std::vector< std::string > files( toCopy );
-            std::copy( args.begin() + offset, args.begin() + offset + toCopy, files.begin() );
-            offset += toCopy;
-            clients[i]->start(*(new Worker(*this, files)));
-        }
+        workers.emplace_back(new Worker(*this, batch));
+        threads.emplace_back([&workers, i]() { workers[i]->run(); });
     }
 
-    for (unsigned i = 0; i < _numWorkers; i++)
+    for (auto& thread : threads)
     {
-        clients[i]->join();
+        thread.join();
     }
 
-    return Application::EXIT_OK;
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    batch.report(std::cout, std::chrono::duration<double>(elapsed).count());
+
+    return batch.isFailed() ? Application::EXIT_SOFTWARE : Application::EXIT_OK;
 }
 
 POCO_APP_MAIN(Tool)
@@ -15,23 +15,29 @@
 // number of child processes, each which handles a viewing (editing) session for one document.
 
 #include <errno.h>
+#include <fcntl.h>
 #include <locale.h>
 #include <unistd.h>
 
+#include <sys/resource.h>
+#include <sys/sendfile.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
 #include <time.h>
 
+#include <algorithm>
 #include <cassert>
 #include <condition_variable>
 #include <cstdlib>
 #include <cstring>
 #include <fstream>
 #include <iostream>
+#include <limits>
 #include <map>
 #include <mutex>
+#include <set>
 #include <sstream>
 #include <thread>
 
@@ -48,12 +54,15 @@
 #include <Poco/Net/ConsoleCertificateHandler.h>
 #include <Poco/Net/Context.h>
 #include <Poco/Net/HTMLForm.h>
+#include <Poco/Net/HTTPClientSession.h>
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/Net/HTTPRequestHandler.h>
 #include <Poco/Net/HTTPRequestHandlerFactory.h>
+#include <Poco/Net/HTTPSClientSession.h>
 #include <Poco/Net/HTTPServer.h>
 #include <Poco/Net/HTTPServerParams.h>
 #include <Poco/Net/HTTPServerRequest.h>
+#include <Poco/Net/HTTPServerRequestImpl.h>
 #include <Poco/Net/HTTPServerResponse.h>
 #include <Poco/Net/InvalidCertificateHandler.h>
 #include <Poco/Net/KeyConsoleHandler.h>
@@ -83,34 +92,51 @@
 
 #include "Admin.hpp"
 #include "Auth.hpp"
+#include "BrokerRegistry.hpp"
 #include "ClientSession.hpp"
+#include "Cluster.hpp"
 #include "Common.hpp"
+#include "ConversionCache.hpp"
+#include "ConversionQueue.hpp"
 #include "Exceptions.hpp"
 #include "FileServer.hpp"
 #include "IoUtil.hpp"
 #include "LOOLProtocol.hpp"
 #include "LOOLSession.hpp"
 #include "Log.hpp"
+#include "MemoryPressure.hpp"
+#include "Metrics.hpp"
+#include "PrespawnControl.hpp"
 #include "PrisonerSession.hpp"
 #include "QueueHandler.hpp"
+#include "SessionRecord.hpp"
+#include "SocketPoll.hpp"
+#include "Startup.hpp"
 #include "Storage.hpp"
+#include "TileCacheQuota.hpp"
+#include "TileStore.hpp"
 #include "Unit.hpp"
 #include "UnitHTTP.hpp"
 #include "UserMessages.hpp"
 #include "Util.hpp"
+#include "WebSocketDeflate.hpp"
+#include "WorkQueue.hpp"
 
 using namespace LOOLProtocol;
 
 using Poco::Exception;
 using Poco::File;
 using Poco::Net::HTMLForm;
+using Poco::Net::HTTPClientSession;
 using Poco::Net::HTTPRequest;
 using Poco::Net::HTTPRequestHandler;
 using Poco::Net::HTTPRequestHandlerFactory;
 using Poco::Net::HTTPResponse;
+using Poco::Net::HTTPSClientSession;
 using Poco::Net::HTTPServer;
 using Poco::Net::HTTPServerParams;
 using Poco::Net::HTTPServerRequest;
+using Poco::Net::HTTPServerRequestImpl;
 using Poco::Net::HTTPServerResponse;
 using Poco::Net::MessageHeader;
 using Poco::Net::NameValueCollection;
@@ -153,13 +179,60 @@ static std::vector<std::shared_ptr<ChildProcess>> newChildren;
 static std::mutex newChildrenMutex;
 static std::condition_variable newChildrenCV;
 static std::chrono::steady_clock::time_point lastForkRequestTime = std::chrono::steady_clock::now();
-static std::map<std::string, std::shared_ptr<DocumentBroker>> docBrokers;
-static std::mutex docBrokersMutex;
+static PrespawnControl prespawnControl(1, 1);
+static size_t lastPrespawnTarget = 0;
+static BrokerRegistry<DocumentBroker> docBrokers;
+// The conversions, apart from the documents being edited, and on kits of their own.
+static BrokerRegistry<DocumentBroker> convertBrokers;
+static ConversionQueue conversionQueue(2, 100);
+static int ConvertQueueTimeoutSecs = 60;
+static int ConvertNiceness = 10;
+// The results kept for converting the same again, if enabled.
+static std::unique_ptr<ConversionCache> conversionCache;
+// Guarded by newChildrenMutex, as are the kits forked for them and those that served them,
+// to take these back once recycled.
+static std::vector<std::shared_ptr<ChildProcess>> convertChildren;
+static size_t convertForksPending = 0;
+static size_t convertChildWaiters = 0;
+static std::set<Poco::Process::PID> convertPids;
+/// A template the storage makes new documents of, and the spare kit it is loaded in,
+/// for those documents to open at once. Guarded by newChildrenMutex.
+struct NewDocumentTemplate
+{
+    std::string _path;
+    std::string _extension;
+    size_t _size;
+    std::shared_ptr<ChildProcess> _child;
+};
+static std::vector<NewDocumentTemplate> newDocumentTemplates;
+static MemoryPressure memoryPressure(0);
+static MemoryPressure::Level lastMemoryPressureLevel = MemoryPressure::Level::None;
+/// Under memory pressure, how long a document must have been idle
+/// for its kit to be trimmed, and to be unloaded.
+static constexpr double MemoryPressureTrimIdleMs = 30 * 1000;
+static constexpr double MemoryPressureUnloadIdleMs = 300 * 1000;
 // Sessions to pre-spawned child processes that have connected but are not yet assigned a
 // document to work on.
 static std::mutex AvailableChildSessionMutex;
 static std::condition_variable AvailableChildSessionCV;
 static std::map<std::string, std::shared_ptr<PrisonerSession>> AvailableChildSessions;
+// Multiplexes the websockets of the sessions and the children, unless each has its own thread.
+static std::shared_ptr<SocketPoll> WebSocketPoll;
+// Saves the documents to Storage, off the threads of their sessions.
+static std::unique_ptr<WorkQueue> SaveQueue;
+static std::mutex SaveQueueMutex;
+// The nodes the clients of each document are routed to the one loading it, if several.
+static std::unique_ptr<Cluster> ClusterNodes;
+static std::string ClusterSecret;
+static int ClusterPollMs = 2000;
+static const std::string ClusterHopHeader = "X-LOOL-Cluster-Hop";
+static const std::string ClusterSecretHeader = "X-LOOL-Cluster-Secret";
+// How often the tile caches are measured against their quota, if any, and their blobs collected.
+static int TileCacheQuotaCheckSecs = 60;
+// Compresses the large messages to the clients that offer permessage-deflate, if enabled.
+static bool WebSocketDeflateEnabled = false;
+static size_t WebSocketDeflateMinSize = 1024;
+static int WebSocketDeflateLevel = 6;
 
 #if ENABLE_DEBUG
 static int careerSpanSeconds = 0;
@@ -175,9 +248,29 @@ static void forkChildren(const int number)
         Log::debug("MasterToForKit: " + aMessage.substr(0, aMessage.length() - 1));
         IoUtil::writeFIFO(LOOLWSD::ForKitWritePipe, aMessage);
         lastForkRequestTime = std::chrono::steady_clock::now();
+        prespawnControl.recordFork(number, lastForkRequestTime);
     }
 }
 
+/// Returns the number of children to keep waiting,
+/// logging and reporting to the admin console when it changes.
+static int getPrespawnTarget()
+{
+    Util::assertIsLocked(newChildrenMutex);
+
+    const auto now = std::chrono::steady_clock::now();
+    const auto target = prespawnControl.getTarget(now);
+    if (target != lastPrespawnTarget)
+    {
+        const auto stats = prespawnControl.getStats(now);
+        Log::info("Prespawning " + std::to_string(target) + " children: " + stats);
+        Admin::instance().notify("prespawn_stats " + stats);
+        lastPrespawnTarget = target;
+    }
+
+    return target;
+}
+
 /// Called on startup only.
 static void preForkChildren()
 {
@@ -206,6 +299,18 @@ static void prespawnChildren()
         }
     }
 
+    for (auto it = convertPids.begin(); it != convertPids.end(); )
+    {
+        if (kill(*it, 0) != 0 && errno == ESRCH)
+        {
+            it = convertPids.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+
     const auto duration = (std::chrono::steady_clock::now() - lastForkRequestTime);
     if (std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() <= CHILD_TIMEOUT_SECS * 1000)
     {
@@ -214,21 +319,186 @@ static void prespawnChildren()
     }
 
     const int available = newChildren.size();
-    int balance = LOOLWSD::NumPreSpawnedChildren;
+    int balance = getPrespawnTarget();
     balance -= available;
     forkChildren(balance);
 }
 
-static size_t addNewChild(const std::shared_ptr<ChildProcess>& child)
+/// Has a spare kit load each template not loaded in one, which prespawnChildren()
+/// replaces then. The template is copied in the documents of the jail of the kit.
+static void preloadTemplates()
+{
+    std::unique_lock<std::mutex> lock(newChildrenMutex, std::defer_lock);
+    if (!lock.try_lock())
+    {
+        return;
+    }
+
+    for (auto& newTemplate : newDocumentTemplates)
+    {
+        if (newTemplate._child && newTemplate._child->isAlive())
+        {
+            continue;
+        }
+
+        newTemplate._child.reset();
+        while (!newChildren.empty() && !newTemplate._child)
+        {
+            auto child = newChildren.back();
+            newChildren.pop_back();
+            if (!child->isAlive())
+            {
+                continue;
+            }
+
+            const auto jailId = std::to_string(child->getPid());
+            const auto name = ".template." + newTemplate._extension;
+            const auto jailedDir = std::string(JAILED_DOCUMENT_ROOT) + jailId;
+            try
+            {
+                const auto dir = LOOLWSD::ChildRoot + jailId + jailedDir;
+                File(dir).createDirectories();
+                File(newTemplate._path).copyTo(dir + '/' + name);
+
+                const std::string message = "preload file://" + jailedDir + '/' + name;
+                Log::info("Preloading template [" + newTemplate._path + "] in child [" + jailId + "].");
+                child->getWebSocket()->sendFrame(message.data(), message.size());
+                newTemplate._child = child;
+            }
+            catch (const std::exception& exc)
+            {
+                Log::error("Failed to preload template [" + newTemplate._path + "]: " + exc.what());
+                newChildren.push_back(child);
+                break;
+            }
+        }
+    }
+}
+
+/// The spare kit with the template the document is a new copy of, if any. Its name
+/// and size tell, the kit checks the content before taking its template for it.
+static std::shared_ptr<ChildProcess> getPreloadedChild(const Poco::URI& uriPublic)
+{
+    {
+        std::unique_lock<std::mutex> lock(newChildrenMutex);
+        if (std::none_of(newDocumentTemplates.begin(), newDocumentTemplates.end(),
+                         [](const NewDocumentTemplate& newTemplate) { return !!newTemplate._child; }))
+        {
+            return nullptr;
+        }
+    }
+
+    // As validated next, at no more cost.
+    StorageBase::FileInfo fileInfo;
+    try
+    {
+        auto storage = StorageBase::create("", "", uriPublic);
+        if (!storage)
+        {
+            return nullptr;
+        }
+
+        fileInfo = storage->getFileInfo(uriPublic);
+    }
+    catch (const std::exception&)
+    {
+        return nullptr;
+    }
+
+    const auto extension = Poco::Path(fileInfo._filename).getExtension();
+    std::unique_lock<std::mutex> lock(newChildrenMutex);
+    for (auto& newTemplate : newDocumentTemplates)
+    {
+        if (newTemplate._child && newTemplate._extension == extension && newTemplate._size == fileInfo._size)
+        {
+            auto child = newTemplate._child;
+            newTemplate._child.reset();
+            if (child->isAlive())
+            {
+                Log::info("Taking child [" + std::to_string(child->getPid()) + "] with template [" +
+                          newTemplate._path + "] for [" + uriPublic.toString() + "].");
+                return child;
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+/// Lowers the priority of each thread of the process, as setpriority() sets that
+/// of a single one. Those it creates after inherit it.
+static void lowerPriority(const Poco::Process::PID pid, const int niceness)
+{
+    std::vector<std::string> threads;
+    try
+    {
+        File("/proc/" + std::to_string(pid) + "/task").list(threads);
+    }
+    catch (const Exception& exc)
+    {
+        Log::warn("Cannot list the threads of [" + std::to_string(pid) + "]: " + exc.displayText());
+    }
+
+    for (const auto& thread : threads)
+    {
+        if (setpriority(PRIO_PROCESS, std::stoi(thread), niceness) != 0)
+        {
+            Log::syserror("setpriority(" + thread + ", " + std::to_string(niceness) + ") failed.");
+        }
+    }
+}
+
+/// Forks children for the conversions, which addNewChild() sets apart.
+static void forkConvertChildren(const size_t number)
+{
+    Util::assertIsLocked(newChildrenMutex);
+
+    const std::string aMessage = "spawn " + std::to_string(number) + "\n";
+    Log::debug("MasterToForKit: " + aMessage.substr(0, aMessage.length() - 1) + " for conversions");
+    IoUtil::writeFIFO(LOOLWSD::ForKitWritePipe, aMessage);
+    convertForksPending += number;
+}
+
+/// recycled is for a child back from serving documents, not forked for us.
+static size_t addNewChild(const std::shared_ptr<ChildProcess>& child, const bool recycled)
 {
     std::unique_lock<std::mutex> lock(newChildrenMutex);
+    if (recycled ? convertPids.count(child->getPid()) > 0 : convertForksPending > 0)
+    {
+        if (!recycled)
+        {
+            --convertForksPending;
+            convertPids.insert(child->getPid());
+            lowerPriority(child->getPid(), ConvertNiceness);
+        }
+
+        convertChildren.emplace_back(child);
+        Log::info() << "Have " << convertChildren.size() << " conversion "
+                    << (convertChildren.size() == 1 ? "child" : "children")
+                    << "." << Log::end;
+
+        newChildrenCV.notify_all();
+        return newChildren.size();
+    }
+
     newChildren.emplace_back(child);
+    if (!recycled)
+    {
+        prespawnControl.recordReady(std::chrono::steady_clock::now());
+
+        static size_t forked = 0;
+        if (++forked == LOOLWSD::NumPreSpawnedChildren)
+        {
+            Startup::record(Startup::Phase::KitsReady);
+        }
+    }
+
     const auto count = newChildren.size();
     Log::info() << "Have " << count << " "
                 << (count == 1 ? "child" : "children")
                 << "." << Log::end;
 
-    newChildrenCV.notify_one();
+    newChildrenCV.notify_all();
     return count;
 }
 
@@ -238,10 +508,11 @@ static std::shared_ptr<ChildProcess> getNewChild()
 
     namespace chrono = std::chrono;
     const auto startTime = chrono::steady_clock::now();
+    prespawnControl.recordRequest(!newChildren.empty(), startTime);
     do
     {
         const int available = newChildren.size();
-        int balance = LOOLWSD::NumPreSpawnedChildren;
+        int balance = getPrespawnTarget();
         if (available == 0)
         {
             Log::error("getNewChild: No available child. Sending spawn request to forkit and failing.");
@@ -277,6 +548,216 @@ static std::shared_ptr<ChildProcess> getNewChild()
     return nullptr;
 }
 
+/// A child for a conversion, from those set apart for them, so that
+/// the conversions don't take those prespawned for the documents edited.
+/// One is kept waiting for the next conversion, and as many as waiting.
+static std::shared_ptr<ChildProcess> getConvertChild()
+{
+    std::unique_lock<std::mutex> lock(newChildrenMutex);
+    ++convertChildWaiters;
+
+    namespace chrono = std::chrono;
+    const auto startTime = chrono::steady_clock::now();
+    do
+    {
+        convertChildren.erase(std::remove_if(convertChildren.begin(), convertChildren.end(),
+                                             [](const std::shared_ptr<ChildProcess>& child) { return !child->isAlive(); }),
+                              convertChildren.end());
+
+        const size_t wanted = convertChildWaiters + 1;
+        const size_t have = convertChildren.size() + convertForksPending;
+        if (have < wanted)
+        {
+            forkConvertChildren(wanted - have);
+        }
+
+        const auto timeout = chrono::milliseconds(CHILD_TIMEOUT_SECS * 1000);
+        if (newChildrenCV.wait_for(lock, timeout, [](){ return !convertChildren.empty(); }))
+        {
+            auto child = convertChildren.back();
+            convertChildren.pop_back();
+            if (child && child->isAlive())
+            {
+                // The one to wait for the next.
+                --convertChildWaiters;
+                if (convertChildren.size() + convertForksPending < convertChildWaiters + 1)
+                {
+                    forkConvertChildren(1);
+                }
+
+                Log::debug("getConvertChild: Returning child [" + std::to_string(child->getPid()) + "].");
+                return child;
+            }
+        }
+        else
+        {
+            // Those forked may never come, fork anew.
+            convertForksPending = 0;
+        }
+    }
+    while (chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - startTime).count() < CHILD_TIMEOUT_SECS * 4000);
+
+    --convertChildWaiters;
+    Log::debug("getConvertChild: Timed out while waiting for a child.");
+    return nullptr;
+}
+
+/// What this node can take, for the others to place the new documents.
+static Cluster::Load getClusterLoad()
+{
+    Cluster::Load load;
+    {
+        std::unique_lock<std::mutex> lock(newChildrenMutex);
+        load._spareKits = newChildren.size();
+    }
+
+    load._freeKb = memoryPressure.getFreeKb();
+    load._documents = docBrokers.size();
+    return load;
+}
+
+/// A session to the node of the cluster, of URI http(s)://host:port.
+static std::unique_ptr<HTTPClientSession> createClusterSession(const std::string& node)
+{
+    const URI uri(node);
+    std::unique_ptr<HTTPClientSession> session;
+#if ENABLE_SSL
+    if (uri.getScheme() == "https")
+    {
+        session.reset(new HTTPSClientSession(uri.getHost(), uri.getPort()));
+    }
+    else
+#endif
+    {
+        session.reset(new HTTPClientSession(uri.getHost(), uri.getPort()));
+    }
+
+    session->setTimeout(Poco::Timespan(COMMAND_TIMEOUT_MS * 1000));
+    return session;
+}
+
+/// Whether the request comes from another node, and how many times it was routed.
+static int getClusterHop(const HTTPServerRequest& request)
+{
+    if (!request.has(ClusterHopHeader) ||
+        !Util::equalsConstantTime(request.get(ClusterSecretHeader, ""), ClusterSecret))
+    {
+        return 0;
+    }
+
+    return std::atoi(request.get(ClusterHopHeader).c_str());
+}
+
+/// Exchanges the loads with the other nodes of the cluster, which are down
+/// while they don't answer, until termination.
+static void pollCluster()
+{
+    Util::setThreadName("cluster_poll");
+    Log::debug("Thread started.");
+
+    while (!TerminationFlag)
+    {
+        const auto now = std::chrono::steady_clock::now();
+        ClusterNodes->setLoad(ClusterNodes->getSelf(), getClusterLoad(), now);
+        for (const auto& node : ClusterNodes->getPeers())
+        {
+            try
+            {
+                auto session = createClusterSession(node);
+                HTTPRequest request(HTTPRequest::HTTP_GET, "/lool/cluster", HTTPRequest::HTTP_1_1);
+                request.set(ClusterSecretHeader, ClusterSecret);
+                session->sendRequest(request);
+
+                HTTPResponse response;
+                std::istream& rs = session->receiveResponse(response);
+                std::string body;
+                StreamCopier::copyToString(rs, body);
+
+                Cluster::Load load;
+                if (response.getStatus() == HTTPResponse::HTTP_OK && Cluster::Load::parse(body, load))
+                {
+                    ClusterNodes->setLoad(node, load, std::chrono::steady_clock::now());
+                }
+                else
+                {
+                    Log::warn("Cluster node [" + node + "] answered " + std::to_string(response.getStatus()) + ": " + body);
+                }
+            }
+            catch (const Exception& exc)
+            {
+                Log::warn("Cluster node [" + node + "] is down: " + exc.displayText());
+                ClusterNodes->setDown(node);
+            }
+            catch (const std::exception& exc)
+            {
+                Log::warn("Cluster node [" + node + "] is down: " + exc.what());
+                ClusterNodes->setDown(node);
+            }
+        }
+
+        ClusterNodes->expire(std::chrono::steady_clock::now());
+        for (int waited = 0; waited < ClusterPollMs && !TerminationFlag; waited += POLL_TIMEOUT_MS / 4)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(POLL_TIMEOUT_MS / 4));
+        }
+    }
+
+    Log::debug("Thread finished.");
+}
+
+/// Keeps the tile caches of all the documents within their quota, if any,
+/// and removes the blobs of the tiles no document refers to, in the background.
+static void manageTileCaches()
+{
+    Util::setThreadName("tile_caches");
+    Log::debug("Thread started.");
+
+    auto& quota = TileCacheQuota::instance();
+    const bool blobs = (LOOLWSD::TileCacheStore == "blobs");
+    if (quota.getQuota() > 0)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        const auto found = quota.scan();
+        Log::info("Found " + std::to_string(found) + " tile caches in " +
+                  std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(
+                                     std::chrono::steady_clock::now() - start).count()) +
+                  " ms: " + quota.getStats());
+    }
+
+    while (!TerminationFlag)
+    {
+        if (quota.getQuota() > 0)
+        {
+            const auto evicted = quota.update();
+            if (evicted > 0)
+            {
+                Log::info("Evicted " + std::to_string(evicted) + " tile caches: " + quota.getStats());
+            }
+            else if (quota.getBytes() > quota.getQuota())
+            {
+                Log::warn("Tile caches over their quota, of documents open: " + quota.getStats());
+            }
+        }
+
+        if (blobs)
+        {
+            // Those of the caches evicted or cleared included.
+            const auto collected = BlobTileStore::collect(LOOLWSD::getTileBlobsPath());
+            if (collected > 0)
+            {
+                Log::debug("Removed " + std::to_string(collected) + " tile blobs: " + BlobTileStore::getStats());
+            }
+        }
+
+        for (int waited = 0; waited < TileCacheQuotaCheckSecs * 1000 && !TerminationFlag; waited += POLL_TIMEOUT_MS / 4)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(POLL_TIMEOUT_MS / 4));
+        }
+    }
+
+    Log::debug("Thread finished.");
+}
+
 /// Handles the filename part of the convert-to POST request payload.
 class ConvertToPartHandler : public PartHandler
 {
@@ -314,32 +795,196 @@ public:
     }
 };
 
+/// Waits for the kit to connect the session of id, false on timeout.
+static bool waitChildSession(const std::string& id)
+{
+    bool isFound = false;
+    std::unique_lock<std::mutex> lock(AvailableChildSessionMutex);
+    Log::debug() << "Waiting for client session [" << id << "] to connect." << Log::end;
+    AvailableChildSessionCV.wait_for(
+        lock,
+        std::chrono::milliseconds(COMMAND_TIMEOUT_MS),
+        [&isFound, &id]
+        {
+            return (isFound = AvailableChildSessions.find(id) != AvailableChildSessions.end());
+        });
+
+    if (!isFound)
+    {
+        return false;
+    }
+
+    Log::debug("Waiting child session permission, done!");
+    AvailableChildSessions.erase(id);
+    return true;
+}
+
 /// Handle a public connection from a client.
 class ClientRequestHandler: public HTTPRequestHandler
 {
 private:
     static void waitBridgeCompleted(const std::shared_ptr<ClientSession>& session)
     {
-        bool isFound = false;
-        std::unique_lock<std::mutex> lock(AvailableChildSessionMutex);
-        Log::debug() << "Waiting for client session [" << session->getId() << "] to connect." << Log::end;
-        AvailableChildSessionCV.wait_for(
-            lock,
-            std::chrono::milliseconds(COMMAND_TIMEOUT_MS),
-            [&isFound, &session]
-            {
-                return (isFound = AvailableChildSessions.find(session->getId()) != AvailableChildSessions.end());
-            });
-
-        if (!isFound)
+        if (!waitChildSession(session->getId()))
         {
             // Let the client know we can't serve now.
             Log::error(session->getName() + ": Failed to connect to lokit process. Client cannot serve now.");
             throw WebSocketErrorMessageException(SERVICE_UNAVALABLE_INTERNAL_ERROR);
         }
+    }
+
+    /// Removes the directory off the thread of the request, which is done once sent.
+    static void removeDirectoryLater(const std::string& path)
+    {
+        static WorkQueue cleanupQueue("file_cleanup");
+        cleanupQueue.post([path]() { Util::removeFile(path, /*recursive=*/true); });
+    }
+
+    /// Cleans up the temporary directory the HTMLForm ctor created.
+    static void removeTempDirectory(const std::string& fromPath)
+    {
+        Path tempDirectory(fromPath);
+        tempDirectory.setFileName("");
+        removeDirectoryLater(tempDirectory.toString());
+    }
+
+    /// Sends the file as the response with sendfile(), from the page cache
+    /// to the socket, instead of reading it through a buffer of ours.
+    /// Over SSL, which encrypts in userspace, as Poco does.
+    static void sendFile(HTTPServerRequest& request, HTTPServerResponse& response,
+                         const std::string& path, const std::string& mimeType)
+    {
+        auto requestImpl = dynamic_cast<HTTPServerRequestImpl*>(&request);
+        const int fd = (LOOLWSD::SSLEnabled || !requestImpl ? -1 : open(path.c_str(), O_RDONLY | O_CLOEXEC));
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+
+            response.sendFile(path, mimeType);
+            return;
+        }
+
+        response.setContentType(mimeType);
+        response.setContentLength(st.st_size);
+        response.setChunkedTransferEncoding(false);
+
+        // Only the headers go through Poco, whose stream buffers them:
+        // they must be out before the body is written past it.
+        response.send().flush();
+
+        const int socketFd = requestImpl->socket().impl()->sockfd();
+        off_t offset = 0;
+        while (offset < st.st_size)
+        {
+            const auto sent = sendfile(socketFd, fd, &offset, st.st_size - offset);
+            if (sent < 0 && errno == EINTR)
+            {
+                continue;
+            }
+
+            if (sent <= 0)
+            {
+                // Past the headers, the client sees the response cut short.
+                Log::syserror("sendfile of [" + path + "] failed after " + std::to_string(offset) + " bytes.");
+                break;
+            }
+        }
 
-        Log::debug("Waiting child session permission, done!");
-        AvailableChildSessions.erase(session->getId());
+        close(fd);
+        Log::debug() << "Sent " << offset << " bytes of [" << path << "] by sendfile." << Log::end;
+    }
+
+    /// Converts the document at fromPath to format, sending it in response.
+    /// On a kit of its own, with no DocumentBroker in docBrokers: it is not
+    /// edited, nor saved, hibernated or shown to the admin console.
+    /// Returns true if sent, then kept under cacheKey, unless empty.
+    static bool convertTo(const std::string& fromPath, const std::string& format, const std::string& options,
+                          const std::string& cacheKey, const std::string& id,
+                          HTTPServerRequest& request, HTTPServerResponse& response)
+    {
+        // Request a kit process for this doc.
+        auto child = getConvertChild();
+        if (!child)
+        {
+            // Let the client know we can't serve now.
+            throw std::runtime_error("Failed to spawn lokit child.");
+        }
+
+        auto uriPublic = DocumentBroker::sanitizeURI(fromPath);
+
+        // Of its own, even if the same document is open, or converted, already.
+        const auto docKey = DocumentBroker::getDocKey(uriPublic) + "_convert_" + id;
+        auto docBroker = std::make_shared<DocumentBroker>(uriPublic, docKey, LOOLWSD::ChildRoot, child);
+        Log::debug("New DocumentBroker for conversion docKey [" + docKey + "].");
+        convertBrokers.insert(docKey, docBroker);
+
+        bool sent = false;
+        try
+        {
+            // Load the document.
+            std::shared_ptr<WebSocket> ws;
+            auto session = std::make_shared<ClientSession>(id, ws, docBroker, nullptr);
+
+            // Request the child to connect to us and add this session.
+            auto sessionsCount = docBroker->addSession(session);
+            Log::trace(docKey + ", ws_sessions++: " + std::to_string(sessionsCount));
+
+            // Wait until the client has connected with a prison socket.
+            waitBridgeCompleted(session);
+            // Now the bridge between the client and kit processes is connected
+            // Let messages flow
+
+            std::string encodedFrom;
+            URI::encode(docBroker->getPublicUri().getPath(), "", encodedFrom);
+            const std::string load = "load url=" + encodedFrom;
+            session->handleInput(load.data(), load.size());
+
+            //FIXME: Check for security violations.
+            Path toPath(docBroker->getPublicUri().getPath());
+            toPath.setExtension(format);
+            const std::string toJailURL = "file://" + std::string(JAILED_DOCUMENT_ROOT) + toPath.getFileName();
+            std::string encodedTo;
+            URI::encode(toJailURL, "", encodedTo);
+
+            // Convert it to the requested format.
+            const auto saveas = "saveas url=" + encodedTo + " format=" + format + " options=" + options;
+            session->handleInput(saveas.data(), saveas.size());
+
+            // Send it back to the client.
+            //TODO: Should have timeout to avoid waiting forever.
+            Poco::URI resultURL(session->getSaveAsUrl());
+            if (!resultURL.getPath().empty())
+            {
+                const std::string mimeType = "application/octet-stream";
+                URI::encode(resultURL.getPath(), "", encodedTo);
+                sendFile(request, response, encodedTo, mimeType);
+                sent = true;
+
+                if (!cacheKey.empty() && !conversionCache->add(cacheKey, encodedTo))
+                {
+                    Log::warn("Failed to keep the conversion of [" + fromPath + "] in the cache.");
+                }
+            }
+
+            sessionsCount = docBroker->removeSession(id);
+            if (sessionsCount != 0)
+            {
+                Log::error("Multiple sessions during conversion. " + std::to_string(sessionsCount) + " sessions remain.");
+            }
+        }
+        catch (const std::exception&)
+        {
+            convertBrokers.erase(docKey, docBroker);
+            throw;
+        }
+
+        Log::debug("Removing DocumentBroker for conversion docKey [" + docKey + "].");
+        convertBrokers.erase(docKey, docBroker);
+        return sent;
     }
 
     /// Handle POST requests.
@@ -357,91 +1002,63 @@ private:
             const std::string format = (form.has("format") ? form.get("format") : "");
 
             bool sent = false;
+            bool busy = false;
             if (!fromPath.empty())
             {
                 if (!format.empty())
                 {
                     Log::info("Conversion request for URI [" + fromPath + "].");
 
-                    // Request a kit process for this doc.
-                    auto child = getNewChild();
-                    if (!child)
-                    {
-                        // Let the client know we can't serve now.
-                        throw std::runtime_error("Failed to spawn lokit child.");
-                    }
-
-                    auto uriPublic = DocumentBroker::sanitizeURI(fromPath);
-                    const auto docKey = DocumentBroker::getDocKey(uriPublic);
-                    auto docBroker = std::make_shared<DocumentBroker>(uriPublic, docKey, LOOLWSD::ChildRoot, child);
-
-                    // This lock could become a bottleneck.
-                    // In that case, we can use a pool and index by publicPath.
-                    std::unique_lock<std::mutex> lock(docBrokersMutex);
-
-                    //FIXME: What if the same document is already open? Need a fake dockey here?
-                    Log::debug("New DocumentBroker for docKey [" + docKey + "].");
-                    docBrokers.emplace(docKey, docBroker);
-
-                    // Load the document.
-                    std::shared_ptr<WebSocket> ws;
-                    auto session = std::make_shared<ClientSession>(id, ws, docBroker, nullptr);
-
-                    // Request the child to connect to us and add this session.
-                    auto sessionsCount = docBroker->addSession(session);
-                    Log::trace(docKey + ", ws_sessions++: " + std::to_string(sessionsCount));
-
-                    lock.unlock();
-
-                    // Wait until the client has connected with a prison socket.
-                    waitBridgeCompleted(session);
-                    // Now the bridge between the client and kit processes is connected
-                    // Let messages flow
-
-                    std::string encodedFrom;
-                    URI::encode(docBroker->getPublicUri().getPath(), "", encodedFrom);
-                    const std::string load = "load url=" + encodedFrom;
-                    session->handleInput(load.data(), load.size());
-
-                    //FIXME: Check for security violations.
-                    Path toPath(docBroker->getPublicUri().getPath());
-                    toPath.setExtension(format);
-                    const std::string toJailURL = "file://" + std::string(JAILED_DOCUMENT_ROOT) + toPath.getFileName();
-                    std::string encodedTo;
-                    URI::encode(toJailURL, "", encodedTo);
-
-                    // Convert it to the requested format.
-                    const auto saveas = "saveas url=" + encodedTo + " format=" + format + " options=";
-                    session->handleInput(saveas.data(), saveas.size());
-
-                    // Send it back to the client.
-                    //TODO: Should have timeout to avoid waiting forever.
-                    Poco::URI resultURL(session->getSaveAsUrl());
-                    if (!resultURL.getPath().empty())
+                    // None are taken from the request, yet.
+                    const std::string options;
+                    const auto cacheKey = (conversionCache ? ConversionCache::getKey(fromPath, format, options) : std::string());
+                    const auto cachedPath = (cacheKey.empty() ? std::string() : conversionCache->find(cacheKey));
+                    size_t queueMs = 0;
+                    if (!cachedPath.empty())
                     {
-                        const std::string mimeType = "application/octet-stream";
-                        URI::encode(resultURL.getPath(), "", encodedTo);
-                        response.sendFile(encodedTo, mimeType);
+                        Log::info("Conversion of [" + fromPath + "] to " + format + " served from the cache.");
+                        sendFile(request, response, cachedPath, "application/octet-stream");
                         sent = true;
                     }
-
-                    lock.lock();
-                    sessionsCount = docBroker->removeSession(id);
-                    if (sessionsCount == 0)
+                    else if (!conversionQueue.enter(ConvertQueueTimeoutSecs * 1000, queueMs))
                     {
-                        Log::debug("Removing DocumentBroker for docKey [" + docKey + "].");
-                        docBrokers.erase(docKey);
+                        Log::warn("Too many conversions queued, turning away [" + fromPath + "].");
+                        busy = true;
                     }
                     else
                     {
-                        Log::error("Multiple sessions during conversion. " + std::to_string(sessionsCount) + " sessions remain.");
+                        const auto convertStartTime = std::chrono::steady_clock::now();
+                        const auto getConvertMs = [&convertStartTime]()
+                            {
+                                return std::chrono::duration_cast<std::chrono::milliseconds>(
+                                    std::chrono::steady_clock::now() - convertStartTime).count();
+                            };
+                        try
+                        {
+                            sent = convertTo(fromPath, format, options, cacheKey, id, request, response);
+                        }
+                        catch (const std::exception&)
+                        {
+                            conversionQueue.leave(false, getConvertMs());
+                            removeTempDirectory(fromPath);
+                            throw;
+                        }
+
+                        const size_t convertMs = getConvertMs();
+                        conversionQueue.leave(sent, convertMs);
+                        Log::info() << "Conversion of [" << fromPath << "] " << (sent ? "done" : "failed")
+                                    << " in " << convertMs << " ms, after " << queueMs
+                                    << " ms queued." << Log::end;
                     }
                 }
 
-                // Clean up the temporary directory the HTMLForm ctor created.
-                Path tempDirectory(fromPath);
-                tempDirectory.setFileName("");
-                Util::removeFile(tempDirectory, /*recursive=*/true);
+                removeTempDirectory(fromPath);
+            }
+
+            if (busy)
+            {
+                // Surfaces as 503, to be retried later.
+                throw std::runtime_error("Too many conversions queued.");
             }
 
             if (!sent)
@@ -500,9 +1117,9 @@ private:
                 const std::string mimeType = form.has("mime_type")
                                            ? form.get("mime_type")
                                            : "application/octet-stream";
-                response.sendFile(filePath, mimeType);
+                sendFile(request, response, filePath, mimeType);
                 //TODO: Cleanup on error.
-                Util::removeFile(dirPath, true);
+                removeDirectoryLater(dirPath);
                 return true;
             }
             else
@@ -515,14 +1132,117 @@ private:
     }
 
     /// Handle GET requests.
-    static void handleGetRequest(HTTPServerRequest& request, std::shared_ptr<WebSocket>& ws, const std::string& id)
+    /// In a cluster, the node to load the document, empty for this one. Unless routed
+    /// already, the owner of the document is asked, and it places it. hop is that of the
+    /// request, and becomes that to route it with.
+    static std::string getClusterNode(const std::string& docKey, int& hop)
     {
-        Log::info("Starting GET request handler for session [" + id + "].");
+        if (!ClusterNodes || hop >= 2)
+        {
+            // Placed here by its owner.
+            return std::string();
+        }
 
-        // indicator to the client that document broker is searching
-        std::string status("statusindicator: find");
-        Log::trace("Sending to Client [" + status + "].");
-        ws->sendFrame(status.data(), (int) status.size());
+        const auto owner = ClusterNodes->getOwner(docKey);
+        if (owner != ClusterNodes->getSelf() && hop == 0)
+        {
+            hop = 1;
+            return owner;
+        }
+
+        // The owner, as by our ring or that of the node that routed it here.
+        if (docBrokers.find(docKey))
+        {
+            return std::string();
+        }
+
+        const auto now = std::chrono::steady_clock::now();
+        ClusterNodes->setLoad(ClusterNodes->getSelf(), getClusterLoad(), now);
+        const auto node = ClusterNodes->place(docKey, now);
+        if (node == ClusterNodes->getSelf())
+        {
+            // Kept while the document gets registered, which marks it as here from then on.
+            ClusterNodes->release(docKey, now);
+            return std::string();
+        }
+
+        hop = 2;
+        return node;
+    }
+
+    /// Relays the messages of the client to the node that loads its document, and back,
+    /// as if the client had connected to it. Returns false if that node can't be reached.
+    /// What the client compresses is inflated, what it gets isn't compressed.
+    static bool proxyClientSocket(HTTPServerRequest& request, const std::shared_ptr<WebSocket>& ws,
+                                  const std::shared_ptr<WebSocketDeflate>& deflate,
+                                  const std::string& node, const int hop)
+    {
+        std::shared_ptr<WebSocket> peer;
+        try
+        {
+            auto session = createClusterSession(node);
+            HTTPRequest peerRequest(HTTPRequest::HTTP_GET, request.getURI(), HTTPRequest::HTTP_1_1);
+            peerRequest.set(ClusterHopHeader, std::to_string(hop));
+            peerRequest.set(ClusterSecretHeader, ClusterSecret);
+            HTTPResponse response;
+            peer = std::make_shared<WebSocket>(*session, peerRequest, response);
+        }
+        catch (const Exception& exc)
+        {
+            Log::error("Failed to connect to cluster node [" + node + "]: " + exc.displayText());
+            ClusterNodes->setDown(node);
+            return false;
+        }
+
+        Log::info("Proxying [" + request.getURI() + "] to cluster node [" + node + "].");
+
+        // Each way on a thread of its own, until either side closes. What the
+        // node sends is binary, as the messages of the kits forwarded, and large
+        // frames are announced, as to the clients that haven't told otherwise.
+        std::atomic<bool> closed(false);
+        auto wakeup = std::make_shared<IoUtil::Wakeup>();
+        auto peerWakeup = std::make_shared<IoUtil::Wakeup>();
+        std::thread fromPeer([&]()
+            {
+                Util::setThreadName("cluster_proxy");
+                IoUtil::SocketProcessor(peer,
+                    [&ws](const std::vector<char>& payload)
+                    {
+                        IoUtil::sendFrame(*ws, payload.data(), payload.size(), WebSocket::FRAME_BINARY, true);
+                        return true;
+                    },
+                    []() {},
+                    [&closed]() { return TerminationFlag || closed; },
+                    peerWakeup);
+
+                closed = true;
+                wakeup->wake();
+            });
+
+        IoUtil::SocketProcessor(ws,
+            [&peer](const std::vector<char>& payload)
+            {
+                IoUtil::sendFrame(*peer, payload.data(), payload.size(), WebSocket::FRAME_TEXT, !IoUtil::CanReceiveLargeFrames);
+                return true;
+            },
+            []() {},
+            [&closed]() { return TerminationFlag || closed; },
+            wakeup, nullptr, deflate);
+
+        closed = true;
+        peerWakeup->wake();
+        fromPeer.join();
+
+        IoUtil::shutdownWebSocket(peer);
+        IoUtil::shutdownWebSocket(ws);
+        return true;
+    }
+
+    /// deflate, if the client negotiated permessage-deflate.
+    static void handleGetRequest(HTTPServerRequest& request, std::shared_ptr<WebSocket>& ws, const std::string& id,
+                                 const std::shared_ptr<WebSocketDeflate>& deflate)
+    {
+        Log::info("Starting GET request handler for session [" + id + "].");
 
         // Remove the leading '/' in the GET URL.
         std::string uri = request.getURI();
@@ -536,25 +1256,38 @@ private:
 
         const auto uriPublic = DocumentBroker::sanitizeURI(uri);
         const auto docKey = DocumentBroker::getDocKey(uriPublic);
-        std::shared_ptr<DocumentBroker> docBroker;
 
-        // scope the docBrokersLock
+        // All the clients of a document are served by the node that loads it.
+        int hop = getClusterHop(request);
+        const auto node = getClusterNode(docKey, hop);
+        if (!node.empty())
         {
-            std::unique_lock<std::mutex> docBrokersLock(docBrokersMutex);
+            const bool placed = (hop == 2);
+            const bool proxied = proxyClientSocket(request, ws, deflate, node, hop);
+            if (placed)
+            {
+                ClusterNodes->release(docKey, std::chrono::steady_clock::now());
+            }
 
-            // Lookup this document.
-            auto it = docBrokers.find(docKey);
-            if (it != docBrokers.end())
+            if (proxied)
             {
-                // Get the DocumentBroker from the Cache.
-                Log::debug("Found DocumentBroker for docKey [" + docKey + "].");
-                docBroker = it->second;
-                assert(docBroker);
+                return;
             }
+
+            Log::warn("Loading [" + docKey + "] here instead of on the cluster node [" + node + "], which is down.");
         }
 
+        // indicator to the client that document broker is searching
+        std::string status("statusindicator: find");
+        Log::trace("Sending to Client [" + status + "].");
+        ws->sendFrame(status.data(), (int) status.size());
+
+        // Lookup this document.
+        std::shared_ptr<DocumentBroker> docBroker = docBrokers.find(docKey);
         if (docBroker)
         {
+            Log::debug("Found DocumentBroker for docKey [" + docKey + "].");
+
             // If this document is going out, wait.
             if (docBroker->isMarkedToDestroy())
             {
@@ -563,8 +1296,7 @@ private:
                 for (size_t i = 0; i < COMMAND_TIMEOUT_MS / timeout; ++i)
                 {
                     std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
-                    std::unique_lock<std::mutex> lock(docBrokersMutex);
-                    if (docBrokers.find(docKey) == docBrokers.end())
+                    if (docBrokers.find(docKey) != docBroker)
                     {
                         docBroker.reset();
                         break;
@@ -582,44 +1314,67 @@ private:
         bool newDoc = false;
         if (!docBroker)
         {
-            newDoc = true;
-            // Request a kit process for this doc.
-            auto child = getNewChild();
-            if (!child)
-            {
-                // Let the client know we can't serve now.
-                Log::error("Failed to get new child. Service Unavailable.");
-                throw WebSocketErrorMessageException(SERVICE_UNAVALABLE_INTERNAL_ERROR);
-            }
+            // Only the first to open this document spawns and validates,
+            // those opening it meanwhile wait, others go ahead in parallel.
+            docBroker = docBrokers.findOrOpen(docKey,
+                [&uriPublic, &docKey]()
+                {
+                    // Request a kit process for this doc, one with it loaded if new.
+                    auto child = getPreloadedChild(uriPublic);
+                    if (!child)
+                    {
+                        child = getNewChild();
+                    }
+
+                    if (!child)
+                    {
+                        // Let the client know we can't serve now.
+                        Log::error("Failed to get new child. Service Unavailable.");
+                        throw WebSocketErrorMessageException(SERVICE_UNAVALABLE_INTERNAL_ERROR);
+                    }
+
+                    // Set one we just created.
+                    Log::debug("New DocumentBroker for docKey [" + docKey + "].");
+                    auto broker = std::make_shared<DocumentBroker>(uriPublic, docKey, LOOLWSD::ChildRoot, child);
+                    child->setDocumentBroker(broker);
+
+                    if (!broker->isAlive())
+                    {
+                        Log::error("Child had SDS. Service Unavailable.");
+                        throw WebSocketErrorMessageException(SERVICE_UNAVALABLE_INTERNAL_ERROR);
+                    }
 
-            // Set one we just created.
-            Log::debug("New DocumentBroker for docKey [" + docKey + "].");
-            docBroker = std::make_shared<DocumentBroker>(uriPublic, docKey, LOOLWSD::ChildRoot, child);
-            child->setDocumentBroker(docBroker);
+                    // Validate the URI and Storage before registering it.
+                    broker->validate(uriPublic);
+                    Log::debug("Validated [" + uriPublic.toString() + "].");
+                    return broker;
+                },
+                newDoc);
         }
 
-        // Validate the broker.
-        if (!docBroker || !docBroker->isAlive())
+        if (!newDoc)
         {
-            Log::error("DocBroker is invalid or child had SDS. Service Unavailable.");
-            if (!newDoc)
+            if (docBroker && docBroker->isHibernated() && !docBroker->resume())
             {
-                // Remove.
-                std::unique_lock<std::mutex> lock(docBrokersMutex);
-                docBrokers.erase(docKey);
+                Log::error("Failed to resume hibernated doc [" + docKey + "].");
             }
 
-            throw WebSocketErrorMessageException(SERVICE_UNAVALABLE_INTERNAL_ERROR);
-        }
+            // Validate the broker.
+            if (!docBroker || !docBroker->isAlive())
+            {
+                Log::error("DocBroker is invalid or child had SDS. Service Unavailable.");
+                if (docBroker)
+                {
+                    // Remove.
+                    docBrokers.erase(docKey, docBroker);
+                }
 
-        // Validate the URI and Storage before moving on.
-        docBroker->validate(uriPublic);
-        Log::debug("Validated [" + uriPublic.toString() + "].");
+                throw WebSocketErrorMessageException(SERVICE_UNAVALABLE_INTERNAL_ERROR);
+            }
 
-        if (newDoc)
-        {
-            std::unique_lock<std::mutex> lock(docBrokersMutex);
-            docBrokers.emplace(docKey, docBroker);
+            // Validate the URI and Storage before moving on.
+            docBroker->validate(uriPublic);
+            Log::debug("Validated [" + uriPublic.toString() + "].");
         }
 
         // Above this point exceptions are safe and will auto-cleanup.
@@ -631,6 +1386,13 @@ private:
             // thread to pump them. This is to empty the queue when we get a "canceltiles" message.
             auto queue = std::make_shared<BasicTileQueue>();
             session = std::make_shared<ClientSession>(id, ws, docBroker, queue);
+            session->setDeflate(deflate);
+            if (!LOOLWSD::SessionRecordPath.empty())
+            {
+                recordSession(session, request.getURI());
+            }
+
+            Admin::instance().addSessionQueue(id, queue);
 
             // Request the child to connect to us and add this session.
             auto sessionsCount = docBroker->addSession(session);
@@ -650,80 +1412,190 @@ private:
             Log::trace("Sending to Client [" + status + "].");
             ws->sendFrame(status.data(), (int) status.size());
 
-            QueueHandler handler(queue, session, "wsd_queue_" + session->getId());
+            if (WebSocketPoll && !LOOLWSD::SSLEnabled)
+            {
+                watchClientSocket(ws, docBroker, session, queue);
+                return;
+            }
+
+            auto wakeup = std::make_shared<IoUtil::Wakeup>();
+            QueueHandler handler(queue, session, "wsd_queue_" + session->getId(), wakeup);
             Thread queueHandlerThread;
             queueHandlerThread.start(handler);
 
             IoUtil::SocketProcessor(ws,
-                [&queue](const std::vector<char>& payload)
+                [&queue, &session](const std::vector<char>& payload)
                 {
+                    session->recordInput(payload);
                     queue->put(payload);
                     return true;
                 },
                 [&session]() { session->closeFrame(); },
-                [&queueHandlerThread]() { return TerminationFlag || !queueHandlerThread.isRunning(); });
+                [&handler]() { return TerminationFlag || handler.isFinished(); },
+                wakeup, nullptr, deflate);
+
+            removeClientSession(docBroker, session, queue);
+
+            Log::info("Finishing GET request handler for session [" + id + "]. Joining the queue.");
+            queue->put("eof");
+            queueHandlerThread.join();
+        }
+        catch (const std::exception& exc)
+        {
+            Log::error("Error in client request handler: " + std::string(exc.what()));
+        }
+
+        shutdownClientSocket(session, ws);
+    }
 
+    /// Hands the socket of a ready session over to the SocketPoll. The messages
+    /// are queued as above, but handled on the thread of the document, which
+    /// also removes the session once the socket is closed. Not over SSL, which
+    /// Poco decrypts reading whole frames, blocking, while the poll doesn't.
+    static void watchClientSocket(const std::shared_ptr<WebSocket>& ws,
+                                  const std::shared_ptr<DocumentBroker>& docBroker,
+                                  const std::shared_ptr<ClientSession>& session,
+                                  const std::shared_ptr<BasicTileQueue>& queue)
+    {
+        // Set once the session is removed, for the messages still in flight.
+        auto closed = std::make_shared<std::atomic<bool>>(false);
+        std::weak_ptr<SocketPoll> weakPoll = WebSocketPoll;
+
+        const WorkQueue::Task pump = [ws, session, queue, closed, weakPoll]()
+        {
+            // We are the only consumer, so get() won't block.
+            while (!*closed && queue->size() > 0)
             {
-                std::unique_lock<std::mutex> docBrokersLock(docBrokersMutex);
-
-                // We can destory if this is the last session.
-                // If not, we have to remove the session and check again.
-                // Otherwise, we may end up removing the one and only session.
-                bool removedSession = false;
-                auto canDestroy = docBroker->canDestroy();
-                sessionsCount = docBroker->getSessionsCount();
-                if (sessionsCount > 1)
+                const auto input = queue->get();
+                if (!session->handleInput(input.data(), input.size()))
                 {
-                    sessionsCount = docBroker->removeSession(id);
-                    removedSession = true;
-                    Log::trace(docKey + ", ws_sessions--: " + std::to_string(sessionsCount));
-                    canDestroy = docBroker->canDestroy();
-                }
+                    Log::info("Socket handler flagged for finishing.");
+                    auto poll = weakPoll.lock();
+                    if (poll)
+                    {
+                        poll->remove(ws);
+                    }
 
-                // If we are the last, we must wait for the save to complete.
-                if (canDestroy)
-                {
-                    Log::info("Shutdown of the last session, saving the document before tearing down.");
+                    break;
                 }
+            }
+        };
 
-                // We need to wait until the save notification reaches us
-                // and Storage persists the document.
-                if (!docBroker->autoSave(canDestroy, COMMAND_TIMEOUT_MS))
-                {
-                    Log::error("Auto-save before closing failed.");
-                }
+        WebSocketPoll->add(ws,
+            [docBroker, session, queue, pump](const std::vector<char>& payload)
+            {
+                session->recordInput(payload);
+                queue->put(payload);
+                docBroker->post(pump);
+                return true;
+            },
+            [session]() { session->closeFrame(); },
+            [ws, docBroker, session, queue, closed]()
+            {
+                docBroker->post([ws, docBroker, session, queue, closed]()
+                    {
+                        *closed = true;
+                        try
+                        {
+                            removeClientSession(docBroker, session, queue);
+                        }
+                        catch (const std::exception& exc)
+                        {
+                            Log::error("Error in client request handler: " + std::string(exc.what()));
+                        }
+
+                        shutdownClientSocket(session, ws);
+                        Log::info("Finished session [" + session->getId() + "].");
+                    });
+            },
+            session->getDeflate());
+    }
+
+    /// Records the messages of the session into a file of its own, named
+    /// by when it started, for the sessions of a document to sort together.
+    static void recordSession(const std::shared_ptr<ClientSession>& session, const std::string& uri)
+    {
+        const auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            std::chrono::system_clock::now().time_since_epoch()).count();
+        const std::string path = LOOLWSD::SessionRecordPath + "/session-" + std::to_string(ms) +
+                                 '-' + session->getId() + ".rec";
+        auto record = std::make_shared<SessionRecord>(path, session->getId(), uri);
+        if (!record->isOpen())
+        {
+            Log::error("Failed to record session [" + session->getId() + "] into [" + path + "].");
+            return;
+        }
+
+        Log::info("Recording session [" + session->getId() + "] into [" + path + "].");
+        session->setRecord(record);
+    }
 
-                if (!removedSession)
-                {
-                    sessionsCount = docBroker->removeSession(id);
-                    Log::trace(docKey + ", ws_sessions--: " + std::to_string(sessionsCount));
-                }
+    /// Removes the session from its document, saving the document first
+    /// and tearing it down if this is the last session.
+    static void removeClientSession(const std::shared_ptr<DocumentBroker>& docBroker,
+                                    const std::shared_ptr<ClientSession>& session,
+                                    const std::shared_ptr<BasicTileQueue>& queue)
+    {
+        const auto id = session->getId();
+        const auto docKey = docBroker->getDocKey();
+        size_t sessionsCount = 0;
+        {
+            // Only this document waits for the save, the others go on.
+            std::unique_lock<std::mutex> removalLock(docBroker->getSessionRemovalMutex());
+
+            // We can destory if this is the last session.
+            // If not, we have to remove the session and check again.
+            // Otherwise, we may end up removing the one and only session.
+            bool removedSession = false;
+            auto canDestroy = docBroker->canDestroy();
+            sessionsCount = docBroker->getSessionsCount();
+            if (sessionsCount > 1)
+            {
+                sessionsCount = docBroker->removeSession(id);
+                removedSession = true;
+                Log::trace(docKey + ", ws_sessions--: " + std::to_string(sessionsCount));
+                canDestroy = docBroker->canDestroy();
             }
 
-            if (session->isLoadFailed())
+            // If we are the last, we must wait for the save to complete.
+            if (canDestroy)
             {
-                Log::info("Clearing the queue.");
-                queue->clear();
+                Log::info("Shutdown of the last session, saving the document before tearing down.");
             }
 
-            if (sessionsCount == 0)
+            // We need to wait until the save notification reaches us
+            // and Storage persists the document.
+            if (!docBroker->autoSave(canDestroy, COMMAND_TIMEOUT_MS))
             {
-                std::unique_lock<std::mutex> docBrokersLock(docBrokersMutex);
-                Log::debug("Removing DocumentBroker for docKey [" + docKey + "].");
-                docBrokers.erase(docKey);
-                Log::info("Removing complete doc [" + docKey + "] from Admin.");
-                Admin::instance().rmDoc(docKey);
+                Log::error("Auto-save before closing failed.");
             }
 
-            Log::info("Finishing GET request handler for session [" + id + "]. Joining the queue.");
-            queue->put("eof");
-            queueHandlerThread.join();
+            if (!removedSession)
+            {
+                sessionsCount = docBroker->removeSession(id);
+                Log::trace(docKey + ", ws_sessions--: " + std::to_string(sessionsCount));
+            }
         }
-        catch (const std::exception& exc)
+
+        if (session->isLoadFailed())
         {
-            Log::error("Error in client request handler: " + std::string(exc.what()));
+            Log::info("Clearing the queue.");
+            queue->clear();
+        }
+
+        if (sessionsCount == 0)
+        {
+            Log::debug("Removing DocumentBroker for docKey [" + docKey + "].");
+            docBrokers.erase(docKey, docBroker);
+            Log::info("Removing complete doc [" + docKey + "] from Admin.");
+            Admin::instance().rmDoc(docKey);
         }
+    }
 
+    /// Completes the close handshake with the client, or aborts it.
+    static void shutdownClientSocket(const std::shared_ptr<ClientSession>& session,
+                                     const std::shared_ptr<WebSocket>& ws)
+    {
         if (session->isCloseFrame())
         {
             Log::trace("Normal close handshake.");
@@ -789,6 +1661,21 @@ private:
         return true;
     }
 
+    static bool handleGetClusterLoad(HTTPServerRequest& request, HTTPServerResponse& response)
+    {
+        if (!Util::equalsConstantTime(request.get(ClusterSecretHeader, ""), ClusterSecret))
+        {
+            throw UnauthorizedRequestException("Bad cluster secret.");
+        }
+
+        const std::string load = getClusterLoad().serialize();
+        response.setContentLength(load.size());
+        response.setContentType("text/plain");
+        response.setChunkedTransferEncoding(false);
+        response.send() << load;
+        return true;
+    }
+
 public:
 
     void handleRequest(HTTPServerRequest& request, HTTPServerResponse& response) override
@@ -821,17 +1708,39 @@ public:
                 // http://server/hosting/discovery
                 responded = handleGetWOPIDiscovery(request, response);
             }
+            else if (request.getMethod() == HTTPRequest::HTTP_GET && request.getURI() == "/lool/cluster" && ClusterNodes)
+            {
+                // The load of this node, polled by the others.
+                responded = handleGetClusterLoad(request, response);
+            }
             else if (!(request.find("Upgrade") != request.end() && Poco::icompare(request["Upgrade"], "websocket") == 0))
             {
                 responded = handlePostRequest(request, response, id);
             }
             else if (reqPathSegs.size() > 2 && reqPathSegs[0] == "lool" && reqPathSegs[1] == "ws")
             {
+                // Accepted with the upgrade, if offered.
+                std::shared_ptr<WebSocketDeflate> deflate;
+                if (WebSocketDeflateEnabled && request.has("Sec-WebSocket-Extensions"))
+                {
+                    bool noContextTakeover = false;
+                    int windowBits = 0;
+                    const auto extension = WebSocketDeflate::negotiate(request.get("Sec-WebSocket-Extensions"),
+                                                                       noContextTakeover, windowBits);
+                    if (!extension.empty())
+                    {
+                        response.set("Sec-WebSocket-Extensions", extension);
+                        deflate = std::make_shared<WebSocketDeflate>(WebSocketDeflateLevel, WebSocketDeflateMinSize,
+                                                                     noContextTakeover, windowBits);
+                        Log::debug("Session [" + id + "] negotiated [" + extension + "].");
+                    }
+                }
+
                 auto ws = std::make_shared<WebSocket>(request, response);
                 try
                 {
                     responded = true; // After upgrading to WS we should not set HTTP response.
-                    handleGetRequest(request, ws, id);
+                    handleGetRequest(request, ws, id, deflate);
                 }
                 catch (const WebSocketErrorMessageException& exc)
                 {
@@ -915,12 +1824,17 @@ public:
             // New Child is spawned.
             const auto params = Poco::URI(request.getURI()).getQueryParameters();
             Poco::Process::PID pid = -1;
+            unsigned served = 0;
             for (const auto& param : params)
             {
                 if (param.first == "pid")
                 {
                     pid = std::stoi(param.second);
                 }
+                else if (param.first == "served")
+                {
+                    served = std::stoul(param.second);
+                }
             }
 
             if (pid <= 0)
@@ -929,11 +1843,19 @@ public:
                 return;
             }
 
-            Log::info("New child [" + std::to_string(pid) + "].");
+            if (served > 0)
+            {
+                Log::info("Recycled child [" + std::to_string(pid) + "] after " + std::to_string(served) + " documents.");
+            }
+            else
+            {
+                Log::info("New child [" + std::to_string(pid) + "].");
+            }
+
             auto ws = std::make_shared<WebSocket>(request, response);
             UnitWSD::get().newChild(ws);
 
-            addNewChild(std::make_shared<ChildProcess>(pid, ws));
+            addNewChild(std::make_shared<ChildProcess>(pid, ws, WebSocketPoll), served > 0);
             return;
         }
 
@@ -977,28 +1899,20 @@ public:
             // Jail id should be the PID, beacuse Admin need it to calculate the memory
             const Poco::Process::PID pid = std::stoi(jailId);
 
-            std::shared_ptr<DocumentBroker> docBroker;
+            // Lookup this document.
+            auto docBroker = docBrokers.find(docKey);
+            if (!docBroker)
             {
-                // This lock could become a bottleneck.
-                // In that case, we can use a pool and index by publicPath.
-                std::unique_lock<std::mutex> lock(docBrokersMutex);
+                docBroker = convertBrokers.find(docKey);
+            }
 
-                // Lookup this document.
-                auto it = docBrokers.find(docKey);
-                if (it != docBrokers.end())
-                {
-                    // Get the DocumentBroker from the Cache.
-                    docBroker = it->second;
-                    assert(docBroker);
-                }
-                else
-                {
-                    // The client closed before we started,
-                    // or some early failure happened.
-                    Log::error("Failed to find DocumentBroker for docKey [" + docKey +
-                               "] while handling child connection for session [" + sessionId + "].");
-                    throw std::runtime_error("Invalid docKey.");
-                }
+            if (!docBroker)
+            {
+                // The client closed before we started,
+                // or some early failure happened.
+                Log::error("Failed to find DocumentBroker for docKey [" + docKey +
+                           "] while handling child connection for session [" + sessionId + "].");
+                throw std::runtime_error("Invalid docKey.");
             }
 
             docBroker->load(jailId);
@@ -1026,32 +1940,43 @@ public:
 
             UnitWSD::get().onChildConnected(pid, sessionId);
 
+            if (WebSocketPoll)
+            {
+                // The messages go to the clients, and to Storage on saving, from the I/O threads.
+                // Joined, not relayed as they come: see SocketPoll::add.
+                WebSocketPoll->add(ws,
+                    [session](const std::vector<char>& payload)
+                    {
+                        return session->handleInput(payload.data(), payload.size());
+                    },
+                    [session]() { session->closeFrame(); },
+                    [session, ws, docKey, sessionId]()
+                    {
+                        shutdownPrisonerSocket(session, ws);
+
+                        Log::info("Removing doc " + docKey + " from Admin");
+                        Admin::instance().rmDoc(docKey, sessionId);
+
+                        // Replenish.
+                        prespawnChildren();
+                    });
+                return;
+            }
+
             IoUtil::SocketProcessor(ws,
                 [&session](const std::vector<char>& payload)
                 {
                     return session->handleInput(payload.data(), payload.size());
                 },
                 [&session]() { session->closeFrame(); },
-                []() { return TerminationFlag; });
-
-            if (session->isCloseFrame())
-            {
-                Log::trace("Normal close handshake.");
-                if (session->shutdownPeer(WebSocket::WS_NORMAL_CLOSE, ""))
+                []() { return TerminationFlag; },
+                nullptr,
+                [&session](const std::vector<char>& fragment, const bool first, const bool final)
                 {
-                    // LOKit initiated close handshake
-                    // respond close frame
-                    ws->shutdown();
-                }
-            }
-            else
-            {
-                // something wrong, with internal exceptions
-                Log::trace("Abnormal close handshake.");
-                session->closeFrame();
-                ws->shutdown(WebSocket::WS_ENDPOINT_GOING_AWAY, SERVICE_UNAVALABLE_INTERNAL_ERROR);
-                session->shutdownPeer(WebSocket::WS_ENDPOINT_GOING_AWAY, SERVICE_UNAVALABLE_INTERNAL_ERROR);
-            }
+                    return session->relayFragment(fragment, first, final);
+                });
+
+            shutdownPrisonerSocket(session, ws);
         }
         catch (const Exception& exc)
         {
@@ -1078,6 +2003,31 @@ public:
         prespawnChildren();
         Log::debug("Thread finished.");
     }
+
+private:
+    /// Completes the close handshake with the child, or aborts it.
+    static void shutdownPrisonerSocket(const std::shared_ptr<PrisonerSession>& session,
+                                       const std::shared_ptr<WebSocket>& ws)
+    {
+        if (session->isCloseFrame())
+        {
+            Log::trace("Normal close handshake.");
+            if (session->shutdownPeer(WebSocket::WS_NORMAL_CLOSE, ""))
+            {
+                // LOKit initiated close handshake
+                // respond close frame
+                ws->shutdown();
+            }
+        }
+        else
+        {
+            // something wrong, with internal exceptions
+            Log::trace("Abnormal close handshake.");
+            session->closeFrame();
+            ws->shutdown(WebSocket::WS_ENDPOINT_GOING_AWAY, SERVICE_UNAVALABLE_INTERNAL_ERROR);
+            session->shutdownPeer(WebSocket::WS_ENDPOINT_GOING_AWAY, SERVICE_UNAVALABLE_INTERNAL_ERROR);
+        }
+    }
 };
 
 class ClientRequestHandlerFactory: public HTTPRequestHandlerFactory
@@ -1115,8 +2065,9 @@ public:
         {
             requestHandler = _fileServer.createRequestHandler();
         }
-        // Admin WebSocket Connections
-        else if (reqPathSegs.size() >= 2 && reqPathSegs[0] == "lool" && reqPathSegs[1] == "adminws")
+        // Admin WebSocket Connections, and the metrics for scraping
+        else if (reqPathSegs.size() >= 2 && reqPathSegs[0] == "lool" &&
+                 (reqPathSegs[1] == "adminws" || reqPathSegs[1] == "metrics"))
         {
             requestHandler = Admin::createRequestHandler();
         }
@@ -1175,6 +2126,32 @@ bool LOOLWSD::SSLEnabled =
 static std::string UnitTestLibrary;
 
 unsigned int LOOLWSD::NumPreSpawnedChildren = 0;
+unsigned int LOOLWSD::MaxPreSpawnedChildren = 0;
+unsigned int LOOLWSD::RenderThreads = 1;
+unsigned int LOOLWSD::CallbackCoalesceMs = 0;
+unsigned int LOOLWSD::PrefetchPercent = 0;
+unsigned int LOOLWSD::RenderBudgetMs = 0;
+unsigned int LOOLWSD::KitMaxDocuments = 1;
+unsigned int LOOLWSD::KitMaxMemoryGrowthKb = 0;
+unsigned int LOOLWSD::HibernateIdleSecs = 0;
+bool LOOLWSD::PlaceKits = false;
+bool LOOLWSD::PrefaultKitImage = true;
+bool LOOLWSD::PrefaultHugePages = false;
+unsigned int LOOLWSD::CpusPerKit = 0;
+unsigned int LOOLWSD::IoThreads = 0;
+unsigned int LOOLWSD::SaveThreads = 4;
+std::string LOOLWSD::SessionRecordPath;
+unsigned int LOOLWSD::TileTraceEvery = 0;
+unsigned int LOOLWSD::TileCacheMemoryLimit = 0;
+std::string LOOLWSD::TileCacheStore = "files";
+int LOOLWSD::TileCompressionLevel = -1;
+std::string LOOLWSD::TileFilters;
+bool LOOLWSD::TilePalette = false;
+int LOOLWSD::TileRecompressionLevel = 9;
+bool LOOLWSD::TileDeltas = false;
+bool LOOLWSD::TilePlaceholders = false;
+unsigned int LOOLWSD::ThumbnailSize = 0;
+bool LOOLWSD::RenderInvalidatedAhead = true;
 
 LOOLWSD::LOOLWSD()
 {
@@ -1184,9 +2161,182 @@ LOOLWSD::~LOOLWSD()
 {
 }
 
+std::string LOOLWSD::getPrespawnStats()
+{
+    return prespawnControl.getStats(std::chrono::steady_clock::now());
+}
+
+std::shared_ptr<ChildProcess> LOOLWSD::getNewChild()
+{
+    return ::getNewChild();
+}
+
+bool LOOLWSD::waitForChildSession(const std::string& id)
+{
+    return waitChildSession(id);
+}
+
+std::string LOOLWSD::getMemoryPressureStats()
+{
+    return memoryPressure.getStats();
+}
+
+void LOOLWSD::postSave(const WorkQueue::Task& task)
+{
+    {
+        std::unique_lock<std::mutex> lock(SaveQueueMutex);
+        if (SaveQueue)
+        {
+            SaveQueue->post(task);
+            return;
+        }
+    }
+
+    // Before starting, or once stopping.
+    task();
+}
+
+std::string LOOLWSD::getConvertStats()
+{
+    std::unique_lock<std::mutex> lock(newChildrenMutex);
+    return conversionQueue.getStats() + " kits=" + std::to_string(convertChildren.size()) +
+           (conversionCache ? " cache " + conversionCache->getStats() : std::string());
+}
+
+std::string LOOLWSD::getTileCacheQuotaStats()
+{
+    return TileCacheQuota::instance().getStats() +
+           (TileCacheStore == "blobs" ? " blobs " + BlobTileStore::getStats() : std::string());
+}
+
+std::string LOOLWSD::getDeflateStats()
+{
+    return std::string(WebSocketDeflateEnabled ? "enabled " : "disabled ") + WebSocketDeflate::getStats();
+}
+
+std::string LOOLWSD::getClusterStats()
+{
+    return (ClusterNodes ? ClusterNodes->getStats() : std::string("self="));
+}
+
+std::string LOOLWSD::getSaveStats()
+{
+    std::ostringstream oss;
+    for (const auto& docBroker : docBrokers.getAll())
+    {
+        oss << docBroker->getPid() << ' ' << docBroker->getSaveStats() << " \n ";
+    }
+
+    return oss.str();
+}
+
+int LOOLWSD::sampleTileTrace()
+{
+    static std::atomic<unsigned> tileRequests(0);
+    static std::atomic<unsigned> nextTraceId(0);
+    if (TileTraceEvery == 0 || ++tileRequests % TileTraceEvery != 0)
+    {
+        return -1;
+    }
+
+    return nextTraceId++ & std::numeric_limits<int>::max();
+}
+
+void LOOLWSD::handleMemoryPressure(const size_t usedKb)
+{
+    const auto level = memoryPressure.update(usedKb);
+    if (level != lastMemoryPressureLevel)
+    {
+        const auto stats = memoryPressure.getStats();
+        Log::warn("Memory pressure changed: " + stats);
+        Admin::instance().notify("memory_pressure " + stats);
+        lastMemoryPressureLevel = level;
+    }
+
+    if (level == MemoryPressure::Level::None)
+    {
+        return;
+    }
+
+    const auto brokers = docBrokers.getAll();
+
+    // First the tiles held in memory, which are on disk anyway.
+    size_t evicted = 0;
+    for (const auto& docBroker : brokers)
+    {
+        if (docBroker->isLoaded() || docBroker->isHibernated())
+        {
+            auto& tileCache = docBroker->tileCache();
+            evicted += tileCache.shrinkMemoryCache(tileCache.getMemoryCacheSize() / 2);
+        }
+    }
+
+    if (evicted > 0)
+    {
+        Log::info("Memory pressure: evicted " + std::to_string(evicted) + " bytes of tiles from memory.");
+        Admin::instance().notify("memory_pressure shrink_tile_caches evicted=" + std::to_string(evicted));
+    }
+
+    if (level < MemoryPressure::Level::TrimKits)
+    {
+        return;
+    }
+
+    // Then what the idle kits keep to render.
+    for (const auto& docBroker : brokers)
+    {
+        if (docBroker->getIdleTimeMs() >= MemoryPressureTrimIdleMs && docBroker->trimKitMemory())
+        {
+            const auto pid = std::to_string(docBroker->getPid());
+            Log::info("Memory pressure: trimming kit [" + pid + "] of doc [" + docBroker->getDocKey() + "].");
+            Admin::instance().notify("memory_pressure trim_kit " + pid);
+        }
+    }
+
+    if (level < MemoryPressure::Level::UnloadDocuments)
+    {
+        return;
+    }
+
+    // Last the document idle the longest, one at a time, saved first if modified.
+    std::shared_ptr<DocumentBroker> idlest;
+    double idlestMs = MemoryPressureUnloadIdleMs;
+    for (const auto& docBroker : brokers)
+    {
+        const auto idleMs = docBroker->getIdleTimeMs();
+        if (docBroker->isLoaded() && !docBroker->isMarkedToDestroy() &&
+            docBroker->getSessionsCount() > 0 && idleMs >= idlestMs)
+        {
+            idlest = docBroker;
+            idlestMs = idleMs;
+        }
+    }
+
+    if (idlest)
+    {
+        const auto pid = std::to_string(idlest->getPid());
+        const auto idle = std::to_string(static_cast<size_t>(idlestMs / 1000));
+        if (idlest->isModified())
+        {
+            // Unloaded after, once saved and no longer modified.
+            if (idlest->autoSave(false, 0))
+            {
+                Log::info("Memory pressure: saving doc [" + idlest->getDocKey() + "] to unload it.");
+                Admin::instance().notify("memory_pressure save " + pid + " " + idle);
+            }
+        }
+        else if (idlest->unload("Unloaded to free memory"))
+        {
+            Log::warn("Memory pressure: unloading doc [" + idlest->getDocKey() + "], idle for " + idle + " s.");
+            Admin::instance().notify("memory_pressure unload " + pid + " " + idle);
+        }
+    }
+}
+
 void LOOLWSD::initialize(Application& self)
 {
-    Log::initialize("wsd");
+    Startup::record(Startup::Phase::WsdStart);
+    Log::initialize("wsd", true);
 
     if (geteuid() == 0)
     {
@@ -1266,6 +2416,136 @@ void LOOLWSD::initialize(Application& self)
         NumPreSpawnedChildren = config().getUInt("num_prespawn_children", 1);
     }
 
+    // Between the two, as the documents are opened.
+    MaxPreSpawnedChildren = std::max(config().getUInt("max_prespawn_children", NumPreSpawnedChildren),
+                                     NumPreSpawnedChildren);
+    prespawnControl.setBounds(NumPreSpawnedChildren, MaxPreSpawnedChildren);
+
+    StringTokenizer templates(config().getString("new_document_templates", ""), " ",
+                              StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+    for (const auto& path : templates)
+    {
+        const File file(path);
+        if (!file.exists() || !file.isFile())
+        {
+            Log::warn("New document template [" + path + "] not found.");
+            continue;
+        }
+
+        newDocumentTemplates.push_back(NewDocumentTemplate{ path, Poco::Path(path).getExtension(),
+                                                            static_cast<size_t>(file.getSize()), nullptr });
+    }
+
+    RenderThreads = config().getUInt("render_threads", 1);
+    if (RenderThreads == 0)
+    {
+        RenderThreads = std::max(1U, std::thread::hardware_concurrency());
+    }
+
+    CallbackCoalesceMs = config().getUInt("callback_coalesce_ms", 5);
+    PrefetchPercent = std::min(config().getUInt("prefetch_percent", 25), 100U);
+    RenderBudgetMs = config().getUInt("render_budget_ms", 500);
+    KitMaxDocuments = std::max(1U, config().getUInt("kit_recycling.max_documents", 1));
+    KitMaxMemoryGrowthKb = config().getUInt("kit_recycling.max_memory_growth_kb", 102400);
+    HibernateIdleSecs = config().getUInt("hibernation.idle_secs", 0);
+    PlaceKits = config().getBool("kit_placement.enable", false);
+    PrefaultKitImage = config().getBool("kit_prefault.enable", true);
+    PrefaultHugePages = config().getBool("kit_prefault.huge_pages", false);
+    CpusPerKit = config().getUInt("kit_placement.cpus_per_kit", 0);
+
+    if (config().getBool("memory_pressure.enable", true))
+    {
+        size_t limitKb = config().getUInt("memory_pressure.limit_kb", 0);
+        if (limitKb == 0)
+        {
+            limitKb = static_cast<size_t>(sysconf(_SC_PHYS_PAGES)) * (sysconf(_SC_PAGESIZE) / 1024);
+        }
+
+        memoryPressure.setLimit(limitKb);
+        Log::info("Shedding memory above a limit of " + std::to_string(limitKb) + " KB.");
+    }
+    IoThreads = config().getUInt("io_threads", 0);
+    SaveThreads = config().getUInt("save_threads", 4);
+    SessionRecordPath = getPathFromConfig("session_record.path");
+    TileTraceEvery = config().getUInt("tile_trace_every", 0);
+
+    conversionQueue.setLimits(config().getUInt("convert.max_running", 2),
+                              config().getUInt("convert.max_queued", 100));
+    Metrics::instance().addCallback("loolwsd_conversion_queue_depth", "The conversions waiting for their turn.",
+                                    "gauge", []() { return conversionQueue.getQueued(); });
+    ConvertQueueTimeoutSecs = config().getUInt("convert.queue_timeout_secs", 60);
+    ConvertNiceness = config().getUInt("convert.niceness", 10);
+    const auto convertCacheMb = config().getUInt("convert.cache_size_mb", 0);
+    if (convertCacheMb > 0)
+    {
+        const auto convertCachePath = Cache + "/convert";
+        File(Cache).createDirectories();
+        conversionCache.reset(new ConversionCache(convertCachePath, static_cast<size_t>(convertCacheMb) * 1024 * 1024));
+        Log::info("Keeping up to " + std::to_string(convertCacheMb) + " MB of conversions in [" +
+                  convertCachePath + "]: " + conversionCache->getStats());
+    }
+
+    TileCacheMemoryLimit = config().getUInt("tile_cache_memory_size", 8 * 1024 * 1024);
+    const auto tileCacheQuotaMb = config().getUInt("tile_cache_quota.size_mb", 0);
+    TileCacheQuotaCheckSecs = std::max(1U, config().getUInt("tile_cache_quota.check_secs", 60));
+    TileCacheQuota::instance().setQuota(Cache, static_cast<size_t>(tileCacheQuotaMb) * 1024 * 1024);
+    Metrics::instance().addCallback("loolwsd_tile_cache_disk_bytes", "The bytes on disk of the tile caches of all the documents.",
+                                    "gauge", []() { return TileCacheQuota::instance().getBytes(); });
+    if (tileCacheQuotaMb > 0)
+    {
+        Log::info("Keeping up to " + std::to_string(tileCacheQuotaMb) + " MB of tile caches in [" + Cache + "].");
+    }
+    TileCacheStore = config().getString("tile_cache_store", "files");
+    WebSocketDeflateEnabled = config().getBool("websocket_deflate.enable", false);
+    WebSocketDeflateMinSize = config().getUInt("websocket_deflate.min_size", 1024);
+    WebSocketDeflateLevel = config().getInt("websocket_deflate.level", 6);
+    Metrics::instance().addCallback("loolwsd_websocket_deflate_input_bytes_total", "The bytes of the messages to the clients compressed.",
+                                    "counter", []() { return WebSocketDeflate::getCounters()._bytesIn.load(); });
+    Metrics::instance().addCallback("loolwsd_websocket_deflate_output_bytes_total", "The bytes those messages were compressed to.",
+                                    "counter", []() { return WebSocketDeflate::getCounters()._bytesOut.load(); });
+    Metrics::instance().addCallback("loolwsd_websocket_deflate_seconds_total", "The time spent compressing the messages to the clients.",
+                                    "counter", []() { return WebSocketDeflate::getCounters()._deflateUs.load() / 1e6; });
+    TileCompressionLevel = config().getInt("tile_encoding.compression_level", 1);
+    TileFilters = config().getString("tile_encoding.filters", "sub");
+    TilePalette = config().getBool("tile_encoding.palette", true);
+    TileRecompressionLevel = config().getInt("tile_encoding.recompression_level", 9);
+    TileDeltas = config().getBool("tile_encoding.deltas", false);
+    TilePlaceholders = config().getBool("tile_encoding.placeholders", false);
+    ThumbnailSize = config().getUInt("thumbnail_prerender_size", 180);
+    RenderInvalidatedAhead = config().getBool("render_invalidated_ahead", true);
+
+    StringTokenizer clusterNodes(config().getString("cluster.nodes", ""), " ",
+                                 StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+    const std::string clusterSelf = config().getString("cluster.self", "");
+    if (clusterNodes.count() > 1)
+    {
+        if (std::find(clusterNodes.begin(), clusterNodes.end(), clusterSelf) == clusterNodes.end())
+        {
+            throw IncompatibleOptionsException("cluster.self must be one of cluster.nodes.");
+        }
+
+        // Else any client could pass for a node, and have a document loaded twice.
+        ClusterSecret = config().getString("cluster.secret", "");
+        if (ClusterSecret.empty())
+        {
+            throw IncompatibleOptionsException("cluster.secret must be set with cluster.nodes.");
+        }
+
+        for (const auto& node : clusterNodes)
+        {
+            if (Poco::URI(node).getScheme() != "https")
+            {
+                Log::warn("Cluster node [" + node + "] is not https, the cluster secret goes to it in plain text.");
+            }
+        }
+
+        ClusterPollMs = std::max(100U, config().getUInt("cluster.poll_ms", 2000));
+        // Down once it missed a few polls.
+        ClusterNodes.reset(new Cluster(clusterSelf, std::vector<std::string>(clusterNodes.begin(), clusterNodes.end()),
+                                       3 * ClusterPollMs + COMMAND_TIMEOUT_MS));
+        Log::info("Cluster of " + std::to_string(clusterNodes.count()) + " nodes, this one [" + clusterSelf + "].");
+    }
+
     StorageBase::initialize();
 
     ServerApplication::initialize(self);
@@ -1464,6 +2744,27 @@ Process::PID LOOLWSD::createForKit()
     args.push_back("--lotemplate=" + LoTemplate);
     args.push_back("--childroot=" + ChildRoot);
     args.push_back("--clientport=" + std::to_string(ClientPortNumber));
+    args.push_back("--renderthreads=" + std::to_string(RenderThreads));
+    args.push_back("--callbackcoalescems=" + std::to_string(CallbackCoalesceMs));
+    args.push_back("--prefetchpercent=" + std::to_string(PrefetchPercent));
+    args.push_back("--renderbudgetms=" + std::to_string(RenderBudgetMs));
+    args.push_back("--kitmaxdocuments=" + std::to_string(KitMaxDocuments));
+    args.push_back("--kitmaxmemorygrowthkb=" + std::to_string(KitMaxMemoryGrowthKb));
+    args.push_back("--tilecompression=" + std::to_string(TileCompressionLevel));
+    args.push_back("--tilefilters=" + TileFilters);
+    if (TilePalette)
+        args.push_back("--tilepalette");
+    if (TileDeltas)
+        args.push_back("--tiledeltas");
+    if (PlaceKits)
+    {
+        args.push_back("--placekits");
+        args.push_back("--cpusperkit=" + std::to_string(CpusPerKit));
+    }
+    if (PrefaultKitImage)
+        args.push_back("--prefault");
+    if (PrefaultHugePages)
+        args.push_back("--hugepages");
     if (UnitWSD::get().hasKitHooks())
         args.push_back("--unitlib=" + UnitTestLibrary);
     if (DisplayVersion)
@@ -1556,12 +2857,25 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
     // Init the file server
     FileServer fileServer;
 
+    if (IoThreads > 0)
+    {
+        WebSocketPoll = std::make_shared<SocketPoll>("ws_poll", IoThreads);
+    }
+
+    if (SaveThreads > 0)
+    {
+        std::unique_lock<std::mutex> lock(SaveQueueMutex);
+        SaveQueue.reset(new WorkQueue("doc_save", SaveThreads));
+    }
+
     // Configure the Server.
     // Note: TCPServer internally uses a ThreadPool to
     // dispatch connections (the default if not given).
     // The capacity of the ThreadPool is increased here to
     // match MAX_SESSIONS. The pool must have sufficient available
     // threads to dispatch new connections, otherwise will deadlock.
+    // With the WebSocketPoll, the threads are only held while
+    // setting up the sessions.
     auto params1 = new HTTPServerParams();
     params1->setMaxThreads(MAX_SESSIONS);
     auto params2 = new HTTPServerParams();
@@ -1585,6 +2899,18 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
     Log::info("Starting prisoner server listening on " + std::to_string(MasterPortNumber));
     srv2.start();
 
+    std::thread clusterThread;
+    if (ClusterNodes)
+    {
+        clusterThread = std::thread(pollCluster);
+    }
+
+    std::thread tileCachesThread;
+    if (TileCacheQuota::instance().getQuota() > 0 || TileCacheStore == "blobs")
+    {
+        tileCachesThread = std::thread(manageTileCaches);
+    }
+
     // Fire the ForKit process; we are ready.
     const Process::PID forKitPid = createForKit();
     if (forKitPid < 0)
@@ -1670,7 +2996,7 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
             // No child processes
             if (errno == ECHILD)
             {
-                TerminationFlag = true;
+                Util::setTerminationFlag();
                 continue;
             }
         }
@@ -1682,10 +3008,16 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
                 {
                     try
                     {
-                        std::unique_lock<std::mutex> docBrokersLock(docBrokersMutex);
-                        for (auto& brokerIt : docBrokers)
+                        for (auto& docBroker : docBrokers.getAll())
                         {
-                            brokerIt.second->autoSave(false, 0);
+                            docBroker->autoSave(false, 0);
+
+                            // Once saved, by the autosave of an idle document above.
+                            if (HibernateIdleSecs > 0 &&
+                                docBroker->getIdleTimeMs() >= HibernateIdleSecs * 1000.0)
+                            {
+                                docBroker->hibernate();
+                            }
                         }
                     }
                     catch (const std::exception& exc)
@@ -1699,14 +3031,30 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
 
             sleep(WSD_SLEEP_SECS);
 
+            if (ThumbnailSize > 0)
+            {
+                try
+                {
+                    for (auto& docBroker : docBrokers.getAll())
+                    {
+                        docBroker->prerenderThumbnails(ThumbnailSize);
+                    }
+                }
+                catch (const std::exception& exc)
+                {
+                    Log::error("Exception: " + std::string(exc.what()));
+                }
+            }
+
             // Make sure we have sufficient reserves.
             prespawnChildren();
+            preloadTemplates();
         }
 #if ENABLE_DEBUG
         if (careerSpanSeconds > 0 && time(nullptr) > startTimeSpan + careerSpanSeconds)
         {
             Log::info(std::to_string(time(nullptr) - startTimeSpan) + " seconds gone, finishing as requested.");
-            TerminationFlag = true;
+            Util::setTerminationFlag();
         }
 #endif
     }
@@ -1715,9 +3063,46 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
     srv.stop();
     srv2.stop();
 
+    if (clusterThread.joinable())
+    {
+        clusterThread.join();
+    }
+
+    if (tileCachesThread.joinable())
+    {
+        tileCachesThread.join();
+    }
+
     // close all websockets
     threadPool.joinAll();
 
+    if (WebSocketPoll)
+    {
+        // Close the rest, and give the documents the time to unload,
+        // as the threads above did.
+        WebSocketPoll->stop();
+        for (int i = 0; i < 2 * COMMAND_TIMEOUT_MS / POLL_TIMEOUT_MS; ++i)
+        {
+            if (docBrokers.empty())
+            {
+                break;
+            }
+
+            std::this_thread::sleep_for(std::chrono::milliseconds(POLL_TIMEOUT_MS));
+        }
+    }
+
+    {
+        // Finishes the saves still pending, those requested after run inline.
+        std::unique_ptr<WorkQueue> saveQueue;
+        {
+            std::unique_lock<std::mutex> lock(SaveQueueMutex);
+            saveQueue = std::move(SaveQueue);
+        }
+
+        saveQueue.reset();
+    }
+
     // Terminate child processes
     Log::info("Requesting child process " + std::to_string(forKitPid) + " to terminate");
     Util::requestTermination(forKitPid);
@@ -1726,6 +3111,8 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
         child->close(true);
     }
 
+    WebSocketPoll.reset();
+
     // Wait for forkit process finish
     waitpid(forKitPid, &status, WUNTRACED);
     close(ForKitWritePipe);
@@ -1746,6 +3133,7 @@ int LOOLWSD::main(const std::vector<std::string>& /*args*/)
 #endif
 
     Log::info("Process [loolwsd] finished.");
+    Log::shutdown();
 
     int returnValue = Application::EXIT_OK;
     UnitWSD::get().returnValue(returnValue);
@@ -24,6 +24,7 @@
 #include "Common.hpp"
 #include "DocumentBroker.hpp"
 #include "Util.hpp"
+#include "WorkQueue.hpp"
 
 class LOOLWSD: public Poco::Util::ServerApplication
 {
@@ -35,6 +36,32 @@ public:
     // so just keep these as statics.
     static std::atomic<unsigned> NextSessionId;
     static unsigned int NumPreSpawnedChildren;
+    static unsigned int MaxPreSpawnedChildren;
+    static unsigned int RenderThreads;
+    static unsigned int CallbackCoalesceMs;
+    static unsigned int PrefetchPercent;
+    static unsigned int RenderBudgetMs;
+    static unsigned int KitMaxDocuments;
+    static unsigned int KitMaxMemoryGrowthKb;
+    static unsigned int HibernateIdleSecs;
+    static bool PlaceKits;
+    static unsigned int CpusPerKit;
+    static bool PrefaultKitImage;
+    static bool PrefaultHugePages;
+    static unsigned int IoThreads;
+    static unsigned int SaveThreads;
+    static std::string SessionRecordPath;
+    static unsigned int TileTraceEvery;
+    static unsigned int TileCacheMemoryLimit;
+    static std::string TileCacheStore;
+    static int TileCompressionLevel;
+    static std::string TileFilters;
+    static bool TilePalette;
+    static int TileRecompressionLevel;
+    static bool TileDeltas;
+    static bool TilePlaceholders;
+    static unsigned int ThumbnailSize;
+    static bool RenderInvalidatedAhead;
     static int ForKitWritePipe;
     static std::string Cache;
     static std::string SysTemplate;
@@ -53,6 +80,47 @@ public:
         return Util::encodeId(++NextSessionId, 4);
     }
 
+    /// How the pool of prespawned children is sized, for the admin console.
+    static std::string getPrespawnStats();
+
+    /// Sheds memory as much as usedKb, the total of the server and its children,
+    /// is close to the limit: from the tiles kept in memory to the idle documents.
+    /// Each action is reported to the admin console.
+    static void handleMemoryPressure(const size_t usedKb);
+
+    static std::string getMemoryPressureStats();
+
+    /// Runs task on the pool of threads saving the documents,
+    /// or inline if there is none.
+    static void postSave(const WorkQueue::Task& task);
+
+    /// The conversions queued and run, and the kits waiting for them, for the admin console.
+    static std::string getConvertStats();
+
+    /// The nodes of the cluster, a line each with its load, for the admin console.
+    static std::string getClusterStats();
+
+    /// The messages to the clients compressed with permessage-deflate, for the admin console.
+    static std::string getDeflateStats();
+
+    /// The disk used by the tile caches and their blobs, for the admin console.
+    static std::string getTileCacheQuotaStats();
+
+    /// Where the "blobs" tile store keeps the tiles shared by the documents.
+    static std::string getTileBlobsPath() { return Cache + "/blobs"; }
+
+    /// The saves of each document, a line each, for the admin console.
+    static std::string getSaveStats();
+
+    /// The trace id for the next tile request of a client, -1 unless it's sampled.
+    static int sampleTileTrace();
+
+    /// A prespawned child for a document, nullptr if none gets ready in time.
+    static std::shared_ptr<ChildProcess> getNewChild();
+
+    /// Waits for the child to connect the session of id, false on timeout.
+    static bool waitForChildSession(const std::string& id);
+
 protected:
     void initialize(Poco::Util::Application& self) override;
     void uninitialize() override;
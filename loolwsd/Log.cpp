@@ -9,10 +9,18 @@
 
 #include <sys/prctl.h>
 
+#include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
 #include <iomanip>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <Poco/ConsoleChannel.h>
 #include <Poco/Process.h>
@@ -41,6 +49,251 @@ namespace Log
     };
     static StaticNames Source;
 
+    std::atomic<int> Level(Poco::Message::PRIO_TRACE);
+
+    /// The logger of Source.name, rather than looked up by name, under
+    /// the lock of Poco, for each message.
+    static std::atomic<Poco::Logger*> SourceLogger(nullptr);
+
+    /// A message as logged, its prefix formatted by the writer.
+    struct Entry
+    {
+        Poco::Int64 time;
+        int threadId;
+        char threadName[16];
+        Poco::Message::Priority priority;
+        std::string text;
+    };
+
+    /// The messages queued by one thread for the writer. Lock-free,
+    /// with the thread the only producer and the writer the only consumer.
+    class Ring
+    {
+    public:
+        static const size_t Capacity = 256;
+
+        Ring() :
+            _entries(Capacity),
+            _head(0),
+            _tail(0)
+        {
+        }
+
+        /// False when full, for the caller to flush and write it itself.
+        bool push(Entry& entry)
+        {
+            const uint64_t head = _head.load(std::memory_order_relaxed);
+            if (head - _tail.load(std::memory_order_acquire) >= Capacity)
+            {
+                return false;
+            }
+
+            Entry& slot = _entries[head % Capacity];
+            slot.time = entry.time;
+            slot.threadId = entry.threadId;
+            std::memcpy(slot.threadName, entry.threadName, sizeof(slot.threadName));
+            slot.priority = entry.priority;
+            slot.text.swap(entry.text);
+            _head.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        /// Moves the entries queued to the batch of the writer.
+        void drain(std::vector<Entry>& batch)
+        {
+            uint64_t tail = _tail.load(std::memory_order_relaxed);
+            const uint64_t head = _head.load(std::memory_order_acquire);
+            for (; tail < head; ++tail)
+            {
+                Entry& slot = _entries[tail % Capacity];
+                batch.emplace_back();
+                Entry& entry = batch.back();
+                entry.time = slot.time;
+                entry.threadId = slot.threadId;
+                std::memcpy(entry.threadName, slot.threadName, sizeof(entry.threadName));
+                entry.priority = slot.priority;
+                entry.text.swap(slot.text);
+            }
+
+            _tail.store(tail, std::memory_order_release);
+        }
+
+    private:
+        std::vector<Entry> _entries;
+        std::atomic<uint64_t> _head;
+        std::atomic<uint64_t> _tail;
+    };
+
+    /// The rings of all threads, and the thread writing them out.
+    /// The rings of finished threads go to those started later,
+    /// so that there are never more than the threads running at once.
+    class Writer
+    {
+    public:
+        static Writer& instance()
+        {
+            // Never destroyed, threads may log while the statics go.
+            static Writer* writer = new Writer();
+            return *writer;
+        }
+
+        bool isRunning() const { return _running.load(std::memory_order_acquire); }
+
+        void start()
+        {
+            std::unique_lock<std::mutex> lock(_threadMutex);
+            if (_thread.joinable())
+            {
+                return;
+            }
+
+            _stop = false;
+            _running = true;
+            _thread = std::thread([this]() { run(); });
+        }
+
+        void stop()
+        {
+            {
+                std::unique_lock<std::mutex> lock(_threadMutex);
+                if (!_thread.joinable())
+                {
+                    return;
+                }
+
+                // Log synchronously from now, after what's queued.
+                _running = false;
+                _stop = true;
+            }
+
+            _wakeup.notify_one();
+            _thread.join();
+            write();
+        }
+
+        std::shared_ptr<Ring> acquire()
+        {
+            std::unique_lock<std::mutex> lock(_ringsMutex);
+            if (!_free.empty())
+            {
+                auto ring = _free.back();
+                _free.pop_back();
+                return ring;
+            }
+
+            _rings.push_back(std::make_shared<Ring>());
+            return _rings.back();
+        }
+
+        void release(const std::shared_ptr<Ring>& ring)
+        {
+            std::unique_lock<std::mutex> lock(_ringsMutex);
+            _free.push_back(ring);
+        }
+
+        /// Writes out what all the threads queued, and then the entry, if any,
+        /// so that it is not written ahead of what was logged before it.
+        void write(Entry* entry = nullptr)
+        {
+            std::unique_lock<std::mutex> lock(_writeMutex);
+            {
+                std::unique_lock<std::mutex> ringsLock(_ringsMutex);
+                for (const auto& ring : _rings)
+                {
+                    ring->drain(_batch);
+                }
+            }
+
+            std::stable_sort(_batch.begin(), _batch.end(),
+                             [](const Entry& a, const Entry& b) { return a.time < b.time; });
+            for (auto& it : _batch)
+            {
+                writeEntry(it);
+            }
+
+            _batch.clear();
+            if (entry)
+            {
+                writeEntry(*entry);
+            }
+        }
+
+        static void writeEntry(const Entry& entry);
+
+    private:
+        Writer() :
+            _running(false),
+            _stop(false)
+        {
+        }
+
+        void run()
+        {
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(_threadMutex);
+                    _wakeup.wait_for(lock, std::chrono::milliseconds(WriteIntervalMs),
+                                     [this]() { return _stop; });
+                    if (_stop)
+                    {
+                        return;
+                    }
+                }
+
+                write();
+            }
+        }
+
+    private:
+        /// How long a message waits at most before being written.
+        static const int WriteIntervalMs = 20;
+
+        std::atomic<bool> _running;
+        bool _stop;
+        std::mutex _threadMutex;
+        std::condition_variable _wakeup;
+        std::thread _thread;
+
+        std::mutex _ringsMutex;
+        std::vector<std::shared_ptr<Ring>> _rings;
+        std::vector<std::shared_ptr<Ring>> _free;
+
+        std::mutex _writeMutex;
+        std::vector<Entry> _batch;
+    };
+
+    /// The ring of the calling thread, handed back when it finishes.
+    static Ring& getThreadRing()
+    {
+        struct Holder
+        {
+            Holder() : _ring(Writer::instance().acquire()) {}
+            ~Holder() { Writer::instance().release(_ring); }
+            std::shared_ptr<Ring> _ring;
+        };
+
+        static thread_local Holder holder;
+        return *holder._ring;
+    }
+
+    /// The name of the calling thread, only asked once of the kernel.
+    static thread_local char ThreadName[16] = { '\0' };
+
+    static const char* getThreadName()
+    {
+        if (ThreadName[0] == '\0')
+        {
+            char procName[32]; // we really need only 16
+            if (prctl(PR_GET_NAME, reinterpret_cast<unsigned long>(procName), 0, 0, 0) != 0)
+                strncpy(procName, "<noid>", sizeof(procName) - 1);
+            procName[sizeof(ThreadName) - 1] = '\0';
+            std::memcpy(ThreadName, procName, sizeof(ThreadName));
+        }
+
+        return ThreadName;
+    }
+
     // We need a signal safe means of writing messages
     //   $ man 7 signal
     void signalLog(const char *message)
@@ -61,9 +314,10 @@ namespace Log
         }
     }
 
-    static void getPrefix(char *buffer)
+    static void formatPrefix(char *buffer, const size_t size, Poco::Int64 usec,
+                             const int threadId, const char *threadName)
     {
-        Poco::Int64 usec = Poco::Timestamp().epochMicroseconds() - epochStart;
+        usec -= epochStart;
 
         const Poco::Int64 one_s = 1000000;
         const Poco::Int64 hours = usec / (one_s*60*60);
@@ -73,17 +327,34 @@ namespace Log
         const Poco::Int64 seconds = usec / (one_s);
         usec %= (one_s);
 
+        const char *appName = (Source.inited ? Source.id.c_str() : "<shutdown>");
+        assert(strlen(appName) + 32 + 28 < 1024 - 1);
+
+        snprintf(buffer, size, "%s-%.2d %.2d:%.2d:%.2d.%.6d [ %s ] ", appName,
+                 threadId, (int)hours, (int)minutes, (int)seconds, (int)usec,
+                 threadName);
+    }
+
+    static int getThreadId()
+    {
+        return (Poco::Thread::current() ? Poco::Thread::current()->id() : 0);
+    }
+
+    static void getPrefix(char *buffer)
+    {
         char procName[32]; // we really need only 16
         if (prctl(PR_GET_NAME, reinterpret_cast<unsigned long>(procName), 0, 0, 0) != 0)
             strncpy(procName, "<noid>", sizeof(procName) - 1);
 
-        const char *appName = (Source.inited ? Source.id.c_str() : "<shutdown>");
-        assert(strlen(appName) + 32 + 28 < 1024 - 1);
+        formatPrefix(buffer, 1024, Poco::Timestamp().epochMicroseconds(), getThreadId(), procName);
+    }
 
-        snprintf(buffer, 4095, "%s-%.2d %.2d:%.2d:%.2d.%.6d [ %s ] ", appName,
-                 (Poco::Thread::current() ? Poco::Thread::current()->id() : 0),
-                 (int)hours, (int)minutes, (int)seconds, (int)usec,
-                 procName);
+    void Writer::writeEntry(const Entry& entry)
+    {
+        char buffer[1024];
+        formatPrefix(buffer, sizeof(buffer), entry.time, entry.threadId, entry.threadName);
+        logger().log(Poco::Message(Source.inited ? Source.name : std::string(),
+                                   buffer + entry.text, entry.priority));
     }
 
     std::string prefix()
@@ -100,8 +371,11 @@ namespace Log
         signalLog(buffer);
     }
 
-    void initialize(const std::string& name)
+    void initialize(const std::string& name, const bool async)
     {
+        // Set up again, with what was queued written as it was.
+        Writer::instance().stop();
+
         Source.name = name;
         std::ostringstream oss;
         oss << Source.name << '-'
@@ -113,8 +387,11 @@ namespace Log
         auto channel = (isatty(fileno(stderr)) || std::getenv("LOOL_LOGCOLOR")
                      ? static_cast<Poco::Channel*>(new Poco::ColorConsoleChannel())
                      : static_cast<Poco::Channel*>(new Poco::ConsoleChannel()));
-        auto& logger = Poco::Logger::create(Source.name, channel, Poco::Message::PRIO_TRACE);
+        auto& logger = Poco::Logger::get(Source.name);
+        logger.setChannel(channel);
+        logger.setLevel(Poco::Message::PRIO_TRACE);
         channel->release();
+        SourceLogger = &logger;
 
         // Configure the logger.
         // TODO: This should come from a file.
@@ -123,44 +400,106 @@ namespace Log
         char *loglevel = std::getenv("LOOL_LOGLEVEL");
         if (loglevel)
             logger.setLevel(std::string(loglevel));
+        Level = logger.getLevel();
+
+        // LOOL_LOGSYNC, to see each message as it is logged when debugging.
+        if (async && !std::getenv("LOOL_LOGSYNC"))
+        {
+            Writer::instance().start();
+        }
 
         info("Initializing " + name);
-        info("Log level is [" + std::to_string(logger.getLevel()) + "].");
+        info("Log level is [" + std::to_string(logger.getLevel()) + "]" +
+             (Writer::instance().isRunning() ? ", logging asynchronously." : "."));
     }
 
     Poco::Logger& logger()
     {
+        Poco::Logger* logger = SourceLogger.load();
+        if (logger && Source.inited)
+        {
+            return *logger;
+        }
+
         return Poco::Logger::get(Source.inited ? Source.name : std::string());
     }
 
+    void flush()
+    {
+        Writer::instance().write();
+    }
+
+    void shutdown()
+    {
+        Writer::instance().stop();
+    }
+
+    void setLevel(const std::string& level)
+    {
+        logger().setLevel(level);
+        Level = logger().getLevel();
+    }
+
+    void setThreadName(const std::string& name)
+    {
+        strncpy(ThreadName, name.c_str(), sizeof(ThreadName) - 1);
+        ThreadName[sizeof(ThreadName) - 1] = '\0';
+    }
+
+    void log(const Poco::Message::Priority priority, const std::string& msg)
+    {
+        if (!isEnabled(priority))
+        {
+            return;
+        }
+
+        Entry entry;
+        entry.time = Poco::Timestamp().epochMicroseconds();
+        entry.threadId = getThreadId();
+        std::memcpy(entry.threadName, getThreadName(), sizeof(entry.threadName));
+        entry.priority = priority;
+        entry.text = msg;
+
+        Writer& writer = Writer::instance();
+        if (!writer.isRunning())
+        {
+            Writer::writeEntry(entry);
+        }
+        // Errors are written at once, they may be the last words.
+        else if (priority <= Poco::Message::PRIO_ERROR || !getThreadRing().push(entry))
+        {
+            writer.write(&entry);
+        }
+    }
+
     void trace(const std::string& msg)
     {
-        logger().trace(prefix() + msg);
+        log(Poco::Message::PRIO_TRACE, msg);
     }
 
     void debug(const std::string& msg)
     {
-        logger().debug(prefix() + msg);
+        log(Poco::Message::PRIO_DEBUG, msg);
     }
 
     void info(const std::string& msg)
     {
-        logger().information(prefix() + msg);
+        log(Poco::Message::PRIO_INFORMATION, msg);
     }
 
     void warn(const std::string& msg)
     {
-        logger().warning(prefix() + msg);
+        log(Poco::Message::PRIO_WARNING, msg);
     }
 
     void error(const std::string& msg)
     {
-        logger().error(prefix() + msg);
+        log(Poco::Message::PRIO_ERROR, msg);
     }
 
     void syserror(const std::string& msg)
     {
-        logger().error(prefix() + msg + " (errno: " + std::string(std::strerror(errno)) + ")");
+        log(Poco::Message::PRIO_ERROR, msg + " (errno: " + std::string(std::strerror(errno)) + ")");
     }
 }
 
@@ -10,15 +10,20 @@
 #ifndef INCLUDED_LOG_HPP
 #define INCLUDED_LOG_HPP
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <sstream>
-#include <functional>
 
 #include <Poco/Logger.h>
+#include <Poco/Message.h>
 
 namespace Log
 {
-    void initialize(const std::string& name);
+    /// With async, the messages below error are queued per thread, lock-free,
+    /// and written by a thread of their own. Not for processes that fork
+    /// without exec, the child would be left without the writer.
+    void initialize(const std::string& name, bool async = false);
     Poco::Logger& logger();
     std::string prefix();
 
@@ -29,11 +34,38 @@ namespace Log
     void error(const std::string& msg);
     void syserror(const std::string& msg);
 
+    /// Writes the queued messages, in the order they were logged, before returning.
+    void flush();
+
+    /// Flushes, and stops the writer, logging synchronously from then on.
+    void shutdown();
+
+    /// Sets the level, a name or a number as for Poco::Logger::setLevel.
+    void setLevel(const std::string& level);
+
+    /// Keeps the name of the calling thread for its messages,
+    /// rather than asking the kernel at each of them.
+    void setThreadName(const std::string& name);
+
     /// Signal safe prefix logging
     void signalLogPrefix();
     /// Signal safe logging
     void signalLog(const char *message);
 
+    /// The most verbose priority logged, for the checks below.
+    extern std::atomic<int> Level;
+
+    /// Whether messages of the priority would be logged. In the hot paths,
+    /// check before building a message, as the arguments of
+    /// Log::trace() << ... are evaluated even when it is disabled.
+    inline bool isEnabled(const Poco::Message::Priority priority)
+    {
+        return priority <= Level.load(std::memory_order_relaxed);
+    }
+
+    inline bool traceEnabled() { return isEnabled(Poco::Message::PRIO_TRACE); }
+    inline bool debugEnabled() { return isEnabled(Poco::Message::PRIO_DEBUG); }
+
     /// The following is to write streaming logs.
     /// Log::info() << "Value: 0x" << std::hex << value
     ///             << ", pointer: " << this << Log::end;
@@ -44,72 +76,87 @@ namespace Log
         }
     } end;
 
+    void log(Poco::Message::Priority priority, const std::string& msg);
+
+    /// Formats nothing when the priority is not logged.
     class StreamLogger
     {
         public:
-            StreamLogger(std::function<void(const std::string&)> func)
-              : _func(func)
+            StreamLogger(const Poco::Message::Priority priority)
+              : _priority(priority)
+              , _stream(isEnabled(priority) ? new std::ostringstream() : nullptr)
             {
             }
 
             StreamLogger(StreamLogger&& sl)
-              : _stream(std::move(sl._stream.str()))
-              , _func(std::move(sl._func))
+              : _priority(sl._priority)
+              , _stream(std::move(sl._stream))
             {
             }
 
-            void flush() const
+            template <typename U>
+            void write(const U& value)
             {
-                _func(_stream.str());
+                if (_stream)
+                {
+                    *_stream << value;
+                }
             }
 
-            std::ostringstream _stream;
+            void flush() const
+            {
+                if (_stream)
+                {
+                    log(_priority, _stream->str());
+                }
+            }
 
         private:
-            std::function<void(const std::string&)> _func;
+            const Poco::Message::Priority _priority;
+            std::unique_ptr<std::ostringstream> _stream;
     };
 
     inline
     StreamLogger trace()
     {
-        return StreamLogger([](const std::string& msg) { trace(msg);});
+        return StreamLogger(Poco::Message::PRIO_TRACE);
     }
 
     inline
     StreamLogger debug()
     {
-        return StreamLogger([](const std::string& msg) { debug(msg);});
+        return StreamLogger(Poco::Message::PRIO_DEBUG);
     }
 
     inline
     StreamLogger info()
     {
-        return StreamLogger([](const std::string& msg) { info(msg);});
+        return StreamLogger(Poco::Message::PRIO_INFORMATION);
     }
 
     inline
     StreamLogger warn()
     {
-        return StreamLogger([](const std::string& msg) { warn(msg);});
+        return StreamLogger(Poco::Message::PRIO_WARNING);
     }
 
     inline
     StreamLogger error()
     {
-        return StreamLogger([](const std::string& msg) { error(msg);});
+        return StreamLogger(Poco::Message::PRIO_ERROR);
     }
 
     template <typename U>
     StreamLogger& operator <<(StreamLogger& lhs, const U& rhs)
     {
-        lhs._stream << rhs;
+        lhs.write(rhs);
         return lhs;
     }
 
     template <typename U>
     StreamLogger& operator <<(StreamLogger&& lhs, U&& rhs)
     {
-        lhs._stream << rhs;
+        lhs.write(rhs);
         return lhs;
     }
 
@@ -0,0 +1,154 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_MEMORYPRESSURE_HPP
+#define INCLUDED_MEMORYPRESSURE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+/// Tells how hard to shed memory, by how close the memory used
+/// by the server, as accounted by the AdminModel, gets to the limit.
+/// Each level is left only once the use is a margin below it,
+/// so that shedding a little doesn't flip it on every sample.
+class MemoryPressure
+{
+public:
+    /// What to do, each level on top of those below it.
+    enum class Level
+    {
+        None,
+        ShrinkTileCaches,
+        TrimKits,
+        UnloadDocuments
+    };
+
+    /// limitKb of 0 disables it.
+    explicit MemoryPressure(const size_t limitKb) :
+        _limitKb(limitKb),
+        _usedKb(0),
+        _level(Level::None)
+    {
+    }
+
+    void setLimit(const size_t limitKb)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _limitKb = limitKb;
+    }
+
+    /// Takes a new sample of the memory used and returns the level for it.
+    Level update(const size_t usedKb)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _usedKb = usedKb;
+        if (_limitKb == 0)
+        {
+            _level = Level::None;
+            return _level;
+        }
+
+        const size_t percent = usedKb * 100 / _limitKb;
+        Level level = Level::None;
+        for (int i = LevelCount - 1; i > 0; --i)
+        {
+            // Stay at the current level until well below it.
+            const size_t threshold = getThreshold(static_cast<Level>(i)) -
+                (static_cast<int>(_level) >= i ? HysteresisPercent : 0);
+            if (percent >= threshold)
+            {
+                level = static_cast<Level>(i);
+                break;
+            }
+        }
+
+        _level = level;
+        return _level;
+    }
+
+    Level getLevel()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _level;
+    }
+
+    /// The memory left under the limit as last sampled, -1 without limit.
+    int64_t getFreeKb()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_limitKb == 0)
+        {
+            return -1;
+        }
+
+        return (_usedKb < _limitKb ? _limitKb - _usedKb : 0);
+    }
+
+    std::string getStats()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        std::ostringstream oss;
+        oss << "level=" << toString(_level)
+            << " used_kb=" << _usedKb
+            << " limit_kb=" << _limitKb;
+        return oss.str();
+    }
+
+    static std::string toString(const Level level)
+    {
+        switch (level)
+        {
+        case Level::None:
+            return "none";
+        case Level::ShrinkTileCaches:
+            return "shrink_tile_caches";
+        case Level::TrimKits:
+            return "trim_kits";
+        case Level::UnloadDocuments:
+            return "unload_documents";
+        }
+
+        return "unknown";
+    }
+
+private:
+    /// The percent of the limit used at which the level starts.
+    static size_t getThreshold(const Level level)
+    {
+        switch (level)
+        {
+        case Level::None:
+            break;
+        case Level::ShrinkTileCaches:
+            return 70;
+        case Level::TrimKits:
+            return 80;
+        case Level::UnloadDocuments:
+            return 90;
+        }
+
+        return 0;
+    }
+
+private:
+    static constexpr int LevelCount = 4;
+    static constexpr size_t HysteresisPercent = 5;
+
+    std::mutex _mutex;
+    size_t _limitKb;
+    size_t _usedKb;
+    Level _level;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -10,16 +10,144 @@
 #include "MessageQueue.hpp"
 
 #include <algorithm>
+#include <cstdlib>
+#include <limits>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#include "TileDesc.hpp"
+
+namespace
+{
+    /// Compares the start of the message to a literal, without copying the message.
+    template <size_t N>
+    bool startsWith(const MessageQueue::Payload& message, const char (&prefix)[N])
+    {
+        return (message.size() >= N - 1 && std::equal(prefix, prefix + N - 1, message.begin()));
+    }
+
+    template <size_t N>
+    bool equals(const MessageQueue::Payload& message, const char (&text)[N])
+    {
+        return (message.size() == N - 1 && std::equal(text, text + N - 1, message.begin()));
+    }
+
+    template <size_t N>
+    bool contains(const MessageQueue::Payload& message, const char (&text)[N])
+    {
+        return (std::search(message.begin(), message.end(), text, text + N - 1) != message.end());
+    }
+
+    /// Tile requests that may be shed, previews are not.
+    bool isTileRequest(const MessageQueue::Payload& message)
+    {
+        return ((startsWith(message, "tile ") || startsWith(message, "tilecombine ")) &&
+                !contains(message, "id="));
+    }
+
+    /// Identifies a tile by its area and zoom, ignoring the version.
+    std::string getTileKey(const int part, const int width, const int height,
+                           const int x, const int y, const int tileWidth, const int tileHeight)
+    {
+        std::ostringstream oss;
+        oss << part << ':' << width << 'x' << height << ':'
+            << x << ',' << y << ':' << tileWidth << 'x' << tileHeight;
+        return oss.str();
+    }
+
+    /// Collects the keys of the tiles of a tile or tilecombine request.
+    bool getTileKeys(const MessageQueue::Payload& message, std::set<std::string>& keys)
+    {
+        try
+        {
+            if (startsWith(message, "tile "))
+            {
+                const auto tile = TileDesc::parse(message.data(), message.size());
+                keys.insert(getTileKey(tile.getPart(), tile.getWidth(), tile.getHeight(),
+                                       tile.getTilePosX(), tile.getTilePosY(),
+                                       tile.getTileWidth(), tile.getTileHeight()));
+                return true;
+            }
+            else if (startsWith(message, "tilecombine "))
+            {
+                const auto tileCombined = TileCombined::parse(message.data(), message.size());
+                for (const auto& tile : tileCombined.getTiles())
+                {
+                    keys.insert(getTileKey(tileCombined.getPart(), tileCombined.getWidth(), tileCombined.getHeight(),
+                                           tile.getTilePosX(), tile.getTilePosY(),
+                                           tileCombined.getTileWidth(), tileCombined.getTileHeight()));
+                }
+
+                return !keys.empty();
+            }
+        }
+        catch (const std::exception&)
+        {
+            // Not ours to judge, leave it to the handler.
+        }
+
+        return false;
+    }
+
+    bool isCancelTiles(const MessageQueue::Payload& message)
+    {
+        return (equals(message, "canceltiles") || startsWith(message, "canceltiles "));
+    }
+
+    /// The versions listed in the ver= of a 'canceltiles', none for all the requests.
+    std::set<int> getCancelledVersions(const MessageQueue::Payload& message)
+    {
+        std::set<int> versions;
+        static const char Ver[] = " ver=";
+        auto it = std::search(message.begin(), message.end(), Ver, Ver + sizeof(Ver) - 1);
+        if (it == message.end())
+        {
+            return versions;
+        }
+
+        const std::string list(it + sizeof(Ver) - 1, std::find(it + 1, message.end(), ' '));
+        std::istringstream iss(list);
+        std::string version;
+        while (std::getline(iss, version, ','))
+        {
+            versions.insert(std::atoi(version.c_str()));
+        }
+
+        return versions;
+    }
+
+    /// Whether the 'canceltiles' of the versions given cancels the tile request.
+    /// Previews, with an id=, are never cancelled.
+    bool isCancelled(const MessageQueue::Payload& message, const std::set<int>& versions)
+    {
+        if (!isTileRequest(message))
+        {
+            return false;
+        }
+
+        if (versions.empty())
+        {
+            return true;
+        }
+
+        static const char Ver[] = " ver=";
+        const auto it = std::search(message.begin(), message.end(), Ver, Ver + sizeof(Ver) - 1);
+        return (it != message.end() &&
+                versions.count(std::atoi(std::string(it + sizeof(Ver) - 1, std::find(it + 1, message.end(), ' ')).c_str())) > 0);
+    }
+}
 
 MessageQueue::~MessageQueue()
 {
     clear();
 }
 
-void MessageQueue::put(const Payload& value)
+void MessageQueue::put(Payload&& value)
 {
     std::unique_lock<std::mutex> lock(_mutex);
-    put_impl(value);
+    put_impl(std::move(value));
     lock.unlock();
     _cv.notify_one();
 }
@@ -27,10 +155,39 @@ void MessageQueue::put(const Payload& value)
 MessageQueue::Payload MessageQueue::get()
 {
     std::unique_lock<std::mutex> lock(_mutex);
-    _cv.wait(lock, [this] { return wait_impl(); });
+    waitUntil(lock, std::chrono::steady_clock::time_point::max());
+    return get_impl();
+}
+
+MessageQueue::Payload MessageQueue::get(const std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (!waitUntil(lock, std::chrono::steady_clock::now() + timeout))
+    {
+        return Payload();
+    }
+
     return get_impl();
 }
 
+bool MessageQueue::waitUntil(std::unique_lock<std::mutex>& lock, const std::chrono::steady_clock::time_point deadline)
+{
+    while (!wait_impl())
+    {
+        const auto wake = std::min(deadline, wake_impl());
+        if (wake == std::chrono::steady_clock::time_point::max())
+        {
+            _cv.wait(lock);
+        }
+        else if (_cv.wait_until(lock, wake) == std::cv_status::timeout && wake == deadline && !wait_impl())
+        {
+            return false;
+        }
+    }
+
+    return true;
+}
+
 void MessageQueue::clear()
 {
     std::unique_lock<std::mutex> lock(_mutex);
@@ -43,9 +200,15 @@ void MessageQueue::remove_if(const std::function<bool(const Payload&)>& pred)
     std::remove_if(_queue.begin(), _queue.end(), pred);
 }
 
-void MessageQueue::put_impl(const Payload& value)
+size_t MessageQueue::size()
 {
-    _queue.push_back(value);
+    std::unique_lock<std::mutex> lock(_mutex);
+    return size_impl();
+}
+
+void MessageQueue::put_impl(Payload&& value)
+{
+    _queue.push_back(std::move(value));
 }
 
 bool MessageQueue::wait_impl() const
@@ -53,9 +216,14 @@ bool MessageQueue::wait_impl() const
     return _queue.size() > 0;
 }
 
+std::chrono::steady_clock::time_point MessageQueue::wake_impl() const
+{
+    return std::chrono::steady_clock::time_point::max();
+}
+
 MessageQueue::Payload MessageQueue::get_impl()
 {
-    auto result = _queue.front();
+    Payload result = std::move(_queue.front());
     _queue.pop_front();
     return result;
 }
@@ -65,57 +233,683 @@ void MessageQueue::clear_impl()
     _queue.clear();
 }
 
-void BasicTileQueue::put_impl(const Payload& value)
+size_t MessageQueue::size_impl() const
+{
+    return _queue.size();
+}
+
+namespace
+{
+    size_t roundUpToPowerOfTwo(const size_t value)
+    {
+        size_t result = 2;
+        while (result < value)
+        {
+            result <<= 1;
+        }
+
+        return result;
+    }
+
+    /// Tells the core we are busy-waiting.
+    inline void cpuRelax()
+    {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+}
+
+constexpr unsigned MPSCMessageQueue::MaxSpins;
+
+MPSCMessageQueue::MPSCMessageQueue(const size_t capacity, const Supersedes& supersedes) :
+    _cells(new Cell[roundUpToPowerOfTwo(capacity)]),
+    _mask(roundUpToPowerOfTwo(capacity) - 1),
+    _supersedes(supersedes),
+    _maxSpins(std::thread::hardware_concurrency() > 1 ? MaxSpins : 0),
+    _enqueuePos(0),
+    _dequeuePos(0),
+    _clearPos(0),
+    _sleeping(false)
+{
+    for (size_t i = 0; i <= _mask; ++i)
+    {
+        _cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+}
+
+MPSCMessageQueue::~MPSCMessageQueue()
+{
+}
+
+void MPSCMessageQueue::put(Payload&& value)
+{
+    Cell* cell;
+    size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+    for (;;)
+    {
+        cell = &_cells[pos & _mask];
+        const size_t sequence = cell->sequence.load(std::memory_order_acquire);
+        const auto diff = static_cast<std::ptrdiff_t>(sequence) - static_cast<std::ptrdiff_t>(pos);
+        if (diff == 0)
+        {
+            if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // Full, wait for the consumer.
+            std::this_thread::yield();
+            pos = _enqueuePos.load(std::memory_order_relaxed);
+        }
+        else
+        {
+            // Another producer got it first.
+            pos = _enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    cell->data = std::move(value);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+
+    // Pairs with the fence in get(), so either we see it sleeping or it sees our message.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (_sleeping.load(std::memory_order_relaxed))
+    {
+        std::unique_lock<std::mutex> lock(_sleepMutex);
+        _sleepCV.notify_one();
+    }
+}
+
+MessageQueue::Payload MPSCMessageQueue::get()
+{
+    for (;;)
+    {
+        // Only we write it.
+        const size_t pos = _dequeuePos.load(std::memory_order_relaxed);
+        Cell& cell = _cells[pos & _mask];
+        const auto isReady = [&]()
+            {
+                return cell.sequence.load(std::memory_order_acquire) == pos + 1;
+            };
+
+        unsigned spins = 0;
+        while (!isReady() && spins++ < _maxSpins)
+        {
+            cpuRelax();
+        }
+
+        if (!isReady())
+        {
+            std::unique_lock<std::mutex> lock(_sleepMutex);
+            _sleeping.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            _sleepCV.wait(lock, isReady);
+            _sleeping.store(false, std::memory_order_relaxed);
+        }
+
+        Payload result = std::move(cell.data);
+        cell.data = Payload();
+        cell.sequence.store(pos + _mask + 1, std::memory_order_release);
+        _dequeuePos.store(pos + 1, std::memory_order_relaxed);
+
+        if (pos >= _clearPos.load(std::memory_order_acquire) && !isSuperseded(pos, result))
+        {
+            return result;
+        }
+    }
+}
+
+bool MPSCMessageQueue::isSuperseded(const size_t pos, const Payload& message)
+{
+    if (!_supersedes)
+    {
+        return false;
+    }
+
+    // The next one, if put already; the producers don't touch it until we got it.
+    const size_t next = pos + 1;
+    const Cell& cell = _cells[next & _mask];
+    return (cell.sequence.load(std::memory_order_acquire) == next + 1 &&
+            next >= _clearPos.load(std::memory_order_acquire) &&
+            _supersedes(message, cell.data));
+}
+
+bool MPSCMessageQueue::isSupersededMove(const Payload& message, const Payload& next)
+{
+    if (!startsWith(message, "mouse type=move ") || !startsWith(next, "mouse type=move "))
+    {
+        return false;
+    }
+
+    // mouse type=move x=<x> y=<y> count=<count> [buttons=<buttons> [modifier=<modifier>]]
+    const auto skipTokens = [](const Payload& payload)
+        {
+            auto it = payload.begin();
+            for (int i = 0; i < 5 && it != payload.end(); ++i)
+            {
+                it = std::find(it, payload.end(), ' ');
+                if (it != payload.end())
+                {
+                    ++it;
+                }
+            }
+
+            return it;
+        };
+
+    const auto rest = skipTokens(message);
+    const auto nextRest = skipTokens(next);
+    return (std::distance(rest, message.end()) == std::distance(nextRest, next.end()) &&
+            std::equal(rest, message.end(), nextRest));
+}
+
+void MPSCMessageQueue::clear()
 {
-    const auto msg = std::string(&value[0], value.size());
-    if (msg == "canceltiles")
+    // Only the consumer may touch the cells, so have it skip them.
+    size_t pos = _enqueuePos.load(std::memory_order_acquire);
+    size_t cleared = _clearPos.load(std::memory_order_relaxed);
+    while (cleared < pos &&
+           !_clearPos.compare_exchange_weak(cleared, pos, std::memory_order_release))
     {
-        // remove all the existing tiles from the queue
-        _queue.erase(std::remove_if(_queue.begin(), _queue.end(),
-                    [](const Payload& v)
+    }
+}
+
+void MPSCMessageQueue::remove_if(const std::function<bool(const Payload&)>& /*pred*/)
+{
+    throw std::logic_error("MPSCMessageQueue does not support remove_if.");
+}
+
+size_t MPSCMessageQueue::size()
+{
+    const size_t dequeued = _dequeuePos.load(std::memory_order_relaxed);
+    const size_t enqueued = _enqueuePos.load(std::memory_order_relaxed);
+    return (enqueued > dequeued ? enqueued - dequeued : 0);
+}
+
+void BasicTileQueue::put_impl(Payload&& value)
+{
+    if (isCancelTiles(value))
+    {
+        // remove the existing tiles, or those of the versions given, from the queue
+        const auto versions = getCancelledVersions(value);
+        const auto end = std::remove_if(_queue.begin(), _queue.end(),
+                    [&versions](const Payload& v)
                     {
                         // must not remove the tiles with 'id=', they are special, used
                         // eg. for previews etc.
-                        const auto tmp = std::string(&v[0], v.size());
-                        return (tmp.compare(0, 5, "tile ") == 0) && (tmp.find("id=") == std::string::npos);
+                        return isCancelled(v, versions);
                     }
-                    ),
-                _queue.end());
+                    );
+        _cancelledCount += std::distance(end, _queue.end());
+        _queue.erase(end, _queue.end());
 
         // put the "canceltiles" in front of other messages
-        _queue.push_front(value);
+        _queue.push_front(std::move(value));
+    }
+    else if ((startsWith(value, "tile ") || startsWith(value, "tilecombine ")) && !contains(value, "id="))
+    {
+        dropSuperseded(value);
+        MessageQueue::put_impl(std::move(value));
+        dropExcess();
     }
     else
     {
-        MessageQueue::put_impl(value);
+        MessageQueue::put_impl(std::move(value));
+    }
+}
+
+constexpr size_t BasicTileQueue::MaxTileRequests;
+
+void BasicTileQueue::dropSuperseded(const Payload& value)
+{
+    std::set<std::string> keys;
+    if (!getTileKeys(value, keys))
+    {
+        return;
+    }
+
+    const auto end = std::remove_if(_queue.begin(), _queue.end(),
+        [&keys](const Payload& v)
+        {
+            std::set<std::string> pendingKeys;
+            if (contains(v, "id=") || !getTileKeys(v, pendingKeys))
+            {
+                return false;
+            }
+
+            return std::includes(keys.begin(), keys.end(), pendingKeys.begin(), pendingKeys.end());
+        });
+
+    _droppedCount += std::distance(end, _queue.end());
+    _queue.erase(end, _queue.end());
+}
+
+void BasicTileQueue::dropExcess()
+{
+    size_t count = std::count_if(_queue.begin(), _queue.end(), [](const Payload& v) { return isTileRequest(v); });
+    for (auto it = _queue.begin(); count > MaxTileRequests && it != _queue.end(); )
+    {
+        if (isTileRequest(*it))
+        {
+            it = _queue.erase(it);
+            --count;
+            ++_droppedCount;
+        }
+        else
+        {
+            ++it;
+        }
+    }
+}
+
+void TileQueue::put_impl(Payload&& value)
+{
+    if (isCancelTiles(value))
+    {
+        // Same as the BasicTileQueue, the previews are apart.
+        const auto versions = getCancelledVersions(value);
+        const auto end = std::remove_if(_tiles.begin(), _tiles.end(),
+                    [&versions](const TileRequest& request)
+                    {
+                        return isCancelled(request.message, versions);
+                    }
+                    );
+        addCancelled(std::distance(end, _tiles.end()));
+        _tiles.erase(end, _tiles.end());
+    }
+    else if (startsWith(value, "tile ") || startsWith(value, "tilecombine "))
+    {
+        if (contains(value, "id="))
+        {
+            // Don't put duplicates into the queue.
+            if (std::find(_previews.begin(), _previews.end(), value) == _previews.end())
+            {
+                _previews.push_back(std::move(value));
+            }
+
+            return;
+        }
+
+        TileRequest request;
+        request.area = Area{ 0, 0, 0, 0 };
+        request.valid = false;
+        request.time = std::chrono::steady_clock::now();
+        if (getTileKeys(value, request.keys))
+        {
+            // Only the latest render of a tile is saved by wsd, the
+            // others would be painted for nothing, whichever the view.
+            const auto end = std::remove_if(_tiles.begin(), _tiles.end(),
+                [&request](const TileRequest& pending)
+                {
+                    return !pending.keys.empty() &&
+                           std::includes(request.keys.begin(), request.keys.end(),
+                                         pending.keys.begin(), pending.keys.end());
+                });
+            addDropped(std::distance(end, _tiles.end()));
+            _tiles.erase(end, _tiles.end());
+        }
+
+        try
+        {
+            if (value[4] == ' ')
+            {
+                const auto tile = TileDesc::parse(value.data(), value.size());
+                request.area = Area{ tile.getTilePosX(), tile.getTilePosY(),
+                                     tile.getTileWidth(), tile.getTileHeight() };
+                _lastPart = tile.getPart();
+            }
+            else
+            {
+                const auto tileCombined = TileCombined::parse(value.data(), value.size());
+                const auto& tiles = tileCombined.getTiles();
+                int left = std::numeric_limits<int>::max();
+                int top = std::numeric_limits<int>::max();
+                int64_t right = std::numeric_limits<int>::min();
+                int64_t bottom = std::numeric_limits<int>::min();
+                for (const auto& tile : tiles)
+                {
+                    left = std::min(left, tile.getTilePosX());
+                    top = std::min(top, tile.getTilePosY());
+                    right = std::max<int64_t>(right, static_cast<int64_t>(tile.getTilePosX()) + tileCombined.getTileWidth());
+                    bottom = std::max<int64_t>(bottom, static_cast<int64_t>(tile.getTilePosY()) + tileCombined.getTileHeight());
+                }
+
+                _lastPart = tileCombined.getPart();
+
+                if (!tiles.empty())
+                {
+                    request.area = Area{ left, top, static_cast<int>(std::min<int64_t>(right - left, std::numeric_limits<int>::max())),
+                                         static_cast<int>(std::min<int64_t>(bottom - top, std::numeric_limits<int>::max())) };
+                }
+            }
+
+            request.valid = true;
+        }
+        catch (const std::exception&)
+        {
+            // Leave it unranked, rendering reports the problem.
+        }
+
+        request.message = std::move(value);
+        _tiles.push_back(std::move(request));
+        return;
+    }
+
+    BasicTileQueue::put_impl(std::move(value));
+}
+
+constexpr int TileQueue::MaxTileAgeMs;
+constexpr int TileQueue::PreviewIntervalMs;
+
+bool TileQueue::wait_impl() const
+{
+    return !_tiles.empty() || BasicTileQueue::wait_impl() ||
+           (!_previews.empty() && std::chrono::steady_clock::now() >= _nextPreview);
+}
+
+std::chrono::steady_clock::time_point TileQueue::wake_impl() const
+{
+    return (_previews.empty() ? BasicTileQueue::wake_impl() : _nextPreview);
+}
+
+MessageQueue::Payload TileQueue::get_impl()
+{
+    if (!_queue.empty())
+    {
+        return BasicTileQueue::get_impl();
+    }
+
+    if (_tiles.empty())
+    {
+        // Only once nothing else is to render, and spaced out, for
+        // the requests of the views not to wait behind a stream of them.
+        Payload result = std::move(_previews.front());
+        _previews.pop_front();
+        _nextPreview = std::chrono::steady_clock::now() + std::chrono::milliseconds(PreviewIntervalMs);
+        return result;
+    }
+
+    // Drop the requests no one has been looking at for a while.
+    const auto now = std::chrono::steady_clock::now();
+    for (auto it = _tiles.begin(); it != _tiles.end(); ++it)
+    {
+        if (now - it->time > std::chrono::milliseconds(MaxTileAgeMs) && isOffScreen(*it))
+        {
+            static const char Drop[] = "drop";
+            Payload dropped(Drop, Drop + sizeof(Drop) - 1);
+            dropped.insert(dropped.end(), it->message.begin(), it->message.end());
+            _tiles.erase(it);
+            return dropped;
+        }
+    }
+
+    // The first of the best ranked, to keep the order among equals.
+    auto best = _tiles.begin();
+    int64_t bestPriority = getPriority(*best);
+    for (auto it = std::next(best); it != _tiles.end(); ++it)
+    {
+        const int64_t priority = getPriority(*it);
+        if (priority < bestPriority)
+        {
+            best = it;
+            bestPriority = priority;
+        }
+    }
+
+    Payload result = std::move(best->message);
+    _tiles.erase(best);
+    return result;
+}
+
+void TileQueue::clear_impl()
+{
+    _tiles.clear();
+    _previews.clear();
+    BasicTileQueue::clear_impl();
+}
+
+size_t TileQueue::size_impl() const
+{
+    return _tiles.size() + _previews.size() + BasicTileQueue::size_impl();
+}
+
+void TileQueue::updateCursorPosition(const int viewId, const int x, const int y, const int width, const int height)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto& view = _views[viewId];
+    view.hasCursor = true;
+    view.cursor = Area{ x, y, width, height };
+}
+
+void TileQueue::updateVisibleArea(const int viewId, const int x, const int y, const int width, const int height)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto& view = _views[viewId];
+    if (view.hasVisibleArea)
+    {
+        const Area& last = view.visibleArea;
+        if (x == last.x && y == last.y && width == last.width && height == last.height)
+        {
+            return;
+        }
+
+        if (x != last.x || y != last.y)
+        {
+            view.scrollX = (x > last.x) - (x < last.x);
+            view.scrollY = (y > last.y) - (y < last.y);
+        }
+    }
+
+    view.hasVisibleArea = true;
+    view.visibleArea = Area{ x, y, width, height };
+    view.prefetched = false;
+}
+
+void TileQueue::updateZoom(const int viewId, const int tilePixelWidth, const int tilePixelHeight,
+                           const int tileTwipWidth, const int tileTwipHeight)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    auto& view = _views[viewId];
+    view.hasZoom = (tilePixelWidth > 0 && tilePixelHeight > 0 && tileTwipWidth > 0 && tileTwipHeight > 0);
+    view.tilePixelWidth = tilePixelWidth;
+    view.tilePixelHeight = tilePixelHeight;
+    view.tileTwipWidth = tileTwipWidth;
+    view.tileTwipHeight = tileTwipHeight;
+    view.prefetched = false;
+}
+
+void TileQueue::removeView(const int viewId)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _views.erase(viewId);
+}
+
+constexpr int TileQueue::MaxInputWaitMs;
+
+bool TileQueue::isInput(const Payload& message)
+{
+    return (startsWith(message, "key ") || startsWith(message, "mouse ") ||
+            startsWith(message, "uno ") || startsWith(message, "selecttext ") ||
+            startsWith(message, "selectgraphic ") || startsWith(message, "resetselection"));
+}
+
+void TileQueue::inputQueued()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    ++_pendingInput;
+}
+
+void TileQueue::inputHandled(const size_t count)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    _pendingInput -= std::min(count, _pendingInput);
+    if (_pendingInput == 0)
+    {
+        _inputCV.notify_all();
+    }
+}
+
+bool TileQueue::waitForInputHandled(const std::chrono::milliseconds timeout)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _inputCV.wait_for(lock, timeout, [this]() { return _pendingInput == 0; });
+}
+
+constexpr int TileQueue::PrefetchDepth;
+constexpr int TileQueue::MaxPrefetchTiles;
+
+std::string TileQueue::getPrefetchRequest(const int docWidth, const int docHeight)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (auto& it : _views)
+    {
+        View& view = it.second;
+        if (view.prefetched || !view.hasVisibleArea || !view.hasZoom ||
+            view.visibleArea.width <= 0 || view.visibleArea.height <= 0)
+        {
+            continue;
+        }
+
+        view.prefetched = true;
+
+        // The tiles showing, even partly, then those next to them.
+        const Area& area = view.visibleArea;
+        const int64_t tileWidth = view.tileTwipWidth;
+        const int64_t tileHeight = view.tileTwipHeight;
+        int64_t firstColumn = std::max(0, area.x) / tileWidth;
+        int64_t lastColumn = (static_cast<int64_t>(area.x) + area.width - 1) / tileWidth;
+        int64_t firstRow = std::max(0, area.y) / tileHeight;
+        int64_t lastRow = (static_cast<int64_t>(area.y) + area.height - 1) / tileHeight;
+        if (view.scrollY > 0 || (view.scrollY == 0 && view.scrollX == 0))
+        {
+            firstRow = lastRow + 1;
+            lastRow = firstRow + PrefetchDepth - 1;
+        }
+        else if (view.scrollY < 0)
+        {
+            lastRow = firstRow - 1;
+            firstRow = lastRow - PrefetchDepth + 1;
+        }
+        else if (view.scrollX > 0)
+        {
+            firstColumn = lastColumn + 1;
+            lastColumn = firstColumn + PrefetchDepth - 1;
+        }
+        else
+        {
+            lastColumn = firstColumn - 1;
+            firstColumn = lastColumn - PrefetchDepth + 1;
+        }
+
+        std::string tilePosX;
+        std::string tilePosY;
+        int count = 0;
+        for (int64_t row = std::max<int64_t>(firstRow, 0); row <= lastRow; ++row)
+        {
+            for (int64_t column = std::max<int64_t>(firstColumn, 0); column <= lastColumn; ++column)
+            {
+                if (column * tileWidth >= docWidth || row * tileHeight >= docHeight ||
+                    count == MaxPrefetchTiles)
+                {
+                    continue;
+                }
+
+                tilePosX += (count ? "," : "") + std::to_string(column * tileWidth);
+                tilePosY += (count ? "," : "") + std::to_string(row * tileHeight);
+                ++count;
+            }
+        }
+
+        if (count > 0)
+        {
+            return "tilecombine part=" + std::to_string(_lastPart) +
+                   " width=" + std::to_string(view.tilePixelWidth) +
+                   " height=" + std::to_string(view.tilePixelHeight) +
+                   " tileposx=" + tilePosX + " tileposy=" + tilePosY +
+                   " tilewidth=" + std::to_string(tileWidth) +
+                   " tileheight=" + std::to_string(tileHeight);
+        }
     }
+
+    return std::string();
 }
 
-void TileQueue::put_impl(const Payload& value)
+int64_t TileQueue::getPriority(const TileRequest& request) const
 {
-    const auto msg = std::string(&value[0], value.size());
-    if (msg.compare(0, 5, "tile ") == 0)
+    // Beyond any distance in the document.
+    static const int64_t OffScreen = int64_t(1) << 40;
+
+    if (!request.valid)
+    {
+        return 0;
+    }
+
+    // Any view showing the tiles rates them by the nearest cursor,
+    // the others come after, by how far off-screen they are.
+    bool anyCursor = false;
+    int64_t cursorDistance = std::numeric_limits<int64_t>::max();
+    bool anyVisibleArea = false;
+    int64_t visibleDistance = std::numeric_limits<int64_t>::max();
+    for (const auto& it : _views)
     {
-        // TODO: implement a real re-ordering here, so that the tiles closest to
-        // the cursor are returned first.
-        // * we will want to put just a general "tile" message to the queue
-        // * add a std::set that handles the tiles
-        // * change the get_impl() to decide which tile is the correct one to
-        //   be returned
-        // * we will also need to be informed about the position of the cursor
-        //   so that get_impl() returns optimal results
-        //
-        // For now: just don't put duplicates into the queue
-        for (const auto& it : _queue)
+        const View& view = it.second;
+        if (view.hasCursor)
         {
-            if (value == it)
+            anyCursor = true;
+            cursorDistance = std::min(cursorDistance, getDistance(request.area, view.cursor));
+        }
+
+        if (view.hasVisibleArea)
+        {
+            anyVisibleArea = true;
+            visibleDistance = std::min(visibleDistance, getDistance(request.area, view.visibleArea));
+        }
+    }
+
+    if (anyVisibleArea && visibleDistance > 0)
+    {
+        return OffScreen + visibleDistance;
+    }
+
+    return (anyCursor ? cursorDistance : 0);
+}
+
+bool TileQueue::isOffScreen(const TileRequest& request) const
+{
+    if (!request.valid)
+    {
+        return false;
+    }
+
+    bool anyVisibleArea = false;
+    for (const auto& it : _views)
+    {
+        if (it.second.hasVisibleArea)
+        {
+            if (getDistance(request.area, it.second.visibleArea) == 0)
             {
-                return;
+                return false;
             }
+
+            anyVisibleArea = true;
         }
     }
 
-    BasicTileQueue::put_impl(value);
+    return anyVisibleArea;
+}
+
+int64_t TileQueue::getDistance(const Area& a, const Area& b)
+{
+    const int64_t dx = std::max<int64_t>({ 0,
+                                           static_cast<int64_t>(a.x) - (static_cast<int64_t>(b.x) + b.width),
+                                           static_cast<int64_t>(b.x) - (static_cast<int64_t>(a.x) + a.width) });
+    const int64_t dy = std::max<int64_t>({ 0,
+                                           static_cast<int64_t>(a.y) - (static_cast<int64_t>(b.y) + b.height),
+                                           static_cast<int64_t>(b.y) - (static_cast<int64_t>(a.y) + a.height) });
+    return dx + dy;
 }
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -10,9 +10,17 @@
 #ifndef INCLUDED_MESSAGEQUEUE_HPP
 #define INCLUDED_MESSAGEQUEUE_HPP
 
+#include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <set>
 #include <deque>
+#include <string>
 #include <vector>
 
 /** Thread-safe message queue (FIFO).
@@ -32,61 +40,318 @@ public:
     MessageQueue(const MessageQueue&) = delete;
     MessageQueue& operator=(const MessageQueue&) = delete;
 
-    /// Thread safe insert the message.
-    void put(const Payload& value);
+    /// Thread safe insert the message, moved all the way into the queue.
+    virtual void put(Payload&& value);
+    void put(const Payload& value)
+    {
+        put(Payload(value));
+    }
+
     void put(const std::string& value)
     {
         put(Payload(value.data(), value.data() + value.size()));
     }
 
-    /// Thread safe obtaining of the message.
-    Payload get();
+    /// Thread safe obtaining of the message, moved out of the queue.
+    virtual Payload get();
+
+    /// As get(), but waits at most timeout, to return an empty payload then.
+    Payload get(const std::chrono::milliseconds timeout);
 
     /// Thread safe removal of all the pending messages.
-    void clear();
+    virtual void clear();
 
     /// Thread safe remove_if.
-    void remove_if(const std::function<bool(const Payload&)>& pred);
+    virtual void remove_if(const std::function<bool(const Payload&)>& pred);
+
+    /// Thread safe count of the pending messages.
+    virtual size_t size();
 
 private:
-    std::mutex _mutex;
+    /// Waits for wait_impl(), until the deadline at most. Returns false at the deadline.
+    bool waitUntil(std::unique_lock<std::mutex>& lock, const std::chrono::steady_clock::time_point deadline);
+
     std::condition_variable _cv;
 
 protected:
-    virtual void put_impl(const Payload& value);
+    std::mutex _mutex;
+
+    virtual void put_impl(Payload&& value);
+
+    virtual bool wait_impl() const;
 
-    bool wait_impl() const;
+    /// When wait_impl() may become true with nothing put meanwhile, max() if never.
+    virtual std::chrono::steady_clock::time_point wake_impl() const;
 
-    Payload get_impl();
+    virtual Payload get_impl();
 
-    void clear_impl();
+    virtual void clear_impl();
+
+    virtual size_t size_impl() const;
 
     std::deque<Payload> _queue;
 };
 
+/** Bounded, lock-free MessageQueue for many producers and a single consumer.
+
+A ring of cells, each with a sequence number telling whose turn it is:
+producers claim a cell with a compare-and-swap on the enqueue position,
+the consumer owns the dequeue position. Producers block while the ring
+is full. The consumer spins briefly before it sleeps on a condition
+variable, which producers only signal when it actually sleeps.
+
+clear() may be called from any thread. remove_if() is not supported.
+*/
+class MPSCMessageQueue : public MessageQueue
+{
+public:
+    /// Whether a message can be dropped for the one put right after it.
+    typedef std::function<bool(const Payload& message, const Payload& next)> Supersedes;
+
+    /// The capacity is rounded up to a power of two.
+    /// get() skips the messages superseded by the next one already put.
+    MPSCMessageQueue(const size_t capacity = 1024, const Supersedes& supersedes = nullptr);
+    virtual ~MPSCMessageQueue();
+
+    /// For the input of a view: a mouse move, superseded by the next if it is a move
+    /// too, with the same buttons and modifiers. Clicks and keys are never dropped.
+    static bool isSupersededMove(const Payload& message, const Payload& next);
+
+    using MessageQueue::put;
+    virtual void put(Payload&& value) override;
+
+    /// Only to be called from the consumer thread.
+    virtual Payload get() override;
+
+    /// Drops the messages put so far, as the consumer gets to them.
+    virtual void clear() override;
+
+    virtual void remove_if(const std::function<bool(const Payload&)>& pred) override;
+
+    /// Approximate while producers are busy.
+    virtual size_t size() override;
+
+    /// Spins of get() on an empty queue before it blocks, on multi-core machines.
+    static constexpr unsigned MaxSpins = 256;
+
+private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        Payload data;
+    };
+
+    /// Whether the message at pos, being got, is superseded by the next.
+    bool isSuperseded(const size_t pos, const Payload& message);
+
+    std::unique_ptr<Cell[]> _cells;
+    const size_t _mask;
+    const Supersedes _supersedes;
+    /// Spinning only wastes the time slice of the producers on a single core.
+    const unsigned _maxSpins;
+
+    /// Apart, to not share cache lines between producers and the consumer.
+    alignas(64) std::atomic<size_t> _enqueuePos;
+    alignas(64) std::atomic<size_t> _dequeuePos;
+    /// Messages before this position were cleared.
+    std::atomic<size_t> _clearPos;
+    std::atomic<bool> _sleeping;
+    std::mutex _sleepMutex;
+    std::condition_variable _sleepCV;
+};
+
 /** MessageQueue specialized for handling of tiles.
 
-Used for basic handling of incoming requests, only can remove tiles when it
-gets a "canceltiles" command.
+Used for basic handling of incoming requests, removes tiles when it gets a
+"canceltiles" command: all the tile and tilecombine requests, or only those
+of the versions given as "canceltiles ver=<ver>,<ver>...". Sheds tile requests that can no longer matter to a
+client that is behind: those superseded by a newer request of the same
+tiles at the same zoom, and the oldest ones beyond MaxTileRequests pending.
+Previews, with an id=, are always kept.
 */
 class BasicTileQueue : public MessageQueue
 {
+public:
+    BasicTileQueue() :
+        _droppedCount(0),
+        _cancelledCount(0)
+    {
+    }
+
+    static constexpr size_t MaxTileRequests = 128;
+
+    /// The number of tile requests shed so far.
+    size_t getDroppedCount() const { return _droppedCount; }
+
+    /// The number of tile requests cancelled so far.
+    size_t getCancelledCount() const { return _cancelledCount; }
+
 protected:
-    virtual void put_impl(const Payload& value) override;
+    virtual void put_impl(Payload&& value) override;
+
+    void addCancelled(const size_t count) { _cancelledCount += count; }
+    void addDropped(const size_t count) { _droppedCount += count; }
+
+private:
+    /// Removes the pending requests the given one makes redundant.
+    void dropSuperseded(const Payload& value);
+
+    /// Removes the oldest requests over MaxTileRequests.
+    void dropExcess();
+
+    std::atomic<size_t> _droppedCount;
+    std::atomic<size_t> _cancelledCount;
 };
 
 /** MessageQueue specialized for priority handling of tiles.
 
 This class builds on BasicTileQueue, and additonaly provides de-duplication
-of tile requests.
+of tile requests by tiles, whatever their version: a request supersedes those
+pending of the same tiles, wsd requesting them again only once those renders
+are of no use, invalidated meanwhile. Also their re-ordering: other messages are returned first,
+then the tile requests closest to the cursors and inside the visible areas
+of the views.
+
+Previews, with an id=, are in a lane of their own: they are rendered only
+when no other request is pending, one per PreviewIntervalMs at most, and
+are never cancelled nor dropped.
 
-TODO: we'll need to add reordering of the tiles at some stage here too - so
-that the ones closest to the cursor position are returned first.
+Requests that are outside all the visible areas for longer than
+MaxTileAgeMs are dropped: they are returned as 'droptile' or
+'droptilecombine' with the arguments of the request, for the consumer
+to decline them.
 */
 class TileQueue : public BasicTileQueue
 {
+public:
+    static constexpr int MaxTileAgeMs = 5000;
+    static constexpr int PreviewIntervalMs = 50;
+
+    /// Thread safe update of where the cursor of a view is, in twips.
+    void updateCursorPosition(const int viewId, const int x, const int y, const int width, const int height);
+
+    /// Thread safe update of the visible area of a view, in twips.
+    void updateVisibleArea(const int viewId, const int x, const int y, const int width, const int height);
+
+    /// Thread safe update of the zoom of a view: the size of its tiles in pixels and in twips.
+    void updateZoom(const int viewId, const int tilePixelWidth, const int tilePixelHeight,
+                    const int tileTwipWidth, const int tileTwipHeight);
+
+    /// Thread safe removal of the cursor and the visible area of a view.
+    void removeView(const int viewId);
+
+    /// Thread safe choice of tiles to render while idle: the rows (or columns) just
+    /// past the visible area of a view, the way it last scrolled, at its zoom, within
+    /// the document. Each view gets them once, until it scrolls or zooms again.
+    /// Returns the 'tilecombine' request, empty when no view needs any.
+    std::string getPrefetchRequest(const int docWidth, const int docHeight);
+
+    /// The rows or columns of tiles prefetched past the visible area.
+    static constexpr int PrefetchDepth = 2;
+    static constexpr int MaxPrefetchTiles = 32;
+
+    /// Whether the message is input of a view, which renders yield to.
+    static bool isInput(const Payload& message);
+
+    /// Thread safe count of the input of the views, from when it is read off
+    /// their sockets to when it is handled (or dropped, by count).
+    void inputQueued();
+    void inputHandled(const size_t count = 1);
+
+    /// Waits for the input counted to be handled, at most timeout.
+    /// Called between paints, for input not to wait behind a backlog of them,
+    /// while renders still make progress under continuous input.
+    /// Returns false on timeout.
+    bool waitForInputHandled(const std::chrono::milliseconds timeout);
+
+    /// The most a render waits on the input of the views.
+    static constexpr int MaxInputWaitMs = 50;
+
 protected:
-    virtual void put_impl(const Payload& value) override;
+    virtual void put_impl(Payload&& value) override;
+
+    virtual bool wait_impl() const override;
+
+    virtual std::chrono::steady_clock::time_point wake_impl() const override;
+
+    virtual Payload get_impl() override;
+
+    virtual void clear_impl() override;
+
+    virtual size_t size_impl() const override;
+
+private:
+    struct Area
+    {
+        int x;
+        int y;
+        int width;
+        int height;
+    };
+
+    struct View
+    {
+        View() :
+            hasCursor(false),
+            hasVisibleArea(false),
+            hasZoom(false),
+            scrollX(0),
+            scrollY(1),
+            prefetched(false)
+        {
+        }
+
+        bool hasCursor;
+        Area cursor;
+        bool hasVisibleArea;
+        Area visibleArea;
+
+        bool hasZoom;
+        int tilePixelWidth;
+        int tilePixelHeight;
+        int tileTwipWidth;
+        int tileTwipHeight;
+
+        /// The way the visible area last moved, -1, 0 or 1, down by default.
+        int scrollX;
+        int scrollY;
+        /// Whether the tiles past the visible area were prefetched since it last changed.
+        bool prefetched;
+    };
+
+    struct TileRequest
+    {
+        Payload message;
+        /// Bounding box of the requested tiles.
+        Area area;
+        bool valid;
+        std::chrono::steady_clock::time_point time;
+        /// The tiles requested, by area and zoom, whatever the version.
+        std::set<std::string> keys;
+    };
+
+    /// Returns the rank of the request, the lowest renders first.
+    int64_t getPriority(const TileRequest& request) const;
+
+    /// True when the request is known to be outside all the visible areas.
+    bool isOffScreen(const TileRequest& request) const;
+
+    /// The distance between two areas, 0 when they intersect.
+    static int64_t getDistance(const Area& a, const Area& b);
+
+    std::deque<TileRequest> _tiles;
+    std::map<int, View> _views;
+
+    /// The preview requests, in order, and when the next may be rendered.
+    std::deque<Payload> _previews;
+    std::chrono::steady_clock::time_point _nextPreview;
+
+    /// The part of the last tile request, the one the views are showing.
+    int _lastPart = 0;
+
+    /// The input counted, not handled yet.
+    size_t _pendingInput = 0;
+    std::condition_variable _inputCV;
 };
 
 #endif
@@ -0,0 +1,320 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_METRICS_HPP
+#define INCLUDED_METRICS_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// Durations counted in fixed buckets, observed without locking.
+/// The kits take theirs as deltas, for wsd to merge into its own.
+class Histogram
+{
+public:
+    /// The last bucket has no upper bound.
+    static const size_t BucketCount = 16;
+
+    /// The upper bounds of the buckets, in ms.
+    static const double* getBounds()
+    {
+        static const double bounds[BucketCount - 1] =
+            { 0.5, 1, 2.5, 5, 10, 25, 50, 100, 250, 500, 1000, 2500, 5000, 10000, 30000 };
+        return bounds;
+    }
+
+    Histogram() :
+        _sumUs(0)
+    {
+        for (auto& count : _counts)
+        {
+            count = 0;
+        }
+    }
+
+    Histogram(const Histogram&) = delete;
+    Histogram& operator=(const Histogram&) = delete;
+
+    void observe(const double ms)
+    {
+        const double* bounds = getBounds();
+        size_t bucket = 0;
+        while (bucket < BucketCount - 1 && ms > bounds[bucket])
+        {
+            ++bucket;
+        }
+
+        ++_counts[bucket];
+        _sumUs += static_cast<uint64_t>(ms > 0 ? ms * 1000 : 0);
+    }
+
+    uint64_t getCount() const
+    {
+        uint64_t count = 0;
+        for (const auto& it : _counts)
+        {
+            count += it;
+        }
+
+        return count;
+    }
+
+    double getSumMs() const { return _sumUs / 1000.; }
+
+    /// Those observed since the last call, as "<count>,...,<count>,<sum us>",
+    /// empty if none.
+    std::string takeDelta()
+    {
+        std::ostringstream oss;
+        bool any = false;
+        for (auto& count : _counts)
+        {
+            const uint64_t value = count.exchange(0);
+            any = any || value > 0;
+            oss << value << ',';
+        }
+
+        oss << _sumUs.exchange(0);
+        return any ? oss.str() : std::string();
+    }
+
+    bool mergeDelta(const std::string& delta)
+    {
+        std::vector<uint64_t> values;
+        std::istringstream iss(delta);
+        std::string value;
+        while (std::getline(iss, value, ','))
+        {
+            char* end = nullptr;
+            values.push_back(std::strtoull(value.c_str(), &end, 10));
+            if (value.empty() || *end != '\0')
+            {
+                return false;
+            }
+        }
+
+        if (values.size() != BucketCount + 1)
+        {
+            return false;
+        }
+
+        for (size_t i = 0; i < BucketCount; ++i)
+        {
+            _counts[i] += values[i];
+        }
+
+        _sumUs += values[BucketCount];
+        return true;
+    }
+
+    /// As a Prometheus histogram, in seconds.
+    void serialize(std::ostream& os, const std::string& name) const
+    {
+        const double* bounds = getBounds();
+        uint64_t cumulative = 0;
+        for (size_t i = 0; i < BucketCount; ++i)
+        {
+            cumulative += _counts[i];
+            os << name << "_bucket{le=\"";
+            if (i < BucketCount - 1)
+                os << bounds[i] / 1000;
+            else
+                os << "+Inf";
+            os << "\"} " << cumulative << '\n';
+        }
+
+        os << name << "_sum " << _sumUs / 1e6 << '\n'
+           << name << "_count " << cumulative << '\n';
+    }
+
+private:
+    std::atomic<uint64_t> _counts[BucketCount];
+    std::atomic<uint64_t> _sumUs;
+};
+
+/// The counters and histograms of wsd, by name, exported in the text
+/// format of Prometheus. They are registered once and never removed,
+/// so the references handed out can be kept, and updated without locking.
+/// The values kept elsewhere are read by callbacks, when exported.
+class Metrics
+{
+public:
+    typedef std::function<double()> Callback;
+    /// The values of a family, by the value of their label.
+    typedef std::function<std::vector<std::pair<std::string, double>>()> LabelledCallback;
+
+    static Metrics& instance()
+    {
+        static Metrics metrics;
+        return metrics;
+    }
+
+    Metrics() {}
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    std::atomic<uint64_t>& counter(const std::string& name, const std::string& help)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        Entry& entry = getEntry(name, help, "counter");
+        if (!entry._counter)
+        {
+            entry._counter.reset(new std::atomic<uint64_t>(0));
+        }
+
+        return *entry._counter;
+    }
+
+    Histogram& histogram(const std::string& name, const std::string& help)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        Entry& entry = getEntry(name, help, "histogram");
+        if (!entry._histogram)
+        {
+            entry._histogram.reset(new Histogram());
+        }
+
+        return *entry._histogram;
+    }
+
+    /// For the values kept elsewhere; type is "counter" or "gauge".
+    void addCallback(const std::string& name, const std::string& help, const std::string& type,
+                     const Callback& callback)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        getEntry(name, help, type)._callback = callback;
+    }
+
+    /// As above, for a family of values told apart by a label.
+    void addLabelledCallback(const std::string& name, const std::string& help, const std::string& type,
+                             const std::string& label, const LabelledCallback& callback)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        Entry& entry = getEntry(name, help, type);
+        entry._label = label;
+        entry._labelledCallback = callback;
+    }
+
+    /// Merges the "<name>=<delta> ..." of a kit into the histograms and
+    /// counters registered by those names, a counter's delta being its
+    /// increment. Returns the number of them merged.
+    size_t mergeDeltas(const std::string& deltas)
+    {
+        size_t merged = 0;
+        std::istringstream iss(deltas);
+        std::string item;
+        while (iss >> item)
+        {
+            const auto equals = item.find('=');
+            if (equals == std::string::npos)
+            {
+                continue;
+            }
+
+            Histogram* histogram = nullptr;
+            std::atomic<uint64_t>* counter = nullptr;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                const auto it = _entries.find(item.substr(0, equals));
+                if (it != _entries.end())
+                {
+                    histogram = it->second._histogram.get();
+                    counter = it->second._counter.get();
+                }
+            }
+
+            const auto delta = item.substr(equals + 1);
+            if (histogram && histogram->mergeDelta(delta))
+            {
+                ++merged;
+            }
+            else if (counter && !delta.empty() && delta.find_first_not_of("0123456789") == std::string::npos)
+            {
+                *counter += std::strtoull(delta.c_str(), nullptr, 10);
+                ++merged;
+            }
+        }
+
+        return merged;
+    }
+
+    std::string serialize()
+    {
+        // The callbacks take locks of their own, so they are run without ours.
+        std::vector<std::pair<std::string, const Entry*>> entries;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (const auto& it : _entries)
+            {
+                entries.emplace_back(it.first, &it.second);
+            }
+        }
+
+        std::ostringstream oss;
+        for (const auto& it : entries)
+        {
+            const std::string& name = it.first;
+            const Entry& entry = *it.second;
+            oss << "# HELP " << name << ' ' << entry._help << '\n'
+                << "# TYPE " << name << ' ' << entry._type << '\n';
+            if (entry._histogram)
+                entry._histogram->serialize(oss, name);
+            else if (entry._counter)
+                oss << name << ' ' << *entry._counter << '\n';
+            else if (entry._callback)
+                oss << name << ' ' << entry._callback() << '\n';
+            else if (entry._labelledCallback)
+            {
+                for (const auto& value : entry._labelledCallback())
+                {
+                    oss << name << '{' << entry._label << "=\"" << value.first << "\"} " << value.second << '\n';
+                }
+            }
+        }
+
+        return oss.str();
+    }
+
+private:
+    struct Entry
+    {
+        std::string _help;
+        std::string _type;
+        std::unique_ptr<std::atomic<uint64_t>> _counter;
+        std::unique_ptr<Histogram> _histogram;
+        Callback _callback;
+        std::string _label;
+        LabelledCallback _labelledCallback;
+    };
+
+    Entry& getEntry(const std::string& name, const std::string& help, const std::string& type)
+    {
+        Entry& entry = _entries[name];
+        entry._help = help;
+        entry._type = type;
+        return entry;
+    }
+
+private:
+    std::mutex _mutex;
+    std::map<std::string, Entry> _entries;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
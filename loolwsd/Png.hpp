@@ -45,9 +45,24 @@
  *        Chris Wilson <chris@chris-wilson.co.uk>
  */
 
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
 #define PNG_SKIP_SETJMP_CHECK
 #include <png.h>
 
+#define LOK_USE_UNSTABLE_API
+#include <LibreOfficeKit/LibreOfficeKitEnums.h>
+
 namespace png
 {
 
@@ -72,47 +87,422 @@ extern "C"
 }
 
 
+/// The unpremultiplied value of each colour component, by alpha.
+/// Replaces a division per component with a lookup.
+inline
+const uint8_t* getUnpremultiplyTable()
+{
+    struct Table
+    {
+        uint8_t values[256 * 256];
+
+        Table()
+        {
+            for (unsigned alpha = 0; alpha < 256; ++alpha)
+            {
+                for (unsigned value = 0; value < 256; ++value)
+                {
+                    values[alpha * 256 + value] = (alpha == 0 ? 0 : (value * 255 + alpha / 2) / alpha);
+                }
+            }
+        }
+    };
+
+    static const Table table;
+    return table.values;
+}
+
+/// Unpremultiplies pixels and converts native endian ARGB => RGBA bytes.
+inline
+void unpremultiplyPixelsScalar(unsigned char* data, const size_t pixels)
+{
+    const uint8_t* table = getUnpremultiplyTable();
+    for (size_t i = 0; i < pixels; ++i)
+    {
+        uint8_t *b = &data[i * 4];
+        uint32_t pixel;
+
+        std::memcpy(&pixel, b, sizeof(uint32_t));
+        const uint32_t alpha = (pixel & 0xff000000) >> 24;
+        const uint8_t* row = table + alpha * 256;
+        b[0] = row[(pixel & 0xff0000) >> 16];
+        b[1] = row[(pixel & 0x00ff00) >>  8];
+        b[2] = row[(pixel & 0x0000ff) >>  0];
+        b[3] = alpha;
+    }
+}
+
+// Opaque pixels, the vast majority in document tiles, only need their
+// red and blue swapped. The vector kernels do that for whole blocks of
+// opaque pixels and leave the rest to the scalar code.
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+
+inline
+void unpremultiplyPixelsSSE2(unsigned char* data, const size_t pixels)
+{
+    const __m128i alphaMask = _mm_set1_epi32(0xff000000);
+    const __m128i greenAlphaMask = _mm_set1_epi32(0xff00ff00);
+    const __m128i lowMask = _mm_set1_epi32(0x000000ff);
+
+    size_t i = 0;
+    for (; i + 4 <= pixels; i += 4)
+    {
+        __m128i* block = reinterpret_cast<__m128i*>(data + i * 4);
+        const __m128i argb = _mm_loadu_si128(block);
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(argb, alphaMask), alphaMask)) != 0xffff)
+        {
+            unpremultiplyPixelsScalar(data + i * 4, 4);
+            continue;
+        }
+
+        const __m128i red = _mm_and_si128(_mm_srli_epi32(argb, 16), lowMask);
+        const __m128i blue = _mm_slli_epi32(_mm_and_si128(argb, lowMask), 16);
+        _mm_storeu_si128(block, _mm_or_si128(_mm_and_si128(argb, greenAlphaMask), _mm_or_si128(red, blue)));
+    }
+
+    unpremultiplyPixelsScalar(data + i * 4, pixels - i);
+}
+
+__attribute__((target("avx2"))) inline
+void unpremultiplyPixelsAVX2(unsigned char* data, const size_t pixels)
+{
+    const __m256i alphaMask = _mm256_set1_epi32(0xff000000);
+    const __m256i swapRedBlue = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                                 2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+
+    size_t i = 0;
+    for (; i + 8 <= pixels; i += 8)
+    {
+        __m256i* block = reinterpret_cast<__m256i*>(data + i * 4);
+        const __m256i argb = _mm256_loadu_si256(block);
+        if (static_cast<unsigned>(_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(argb, alphaMask), alphaMask))) != 0xffffffff)
+        {
+            unpremultiplyPixelsScalar(data + i * 4, 8);
+            continue;
+        }
+
+        _mm256_storeu_si256(block, _mm256_shuffle_epi8(argb, swapRedBlue));
+    }
+
+    unpremultiplyPixelsSSE2(data + i * 4, pixels - i);
+}
+
+#define LOOL_PNG_UNPREMULTIPLY_X86 1
+
+#elif __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && defined(__aarch64__)
+
+inline
+void unpremultiplyPixelsNEON(unsigned char* data, const size_t pixels)
+{
+    size_t i = 0;
+    for (; i + 16 <= pixels; i += 16)
+    {
+        // Loads B, G, R and A of 16 pixels into separate registers.
+        const uint8x16x4_t bgra = vld4q_u8(data + i * 4);
+        if (vminvq_u8(bgra.val[3]) != 0xff)
+        {
+            unpremultiplyPixelsScalar(data + i * 4, 16);
+            continue;
+        }
+
+        uint8x16x4_t rgba;
+        rgba.val[0] = bgra.val[2];
+        rgba.val[1] = bgra.val[1];
+        rgba.val[2] = bgra.val[0];
+        rgba.val[3] = bgra.val[3];
+        vst4q_u8(data + i * 4, rgba);
+    }
+
+    unpremultiplyPixelsScalar(data + i * 4, pixels - i);
+}
+
+#endif
+
+typedef void (*UnpremultiplyFunction)(unsigned char* data, const size_t pixels);
+
+/// The fastest unpremultiply kernel this CPU supports.
+inline
+UnpremultiplyFunction getUnpremultiplyFunction()
+{
+#if defined(LOOL_PNG_UNPREMULTIPLY_X86)
+    static const UnpremultiplyFunction function = (__builtin_cpu_supports("avx2") ? unpremultiplyPixelsAVX2
+                                                                                   : unpremultiplyPixelsSSE2);
+#elif __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ && defined(__aarch64__)
+    static const UnpremultiplyFunction function = unpremultiplyPixelsNEON;
+#else
+    static const UnpremultiplyFunction function = unpremultiplyPixelsScalar;
+#endif
+    return function;
+}
+
+inline
+void unpremultiplyPixels(unsigned char* data, const size_t pixels)
+{
+    getUnpremultiplyFunction()(data, pixels);
+}
+
 /* Unpremultiplies data and converts native endian ARGB => RGBA bytes */
 static void
 unpremultiply_data (png_structp /*png*/, png_row_infop row_info, png_bytep data)
 {
-    unsigned int i;
+    unpremultiplyPixels(data, row_info->rowbytes / 4);
+}
 
-    for (i = 0; i < row_info->rowbytes; i += 4)
+/// How tiles are compressed.
+struct EncodeOptions
+{
+    EncodeOptions() :
+        compressionLevel(-1),
+        filters(-1),
+        palette(false)
     {
-        uint8_t *b = &data[i];
-        uint32_t pixel;
-        uint8_t  alpha;
+    }
+
+    /// zlib compression level, 0 (none) to 9 (smallest), or -1 for the zlib default.
+    int compressionLevel;
 
-        memcpy (&pixel, b, sizeof (uint32_t));
-        alpha = (pixel & 0xff000000) >> 24;
-        if (alpha == 0)
+    /// The PNG_FILTER_* flags of the row filters to choose from, or -1 for the libpng default.
+    /// Images encoded with a palette are never filtered.
+    int filters;
+
+    /// Whether to encode the images of at most 256 colours with a palette.
+    bool palette;
+
+    /// Parses a comma separated list of filter names: none, sub, up, avg, paeth or all.
+    /// Returns -1, the libpng default, for an empty list or an unknown name.
+    static int parseFilters(const std::string& names)
+    {
+        int filters = 0;
+        std::string::size_type start = 0;
+        while (start < names.size())
         {
-            b[0] = b[1] = b[2] = b[3] = 0;
+            auto end = names.find(',', start);
+            if (end == std::string::npos)
+            {
+                end = names.size();
+            }
+
+            const auto name = names.substr(start, end - start);
+            if (name == "none")
+                filters |= PNG_FILTER_NONE;
+            else if (name == "sub")
+                filters |= PNG_FILTER_SUB;
+            else if (name == "up")
+                filters |= PNG_FILTER_UP;
+            else if (name == "avg")
+                filters |= PNG_FILTER_AVG;
+            else if (name == "paeth")
+                filters |= PNG_FILTER_PAETH;
+            else if (name == "all")
+                filters |= PNG_ALL_FILTERS;
+            else
+                return -1;
+
+            start = end + 1;
         }
-        else
+
+        return (filters ? filters : -1);
+    }
+};
+
+/// Returns true when an area of the pixmap is a single colour, and which.
+inline
+bool isUniform(const unsigned char* pixmap, int startX, int startY,
+               int width, int height, int bufferWidth, uint32_t& colour)
+{
+    const unsigned char* first = pixmap + (startY * bufferWidth * 4) + (startX * 4);
+    std::memcpy(&colour, first, sizeof(uint32_t));
+    for (int x = 1; x < width; ++x)
+    {
+        if (std::memcmp(first + x * 4, first, sizeof(uint32_t)) != 0)
+        {
+            return false;
+        }
+    }
+
+    // The other rows only have to match the first.
+    for (int y = 1; y < height; ++y)
+    {
+        const unsigned char* row = pixmap + ((startY + y) * bufferWidth * 4) + (startX * 4);
+        if (std::memcmp(row, first, width * 4) != 0)
         {
-            b[0] = (((pixel & 0xff0000) >> 16) * 255 + alpha / 2) / alpha;
-            b[1] = (((pixel & 0x00ff00) >>  8) * 255 + alpha / 2) / alpha;
-            b[2] = (((pixel & 0x0000ff) >>  0) * 255 + alpha / 2) / alpha;
-            b[3] = alpha;
+            return false;
         }
     }
+
+    return true;
 }
 
-// Sadly, older libpng headers don't use const for the pixmap pointer parameter to
-// png_write_row(), so can't use const here for pixmap.
+/// Finds the bounding box of the pixels of an area of the pixmap that
+/// differ from previous, a copy of the area as it was, packed by rows.
+/// Returns false when none differ.
 inline
-bool encodeSubBufferToPNG(unsigned char* pixmap, int startX, int startY,
-                          int width, int height,
-                          int bufferWidth, int bufferHeight,
-                          std::vector<char>& output, LibreOfficeKitTileMode mode)
+bool getChangedArea(const unsigned char* previous, const unsigned char* pixmap,
+                    int startX, int startY, int width, int height, int bufferWidth,
+                    int& changedX, int& changedY, int& changedWidth, int& changedHeight)
 {
-    if (bufferWidth < width || bufferHeight < height)
+    const size_t rowSize = width * 4;
+    const auto getRow = [&](const int y) { return pixmap + ((startY + y) * bufferWidth * 4) + (startX * 4); };
+    const auto rowChanged = [&](const int y) { return std::memcmp(getRow(y), previous + y * rowSize, rowSize) != 0; };
+
+    int top = 0;
+    while (top < height && !rowChanged(top))
+    {
+        ++top;
+    }
+
+    if (top == height)
+    {
+        return false;
+    }
+
+    int bottom = height - 1;
+    while (bottom > top && !rowChanged(bottom))
+    {
+        --bottom;
+    }
+
+    int left = width;
+    int right = -1;
+    for (int y = top; y <= bottom; ++y)
+    {
+        const unsigned char* row = getRow(y);
+        const unsigned char* previousRow = previous + y * rowSize;
+        for (int x = 0; x < left; ++x)
+        {
+            if (std::memcmp(row + x * 4, previousRow + x * 4, 4) != 0)
+            {
+                left = x;
+                break;
+            }
+        }
+
+        for (int x = width - 1; x > right; --x)
+        {
+            if (std::memcmp(row + x * 4, previousRow + x * 4, 4) != 0)
+            {
+                right = x;
+                break;
+            }
+        }
+    }
+
+    changedX = left;
+    changedY = top;
+    changedWidth = right - left + 1;
+    changedHeight = bottom - top + 1;
+    return true;
+}
+
+/// Finds the colours of an area of the pixmap, and the colour index of each of its pixels.
+/// Returns false when there are more than maxColours.
+inline
+bool getPalette(const unsigned char* pixmap, int startX, int startY,
+                int width, int height, int bufferWidth,
+                std::vector<uint32_t>& colours, std::vector<unsigned char>& indices,
+                const size_t maxColours = 256)
+{
+    colours.clear();
+    indices.resize(width * height);
+
+    std::unordered_map<uint32_t, unsigned char> lookup;
+    uint32_t lastColour = 0;
+    unsigned char lastIndex = 0;
+    for (int y = 0; y < height; ++y)
+    {
+        const unsigned char* row = pixmap + ((startY + y) * bufferWidth * 4) + (startX * 4);
+        for (int x = 0; x < width; ++x)
+        {
+            uint32_t colour;
+            std::memcpy(&colour, row + x * 4, sizeof(uint32_t));
+
+            // Runs of the same colour are the common case.
+            if (colours.empty() || colour != lastColour)
+            {
+                const auto it = lookup.find(colour);
+                if (it != lookup.end())
+                {
+                    lastIndex = it->second;
+                }
+                else
+                {
+                    if (colours.size() == maxColours)
+                    {
+                        return false;
+                    }
+
+                    lastIndex = colours.size();
+                    lookup.emplace(colour, lastIndex);
+                    colours.push_back(colour);
+                }
+
+                lastColour = colour;
+            }
+
+            indices[y * width + x] = lastIndex;
+        }
+    }
+
+    return true;
+}
+
+/// The palette of an image of at most 256 colours, and the colour index of each pixel.
+struct Palette
+{
+    std::vector<png_color> colours;
+    /// The alpha of each colour, empty when all are opaque.
+    std::vector<png_byte> transparency;
+    std::vector<unsigned char> indices;
+};
+
+/// Returns the palette of an area of the pixmap, if it has at most 256 colours.
+inline
+bool getPalette(unsigned char* pixmap, int startX, int startY,
+                int width, int height, int bufferWidth,
+                LibreOfficeKitTileMode mode, Palette& palette)
+{
+    std::vector<uint32_t> colours;
+    if (!getPalette(pixmap, startX, startY, width, height, bufferWidth, colours, palette.indices))
     {
         return false;
     }
 
+    palette.colours.resize(colours.size());
+    palette.transparency.resize(colours.size());
+    bool opaque = true;
+    for (size_t i = 0; i < colours.size(); ++i)
+    {
+        unsigned char rgba[4];
+        std::memcpy(rgba, &colours[i], sizeof(rgba));
+        if (mode == LOK_TILEMODE_BGRA)
+        {
+            unpremultiplyPixelsScalar(rgba, 1);
+        }
+
+        palette.colours[i].red = rgba[0];
+        palette.colours[i].green = rgba[1];
+        palette.colours[i].blue = rgba[2];
+        palette.transparency[i] = rgba[3];
+        opaque = opaque && (rgba[3] == 0xff);
+    }
+
+    if (opaque)
+    {
+        palette.transparency.clear();
+    }
+
+    return true;
+}
+
+// Sadly, older libpng headers don't use const for the pixmap pointer parameter to
+// png_write_row(), so can't use const here for pixmap.
+/// Encodes the area with the palette if given, otherwise as RGBA.
+inline
+bool writePNG(unsigned char* pixmap, int startX, int startY,
+              int width, int height, int bufferWidth,
+              std::vector<char>& output, LibreOfficeKitTileMode mode,
+              const EncodeOptions& options, const Palette* palette)
+{
     png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
 
     png_infop info_ptr = png_create_info_struct(png_ptr);
@@ -123,22 +513,61 @@ bool encodeSubBufferToPNG(unsigned char* pixmap, int startX, int startY,
         return false;
     }
 
-    png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    if (options.compressionLevel >= 0)
+    {
+        png_set_compression_level(png_ptr, options.compressionLevel);
+    }
+
+    if (palette)
+    {
+        // Indices don't predict their neighbours, filtering only adds to them.
+        png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, PNG_FILTER_NONE);
+
+        // The smallest bit depth that fits the palette, packed by libpng.
+        const auto count = palette->colours.size();
+        const int bitDepth = (count <= 2 ? 1 : count <= 4 ? 2 : count <= 16 ? 4 : 8);
+        png_set_IHDR(png_ptr, info_ptr, width, height, bitDepth, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_set_PLTE(png_ptr, info_ptr, palette->colours.data(), count);
+        if (!palette->transparency.empty())
+        {
+            png_set_tRNS(png_ptr, info_ptr, palette->transparency.data(), count, nullptr);
+        }
+    }
+    else
+    {
+        if (options.filters >= 0)
+        {
+            png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, options.filters);
+        }
+
+        png_set_IHDR(png_ptr, info_ptr, width, height, 8, PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+    }
 
     png_set_write_fn(png_ptr, &output, user_write_fn, user_flush_fn);
     png_set_write_status_fn(png_ptr, user_write_status_fn);
 
     png_write_info(png_ptr, info_ptr);
 
-    if (mode == LOK_TILEMODE_BGRA)
+    if (palette)
     {
-        png_set_write_user_transform_fn (png_ptr, unpremultiply_data);
+        png_set_packing(png_ptr);
+        for (int y = 0; y < height; ++y)
+        {
+            png_write_row(png_ptr, const_cast<unsigned char*>(palette->indices.data()) + y * width);
+        }
     }
-
-    for (int y = 0; y < height; ++y)
+    else
     {
-        size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
-        png_write_row(png_ptr, pixmap + position);
+        if (mode == LOK_TILEMODE_BGRA)
+        {
+            png_set_write_user_transform_fn (png_ptr, unpremultiply_data);
+        }
+
+        for (int y = 0; y < height; ++y)
+        {
+            size_t position = ((startY + y) * bufferWidth * 4) + (startX * 4);
+            png_write_row(png_ptr, pixmap + position);
+        }
     }
 
     png_write_end(png_ptr, info_ptr);
@@ -148,11 +577,72 @@ bool encodeSubBufferToPNG(unsigned char* pixmap, int startX, int startY,
     return true;
 }
 
+inline
+bool encodeSubBufferToPNG(unsigned char* pixmap, int startX, int startY,
+                          int width, int height,
+                          int bufferWidth, int bufferHeight,
+                          std::vector<char>& output, LibreOfficeKitTileMode mode,
+                          const EncodeOptions& options = EncodeOptions())
+{
+    if (bufferWidth < width || bufferHeight < height)
+    {
+        return false;
+    }
+
+    Palette palette;
+    if (options.palette && getPalette(pixmap, startX, startY, width, height, bufferWidth, mode, palette))
+    {
+        return writePNG(pixmap, startX, startY, width, height, bufferWidth, output, mode, options, &palette);
+    }
+
+    return writePNG(pixmap, startX, startY, width, height, bufferWidth, output, mode, options, nullptr);
+}
+
 inline
 bool encodeBufferToPNG(unsigned char* pixmap, int width, int height,
-                       std::vector<char>& output, LibreOfficeKitTileMode mode)
+                       std::vector<char>& output, LibreOfficeKitTileMode mode,
+                       const EncodeOptions& options = EncodeOptions())
+{
+    return encodeSubBufferToPNG(pixmap, 0, 0, width, height, width, height, output, mode, options);
+}
+
+/// Decodes a PNG into unpremultiplied RGBA pixels.
+inline
+bool decodePNG(const char* data, const size_t size,
+               std::vector<unsigned char>& pixmap, int& width, int& height)
+{
+    png_image image;
+    std::memset(&image, 0, sizeof(image));
+    image.version = PNG_IMAGE_VERSION;
+
+    if (!png_image_begin_read_from_memory(&image, data, size))
+    {
+        return false;
+    }
+
+    image.format = PNG_FORMAT_RGBA;
+    pixmap.resize(PNG_IMAGE_SIZE(image));
+    if (!png_image_finish_read(&image, nullptr, pixmap.data(), 0, nullptr))
+    {
+        png_image_free(&image);
+        return false;
+    }
+
+    width = image.width;
+    height = image.height;
+    return true;
+}
+
+/// Re-encodes a PNG with other options, typically to make it smaller.
+inline
+bool recompressPNG(const char* data, const size_t size,
+                   std::vector<char>& output, const EncodeOptions& options)
 {
-    return encodeSubBufferToPNG(pixmap, 0, 0, width, height, width, height, output, mode);
+    std::vector<unsigned char> pixmap;
+    int width = 0;
+    int height = 0;
+    return decodePNG(data, size, pixmap, width, height) &&
+           encodeBufferToPNG(pixmap.data(), width, height, output, LOK_TILEMODE_RGBA, options);
 }
 
 }
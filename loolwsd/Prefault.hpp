@@ -0,0 +1,265 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_PREFAULT_HPP
+#define INCLUDED_PREFAULT_HPP
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+/// Warms the image of LibreOffice that ForKit preinitialized, before it
+/// forks the kits: the pages mapped from the files of LibreOffice, and
+/// from the fonts, configuration and type libraries, are faulted in once
+/// here, instead of in each kit, on its way to its first paint. They are
+/// only read, so that those of the files stay shared through the page
+/// cache, and none gets private. The files of those kinds not mapped yet
+/// are read ahead, for the kits to find them in the page cache.
+class Prefault
+{
+public:
+    /// A line of /proc/<pid>/maps.
+    struct Mapping
+    {
+        Mapping() :
+            _start(0),
+            _end(0),
+            _offset(0)
+        {
+        }
+
+        uintptr_t _start;
+        uintptr_t _end;
+        std::string _perms;
+        uint64_t _offset;
+        std::string _path;
+    };
+
+    struct Stats
+    {
+        Stats() :
+            _mappings(0),
+            _pages(0),
+            _hugeMappings(0),
+            _files(0),
+            _fileBytes(0),
+            _ms(0)
+        {
+        }
+
+        /// The mappings warmed, and their pages.
+        size_t _mappings;
+        size_t _pages;
+        /// The mappings of code marked for huge pages.
+        size_t _hugeMappings;
+        /// The files read ahead, and their bytes.
+        size_t _files;
+        size_t _fileBytes;
+        int64_t _ms;
+
+        std::string toString() const
+        {
+            std::ostringstream oss;
+            oss << "mappings=" << _mappings
+                << " pages=" << _pages
+                << " huge_mappings=" << _hugeMappings
+                << " files=" << _files
+                << " file_bytes=" << _fileBytes
+                << " ms=" << _ms;
+            return oss.str();
+        }
+    };
+
+    /// Returns false unless the line is that of a mapping.
+    static bool parseMapping(const std::string& line, Mapping& mapping)
+    {
+        std::istringstream iss(line);
+        std::string range;
+        std::string device;
+        std::string inode;
+        if (!(iss >> range >> mapping._perms >> std::hex >> mapping._offset >> device >> inode))
+        {
+            return false;
+        }
+
+        const auto dash = range.find('-');
+        if (dash == std::string::npos || mapping._perms.size() != 4)
+        {
+            return false;
+        }
+
+        mapping._start = std::strtoull(range.c_str(), nullptr, 16);
+        mapping._end = std::strtoull(range.c_str() + dash + 1, nullptr, 16);
+
+        // The path, if any, may have spaces.
+        mapping._path.clear();
+        std::getline(iss >> std::ws, mapping._path);
+        return mapping._end > mapping._start;
+    }
+
+    /// Whether the file is a font, configuration or type library,
+    /// which LibreOffice reads wherever it is.
+    static bool isDataFile(const std::string& path)
+    {
+        for (const char* extension : { ".rdb", ".xcd", ".ttf", ".ttc", ".otf", ".pfb" })
+        {
+            const size_t size = std::char_traits<char>::length(extension);
+            if (path.size() > size && path.compare(path.size() - size, size, extension) == 0)
+            {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /// Whether to warm the mapping: readable, from a file of LibreOffice
+    /// under loTemplate, or from a data file, and not deleted since.
+    static bool isWarmed(const Mapping& mapping, const std::string& loTemplate)
+    {
+        const std::string deleted = " (deleted)";
+        return (mapping._perms[0] == 'r' && !mapping._path.empty() && mapping._path[0] == '/' &&
+                (mapping._path.size() < deleted.size() ||
+                 mapping._path.compare(mapping._path.size() - deleted.size(), deleted.size(), deleted) != 0) &&
+                ((!loTemplate.empty() && mapping._path.compare(0, loTemplate.size() + 1, loTemplate + '/') == 0) ||
+                 isDataFile(mapping._path)));
+    }
+
+    /// Warms the mappings of this process, then reads ahead the data files
+    /// under loTemplate. hugePages marks the code for huge pages, where the
+    /// kernel backs the files with them.
+    static Stats warm(const std::string& loTemplate, const bool hugePages)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        Stats stats;
+
+        std::ifstream maps("/proc/self/maps");
+        std::string line;
+        Mapping mapping;
+        while (std::getline(maps, line))
+        {
+            if (parseMapping(line, mapping) && isWarmed(mapping, loTemplate))
+            {
+                if (hugePages && mapping._perms[2] == 'x' && adviseHugePages(mapping))
+                {
+                    ++stats._hugeMappings;
+                }
+
+                stats._pages += touch(mapping);
+                ++stats._mappings;
+            }
+        }
+
+        for (const char* dir : { "/program", "/share/registry", "/share/fonts" })
+        {
+            readAhead(loTemplate + dir, stats);
+        }
+
+        stats._ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        std::chrono::steady_clock::now() - start).count();
+        return stats;
+    }
+
+private:
+    /// Faults in the pages of the mapping backed by its file, by reading
+    /// them, those past the end of the file would fault with SIGBUS.
+    /// Returns the number of pages.
+    static size_t touch(const Mapping& mapping)
+    {
+        struct stat st;
+        if (stat(mapping._path.c_str(), &st) != 0 || static_cast<uint64_t>(st.st_size) <= mapping._offset)
+        {
+            return 0;
+        }
+
+        const uintptr_t pageSize = getpagesize();
+        const uint64_t fileBytes = static_cast<uint64_t>(st.st_size) - mapping._offset;
+        const uintptr_t end = (fileBytes < mapping._end - mapping._start ? mapping._start + fileBytes : mapping._end);
+        const uintptr_t pages = (end - mapping._start + pageSize - 1) / pageSize;
+        madvise(reinterpret_cast<void*>(mapping._start), pages * pageSize, MADV_WILLNEED);
+
+        for (uintptr_t address = mapping._start; address < end; address += pageSize)
+        {
+            // Read, never written: the page stays that of the file.
+            static_cast<void>(*reinterpret_cast<const volatile char*>(address));
+        }
+
+        return pages;
+    }
+
+    /// Returns true if the kernel took the hint.
+    static bool adviseHugePages(const Mapping& mapping)
+    {
+#ifdef MADV_HUGEPAGE
+        // Only the huge pages within the mapping can be backed so.
+        const uintptr_t hugePageSize = 2 * 1024 * 1024;
+        const uintptr_t start = (mapping._start + hugePageSize - 1) & ~(hugePageSize - 1);
+        const uintptr_t end = mapping._end & ~(hugePageSize - 1);
+        return (end > start && madvise(reinterpret_cast<void*>(start), end - start, MADV_HUGEPAGE) == 0);
+#else
+        static_cast<void>(mapping);
+        return false;
+#endif
+    }
+
+    /// Reads ahead the data files under path, in the background.
+    static void readAhead(const std::string& path, Stats& stats)
+    {
+        DIR* dir = opendir(path.c_str());
+        if (!dir)
+        {
+            return;
+        }
+
+        while (struct dirent* entry = readdir(dir))
+        {
+            const std::string name = entry->d_name;
+            const std::string child = path + '/' + name;
+            struct stat st;
+            if (name[0] == '.' || lstat(child.c_str(), &st) != 0)
+            {
+                continue;
+            }
+
+            if (S_ISDIR(st.st_mode))
+            {
+                readAhead(child, stats);
+            }
+            else if (S_ISREG(st.st_mode) && isDataFile(name))
+            {
+                const int fd = open(child.c_str(), O_RDONLY | O_CLOEXEC);
+                if (fd >= 0)
+                {
+                    if (posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) == 0)
+                    {
+                        ++stats._files;
+                        stats._fileBytes += st.st_size;
+                    }
+
+                    close(fd);
+                }
+            }
+        }
+
+        closedir(dir);
+    }
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,161 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_PRESPAWNCONTROL_HPP
+#define INCLUDED_PRESPAWNCONTROL_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <deque>
+#include <iomanip>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+/// Sizes the pool of children kept started in advance.
+/// Enough are kept to serve the documents opened meanwhile
+/// a new child is forked and gets ready, so that bursts of opens
+/// don't all wait for ForKit, within the configured bounds.
+class PrespawnControl
+{
+public:
+    typedef std::chrono::steady_clock::time_point TimePoint;
+
+    PrespawnControl(const size_t minChildren, const size_t maxChildren) :
+        _minChildren(minChildren),
+        _maxChildren(std::max(minChildren, maxChildren)),
+        _openWeight(0),
+        _readyMs(0),
+        _hits(0),
+        _misses(0)
+    {
+    }
+
+    void setBounds(const size_t minChildren, const size_t maxChildren)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _minChildren = minChildren;
+        _maxChildren = std::max(minChildren, maxChildren);
+    }
+
+    /// A document wants a child, hit tells whether one was waiting.
+    void recordRequest(const bool hit, const TimePoint now)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _openWeight = getOpenWeight(now) + 1;
+        _lastOpen = now;
+        if (hit)
+        {
+            ++_hits;
+        }
+        else
+        {
+            ++_misses;
+        }
+    }
+
+    /// ForKit was asked for count more children.
+    void recordFork(const size_t count, const TimePoint now)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        // Those that never made it aren't waited for anymore.
+        while (!_forks.empty() &&
+               std::chrono::duration_cast<std::chrono::milliseconds>(now - _forks.front()).count() > ForkExpiryMs)
+        {
+            _forks.pop_front();
+        }
+
+        _forks.insert(_forks.end(), count, now);
+    }
+
+    /// A child got ready, measures the time it took since requested.
+    void recordReady(const TimePoint now)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        if (_forks.empty())
+        {
+            // Spawned by ForKit on its own, at startup.
+            return;
+        }
+
+        const double ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - _forks.front()).count();
+        _forks.pop_front();
+        _readyMs = (_readyMs > 0 ? _readyMs + (ms - _readyMs) / 4 : std::max(ms, 1.));
+    }
+
+    /// The number of children to keep waiting.
+    size_t getTarget(const TimePoint now)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return computeTarget(now);
+    }
+
+    std::string getStats(const TimePoint now)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        std::ostringstream oss;
+        oss << "target=" << computeTarget(now)
+            << " min=" << _minChildren
+            << " max=" << _maxChildren
+            << " open_rate=" << std::fixed << std::setprecision(2) << getOpenRate(now)
+            << " ready_ms=" << static_cast<size_t>(_readyMs)
+            << " hits=" << _hits
+            << " misses=" << _misses;
+        return oss.str();
+    }
+
+private:
+    /// The opens of the last RateWindowMs or so, older ones decaying exponentially.
+    double getOpenWeight(const TimePoint now) const
+    {
+        if (_openWeight == 0)
+        {
+            return 0;
+        }
+
+        const double ms = std::chrono::duration_cast<std::chrono::milliseconds>(now - _lastOpen).count();
+        return _openWeight * std::exp(-ms / RateWindowMs);
+    }
+
+    /// Opens per second.
+    double getOpenRate(const TimePoint now) const
+    {
+        return getOpenWeight(now) * 1000 / RateWindowMs;
+    }
+
+    size_t computeTarget(const TimePoint now) const
+    {
+        // The opens expected while a replacement is getting ready.
+        const size_t demand = std::lround(getOpenRate(now) * _readyMs / 1000);
+        return std::min(_minChildren + demand, _maxChildren);
+    }
+
+private:
+    static constexpr double RateWindowMs = 30 * 1000;
+    static constexpr int ForkExpiryMs = 60 * 1000;
+
+    std::mutex _mutex;
+    size_t _minChildren;
+    size_t _maxChildren;
+    double _openWeight;
+    TimePoint _lastOpen;
+    /// When each of the children not ready yet was requested.
+    std::deque<TimePoint> _forks;
+    /// Average time from the fork request to the child being ready.
+    double _readyMs;
+    size_t _hits;
+    size_t _misses;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
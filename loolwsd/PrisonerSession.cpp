@@ -10,13 +10,18 @@
 #include "PrisonerSession.hpp"
 #include "config.h"
 
+#include <algorithm>
+#include <sstream>
+
 #include <Poco/FileStream.h>
 #include <Poco/JSON/Object.h>
 #include <Poco/JSON/Parser.h>
 #include <Poco/URI.h>
 #include <Poco/URIStreamOpener.h>
 
+#include "Command.hpp"
 #include "Common.hpp"
+#include "FontCache.hpp"
 #include "LOOLProtocol.hpp"
 #include "LOOLSession.hpp"
 #include "LOOLWSD.hpp"
@@ -48,13 +53,62 @@ PrisonerSession::~PrisonerSession()
     Log::info("~PrisonerSession dtor [" + getName() + "].");
 }
 
+bool PrisonerSession::isRelayed(const std::vector<char>& fragment)
+{
+    const std::string firstToken = LOOLProtocol::getFirstToken(fragment);
+    if (firstToken == "textselectioncontent:")
+    {
+        return true;
+    }
+    else if (firstToken == "commandvalues:")
+    {
+        // The fonts and the styles are saved to the cache, so are joined. Their names come first.
+        const std::string start(fragment.data(), std::min<size_t>(fragment.size(), READ_BUFFER_SIZE));
+        return (start.find(".uno:CharFontName") == std::string::npos &&
+                start.find(".uno:StyleApply") == std::string::npos);
+    }
+
+    return false;
+}
+
+bool PrisonerSession::relayFragment(const std::vector<char>& fragment, const bool first, const bool final)
+{
+    if (first)
+    {
+        // The clients announcing large frames need the size first.
+        auto peer = _peer.lock();
+        if (!peer || peer->isAnnouncingLargeFrames() || !isRelayed(fragment))
+        {
+            return false;
+        }
+
+        Log::trace(getName() + ": relaying [" + getAbbreviatedMessage(fragment.data(), fragment.size()) + "].");
+        _relayPeer = peer;
+    }
+
+    if (_relayPeer)
+    {
+        _relayPeer->sendFragment(fragment.data(), fragment.size(), first, final);
+    }
+
+    if (final)
+    {
+        _relayPeer.reset();
+    }
+
+    return true;
+}
+
 bool PrisonerSession::_handleInput(const char *buffer, int length)
 {
     const std::string firstLine = getFirstLine(buffer, length);
     StringTokenizer tokens(firstLine, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
     Log::trace(getName() + ": handling [" + firstLine + "].");
 
-    if (LOOLProtocol::tokenIndicatesUserInteraction(tokens[0]))
+    // The kits send many notifications not dispatched here, so unknown to the table.
+    const Command command = getCommand(buffer, length);
+    countCommand(command);
+    if (command == Command::Unknown ? LOOLProtocol::tokenIndicatesUserInteraction(tokens[0]) : isUserInteraction(command))
     {
         // Keep track of timestamps of incoming client messages that indicate user activity.
         updateLastActivityTime();
@@ -70,7 +124,7 @@ bool PrisonerSession::_handleInput(const char *buffer, int length)
         throw Poco::ProtocolException("The session has not been assigned a peer.");
     }
 
-    if (tokens[0] == "unocommandresult:")
+    if (command == Command::UnoCommandResultMessage)
     {
         const std::string stringMsg(buffer, length);
         Log::info(getName() + "Command: " + stringMsg);
@@ -84,13 +138,13 @@ bool PrisonerSession::_handleInput(const char *buffer, int length)
             if (object->get("commandName").toString() == ".uno:Save" &&
                 object->get("success").toString() == "true")
             {
-                _docBroker->save();
+                _docBroker->requestSave();
                 return true;
             }
         }
     }
     else
-    if (tokens[0] == "error:")
+    if (command == Command::ErrorMessage)
     {
         std::string errorCommand;
         std::string errorKind;
@@ -111,14 +165,14 @@ bool PrisonerSession::_handleInput(const char *buffer, int length)
         }
     }
     else
-    if (tokens[0] == "curpart:" &&
+    if (command == Command::CurPartMessage &&
         tokens.count() == 2 &&
         getTokenInteger(tokens[1], "part", _curPart))
     {
         return true;
     }
     else
-    if (tokens.count() == 2 && tokens[0] == "saveas:")
+    if (tokens.count() == 2 && command == Command::SaveAsMessage)
     {
         std::string url;
         if (!getTokenString(tokens[1], "url", url))
@@ -150,7 +204,7 @@ bool PrisonerSession::_handleInput(const char *buffer, int length)
         peer->setSaveAsUrl(url);
         return true;
     }
-    else if (tokens.count() == 2 && tokens[0] == "statechanged:")
+    else if (tokens.count() == 2 && command == Command::StateChangedMessage)
     {
         if (_docBroker)
         {
@@ -164,15 +218,21 @@ bool PrisonerSession::_handleInput(const char *buffer, int length)
 
     if (!_isDocPasswordProtected)
     {
-        if (tokens[0] == "tile:")
+        if (command == Command::TileMessage)
         {
             assert(!"Tile traffic should go through the DocumentBroker-LoKit WS.");
         }
-        else if (tokens[0] == "status:")
+        else if (command == Command::StatusMessage)
         {
             _docBroker->setLoaded();
             _docBroker->tileCache().saveTextFile(std::string(buffer, length), "status.txt");
 
+            // The first document loaded has its kit render the previews of all the fonts.
+            if (FontCache::instance().startBuilding())
+            {
+                _docBroker->prerenderFonts();
+            }
+
             // Forward the status response to the client.
             forwardToPeer(_peer, buffer, length);
 
@@ -182,7 +242,7 @@ bool PrisonerSession::_handleInput(const char *buffer, int length)
             Log::debug("Forwarding [" + message + "] in response to status.");
             return forwardToPeer(_peer, message.c_str(), message.size());
         }
-        else if (tokens[0] == "commandvalues:")
+        else if (command == Command::CommandValuesMessage)
         {
             const std::string stringMsg(buffer, length);
             const auto index = stringMsg.find_first_of('{');
@@ -201,19 +261,35 @@ bool PrisonerSession::_handleInput(const char *buffer, int length)
                 }
             }
         }
-        else if (tokens[0] == "partpagerectangles:")
+        else if (command == Command::PartPageRectanglesMessage)
         {
             if (tokens.count() > 1 && !tokens[1].empty())
             {
                 _docBroker->tileCache().saveTextFile(std::string(buffer, length), "partpagerectangles.txt");
             }
         }
-        else if (tokens[0] == "invalidatetiles:")
+        else if (command == Command::InvalidateTilesMessage)
         {
-            assert(firstLine.size() == static_cast<std::string::size_type>(length));
-            _docBroker->tileCache().invalidateTiles(firstLine);
+            // The areas the kit merged come together, a line each.
+            const std::string message(buffer, length);
+            const auto areas = TileInvalidation::parseAll(message);
+            _docBroker->tileCache().invalidateTiles(areas);
+            if (LOOLWSD::RenderInvalidatedAhead)
+            {
+                _docBroker->renderInvalidatedTiles(areas, peer->getView());
+            }
+
+            // The clients take them a message each.
+            std::istringstream lines(message);
+            std::string line;
+            while (std::getline(lines, line))
+            {
+                forwardToPeer(_peer, line.data(), line.size());
+            }
+
+            return true;
         }
-        else if (tokens[0] == "invalidatecursor:")
+        else if (command == Command::InvalidateCursorMessage)
         {
             assert(firstLine.size() == static_cast<std::string::size_type>(length));
             StringTokenizer firstLineTokens(firstLine, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
@@ -230,7 +306,7 @@ bool PrisonerSession::_handleInput(const char *buffer, int length)
                 Log::error("Unable to parse " + firstLine);
             }
         }
-        else if (tokens[0] == "renderfont:")
+        else if (command == Command::RenderFontMessage)
         {
             std::string font;
             if (tokens.count() < 2 ||
@@ -242,6 +318,7 @@ bool PrisonerSession::_handleInput(const char *buffer, int length)
 
             assert(firstLine.size() < static_cast<std::string::size_type>(length));
             _docBroker->tileCache().saveRendering(font, "font", buffer + firstLine.size() + 1, length - firstLine.size() - 1);
+            FontCache::instance().add(FontCache::getName(font), buffer + firstLine.size() + 1, length - firstLine.size() - 1);
         }
     }
 
@@ -27,6 +27,13 @@ public:
     void setPeer(const std::shared_ptr<ClientSession>& peer) { _peer = peer; }
     bool shutdownPeer(Poco::UInt16 statusCode, const std::string& message);
 
+    /// Relays the large replies not kept here to the client as they come,
+    /// a fragment at a time, rather than joined first. See MessageReader::Relay.
+    bool relayFragment(const std::vector<char>& fragment, bool first, bool final);
+
+    /// Whether a reply, by its first fragment, is one to relay.
+    static bool isRelayed(const std::vector<char>& fragment);
+
 private:
 
     virtual bool _handleInput(const char *buffer, int length) override;
@@ -35,6 +42,8 @@ private:
 
     std::shared_ptr<DocumentBroker> _docBroker;
     std::weak_ptr<ClientSession> _peer;
+    /// The client a reply is being relayed to, until its final fragment.
+    std::shared_ptr<ClientSession> _relayPeer;
     int _curPart;
 };
 
@@ -7,8 +7,13 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/.
  */
 
+#include <atomic>
+#include <functional>
+#include <memory>
+
 #include <Poco/Runnable.h>
 
+#include "IoUtil.hpp"
 #include "MessageQueue.hpp"
 #include "LOOLSession.hpp"
 #include "LOOLProtocol.hpp"
@@ -18,15 +23,27 @@
 class QueueHandler: public Poco::Runnable
 {
 public:
+    typedef std::function<void(const MessageQueue::Payload&)> Handled;
+
+    /// @param wakeup, if given, is woken up once we're finished.
+    /// @param handled, if given, is called after each message is handled.
     QueueHandler(std::shared_ptr<MessageQueue> queue,
                  const std::shared_ptr<LOOLSession>& session,
-                 const std::string& name):
+                 const std::string& name,
+                 const std::shared_ptr<IoUtil::Wakeup>& wakeup = nullptr,
+                 const Handled& handled = nullptr):
         _queue(queue),
         _session(session),
-        _name(name)
+        _name(name),
+        _wakeup(wakeup),
+        _handled(handled),
+        _finished(false)
     {
     }
 
+    /// Whether run() is done, or about to be.
+    bool isFinished() const { return _finished; }
+
     void run() override
     {
         Util::setThreadName(_name);
@@ -44,7 +61,13 @@ public:
                     break;
                 }
 
-                if (!_session->handleInput(input.data(), input.size()))
+                const bool carryOn = _session->handleInput(input.data(), input.size());
+                if (_handled)
+                {
+                    _handled(input);
+                }
+
+                if (!carryOn)
                 {
                     Log::info("Socket handler flagged for finishing.");
                     break;
@@ -56,6 +79,12 @@ public:
             Log::error(std::string("QueueHandler::run: Exception: ") + exc.what());
         }
 
+        _finished = true;
+        if (_wakeup)
+        {
+            _wakeup->wake();
+        }
+
         Log::debug("Thread finished.");
     }
 
@@ -63,6 +92,9 @@ private:
     std::shared_ptr<MessageQueue> _queue;
     std::shared_ptr<LOOLSession> _session;
     const std::string _name;
+    std::shared_ptr<IoUtil::Wakeup> _wakeup;
+    const Handled _handled;
+    std::atomic<bool> _finished;
 };
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
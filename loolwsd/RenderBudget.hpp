@@ -0,0 +1,125 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_RENDERBUDGET_HPP
+#define INCLUDED_RENDERBUDGET_HPP
+
+#include <cstring>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+/// The time the renders of a document took, by tile, to tell ahead which
+/// renders would take longer than a budget: those of large diagrams, or
+/// of huge spreadsheets. These are first painted at a lower resolution,
+/// quick to paint, for the clients to show until the tiles in full come.
+/// Used by the render thread only.
+class RenderBudget
+{
+public:
+    /// budgetMs of 0 for none.
+    explicit RenderBudget(const int budgetMs, const size_t maxTiles = MaxTiles) :
+        _budgetMs(budgetMs),
+        _maxTiles(maxTiles)
+    {
+    }
+
+    int getBudgetMs() const { return _budgetMs; }
+
+    /// A tile at its zoom.
+    static std::string getKey(const int part, const int tilePosX, const int tilePosY,
+                              const int tileWidth, const int tileHeight)
+    {
+        return std::to_string(part) + ':' + std::to_string(tilePosX) + ',' + std::to_string(tilePosY) +
+               ':' + std::to_string(tileWidth) + 'x' + std::to_string(tileHeight);
+    }
+
+    /// Keeps the time the tile took to render, its share of a render of several,
+    /// averaged with the last, and forgets the tiles rendered the longest ago.
+    void record(const std::string& key, const double ms)
+    {
+        const auto it = _renderMs.find(key);
+        if (it != _renderMs.end())
+        {
+            it->second = (it->second + ms) / 2;
+            return;
+        }
+
+        _renderMs.emplace(key, ms);
+        _order.push_back(key);
+        while (_order.size() > _maxTiles)
+        {
+            _renderMs.erase(_order.front());
+            _order.pop_front();
+        }
+    }
+
+    /// The time the tile took to render, 0 if not known.
+    double estimate(const std::string& key) const
+    {
+        const auto it = _renderMs.find(key);
+        return (it != _renderMs.end() ? it->second : 0);
+    }
+
+    /// The factor to divide the resolution of a render estimated at ms by,
+    /// for it to fit the budget, the time going with the pixels painted.
+    /// 1 when it fits already, or without budget.
+    int getScale(const double ms) const
+    {
+        int scale = 1;
+        while (_budgetMs > 0 && scale < MaxScale && ms > _budgetMs * scale * scale)
+        {
+            scale *= 2;
+        }
+
+        return scale;
+    }
+
+    size_t size() const { return _renderMs.size(); }
+
+    /// Scales the RGBA pixels of source up to fill target, each pixel to its
+    /// nearest, which is quick and keeps the colours of the document.
+    static void upscale(const unsigned char* source, const int sourceWidth, const int sourceHeight,
+                        unsigned char* target, const int targetWidth, const int targetHeight)
+    {
+        for (int y = 0; y < targetHeight; ++y)
+        {
+            const unsigned char* sourceRow = source + 4 * sourceWidth * (static_cast<long>(y) * sourceHeight / targetHeight);
+            unsigned char* targetRow = target + 4 * targetWidth * y;
+            if (y > 0 && (static_cast<long>(y) * sourceHeight / targetHeight) ==
+                         (static_cast<long>(y - 1) * sourceHeight / targetHeight))
+            {
+                // The same as the row above.
+                std::memcpy(targetRow, targetRow - 4 * targetWidth, 4 * targetWidth);
+                continue;
+            }
+
+            for (int x = 0; x < targetWidth; ++x)
+            {
+                std::memcpy(targetRow + 4 * x, sourceRow + 4 * (static_cast<long>(x) * sourceWidth / targetWidth), 4);
+            }
+        }
+    }
+
+private:
+    /// The tiles of a few screens, at a few zooms.
+    static constexpr size_t MaxTiles = 4096;
+    /// The lowest resolution, a 256 pixels tile painted in 32.
+    static constexpr int MaxScale = 8;
+
+    const int _budgetMs;
+    const size_t _maxTiles;
+    std::unordered_map<std::string, double> _renderMs;
+    /// The keys of _renderMs, first recorded first.
+    std::deque<std::string> _order;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
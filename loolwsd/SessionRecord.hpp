@@ -0,0 +1,302 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_SESSIONRECORD_HPP
+#define INCLUDED_SESSIONRECORD_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <istream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// The messages a client sent in a session, as they came, for the session
+/// to be replayed against a build, at the pace of the client or faster, by
+/// test/replaytool. A file per session: a line with the session and the URI
+/// it connected to, then each message as a line with when it came, in ms
+/// since the epoch, for the sessions of a document to be replayed together,
+/// and its size, then its bytes and a newline, for those of several lines.
+class SessionRecord
+{
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry
+    {
+        Entry() : _ms(0) {}
+
+        int64_t _ms;
+        std::string _message;
+    };
+
+    /// Records into path, replaced. Check isOpen().
+    SessionRecord(const std::string& path, const std::string& sessionId, const std::string& uri) :
+        _file(path, std::ios::binary | std::ios::trunc)
+    {
+        _file << Magic << ' ' << sessionId << ' ' << uri << '\n';
+        _file.flush();
+    }
+
+    SessionRecord(const SessionRecord&) = delete;
+    SessionRecord& operator=(const SessionRecord&) = delete;
+
+    bool isOpen() const { return _file.good(); }
+
+    /// Writes the message through, not to lose the last ones if wsd goes down.
+    void record(const char* data, const size_t size)
+    {
+        const int64_t ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                               std::chrono::system_clock::now().time_since_epoch()).count();
+        std::unique_lock<std::mutex> lock(_mutex);
+        _file << ms << ' ' << size << '\n';
+        _file.write(data, size);
+        _file << '\n';
+        _file.flush();
+    }
+
+    /// Returns false unless the stream starts as a record does.
+    static bool readHeader(std::istream& stream, std::string& sessionId, std::string& uri)
+    {
+        std::string line;
+        std::string magic;
+        if (!std::getline(stream, line) || !(std::istringstream(line) >> magic >> sessionId >> uri) ||
+            magic != Magic)
+        {
+            return false;
+        }
+
+        return true;
+    }
+
+    /// Returns false at the end, or at a message cut short.
+    static bool readEntry(std::istream& stream, Entry& entry)
+    {
+        std::string line;
+        size_t size = 0;
+        if (!std::getline(stream, line) || !(std::istringstream(line) >> entry._ms >> size))
+        {
+            return false;
+        }
+
+        entry._message.resize(size);
+        return (stream.read(&entry._message[0], size) && stream.get() == '\n');
+    }
+
+    /// The message with the value of the token name=value of its first line
+    /// replaced, as the URL of the document to load, for a copy of it.
+    static std::string setToken(const std::string& message, const std::string& name, const std::string& value)
+    {
+        const size_t end = std::min(message.find('\n'), message.size());
+        for (size_t pos = message.find(name + '='); pos < end; pos = message.find(name + '=', pos + 1))
+        {
+            if (pos == 0 || message[pos - 1] == ' ')
+            {
+                const size_t start = pos + name.size() + 1;
+                const size_t stop = std::min(message.find(' ', start), end);
+                return message.substr(0, start) + value + message.substr(stop);
+            }
+        }
+
+        return message;
+    }
+
+    /// The keys of the replies the server sends to the message, those worth
+    /// timing: each tile requested, the status loaded, the values asked, and
+    /// for a keystroke, click or command, the area to repaint. Empty if none.
+    static std::vector<std::string> getAwaitedReplies(const std::string& firstLine)
+    {
+        std::vector<std::string> keys;
+        const std::string command = firstLine.substr(0, firstLine.find(' '));
+        if (command == "tile")
+        {
+            keys.push_back(getTileKey(firstLine, getToken(firstLine, "tileposx"), getToken(firstLine, "tileposy")));
+        }
+        else if (command == "tilecombine")
+        {
+            std::istringstream posX(getToken(firstLine, "tileposx"));
+            std::istringstream posY(getToken(firstLine, "tileposy"));
+            std::string x;
+            std::string y;
+            while (std::getline(posX, x, ',') && std::getline(posY, y, ','))
+            {
+                keys.push_back(getTileKey(firstLine, x, y));
+            }
+        }
+        else if (command == "load" || command == "status")
+        {
+            keys.push_back("status:");
+        }
+        else if (command == "commandvalues" || command == "partpagerectangles" ||
+                 command == "renderfont" || command == "downloadas" || command == "saveas")
+        {
+            keys.push_back(command + ':');
+        }
+        else if (command == "gettextselection")
+        {
+            keys.push_back("textselectioncontent:");
+        }
+        else if ((command == "key" && getToken(firstLine, "type") == "input") ||
+                 (command == "mouse" && getToken(firstLine, "type") == "buttondown") ||
+                 command == "uno" || command == "paste")
+        {
+            keys.push_back(Invalidate);
+        }
+
+        return keys;
+    }
+
+    /// The key of the reply of the server, empty if none is timed. The
+    /// placeholders and previews of the tiles, of version 0, are not yet
+    /// the tiles awaited.
+    static std::string getReplyKey(const std::string& firstLine)
+    {
+        const std::string command = firstLine.substr(0, firstLine.find(' '));
+        if (command == "tile:" || command == "tiledelta:")
+        {
+            return (getToken(firstLine, "ver") == "0" ? std::string() :
+                    getTileKey(firstLine, getToken(firstLine, "tileposx"), getToken(firstLine, "tileposy")));
+        }
+        else if (command == "invalidatetiles:" || command == "invalidatecursor:")
+        {
+            return Invalidate;
+        }
+        else if (command == "status:" || command == "commandvalues:" || command == "partpagerectangles:" ||
+                 command == "renderfont:" || command == "downloadas:" || command == "saveas:" ||
+                 command == "textselectioncontent:")
+        {
+            return command;
+        }
+
+        return std::string();
+    }
+
+    /// Times the replies to the messages replayed, by the command of each.
+    /// Sent by one thread, received by another.
+    class Replies
+    {
+    public:
+        typedef std::vector<std::pair<std::string, Clock::duration>> Latencies;
+
+        void sent(const std::string& firstLine, const Clock::time_point now)
+        {
+            const std::string command = firstLine.substr(0, firstLine.find(' '));
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (const auto& key : getAwaitedReplies(firstLine))
+            {
+                _pending.push_back(Pending{ key, command, now });
+            }
+        }
+
+        /// The latencies of the messages the reply answers: the oldest
+        /// awaiting it, or all of them for an area to repaint, which
+        /// covers the keystrokes typed since the last.
+        Latencies received(const std::string& firstLine, const Clock::time_point now)
+        {
+            Latencies latencies;
+            const std::string key = getReplyKey(firstLine);
+            if (key.empty())
+            {
+                return latencies;
+            }
+
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (auto it = _pending.begin(); it != _pending.end(); )
+            {
+                if (it->_key != key)
+                {
+                    ++it;
+                    continue;
+                }
+
+                latencies.emplace_back(it->_command, now - it->_sent);
+                it = _pending.erase(it);
+                if (key != Invalidate)
+                {
+                    break;
+                }
+            }
+
+            return latencies;
+        }
+
+        /// Forgets the messages awaiting a reply for longer than timeout,
+        /// not to answer them with a later one. Returns their number.
+        size_t expire(const Clock::time_point now, const Clock::duration timeout)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            size_t expired = 0;
+            while (!_pending.empty() && now - _pending.front()._sent > timeout)
+            {
+                _pending.pop_front();
+                ++expired;
+            }
+
+            return expired;
+        }
+
+        size_t size() const
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            return _pending.size();
+        }
+
+    private:
+        struct Pending
+        {
+            std::string _key;
+            std::string _command;
+            Clock::time_point _sent;
+        };
+
+        std::deque<Pending> _pending;
+        mutable std::mutex _mutex;
+    };
+
+private:
+    static constexpr const char* Magic = "loolsessionrecord1";
+    /// The key of the replies that repaint.
+    static constexpr const char* Invalidate = "invalidate";
+
+    /// The value of the token name=value of the line, empty if none.
+    static std::string getToken(const std::string& line, const std::string& name)
+    {
+        std::istringstream iss(line);
+        std::string token;
+        while (iss >> token)
+        {
+            if (token.size() > name.size() && token[name.size()] == '=' && token.compare(0, name.size(), name) == 0)
+            {
+                return token.substr(name.size() + 1);
+            }
+        }
+
+        return std::string();
+    }
+
+    /// A tile at its zoom, as requested and as sent.
+    static std::string getTileKey(const std::string& line, const std::string& tilePosX, const std::string& tilePosY)
+    {
+        return "tile:" + getToken(line, "part") + ',' + tilePosX + ',' + tilePosY + ',' +
+               getToken(line, "tilewidth") + ',' + getToken(line, "tileheight");
+    }
+
+private:
+    std::ofstream _file;
+    std::mutex _mutex;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,340 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "SocketPoll.hpp"
+#include "config.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+
+#include <Poco/Exception.h>
+
+#include "Common.hpp"
+#include "Log.hpp"
+#include "Util.hpp"
+
+using Poco::Net::WebSocket;
+
+SocketPoll::SocketPoll(const std::string& name, const size_t threads) :
+    _name(name),
+    _epollFd(epoll_create1(EPOLL_CLOEXEC)),
+    _wakeupFd(eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)),
+    _stop(false)
+{
+    if (_epollFd < 0 || _wakeupFd < 0)
+    {
+        Log::syserror("Failed to create the socket poll.");
+        throw std::runtime_error("Failed to create the socket poll.");
+    }
+
+    // Level-triggered, so that it wakes up all the threads.
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = _wakeupFd;
+    if (epoll_ctl(_epollFd, EPOLL_CTL_ADD, _wakeupFd, &event) < 0)
+    {
+        Log::syserror("Failed to watch the wakeup descriptor.");
+        throw std::runtime_error("Failed to create the socket poll.");
+    }
+
+    for (size_t i = 0; i < threads; ++i)
+    {
+        _threads.emplace_back([this]() { pollThread(); });
+    }
+
+    Log::info() << "SocketPoll [" << _name << "] started with " << threads << " threads." << Log::end;
+}
+
+SocketPoll::~SocketPoll()
+{
+    stop();
+    ::close(_wakeupFd);
+    ::close(_epollFd);
+}
+
+void SocketPoll::add(const std::shared_ptr<WebSocket>& ws,
+                     const MessageHandler& handler,
+                     const CloseHandler& closeFrame,
+                     const CloseHandler& onClose,
+                     const std::shared_ptr<WebSocketDeflate>& deflate)
+{
+    auto entry = std::make_shared<Entry>(ws);
+    entry->_reader.setDeflate(deflate);
+    entry->_handler = handler;
+    entry->_closeFrame = closeFrame;
+    entry->_onClose = onClose;
+
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _entries[entry->_fd] = entry;
+    }
+
+    if (_stop)
+    {
+        // Too late, no one would read it.
+        close(entry);
+        return;
+    }
+
+    epoll_event event = {};
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.fd = entry->_fd;
+    if (epoll_ctl(_epollFd, EPOLL_CTL_ADD, entry->_fd, &event) < 0)
+    {
+        Log::syserror("Failed to watch socket #" + std::to_string(entry->_fd) + ".");
+        close(entry);
+        return;
+    }
+
+    Log::debug() << "SocketPoll [" << _name << "] watching socket #" << entry->_fd << "." << Log::end;
+}
+
+void SocketPoll::remove(const std::shared_ptr<WebSocket>& ws)
+{
+    std::shared_ptr<Entry> entry;
+    {
+        // The socket may be closed already, so find it by the object.
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (const auto& pair : _entries)
+        {
+            if (pair.second->_ws == ws)
+            {
+                entry = pair.second;
+                break;
+            }
+        }
+    }
+
+    if (entry)
+    {
+        close(entry);
+        if (entry->_processThread != std::this_thread::get_id())
+        {
+            // Wait for the handler to finish.
+            std::unique_lock<std::mutex> lock(entry->_processMutex);
+        }
+    }
+}
+
+size_t SocketPoll::getSocketCount()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _entries.size();
+}
+
+void SocketPoll::stop()
+{
+    if (_stop.exchange(true))
+    {
+        return;
+    }
+
+    const uint64_t one = 1;
+    if (write(_wakeupFd, &one, sizeof(one)) < 0)
+    {
+        Log::syserror("Failed to wake up the socket poll.");
+    }
+
+    for (auto& thread : _threads)
+    {
+        thread.join();
+    }
+
+    _threads.clear();
+
+    std::map<int, std::shared_ptr<Entry>> entries;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        entries = _entries;
+    }
+
+    for (const auto& pair : entries)
+    {
+        close(pair.second);
+    }
+
+    Log::info("SocketPoll [" + _name + "] stopped.");
+}
+
+void SocketPoll::pollThread()
+{
+    Util::setThreadName(_name);
+
+    Log::debug("Thread started.");
+
+    while (!_stop)
+    {
+        // One socket at a time, so that a slow handler doesn't hold up
+        // others that are ready meanwhile: those go to the other threads.
+        epoll_event event;
+        const int count = epoll_wait(_epollFd, &event, 1, -1);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            Log::syserror("epoll_wait failed.");
+            break;
+        }
+
+        if (count == 0 || event.data.fd == _wakeupFd)
+        {
+            continue;
+        }
+
+        std::shared_ptr<Entry> entry;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            const auto it = _entries.find(event.data.fd);
+            if (it != _entries.end())
+            {
+                entry = it->second;
+            }
+        }
+
+        if (!entry || entry->_closed)
+        {
+            continue;
+        }
+
+        bool alive = false;
+        std::unique_lock<std::mutex> processLock(entry->_processMutex);
+        entry->_processThread = std::this_thread::get_id();
+        try
+        {
+            alive = process(*entry);
+        }
+        catch (const Poco::Exception& exc)
+        {
+            Log::error() << "SocketPoll: Exception on socket #" << entry->_fd << ": "
+                         << exc.displayText()
+                         << (exc.nested() ? " (" + exc.nested()->displayText() + ")" : "")
+                         << Log::end;
+        }
+        catch (const std::exception& exc)
+        {
+            Log::error() << "SocketPoll: Exception on socket #" << entry->_fd << ": "
+                         << exc.what() << Log::end;
+        }
+
+        entry->_processThread = std::thread::id();
+        processLock.unlock();
+
+        if (!alive)
+        {
+            close(entry);
+            continue;
+        }
+
+        // Done with it, let the next readiness through.
+        event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+        event.data.fd = entry->_fd;
+        if (epoll_ctl(_epollFd, EPOLL_CTL_MOD, entry->_fd, &event) < 0 && !entry->_closed)
+        {
+            Log::syserror("Failed to watch socket #" + std::to_string(entry->_fd) + " again.");
+            close(entry);
+        }
+    }
+
+    Log::debug("Thread finished.");
+}
+
+bool SocketPoll::process(Entry& entry)
+{
+    // Only what is there: a peer stalling in the middle of a frame
+    // must not hold up the thread, nor the other sockets on it.
+    char buffer[READ_BUFFER_SIZE * 32];
+    const ssize_t size = recv(entry._fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+    if (size < 0)
+    {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+        {
+            return true;
+        }
+
+        Log::syserror("Failed to read socket #" + std::to_string(entry._fd) + ".");
+        return false;
+    }
+
+    if (size == 0)
+    {
+        entry._closeFrame();
+        Log::warn("Connection closed.");
+        return false;
+    }
+
+    // Each complete message, of the frames read so far.
+    entry._reader.feed(buffer, size);
+    while (!entry._closed)
+    {
+        const int result = entry._reader.next(entry._payload);
+        if (result < 0)
+        {
+            entry._closeFrame();
+            Log::warn("Connection closed.");
+            return false;
+        }
+        else if (result == 0)
+        {
+            break;
+        }
+
+        const auto success = entry._handler(entry._payload);
+        entry._payload.resize(0);
+        if (!success)
+        {
+            Log::info("Socket handler flagged to finish.");
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void SocketPoll::close(const std::shared_ptr<Entry>& entry)
+{
+    if (entry->_closed.exchange(true))
+    {
+        return;
+    }
+
+    {
+        // The socket may be closed already, and its descriptor reused
+        // by one added since, which is not ours to unregister.
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto it = _entries.find(entry->_fd);
+        if (it != _entries.end() && it->second == entry)
+        {
+            epoll_ctl(_epollFd, EPOLL_CTL_DEL, entry->_fd, nullptr);
+            _entries.erase(it);
+        }
+    }
+
+    Log::debug() << "SocketPoll [" << _name << "] removed socket #" << entry->_fd << "." << Log::end;
+
+    try
+    {
+        entry->_onClose();
+    }
+    catch (const std::exception& exc)
+    {
+        Log::error() << "SocketPoll: Exception closing socket #" << entry->_fd << ": "
+                     << exc.what() << Log::end;
+    }
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,120 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_SOCKETPOLL_HPP
+#define INCLUDED_SOCKETPOLL_HPP
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Poco/Net/WebSocket.h>
+
+#include "IoUtil.hpp"
+
+/// Multiplexes many WebSockets over a few I/O threads with epoll.
+/// The readiness of each socket is reported to one thread at a time,
+/// which reads what is there, without waiting for the rest of a frame,
+/// and passes each complete message to the socket's handler. The handlers
+/// run on the I/O threads and must not block for long: anything slow is
+/// to be handed to another thread.
+class SocketPoll
+{
+public:
+    /// Gets a complete message, returns false to close the socket.
+    typedef std::function<bool(const std::vector<char>&)> MessageHandler;
+    typedef std::function<void()> CloseHandler;
+
+    SocketPoll(const std::string& name, const size_t threads);
+    ~SocketPoll();
+
+    SocketPoll(const SocketPoll&) = delete;
+    SocketPoll& operator=(const SocketPoll&) = delete;
+
+    /// Starts watching the socket, which must be a plain one: the frames
+    /// are read off its descriptor, not through Poco.
+    /// closeFrame is called when the peer closes the connection, as with
+    /// IoUtil::SocketProcessor, and onClose once the socket is removed,
+    /// whatever the reason. Those compressed are inflated with deflate,
+    /// if given. Messages are always joined, never relayed: the rest of
+    /// one relayed would be read back on an I/O thread, which its peer's
+    /// other senders, waiting for it to end, may all be holding up.
+    void add(const std::shared_ptr<Poco::Net::WebSocket>& ws,
+             const MessageHandler& handler,
+             const CloseHandler& closeFrame,
+             const CloseHandler& onClose,
+             const std::shared_ptr<WebSocketDeflate>& deflate = nullptr);
+
+    /// Stops watching the socket and calls its onClose, if not done already.
+    /// Once it returns, the handlers of the socket are done running, unless
+    /// it is called from one of them.
+    void remove(const std::shared_ptr<Poco::Net::WebSocket>& ws);
+
+    size_t getSocketCount();
+
+    /// Stops the threads and removes the remaining sockets.
+    void stop();
+
+private:
+    struct Entry
+    {
+        Entry(const std::shared_ptr<Poco::Net::WebSocket>& ws) :
+            _ws(ws),
+            _fd(ws->impl()->sockfd()),
+            _reader(*ws),
+            _closed(false)
+        {
+        }
+
+        std::shared_ptr<Poco::Net::WebSocket> _ws;
+        /// Kept, as the socket may be closed before it's removed.
+        const int _fd;
+        /// Parses the frames of the bytes read.
+        IoUtil::MessageReader _reader;
+        /// The message being assembled.
+        std::vector<char> _payload;
+        MessageHandler _handler;
+        CloseHandler _closeFrame;
+        CloseHandler _onClose;
+        std::atomic<bool> _closed;
+        /// Held by the thread reading the socket.
+        std::mutex _processMutex;
+        std::atomic<std::thread::id> _processThread;
+    };
+
+    void pollThread();
+
+    /// Reads what the socket has, and handles the messages it completes.
+    /// Returns false once the socket is closed.
+    bool process(Entry& entry);
+
+    /// Unregisters the entry and calls its onClose, once.
+    void close(const std::shared_ptr<Entry>& entry);
+
+private:
+    const std::string _name;
+    const int _epollFd;
+    /// Wakes up the threads to stop.
+    const int _wakeupFd;
+    std::atomic<bool> _stop;
+    std::vector<std::thread> _threads;
+
+    /// The watched sockets, by descriptor.
+    std::mutex _mutex;
+    std::map<int, std::shared_ptr<Entry>> _entries;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,190 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_STARTUP_HPP
+#define INCLUDED_STARTUP_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <sstream>
+#include <string>
+
+#include "Trace.hpp"
+
+/// The phases of the cold path, from the launch of wsd to its kits ready,
+/// then from the load of the first document to its first tile sent.
+/// Each process keeps when it first reached each phase, on the monotonic
+/// clock all processes share. The kits inherit those of ForKit, and send
+/// theirs to wsd with their first paint, which reports them all once the
+/// first tile is sent, with the memory of the kit then.
+namespace Startup
+{
+    enum class Phase : unsigned char
+    {
+        WsdStart,       //< wsd: main() entered.
+        ForKitStart,    //< forkit: main() entered.
+        GlobalPreinit,  //< forkit: LibreOffice preinitialized.
+        Prefault,       //< forkit: the image of LibreOffice prefaulted, if enabled.
+        Fork,           //< kit: forked.
+        JailLink,       //< kit: jailed, its files linked.
+        KitReady,       //< kit: LibreOfficeKit initialized.
+        KitsReady,      //< wsd: as many kits as to prespawn connected.
+        LoadRequest,    //< wsd: the load of a client received.
+        DocumentLoad,   //< kit: documentLoad returned.
+        FirstPaint,     //< kit: the first tile painted.
+        FirstTileSent,  //< wsd: the first tile sent to a client.
+        Count
+    };
+
+    inline const char* getPhaseName(const Phase phase)
+    {
+        static const char* names[] =
+        {
+            "wsd_start", "forkit_start", "global_preinit", "prefault", "fork", "jail_link", "kit_ready",
+            "kits_ready", "load_request", "document_load", "first_paint", "first_tile_sent"
+        };
+        return phase < Phase::Count ? names[static_cast<size_t>(phase)] : "unknown";
+    }
+
+    /// The times of the phases in us, 0 until reached.
+    inline std::atomic<int64_t>* getTimes()
+    {
+        static std::atomic<int64_t> times[static_cast<size_t>(Phase::Count)];
+        return times;
+    }
+
+    inline bool record(const Phase phase, const int64_t timeUs)
+    {
+        int64_t unset = 0;
+        return getTimes()[static_cast<size_t>(phase)].compare_exchange_strong(unset, timeUs);
+    }
+
+    /// Records the phase reached now, unless it was before.
+    /// Returns true the first time only.
+    inline bool record(const Phase phase)
+    {
+        return record(phase, Trace::now());
+    }
+
+    /// The memory of the kit at its first paint, in KB, 0 until measured:
+    /// its private pages (USS), and its share of all (PSS).
+    inline std::atomic<int64_t>* getKitMemoryKb()
+    {
+        static std::atomic<int64_t> memory[2];
+        return memory;
+    }
+
+    /// Records the memory of the first kit measured only.
+    inline bool recordKitMemory(const int64_t ussKb, const int64_t pssKb)
+    {
+        int64_t unset = 0;
+        if (!getKitMemoryKb()[0].compare_exchange_strong(unset, ussKb))
+        {
+            return false;
+        }
+
+        getKitMemoryKb()[1] = pssKb;
+        return true;
+    }
+
+    /// The phases reached, as " <name>=<us>..." for the kits to send.
+    inline std::string serialize()
+    {
+        std::ostringstream oss;
+        for (size_t i = 0; i < static_cast<size_t>(Phase::Count); ++i)
+        {
+            const int64_t time = getTimes()[i];
+            if (time > 0)
+            {
+                oss << ' ' << getPhaseName(static_cast<Phase>(i)) << '=' << time;
+            }
+        }
+
+        return oss.str();
+    }
+
+    /// Keeps the phases sent by a kit not reached here.
+    /// Returns the number of them merged.
+    inline size_t merge(const std::string& phases)
+    {
+        size_t merged = 0;
+        std::istringstream iss(phases);
+        std::string item;
+        while (iss >> item)
+        {
+            const auto equal = item.find('=');
+            const int64_t time = (equal == std::string::npos ? 0 : std::strtoll(item.c_str() + equal + 1, nullptr, 10));
+            for (size_t i = 0; i < static_cast<size_t>(Phase::Count) && time > 0; ++i)
+            {
+                if (item.compare(0, equal, getPhaseName(static_cast<Phase>(i))) == 0)
+                {
+                    merged += record(static_cast<Phase>(i), time);
+                    break;
+                }
+            }
+        }
+
+        return merged;
+    }
+
+    /// The phases reached, in ms since the first, as JSON to compare between builds,
+    /// with the time wsd took to have its kits ready and the first tile to be sent,
+    /// and the memory of the kit at its first paint, once measured.
+    inline std::string getReport()
+    {
+        const auto times = getTimes();
+        int64_t first = 0;
+        for (size_t i = 0; i < static_cast<size_t>(Phase::Count); ++i)
+        {
+            if (times[i] > 0 && (first == 0 || times[i] < first))
+            {
+                first = times[i];
+            }
+        }
+
+        const auto getSpan = [times](const Phase from, const Phase to)
+            {
+                const int64_t start = times[static_cast<size_t>(from)];
+                const int64_t end = times[static_cast<size_t>(to)];
+                return (start > 0 && end >= start ? (end - start) / 1000. : -1.);
+            };
+
+        std::ostringstream oss;
+        oss << std::fixed << std::setprecision(3)
+            << "{\"startup_ms\":" << getSpan(Phase::WsdStart, Phase::KitsReady)
+            << ",\"first_tile_ms\":" << getSpan(Phase::LoadRequest, Phase::FirstTileSent)
+            << ",\"phases\":{";
+        bool separate = false;
+        for (size_t i = 0; i < static_cast<size_t>(Phase::Count); ++i)
+        {
+            if (times[i] > 0)
+            {
+                oss << (separate ? "," : "") << '"' << getPhaseName(static_cast<Phase>(i)) << "\":"
+                    << (times[i] - first) / 1000.;
+                separate = true;
+            }
+        }
+
+        oss << '}';
+        const auto memory = getKitMemoryKb();
+        if (memory[0] > 0)
+        {
+            oss << ",\"kit_uss_kb\":" << memory[0] << ",\"kit_pss_kb\":" << memory[1];
+        }
+
+        oss << '}';
+        return oss.str();
+    }
+}
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
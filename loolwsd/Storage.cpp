@@ -10,9 +10,20 @@
 #include "Storage.hpp"
 #include "config.h"
 
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <fstream>
+#include <functional>
 #include <string>
+#include <vector>
 
 #include <Poco/JSON/Object.h>
 #include <Poco/JSON/Parser.h>
@@ -21,17 +32,181 @@
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/Net/HTTPResponse.h>
 #include <Poco/Net/HTTPSClientSession.h>
+#include <Poco/Net/NetException.h>
 #include <Poco/Net/NetworkInterface.h>
 #include <Poco/Net/SSLManager.h>
 #include <Poco/StreamCopier.h>
 
 #include "Auth.hpp"
 #include "Common.hpp"
+#include "ConnectionPool.hpp"
 #include "Exceptions.hpp"
+#include "ExpiringCache.hpp"
 #include "Log.hpp"
 #include "Unit.hpp"
 #include "Util.hpp"
 
+namespace
+{
+    /// The files are streamed through a buffer of this size,
+    /// however large they are.
+    constexpr size_t TransferChunkSize = 64 * 1024;
+
+    /// CheckFileInfo returns a small JSON, anything larger is broken.
+    constexpr size_t MaxFileInfoSize = 1024 * 1024;
+
+    constexpr size_t MaxCachedFileInfos = 1024;
+
+    int WopiIdleConnectionTimeoutMs = 15000;
+
+    /// By "host:port".
+    std::unique_ptr<Poco::Net::HTTPClientSession> createWopiSession(const std::string& key)
+    {
+        const auto colon = key.rfind(':');
+        const auto host = key.substr(0, colon);
+        const auto port = std::stoi(key.substr(colon + 1));
+#if ENABLE_SSL
+        std::unique_ptr<Poco::Net::HTTPClientSession> session(
+            new Poco::Net::HTTPSClientSession(host, port, Poco::Net::SSLManager::instance().defaultClientContext()));
+#else
+        std::unique_ptr<Poco::Net::HTTPClientSession> session(new Poco::Net::HTTPClientSession(host, port));
+#endif
+        session->setKeepAlive(true);
+        session->setKeepAliveTimeout(Poco::Timespan(WopiIdleConnectionTimeoutMs / 1000, (WopiIdleConnectionTimeoutMs % 1000) * 1000));
+        return session;
+    }
+
+    ConnectionPool<Poco::Net::HTTPClientSession>& getWopiSessions()
+    {
+        static ConnectionPool<Poco::Net::HTTPClientSession> sessions(createWopiSession, 4, WopiIdleConnectionTimeoutMs);
+        return sessions;
+    }
+
+    /// By the URI, with the id of the file and the access token.
+    ExpiringCache<StorageBase::FileInfo>& getWopiFileInfos()
+    {
+        static ExpiringCache<StorageBase::FileInfo> fileInfos(5000, MaxCachedFileInfos);
+        return fileInfos;
+    }
+
+    /// Runs request on a session to the host of uri, kept open for the next
+    /// if request returns true, as it does once the response is read whole.
+    /// A reused session the host closed meanwhile is replaced by a new one.
+    bool withWopiSession(const Poco::URI& uri, const std::function<bool(Poco::Net::HTTPClientSession&)>& request)
+    {
+        const auto key = uri.getHost() + ':' + std::to_string(uri.getPort());
+        bool reused = false;
+        auto session = getWopiSessions().acquire(key, std::chrono::steady_clock::now(), reused);
+        bool result = false;
+        try
+        {
+            result = request(*session);
+        }
+        catch (const Poco::Net::NetException& exc)
+        {
+            if (!reused)
+            {
+                throw;
+            }
+
+            Log::debug("Pooled session to [" + key + "] failed, retrying on a new one: " + exc.displayText());
+            session = createWopiSession(key);
+            result = request(*session);
+        }
+
+        if (result)
+        {
+            getWopiSessions().release(key, std::move(session), std::chrono::steady_clock::now());
+        }
+
+        return result;
+    }
+
+    /// Copies the file from one path to another within the kernel: sharing its
+    /// blocks with a reflink where the filesystem can (btrfs, XFS), else
+    /// by copy_file_range. Returns false, for the caller to copy in userspace,
+    /// if neither is supported between the two, as across filesystems.
+    bool copyFileInKernel(const std::string& fromPath, const std::string& toPath, std::string& method)
+    {
+        const int from = open(fromPath.c_str(), O_RDONLY | O_CLOEXEC);
+        if (from < 0)
+        {
+            return false;
+        }
+
+        struct stat st;
+        if (fstat(from, &st) != 0)
+        {
+            close(from);
+            return false;
+        }
+
+        const int to = open(toPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 0777);
+        if (to < 0)
+        {
+            close(from);
+            return false;
+        }
+
+        bool copied = false;
+#ifdef FICLONE
+        if (ioctl(to, FICLONE, from) == 0)
+        {
+            method = "reflink";
+            copied = true;
+        }
+#endif
+#ifdef __NR_copy_file_range
+        if (!copied)
+        {
+            off_t remaining = st.st_size;
+            while (remaining > 0)
+            {
+                const auto count = syscall(__NR_copy_file_range, from, nullptr, to, nullptr, remaining, 0);
+                if (count <= 0)
+                {
+                    // Not supported here, or failed midway: the userspace copy starts over.
+                    break;
+                }
+
+                remaining -= count;
+            }
+
+            if (remaining == 0)
+            {
+                method = "copy_file_range";
+                copied = true;
+            }
+        }
+#endif
+
+        close(from);
+        if (close(to) != 0)
+        {
+            copied = false;
+        }
+
+        return copied;
+    }
+
+    /// Copies as cheaply as the filesystems allow, logging how and how long it took.
+    void copyFile(const std::string& fromPath, const std::string& toPath)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        std::string method;
+        if (!copyFileInKernel(fromPath, toPath, method))
+        {
+            method = "userspace copy";
+            Poco::File(fromPath).copyTo(toPath);
+        }
+
+        const auto elapsedMs = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                    std::chrono::steady_clock::now() - start).count();
+        Log::info() << "Copied " << fromPath << " to " << toPath << " by " << method
+                    << " in " << elapsedMs << " ms." << Log::end;
+    }
+}
+
 ///////////////////
 // StorageBase Impl
 ///////////////////
@@ -55,6 +230,38 @@ std::string StorageBase::getLocalRootPath() const
     return rootPath.toString();
 }
 
+size_t StorageBase::transfer(std::istream& in, std::ostream& out, const size_t total, const std::string& operation)
+{
+    std::vector<char> buffer(TransferChunkSize);
+    size_t done = 0;
+    size_t lastPercent = 0;
+    while (in && out)
+    {
+        in.read(buffer.data(), buffer.size());
+        const auto count = in.gcount();
+        if (count <= 0)
+        {
+            break;
+        }
+
+        out.write(buffer.data(), count);
+        done += count;
+
+        if (_progressHandler && total > 0)
+        {
+            const size_t percent = std::min<size_t>(done * 100 / total, 100);
+            if (percent > lastPercent)
+            {
+                _progressHandler(operation, done, total);
+                lastPercent = percent;
+            }
+        }
+    }
+
+    out.flush();
+    return done;
+}
+
 size_t StorageBase::getFileSize(const std::string& filename)
 {
     return std::ifstream(filename, std::ifstream::ate | std::ifstream::binary).tellg();
@@ -70,6 +277,12 @@ void StorageBase::initialize()
     WopiEnabled = app.config().getBool("storage.wopi[@allow]", false);
     if (WopiEnabled)
     {
+        WopiIdleConnectionTimeoutMs = app.config().getUInt("storage.wopi.idle_connection_timeout_ms", 15000);
+        getWopiSessions().setLimits(app.config().getUInt("storage.wopi.max_idle_connections", 4),
+                                    WopiIdleConnectionTimeoutMs);
+        getWopiFileInfos().setLimits(app.config().getUInt("storage.wopi.fileinfo_cache_ms", 5000),
+                                     MaxCachedFileInfos);
+
         for (size_t i = 0; ; ++i)
         {
             const std::string path = "storage.wopi.host[" + std::to_string(i) + "]";
@@ -202,7 +415,7 @@ std::string LocalStorage::loadStorageFileToLocal()
         if (!Poco::File(_jailedFilePath).exists())
         {
             Log::info("Copying " + publicFilePath + " to " + _jailedFilePath);
-            Poco::File(publicFilePath).copyTo(_jailedFilePath);
+            copyFile(publicFilePath, _jailedFilePath);
             _isCopy = true;
         }
     }
@@ -224,7 +437,7 @@ bool LocalStorage::saveLocalFileToStorage()
         if (_isCopy && Poco::File(_jailedFilePath).exists())
         {
             Log::info("Copying " + _jailedFilePath + " to " + _uri);
-            Poco::File(_jailedFilePath).copyTo(_uri);
+            copyFile(_jailedFilePath, _uri);
         }
     }
     catch (const Poco::Exception& exc)
@@ -243,32 +456,52 @@ StorageBase::FileInfo WopiStorage::getFileInfo(const Poco::URI& uri)
 {
     Log::debug("Getting info for wopi uri [" + uri.toString() + "].");
 
-#if ENABLE_SSL
-    Poco::Net::HTTPSClientSession session(uri.getHost(), uri.getPort(), Poco::Net::SSLManager::instance().defaultClientContext());
-#else
-    Poco::Net::HTTPClientSession session(uri.getHost(), uri.getPort());
-#endif
-    Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri.getPathAndQuery(), Poco::Net::HTTPMessage::HTTP_1_1);
-    request.set("User-Agent", "LOOLWSD WOPI Agent");
-    session.sendRequest(request);
-
-    Poco::Net::HTTPResponse response;
-    std::istream& rs = session.receiveResponse(response);
-
-    auto logger = Log::trace();
-    logger << "WOPI::CheckFileInfo header for URI [" << uri.toString() << "]:\n";
-    for (auto& pair : response)
+    // Those opening the document meanwhile with the same token get the same.
+    const auto key = uri.toString();
+    FileInfo fileInfo;
+    if (getWopiFileInfos().get(key, fileInfo, std::chrono::steady_clock::now()))
     {
-        logger << '\t' + pair.first + ": " + pair.second << " / ";
+        Log::debug("WOPI::CheckFileInfo for URI [" + key + "] cached.");
+        return fileInfo;
     }
 
-    logger << Log::end;
+    std::string resMsg;
+    withWopiSession(uri, [&uri, &resMsg](Poco::Net::HTTPClientSession& session)
+        {
+            Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri.getPathAndQuery(), Poco::Net::HTTPMessage::HTTP_1_1);
+            request.set("User-Agent", "LOOLWSD WOPI Agent");
+            session.sendRequest(request);
+
+            Poco::Net::HTTPResponse response;
+            std::istream& rs = session.receiveResponse(response);
+
+            auto logger = Log::trace();
+            logger << "WOPI::CheckFileInfo header for URI [" << uri.toString() << "]:\n";
+            for (auto& pair : response)
+            {
+                logger << '\t' + pair.first + ": " + pair.second << " / ";
+            }
+
+            logger << Log::end;
+
+            resMsg.clear();
+            char buffer[4096];
+            while (rs.read(buffer, sizeof(buffer)) || rs.gcount() > 0)
+            {
+                resMsg.append(buffer, rs.gcount());
+                if (resMsg.size() > MaxFileInfoSize)
+                {
+                    throw std::runtime_error("WOPI::CheckFileInfo response larger than " +
+                                             std::to_string(MaxFileInfoSize) + " bytes.");
+                }
+            }
+
+            return true;
+        });
 
     // Parse the response.
     std::string filename;
     size_t size = 0;
-    std::string resMsg;
-    Poco::StreamCopier::copyToString(rs, resMsg);
     Log::debug("WOPI::CheckFileInfo returned: " + resMsg);
     const auto index = resMsg.find_first_of('{');
     if (index != std::string::npos)
@@ -282,7 +515,13 @@ StorageBase::FileInfo WopiStorage::getFileInfo(const Poco::URI& uri)
     }
 
     // WOPI doesn't support file last modified time.
-    return FileInfo({filename, Poco::Timestamp(), size});
+    fileInfo = FileInfo({filename, Poco::Timestamp(), size});
+    if (!filename.empty())
+    {
+        getWopiFileInfos().put(key, fileInfo, std::chrono::steady_clock::now());
+    }
+
+    return fileInfo;
 }
 
 /// uri format: http://server/<...>/wopi*/files/<id>/content
@@ -303,37 +542,49 @@ std::string WopiStorage::loadStorageFileToLocal()
     const auto url = uriObject.getPath() + "/contents?" + uriObject.getQuery();
     Log::debug("Wopi requesting: " + url);
 
-#if ENABLE_SSL
-    Poco::Net::HTTPSClientSession session(uriObject.getHost(), uriObject.getPort(), Poco::Net::SSLManager::instance().defaultClientContext());
-#else
-    Poco::Net::HTTPClientSession session(uriObject.getHost(), uriObject.getPort());
-#endif
-    Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, url, Poco::Net::HTTPMessage::HTTP_1_1);
-    request.set("User-Agent", "LOOLWSD WOPI Agent");
-    session.sendRequest(request);
+    _jailedFilePath = Poco::Path(getLocalRootPath(), _fileInfo._filename).toString();
+    withWopiSession(uriObject, [this, &url](Poco::Net::HTTPClientSession& session)
+        {
+            Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, url, Poco::Net::HTTPMessage::HTTP_1_1);
+            request.set("User-Agent", "LOOLWSD WOPI Agent");
+            session.sendRequest(request);
 
-    Poco::Net::HTTPResponse response;
-    std::istream& rs = session.receiveResponse(response);
+            Poco::Net::HTTPResponse response;
+            std::istream& rs = session.receiveResponse(response);
 
-    auto logger = Log::trace();
-    logger << "WOPI::GetFile header for URI [" << _uri << "]:\n";
-    for (auto& pair : response)
-    {
-        logger << '\t' + pair.first + ": " + pair.second << " / ";
-    }
+            auto logger = Log::trace();
+            logger << "WOPI::GetFile header for URI [" << _uri << "]:\n";
+            for (auto& pair : response)
+            {
+                logger << '\t' + pair.first + ": " + pair.second << " / ";
+            }
 
-    logger << Log::end;
+            logger << Log::end;
 
-    _jailedFilePath = Poco::Path(getLocalRootPath(), _fileInfo._filename).toString();
-    std::ofstream ofs(_jailedFilePath);
-    std::copy(std::istreambuf_iterator<char>(rs),
-              std::istreambuf_iterator<char>(),
-              std::ostreambuf_iterator<char>(ofs));
-    const auto size = getFileSize(_jailedFilePath);
+            if (response.getStatus() != Poco::Net::HTTPResponse::HTTP_OK)
+            {
+                Log::error() << "WOPI::GetFile failed for [" << _uri << "]: "
+                             << response.getStatus() << " " << response.getReason() << Log::end;
+                throw std::runtime_error("Failed to load file from storage.");
+            }
+
+            // Straight into the jail, as it comes.
+            const auto total = (response.getContentLength() != Poco::Net::HTTPMessage::UNKNOWN_CONTENT_LENGTH
+                                ? static_cast<size_t>(response.getContentLength()) : _fileInfo._size);
+            std::ofstream ofs(_jailedFilePath, std::ios::binary);
+            const auto size = transfer(rs, ofs, total, "download");
+            if (!ofs || (response.getContentLength() != Poco::Net::HTTPMessage::UNKNOWN_CONTENT_LENGTH && size != total))
+            {
+                Log::error() << "WOPI::GetFile downloaded " << size << " of " << total << " bytes from [" << _uri
+                             << "] -> " << _jailedFilePath << Log::end;
+                throw std::runtime_error("Failed to load file from storage.");
+            }
 
-    Log::info() << "WOPI::GetFile downloaded " << size << " bytes from [" << _uri
-                << "] -> " << _jailedFilePath << ": "
-                << response.getStatus() << " " << response.getReason() << Log::end;
+            Log::info() << "WOPI::GetFile downloaded " << size << " bytes from [" << _uri
+                        << "] -> " << _jailedFilePath << ": "
+                        << response.getStatus() << " " << response.getReason() << Log::end;
+            return true;
+        });
 
     // Now return the jailed path.
     return Poco::Path(_jailPath, _fileInfo._filename).toString();
@@ -348,34 +599,51 @@ bool WopiStorage::saveLocalFileToStorage()
     const auto url = uriObject.getPath() + "/contents?" + uriObject.getQuery();
     Log::debug("Wopi posting: " + url);
 
-#if ENABLE_SSL
-    Poco::Net::HTTPSClientSession session(uriObject.getHost(), uriObject.getPort(), Poco::Net::SSLManager::instance().defaultClientContext());
-#else
-    Poco::Net::HTTPClientSession session(uriObject.getHost(), uriObject.getPort());
-#endif
-    Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, url, Poco::Net::HTTPMessage::HTTP_1_1);
-    request.set("X-WOPIOverride", "PUT");
-    request.setContentType("application/octet-stream");
-    request.setContentLength(size);
-
-    std::ostream& os = session.sendRequest(request);
-    std::ifstream ifs(_jailedFilePath);
-    Poco::StreamCopier::copyStream(ifs, os);
-
-    Poco::Net::HTTPResponse response;
-    std::istream& rs = session.receiveResponse(response);
-    std::ostringstream oss;
-    Poco::StreamCopier::copyStream(rs, oss);
-
-    Log::info("WOPI::PutFile response: " + oss.str());
-    const auto success = (response.getStatus() == Poco::Net::HTTPResponse::HTTP_OK);
-    Log::info() << "WOPI::PutFile uploaded " << size << " bytes from [" << _jailedFilePath  << "]:"
-                << "] -> [" << _uri << "]: "
-                <<  response.getStatus() << " " << response.getReason() << Log::end;
+    bool success = false;
+    withWopiSession(uriObject, [this, &url, size, &success](Poco::Net::HTTPClientSession& session)
+        {
+            Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, url, Poco::Net::HTTPMessage::HTTP_1_1);
+            request.set("X-WOPIOverride", "PUT");
+            request.setContentType("application/octet-stream");
+            request.setContentLength(size);
+
+            std::ostream& os = session.sendRequest(request);
+            std::ifstream ifs(_jailedFilePath, std::ios::binary);
+            if (transfer(ifs, os, size, "upload") != size)
+            {
+                Log::error("WOPI::PutFile failed to send [" + _jailedFilePath + "] to [" + _uri + "].");
+                success = false;
+                return false;
+            }
+
+            Poco::Net::HTTPResponse response;
+            std::istream& rs = session.receiveResponse(response);
+            std::ostringstream oss;
+            Poco::StreamCopier::copyStream(rs, oss);
+
+            Log::info("WOPI::PutFile response: " + oss.str());
+            success = (response.getStatus() == Poco::Net::HTTPResponse::HTTP_OK);
+            Log::info() << "WOPI::PutFile uploaded " << size << " bytes from [" << _jailedFilePath  << "]:"
+                        << "] -> [" << _uri << "]: "
+                        <<  response.getStatus() << " " << response.getReason() << Log::end;
+            return true;
+        });
+
+    if (success)
+    {
+        // The size changed, at least.
+        getWopiFileInfos().erase(Poco::URI(_uri).toString());
+    }
 
     return success;
 }
 
+std::string WopiStorage::getStats()
+{
+    return "pool " + getWopiSessions().getStats() +
+           " fileinfo " + getWopiFileInfos().getStats();
+}
+
 //////////////////////
 // WebDAVStorage Impl
 ///////////////////////
@@ -11,6 +11,8 @@
 #ifndef INCLUDED_STORAGE_HPP
 #define INCLUDED_STORAGE_HPP
 
+#include <functional>
+#include <iosfwd>
 #include <string>
 #include <set>
 
@@ -51,10 +53,17 @@ public:
         Log::debug("Storage ctor: " + uri);
     }
 
+    /// Called as the file is streamed, with "download" or "upload",
+    /// the bytes transferred so far and the total.
+    typedef std::function<void(const std::string& operation, size_t done, size_t total)> ProgressHandler;
+
     std::string getLocalRootPath() const;
 
     const std::string& getUri() const { return _uri; }
 
+    /// Reports the progress of the transfers, at each percent.
+    void setProgressHandler(const ProgressHandler& handler) { _progressHandler = handler; }
+
     /// Returns information about the file.
     virtual FileInfo getFileInfo(const Poco::URI& uri) = 0;
 
@@ -79,12 +88,18 @@ public:
                                                const std::string& jailPath,
                                                const Poco::URI& uri);
 
+protected:
+    /// Streams in to out through a fixed-size buffer, reporting the progress
+    /// if total is known. Returns the number of bytes copied.
+    size_t transfer(std::istream& in, std::ostream& out, size_t total, const std::string& operation);
+
 protected:
     const std::string _localStorePath;
     const std::string _jailPath;
     const std::string _uri;
     std::string _jailedFilePath;
     FileInfo _fileInfo;
+    ProgressHandler _progressHandler;
 
     static bool FilesystemEnabled;
     static bool WopiEnabled;
@@ -135,6 +150,9 @@ public:
     std::string loadStorageFileToLocal() override;
 
     bool saveLocalFileToStorage() override;
+
+    /// Of the sessions to the WOPI hosts and the CheckFileInfo cache, for the admin console.
+    static std::string getStats();
 };
 
 class WebDAVStorage : public StorageBase
@@ -0,0 +1,145 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TASKPOOL_HPP
+#define INCLUDED_TASKPOOL_HPP
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Log.hpp"
+#include "Util.hpp"
+
+/// A fixed set of worker threads that run batches of independent tasks.
+/// The thread submitting a batch works on it too, and returns once all
+/// of its tasks are done. Batches are run one at a time.
+class TaskPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    /// threads is the number of threads working on a batch, the caller included.
+    TaskPool(const std::string& name, const size_t threads) :
+        _tasks(nullptr),
+        _next(0),
+        _pending(0),
+        _stop(false)
+    {
+        for (size_t i = 1; i < threads; ++i)
+        {
+            _workers.emplace_back([this, name]()
+                {
+                    Util::setThreadName(name);
+                    work();
+                });
+        }
+    }
+
+    ~TaskPool()
+    {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _stop = true;
+        }
+
+        _cvWork.notify_all();
+        for (auto& worker : _workers)
+        {
+            worker.join();
+        }
+    }
+
+    TaskPool(const TaskPool&) = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+
+    size_t getThreadCount() const { return _workers.size() + 1; }
+
+    /// Runs all the tasks and waits for them to finish.
+    void run(const std::vector<Task>& tasks)
+    {
+        std::unique_lock<std::mutex> batchLock(_batchMutex);
+        std::unique_lock<std::mutex> lock(_mutex);
+
+        _tasks = &tasks;
+        _next = 0;
+        _pending = tasks.size();
+        _cvWork.notify_all();
+
+        while (_next < tasks.size())
+        {
+            runNext(lock);
+        }
+
+        _cvDone.wait(lock, [this]() { return _pending == 0; });
+        _tasks = nullptr;
+    }
+
+private:
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (;;)
+        {
+            _cvWork.wait(lock, [this]() { return _stop || (_tasks && _next < _tasks->size()); });
+            if (_stop)
+            {
+                return;
+            }
+
+            runNext(lock);
+        }
+    }
+
+    /// Runs the next task of the batch, without holding the lock.
+    void runNext(std::unique_lock<std::mutex>& lock)
+    {
+        const Task& task = (*_tasks)[_next++];
+
+        lock.unlock();
+        try
+        {
+            task();
+        }
+        catch (const std::exception& exc)
+        {
+            Log::error() << "TaskPool: Exception: " << exc.what() << Log::end;
+        }
+
+        lock.lock();
+
+        if (--_pending == 0)
+        {
+            _cvDone.notify_all();
+        }
+    }
+
+private:
+    std::vector<std::thread> _workers;
+
+    /// Serializes the batches.
+    std::mutex _batchMutex;
+
+    /// Guards the batch state below.
+    std::mutex _mutex;
+    std::condition_variable _cvWork;
+    std::condition_variable _cvDone;
+    const std::vector<Task>* _tasks;
+    size_t _next;
+    size_t _pending;
+    bool _stop;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
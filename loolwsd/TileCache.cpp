@@ -10,11 +10,14 @@
 #include "TileCache.hpp"
 #include "config.h"
 
+#include <algorithm>
 #include <cassert>
 #include <climits>
 #include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <sstream>
@@ -22,32 +25,62 @@
 #include <vector>
 
 #include <Poco/DigestEngine.h>
-#include <Poco/DirectoryIterator.h>
 #include <Poco/Exception.h>
 #include <Poco/File.h>
 #include <Poco/Path.h>
-#include <Poco/StringTokenizer.h>
 #include <Poco/Timestamp.h>
 #include <Poco/URI.h>
 
 #include "ClientSession.hpp"
 #include "Common.hpp"
+#include "IoUtil.hpp"
 #include "LOOLProtocol.hpp"
+#include "Metrics.hpp"
+#include "Png.hpp"
+#include "Startup.hpp"
+#include "Trace.hpp"
 #include "Unit.hpp"
 #include "Util.hpp"
 
-using Poco::DirectoryIterator;
 using Poco::File;
-using Poco::StringTokenizer;
 using Poco::Timestamp;
 
 using namespace LOOLProtocol;
 
+namespace
+{
+    Histogram& TileLatency = Metrics::instance().histogram("loolwsd_tile_latency_seconds",
+                                                           "From sending a tile request to the kit until the tile is back.");
+    std::atomic<uint64_t>& TilePlaceholders = Metrics::instance().counter("loolwsd_tile_placeholders_total",
+                                                                          "Tiles sent scaled from another zoom, until rendered.");
+    std::atomic<uint64_t>& TilePreviews = Metrics::instance().counter("loolwsd_tile_previews_total",
+                                                                      "Tiles sent rendered at a lower resolution, until rendered in full.");
+    std::atomic<uint64_t>& TilesCancelled = Metrics::instance().counter("loolwsd_tiles_cancelled_total",
+                                                                        "Tiles being rendered no client waited for anymore.");
+}
+
+std::atomic<uint64_t> TileCache::MemoryCacheHits(0);
+std::atomic<uint64_t> TileCache::MemoryCacheMisses(0);
+std::atomic<uint64_t> TileCache::MemoryCacheTotalSize(0);
+std::mutex TileCache::SharedSolidTilesMutex;
+std::unordered_map<std::string, TileCache::Tile> TileCache::SharedSolidTiles;
+
 TileCache::TileCache(const std::string& docURL,
                      const Timestamp& modifiedTime,
-                     const std::string& cacheDir) :
+                     const std::string& cacheDir,
+                     const size_t memoryCacheLimit,
+                     const std::string& storeType,
+                     const int recompressionLevel,
+                     const std::string& blobsDir) :
     _docURL(docURL),
-    _cacheDir(cacheDir)
+    _cacheDir(cacheDir),
+    _storeType(storeType),
+    _blobsDir(blobsDir),
+    _memoryCacheSize(0),
+    _memoryCacheLimit(memoryCacheLimit),
+    _stopRecompression(false),
+    _recompressionLevel(recompressionLevel),
+    _recompressor(std::make_shared<Recompressor>())
 {
     Log::info() << "TileCache ctor for uri [" << _docURL
                 << "] modifiedTime=" << (modifiedTime.raw()/1000000)
@@ -65,26 +98,60 @@ TileCache::TileCache(const std::string& docURL,
     File(_cacheDir).createDirectories();
 
     saveLastModified(modifiedTime);
+
+    _recompressor->_tileCache = this;
 }
 
 TileCache::~TileCache()
 {
+    {
+        // Waits for the tile being recompressed, if any.
+        std::unique_lock<std::mutex> recompressorLock(_recompressor->_mutex);
+        _recompressor->_tileCache = nullptr;
+    }
+
+    {
+        std::unique_lock<std::mutex> lock(_cacheMutex);
+
+        // Don't lose what is left.
+        for (const auto& pending : _pendingTiles)
+        {
+            _tileStore->save(pending.first, pending.second->data(), pending.second->size());
+        }
+
+        _pendingTiles.clear();
+        _pendingQueue.clear();
+        _stopRecompression = true;
+    }
+
+    _pendingCV.notify_all();
+
+    saveManifest();
+
+    MemoryCacheTotalSize -= _memoryCacheSize;
     Log::info("~TileCache dtor for uri [" + _docURL + "].");
 }
 
 struct TileCache::TileBeingRendered
 {
     std::vector<std::weak_ptr<ClientSession>> _subscribers;
-    TileBeingRendered(const std::string& cachedName, const int version)
+    TileBeingRendered(const std::string& cachedName, const TileDesc& tile)
      : _startTime(std::chrono::steady_clock::now()),
        _cachedName(cachedName),
-       _ver(version)
+       _tile(tile),
+       _ver(tile.getVersion()),
+       _renderedAhead(false)
     {
     }
 
     const std::string& getCacheName() const { return _cachedName; }
+    const TileDesc& getTile() const { return _tile; }
     int getVersion() const { return _ver; }
 
+    /// Registered for no one, ahead of need: no session may cancel it.
+    bool isRenderedAhead() const { return _renderedAhead; }
+    void setRenderedAhead() { _renderedAhead = true; }
+
     std::chrono::steady_clock::time_point getStartTime() const { return _startTime; }
     double getElapsedTimeMs() const { return std::chrono::duration_cast<std::chrono::milliseconds>
                                               (std::chrono::steady_clock::now() - _startTime).count(); }
@@ -96,7 +163,9 @@ struct TileCache::TileBeingRendered
 private:
     std::chrono::steady_clock::time_point _startTime;
     std::string _cachedName;
+    TileDesc _tile;
     int _ver;
+    bool _renderedAhead;
 };
 
 std::shared_ptr<TileCache::TileBeingRendered> TileCache::findTileBeingRendered(const TileDesc& tileDesc)
@@ -115,31 +184,135 @@ void TileCache::forgetTileBeingRendered(const TileDesc& tile)
 
     Util::assertIsLocked(_tilesBeingRenderedMutex);
 
-    assert(_tilesBeingRendered.find(cachedName) != _tilesBeingRendered.end());
+    // The kit may decline a stale duplicate of a request already rendered.
     _tilesBeingRendered.erase(cachedName);
+    _tileDeltas.erase(cachedName);
 }
 
-std::unique_ptr<std::fstream> TileCache::lookupTile(const TileDesc& tile)
+std::vector<int> TileCache::cancelTiles(const std::shared_ptr<ClientSession>& subscriber,
+                                        const std::function<bool(const TileDesc&)>& isObsolete)
 {
-    const std::string fileName = _cacheDir + "/" + cacheFileName(tile);
+    std::unique_lock<std::mutex> lock(_tilesBeingRenderedMutex);
 
-    std::unique_ptr<std::fstream> result(new std::fstream(fileName, std::ios::in));
-    UnitWSD::get().lookupTile(tile.getPart(), tile.getWidth(), tile.getHeight(),
-                              tile.getTilePosX(), tile.getTilePosY(),
-                              tile.getTileWidth(), tile.getTileHeight(), result);
+    // A version is a request to the kit, still worth rendering
+    // while any of its tiles is waited for.
+    std::map<int, bool> waited;
+    for (const auto& it : _tilesBeingRendered)
+    {
+        TileBeingRendered& tileBeingRendered = *it.second;
+        const TileDesc& tile = tileBeingRendered.getTile();
+        auto& subscribers = tileBeingRendered._subscribers;
+        if (tile.getId() < 0 && isObsolete(tile))
+        {
+            subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(),
+                                             [&subscriber](const std::weak_ptr<ClientSession>& s)
+                                             {
+                                                 return s.lock() == subscriber;
+                                             }),
+                              subscribers.end());
+        }
+
+        bool& isWaited = waited[tileBeingRendered.getVersion()];
+        isWaited = isWaited || tile.getId() >= 0 || tileBeingRendered.isRenderedAhead() ||
+                   std::any_of(subscribers.begin(), subscribers.end(),
+                               [](const std::weak_ptr<ClientSession>& s) { return !s.expired(); });
+    }
 
-    if (result && result->is_open())
+    size_t cancelled = 0;
+    for (auto it = _tilesBeingRendered.begin(); it != _tilesBeingRendered.end(); )
     {
-        Log::trace("Found cache tile: " + fileName);
-        return result;
+        if (!waited[it->second->getVersion()])
+        {
+            _tileDeltas.erase(it->first);
+            it = _tilesBeingRendered.erase(it);
+            ++cancelled;
+        }
+        else
+        {
+            ++it;
+        }
     }
 
-    return nullptr;
+    std::vector<int> versions;
+    for (const auto& it : waited)
+    {
+        if (!it.second)
+        {
+            versions.push_back(it.first);
+        }
+    }
+
+    if (cancelled > 0)
+    {
+        TilesCancelled += cancelled;
+        Log::debug() << "STATISTICS: cancelled " << cancelled << " tiles being rendered, in "
+                     << versions.size() << " requests, " << TilesCancelled << " so far." << Log::end;
+    }
+
+    return versions;
+}
+
+bool TileCache::hasTile(const TileDesc& tile)
+{
+    const std::string cachedName = cacheFileName(tile);
+
+    std::unique_lock<std::mutex> lock(_cacheMutex);
+    ensureIndexed();
+    return _tileIndex.contains(cachedName);
+}
+
+TileCache::Tile TileCache::lookupTile(const TileDesc& tile)
+{
+    const std::string cachedName = cacheFileName(tile);
+
+    std::unique_lock<std::mutex> lock(_cacheMutex);
+    ensureIndexed();
+
+    Tile result;
+    const auto solidIt = _solidTiles.find(cachedName);
+    const auto it = _memoryCacheIndex.find(cachedName);
+    if (solidIt != _solidTiles.end())
+    {
+        result = solidIt->second;
+        ++MemoryCacheHits;
+    }
+    else if (it != _memoryCacheIndex.end())
+    {
+        // Move to the front as the most-recently used.
+        _memoryCache.splice(_memoryCache.begin(), _memoryCache, it->second);
+        result = it->second->second;
+        ++MemoryCacheHits;
+    }
+    else
+    {
+        const auto pendingIt = _pendingTiles.find(cachedName);
+        result = (pendingIt != _pendingTiles.end() ? pendingIt->second : _tileStore->load(cachedName));
+        if (result)
+        {
+            if (Log::traceEnabled())
+            {
+                Log::trace("Found cache tile: " + cachedName);
+            }
+
+            addToMemoryCache(cachedName, result);
+        }
+
+        ++MemoryCacheMisses;
+    }
+
+    UnitWSD::get().lookupTile(tile.getPart(), tile.getWidth(), tile.getHeight(),
+                              tile.getTilePosX(), tile.getTilePosY(),
+                              tile.getTileWidth(), tile.getTileHeight(), result);
+
+    return result;
 }
 
 void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const size_t size, const bool priority)
 {
+    // Same lock order as invalidateTiles.
+    std::unique_lock<std::mutex> cacheLock(_cacheMutex);
     std::unique_lock<std::mutex> lock(_tilesBeingRenderedMutex);
+    ensureIndexed();
 
     std::shared_ptr<TileBeingRendered> tileBeingRendered = findTileBeingRendered(tile);
     if (!priority && tileBeingRendered && tileBeingRendered->getVersion() != tile.getVersion())
@@ -149,45 +322,362 @@ void TileCache::saveTileAndNotify(const TileDesc& tile, const char *data, const
         return;
     }
 
-    // Save to disk.
     const auto cachedName = (tileBeingRendered ? tileBeingRendered->getCacheName()
                                                : cacheFileName(tile));
-    const auto fileName = _cacheDir + "/" + cachedName;
-    Log::trace() << "Saving cache tile: " << fileName << Log::end;
-    std::fstream outStream(fileName, std::ios::out);
-    outStream.write(data, size);
-    outStream.close();
+    _renderVersions[cachedName] = tile.getVersion();
+
+    std::unique_ptr<TileDelta> delta;
+    const auto deltaIt = _tileDeltas.find(cachedName);
+    if (deltaIt != _tileDeltas.end())
+    {
+        if (deltaIt->second.version == tile.getVersion())
+        {
+            delta.reset(new TileDelta(std::move(deltaIt->second)));
+        }
+
+        _tileDeltas.erase(deltaIt);
+    }
+
+    if (tile.isSolid())
+    {
+        Log::trace() << "Saving solid tile: " << cachedName << Log::end;
+        if (_solidTiles.find(cachedName) == _solidTiles.end() && _tileIndex.contains(cachedName))
+        {
+            // Replaces a stored one.
+            _tileStore->remove(cachedName);
+            _pendingTiles.erase(cachedName);
+            removeFromMemoryCache(cachedName);
+        }
+
+        _solidTiles[cachedName] = getSharedSolidTile(data, size);
+        _tileIndex.insert(cachedName, tile.getPart(), tile.getTilePosX(), tile.getTilePosY(),
+                          tile.getTileWidth(), tile.getTileHeight());
+    }
+    else
+    {
+        Log::trace() << "Saving cache tile: " << cachedName << Log::end;
+        _solidTiles.erase(cachedName);
+
+        const auto cachedTile = std::make_shared<std::vector<char>>(data, data + size);
+        if (_recompressionLevel >= 0 &&
+            (_pendingTiles.size() < MaxPendingTiles || _pendingTiles.count(cachedName)))
+        {
+            // Stored once recompressed.
+            const auto pending = _pendingTiles.emplace(cachedName, cachedTile);
+            if (pending.second)
+            {
+                _pendingQueue.push_back(cachedName);
+
+                // One task per tile queued.
+                const auto recompressor = _recompressor;
+                getRecompressionQueue().post([recompressor]()
+                    {
+                        std::unique_lock<std::mutex> recompressorLock(recompressor->_mutex);
+                        if (recompressor->_tileCache)
+                        {
+                            recompressor->_tileCache->recompressNextTile();
+                        }
+                    });
+            }
+            else
+            {
+                pending.first->second = cachedTile;
+            }
+        }
+        else
+        {
+            _tileStore->save(cachedName, data, size);
+        }
+
+        _tileIndex.insert(cachedName, tile.getPart(), tile.getTilePosX(), tile.getTilePosY(),
+                          tile.getTileWidth(), tile.getTileHeight());
+        addToMemoryCache(cachedName, cachedTile);
+    }
 
     // Notify subscribers, if any.
+    std::vector<std::shared_ptr<ClientSession>> subscribers;
     if (tileBeingRendered)
     {
-        if (!tileBeingRendered->_subscribers.empty())
+        for (const auto& i: tileBeingRendered->_subscribers)
         {
-            const std::string message = tile.serialize("tile");
-            Log::debug("Sending tile message to subscribers: " + message);
-
-            for (const auto& i: tileBeingRendered->_subscribers)
+            auto subscriber = i.lock();
+            if (subscriber)
             {
-                auto subscriber = i.lock();
-                if (subscriber)
-                {
-                    //FIXME: This is inefficient; should just send directly to each client (although that is risky as well!
-                    // Re-emit the tile command in the other thread(s) to re-check and hit
-                    // the cache. Construct the message from scratch to contain only the
-                    // mandatory parts of the message.
-                    subscriber->sendToInputQueue(message);
-                }
+                subscribers.push_back(subscriber);
             }
         }
 
         // Remove subscriptions.
         if (tileBeingRendered->getVersion() == tile.getVersion())
         {
+            const auto elapsedMs = tileBeingRendered->getElapsedTimeMs();
+            TileLatency.observe(elapsedMs);
             Log::debug() << "STATISTICS: tile internal roundtrip "
-                         << tileBeingRendered->getElapsedTimeMs() << " ms." << Log::end;
+                         << elapsedMs << " ms." << Log::end;
             _tilesBeingRendered.erase(cachedName);
         }
     }
+
+    // Don't block the cache on slow clients.
+    lock.unlock();
+    cacheLock.unlock();
+
+    if (!subscribers.empty())
+    {
+        // Send the rendered tile to all the subscribers from the same
+        // buffer, rather than have each re-request it from the cache.
+        const std::string response = tile.serialize("tile:") + "\n";
+        Log::debug() << "Sending tile to " << subscribers.size() << " subscribers: " << response << Log::end;
+
+        for (const auto& subscriber : subscribers)
+        {
+            // The delta only applies to what the subscriber has.
+            if (delta && subscriber->canReceiveTileDeltas() &&
+                subscriber->getTileVersion(cachedName) == delta->baseVersion)
+            {
+                subscriber->sendBinaryFrame(delta->message.data(), delta->message.size());
+            }
+            else
+            {
+                subscriber->sendBinaryFrame({ IoUtil::getBuffer(response.data(), response.size()),
+                                              IoUtil::getBuffer(data, size) });
+            }
+
+            subscriber->setTileVersion(cachedName, tile.getVersion(), tile.getVersion());
+        }
+
+        Trace::record(tile.getTraceId(), Trace::Stage::ClientSent);
+        if (Startup::record(Startup::Phase::FirstTileSent))
+        {
+            const auto report = Startup::getReport();
+            Log::info("Startup phases: " + report);
+            UnitWSD::get().onStartupReport(report);
+        }
+    }
+}
+
+void TileCache::saveTileDelta(const TileDesc& tile, const int baseVersion, const char *data, const size_t size)
+{
+    const std::string cachedName = cacheFileName(tile);
+
+    std::unique_lock<std::mutex> lock(_tilesBeingRenderedMutex);
+
+    // Only worth keeping while rendering.
+    if (_tilesBeingRendered.find(cachedName) != _tilesBeingRendered.end())
+    {
+        TileDelta& delta = _tileDeltas[cachedName];
+        delta.version = tile.getVersion();
+        delta.baseVersion = baseVersion;
+        delta.message.assign(data, data + size);
+    }
+}
+
+size_t TileCache::notifyPreview(const TileDesc& tile, const char *data, const size_t size)
+{
+    std::vector<std::shared_ptr<ClientSession>> subscribers;
+    {
+        std::unique_lock<std::mutex> lock(_tilesBeingRenderedMutex);
+        const auto tileBeingRendered = findTileBeingRendered(tile);
+        if (!tileBeingRendered || tileBeingRendered->getVersion() != tile.getVersion())
+        {
+            // Rendered in full already, or to be again.
+            return 0;
+        }
+
+        for (const auto& i : tileBeingRendered->_subscribers)
+        {
+            auto subscriber = i.lock();
+            if (subscriber)
+            {
+                subscribers.push_back(subscriber);
+            }
+        }
+    }
+
+    // Older than any render, as the placeholders, for the client to replace it.
+    TileDesc preview(tile);
+    preview.setVersion(0);
+    preview.setImgSize(size);
+    const std::string response = preview.serialize("tile:") + "\n";
+    const std::string cachedName = cacheFileName(tile);
+    for (const auto& subscriber : subscribers)
+    {
+        // Nor the base of a delta: the render is to be sent whole over it.
+        subscriber->resetTileVersion(cachedName);
+        subscriber->sendBinaryFrame({ IoUtil::getBuffer(response.data(), response.size()),
+                                      IoUtil::getBuffer(data, size) });
+    }
+
+    TilePreviews += subscribers.size();
+    return subscribers.size();
+}
+
+constexpr size_t TileCache::MaxPlaceholderSources;
+
+TileCache::Tile TileCache::findTile(const std::string& cachedName)
+{
+    Util::assertIsLocked(_cacheMutex);
+
+    const auto solidIt = _solidTiles.find(cachedName);
+    if (solidIt != _solidTiles.end())
+    {
+        return solidIt->second;
+    }
+
+    const auto it = _memoryCacheIndex.find(cachedName);
+    if (it != _memoryCacheIndex.end())
+    {
+        return it->second->second;
+    }
+
+    const auto pendingIt = _pendingTiles.find(cachedName);
+    return (pendingIt != _pendingTiles.end() ? pendingIt->second : _tileStore->load(cachedName));
+}
+
+std::vector<TileCache::Tile> TileCache::getPlaceholders(const std::vector<TileDesc>& tiles)
+{
+    // The cached tiles over the area of each, at a single other zoom.
+    std::vector<std::vector<std::pair<TileDesc, Tile>>> sources(tiles.size());
+    {
+        std::unique_lock<std::mutex> lock(_cacheMutex);
+        ensureIndexed();
+        for (size_t i = 0; i < tiles.size(); ++i)
+        {
+            const TileDesc& tile = tiles[i];
+
+            // By twips per pixel.
+            std::map<double, std::vector<std::string>> zooms;
+            for (const auto& cachedName : _tileIndex.intersecting(tile.getPart(), tile.getTilePosX(), tile.getTilePosY(),
+                                                                  tile.getTileWidth(), tile.getTileHeight()))
+            {
+                int part, width, height, tilePosX, tilePosY, tileWidth, tileHeight;
+                if (parseCacheFileName(cachedName, part, width, height, tilePosX, tilePosY, tileWidth, tileHeight) &&
+                    width > 0 && height > 0 && tileWidth > 0 && tileHeight > 0)
+                {
+                    zooms[static_cast<double>(tileWidth) / width].push_back(cachedName);
+                }
+            }
+
+            const double scale = static_cast<double>(tile.getTileWidth()) / tile.getWidth();
+            const std::vector<std::string>* closest = nullptr;
+            double closestRatio = 0;
+            for (const auto& zoom : zooms)
+            {
+                const double ratio = std::max(zoom.first / scale, scale / zoom.first);
+                if (ratio > 1.001 && (!closest || ratio < closestRatio))
+                {
+                    closest = &zoom.second;
+                    closestRatio = ratio;
+                }
+            }
+
+            if (!closest || closest->size() > MaxPlaceholderSources)
+            {
+                continue;
+            }
+
+            for (const auto& cachedName : *closest)
+            {
+                int part, width, height, tilePosX, tilePosY, tileWidth, tileHeight;
+                parseCacheFileName(cachedName, part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
+                const Tile data = findTile(cachedName);
+                if (data)
+                {
+                    sources[i].emplace_back(TileDesc(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight), data);
+                }
+            }
+        }
+    }
+
+    // Neighbouring tiles share their sources, decoded once.
+    struct Image
+    {
+        std::vector<unsigned char> pixmap;
+        int width = 0;
+        int height = 0;
+    };
+    std::map<const std::vector<char>*, Image> images;
+
+    png::EncodeOptions options;
+    options.compressionLevel = 1;
+
+    std::vector<Tile> placeholders(tiles.size());
+    for (size_t i = 0; i < tiles.size(); ++i)
+    {
+        const TileDesc& tile = tiles[i];
+        const int width = tile.getWidth();
+        const int height = tile.getHeight();
+        std::vector<unsigned char> pixmap;
+        std::vector<int> columns(width);
+        for (const auto& source : sources[i])
+        {
+            const TileDesc& sourceTile = source.first;
+            auto it = images.find(source.second.get());
+            if (it == images.end())
+            {
+                Image image;
+                png::decodePNG(source.second->data(), source.second->size(), image.pixmap, image.width, image.height);
+                it = images.emplace(source.second.get(), std::move(image)).first;
+            }
+
+            const Image& image = it->second;
+            if (image.pixmap.empty())
+            {
+                continue;
+            }
+
+            if (pixmap.empty())
+            {
+                pixmap.assign(4 * width * height, 0xff);
+            }
+
+            // The nearest pixel of the source to the middle of each of ours, -1 outside.
+            for (int x = 0; x < width; ++x)
+            {
+                const int64_t twipX = tile.getTilePosX() + (2 * int64_t(x) + 1) * tile.getTileWidth() / (2 * width) - sourceTile.getTilePosX();
+                columns[x] = (twipX >= 0 && twipX < sourceTile.getTileWidth() ? twipX * image.width / sourceTile.getTileWidth() : -1);
+            }
+
+            for (int y = 0; y < height; ++y)
+            {
+                const int64_t twipY = tile.getTilePosY() + (2 * int64_t(y) + 1) * tile.getTileHeight() / (2 * height) - sourceTile.getTilePosY();
+                if (twipY < 0 || twipY >= sourceTile.getTileHeight())
+                {
+                    continue;
+                }
+
+                const unsigned char* sourceRow = &image.pixmap[4 * (twipY * image.height / sourceTile.getTileHeight()) * image.width];
+                unsigned char* row = &pixmap[4 * y * width];
+                for (int x = 0; x < width; ++x)
+                {
+                    if (columns[x] >= 0)
+                    {
+                        std::memcpy(row + 4 * x, sourceRow + 4 * columns[x], 4);
+                    }
+                }
+            }
+        }
+
+        auto output = std::make_shared<std::vector<char>>();
+        if (!pixmap.empty() &&
+            png::encodeBufferToPNG(pixmap.data(), width, height, *output, LOK_TILEMODE_RGBA, options))
+        {
+            placeholders[i] = output;
+            ++TilePlaceholders;
+        }
+    }
+
+    return placeholders;
+}
+
+int TileCache::getRenderVersion(const TileDesc& tile)
+{
+    const std::string cachedName = cacheFileName(tile);
+
+    std::unique_lock<std::mutex> lock(_cacheMutex);
+    ensureIndexed();
+    const auto it = _renderVersions.find(cachedName);
+    return (it != _renderVersions.end() ? it->second : -1);
 }
 
 std::string TileCache::getTextFile(const std::string& fileName)
@@ -274,28 +764,36 @@ std::unique_ptr<std::fstream> TileCache::lookupRendering(const std::string& name
     return nullptr;
 }
 
-void TileCache::invalidateTiles(int part, int x, int y, int width, int height)
+void TileCache::invalidateTiles(const std::vector<TileInvalidation::Area>& areas)
 {
-    Log::trace() << "Removing invalidated tiles: part: " << part
-                 << ", x: " << x << ", y: " << y
-                 << ", width: " << width
-                 << ", height: " << height << Log::end;
-
-    File dir(_cacheDir);
+    if (areas.empty())
+    {
+        return;
+    }
 
     std::unique_lock<std::mutex> lock(_cacheMutex);
     std::unique_lock<std::mutex> lockSubscribers(_tilesBeingRenderedMutex);
+    ensureIndexed();
 
-    if (dir.exists() && dir.isDirectory())
+    for (const auto& area : areas)
     {
-        for (auto tileIterator = DirectoryIterator(dir); tileIterator != DirectoryIterator(); ++tileIterator)
+        Log::trace() << "Removing invalidated tiles: part: " << area._part
+                     << ", x: " << area._x << ", y: " << area._y
+                     << ", width: " << area._width
+                     << ", height: " << area._height << Log::end;
+
+        for (const auto& cachedName : _tileIndex.intersecting(area._part, area._x, area._y, area._width, area._height))
         {
-            const std::string fileName = tileIterator.path().getFileName();
-            if (intersectsTile(fileName, part, x, y, width, height))
+            Log::debug("Removing tile: " + cachedName);
+            if (_solidTiles.erase(cachedName) == 0)
             {
-                Log::debug("Removing tile: " + tileIterator.path().toString());
-                Util::removeFile(tileIterator.path());
+                _tileStore->remove(cachedName);
+                _pendingTiles.erase(cachedName);
             }
+
+            removeFromMemoryCache(cachedName);
+            _renderVersions.erase(cachedName);
+            _tileIndex.remove(cachedName);
         }
     }
 
@@ -303,9 +801,15 @@ void TileCache::invalidateTiles(int part, int x, int y, int width, int height)
     for (auto it = _tilesBeingRendered.begin(); it != _tilesBeingRendered.end(); )
     {
         const std::string cachedName = it->first;
-        if (intersectsTile(cachedName, part, x, y, width, height))
+        const auto& tile = it->second->getTile();
+        if (std::any_of(areas.begin(), areas.end(),
+                        [&tile](const TileInvalidation::Area& area)
+                        {
+                            return intersectsTile(tile, area._part, area._x, area._y, area._width, area._height);
+                        }))
         {
             Log::debug("Removing subscriptions for: " + cachedName);
+            _tileDeltas.erase(cachedName);
             it = _tilesBeingRendered.erase(it);
         }
         else
@@ -317,30 +821,10 @@ void TileCache::invalidateTiles(int part, int x, int y, int width, int height)
 
 void TileCache::invalidateTiles(const std::string& tiles)
 {
-    StringTokenizer tokens(tiles, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
-
-    assert(tokens[0] == "invalidatetiles:");
+    assert(tiles.compare(0, 16, "invalidatetiles:") == 0);
 
-    if (tokens.count() == 2 && tokens[1] == "EMPTY")
-    {
-        invalidateTiles(-1, 0, 0, INT_MAX, INT_MAX);
-    }
-    else if (tokens.count() != 6)
-    {
-        return;
-    }
-    else
-    {
-        int part, x, y, width, height;
-        if (getTokenInteger(tokens[1], "part", part) &&
-            getTokenInteger(tokens[2], "x", x) &&
-            getTokenInteger(tokens[3], "y", y) &&
-            getTokenInteger(tokens[4], "width", width) &&
-            getTokenInteger(tokens[5], "height", height))
-        {
-            invalidateTiles(part, x, y, width, height);
-        }
-    }
+    // Those the kit merged come together, a line each.
+    invalidateTiles(TileInvalidation::parseAll(tiles));
 }
 
 void TileCache::removeFile(const std::string& fileName)
@@ -365,24 +849,139 @@ bool TileCache::parseCacheFileName(const std::string& fileName, int& part, int&
     return (std::sscanf(fileName.c_str(), "%d_%dx%d.%d,%d.%dx%d.png", &part, &width, &height, &tilePosX, &tilePosY, &tileWidth, &tileHeight) == 7);
 }
 
-bool TileCache::intersectsTile(const std::string& fileName, int part, int x, int y, int width, int height)
+bool TileCache::intersectsTile(const TileDesc& tile, int part, int x, int y, int width, int height)
+{
+    if (part != -1 && tile.getPart() != part)
+        return false;
+
+    const int left = std::max(x, tile.getTilePosX());
+    const int right = std::min(x + width, tile.getTilePosX() + tile.getTileWidth());
+    const int top = std::max(y, tile.getTilePosY());
+    const int bottom = std::min(y + height, tile.getTilePosY() + tile.getTileHeight());
+
+    return (left <= right && top <= bottom);
+}
+
+void TileCache::ensureIndexed()
+{
+    Util::assertIsLocked(_cacheMutex);
+
+    if (_tileStore)
+    {
+        return;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    _tileStore = TileStore::create(_storeType, _cacheDir, _blobsDir);
+    const bool fromManifest = loadManifest();
+    if (!fromManifest)
+    {
+        loadTileIndex();
+    }
+
+    Log::debug() << "Indexed " << _tileIndex.size() << " cached tiles in " << _cacheDir
+                 << (fromManifest ? " from the manifest" : " by listing them") << " in "
+                 << std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count()
+                 << " us." << Log::end;
+}
+
+void TileCache::loadTileIndex()
+{
+    Util::assertIsLocked(_cacheMutex);
+
+    for (const auto& name : _tileStore->list())
+    {
+        int part, width, height, tilePosX, tilePosY, tileWidth, tileHeight;
+        if (parseCacheFileName(name, part, width, height, tilePosX, tilePosY, tileWidth, tileHeight))
+        {
+            _tileIndex.insert(name, part, tilePosX, tilePosY, tileWidth, tileHeight);
+        }
+    }
+}
+
+bool TileCache::loadManifest()
+{
+    Util::assertIsLocked(_cacheMutex);
+
+    const std::string path = _cacheDir + "/manifest.txt";
+    std::ifstream manifest(path);
+    if (!manifest.is_open())
+    {
+        return false;
+    }
+
+    // Whatever it holds, it is stale once the tiles change: a session cut short
+    // leaves none behind, for the next to list the store instead.
+    std::string header;
+    std::getline(manifest, header);
+    std::remove(path.c_str());
+
+    std::ostringstream expected;
+    expected << "manifest version=" << ManifestVersion << " modtime=" << getLastModified().raw();
+    if (header != expected.str())
+    {
+        Log::info("Ignoring the tile cache manifest [" + header + "] of " + _cacheDir + ".");
+        return false;
+    }
+
+    std::string name;
+    int version = -1;
+    while (manifest >> name >> version)
+    {
+        int part, width, height, tilePosX, tilePosY, tileWidth, tileHeight;
+        if (parseCacheFileName(name, part, width, height, tilePosX, tilePosY, tileWidth, tileHeight))
+        {
+            _tileIndex.insert(name, part, tilePosX, tilePosY, tileWidth, tileHeight);
+            if (version >= 0)
+            {
+                _renderVersions[name] = version;
+            }
+        }
+    }
+
+    return true;
+}
+
+void TileCache::saveManifest()
 {
-    int tilePart, tilePixelWidth, tilePixelHeight, tilePosX, tilePosY, tileWidth, tileHeight;
-    if (parseCacheFileName(fileName, tilePart, tilePixelWidth, tilePixelHeight, tilePosX, tilePosY, tileWidth, tileHeight))
+    std::unique_lock<std::mutex> lock(_cacheMutex);
+
+    if (!_tileStore)
     {
-        if (part != -1 && tilePart != part)
-            return false;
+        // Never indexed, so the manifest, if any, is still good.
+        return;
+    }
 
-        const int left = std::max(x, tilePosX);
-        const int right = std::min(x + width, tilePosX + tileWidth);
-        const int top = std::max(y, tilePosY);
-        const int bottom = std::min(y + height, tilePosY + tileHeight);
+    const std::string path = _cacheDir + "/manifest.txt";
+    const std::string temp = path + ".new";
+    {
+        std::ofstream manifest(temp);
+        manifest << "manifest version=" << ManifestVersion << " modtime=" << getLastModified().raw() << '\n';
+        for (const auto& name : _tileIndex.getNames())
+        {
+            // The solid tiles are in memory only.
+            if (_solidTiles.find(name) == _solidTiles.end())
+            {
+                const auto it = _renderVersions.find(name);
+                manifest << name << ' ' << (it != _renderVersions.end() ? it->second : -1) << '\n';
+            }
+        }
 
-        if (left <= right && top <= bottom)
-            return true;
+        if (!manifest.good())
+        {
+            Log::error("Failed to write the tile cache manifest of " + _cacheDir + ".");
+            manifest.close();
+            std::remove(temp.c_str());
+            return;
+        }
     }
 
-    return false;
+    // Complete or absent.
+    if (std::rename(temp.c_str(), path.c_str()) != 0)
+    {
+        Log::syserror("Failed to rename " + temp + ".");
+        std::remove(temp.c_str());
+    }
 }
 
 Timestamp TileCache::getLastModified()
@@ -406,6 +1005,152 @@ void TileCache::saveLastModified(const Timestamp& timestamp)
     modTimeFile.close();
 }
 
+void TileCache::addToMemoryCache(const std::string& cachedName, const Tile& tile)
+{
+    Util::assertIsLocked(_cacheMutex);
+
+    removeFromMemoryCache(cachedName);
+
+    if (tile->size() > _memoryCacheLimit)
+    {
+        // Disabled, or too large to be worth keeping.
+        return;
+    }
+
+    _memoryCache.emplace_front(cachedName, tile);
+    _memoryCacheIndex[cachedName] = _memoryCache.begin();
+    _memoryCacheSize += tile->size();
+    MemoryCacheTotalSize += tile->size();
+
+    while (_memoryCacheSize > _memoryCacheLimit)
+    {
+        removeFromMemoryCache(_memoryCache.back().first);
+    }
+}
+
+size_t TileCache::shrinkMemoryCache(const size_t size)
+{
+    std::unique_lock<std::mutex> lock(_cacheMutex);
+
+    const auto before = _memoryCacheSize;
+    while (_memoryCacheSize > size)
+    {
+        removeFromMemoryCache(_memoryCache.back().first);
+    }
+
+    return before - _memoryCacheSize;
+}
+
+void TileCache::removeFromMemoryCache(const std::string& cachedName)
+{
+    Util::assertIsLocked(_cacheMutex);
+
+    const auto it = _memoryCacheIndex.find(cachedName);
+    if (it != _memoryCacheIndex.end())
+    {
+        _memoryCacheSize -= it->second->second->size();
+        MemoryCacheTotalSize -= it->second->second->size();
+        _memoryCache.erase(it->second);
+        _memoryCacheIndex.erase(it);
+    }
+}
+
+void TileCache::recompressNextTile()
+{
+    png::EncodeOptions options;
+    options.compressionLevel = _recompressionLevel;
+    options.filters = PNG_ALL_FILTERS;
+    options.palette = true;
+
+    std::unique_lock<std::mutex> lock(_cacheMutex);
+    if (_pendingQueue.empty())
+    {
+        return;
+    }
+
+    const std::string cachedName = _pendingQueue.front();
+    _pendingQueue.pop_front();
+
+    auto it = _pendingTiles.find(cachedName);
+    while (it != _pendingTiles.end())
+    {
+        const Tile tile = it->second;
+        lock.unlock();
+
+        auto stored = std::make_shared<std::vector<char>>();
+        if (!png::recompressPNG(tile->data(), tile->size(), *stored, options) ||
+            stored->size() >= tile->size())
+        {
+            stored = tile;
+        }
+
+        lock.lock();
+
+        it = _pendingTiles.find(cachedName);
+        if (it != _pendingTiles.end() && it->second == tile)
+        {
+            Log::trace() << "Storing recompressed tile " << cachedName << ": " << tile->size()
+                         << " -> " << stored->size() << " bytes." << Log::end;
+            _pendingTiles.erase(it);
+            _tileStore->save(cachedName, stored->data(), stored->size());
+            if (_memoryCacheIndex.find(cachedName) != _memoryCacheIndex.end())
+            {
+                addToMemoryCache(cachedName, stored);
+            }
+
+            break;
+        }
+
+        // Rendered again while we were at it, redo; or invalidated meanwhile.
+    }
+
+    _pendingCV.notify_all();
+}
+
+WorkQueue& TileCache::getRecompressionQueue()
+{
+    // Background work, one thread is plenty for all the documents.
+    static WorkQueue recompressionQueue("tile_recompress");
+    return recompressionQueue;
+}
+
+TileCache::Tile TileCache::getSharedSolidTile(const char *data, const size_t size)
+{
+    std::unique_lock<std::mutex> lock(SharedSolidTilesMutex);
+
+    const std::string key(data, size);
+    const auto it = SharedSolidTiles.find(key);
+    if (it != SharedSolidTiles.end())
+    {
+        return it->second;
+    }
+
+    if (SharedSolidTiles.size() >= MaxSharedSolidTiles)
+    {
+        // The documents keep theirs alive.
+        SharedSolidTiles.clear();
+    }
+
+    const auto tile = std::make_shared<std::vector<char>>(data, data + size);
+    SharedSolidTiles.emplace(key, tile);
+    return tile;
+}
+
+void TileCache::waitForRecompression()
+{
+    std::unique_lock<std::mutex> lock(_cacheMutex);
+    _pendingCV.wait(lock, [this]() { return _pendingTiles.empty() || _stopRecompression; });
+}
+
+std::string TileCache::getMemoryCacheStats()
+{
+    std::ostringstream oss;
+    oss << "hits=" << MemoryCacheHits
+        << " misses=" << MemoryCacheMisses
+        << " size=" << MemoryCacheTotalSize;
+    return oss.str();
+}
+
 // FIXME: to be further simplified when we centralize tile messages.
 int TileCache::isTileBeingRenderedIfSoSubscribe(const TileDesc& tile, const std::shared_ptr<ClientSession> &subscriber)
 {
@@ -417,6 +1162,12 @@ int TileCache::isTileBeingRenderedIfSoSubscribe(const TileDesc& tile, const std:
     {
         Log::debug() << "Tile (" << tile.getPart() << ',' << tile.getTilePosX() << ','
                      << tile.getTilePosY() << ") is already being rendered, subscribing." << Log::end;
+        if (!subscriber)
+        {
+            // Rendered ahead, for no one yet, and already coming.
+            return 0;
+        }
+
         assert(subscriber->getKind() == LOOLSession::Kind::ToClient);
 
         for (const auto &s : tileBeingRendered->_subscribers)
@@ -432,7 +1183,8 @@ int TileCache::isTileBeingRenderedIfSoSubscribe(const TileDesc& tile, const std:
         const auto duration = (std::chrono::steady_clock::now() - tileBeingRendered->getStartTime());
         if (std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() > COMMAND_TIMEOUT_MS)
         {
-            // Tile painting has stalled. Reissue.
+            // Tile painting has stalled. Reissue, once per timeout.
+            tileBeingRendered->resetStartTime();
             return tileBeingRendered->getVersion();
         }
 
@@ -448,8 +1200,13 @@ int TileCache::isTileBeingRenderedIfSoSubscribe(const TileDesc& tile, const std:
 
         assert(_tilesBeingRendered.find(cachedName) == _tilesBeingRendered.end());
 
-        tileBeingRendered = std::make_shared<TileBeingRendered>(cachedName, tile.getVersion());
+        tileBeingRendered = std::make_shared<TileBeingRendered>(cachedName, tile);
         tileBeingRendered->_subscribers.push_back(subscriber);
+        if (!subscriber)
+        {
+            // Other views' cancellations must not drop it.
+            tileBeingRendered->setRenderedAhead();
+        }
         _tilesBeingRendered[cachedName] = tileBeingRendered;
 
         return tileBeingRendered->getVersion();
@@ -10,15 +10,27 @@
 #ifndef INCLUDED_TILECACHE_HPP
 #define INCLUDED_TILECACHE_HPP
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
 #include <iosfwd>
+#include <list>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <unordered_map>
+#include <vector>
 
 #include <Poco/Timestamp.h>
 
 #include "TileDesc.hpp"
+#include "TileIndex.hpp"
+#include "TileInvalidation.hpp"
+#include "TileStore.hpp"
+#include "WorkQueue.hpp"
 
 class ClientSession;
 
@@ -30,22 +42,67 @@ class TileCache
     std::shared_ptr<TileBeingRendered> findTileBeingRendered(const TileDesc& tile);
 
 public:
+    /// An encoded (PNG) tile, shared between the cache and its readers.
+    typedef std::shared_ptr<std::vector<char>> Tile;
+
     /// When the docURL is a non-file:// url, the timestamp has to be provided by the caller.
     /// For file:// url's, it's ignored.
     /// When it is missing for non-file:// url, it is assumed the document must be read, and no cached value used.
-    TileCache(const std::string& docURL, const Poco::Timestamp& modifiedTime, const std::string& cacheDir);
+    /// memoryCacheLimit is the budget, in bytes, of encoded tiles kept in memory. 0 disables it.
+    /// storeType is the on-disk layout of the tiles, see TileStore::create.
+    /// The tiles on disk are indexed on first access, from the manifest
+    /// written when the cache was last closed, if any.
+    /// recompressionLevel is the zlib level rendered tiles are recompressed at,
+    /// in the background, before they are stored. -1 stores them as rendered.
+    /// The documents share the thread that recompresses them.
+    /// blobsDir is where the "blobs" store keeps the tiles shared by the documents.
+    TileCache(const std::string& docURL, const Poco::Timestamp& modifiedTime, const std::string& cacheDir,
+              const size_t memoryCacheLimit = 0, const std::string& storeType = "files",
+              const int recompressionLevel = -1, const std::string& blobsDir = std::string());
     ~TileCache();
 
     TileCache(const TileCache&) = delete;
 
     /// Subscribes if no subscription exists and returns the version number.
     /// Otherwise returns 0 to signify a subscription exists.
+    /// A null subscriber registers the render for those asking meanwhile,
+    /// which cancelTiles then leaves alone.
     int isTileBeingRenderedIfSoSubscribe(const TileDesc& tile, const std::shared_ptr<ClientSession> &subscriber);
 
-    std::unique_ptr<std::fstream> lookupTile(const TileDesc& tile);
+    /// Whether the tile is cached, without reading it.
+    bool hasTile(const TileDesc& tile);
+
+    /// Returns the encoded tile, from memory if possible, otherwise from disk.
+    /// Returns nullptr when the tile is not cached.
+    Tile lookupTile(const TileDesc& tile);
 
+    /// Saves the rendered tile and sends it to the sessions waiting for it.
+    /// Those that have the base of a delta saved for it get the delta instead.
     void saveTileAndNotify(const TileDesc& tile, const char *data, const size_t size, const bool priority);
 
+    /// Keeps a 'tiledelta:' message from the child, which precedes the tile
+    /// it is the delta of, until that is saved.
+    void saveTileDelta(const TileDesc& tile, const int baseVersion, const char *data, const size_t size);
+
+    /// Sends a preview of the tile, rendered at a lower resolution, to those
+    /// waiting for it to be rendered in full. Neither cached nor the base of
+    /// a delta. Returns the number of subscribers it was sent to.
+    size_t notifyPreview(const TileDesc& tile, const char *data, const size_t size);
+
+    /// Synthesizes a placeholder for each tile, scaled from the tiles cached over
+    /// its area at the zoom closest to its own, for the clients to show until it
+    /// is rendered. nullptr for the tiles with none cached around.
+    std::vector<Tile> getPlaceholders(const std::vector<TileDesc>& tiles);
+
+    /// The most cached tiles a placeholder is scaled from.
+    static constexpr size_t MaxPlaceholderSources = 16;
+
+    /// Returns the version of the render the cached tile comes from, -1 if not known.
+    int getRenderVersion(const TileDesc& tile);
+
+    /// Returns the name a tile is cached under.
+    static std::string cacheFileName(const TileDesc& tile);
+
     std::string getTextFile(const std::string& fileName);
 
     // Save some text into a file in the cache directory
@@ -60,9 +117,13 @@ public:
 
     std::unique_ptr<std::fstream> lookupRendering(const std::string& name, const std::string& dir);
 
-    // The tiles parameter is an invalidatetiles: message as sent by the child process
+    // The tiles parameter is an invalidatetiles: message as sent by the child process,
+    // of a line per area, which are all invalidated at once.
     void invalidateTiles(const std::string& tiles);
 
+    /// Invalidates the areas, as parsed from such a message, at once.
+    void invalidateTiles(const std::vector<TileInvalidation::Area>& areas);
+
     /// Store the timestamp to modtime.txt.
     void saveLastModified(const Poco::Timestamp& timestamp);
 
@@ -70,21 +131,83 @@ public:
 
     void forgetTileBeingRendered(const TileDesc& tile);
 
-private:
-    void invalidateTiles(int part, int x, int y, int width, int height);
+    /// Unsubscribes the session from the tiles being rendered that isObsolete
+    /// tells it no longer wants, previews apart. Forgets the renders no one
+    /// waits for anymore, rendered-ahead ones apart, and returns their
+    /// versions, for the kit to cancel.
+    std::vector<int> cancelTiles(const std::shared_ptr<ClientSession>& subscriber,
+                                 const std::function<bool(const TileDesc&)>& isObsolete);
+
+    /// Requires the lock from getTilesBeingRenderedLock().
+    bool hasTilesBeingRendered() const { return !_tilesBeingRendered.empty(); }
+
+    /// Bytes of encoded tiles currently held in memory by this cache.
+    size_t getMemoryCacheSize()
+    {
+        std::unique_lock<std::mutex> lock(_cacheMutex);
+        return _memoryCacheSize;
+    }
+
+    /// Evicts the least-recently used tiles from memory, which stay on disk,
+    /// until the size is at most size bytes. Returns the bytes evicted.
+    size_t shrinkMemoryCache(const size_t size);
+
+    /// Returns the in-memory cache statistics of all documents as
+    /// "hits=<n> misses=<n> size=<bytes>".
+    static std::string getMemoryCacheStats();
 
+    static uint64_t getMemoryCacheHits() { return MemoryCacheHits; }
+    static uint64_t getMemoryCacheMisses() { return MemoryCacheMisses; }
+    static uint64_t getMemoryCacheTotalSize() { return MemoryCacheTotalSize; }
+
+    /// Blocks until the tiles waiting for recompression are stored.
+    void waitForRecompression();
+
+private:
     // Removes the given file from the cache
     void removeFile(const std::string& fileName);
 
-    std::string cacheFileName(const TileDesc& tile);
     bool parseCacheFileName(const std::string& fileName, int& part, int& width, int& height, int& tilePosX, int& tilePosY, int& tileWidth, int& tileHeight);
 
-    /// Extract location from fileName, and check if it intersects with [x, y, width, height].
-    bool intersectsTile(const std::string& fileName, int part, int x, int y, int width, int height);
+    /// Check if the tile intersects with [x, y, width, height].
+    static bool intersectsTile(const TileDesc& tile, int part, int x, int y, int width, int height);
+
+    /// Opens the store and indexes the tiles on disk, left from a previous
+    /// session, unless done already. Requires _cacheMutex.
+    void ensureIndexed();
+
+    /// Index the tiles already on disk by listing the store. Requires _cacheMutex.
+    void loadTileIndex();
+
+    /// Index the tiles listed in the manifest, if it is of the same
+    /// document version, and removes it, as the tiles are about to change.
+    /// Returns false without a valid manifest. Requires _cacheMutex.
+    bool loadManifest();
+
+    /// Lists the tiles stored, with their render versions, for the next
+    /// session of the document to index them without listing the store.
+    void saveManifest();
 
     /// Load the timestamp from modtime.txt.
     Poco::Timestamp getLastModified();
 
+    /// Insert or replace a tile in the in-memory cache and evict
+    /// the least-recently used ones to stay within the budget.
+    void addToMemoryCache(const std::string& cachedName, const Tile& tile);
+
+    /// Returns the cached tile, without counting it as used. Requires _cacheMutex.
+    Tile findTile(const std::string& cachedName);
+    void removeFromMemoryCache(const std::string& cachedName);
+
+    /// Recompresses and stores the oldest pending tile, if any.
+    void recompressNextTile();
+
+    /// The queue the tiles of all the documents are recompressed on.
+    static WorkQueue& getRecompressionQueue();
+
+    /// Returns the one shared copy of a single-colour tile image.
+    static Tile getSharedSolidTile(const char *data, const size_t size);
+
     const std::string _docURL;
 
     const std::string _cacheDir;
@@ -94,6 +217,81 @@ private:
     std::mutex _tilesBeingRenderedMutex;
 
     std::map<std::string, std::shared_ptr<TileBeingRendered>> _tilesBeingRendered;
+
+    /// The delta a tile being rendered comes with, if any, by cache name.
+    /// Guarded by _tilesBeingRenderedMutex.
+    struct TileDelta
+    {
+        int version;
+        int baseVersion;
+        std::vector<char> message;
+    };
+    std::unordered_map<std::string, TileDelta> _tileDeltas;
+
+    /// Version of the render each cached tile comes from.
+    /// Guarded by _cacheMutex.
+    std::unordered_map<std::string, int> _renderVersions;
+
+    const std::string _storeType;
+    const std::string _blobsDir;
+
+    /// The tiles on disk, null until indexed. Guarded by _cacheMutex.
+    std::unique_ptr<TileStore> _tileStore;
+
+    /// Location of the tiles cached on disk, by cache file name,
+    /// so invalidation doesn't need to list the cache directory.
+    /// Guarded by _cacheMutex.
+    TileIndex _tileIndex;
+
+    /// In-memory LRU of encoded tiles, most-recently used first.
+    /// Guarded by _cacheMutex.
+    typedef std::list<std::pair<std::string, Tile>> MemoryCacheList;
+    MemoryCacheList _memoryCache;
+    std::unordered_map<std::string, MemoryCacheList::iterator> _memoryCacheIndex;
+    size_t _memoryCacheSize;
+    const size_t _memoryCacheLimit;
+
+    /// Rendered tiles waiting to be recompressed and stored, and the order
+    /// they came in. Their lookups are served from here meanwhile.
+    /// Guarded by _cacheMutex.
+    std::unordered_map<std::string, Tile> _pendingTiles;
+    std::deque<std::string> _pendingQueue;
+    std::condition_variable _pendingCV;
+    bool _stopRecompression;
+    const int _recompressionLevel;
+
+    /// How the tasks queued to recompress our tiles reach us,
+    /// as they may run after we are gone.
+    struct Recompressor
+    {
+        Recompressor() :
+            _tileCache(nullptr)
+        {
+        }
+
+        std::mutex _mutex;
+        TileCache* _tileCache;
+    };
+    std::shared_ptr<Recompressor> _recompressor;
+
+    /// The format of the manifest, which is ignored if different.
+    static constexpr int ManifestVersion = 1;
+
+    /// Beyond this many pending tiles, new ones are stored as rendered.
+    static constexpr size_t MaxPendingTiles = 256;
+
+    /// The single-colour tiles, which are never stored, nor counted
+    /// in the memory cache. Guarded by _cacheMutex.
+    std::unordered_map<std::string, Tile> _solidTiles;
+
+    /// The solid tile images shared by all documents, by content.
+    static std::mutex SharedSolidTilesMutex;
+    static std::unordered_map<std::string, Tile> SharedSolidTiles;
+    static constexpr size_t MaxSharedSolidTiles = 1024;
+
+    static std::atomic<uint64_t> MemoryCacheHits;
+    static std::atomic<uint64_t> MemoryCacheMisses;
+    static std::atomic<uint64_t> MemoryCacheTotalSize;
 };
 
 #endif
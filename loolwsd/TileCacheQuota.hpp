@@ -0,0 +1,384 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TILECACHEQUOTA_HPP
+#define INCLUDED_TILECACHEQUOTA_HPP
+
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// The disk used by the tile caches of all the documents, under the cache
+/// root as <root>/a/b/c/<rest of the hash>, bounded by a quota. The caches
+/// of the documents open are measured as they grow, and those of the
+/// documents closed once, when closed. Over the quota, the caches of the
+/// documents closed the longest ago go first, those open never.
+/// The file times keep the order across restarts. The tiles linked to
+/// blobs, shared by several caches, count in each for their share.
+class TileCacheQuota
+{
+public:
+    static TileCacheQuota& instance()
+    {
+        static TileCacheQuota tileCacheQuota;
+        return tileCacheQuota;
+    }
+
+    /// maxBytes of 0 for no quota.
+    explicit TileCacheQuota(const std::string& root = std::string(), const size_t maxBytes = 0) :
+        _root(root),
+        _maxBytes(maxBytes),
+        _bytes(0),
+        _evicted(0),
+        _evictedBytes(0)
+    {
+    }
+
+    TileCacheQuota(const TileCacheQuota&) = delete;
+    TileCacheQuota& operator=(const TileCacheQuota&) = delete;
+
+    void setQuota(const std::string& root, const size_t maxBytes)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _root = root;
+        _maxBytes = maxBytes;
+    }
+
+    size_t getQuota() const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _maxBytes;
+    }
+
+    /// A document uses the cache at path: kept until closed.
+    /// Waits for the cache to be evicted if it is being so.
+    void open(const std::string& path, const time_t now)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        Entry& entry = _entries[path];
+        ++entry._refs;
+        entry._used = now;
+    }
+
+    /// The document is closed, its cache to be measured a last time.
+    void close(const std::string& path, const time_t now)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        const auto it = _entries.find(path);
+        if (it != _entries.end() && it->second._refs > 0)
+        {
+            --it->second._refs;
+            it->second._used = now;
+            it->second._measured = false;
+        }
+    }
+
+    /// Takes the caches left from before, as used when last written to.
+    /// Returns the number found.
+    size_t scan()
+    {
+        std::string root;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            root = _root;
+        }
+
+        std::vector<std::string> paths;
+        findCaches(root, 0, paths);
+
+        std::vector<std::pair<std::string, Entry>> found;
+        for (const auto& path : paths)
+        {
+            Entry entry;
+            measure(path, entry._bytes, entry._used);
+            entry._measured = true;
+            found.emplace_back(path, entry);
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (const auto& it : found)
+        {
+            if (_entries.find(it.first) == _entries.end())
+            {
+                _entries[it.first] = it.second;
+                _bytes += it.second._bytes;
+            }
+        }
+
+        return found.size();
+    }
+
+    /// Measures the caches open and those closed since, then evicts until
+    /// within the quota. Returns the number of caches evicted.
+    size_t update()
+    {
+        std::vector<std::string> paths;
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            for (const auto& it : _entries)
+            {
+                if (it.second._refs > 0 || !it.second._measured)
+                {
+                    paths.push_back(it.first);
+                }
+            }
+        }
+
+        // Without the lock, not to hold the documents opening.
+        std::vector<std::pair<size_t, bool>> sizes;
+        for (const auto& path : paths)
+        {
+            size_t bytes = 0;
+            time_t modified = 0;
+            const bool exists = measure(path, bytes, modified);
+            sizes.emplace_back(bytes, exists);
+        }
+
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (size_t i = 0; i < paths.size(); ++i)
+        {
+            const auto it = _entries.find(paths[i]);
+            if (it == _entries.end())
+            {
+                continue;
+            }
+
+            _bytes = _bytes - it->second._bytes + sizes[i].first;
+            it->second._bytes = sizes[i].first;
+            if (it->second._refs == 0)
+            {
+                it->second._measured = true;
+                if (!sizes[i].second)
+                {
+                    // Removed by hand.
+                    _entries.erase(it);
+                }
+            }
+        }
+
+        return evict();
+    }
+
+    size_t getBytes() const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _bytes;
+    }
+
+    size_t size() const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        return _entries.size();
+    }
+
+    std::string getStats() const
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        size_t open = 0;
+        size_t openBytes = 0;
+        for (const auto& it : _entries)
+        {
+            if (it.second._refs > 0)
+            {
+                ++open;
+                openBytes += it.second._bytes;
+            }
+        }
+
+        std::ostringstream oss;
+        oss << "documents=" << _entries.size()
+            << " open=" << open
+            << " bytes=" << _bytes
+            << " open_bytes=" << openBytes
+            << " quota=" << _maxBytes
+            << " evicted=" << _evicted
+            << " evicted_bytes=" << _evictedBytes;
+        return oss.str();
+    }
+
+private:
+    struct Entry
+    {
+        Entry() :
+            _bytes(0),
+            _used(0),
+            _refs(0),
+            _measured(false)
+        {
+        }
+
+        size_t _bytes;
+        time_t _used;
+        size_t _refs;
+        /// Since last closed.
+        bool _measured;
+    };
+
+    /// The directories at the depth of the caches: three of one character,
+    /// then the rest of the hash. Those of the conversions and the blobs are not.
+    static void findCaches(const std::string& path, const int depth, std::vector<std::string>& paths)
+    {
+        DIR* dir = opendir(path.c_str());
+        if (!dir)
+        {
+            return;
+        }
+
+        while (struct dirent* entry = readdir(dir))
+        {
+            const std::string name = entry->d_name;
+            const std::string child = path + '/' + name;
+            struct stat st;
+            if (name[0] == '.' || (depth < 3 && name.size() != 1) ||
+                lstat(child.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+            {
+                continue;
+            }
+
+            if (depth < 3)
+            {
+                findCaches(child, depth + 1, paths);
+            }
+            else
+            {
+                paths.push_back(child);
+            }
+        }
+
+        closedir(dir);
+    }
+
+    /// The bytes on disk under path, and when last written to.
+    /// A file of several links, one of them that of its blob, counts for
+    /// its share of each of the others. Returns false if path is not there.
+    static bool measure(const std::string& path, size_t& bytes, time_t& modified)
+    {
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0)
+        {
+            return false;
+        }
+
+        const size_t size = static_cast<size_t>(st.st_blocks) * 512;
+        bytes += (S_ISREG(st.st_mode) && st.st_nlink > 1 ? size / (st.st_nlink - 1) : size);
+        if (st.st_mtime > modified)
+        {
+            modified = st.st_mtime;
+        }
+
+        if (S_ISDIR(st.st_mode))
+        {
+            if (DIR* dir = opendir(path.c_str()))
+            {
+                while (struct dirent* entry = readdir(dir))
+                {
+                    const std::string name = entry->d_name;
+                    if (name != "." && name != "..")
+                    {
+                        measure(path + '/' + name, bytes, modified);
+                    }
+                }
+
+                closedir(dir);
+            }
+        }
+
+        return true;
+    }
+
+    static void removeTree(const std::string& path)
+    {
+        struct stat st;
+        if (lstat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+        {
+            if (DIR* dir = opendir(path.c_str()))
+            {
+                while (struct dirent* entry = readdir(dir))
+                {
+                    const std::string name = entry->d_name;
+                    if (name != "." && name != "..")
+                    {
+                        removeTree(path + '/' + name);
+                    }
+                }
+
+                closedir(dir);
+            }
+
+            rmdir(path.c_str());
+        }
+        else
+        {
+            ::unlink(path.c_str());
+        }
+    }
+
+    /// Removes the caches of the documents closed the longest ago until
+    /// within the quota, then their parents left empty. With the lock held,
+    /// for a document opening not to find its cache half removed.
+    size_t evict()
+    {
+        size_t evicted = 0;
+        while (_maxBytes > 0 && _bytes > _maxBytes)
+        {
+            auto oldest = _entries.end();
+            for (auto it = _entries.begin(); it != _entries.end(); ++it)
+            {
+                if (it->second._refs == 0 && it->second._measured &&
+                    (oldest == _entries.end() || it->second._used < oldest->second._used))
+                {
+                    oldest = it;
+                }
+            }
+
+            if (oldest == _entries.end())
+            {
+                // All open: they keep their tiles.
+                break;
+            }
+
+            const std::string path = oldest->first;
+            removeTree(path);
+            for (std::string parent = path.substr(0, path.rfind('/'));
+                 parent.size() > _root.size() && rmdir(parent.c_str()) == 0;
+                 parent = parent.substr(0, parent.rfind('/')))
+            {
+            }
+
+            _bytes -= oldest->second._bytes;
+            _evictedBytes += oldest->second._bytes;
+            _entries.erase(oldest);
+            ++_evicted;
+            ++evicted;
+        }
+
+        return evicted;
+    }
+
+private:
+    std::string _root;
+    size_t _maxBytes;
+    std::map<std::string, Entry> _entries;
+    size_t _bytes;
+    size_t _evicted;
+    size_t _evictedBytes;
+    mutable std::mutex _mutex;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,112 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TILECOALESCER_HPP
+#define INCLUDED_TILECOALESCER_HPP
+
+#include <algorithm>
+#include <cstddef>
+#include <map>
+#include <vector>
+
+#include "TileDesc.hpp"
+
+/// Plans the renders of a set of tiles of the same size and part.
+/// The kit paints the bounding box of each 'tilecombine' in one go,
+/// so tiles forming a rectangle are best rendered together.
+class TileCoalescer
+{
+public:
+    /// Groups the tiles into rectangles of adjacent tiles, each at most
+    /// maxPixels in size, merging the rows that span the same columns.
+    /// A tile larger than maxPixels still gets a group of its own.
+    static std::vector<std::vector<TileDesc>> coalesce(const std::vector<TileDesc>& tiles,
+                                                       const size_t maxPixels)
+    {
+        std::vector<std::vector<TileDesc>> groups;
+        if (tiles.empty())
+        {
+            return groups;
+        }
+
+        const int tileWidth = tiles[0].getTileWidth();
+        const int tileHeight = tiles[0].getTileHeight();
+        const size_t tilePixels = static_cast<size_t>(tiles[0].getWidth()) * tiles[0].getHeight();
+        const size_t maxTiles = std::max<size_t>(1, maxPixels / std::max<size_t>(1, tilePixels));
+
+        // Rows, top down, each left to right, without duplicates.
+        std::map<int, std::map<int, TileDesc>> rows;
+        for (const auto& tile : tiles)
+        {
+            rows[tile.getTilePosY()].emplace(tile.getTilePosX(), tile);
+        }
+
+        // The rectangles that may still get another row, by their columns.
+        struct Area
+        {
+            size_t group;
+            int bottom;
+            size_t columns;
+            size_t rows;
+        };
+        std::map<std::pair<int, int>, Area> open;
+
+        for (const auto& row : rows)
+        {
+            const int y = row.first;
+            std::map<std::pair<int, int>, Area> stillOpen;
+
+            // Split the row into runs of adjacent tiles, none wider than the budget.
+            auto it = row.second.begin();
+            while (it != row.second.end())
+            {
+                std::vector<TileDesc> run;
+                const int left = it->first;
+                int right = left;
+                do
+                {
+                    run.push_back(it->second);
+                    right = it->first;
+                    ++it;
+                }
+                while (it != row.second.end() && it->first == right + tileWidth && run.size() < maxTiles);
+
+                const auto columns = std::make_pair(left, right);
+                const auto openIt = open.find(columns);
+                if (openIt != open.end() && openIt->second.bottom + tileHeight == y &&
+                    (openIt->second.rows + 1) * openIt->second.columns <= maxTiles)
+                {
+                    // Grow the rectangle above by this row.
+                    Area area = openIt->second;
+                    auto& group = groups[area.group];
+                    group.insert(group.end(), run.begin(), run.end());
+                    area.bottom = y;
+                    ++area.rows;
+                    open.erase(openIt);
+                    stillOpen[columns] = area;
+                }
+                else
+                {
+                    const Area area = { groups.size(), y, run.size(), 1 };
+                    groups.push_back(run);
+                    stillOpen[columns] = area;
+                }
+            }
+
+            // Those that didn't get this row are done.
+            open.swap(stillOpen);
+        }
+
+        return groups;
+    }
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
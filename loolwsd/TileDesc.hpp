@@ -10,9 +10,10 @@
 #ifndef INCLUDED_TILEDESC_HPP
 #define INCLUDED_TILEDESC_HPP
 
-#include <map>
-#include <sstream>
+#include <algorithm>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 #include <Poco/StringTokenizer.h>
 
@@ -24,7 +25,7 @@
 class TileDesc
 {
 public:
-    TileDesc(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight, int ver = -1, int imgSize = 0, int id = -1) :
+    TileDesc(int part, int width, int height, int tilePosX, int tilePosY, int tileWidth, int tileHeight, int ver = -1, int imgSize = 0, int id = -1, bool solid = false) :
         _part(part),
         _width(width),
         _height(height),
@@ -34,7 +35,9 @@ public:
         _tileHeight(tileHeight),
         _ver(ver),
         _imgSize(imgSize),
-        _id(id)
+        _id(id),
+        _solid(solid),
+        _traceId(-1)
     {
         if (_part < 0 ||
             _width <= 0 ||
@@ -60,71 +63,149 @@ public:
     void setVersion(const int ver) { _ver = ver; }
     int getImgSize() const { return _imgSize; }
     void setImgSize(const int imgSize) { _imgSize = imgSize; }
+    /// The id of a preview, -1 for the tiles of the views.
+    int getId() const { return _id; }
+    /// True when the tile is a single colour, whose image is shared.
+    bool isSolid() const { return _solid; }
+    void setSolid(const bool solid) { _solid = solid; }
+    /// The id of the request in the traces, if traced, else -1.
+    int getTraceId() const { return _traceId; }
+    void setTraceId(const int traceId) { _traceId = traceId; }
 
     /// Serialize this instance into a string.
     /// Optionally prepend a prefix.
     std::string serialize(const std::string& prefix = "") const
     {
-        std::ostringstream oss;
-        oss << prefix
-            << " part=" << _part
-            << " width=" << _width
-            << " height=" << _height
-            << " tileposx=" << _tilePosX
-            << " tileposy=" << _tilePosY
-            << " tilewidth=" << _tileWidth
-            << " tileheight=" << _tileHeight
-            << " ver=" << _ver
-            << " imgsize=" << _imgSize;
+        std::string output;
+        output.reserve(prefix.size() + 128);
+        output += prefix;
+        output += " part=";
+        LOOLProtocol::appendInteger(output, _part);
+        output += " width=";
+        LOOLProtocol::appendInteger(output, _width);
+        output += " height=";
+        LOOLProtocol::appendInteger(output, _height);
+        output += " tileposx=";
+        LOOLProtocol::appendInteger(output, _tilePosX);
+        output += " tileposy=";
+        LOOLProtocol::appendInteger(output, _tilePosY);
+        output += " tilewidth=";
+        LOOLProtocol::appendInteger(output, _tileWidth);
+        output += " tileheight=";
+        LOOLProtocol::appendInteger(output, _tileHeight);
+        output += " ver=";
+        LOOLProtocol::appendInteger(output, _ver);
+        output += " imgsize=";
+        LOOLProtocol::appendInteger(output, _imgSize);
         if (_id >= 0)
         {
-            oss << " id=" << _id;
+            output += " id=";
+            LOOLProtocol::appendInteger(output, _id);
         }
 
-        return oss.str();
+        if (_solid)
+        {
+            output += " solid=1";
+        }
+
+        if (_traceId >= 0)
+        {
+            output += " trace=";
+            LOOLProtocol::appendInteger(output, _traceId);
+        }
+
+        return output;
     }
 
     /// Deserialize a TileDesc from a tokenized string.
     static
     TileDesc parse(const Poco::StringTokenizer& tokens)
     {
-        // We don't expect undocumented fields and
-        // assume all values to be int.
-        std::map<std::string, int> pairs;
-
-        // Optional.
-        pairs["ver"] = -1;
-        pairs["imgsize"] = 0;
-        pairs["id"] = -1;
-
+        Fields fields;
         for (size_t i = 0; i < tokens.count(); ++i)
         {
-            std::string name;
-            int value = -1;
-            if (LOOLProtocol::parseNameIntegerPair(tokens[i], name, value))
-            {
-                pairs[name] = value;
-            }
+            fields.parse(tokens[i].data(), tokens[i].size());
         }
 
-        return TileDesc(pairs["part"], pairs["width"], pairs["height"],
-                        pairs["tileposx"], pairs["tileposy"],
-                        pairs["tilewidth"], pairs["tileheight"],
-                        pairs["ver"],
-                        pairs["imgsize"], pairs["id"]);
+        return fields.create();
     }
 
     /// Deserialize a TileDesc from a string format.
     static
     TileDesc parse(const std::string& message)
     {
-        Poco::StringTokenizer tokens(message, " ",
-                                     Poco::StringTokenizer::TOK_IGNORE_EMPTY |
-                                     Poco::StringTokenizer::TOK_TRIM);
-        return parse(tokens);
+        return parse(message.data(), message.size());
+    }
+
+    /// Deserialize a TileDesc from a message, in a single pass and without allocating.
+    static
+    TileDesc parse(const char *message, const size_t length)
+    {
+        Fields fields;
+        fields.parse(message, length);
+        return fields.create();
     }
 
 private:
+    /// The fields of a message being parsed.
+    /// We don't expect undocumented fields and assume all values to be int.
+    struct Fields
+    {
+        int part = 0;
+        int width = 0;
+        int height = 0;
+        int tilePosX = 0;
+        int tilePosY = 0;
+        int tileWidth = 0;
+        int tileHeight = 0;
+        // Optional.
+        int ver = -1;
+        int imgSize = 0;
+        int id = -1;
+        int solid = 0;
+        int traceId = -1;
+
+        void parse(const char *message, const size_t length)
+        {
+            LOOLProtocol::forEachNameValue(message, length,
+                [this](const char *name, const char *nameEnd, const char *value, const char *valueEnd)
+                {
+                    int *field = getField(name, nameEnd);
+                    int parsed = 0;
+                    if (field && LOOLProtocol::parseInteger(value, valueEnd, parsed))
+                    {
+                        *field = parsed;
+                    }
+                });
+        }
+
+        int *getField(const char *name, const char *nameEnd)
+        {
+            using LOOLProtocol::nameEquals;
+            if (nameEquals(name, nameEnd, "part")) return &part;
+            if (nameEquals(name, nameEnd, "width")) return &width;
+            if (nameEquals(name, nameEnd, "height")) return &height;
+            if (nameEquals(name, nameEnd, "tileposx")) return &tilePosX;
+            if (nameEquals(name, nameEnd, "tileposy")) return &tilePosY;
+            if (nameEquals(name, nameEnd, "tilewidth")) return &tileWidth;
+            if (nameEquals(name, nameEnd, "tileheight")) return &tileHeight;
+            if (nameEquals(name, nameEnd, "ver")) return &ver;
+            if (nameEquals(name, nameEnd, "imgsize")) return &imgSize;
+            if (nameEquals(name, nameEnd, "id")) return &id;
+            if (nameEquals(name, nameEnd, "solid")) return &solid;
+            if (nameEquals(name, nameEnd, "trace")) return &traceId;
+            return nullptr;
+        }
+
+        TileDesc create() const
+        {
+            TileDesc tile(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight,
+                          ver, imgSize, id, solid != 0);
+            tile.setTraceId(traceId);
+            return tile;
+        }
+    };
+
     int _part;
     int _width;
     int _height;
@@ -135,22 +216,35 @@ private:
     int _ver;       //< Versioning support.
     int _imgSize;   //< Used for responses.
     int _id;
+    bool _solid;
+    int _traceId;
 };
 
 class TileCombined
 {
 private:
+    /// A range of the message being parsed.
+    struct Range
+    {
+        const char *begin = nullptr;
+        const char *end = nullptr;
+
+        bool empty() const { return begin == end; }
+    };
+
     TileCombined(int part, int width, int height,
-                 const std::string& tilePositionsX, const std::string& tilePositionsY,
-                 int tileWidth, int tileHeight, int ver = -1,
-                 const std::string& imgSizes = "", int id = -1) :
+                 const Range& tilePositionsX, const Range& tilePositionsY,
+                 int tileWidth, int tileHeight, int ver,
+                 const Range& imgSizes, int id,
+                 const Range& solids, int traceId) :
         _part(part),
         _width(width),
         _height(height),
         _tileWidth(tileWidth),
         _tileHeight(tileHeight),
         _ver(ver),
-        _id(id)
+        _id(id),
+        _traceId(traceId)
     {
         if (_part < 0 ||
             _width <= 0 ||
@@ -161,39 +255,39 @@ private:
             throw BadArgumentException("Invalid tilecombine descriptor.");
         }
 
-        Poco::StringTokenizer positionXtokens(tilePositionsX, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
-        Poco::StringTokenizer positionYtokens(tilePositionsY, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
-        Poco::StringTokenizer sizeTokens(imgSizes, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
-
-        const auto numberOfPositions = positionYtokens.count();
-
-        // check that number of positions for X and Y is the same
-        if (numberOfPositions != positionXtokens.count() || (!imgSizes.empty() && numberOfPositions != sizeTokens.count()))
-        {
-            throw BadArgumentException("Invalid tilecombine descriptor. Uneven number of tiles.");
-        }
-
-        for (size_t i = 0; i < numberOfPositions; ++i)
+        // Walk the lists together, they must be of the same length.
+        LOOLProtocol::IntegerListReader positionsX(tilePositionsX.begin, tilePositionsX.end);
+        LOOLProtocol::IntegerListReader positionsY(tilePositionsY.begin, tilePositionsY.end);
+        LOOLProtocol::IntegerListReader sizes(imgSizes.begin, imgSizes.end);
+        LOOLProtocol::IntegerListReader solidFlags(solids.begin, solids.end);
+        try
         {
             int x = 0;
-            if (!LOOLProtocol::stringToInteger(positionXtokens[i], x))
+            while (positionsX.next(x))
             {
-                throw BadArgumentException("Invalid tilecombine descriptor.");
-            }
+                int y = 0;
+                int size = 0;
+                int solid = 0;
+                if (!positionsY.next(y) ||
+                    (!imgSizes.empty() && !sizes.next(size)) ||
+                    (!solids.empty() && !solidFlags.next(solid)))
+                {
+                    throw BadArgumentException("Invalid tilecombine descriptor. Uneven number of tiles.");
+                }
 
-            int y = 0;
-            if (!LOOLProtocol::stringToInteger(positionYtokens[i], y))
-            {
-                throw BadArgumentException("Invalid tilecombine descriptor.");
+                _tiles.emplace_back(_part, _width, _height, x, y, _tileWidth, _tileHeight, ver, size, id, solid != 0);
+                _tiles.back().setTraceId(traceId);
             }
 
-            int size = 0;
-            if (sizeTokens.count() && !LOOLProtocol::stringToInteger(sizeTokens[i], size))
+            int extra = 0;
+            if (positionsY.next(extra) || sizes.next(extra) || solidFlags.next(extra))
             {
-                throw BadArgumentException("Invalid tilecombine descriptor.");
+                throw BadArgumentException("Invalid tilecombine descriptor. Uneven number of tiles.");
             }
-
-            _tiles.emplace_back(_part, _width, _height, x, y, _tileWidth, _tileHeight, ver, size, id);
+        }
+        catch (const std::invalid_argument&)
+        {
+            throw BadArgumentException("Invalid tilecombine descriptor.");
         }
     }
 
@@ -206,6 +300,16 @@ public:
     int getTileHeight() const { return _tileHeight; }
     int getVersion() const { return _ver; }
     void setVersion(const int ver) { _ver = ver; }
+    int getId() const { return _id; }
+    int getTraceId() const { return _traceId; }
+    void setTraceId(const int traceId)
+    {
+        _traceId = traceId;
+        for (auto& tile : _tiles)
+        {
+            tile.setTraceId(traceId);
+        }
+    }
 
     const std::vector<TileDesc>& getTiles() const { return _tiles; }
     std::vector<TileDesc>& getTiles() { return _tiles; }
@@ -214,112 +318,173 @@ public:
     /// Optionally prepend a prefix.
     std::string serialize(const std::string& prefix = "") const
     {
-        std::ostringstream oss;
-        oss << prefix
-            << " part=" << _part
-            << " width=" << _width
-            << " height=" << _height
-            << " tileposx=";
-        for (const auto& tile : _tiles)
-        {
-            oss << tile.getTilePosX() << ',';
-        }
-
-        oss.seekp(-1, std::ios_base::cur); // Remove last comma.
-
-        oss << " tileposy=";
-        for (const auto& tile : _tiles)
+        std::string output;
+        output.reserve(prefix.size() + 128 + _tiles.size() * 24);
+        output += prefix;
+        output += " part=";
+        LOOLProtocol::appendInteger(output, _part);
+        output += " width=";
+        LOOLProtocol::appendInteger(output, _width);
+        output += " height=";
+        LOOLProtocol::appendInteger(output, _height);
+
+        output += " tileposx=";
+        appendList(output, [](const TileDesc& tile) { return tile.getTilePosX(); });
+        output += " tileposy=";
+        appendList(output, [](const TileDesc& tile) { return tile.getTilePosY(); });
+        output += " imgsize=";
+        appendList(output, [](const TileDesc& tile) { return tile.getImgSize(); });
+
+        // Only listed when there are any, for older clients.
+        if (std::any_of(_tiles.begin(), _tiles.end(), [](const TileDesc& tile) { return tile.isSolid(); }))
         {
-            oss << tile.getTilePosY() << ',';
+            output += " solid=";
+            appendList(output, [](const TileDesc& tile) { return tile.isSolid() ? 1 : 0; });
         }
 
-        oss.seekp(-1, std::ios_base::cur); // Remove last comma.
-
-        oss << " imgsize=";
-        for (const auto& tile : _tiles)
+        output += " tilewidth=";
+        LOOLProtocol::appendInteger(output, _tileWidth);
+        output += " tileheight=";
+        LOOLProtocol::appendInteger(output, _tileHeight);
+        if (_ver >= 0)
         {
-            oss << tile.getImgSize() << ',';
+            output += " ver=";
+            LOOLProtocol::appendInteger(output, _ver);
         }
 
-        oss.seekp(-1, std::ios_base::cur); // Remove last comma.
-
-        oss << " tilewidth=" << _tileWidth
-            << " tileheight=" << _tileHeight;
-        if (_ver >= 0)
+        if (_id >= 0)
         {
-            oss << " ver=" << _ver;
+            output += " id=";
+            LOOLProtocol::appendInteger(output, _id);
         }
 
-        if (_id >= 0)
+        if (_traceId >= 0)
         {
-            oss << " id=" << _id;
+            output += " trace=";
+            LOOLProtocol::appendInteger(output, _traceId);
         }
 
-        return oss.str();
+        return output;
     }
 
     /// Deserialize a TileDesc from a tokenized string.
     static
     TileCombined parse(const Poco::StringTokenizer& tokens)
     {
-        // We don't expect undocumented fields and
-        // assume all values to be int.
-        std::map<std::string, int> pairs;
-
-        // Optional.
-        pairs["ver"] = -1;
-        pairs["id"] = -1;
-
-        std::string tilePositionsX;
-        std::string tilePositionsY;
-        std::string imgSizes;
+        Fields fields;
         for (size_t i = 0; i < tokens.count(); ++i)
         {
-            std::string name;
-            std::string value;
-            if (LOOLProtocol::parseNameValuePair(tokens[i], name, value))
-            {
-                if (name == "tileposx")
-                {
-                    tilePositionsX = value;
-                }
-                else if (name == "tileposy")
-                {
-                    tilePositionsY = value;
-                }
-                else if (name == "imgsize")
-                {
-                    imgSizes = value;
-                }
-                else
-                {
-                    int v = 0;
-                    if (LOOLProtocol::stringToInteger(value, v))
-                    {
-                        pairs[name] = v;
-                    }
-                }
-            }
+            fields.parse(tokens[i].data(), tokens[i].size());
         }
 
-        return TileCombined(pairs["part"], pairs["width"], pairs["height"],
-                            tilePositionsX, tilePositionsY,
-                            pairs["tilewidth"], pairs["tileheight"],
-                            pairs["ver"],
-                            imgSizes, pairs["id"]);
+        return fields.create();
     }
 
     /// Deserialize a TileDesc from a string format.
     static
     TileCombined parse(const std::string& message)
     {
-        Poco::StringTokenizer tokens(message, " ",
-                                     Poco::StringTokenizer::TOK_IGNORE_EMPTY |
-                                     Poco::StringTokenizer::TOK_TRIM);
-        return parse(tokens);
+        return parse(message.data(), message.size());
+    }
+
+    /// Deserialize a TileCombined from a message, in a single pass and
+    /// without allocating anything but the tiles.
+    static
+    TileCombined parse(const char *message, const size_t length)
+    {
+        Fields fields;
+        fields.parse(message, length);
+        return fields.create();
     }
 
 private:
+    /// Appends the comma-separated values of the tiles.
+    template <typename Func>
+    void appendList(std::string& output, Func func) const
+    {
+        for (size_t i = 0; i < _tiles.size(); ++i)
+        {
+            if (i > 0)
+            {
+                output += ',';
+            }
+
+            LOOLProtocol::appendInteger(output, func(_tiles[i]));
+        }
+    }
+
+    /// The fields of a message being parsed, the lists still unparsed.
+    /// We don't expect undocumented fields and assume all values to be int.
+    struct Fields
+    {
+        int part = 0;
+        int width = 0;
+        int height = 0;
+        int tileWidth = 0;
+        int tileHeight = 0;
+        // Optional.
+        int ver = -1;
+        int id = -1;
+        int traceId = -1;
+
+        Range tilePositionsX;
+        Range tilePositionsY;
+        Range imgSizes;
+        Range solids;
+
+        void parse(const char *message, const size_t length)
+        {
+            LOOLProtocol::forEachNameValue(message, length,
+                [this](const char *name, const char *nameEnd, const char *value, const char *valueEnd)
+                {
+                    Range *list = getList(name, nameEnd);
+                    if (list)
+                    {
+                        list->begin = value;
+                        list->end = valueEnd;
+                        return;
+                    }
+
+                    int *field = getField(name, nameEnd);
+                    int parsed = 0;
+                    if (field && LOOLProtocol::parseInteger(value, valueEnd, parsed))
+                    {
+                        *field = parsed;
+                    }
+                });
+        }
+
+        Range *getList(const char *name, const char *nameEnd)
+        {
+            using LOOLProtocol::nameEquals;
+            if (nameEquals(name, nameEnd, "tileposx")) return &tilePositionsX;
+            if (nameEquals(name, nameEnd, "tileposy")) return &tilePositionsY;
+            if (nameEquals(name, nameEnd, "imgsize")) return &imgSizes;
+            if (nameEquals(name, nameEnd, "solid")) return &solids;
+            return nullptr;
+        }
+
+        int *getField(const char *name, const char *nameEnd)
+        {
+            using LOOLProtocol::nameEquals;
+            if (nameEquals(name, nameEnd, "part")) return &part;
+            if (nameEquals(name, nameEnd, "width")) return &width;
+            if (nameEquals(name, nameEnd, "height")) return &height;
+            if (nameEquals(name, nameEnd, "tilewidth")) return &tileWidth;
+            if (nameEquals(name, nameEnd, "tileheight")) return &tileHeight;
+            if (nameEquals(name, nameEnd, "ver")) return &ver;
+            if (nameEquals(name, nameEnd, "id")) return &id;
+            if (nameEquals(name, nameEnd, "trace")) return &traceId;
+            return nullptr;
+        }
+
+        TileCombined create() const
+        {
+            return TileCombined(part, width, height, tilePositionsX, tilePositionsY,
+                                tileWidth, tileHeight, ver, imgSizes, id, solids, traceId);
+        }
+    };
+
     std::vector<TileDesc> _tiles;
     int _part;
     int _width;
@@ -328,6 +493,7 @@ private:
     int _tileHeight;
     int _ver;       //< Versioning support.
     int _id;
+    int _traceId;   //< Of the request, in the traces.
 };
 
 #endif
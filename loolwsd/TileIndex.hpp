@@ -0,0 +1,208 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TILEINDEX_HPP
+#define INCLUDED_TILEINDEX_HPP
+
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// Spatial index of named tiles, per part, on a coarse grid of
+/// buckets in document coordinates (twips). Finding the tiles that
+/// intersect an area only visits the buckets the area overlaps.
+class TileIndex
+{
+public:
+    /// Size, in twips, of the square grid buckets.
+    static constexpr int64_t BucketSize = 7680;
+
+    /// Adds a tile, or moves it if the name is already indexed.
+    void insert(const std::string& name, const int part,
+                const int x, const int y, const int width, const int height)
+    {
+        remove(name);
+
+        const Entry entry = { part, x, y, width, height };
+        _entries.emplace(name, entry);
+
+        auto& buckets = _parts[part];
+        forEachBucket(entry, [&](const Bucket& bucket) { buckets[bucket].insert(name); });
+    }
+
+    void remove(const std::string& name)
+    {
+        const auto it = _entries.find(name);
+        if (it == _entries.end())
+        {
+            return;
+        }
+
+        const Entry& entry = it->second;
+        auto& buckets = _parts[entry.part];
+        forEachBucket(entry, [&](const Bucket& bucket)
+            {
+                const auto bucketIt = buckets.find(bucket);
+                if (bucketIt != buckets.end())
+                {
+                    bucketIt->second.erase(name);
+                    if (bucketIt->second.empty())
+                    {
+                        buckets.erase(bucketIt);
+                    }
+                }
+            });
+
+        if (buckets.empty())
+        {
+            _parts.erase(entry.part);
+        }
+
+        _entries.erase(it);
+    }
+
+    /// Returns the names of the tiles that intersect (or touch) the given area.
+    /// A part of -1 matches all parts.
+    std::vector<std::string> intersecting(const int part, const int x, const int y,
+                                          const int width, const int height) const
+    {
+        std::set<std::string> found;
+        const Entry area = { part, x, y, width, height };
+        for (const auto& partIt : _parts)
+        {
+            if (part != -1 && partIt.first != part)
+            {
+                continue;
+            }
+
+            const auto& buckets = partIt.second;
+            const Bucket first = bucketOf(x, y);
+            const Bucket last = bucketOf(static_cast<int64_t>(x) + width,
+                                         static_cast<int64_t>(y) + height);
+
+            // Buckets are ordered by row, then by column; skip over the
+            // columns outside the area instead of visiting every bucket.
+            auto it = buckets.lower_bound(first);
+            while (it != buckets.end() && it->first.first <= last.first)
+            {
+                const auto row = it->first.first;
+                const auto column = it->first.second;
+                if (column < first.second)
+                {
+                    it = buckets.lower_bound(Bucket(row, first.second));
+                    continue;
+                }
+
+                if (column > last.second)
+                {
+                    it = buckets.lower_bound(Bucket(row + 1, first.second));
+                    continue;
+                }
+
+                for (const auto& name : it->second)
+                {
+                    const auto entryIt = _entries.find(name);
+                    if (entryIt != _entries.end() && intersects(entryIt->second, area))
+                    {
+                        found.insert(name);
+                    }
+                }
+
+                ++it;
+            }
+        }
+
+        return std::vector<std::string>(found.begin(), found.end());
+    }
+
+    bool contains(const std::string& name) const { return _entries.find(name) != _entries.end(); }
+
+    size_t size() const { return _entries.size(); }
+
+    std::vector<std::string> getNames() const
+    {
+        std::vector<std::string> names;
+        names.reserve(_entries.size());
+        for (const auto& it : _entries)
+        {
+            names.push_back(it.first);
+        }
+
+        return names;
+    }
+
+    void clear()
+    {
+        _entries.clear();
+        _parts.clear();
+    }
+
+private:
+    struct Entry
+    {
+        int part;
+        int x;
+        int y;
+        int width;
+        int height;
+    };
+
+    /// Row and column of a grid bucket.
+    typedef std::pair<int64_t, int64_t> Bucket;
+
+    static int64_t floorDiv(const int64_t value)
+    {
+        return (value >= 0 ? value / BucketSize : -((-value + BucketSize - 1) / BucketSize));
+    }
+
+    static Bucket bucketOf(const int64_t x, const int64_t y)
+    {
+        return Bucket(floorDiv(y), floorDiv(x));
+    }
+
+    template <typename F>
+    static void forEachBucket(const Entry& entry, F func)
+    {
+        const Bucket first = bucketOf(entry.x, entry.y);
+        const Bucket last = bucketOf(static_cast<int64_t>(entry.x) + entry.width,
+                                     static_cast<int64_t>(entry.y) + entry.height);
+        for (auto row = first.first; row <= last.first; ++row)
+        {
+            for (auto column = first.second; column <= last.second; ++column)
+            {
+                func(Bucket(row, column));
+            }
+        }
+    }
+
+    /// Touching edges count as intersecting.
+    static bool intersects(const Entry& tile, const Entry& area)
+    {
+        const int64_t left = std::max<int64_t>(area.x, tile.x);
+        const int64_t right = std::min<int64_t>(static_cast<int64_t>(area.x) + area.width,
+                                                static_cast<int64_t>(tile.x) + tile.width);
+        const int64_t top = std::max<int64_t>(area.y, tile.y);
+        const int64_t bottom = std::min<int64_t>(static_cast<int64_t>(area.y) + area.height,
+                                                 static_cast<int64_t>(tile.y) + tile.height);
+        return (left <= right && top <= bottom);
+    }
+
+private:
+    std::unordered_map<std::string, Entry> _entries;
+    std::map<int, std::map<Bucket, std::set<std::string>>> _parts;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
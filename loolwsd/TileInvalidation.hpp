@@ -0,0 +1,225 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TILEINVALIDATION_HPP
+#define INCLUDED_TILEINVALIDATION_HPP
+
+#include <algorithm>
+#include <climits>
+#include <cstdint>
+#include <cstdlib>
+#include <set>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+/// The areas of the document the kit invalidated together, merged over the
+/// interval it waits for more, sent in one 'invalidatetiles:' message of a
+/// line each. wsd drops them from the tile cache at once, then renders again
+/// the tiles of them each view shows, ahead of the view asking for them.
+class TileInvalidation
+{
+public:
+    /// In twips. A part of -1 for all of them.
+    struct Area
+    {
+        Area(const int part = 0, const int x = 0, const int y = 0, const int width = 0, const int height = 0) :
+            _part(part),
+            _x(x),
+            _y(y),
+            _width(width),
+            _height(height)
+        {
+        }
+
+        int _part;
+        int _x;
+        int _y;
+        int _width;
+        int _height;
+    };
+
+    /// What a client shows, as it last told: 'clientvisiblearea' and 'clientzoom'.
+    struct View
+    {
+        View() :
+            _tilePixelWidth(0),
+            _tilePixelHeight(0),
+            _tileTwipWidth(0),
+            _tileTwipHeight(0)
+        {
+        }
+
+        bool isKnown() const
+        {
+            return (_visibleArea._width > 0 && _visibleArea._height > 0 &&
+                    _tilePixelWidth > 0 && _tilePixelHeight > 0 &&
+                    _tileTwipWidth > 0 && _tileTwipHeight > 0);
+        }
+
+        Area _visibleArea;
+        int _tilePixelWidth;
+        int _tilePixelHeight;
+        int _tileTwipWidth;
+        int _tileTwipHeight;
+    };
+
+    /// Returns false unless the line is 'invalidatetiles: EMPTY', the whole
+    /// document, or 'invalidatetiles: part=<n> x=<n> y=<n> width=<n> height=<n>'.
+    static bool parse(const std::string& line, Area& area)
+    {
+        std::istringstream iss(line);
+        std::string token;
+        if (!(iss >> token) || token != "invalidatetiles:")
+        {
+            return false;
+        }
+
+        std::vector<std::string> tokens;
+        while (iss >> token)
+        {
+            tokens.push_back(token);
+        }
+
+        if (tokens.size() == 1 && tokens[0] == "EMPTY")
+        {
+            area = Area(-1, 0, 0, INT_MAX, INT_MAX);
+            return true;
+        }
+
+        return (tokens.size() == 5 &&
+                getInteger(tokens[0], "part", area._part) &&
+                getInteger(tokens[1], "x", area._x) &&
+                getInteger(tokens[2], "y", area._y) &&
+                getInteger(tokens[3], "width", area._width) &&
+                getInteger(tokens[4], "height", area._height));
+    }
+
+    /// The areas of the lines of the message that parse.
+    static std::vector<Area> parseAll(const std::string& message)
+    {
+        std::vector<Area> areas;
+        std::istringstream iss(message);
+        std::string line;
+        Area area;
+        while (std::getline(iss, line))
+        {
+            if (parse(line, area))
+            {
+                areas.push_back(area);
+            }
+        }
+
+        return areas;
+    }
+
+    /// The tiles of the view that any of the areas touch, as the client
+    /// asks for them again, each once, by row. Those of the areas of all
+    /// the parts are left to the client, which alone knows the part it
+    /// shows. None if there are more than maxTiles, the view being that
+    /// large, or zoomed that far out, for the client to ask for those it
+    /// wants.
+    static std::vector<Area> getVisibleTiles(const std::vector<Area>& areas, const View& view,
+                                             const size_t maxTiles)
+    {
+        std::vector<Area> tiles;
+        if (!view.isKnown())
+        {
+            return tiles;
+        }
+
+        const Area& visible = view._visibleArea;
+        const int64_t tileWidth = view._tileTwipWidth;
+        const int64_t tileHeight = view._tileTwipHeight;
+
+        // By part, row and column.
+        std::set<std::pair<int, std::pair<int64_t, int64_t>>> positions;
+        for (const auto& area : areas)
+        {
+            if (area._part < 0)
+            {
+                continue;
+            }
+
+            // Touching edges count, as for the tile cache.
+            const int64_t left = std::max<int64_t>(std::max<int64_t>(area._x, visible._x), 0);
+            const int64_t top = std::max<int64_t>(std::max<int64_t>(area._y, visible._y), 0);
+            const int64_t right = std::min<int64_t>(static_cast<int64_t>(area._x) + area._width,
+                                                    static_cast<int64_t>(visible._x) + visible._width);
+            const int64_t bottom = std::min<int64_t>(static_cast<int64_t>(area._y) + area._height,
+                                                     static_cast<int64_t>(visible._y) + visible._height);
+            if (left > right || top > bottom)
+            {
+                continue;
+            }
+
+            const int64_t firstColumn = std::max<int64_t>((left + tileWidth - 1) / tileWidth - 1, 0);
+            const int64_t firstRow = std::max<int64_t>((top + tileHeight - 1) / tileHeight - 1, 0);
+            const int64_t columns = right / tileWidth - firstColumn + 1;
+            const int64_t rows = bottom / tileHeight - firstRow + 1;
+            if (columns > static_cast<int64_t>(maxTiles) || rows > static_cast<int64_t>(maxTiles) ||
+                columns * rows > static_cast<int64_t>(maxTiles))
+            {
+                return tiles;
+            }
+
+            for (int64_t row = firstRow; row < firstRow + rows; ++row)
+            {
+                for (int64_t column = firstColumn; column < firstColumn + columns; ++column)
+                {
+                    positions.insert(std::make_pair(area._part, std::make_pair(row, column)));
+                }
+            }
+
+            if (positions.size() > maxTiles)
+            {
+                return tiles;
+            }
+        }
+
+        for (const auto& position : positions)
+        {
+            const int64_t x = position.second.second * tileWidth;
+            const int64_t y = position.second.first * tileHeight;
+            if (x + tileWidth <= INT_MAX && y + tileHeight <= INT_MAX)
+            {
+                tiles.emplace_back(position.first, x, y, tileWidth, tileHeight);
+            }
+        }
+
+        return tiles;
+    }
+
+private:
+    /// Parses name=<integer>.
+    static bool getInteger(const std::string& token, const std::string& name, int& value)
+    {
+        if (token.size() <= name.size() + 1 || token[name.size()] != '=' ||
+            token.compare(0, name.size(), name) != 0)
+        {
+            return false;
+        }
+
+        const char* start = token.c_str() + name.size() + 1;
+        char* end = nullptr;
+        const long result = std::strtol(start, &end, 10);
+        if (*end != '\0' || result < INT_MIN || result > INT_MAX)
+        {
+            return false;
+        }
+
+        value = static_cast<int>(result);
+        return true;
+    }
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
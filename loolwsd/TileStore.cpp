@@ -0,0 +1,629 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "TileStore.hpp"
+#include "config.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <Poco/DigestEngine.h>
+#include <Poco/DirectoryIterator.h>
+#include <Poco/File.h>
+#include <Poco/SHA1Engine.h>
+
+#include "Log.hpp"
+#include "Util.hpp"
+
+using Poco::DirectoryIterator;
+using Poco::File;
+
+namespace
+{
+    /// Precedes every record in the slab, followed by the name and the data.
+    struct RecordHeader
+    {
+        uint32_t magic;
+        uint32_t nameSize;
+        uint32_t dataSize;
+        uint32_t flags;
+    };
+
+    constexpr uint32_t RecordMagic = 0x4c4f4f54; // "LOOT"
+    constexpr uint32_t RecordRemoved = 1;
+
+    constexpr size_t MinSlabCapacity = 1024 * 1024;
+
+    /// Don't bother compacting less garbage than this.
+    constexpr size_t MinCompactionGarbage = 4 * 1024 * 1024;
+
+    /// Blobs being written for longer are left over from a crash.
+    constexpr time_t StaleBlobSecs = 3600;
+}
+
+std::atomic<uint64_t> BlobTileStore::BlobsWritten(0);
+std::atomic<uint64_t> BlobTileStore::BlobsShared(0);
+std::atomic<uint64_t> BlobTileStore::BlobsCollected(0);
+
+std::unique_ptr<TileStore> TileStore::create(const std::string& type, const std::string& cacheDir,
+                                             const std::string& blobsDir)
+{
+    if (type == "slab")
+    {
+        return std::unique_ptr<TileStore>(new SlabTileStore(cacheDir));
+    }
+
+    if (type == "blobs")
+    {
+        if (!blobsDir.empty())
+        {
+            return std::unique_ptr<TileStore>(new BlobTileStore(cacheDir, blobsDir));
+        }
+
+        Log::warn("No directory for the tile blobs, using files.");
+    }
+    else if (type != "files")
+    {
+        Log::warn("Unknown tile store type [" + type + "], using files.");
+    }
+
+    return std::unique_ptr<TileStore>(new FileTileStore(cacheDir));
+}
+
+std::vector<std::string> FileTileStore::list()
+{
+    std::vector<std::string> names;
+
+    File dir(_cacheDir);
+    if (dir.exists() && dir.isDirectory())
+    {
+        for (auto it = DirectoryIterator(dir); it != DirectoryIterator(); ++it)
+        {
+            names.push_back(it.path().getFileName());
+        }
+    }
+
+    return names;
+}
+
+std::shared_ptr<std::vector<char>> FileTileStore::load(const std::string& name)
+{
+    std::fstream file(_cacheDir + "/" + name, std::ios::in);
+    if (!file.is_open())
+    {
+        return nullptr;
+    }
+
+    file.seekg(0, std::ios_base::end);
+    const std::streamsize size = file.tellg();
+    file.seekg(0, std::ios_base::beg);
+
+    auto result = std::make_shared<std::vector<char>>(size);
+    file.read(result->data(), size);
+    return result;
+}
+
+void FileTileStore::save(const std::string& name, const char *data, const size_t size)
+{
+    // Not to write through a link to a blob, left by a BlobTileStore.
+    const std::string path = _cacheDir + "/" + name;
+    ::unlink(path.c_str());
+
+    std::fstream outStream(path, std::ios::out);
+    outStream.write(data, size);
+    outStream.close();
+}
+
+void FileTileStore::remove(const std::string& name)
+{
+    Util::removeFile(_cacheDir + "/" + name);
+}
+
+void BlobTileStore::save(const std::string& name, const char *data, const size_t size)
+{
+    Poco::SHA1Engine digestEngine;
+    digestEngine.update(data, size);
+    const std::string hash = Poco::DigestEngine::digestToHex(digestEngine.digest());
+    const std::string blobPath = _blobsDir + "/" + hash.substr(0, 2) + "/" + hash;
+
+    // Linked aside then renamed over, to replace the previous tile at once.
+    const std::string path = _cacheDir + "/" + name;
+    const std::string tempPath = _cacheDir + "/.link." + name;
+    ::unlink(tempPath.c_str());
+    if (link(blobPath.c_str(), tempPath.c_str()) == 0)
+    {
+        ++BlobsShared;
+    }
+    else if (errno != ENOENT || !writeBlob(blobPath, data, size) ||
+             link(blobPath.c_str(), tempPath.c_str()) != 0)
+    {
+        // Too many links, another filesystem, or collected meanwhile.
+        Log::debug("Failed to link tile [" + name + "] to its blob, storing it apart.");
+        FileTileStore::save(name, data, size);
+        return;
+    }
+
+    if (rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        Log::syserror("Failed to store tile [" + path + "].");
+        ::unlink(tempPath.c_str());
+    }
+}
+
+bool BlobTileStore::writeBlob(const std::string& path, const char *data, const size_t size)
+{
+    static std::atomic<uint64_t> counter(0);
+
+    // Whole or not at all, for the other documents to link to.
+    const std::string tempPath = path + ".tmp" + std::to_string(getpid()) + '_' + std::to_string(++counter);
+    File(path.substr(0, path.rfind('/'))).createDirectories();
+    std::ofstream blob(tempPath, std::ios::binary | std::ios::trunc);
+    blob.write(data, size);
+    blob.close();
+    if (blob.fail() || rename(tempPath.c_str(), path.c_str()) != 0)
+    {
+        Log::syserror("Failed to write tile blob [" + path + "].");
+        ::unlink(tempPath.c_str());
+        return false;
+    }
+
+    ++BlobsWritten;
+    return true;
+}
+
+size_t BlobTileStore::collect(const std::string& blobsDir)
+{
+    size_t collected = 0;
+    const time_t now = time(nullptr);
+    File dir(blobsDir);
+    if (!dir.exists() || !dir.isDirectory())
+    {
+        return collected;
+    }
+
+    for (auto it = DirectoryIterator(dir); it != DirectoryIterator(); ++it)
+    {
+        const std::string subDir = it.path().toString();
+        struct stat st;
+        if (lstat(subDir.c_str(), &st) != 0 || !S_ISDIR(st.st_mode))
+        {
+            continue;
+        }
+
+        for (auto blobIt = DirectoryIterator(subDir); blobIt != DirectoryIterator(); ++blobIt)
+        {
+            // Left with the link of its name only, unless being written.
+            const std::string path = blobIt.path().toString();
+            if (lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_nlink == 1 &&
+                (path.find(".tmp") == std::string::npos || now - st.st_mtime > StaleBlobSecs) &&
+                ::unlink(path.c_str()) == 0)
+            {
+                ++collected;
+            }
+        }
+    }
+
+    BlobsCollected += collected;
+    return collected;
+}
+
+std::string BlobTileStore::getStats()
+{
+    std::ostringstream oss;
+    oss << "written=" << BlobsWritten
+        << " shared=" << BlobsShared
+        << " collected=" << BlobsCollected;
+    return oss.str();
+}
+
+size_t SlabTileStore::Record::getSize() const
+{
+    return sizeof(RecordHeader) + nameSize + dataSize;
+}
+
+SlabTileStore::SlabTileStore(const std::string& cacheDir) :
+    _path(cacheDir + "/tiles.slab"),
+    _fd(-1),
+    _map(nullptr),
+    _capacity(0),
+    _end(0),
+    _liveSize(0),
+    _compacting(false)
+{
+    _fd = open(_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (_fd < 0)
+    {
+        Log::syserror("Failed to open tile slab [" + _path + "].");
+        return;
+    }
+
+    struct stat st;
+    if (fstat(_fd, &st) == 0 && st.st_size > 0)
+    {
+        map(st.st_size);
+        scan();
+    }
+
+    Log::info() << "Opened tile slab [" << _path << "] with " << _index.size()
+                << " tiles, " << _liveSize << " of " << _end << " bytes live." << Log::end;
+}
+
+SlabTileStore::~SlabTileStore()
+{
+    waitForCompaction();
+
+    if (_map)
+    {
+        munmap(_map, _capacity);
+    }
+
+    if (_fd >= 0)
+    {
+        close(_fd);
+    }
+}
+
+std::vector<std::string> SlabTileStore::list()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    std::vector<std::string> names;
+    names.reserve(_index.size());
+    for (const auto& it : _index)
+    {
+        names.push_back(it.first);
+    }
+
+    return names;
+}
+
+std::shared_ptr<std::vector<char>> SlabTileStore::load(const std::string& name)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    const auto it = _index.find(name);
+    if (it == _index.end() || _map == nullptr)
+    {
+        return nullptr;
+    }
+
+    const Record& record = it->second;
+    const char *data = _map + record.offset + sizeof(RecordHeader) + record.nameSize;
+    return std::make_shared<std::vector<char>>(data, data + record.dataSize);
+}
+
+void SlabTileStore::save(const std::string& name, const char *data, const size_t size)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    const auto it = _index.find(name);
+    if (it != _index.end())
+    {
+        _liveSize -= it->second.getSize();
+        _index.erase(it);
+    }
+
+    const Record record = append(name, data, size, false);
+    if (record.nameSize > 0)
+    {
+        _index[name] = record;
+        _liveSize += record.getSize();
+    }
+
+    compactIfNeeded();
+}
+
+void SlabTileStore::remove(const std::string& name)
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    const auto it = _index.find(name);
+    if (it != _index.end())
+    {
+        _liveSize -= it->second.getSize();
+        _index.erase(it);
+
+        // Persist the removal, or the tile comes back when the slab is reopened.
+        append(name, nullptr, 0, true);
+
+        compactIfNeeded();
+    }
+}
+
+size_t SlabTileStore::getUsedSize()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _end;
+}
+
+size_t SlabTileStore::getLiveSize()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    return _liveSize;
+}
+
+void SlabTileStore::waitForCompaction()
+{
+    if (_compactionThread.joinable())
+    {
+        _compactionThread.join();
+    }
+}
+
+void SlabTileStore::scan()
+{
+    _index.clear();
+    _liveSize = 0;
+
+    size_t offset = 0;
+    Record record;
+    std::string name;
+    bool removed = false;
+    while (readRecord(offset, record, name, removed))
+    {
+        const auto it = _index.find(name);
+        if (it != _index.end())
+        {
+            _liveSize -= it->second.getSize();
+            _index.erase(it);
+        }
+
+        if (!removed)
+        {
+            _index[name] = record;
+            _liveSize += record.getSize();
+        }
+
+        offset += record.getSize();
+    }
+
+    // Anything after the last valid record is a torn write; overwrite it.
+    _end = offset;
+}
+
+bool SlabTileStore::readRecord(const size_t offset, Record& record, std::string& name, bool& removed) const
+{
+    if (_map == nullptr || offset + sizeof(RecordHeader) > _capacity)
+    {
+        return false;
+    }
+
+    RecordHeader header;
+    std::memcpy(&header, _map + offset, sizeof(header));
+    if (header.magic != RecordMagic || header.nameSize == 0 ||
+        offset + sizeof(RecordHeader) + header.nameSize + header.dataSize > _capacity)
+    {
+        return false;
+    }
+
+    record.offset = offset;
+    record.nameSize = header.nameSize;
+    record.dataSize = header.dataSize;
+    name.assign(_map + offset + sizeof(RecordHeader), header.nameSize);
+    removed = (header.flags & RecordRemoved);
+    return true;
+}
+
+SlabTileStore::Record SlabTileStore::append(const std::string& name, const char *data, const uint32_t size, const bool removed)
+{
+    Util::assertIsLocked(_mutex);
+
+    Record record = { _end, static_cast<uint32_t>(name.size()), size };
+    reserve(_end + record.getSize());
+    if (_end + record.getSize() > _capacity)
+    {
+        Log::error("Failed to store tile [" + name + "] in the slab.");
+        record.nameSize = 0;
+        return record;
+    }
+
+    // Write the header last, so a torn write is never taken for a valid record.
+    char *dest = _map + _end;
+    std::memcpy(dest + sizeof(RecordHeader), name.data(), name.size());
+    if (size > 0)
+    {
+        std::memcpy(dest + sizeof(RecordHeader) + name.size(), data, size);
+    }
+
+    const RecordHeader header = { RecordMagic, record.nameSize, record.dataSize,
+                                  removed ? RecordRemoved : 0 };
+    std::memcpy(dest, &header, sizeof(header));
+
+    _end += record.getSize();
+    return record;
+}
+
+void SlabTileStore::reserve(const size_t size)
+{
+    if (size <= _capacity || _fd < 0)
+    {
+        return;
+    }
+
+    size_t capacity = std::max(_capacity * 2, MinSlabCapacity);
+    while (capacity < size)
+    {
+        capacity *= 2;
+    }
+
+    map(capacity);
+}
+
+void SlabTileStore::map(const size_t capacity)
+{
+    if (_map)
+    {
+        munmap(_map, _capacity);
+        _map = nullptr;
+        _capacity = 0;
+    }
+
+    if (ftruncate(_fd, capacity) != 0)
+    {
+        Log::syserror("Failed to resize tile slab [" + _path + "].");
+        return;
+    }
+
+    void *map = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+    if (map == MAP_FAILED)
+    {
+        Log::syserror("Failed to map tile slab [" + _path + "].");
+        return;
+    }
+
+    _map = static_cast<char*>(map);
+    _capacity = capacity;
+}
+
+void SlabTileStore::compactIfNeeded()
+{
+    Util::assertIsLocked(_mutex);
+
+    const size_t garbage = _end - _liveSize;
+    if (_compacting || garbage < MinCompactionGarbage || garbage < _liveSize)
+    {
+        return;
+    }
+
+    // The previous compaction is done, it only needs reaping.
+    waitForCompaction();
+
+    _compacting = true;
+    _compactionThread = std::thread([this]() { compact(); });
+}
+
+void SlabTileStore::compact()
+{
+    Util::setThreadName("tile_compact");
+
+    std::vector<std::pair<std::string, Record>> live;
+    size_t snapshotEnd = 0;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        live.assign(_index.begin(), _index.end());
+        snapshotEnd = _end;
+    }
+
+    Log::debug() << "Compacting tile slab [" << _path << "] of " << snapshotEnd
+                 << " bytes with " << live.size() << " tiles." << Log::end;
+
+    const std::string newPath = _path + ".new";
+    const int newFd = open(newPath.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (newFd < 0)
+    {
+        Log::syserror("Failed to create [" + newPath + "].");
+        _compacting = false;
+        return;
+    }
+
+    // The slab is append-only. Records before the snapshot never change, so they
+    // are copied without holding the lock. Only compaction replaces _fd.
+    std::unordered_map<std::string, Record> index;
+    size_t end = 0;
+    std::vector<char> buffer;
+    for (const auto& it : live)
+    {
+        const auto size = it.second.getSize();
+        buffer.resize(size);
+        if (pread(_fd, buffer.data(), size, it.second.offset) != static_cast<ssize_t>(size) ||
+            pwrite(newFd, buffer.data(), size, end) != static_cast<ssize_t>(size))
+        {
+            Log::syserror("Failed to compact tile slab [" + _path + "].");
+            close(newFd);
+            Util::removeFile(newPath);
+            _compacting = false;
+            return;
+        }
+
+        Record record = it.second;
+        record.offset = end;
+        index[it.first] = record;
+        end += size;
+    }
+
+    std::unique_lock<std::mutex> lock(_mutex);
+
+    // Replay verbatim whatever was appended in the meantime, removals included.
+    const size_t tailSize = _end - snapshotEnd;
+    if (tailSize > 0 &&
+        pwrite(newFd, _map + snapshotEnd, tailSize, end) != static_cast<ssize_t>(tailSize))
+    {
+        Log::syserror("Failed to compact tile slab [" + _path + "].");
+        close(newFd);
+        Util::removeFile(newPath);
+        _compacting = false;
+        return;
+    }
+
+    Record record;
+    std::string name;
+    bool removed = false;
+    for (size_t offset = snapshotEnd; offset < _end && readRecord(offset, record, name, removed); )
+    {
+        if (removed)
+        {
+            index.erase(name);
+        }
+        else
+        {
+            Record moved = record;
+            moved.offset = end + (offset - snapshotEnd);
+            index[name] = moved;
+        }
+
+        offset += record.getSize();
+    }
+
+    end += tailSize;
+
+    if (rename(newPath.c_str(), _path.c_str()) != 0)
+    {
+        Log::syserror("Failed to replace tile slab [" + _path + "].");
+        close(newFd);
+        Util::removeFile(newPath);
+        _compacting = false;
+        return;
+    }
+
+    const size_t oldEnd = _end;
+    munmap(_map, _capacity);
+    _map = nullptr;
+    _capacity = 0;
+    close(_fd);
+
+    _fd = newFd;
+    _end = end;
+    _index = std::move(index);
+    _liveSize = 0;
+    for (const auto& it : _index)
+    {
+        _liveSize += it.second.getSize();
+    }
+
+    map(std::max(MinSlabCapacity, end));
+
+    Log::info() << "Compacted tile slab [" << _path << "] from " << oldEnd
+                << " to " << _end << " bytes." << Log::end;
+
+    _compacting = false;
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,177 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+// Persistent storage of the tiles of a TileCache.
+#ifndef INCLUDED_TILESTORE_HPP
+#define INCLUDED_TILESTORE_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+/// Base class of the on-disk layouts of the encoded tiles of one document.
+/// Tiles are identified by their cache name. The TileCache makes all the
+/// calls under its cache mutex, so they need not be serialized here, but
+/// against the threads of a store of its own: SlabTileStore takes its own
+/// mutex in each, for its compaction thread.
+class TileStore
+{
+public:
+    virtual ~TileStore() {}
+
+    /// Returns the names of all the stored tiles.
+    virtual std::vector<std::string> list() = 0;
+
+    /// Returns the tile data, or nullptr if not stored.
+    virtual std::shared_ptr<std::vector<char>> load(const std::string& name) = 0;
+
+    /// Stores the tile, replacing any previous one of the same name.
+    virtual void save(const std::string& name, const char *data, const size_t size) = 0;
+
+    virtual void remove(const std::string& name) = 0;
+
+    /// TileStore creation factory.
+    /// type is "files" (the default), "slab", or "blobs", whose blobs are
+    /// shared by the documents under blobsDir.
+    static std::unique_ptr<TileStore> create(const std::string& type, const std::string& cacheDir,
+                                             const std::string& blobsDir = std::string());
+};
+
+/// One PNG file per tile in the cache directory.
+class FileTileStore : public TileStore
+{
+public:
+    FileTileStore(const std::string& cacheDir) :
+        _cacheDir(cacheDir)
+    {
+    }
+
+    std::vector<std::string> list() override;
+
+    std::shared_ptr<std::vector<char>> load(const std::string& name) override;
+
+    void save(const std::string& name, const char *data, const size_t size) override;
+
+    void remove(const std::string& name) override;
+
+protected:
+    const std::string _cacheDir;
+};
+
+/// One file per tile in the cache directory, as FileTileStore, each a hard
+/// link to a blob named by the hash of its content, shared by all the tiles
+/// of all the documents that are the same: those of the blank pages, the
+/// templates and the letterheads are stored once, and read once into the
+/// page cache. The links to a blob count its references: a blob left with
+/// none, as its tiles are replaced or removed, is removed by collect().
+class BlobTileStore : public FileTileStore
+{
+public:
+    BlobTileStore(const std::string& cacheDir, const std::string& blobsDir) :
+        FileTileStore(cacheDir),
+        _blobsDir(blobsDir)
+    {
+    }
+
+    void save(const std::string& name, const char *data, const size_t size) override;
+
+    /// Removes the blobs no tile refers to. Returns the number removed.
+    static size_t collect(const std::string& blobsDir);
+
+    /// The blobs written, those linked to instead, and those removed.
+    static std::string getStats();
+
+private:
+    /// Creates the blob of the data, unless there. Returns false on failure.
+    bool writeBlob(const std::string& path, const char *data, const size_t size);
+
+private:
+    const std::string _blobsDir;
+
+    static std::atomic<uint64_t> BlobsWritten;
+    static std::atomic<uint64_t> BlobsShared;
+    static std::atomic<uint64_t> BlobsCollected;
+};
+
+/// All tiles packed in a single append-only, memory-mapped file.
+/// Replaced and removed tiles leave garbage behind, which is
+/// reclaimed by compacting into a new file in the background.
+class SlabTileStore : public TileStore
+{
+public:
+    SlabTileStore(const std::string& cacheDir);
+    ~SlabTileStore();
+
+    std::vector<std::string> list() override;
+
+    std::shared_ptr<std::vector<char>> load(const std::string& name) override;
+
+    void save(const std::string& name, const char *data, const size_t size) override;
+
+    void remove(const std::string& name) override;
+
+    /// Bytes used in the slab, including the garbage.
+    size_t getUsedSize();
+    /// Bytes of the tiles still referenced.
+    size_t getLiveSize();
+
+    /// Blocks until any running compaction is done.
+    void waitForCompaction();
+
+private:
+    /// Location of a record in the slab.
+    struct Record
+    {
+        size_t offset;
+        uint32_t nameSize;
+        uint32_t dataSize;
+
+        size_t getSize() const;
+    };
+
+    /// Rebuilds the index from the slab contents.
+    void scan();
+
+    /// Reads the record at offset, if it is complete and valid.
+    bool readRecord(const size_t offset, Record& record, std::string& name, bool& removed) const;
+
+    /// Appends a record and returns it.
+    Record append(const std::string& name, const char *data, const uint32_t size, const bool removed);
+
+    /// Grows the file and its mapping to hold at least size bytes.
+    void reserve(const size_t size);
+    void map(const size_t capacity);
+
+    void compactIfNeeded();
+    void compact();
+
+private:
+    const std::string _path;
+    int _fd;
+    char *_map;
+    size_t _capacity;
+    /// End of the last record.
+    size_t _end;
+    size_t _liveSize;
+    std::unordered_map<std::string, Record> _index;
+
+    /// Guards everything above against the compaction thread.
+    std::mutex _mutex;
+    std::thread _compactionThread;
+    std::atomic<bool> _compacting;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
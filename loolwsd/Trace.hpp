@@ -0,0 +1,317 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_TRACE_HPP
+#define INCLUDED_TRACE_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/// The stages of the tile requests that carry a trace=<id>, timestamped
+/// into a ring buffer per thread. The kits send theirs to wsd, which keeps
+/// them with its own, to be dumped as Chrome trace events.
+/// The timestamps are of the monotonic clock, which all processes share.
+namespace Trace
+{
+    enum class Stage : unsigned char
+    {
+        ClientRequest,  //< wsd: the tile request of the client parsed.
+        CacheHit,       //< wsd: sent from the cache.
+        RenderRequest,  //< wsd: sent to the kit to render.
+        KitReceived,    //< kit: queued for the render thread.
+        RenderStart,    //< kit: taken off the queue.
+        Painted,        //< kit: paintPartTile returned.
+        Encoded,        //< kit: the images encoded.
+        KitSent,        //< kit: the response sent.
+        BrokerResponse, //< wsd: the response received from the kit.
+        ClientSent,     //< wsd: the tile sent to the subscribers.
+        Count
+    };
+
+    inline const char* getStageName(const Stage stage)
+    {
+        static const char* names[] =
+        {
+            "client_request", "cache_hit", "render_request", "kit_received", "render_start",
+            "painted", "encoded", "kit_sent", "broker_response", "client_sent"
+        };
+        return stage < Stage::Count ? names[static_cast<size_t>(stage)] : "unknown";
+    }
+
+    struct Event
+    {
+        int64_t traceId;
+        int64_t timeUs;
+        int pid;
+        int tid;
+        Stage stage;
+    };
+
+    /// The events of one thread, the oldest overwritten once full. Only the
+    /// thread writes, so the lock is contended only by the dumps.
+    class Buffer
+    {
+    public:
+        static const size_t Capacity = 4096;
+
+        Buffer() :
+            _events(Capacity),
+            _next(0),
+            _taken(0)
+        {
+        }
+
+        void record(const Event& event)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _events[_next % Capacity] = event;
+            ++_next;
+        }
+
+        /// Appends the events held, or only those not taken before.
+        void collect(std::vector<Event>& events, const bool take)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            const uint64_t oldest = (_next > Capacity ? _next - Capacity : 0);
+            for (uint64_t i = (take ? std::max(oldest, _taken) : oldest); i < _next; ++i)
+            {
+                events.push_back(_events[i % Capacity]);
+            }
+
+            if (take)
+            {
+                _taken = _next;
+            }
+        }
+
+    private:
+        std::mutex _mutex;
+        std::vector<Event> _events;
+        uint64_t _next;
+        uint64_t _taken;
+    };
+
+    /// The buffers of all threads. Those of finished threads are
+    /// kept for the threads started later, so they are never lost nor
+    /// more than the threads running at once.
+    class Registry
+    {
+    public:
+        static Registry& instance()
+        {
+            static Registry registry;
+            return registry;
+        }
+
+        std::shared_ptr<Buffer> acquire()
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            if (!_free.empty())
+            {
+                auto buffer = _free.back();
+                _free.pop_back();
+                return buffer;
+            }
+
+            _buffers.push_back(std::make_shared<Buffer>());
+            return _buffers.back();
+        }
+
+        void release(const std::shared_ptr<Buffer>& buffer)
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _free.push_back(buffer);
+        }
+
+        std::vector<Event> collect(const bool take)
+        {
+            std::vector<std::shared_ptr<Buffer>> buffers;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                buffers = _buffers;
+            }
+
+            std::vector<Event> events;
+            for (const auto& buffer : buffers)
+            {
+                buffer->collect(events, take);
+            }
+
+            std::sort(events.begin(), events.end(),
+                      [](const Event& a, const Event& b) { return a.timeUs < b.timeUs; });
+            return events;
+        }
+
+    private:
+        std::mutex _mutex;
+        std::vector<std::shared_ptr<Buffer>> _buffers;
+        std::vector<std::shared_ptr<Buffer>> _free;
+    };
+
+    /// The buffer of the calling thread, handed back when it finishes.
+    inline Buffer& getThreadBuffer()
+    {
+        struct Holder
+        {
+            Holder() : _buffer(Registry::instance().acquire()) {}
+            ~Holder() { Registry::instance().release(_buffer); }
+            std::shared_ptr<Buffer> _buffer;
+        };
+
+        static thread_local Holder holder;
+        return *holder._buffer;
+    }
+
+    inline int64_t now()
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /// Records the stage of the request, unless it isn't traced.
+    inline void record(const int64_t traceId, const Stage stage)
+    {
+        if (traceId < 0)
+        {
+            return;
+        }
+
+        static thread_local const int tid = syscall(SYS_gettid);
+        getThreadBuffer().record(Event{ traceId, now(), getpid(), tid, stage });
+    }
+
+    /// The events not sent before, as "<id>,<stage>,<us>,<pid>,<tid> ...", for the kits to send.
+    inline std::string takeEvents()
+    {
+        std::ostringstream oss;
+        for (const auto& event : Registry::instance().collect(true))
+        {
+            oss << ' ' << event.traceId << ',' << static_cast<unsigned>(event.stage) << ','
+                << event.timeUs << ',' << event.pid << ',' << event.tid;
+        }
+
+        return oss.str();
+    }
+
+    /// Keeps the events sent by a kit with those of the calling thread.
+    /// Returns the number of them merged.
+    inline size_t mergeEvents(const std::string& events)
+    {
+        size_t merged = 0;
+        std::istringstream iss(events);
+        std::string item;
+        while (iss >> item)
+        {
+            // The id, stage, time, pid and tid, all of them.
+            int64_t values[5];
+            size_t count = 0;
+            const char* pos = item.c_str();
+            char* end = nullptr;
+            for (; count < 5; ++count)
+            {
+                values[count] = std::strtoll(pos, &end, 10);
+                if (end == pos || (*end != ',' && *end != '\0'))
+                {
+                    break;
+                }
+
+                pos = end + 1;
+                if (*end == '\0')
+                {
+                    ++count;
+                    break;
+                }
+            }
+
+            if (count != 5 || *end != '\0' ||
+                values[1] < 0 || values[1] >= static_cast<int64_t>(Stage::Count))
+            {
+                continue;
+            }
+
+            Event event;
+            event.traceId = values[0];
+            event.timeUs = values[2];
+            event.pid = values[3];
+            event.tid = values[4];
+            event.stage = static_cast<Stage>(values[1]);
+            getThreadBuffer().record(event);
+            ++merged;
+        }
+
+        return merged;
+    }
+
+    /// All the events held, in the JSON of the Chrome trace viewer (chrome://tracing).
+    /// Each stage is an instant on its thread, and each request a span across them.
+    inline std::string dumpJson()
+    {
+        const auto events = Registry::instance().collect(false);
+
+        std::ostringstream oss;
+        oss << "{\"traceEvents\":[";
+        bool first = true;
+        const auto separate = [&oss, &first]() { oss << (first ? "" : ","); first = false; };
+        for (const auto& event : events)
+        {
+            separate();
+            oss << "{\"name\":\"" << getStageName(event.stage) << "\",\"cat\":\"tile\",\"ph\":\"i\",\"s\":\"t\""
+                << ",\"ts\":" << event.timeUs << ",\"pid\":" << event.pid << ",\"tid\":" << event.tid
+                << ",\"args\":{\"trace\":" << event.traceId << "}}";
+        }
+
+        // The spans, from the first to the last stage of each request.
+        std::vector<const Event*> byId;
+        for (const auto& event : events)
+        {
+            byId.push_back(&event);
+        }
+
+        std::stable_sort(byId.begin(), byId.end(),
+                         [](const Event* a, const Event* b) { return a->traceId < b->traceId; });
+        for (size_t i = 0; i < byId.size(); )
+        {
+            size_t last = i;
+            while (last + 1 < byId.size() && byId[last + 1]->traceId == byId[i]->traceId)
+            {
+                ++last;
+            }
+
+            const std::pair<char, const Event*> ends[] = { { 'b', byId[i] }, { 'e', byId[last] } };
+            for (const auto& end : ends)
+            {
+                separate();
+                oss << "{\"name\":\"tile " << end.second->traceId << "\",\"cat\":\"tile\",\"ph\":\""
+                    << end.first << "\",\"id\":" << end.second->traceId
+                    << ",\"ts\":" << end.second->timeUs << ",\"pid\":" << byId[i]->pid << ",\"tid\":" << byId[i]->tid
+                    << '}';
+            }
+
+            i = last + 1;
+        }
+
+        oss << "]}";
+        return oss.str();
+    }
+}
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -132,9 +132,9 @@ UnitWSD::~UnitWSD()
 }
 
 void UnitWSD::lookupTile(int part, int width, int height, int tilePosX, int tilePosY,
-                         int tileWidth, int tileHeight, std::unique_ptr<std::fstream>& cacheFile)
+                         int tileWidth, int tileHeight, std::shared_ptr<std::vector<char>>& tile)
 {
-    if (cacheFile && cacheFile->is_open())
+    if (tile)
     {
         onTileCacheHit(part, width, height, tilePosX, tilePosY, tileWidth, tileHeight);
     }
@@ -158,7 +158,7 @@ void UnitBase::exitTest(TestResult result)
     _retValue = result == TestResult::TEST_OK ?
         Poco::Util::Application::EXIT_OK :
         Poco::Util::Application::EXIT_SOFTWARE;
-    TerminationFlag = true;
+    Util::setTerminationFlag();
 }
 
 void UnitBase::timeout()
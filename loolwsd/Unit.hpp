@@ -12,6 +12,7 @@
 #include <string>
 #include <memory>
 #include <atomic>
+#include <vector>
 #include <assert.h>
 
 #include <Poco/Net/WebSocket.h>
@@ -141,7 +142,7 @@ public:
     // ---------------- TileCache hooks ----------------
     /// Called before the lookupTile call returns. Should always be called to fire events.
     virtual void lookupTile(int part, int width, int height, int tilePosX, int tilePosY,
-                            int tileWidth, int tileHeight, std::unique_ptr<std::fstream>& cacheFile);
+                            int tileWidth, int tileHeight, std::shared_ptr<std::vector<char>>& tile);
 
     // ---------------- WSD events ----------------
     virtual void onChildConnected(const int /* pid */, const std::string& /* sessionId */) {}
@@ -149,6 +150,8 @@ public:
     virtual void onAdminNotifyMessage(const std::string& /* message */) {}
     /// When admin message is sent in response to a query
     virtual void onAdminQueryMessage(const std::string& /* message */) {}
+    /// When the first tile is sent, with the timings of the startup phases as JSON
+    virtual void onStartupReport(const std::string& /* report */) {}
 
     // ---------------- TileCache events ----------------
     virtual void onTileCacheHit(int /*part*/, int /*width*/, int /*height*/,
@@ -12,15 +12,19 @@
 
 #include <execinfo.h>
 #include <signal.h>
+#include <sys/eventfd.h>
 #include <sys/poll.h>
 #include <sys/prctl.h>
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <atomic>
 #include <cassert>
+#include <cstdint>
 #include <cstdlib>
 #include <cstring>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <mutex>
@@ -202,12 +206,69 @@ namespace Util
         }
     }
 
+    namespace
+    {
+        std::atomic<int> TerminationFd(-1);
+        /// The process TerminationFd belongs to, the children
+        /// forked by ForKit inherit that of their parent.
+        std::atomic<pid_t> TerminationFdPid(0);
+        std::mutex TerminationFdMutex;
+    }
+
+    void setTerminationFlag()
+    {
+        TerminationFlag = true;
+
+        if (TerminationFdPid == getpid())
+        {
+            const uint64_t one = 1;
+            if (write(TerminationFd, &one, sizeof(one)) < 0)
+            {
+                Log::signalLog("Failed to wake up on termination.\n");
+            }
+        }
+    }
+
+    int getTerminationFd()
+    {
+        const pid_t pid = getpid();
+        if (TerminationFdPid == pid)
+        {
+            return TerminationFd;
+        }
+
+        std::unique_lock<std::mutex> lock(TerminationFdMutex);
+        if (TerminationFdPid != pid)
+        {
+            const int fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+            if (fd < 0)
+            {
+                Log::syserror("Failed to create termination eventfd.");
+            }
+
+            const int inherited = TerminationFd.exchange(fd);
+            if (inherited >= 0)
+            {
+                close(inherited);
+            }
+
+            TerminationFdPid = pid;
+            if (TerminationFlag)
+            {
+                // Flagged before we could be woken up.
+                setTerminationFlag();
+            }
+        }
+
+        return TerminationFd;
+    }
+
     static
     void handleTerminationSignal(const int signal)
     {
         if (!TerminationFlag)
         {
-            TerminationFlag = true;
+            setTerminationFlag();
 
             Log::signalLogPrefix();
             Log::signalLog(" Termination signal received: ");
@@ -324,35 +385,128 @@ namespace Util
         }
     }
 
-    int getMemoryUsage(const Poco::Process::PID nPid)
+    bool parseMemoryStats(std::istream& smaps, MemoryStats& stats)
     {
-        //TODO: Instead of RSS, return PSS
-        const auto cmd = "ps o rss= -p " + std::to_string(nPid);
-        FILE* fp = popen(cmd.c_str(), "r");
-        if (fp == nullptr)
+        bool found = false;
+        std::string line;
+        while (std::getline(smaps, line))
+        {
+            // Only the "Name:   1234 kB" lines, not the mappings, nor the flags.
+            const auto colon = line.find(':');
+            if (colon == std::string::npos || line.size() < colon + 3 ||
+                line.compare(line.size() - 3, 3, " kB") != 0)
+            {
+                continue;
+            }
+
+            const auto field = line.substr(0, colon);
+            size_t* total = nullptr;
+            if (field == "Rss")
+                total = &stats.rss;
+            else if (field == "Pss")
+                total = &stats.pss;
+            else if (field == "Private_Clean" || field == "Private_Dirty")
+                total = &stats.uss;
+            else if (field == "Shared_Clean" || field == "Shared_Dirty")
+                total = &stats.shared;
+            else if (field == "Swap")
+                total = &stats.swap;
+
+            if (total)
+            {
+                *total += std::strtoul(line.c_str() + colon + 1, nullptr, 10);
+                found = true;
+            }
+        }
+
+        return found;
+    }
+
+    bool getMemoryStats(const Poco::Process::PID pid, MemoryStats& stats)
+    {
+        const std::string procPath = "/proc/" + std::to_string(pid);
+        for (const auto& name : { "/smaps_rollup", "/smaps" })
+        {
+            std::ifstream smaps(procPath + name);
+            MemoryStats read;
+            if (smaps && parseMemoryStats(smaps, read))
+            {
+                stats = read;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    size_t getResidentMemory(const Poco::Process::PID pid)
+    {
+        std::ifstream statm("/proc/" + std::to_string(pid) + "/statm");
+        size_t size = 0;
+        size_t resident = 0;
+        if (!(statm >> size >> resident))
         {
             return 0;
         }
 
-        std::string sResponse;
-        char cmdBuffer[1024];
-        while (fgets(cmdBuffer, sizeof(cmdBuffer) - 1, fp) != nullptr)
+        return resident * (getpagesize() / 1024);
+    }
+
+    long parseCpuTime(const std::string& stat)
+    {
+        // The name, in parentheses, may have spaces, or parentheses.
+        const auto end = stat.rfind(')');
+        if (end == std::string::npos)
         {
-            sResponse += cmdBuffer;
+            return -1;
         }
-        pclose(fp);
 
-        int nMem = -1;
-        try
+        // The state is the 3rd field, utime and stime the 14th and 15th.
+        std::istringstream iss(stat.substr(end + 1));
+        std::string field;
+        for (int i = 3; i < 14 && (iss >> field); ++i)
         {
-            nMem = std::stoi(sResponse);
         }
-        catch(std::exception& e)
+
+        unsigned long utime = 0;
+        unsigned long stime = 0;
+        if (!(iss >> utime >> stime))
+        {
+            return -1;
+        }
+
+        static const long ticksPerSecond = sysconf(_SC_CLK_TCK);
+        return (utime + stime) * 1000 / (ticksPerSecond > 0 ? ticksPerSecond : 100);
+    }
+
+    long getCpuTime(const Poco::Process::PID pid)
+    {
+        std::ifstream statFile("/proc/" + std::to_string(pid) + "/stat");
+        std::string stat;
+        if (!std::getline(statFile, stat))
+        {
+            return -1;
+        }
+
+        return parseCpuTime(stat);
+    }
+
+    int getMemoryUsage(const Poco::Process::PID nPid)
+    {
+        MemoryStats stats;
+        if (getMemoryStats(nPid, stats))
+        {
+            return stats.pss;
+        }
+
+        const auto rss = getResidentMemory(nPid);
+        if (rss == 0)
         {
             Log::warn() << "Trying to find memory of invalid/dead PID" << Log::end;
+            return -1;
         }
 
-        return nMem;
+        return rss;
     }
 
     std::string replace(const std::string& s, const std::string& a, const std::string& b)
@@ -366,6 +520,18 @@ namespace Util
         return result;
     }
 
+    bool equalsConstantTime(const std::string& a, const std::string& b)
+    {
+        unsigned char diff = (a.size() != b.size() ? 1 : 0);
+        const size_t size = std::max(a.size(), b.size());
+        for (size_t i = 0; i < size; ++i)
+        {
+            diff |= static_cast<unsigned char>((i < a.size() ? a[i] : 0) ^ (i < b.size() ? b[i] : 0));
+        }
+
+        return diff == 0;
+    }
+
     std::string formatLinesForLog(const std::string& s)
     {
         std::string r;
@@ -381,6 +547,7 @@ namespace Util
     {
         if (prctl(PR_SET_NAME, reinterpret_cast<unsigned long>(s.c_str()), 0, 0, 0) != 0)
             Log::syserror("Cannot set thread name to " + s + ".");
+        Log::setThreadName(s);
     }
 
     void displayVersionInfo(const char *app)
@@ -86,16 +86,63 @@ namespace Util
     /// Returns the name of the signal.
     const char *signalName(int signo);
 
+    /// Sets TerminationFlag and wakes up those waiting on getTerminationFd().
+    /// Async-signal-safe.
+    void setTerminationFlag();
+
+    /// A descriptor that becomes readable for good once setTerminationFlag()
+    /// is called in this process, or -1 if it couldn't be created.
+    int getTerminationFd();
+
     /// Trap signals to cleanup and exit the process gracefully.
     void setTerminationSignals();
     void setFatalSignals();
 
     void requestTermination(const Poco::Process::PID& pid);
 
+    /// The memory of a process, in KB.
+    struct MemoryStats
+    {
+        size_t rss = 0;
+        /// Proportional: the shared pages are divided among the processes sharing them.
+        size_t pss = 0;
+        /// Unique: the private pages, freed with the process.
+        size_t uss = 0;
+        /// The pages shared with other processes, ForKit and the other kits mostly.
+        size_t shared = 0;
+        size_t swap = 0;
+    };
+
+    /// Adds up the fields of each mapping in the smaps (or smaps_rollup) format.
+    /// Returns false if none were found.
+    bool parseMemoryStats(std::istream& smaps, MemoryStats& stats);
+
+    /// Reads /proc/<pid>/smaps_rollup, or the slower smaps of kernels before 4.14.
+    /// Returns false if those aren't readable: the process is gone or not dumpable.
+    bool getMemoryStats(const Poco::Process::PID pid, MemoryStats& stats);
+
+    /// Returns the resident memory in KB, 0 if the process is gone.
+    /// Cheap, from /proc/<pid>/statm, but counts the shared pages in full.
+    size_t getResidentMemory(const Poco::Process::PID pid);
+
+    /// Returns the PSS of the process in KB, or its resident memory when
+    /// that can't be read, -1 if it's gone.
     int getMemoryUsage(const Poco::Process::PID nPid);
 
+    /// The CPU time, user and system, in the /proc/<pid>/stat line, in ms.
+    /// Returns -1 if it isn't in that format.
+    long parseCpuTime(const std::string& stat);
+
+    /// Returns the CPU time the process used in ms, -1 if it's gone.
+    /// Cheap, a line of /proc/<pid>/stat.
+    long getCpuTime(const Poco::Process::PID pid);
+
     std::string replace(const std::string& s, const std::string& a, const std::string& b);
 
+    /// Compares in a time that only depends on the sizes, for the
+    /// secrets compared not to be guessed a character at a time.
+    bool equalsConstantTime(const std::string& a, const std::string& b);
+
     std::string formatLinesForLog(const std::string& s);
 
     void setThreadName(const std::string& s);
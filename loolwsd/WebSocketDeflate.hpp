@@ -0,0 +1,377 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_WEBSOCKETDEFLATE_HPP
+#define INCLUDED_WEBSOCKETDEFLATE_HPP
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/// The permessage-deflate extension of WebSocket (RFC 7692), for the
+/// messages to a client that offers it: those large enough to gain, and
+/// not images, which are compressed already. The messages refer to those
+/// sent before them on the connection, through the context it keeps,
+/// unless the client asks otherwise. The client is asked to keep none,
+/// for its messages, small, to be inflated without a window per connection.
+/// The contexts are created on first use, then reused.
+class WebSocketDeflate
+{
+public:
+    /// The counters of all the connections.
+    struct Stats
+    {
+        std::atomic<uint64_t> _compressed;
+        std::atomic<uint64_t> _skipped;
+        std::atomic<uint64_t> _bytesIn;
+        std::atomic<uint64_t> _bytesOut;
+        std::atomic<uint64_t> _deflateUs;
+        std::atomic<uint64_t> _inflated;
+        std::atomic<uint64_t> _inflateUs;
+    };
+
+    static Stats& getCounters()
+    {
+        static Stats stats;
+        return stats;
+    }
+
+    /// The counters, for the admin console.
+    static std::string getStats()
+    {
+        const Stats& stats = getCounters();
+        std::ostringstream oss;
+        oss << "compressed=" << stats._compressed
+            << " skipped=" << stats._skipped
+            << " bytes_in=" << stats._bytesIn
+            << " bytes_out=" << stats._bytesOut
+            << " deflate_us=" << stats._deflateUs
+            << " inflated=" << stats._inflated
+            << " inflate_us=" << stats._inflateUs;
+        return oss.str();
+    }
+
+    /// The extension accepted, to send back in Sec-WebSocket-Extensions,
+    /// from the offers of a client, by preference. Empty to decline them all.
+    /// noContextTakeover and windowBits are what the client asks of us.
+    static std::string negotiate(const std::string& offers, bool& noContextTakeover, int& windowBits)
+    {
+        std::istringstream offerStream(offers);
+        std::string offer;
+        while (std::getline(offerStream, offer, ','))
+        {
+            std::istringstream paramStream(offer);
+            std::string param;
+            std::getline(paramStream, param, ';');
+            if (trim(param) != "permessage-deflate")
+            {
+                continue;
+            }
+
+            bool accepted = true;
+            std::set<std::string> names;
+            noContextTakeover = false;
+            windowBits = MaxWindowBits;
+            while (accepted && std::getline(paramStream, param, ';'))
+            {
+                param = trim(param);
+                const auto equal = param.find('=');
+                const std::string name = trim(param.substr(0, equal));
+                std::string value = (equal == std::string::npos ? std::string() : trim(param.substr(equal + 1)));
+                if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+                {
+                    value = value.substr(1, value.size() - 2);
+                }
+
+                if (!names.insert(name).second)
+                {
+                    accepted = false;
+                }
+                else if (name == "server_no_context_takeover" && value.empty())
+                {
+                    noContextTakeover = true;
+                }
+                else if (name == "server_max_window_bits")
+                {
+                    // zlib can't deflate with a window of 8 bits.
+                    windowBits = std::atoi(value.c_str());
+                    accepted = (windowBits >= MinWindowBits && windowBits <= MaxWindowBits);
+                }
+                else if (name != "client_no_context_takeover" && name != "client_max_window_bits")
+                {
+                    accepted = false;
+                }
+            }
+
+            if (accepted)
+            {
+                std::string response = "permessage-deflate; client_no_context_takeover";
+                if (noContextTakeover)
+                {
+                    response += "; server_no_context_takeover";
+                }
+
+                if (names.count("server_max_window_bits"))
+                {
+                    response += "; server_max_window_bits=" + std::to_string(windowBits);
+                }
+
+                return response;
+            }
+        }
+
+        return std::string();
+    }
+
+    /// level is that of zlib, messages under minSize are sent as they are.
+    WebSocketDeflate(const int level, const size_t minSize,
+                     const bool noContextTakeover = false, const int windowBits = MaxWindowBits) :
+        _level(level),
+        _minSize(minSize),
+        _noContextTakeover(noContextTakeover),
+        _windowBits(windowBits),
+        _deflating(false),
+        _inflating(false)
+    {
+    }
+
+    ~WebSocketDeflate()
+    {
+        if (_deflating)
+        {
+            deflateEnd(&_deflate);
+        }
+
+        if (_inflating)
+        {
+            inflateEnd(&_inflate);
+        }
+    }
+
+    WebSocketDeflate(const WebSocketDeflate&) = delete;
+    WebSocketDeflate& operator=(const WebSocketDeflate&) = delete;
+
+    /// Whether the message is worth compressing: large enough,
+    /// and without an image after its first line.
+    bool isCompressible(const char* data, const size_t size) const
+    {
+        if (size < _minSize)
+        {
+            return false;
+        }
+
+        const char* newline = static_cast<const char*>(std::memchr(data, '\n', std::min(size, static_cast<size_t>(FirstLineMaxSize))));
+        return (!newline || static_cast<size_t>(data + size - newline) <= PngSignatureSize ||
+                std::memcmp(newline + 1, "\x89PNG", PngSignatureSize) != 0);
+    }
+
+    /// Compresses a whole message into out. Returns false, the context
+    /// being reset, if it doesn't get smaller: sent as is, it isn't there
+    /// for the next messages to refer to.
+    bool compress(const char* data, const size_t size, std::vector<char>& out)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        if (!deflateInto(data, size, out, Z_SYNC_FLUSH) || out.size() < TailSize || out.size() - TailSize >= size)
+        {
+            if (_deflating)
+            {
+                deflateReset(&_deflate);
+            }
+
+            ++getCounters()._skipped;
+            return false;
+        }
+
+        endMessage(size, out, start);
+        return true;
+    }
+
+    /// Compresses a part of a message sent in fragments into out, the
+    /// first fragment to carry the flag of the compression. Returns false
+    /// if it failed, the message then being cut short.
+    bool compressPart(const char* data, const size_t size, std::vector<char>& out, const bool final)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        if (!deflateInto(data, size, out, final ? Z_SYNC_FLUSH : Z_NO_FLUSH))
+        {
+            return false;
+        }
+
+        if (final)
+        {
+            endMessage(size, out, start);
+        }
+        else
+        {
+            Stats& stats = getCounters();
+            stats._bytesIn += size;
+            stats._bytesOut += out.size();
+            stats._deflateUs += std::chrono::duration_cast<std::chrono::microseconds>(
+                                    std::chrono::steady_clock::now() - start).count();
+        }
+
+        return true;
+    }
+
+    /// Inflates a message of the client in place. Returns false if it
+    /// is not valid, or would be larger than maxSize.
+    bool decompress(std::vector<char>& payload, const size_t maxSize)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        if (!_inflating)
+        {
+            std::memset(&_inflate, 0, sizeof(_inflate));
+            if (inflateInit2(&_inflate, -MaxWindowBits) != Z_OK)
+            {
+                return false;
+            }
+
+            _inflating = true;
+        }
+        else
+        {
+            // The client keeps no context either.
+            inflateReset(&_inflate);
+        }
+
+        const char* tail = "\x00\x00\xff\xff";
+        payload.insert(payload.end(), tail, tail + TailSize);
+        _inflate.next_in = reinterpret_cast<Bytef*>(payload.data());
+        _inflate.avail_in = payload.size();
+
+        size_t used = 0;
+        _buffer.resize(0);
+        for (;;)
+        {
+            if (used == _buffer.size())
+            {
+                _buffer.resize(used + std::max<size_t>(payload.size() * 4, 4096));
+            }
+
+            _inflate.next_out = reinterpret_cast<Bytef*>(_buffer.data() + used);
+            _inflate.avail_out = _buffer.size() - used;
+            const int result = inflate(&_inflate, Z_SYNC_FLUSH);
+            used = _buffer.size() - _inflate.avail_out;
+            if (used > maxSize || (result != Z_OK && result != Z_BUF_ERROR && result != Z_STREAM_END))
+            {
+                return false;
+            }
+
+            if (result == Z_STREAM_END || (_inflate.avail_in == 0 && _inflate.avail_out > 0))
+            {
+                break;
+            }
+        }
+
+        _buffer.resize(used);
+        payload.swap(_buffer);
+
+        ++getCounters()._inflated;
+        getCounters()._inflateUs += std::chrono::duration_cast<std::chrono::microseconds>(
+                                     std::chrono::steady_clock::now() - start).count();
+        return true;
+    }
+
+private:
+    /// Of the 00 00 ff ff ending the data flushed, removed from the end of each message.
+    static constexpr size_t TailSize = 4;
+    static constexpr size_t PngSignatureSize = 4;
+    /// Where the first line of a message with an image ends at most.
+    static constexpr size_t FirstLineMaxSize = 1024;
+    static constexpr int MinWindowBits = 9;
+    static constexpr int MaxWindowBits = 15;
+
+    static std::string trim(const std::string& text)
+    {
+        const auto first = text.find_first_not_of(" \t");
+        const auto last = text.find_last_not_of(" \t");
+        return (first == std::string::npos ? std::string() : text.substr(first, last - first + 1));
+    }
+
+    /// Deflates the data into out, replacing what it held.
+    bool deflateInto(const char* data, const size_t size, std::vector<char>& out, const int flush)
+    {
+        if (!_deflating)
+        {
+            std::memset(&_deflate, 0, sizeof(_deflate));
+            if (deflateInit2(&_deflate, _level, Z_DEFLATED, -_windowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+            {
+                return false;
+            }
+
+            _deflating = true;
+        }
+
+        _deflate.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        _deflate.avail_in = size;
+
+        size_t used = 0;
+        out.resize(0);
+        do
+        {
+            out.resize(used + std::max<size_t>(size / 2, 1024));
+            _deflate.next_out = reinterpret_cast<Bytef*>(out.data() + used);
+            _deflate.avail_out = out.size() - used;
+            const int result = deflate(&_deflate, flush);
+            used = out.size() - _deflate.avail_out;
+            if (result != Z_OK && result != Z_BUF_ERROR)
+            {
+                return false;
+            }
+        }
+        while (_deflate.avail_out == 0);
+
+        out.resize(used);
+        return true;
+    }
+
+    /// Removes the tail of the message compressed, and counts it.
+    void endMessage(const size_t size, std::vector<char>& out,
+                    const std::chrono::steady_clock::time_point start)
+    {
+        out.resize(out.size() - TailSize);
+        if (_noContextTakeover)
+        {
+            deflateReset(&_deflate);
+        }
+
+        Stats& stats = getCounters();
+        ++stats._compressed;
+        stats._bytesIn += size;
+        stats._bytesOut += out.size();
+        stats._deflateUs += std::chrono::duration_cast<std::chrono::microseconds>(
+                                std::chrono::steady_clock::now() - start).count();
+    }
+
+private:
+    const int _level;
+    const size_t _minSize;
+    const bool _noContextTakeover;
+    const int _windowBits;
+    /// To the client, under the lock of sending.
+    z_stream _deflate;
+    bool _deflating;
+    /// From the client, by the one reading its socket.
+    z_stream _inflate;
+    bool _inflating;
+    std::vector<char> _buffer;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,140 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_WORKQUEUE_HPP
+#define INCLUDED_WORKQUEUE_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Log.hpp"
+#include "Util.hpp"
+
+/// A thread running the tasks posted to it, one at a time and in order.
+/// Or as many threads, each running the next task, in parallel.
+/// The last task may destroy the WorkQueue itself: the thread then
+/// finishes on its own instead of being joined.
+class WorkQueue
+{
+public:
+    typedef std::function<void()> Task;
+
+    WorkQueue(const std::string& name, const size_t threads = 1) :
+        _state(std::make_shared<State>())
+    {
+        auto state = _state;
+        for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i)
+        {
+            const auto threadName = (threads > 1 ? name + '_' + std::to_string(i) : name);
+            _threads.emplace_back([state, threadName]()
+                {
+                    Util::setThreadName(threadName);
+                    run(*state);
+                });
+        }
+    }
+
+    ~WorkQueue()
+    {
+        {
+            std::unique_lock<std::mutex> lock(_state->_mutex);
+            _state->_stop = true;
+        }
+
+        // Those still pending are run before the threads finish.
+        _state->_cv.notify_all();
+        for (auto& thread : _threads)
+        {
+            if (thread.get_id() == std::this_thread::get_id())
+            {
+                thread.detach();
+            }
+            else
+            {
+                thread.join();
+            }
+        }
+    }
+
+    WorkQueue(const WorkQueue&) = delete;
+    WorkQueue& operator=(const WorkQueue&) = delete;
+
+    void post(Task task)
+    {
+        {
+            std::unique_lock<std::mutex> lock(_state->_mutex);
+            _state->_tasks.push_back(std::move(task));
+        }
+
+        _state->_cv.notify_one();
+    }
+
+private:
+    /// Shared with the thread, which may outlive us.
+    struct State
+    {
+        State() :
+            _stop(false)
+        {
+        }
+
+        std::mutex _mutex;
+        std::condition_variable _cv;
+        std::deque<Task> _tasks;
+        bool _stop;
+    };
+
+    /// Runs the tasks until stopped, then those still pending.
+    static void run(State& state)
+    {
+        std::unique_lock<std::mutex> lock(state._mutex);
+        for (;;)
+        {
+            state._cv.wait(lock, [&state]() { return state._stop || !state._tasks.empty(); });
+            if (state._tasks.empty())
+            {
+                return;
+            }
+
+            Task task = std::move(state._tasks.front());
+            state._tasks.pop_front();
+
+            lock.unlock();
+            try
+            {
+                task();
+            }
+            catch (const std::exception& exc)
+            {
+                Log::error() << "WorkQueue: Exception: " << exc.what() << Log::end;
+            }
+
+            // Release what the task holds before taking the lock,
+            // this may well be the owner of the queue.
+            task = nullptr;
+            lock.lock();
+        }
+    }
+
+private:
+    std::shared_ptr<State> _state;
+    std::vector<std::thread> _threads;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
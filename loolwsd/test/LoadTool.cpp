@@ -0,0 +1,436 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Poco/Net/AcceptCertificateHandler.h>
+#include <Poco/Net/Context.h>
+#include <Poco/Net/SSLManager.h>
+#include <Poco/Net/WebSocket.h>
+#include <Poco/StringTokenizer.h>
+#include <Poco/URI.h>
+#include <Poco/Util/Application.h>
+#include <Poco/Util/HelpFormatter.h>
+#include <Poco/Util/Option.h>
+#include <Poco/Util/OptionSet.h>
+
+#include "helpers.hpp"
+#include "latencies.hpp"
+
+using Poco::StringTokenizer;
+using Poco::Util::Application;
+using Poco::Util::HelpFormatter;
+using Poco::Util::Option;
+using Poco::Util::OptionSet;
+
+/// A user editing a document: typing, scrolling and zooming, as loleaflet
+/// sends them, while a thread of its own times the responses.
+class User
+{
+public:
+    User(const std::string& name, const std::shared_ptr<Poco::Net::WebSocket>& ws,
+         Latencies& latencies, const unsigned seed) :
+        _name(name),
+        _ws(ws),
+        _latencies(latencies),
+        _random(seed),
+        _docHeight(0),
+        _stop(false),
+        _tileTwips(3840),
+        _scrollY(0)
+    {
+    }
+
+    void start(const Clock::time_point end, const std::chrono::milliseconds interval)
+    {
+        _reader = std::thread([this]() { read(); });
+        _writer = std::thread([this, end, interval]() { write(end, interval); });
+    }
+
+    void join()
+    {
+        _writer.join();
+        _stop = true;
+        _reader.join();
+    }
+
+private:
+    void send(const std::string& message)
+    {
+        std::unique_lock<std::mutex> lock(_sendMutex);
+        _ws->sendFrame(message.data(), message.size());
+    }
+
+    /// Picks an action, most often a keystroke, then waits for the next.
+    void write(const Clock::time_point end, const std::chrono::milliseconds interval)
+    {
+        try
+        {
+            send("status");
+            std::uniform_int_distribution<int> actions(0, 99);
+            while (Clock::now() < end)
+            {
+                const int action = actions(_random);
+                if (action < 75)
+                    type();
+                else if (action < 95)
+                    scroll();
+                else
+                    zoom();
+
+                std::this_thread::sleep_for(interval);
+            }
+        }
+        catch (const std::exception& exc)
+        {
+            std::cerr << _name << "stopped sending: " << exc.what() << std::endl;
+        }
+    }
+
+    void type()
+    {
+        std::uniform_int_distribution<int> letters('a', 'z');
+        const int letter = letters(_random);
+        {
+            std::unique_lock<std::mutex> lock(_pendingMutex);
+            _pendingKeys.push_back(Clock::now());
+        }
+
+        send("key type=input char=" + std::to_string(letter) + " key=0");
+        send("key type=up char=0 key=0");
+    }
+
+    /// Down by a row of tiles, back to the top at the end of the document.
+    void scroll()
+    {
+        const int docHeight = _docHeight;
+        _scrollY += _tileTwips;
+        if (docHeight > 0 && _scrollY + 4 * _tileTwips > docHeight)
+        {
+            _scrollY = 0;
+        }
+
+        send("clientvisiblearea x=0 y=" + std::to_string(_scrollY) +
+             " width=" + std::to_string(4 * _tileTwips) + " height=" + std::to_string(4 * _tileTwips));
+        requestViewport();
+    }
+
+    /// Between 50% and 200%.
+    void zoom()
+    {
+        static const int zooms[] = { 7680, 5120, 3840, 2560, 1920 };
+        std::uniform_int_distribution<int> choices(0, sizeof(zooms) / sizeof(zooms[0]) - 1);
+        _tileTwips = zooms[choices(_random)];
+        _scrollY = 0;
+
+        send("clientzoom tilepixelwidth=256 tilepixelheight=256 tiletwipwidth=" +
+             std::to_string(_tileTwips) + " tiletwipheight=" + std::to_string(_tileTwips));
+        requestViewport();
+    }
+
+    /// The 4x4 tiles of the viewport in one tilecombine, as loleaflet requests them.
+    void requestViewport()
+    {
+        std::string posX;
+        std::string posY;
+        const auto now = Clock::now();
+        std::unique_lock<std::mutex> lock(_pendingMutex);
+        for (int y = 0; y < 4; ++y)
+        {
+            for (int x = 0; x < 4; ++x)
+            {
+                const int tileX = x * _tileTwips;
+                const int tileY = _scrollY + y * _tileTwips;
+                posX += (posX.empty() ? "" : ",") + std::to_string(tileX);
+                posY += (posY.empty() ? "" : ",") + std::to_string(tileY);
+
+                // Only the first request of the tile is timed.
+                _pendingTiles.emplace(getTileKey(tileX, tileY, _tileTwips), now);
+            }
+        }
+
+        lock.unlock();
+        send("tilecombine part=0 width=256 height=256 tileposx=" + posX + " tileposy=" + posY +
+             " tilewidth=" + std::to_string(_tileTwips) + " tileheight=" + std::to_string(_tileTwips));
+    }
+
+    static std::string getTileKey(const int x, const int y, const int twips)
+    {
+        return std::to_string(x) + ',' + std::to_string(y) + ',' + std::to_string(twips);
+    }
+
+    void read()
+    {
+        try
+        {
+            _ws->setReceiveTimeout(0);
+            std::vector<char> buffer(READ_BUFFER_SIZE * 100);
+            const Poco::Timespan waitTime(100000);
+            while (!_stop)
+            {
+                if (!_ws->poll(waitTime, Poco::Net::Socket::SELECT_READ))
+                {
+                    continue;
+                }
+
+                int flags = 0;
+                int bytes = _ws->receiveFrame(buffer.data(), buffer.size(), flags);
+                if (bytes <= 0 || (flags & Poco::Net::WebSocket::FRAME_OP_BITMASK) == Poco::Net::WebSocket::FRAME_OP_CLOSE)
+                {
+                    break;
+                }
+
+                std::string line = LOOLProtocol::getFirstLine(buffer.data(), bytes);
+                int size = 0;
+                if (line.find("nextmessage:") == 0 &&
+                    LOOLProtocol::getTokenInteger(line.substr(line.find(' ') + 1), "size", size) && size > 0)
+                {
+                    buffer.resize(std::max(buffer.size(), static_cast<size_t>(size)));
+                    bytes = _ws->receiveFrame(buffer.data(), buffer.size(), flags);
+                    line = LOOLProtocol::getFirstLine(buffer.data(), std::max(bytes, 0));
+                }
+
+                handleMessage(line);
+            }
+        }
+        catch (const std::exception& exc)
+        {
+            std::cerr << _name << "stopped reading: " << exc.what() << std::endl;
+        }
+    }
+
+    void handleMessage(const std::string& line)
+    {
+        const auto now = Clock::now();
+        if (line.find("invalidatetiles:") == 0)
+        {
+            // The keystrokes typed so far are on screen once repainted.
+            std::unique_lock<std::mutex> lock(_pendingMutex);
+            for (const auto& sent : _pendingKeys)
+            {
+                _latencies.add("keystroke_to_invalidate", now - sent);
+            }
+
+            _pendingKeys.clear();
+        }
+        else if (line.find("tile:") == 0)
+        {
+            StringTokenizer tokens(line, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+            int x = 0;
+            int y = 0;
+            int twips = 0;
+            if (LOOLProtocol::getTokenInteger(tokens, "tileposx", x) &&
+                LOOLProtocol::getTokenInteger(tokens, "tileposy", y) &&
+                LOOLProtocol::getTokenInteger(tokens, "tilewidth", twips))
+            {
+                std::unique_lock<std::mutex> lock(_pendingMutex);
+                const auto it = _pendingTiles.find(getTileKey(x, y, twips));
+                if (it != _pendingTiles.end())
+                {
+                    _latencies.add("tile_request_to_response", now - it->second);
+                    _pendingTiles.erase(it);
+                }
+            }
+        }
+        else if (line.find("status:") == 0)
+        {
+            StringTokenizer tokens(line, " ", StringTokenizer::TOK_IGNORE_EMPTY | StringTokenizer::TOK_TRIM);
+            int height = 0;
+            if (LOOLProtocol::getTokenInteger(tokens, "height", height))
+            {
+                _docHeight = height;
+            }
+        }
+    }
+
+private:
+    const std::string _name;
+    std::shared_ptr<Poco::Net::WebSocket> _ws;
+    Latencies& _latencies;
+    std::mt19937 _random;
+    std::atomic<int> _docHeight;
+    std::atomic<bool> _stop;
+
+    /// Only the writer thread changes these.
+    int _tileTwips;
+    int _scrollY;
+
+    std::mutex _sendMutex;
+    std::mutex _pendingMutex;
+    std::deque<Clock::time_point> _pendingKeys;
+    std::map<std::string, Clock::time_point> _pendingTiles;
+
+    std::thread _writer;
+    std::thread _reader;
+};
+
+/** Simulates users editing documents on a running loolwsd, for its capacity.
+    The latencies are printed a JSON object per line. */
+class LoadTool: public Poco::Util::Application
+{
+public:
+    LoadTool();
+    ~LoadTool() {}
+
+protected:
+    void defineOptions(Poco::Util::OptionSet& options) override;
+    void handleOption(const std::string& name, const std::string& value) override;
+    int  main(const std::vector<std::string>& args) override;
+
+private:
+    std::string _server;
+    unsigned _users;
+    unsigned _documents;
+    unsigned _duration;
+    unsigned _interval;
+};
+
+LoadTool::LoadTool() :
+    _server(helpers::getTestServerURI()),
+    _users(10),
+    _documents(2),
+    _duration(60),
+    _interval(200)
+{
+}
+
+void LoadTool::defineOptions(OptionSet& optionSet)
+{
+    Application::defineOptions(optionSet);
+
+    optionSet.addOption(Option("help", "", "Display help information on command line arguments.")
+                        .required(false).repeatable(false));
+    optionSet.addOption(Option("server", "", "URI of the loolwsd to load, the local one by default")
+                        .required(false).repeatable(false)
+                        .argument("uri"));
+    optionSet.addOption(Option("users", "", "number of simulated users")
+                        .required(false).repeatable(false)
+                        .argument("count"));
+    optionSet.addOption(Option("documents", "", "number of documents the users are spread over")
+                        .required(false).repeatable(false)
+                        .argument("count"));
+    optionSet.addOption(Option("duration", "", "how long the users edit, in seconds")
+                        .required(false).repeatable(false)
+                        .argument("seconds"));
+    optionSet.addOption(Option("interval", "", "the pause of each user between actions, in ms")
+                        .required(false).repeatable(false)
+                        .argument("ms"));
+}
+
+void LoadTool::handleOption(const std::string& optionName,
+                            const std::string& value)
+{
+    Application::handleOption(optionName, value);
+
+    if (optionName == "help")
+    {
+        HelpFormatter helpFormatter(options());
+        helpFormatter.setCommand(commandName());
+        helpFormatter.setUsage("OPTIONS [document...]");
+        helpFormatter.setHeader("LibreOffice On-Line load generator: users typing, scrolling and zooming, "
+                                "in copies of the documents given, of the test documents by default.");
+        helpFormatter.format(std::cout);
+        std::exit(Application::EXIT_OK);
+    }
+    else if (optionName == "server")
+        _server = value;
+    else if (optionName == "users")
+        _users = std::max(std::stoi(value), 1);
+    else if (optionName == "documents")
+        _documents = std::max(std::stoi(value), 1);
+    else if (optionName == "duration")
+        _duration = std::max(std::stoi(value), 1);
+    else if (optionName == "interval")
+        _interval = std::max(std::stoi(value), 1);
+}
+
+int LoadTool::main(const std::vector<std::string>& args)
+{
+#if ENABLE_SSL
+    Poco::Net::initializeSSL();
+    // Just accept the certificate anyway, as the tests do.
+    Poco::SharedPtr<Poco::Net::InvalidCertificateHandler> invalidCertHandler = new Poco::Net::AcceptCertificateHandler(false);
+    Poco::Net::Context::Params sslParams;
+    Poco::Net::Context::Ptr sslContext = new Poco::Net::Context(Poco::Net::Context::CLIENT_USE, sslParams);
+    Poco::Net::SSLManager::instance().initializeClient(0, invalidCertHandler, sslContext);
+#endif
+
+    // Text, spreadsheet and presentation, in turn.
+    std::vector<std::string> sources(args);
+    if (sources.empty())
+    {
+        sources = { "hello.odt", "load12.ods", "insert-delete.odp" };
+    }
+
+    std::vector<std::string> documentURLs;
+    for (unsigned i = 0; i < _documents; ++i)
+    {
+        std::string documentPath;
+        std::string documentURL;
+        helpers::getDocumentPathAndURL(sources[i % sources.size()].c_str(), documentPath, documentURL);
+        documentURLs.push_back(documentURL);
+    }
+
+    // Loaded one after the other, the first view of each document first.
+    const Poco::URI uri(_server);
+    Latencies latencies;
+    std::vector<std::unique_ptr<User>> users;
+    try
+    {
+        for (unsigned i = 0; i < _users; ++i)
+        {
+            const std::string name = "user" + std::to_string(i) + ' ';
+            auto ws = helpers::loadDocAndGetSocket(uri, documentURLs[i % _documents], name, i >= _documents);
+            users.emplace_back(new User(name, ws, latencies, i));
+        }
+    }
+    catch (const std::exception& exc)
+    {
+        std::cerr << "Failed to load the documents: " << exc.what() << std::endl;
+        return Application::EXIT_SOFTWARE;
+    }
+
+    std::cerr << _users << " users editing " << _documents << " documents for " << _duration << " s." << std::endl;
+    const auto end = Clock::now() + std::chrono::seconds(_duration);
+    for (auto& user : users)
+    {
+        user->start(end, std::chrono::milliseconds(_interval));
+    }
+
+    for (auto& user : users)
+    {
+        user->join();
+    }
+
+    latencies.report(_duration);
+
+#if ENABLE_SSL
+    Poco::Net::uninitializeSSL();
+#endif
+    return Application::EXIT_OK;
+}
+
+POCO_APP_MAIN(LoadTool)
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
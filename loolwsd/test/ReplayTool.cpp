@@ -0,0 +1,430 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "config.h"
+
+#include <dirent.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Poco/Net/AcceptCertificateHandler.h>
+#include <Poco/Net/Context.h>
+#include <Poco/Net/HTTPRequest.h>
+#include <Poco/Net/HTTPResponse.h>
+#include <Poco/Net/SSLManager.h>
+#include <Poco/Net/WebSocket.h>
+#include <Poco/URI.h>
+#include <Poco/Util/Application.h>
+#include <Poco/Util/HelpFormatter.h>
+#include <Poco/Util/Option.h>
+#include <Poco/Util/OptionSet.h>
+
+#include "SessionRecord.hpp"
+#include "helpers.hpp"
+#include "latencies.hpp"
+
+using Poco::Util::Application;
+using Poco::Util::HelpFormatter;
+using Poco::Util::Option;
+using Poco::Util::OptionSet;
+
+/// How long a message waits for its reply at most, then is unanswered.
+static const std::chrono::seconds ReplyTimeout(10);
+
+/// A session recorded, replayed on a connection of its own: its messages
+/// sent at their times, scaled, while a thread of its own times the replies.
+class Session
+{
+public:
+    Session(const std::string& name, const std::vector<SessionRecord::Entry>& entries, Latencies& latencies) :
+        _name(name),
+        _entries(entries),
+        _latencies(latencies),
+        _stop(false),
+        _unanswered(0)
+    {
+    }
+
+    int64_t getFirstMs() const { return _entries.empty() ? 0 : _entries.front()._ms; }
+    size_t getMessageCount() const { return _entries.size(); }
+    size_t getUnanswered() const { return _unanswered; }
+
+    void connect(const Poco::URI& server, const std::string& uri)
+    {
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri);
+        Poco::Net::HTTPResponse response;
+        _ws = helpers::connectLOKit(server, request, response, _name);
+    }
+
+    /// The message recorded at firstMs is sent at startTime, the others after
+    /// it by their times divided by speed, or at once for a speed of 0.
+    void start(const Clock::time_point startTime, const int64_t firstMs, const double speed)
+    {
+        _reader = std::thread([this]() { read(); });
+        _writer = std::thread([this, startTime, firstMs, speed]() { write(startTime, firstMs, speed); });
+    }
+
+    /// Once all sent, waits for the replies still awaited.
+    void join()
+    {
+        _writer.join();
+        const auto end = Clock::now() + ReplyTimeout;
+        while (_replies.size() > 0 && Clock::now() < end)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+
+        _stop = true;
+        _reader.join();
+        _unanswered += _replies.size();
+    }
+
+private:
+    void write(const Clock::time_point startTime, const int64_t firstMs, const double speed)
+    {
+        try
+        {
+            for (const auto& entry : _entries)
+            {
+                if (speed > 0)
+                {
+                    std::this_thread::sleep_until(startTime + std::chrono::microseconds(
+                                                  static_cast<int64_t>((entry._ms - firstMs) * 1000 / speed)));
+                }
+
+                _replies.sent(LOOLProtocol::getFirstLine(entry._message), Clock::now());
+                _ws->sendFrame(entry._message.data(), entry._message.size());
+            }
+        }
+        catch (const std::exception& exc)
+        {
+            std::cerr << _name << "stopped sending: " << exc.what() << std::endl;
+        }
+    }
+
+    void read()
+    {
+        try
+        {
+            _ws->setReceiveTimeout(0);
+            std::vector<char> buffer(READ_BUFFER_SIZE * 100);
+            const Poco::Timespan waitTime(100000);
+            while (!_stop)
+            {
+                _unanswered += _replies.expire(Clock::now(), ReplyTimeout);
+                if (!_ws->poll(waitTime, Poco::Net::Socket::SELECT_READ))
+                {
+                    continue;
+                }
+
+                int flags = 0;
+                int bytes = _ws->receiveFrame(buffer.data(), buffer.size(), flags);
+                if (bytes <= 0 || (flags & Poco::Net::WebSocket::FRAME_OP_BITMASK) == Poco::Net::WebSocket::FRAME_OP_CLOSE)
+                {
+                    break;
+                }
+
+                std::string line = LOOLProtocol::getFirstLine(buffer.data(), bytes);
+                int size = 0;
+                if (line.find("nextmessage:") == 0 &&
+                    LOOLProtocol::getTokenInteger(line.substr(line.find(' ') + 1), "size", size) && size > 0)
+                {
+                    buffer.resize(std::max(buffer.size(), static_cast<size_t>(size)));
+                    bytes = _ws->receiveFrame(buffer.data(), buffer.size(), flags);
+                    line = LOOLProtocol::getFirstLine(buffer.data(), std::max(bytes, 0));
+                }
+
+                for (const auto& latency : _replies.received(line, Clock::now()))
+                {
+                    _latencies.add(latency.first, latency.second);
+                }
+            }
+        }
+        catch (const std::exception& exc)
+        {
+            std::cerr << _name << "stopped reading: " << exc.what() << std::endl;
+        }
+    }
+
+private:
+    const std::string _name;
+    const std::vector<SessionRecord::Entry> _entries;
+    Latencies& _latencies;
+    SessionRecord::Replies _replies;
+    std::shared_ptr<Poco::Net::WebSocket> _ws;
+    std::atomic<bool> _stop;
+    std::atomic<size_t> _unanswered;
+
+    std::thread _writer;
+    std::thread _reader;
+};
+
+/// The CPU time of the process and of all its descendants, the kits, in ms.
+/// Those gone meanwhile are not counted.
+static long getTreeCpuTime(const int root)
+{
+    std::map<int, std::pair<int, long>> processes;
+    DIR* dir = opendir("/proc");
+    if (!dir)
+    {
+        return -1;
+    }
+
+    while (struct dirent* entry = readdir(dir))
+    {
+        const int pid = std::atoi(entry->d_name);
+        if (pid <= 0)
+        {
+            continue;
+        }
+
+        std::ifstream statFile("/proc/" + std::to_string(pid) + "/stat");
+        std::string stat;
+        if (!std::getline(statFile, stat) || stat.rfind(')') == std::string::npos)
+        {
+            continue;
+        }
+
+        // The parent follows the state, after the name.
+        std::istringstream iss(stat.substr(stat.rfind(')') + 1));
+        std::string state;
+        int parent = 0;
+        iss >> state >> parent;
+        processes[pid] = std::make_pair(parent, Util::parseCpuTime(stat));
+    }
+
+    closedir(dir);
+
+    long total = 0;
+    for (const auto& it : processes)
+    {
+        for (int pid = it.first; pid > 1; )
+        {
+            if (pid == root)
+            {
+                total += std::max(it.second.second, 0L);
+                break;
+            }
+
+            const auto parent = processes.find(pid);
+            pid = (parent != processes.end() ? parent->second.first : 0);
+        }
+    }
+
+    return total;
+}
+
+/** Replays the sessions recorded by a loolwsd, with session_record set, against
+    another, for the latencies of the replies by the kind of message, and the
+    CPU time of the server. All is printed a JSON object per line. */
+class ReplayTool: public Poco::Util::Application
+{
+public:
+    ReplayTool();
+    ~ReplayTool() {}
+
+protected:
+    void defineOptions(Poco::Util::OptionSet& options) override;
+    void handleOption(const std::string& name, const std::string& value) override;
+    int  main(const std::vector<std::string>& args) override;
+
+private:
+    std::string _server;
+    std::string _document;
+    double _speed;
+    int _pid;
+};
+
+ReplayTool::ReplayTool() :
+    _server(helpers::getTestServerURI()),
+    _speed(1),
+    _pid(0)
+{
+}
+
+void ReplayTool::defineOptions(OptionSet& optionSet)
+{
+    Application::defineOptions(optionSet);
+
+    optionSet.addOption(Option("help", "", "Display help information on command line arguments.")
+                        .required(false).repeatable(false));
+    optionSet.addOption(Option("server", "", "URI of the loolwsd to replay against, the local one by default")
+                        .required(false).repeatable(false)
+                        .argument("uri"));
+    optionSet.addOption(Option("document", "", "URL of the document to load instead of the one recorded, a copy of it")
+                        .required(false).repeatable(false)
+                        .argument("url"));
+    optionSet.addOption(Option("speed", "", "factor the pace of the clients is sped up by, 0 to send without pause")
+                        .required(false).repeatable(false)
+                        .argument("factor"));
+    optionSet.addOption(Option("pid", "", "process of the loolwsd, local, to measure the CPU time of, with its kits")
+                        .required(false).repeatable(false)
+                        .argument("pid"));
+}
+
+void ReplayTool::handleOption(const std::string& optionName,
+                              const std::string& value)
+{
+    Application::handleOption(optionName, value);
+
+    if (optionName == "help")
+    {
+        HelpFormatter helpFormatter(options());
+        helpFormatter.setCommand(commandName());
+        helpFormatter.setUsage("OPTIONS record...");
+        helpFormatter.setHeader("LibreOffice On-Line session replay: the sessions recorded, replayed together "
+                                "at the pace of their clients, or faster.");
+        helpFormatter.format(std::cout);
+        std::exit(Application::EXIT_OK);
+    }
+    else if (optionName == "server")
+        _server = value;
+    else if (optionName == "document")
+        _document = value;
+    else if (optionName == "speed")
+        _speed = std::max(std::stod(value), 0.);
+    else if (optionName == "pid")
+        _pid = std::stoi(value);
+}
+
+int ReplayTool::main(const std::vector<std::string>& args)
+{
+    if (args.empty())
+    {
+        std::cerr << "Usage: replaytool [--server=<uri>] [--document=<url>] [--speed=<factor>] [--pid=<pid>] record..." << std::endl;
+        return Application::EXIT_USAGE;
+    }
+
+#if ENABLE_SSL
+    Poco::Net::initializeSSL();
+    // Just accept the certificate anyway, as the tests do.
+    Poco::SharedPtr<Poco::Net::InvalidCertificateHandler> invalidCertHandler = new Poco::Net::AcceptCertificateHandler(false);
+    Poco::Net::Context::Params sslParams;
+    Poco::Net::Context::Ptr sslContext = new Poco::Net::Context(Poco::Net::Context::CLIENT_USE, sslParams);
+    Poco::Net::SSLManager::instance().initializeClient(0, invalidCertHandler, sslContext);
+#endif
+
+    // Connected in the order they started, the first view of each document first.
+    std::vector<std::pair<std::string, std::vector<SessionRecord::Entry>>> records;
+    for (const auto& path : args)
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::string sessionId;
+        std::string uri;
+        if (!SessionRecord::readHeader(file, sessionId, uri))
+        {
+            std::cerr << "Not a session record: " << path << std::endl;
+            return Application::EXIT_DATAERR;
+        }
+
+        std::vector<SessionRecord::Entry> entries;
+        SessionRecord::Entry entry;
+        while (SessionRecord::readEntry(file, entry))
+        {
+            if (!_document.empty() && entry._message.compare(0, 5, "load ") == 0)
+            {
+                entry._message = SessionRecord::setToken(entry._message, "url", _document);
+            }
+
+            entries.push_back(entry);
+        }
+
+        if (!entries.empty())
+        {
+            records.emplace_back(_document.empty() ? uri : "/lool/ws/" + _document, entries);
+        }
+    }
+
+    std::stable_sort(records.begin(), records.end(),
+                     [](const std::pair<std::string, std::vector<SessionRecord::Entry>>& a,
+                        const std::pair<std::string, std::vector<SessionRecord::Entry>>& b)
+                     { return a.second.front()._ms < b.second.front()._ms; });
+
+    const Poco::URI uri(_server);
+    Latencies latencies;
+    std::vector<std::unique_ptr<Session>> sessions;
+    size_t messages = 0;
+    try
+    {
+        for (const auto& record : records)
+        {
+            const std::string name = "session" + std::to_string(sessions.size()) + ' ';
+            sessions.emplace_back(new Session(name, record.second, latencies));
+            sessions.back()->connect(uri, record.first);
+            messages += sessions.back()->getMessageCount();
+        }
+    }
+    catch (const std::exception& exc)
+    {
+        std::cerr << "Failed to connect the sessions: " << exc.what() << std::endl;
+        return Application::EXIT_SOFTWARE;
+    }
+
+    if (sessions.empty())
+    {
+        std::cerr << "No messages to replay." << std::endl;
+        return Application::EXIT_DATAERR;
+    }
+
+    std::cerr << "Replaying " << sessions.size() << " sessions, " << messages << " messages." << std::endl;
+    const long cpuStart = (_pid > 0 ? getTreeCpuTime(_pid) : -1);
+    const auto start = Clock::now();
+    const int64_t firstMs = sessions.front()->getFirstMs();
+    for (auto& session : sessions)
+    {
+        session->start(start, firstMs, _speed);
+    }
+
+    size_t unanswered = 0;
+    for (auto& session : sessions)
+    {
+        session->join();
+        unanswered += session->getUnanswered();
+    }
+
+    const double seconds = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count() / 1000.;
+    latencies.report(seconds);
+    std::cout << std::fixed << std::setprecision(3)
+              << "{\"metric\":\"replay\""
+              << ",\"sessions\":" << sessions.size()
+              << ",\"messages\":" << messages
+              << ",\"unanswered\":" << unanswered
+              << ",\"seconds\":" << seconds
+              << "}" << std::endl;
+    if (cpuStart >= 0)
+    {
+        const long cpuMs = getTreeCpuTime(_pid) - cpuStart;
+        std::cout << std::fixed << std::setprecision(3)
+                  << "{\"metric\":\"server_cpu\""
+                  << ",\"cpu_ms\":" << cpuMs
+                  << ",\"cpu_percent\":" << (seconds > 0 ? cpuMs / seconds / 10 : 0)
+                  << "}" << std::endl;
+    }
+
+#if ENABLE_SSL
+    Poco::Net::uninitializeSSL();
+#endif
+    return Application::EXIT_OK;
+}
+
+POCO_APP_MAIN(ReplayTool)
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
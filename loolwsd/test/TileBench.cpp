@@ -0,0 +1,288 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include "config.h"
+
+#include <algorithm>
+#include <cassert>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#define LOK_USE_UNSTABLE_API
+#include <LibreOfficeKit/LibreOfficeKitInit.h>
+
+#include <Poco/Path.h>
+#include <Poco/TemporaryFile.h>
+#include <Poco/Util/Application.h>
+#include <Poco/Util/HelpFormatter.h>
+#include <Poco/Util/Option.h>
+#include <Poco/Util/OptionSet.h>
+
+#include "LibreOfficeKit.hpp"
+#include "Log.hpp"
+#include "Png.hpp"
+
+using Poco::Util::Application;
+using Poco::Util::HelpFormatter;
+using Poco::Util::Option;
+using Poco::Util::OptionSet;
+
+/** Benchmarks of the rendering of the kits: painting the tiles with
+    LibreOfficeKit and encoding them, as a kit does, on documents of each kind.
+    The results are printed a JSON object per line, to be compared across builds. */
+class TileBench: public Poco::Util::Application
+{
+public:
+    TileBench();
+    ~TileBench() {}
+
+    std::string _loTemplate;
+    unsigned _iterations;
+
+protected:
+    void defineOptions(Poco::Util::OptionSet& options) override;
+    void handleOption(const std::string& name, const std::string& value) override;
+    int  main(const std::vector<std::string>& args) override;
+
+private:
+    /// The durations of the runs of a case, in ms.
+    struct Result
+    {
+        double minMs = std::numeric_limits<double>::max();
+        double maxMs = 0;
+        double totalMs = 0;
+        size_t bytes = 0;
+    };
+
+    /// Times run, which returns the bytes it encoded, _iterations times after a first untimed run.
+    Result measure(const std::function<size_t()>& run);
+
+    void report(const std::string& document, const std::string& name, int zoom,
+                int tiles, const Result& result);
+
+    /// Runs the cases on the document at each zoom.
+    void benchDocument(lok::Office& office, const std::string& path);
+};
+
+namespace
+{
+    /// The size of the tiles in pixels, as loleaflet requests them.
+    const int TileSize = 256;
+
+    /// The width of a tile in twips at 100%, as loleaflet requests them.
+    const int TileTwipsAt100 = 3840;
+
+    /// A viewport of loleaflet, combined in one request.
+    const int CombinedTilesByX = 4;
+    const int CombinedTilesByY = 4;
+}
+
+TileBench::TileBench() :
+    _iterations(20)
+{
+}
+
+void TileBench::defineOptions(OptionSet& optionSet)
+{
+    Application::defineOptions(optionSet);
+
+    optionSet.addOption(Option("help", "", "Display help information on command line arguments.")
+                        .required(false).repeatable(false));
+    optionSet.addOption(Option("lo-template-path", "", "The installation of LibreOffice to use, its program directory.")
+                        .required(false).repeatable(false)
+                        .argument("directory"));
+    optionSet.addOption(Option("iterations", "", "number of timed runs of each case")
+                        .required(false).repeatable(false)
+                        .argument("count"));
+}
+
+void TileBench::handleOption(const std::string& optionName,
+                             const std::string& value)
+{
+    Application::handleOption(optionName, value);
+
+    if (optionName == "help")
+    {
+        HelpFormatter helpFormatter(options());
+        helpFormatter.setCommand(commandName());
+        helpFormatter.setUsage("OPTIONS [document...]");
+        helpFormatter.setHeader("LibreOffice On-Line tile rendering benchmarks, "
+                                "on the test documents of each kind by default.");
+        helpFormatter.format(std::cout);
+        std::exit(Application::EXIT_OK);
+    }
+    else if (optionName == "lo-template-path")
+        _loTemplate = value;
+    else if (optionName == "iterations")
+        _iterations = std::max(std::stoi(value), 1);
+}
+
+TileBench::Result TileBench::measure(const std::function<size_t()>& run)
+{
+    // Warms up the caches of LibreOffice, as the first view of the area did.
+    run();
+
+    Result result;
+    for (unsigned i = 0; i < _iterations; ++i)
+    {
+        const auto start = std::chrono::steady_clock::now();
+        result.bytes = run();
+        const double ms = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count() / 1000.;
+
+        result.minMs = std::min(result.minMs, ms);
+        result.maxMs = std::max(result.maxMs, ms);
+        result.totalMs += ms;
+    }
+
+    return result;
+}
+
+void TileBench::report(const std::string& document, const std::string& name, const int zoom,
+                       const int tiles, const Result& result)
+{
+    std::cout << std::fixed << std::setprecision(3)
+              << "{\"document\":\"" << document << "\""
+              << ",\"case\":\"" << name << "\""
+              << ",\"zoom\":" << zoom
+              << ",\"tiles\":" << tiles
+              << ",\"iterations\":" << _iterations
+              << ",\"mean_ms\":" << result.totalMs / _iterations
+              << ",\"min_ms\":" << result.minMs
+              << ",\"max_ms\":" << result.maxMs
+              << ",\"bytes\":" << result.bytes
+              << "}" << std::endl;
+}
+
+void TileBench::benchDocument(lok::Office& office, const std::string& path)
+{
+    const std::string url = "file://" + Poco::Path(path).makeAbsolute().toString();
+    const std::string name = Poco::Path(path).getFileName();
+    const auto document = office.documentLoad(url.c_str());
+    if (!document || !document->get())
+    {
+        char* error = office.getError();
+        std::cerr << "Failed to load " << url << ": " << (error ? error : "unknown error") << ".\n";
+        office.freeError(error);
+        std::exit(Application::EXIT_SOFTWARE);
+    }
+
+    document->initializeForRendering();
+    const int part = document->getPart();
+    const auto mode = static_cast<LibreOfficeKitTileMode>(document->getTileMode());
+    const png::EncodeOptions encoding;
+
+    std::vector<unsigned char> tilePixmap(4 * TileSize * TileSize);
+    std::vector<unsigned char> combinedPixmap(4 * TileSize * TileSize * CombinedTilesByX * CombinedTilesByY);
+    std::vector<char> output;
+
+    for (const int zoom : { 50, 100, 200 })
+    {
+        const int tileTwips = TileTwipsAt100 * 100 / zoom;
+
+        // One tile, the first one of the document.
+        const auto paintTile = [&]()
+            {
+                document->paintPartTile(tilePixmap.data(), part, TileSize, TileSize,
+                                        0, 0, tileTwips, tileTwips);
+            };
+
+        report(name, "paint", zoom, 1, measure([&]() { paintTile(); return 0; }));
+
+        paintTile();
+        report(name, "encode", zoom, 1, measure([&]()
+            {
+                output.clear();
+                png::encodeSubBufferToPNG(tilePixmap.data(), 0, 0, TileSize, TileSize,
+                                          TileSize, TileSize, output, mode, encoding);
+                return output.size();
+            }));
+
+        // As renderTile: painted and encoded.
+        report(name, "render_tile", zoom, 1, measure([&]()
+            {
+                paintTile();
+                output.clear();
+                png::encodeBufferToPNG(tilePixmap.data(), TileSize, TileSize, output, mode, encoding);
+                return output.size();
+            }));
+
+        // As renderCombinedTiles: a viewport painted at once, then each tile encoded.
+        const int pixmapWidth = TileSize * CombinedTilesByX;
+        const int pixmapHeight = TileSize * CombinedTilesByY;
+        report(name, "render_combined", zoom, CombinedTilesByX * CombinedTilesByY, measure([&]()
+            {
+                document->paintPartTile(combinedPixmap.data(), part, pixmapWidth, pixmapHeight,
+                                        0, 0, tileTwips * CombinedTilesByX, tileTwips * CombinedTilesByY);
+                size_t bytes = 0;
+                for (int y = 0; y < CombinedTilesByY; ++y)
+                {
+                    for (int x = 0; x < CombinedTilesByX; ++x)
+                    {
+                        output.clear();
+                        png::encodeSubBufferToPNG(combinedPixmap.data(), x * TileSize, y * TileSize,
+                                                  TileSize, TileSize, pixmapWidth, pixmapHeight,
+                                                  output, mode, encoding);
+                        bytes += output.size();
+                    }
+                }
+
+                return bytes;
+            }));
+    }
+}
+
+int TileBench::main(const std::vector<std::string>& args)
+{
+    if (_loTemplate.empty())
+    {
+        std::cerr << "Needs --lo-template-path, the program directory of LibreOffice.\n";
+        return Application::EXIT_USAGE;
+    }
+
+    // Text, spreadsheet and presentation.
+    std::vector<std::string> documents(args);
+    if (documents.empty())
+    {
+        documents = { TDOC "/hello.odt", TDOC "/load12.ods", TDOC "/insert-delete.odp" };
+    }
+
+    Log::initialize("tilebench");
+    Log::setLevel("warning");
+
+    Poco::TemporaryFile userDir;
+    userDir.createDirectories();
+    const std::string userDirUrl = "file://" + userDir.path();
+    LibreOfficeKit* kit = lok_init_2(_loTemplate.c_str(), userDirUrl.c_str());
+    if (!kit)
+    {
+        std::cerr << "Failed to initialize LibreOfficeKit from " << _loTemplate << ".\n";
+        return Application::EXIT_SOFTWARE;
+    }
+
+    lok::Office office(kit);
+    for (const auto& path : documents)
+    {
+        benchDocument(office, path);
+    }
+
+    return Application::EXIT_OK;
+}
+
+POCO_APP_MAIN(TileBench)
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
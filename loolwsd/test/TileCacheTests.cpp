@@ -10,13 +10,27 @@
 #include "config.h"
 
 #include <png.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <numeric>
+#include <random>
+#include <thread>
+
+#include <Poco/File.h>
 #include <Poco/Net/WebSocket.h>
 #include <cppunit/extensions/HelperMacros.h>
 
 #include "helpers.hpp"
 #include <Common.hpp>
 #include <LOOLProtocol.hpp>
+#include <Png.hpp>
 #include <TileCache.hpp>
+#include <TileStore.hpp>
 #include <Unit.hpp>
 #include <Util.hpp>
 
@@ -31,6 +45,16 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST_SUITE(TileCacheTests);
 
     CPPUNIT_TEST(testSimple);
+    CPPUNIT_TEST(testMemoryCache);
+    CPPUNIT_TEST(testSlabStore);
+    CPPUNIT_TEST(testBlobStore);
+    CPPUNIT_TEST(testManifest);
+    CPPUNIT_TEST(testRecompression);
+    CPPUNIT_TEST(testSolidTiles);
+    CPPUNIT_TEST(testCancelTiles);
+    CPPUNIT_TEST(testPlaceholders);
+    CPPUNIT_TEST(testThumbnails);
+    CPPUNIT_TEST(testCacheScalability);
     CPPUNIT_TEST(testSimpleCombine);
     CPPUNIT_TEST(testPerformance);
     CPPUNIT_TEST(testUnresponsiveClient);
@@ -44,6 +68,16 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST_SUITE_END();
 
     void testSimple();
+    void testMemoryCache();
+    void testSlabStore();
+    void testBlobStore();
+    void testManifest();
+    void testRecompression();
+    void testSolidTiles();
+    void testCancelTiles();
+    void testPlaceholders();
+    void testThumbnails();
+    void testCacheScalability();
     void testSimpleCombine();
     void testPerformance();
     void testUnresponsiveClient();
@@ -67,6 +101,8 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
 
     void checkBlackTile(std::stringstream& tile);
 
+    void benchCache(const std::string& storeType, const int count);
+
     static
     std::vector<char> genRandomData(const size_t size)
     {
@@ -81,21 +117,6 @@ class TileCacheTests : public CPPUNIT_NS::TestFixture
         return v;
     }
 
-    static
-    std::vector<char> readDataFromFile(std::unique_ptr<std::fstream>& file)
-    {
-        file->seekg(0, std::ios_base::end);
-        const std::streamsize size = file->tellg();
-
-        std::vector<char> v;
-        v.resize(size);
-
-        file->seekg(0, std::ios_base::beg);
-        file->read(v.data(), size);
-
-        return v;
-    }
-
 public:
     TileCacheTests()
         : _uri(helpers::getTestServerURI())
@@ -149,9 +170,8 @@ void TileCacheTests::testSimple()
 
     // Find Tile
     file = tc.lookupTile(tile);
-    CPPUNIT_ASSERT_MESSAGE("tile not found when expected", file && file->is_open());
-    const auto tileData = readDataFromFile(file);
-    CPPUNIT_ASSERT_MESSAGE("cached tile corrupted", data == tileData);
+    CPPUNIT_ASSERT_MESSAGE("tile not found when expected", !!file);
+    CPPUNIT_ASSERT_MESSAGE("cached tile corrupted", data == *file);
 
     // Invalidate Tiles
     tc.invalidateTiles("invalidatetiles: EMPTY");
@@ -161,6 +181,555 @@ void TileCacheTests::testSimple()
     CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !file);
 }
 
+void TileCacheTests::testMemoryCache()
+{
+    if (!UnitWSD::init(UnitWSD::UnitType::TYPE_WSD, ""))
+    {
+        throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    // Room for two tiles in memory.
+    const auto size = 1024;
+    TileCache tc("doc.ods", Poco::Timestamp(), "/tmp/tile_cache_tests", 2 * size + size / 2);
+
+    TileDesc tile1(0, 256, 256, 0, 0, 3840, 3840);
+    TileDesc tile2(0, 256, 256, 3840, 0, 3840, 3840);
+    TileDesc tile3(0, 256, 256, 7680, 0, 3840, 3840);
+
+    const auto data1 = genRandomData(size);
+    const auto data2 = genRandomData(size);
+    const auto data3 = genRandomData(size);
+    tc.saveTileAndNotify(tile1, data1.data(), size, true);
+    tc.saveTileAndNotify(tile2, data2.data(), size, true);
+    tc.saveTileAndNotify(tile3, data3.data(), size, true);
+
+    // The least-recently used tile was evicted.
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2 * size), tc.getMemoryCacheSize());
+
+    // But all are still found, evicted ones from the disk.
+    auto tile = tc.lookupTile(tile1);
+    CPPUNIT_ASSERT_MESSAGE("tile not found when expected", tile && data1 == *tile);
+    tile = tc.lookupTile(tile2);
+    CPPUNIT_ASSERT_MESSAGE("tile not found when expected", tile && data2 == *tile);
+    tile = tc.lookupTile(tile3);
+    CPPUNIT_ASSERT_MESSAGE("tile not found when expected", tile && data3 == *tile);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2 * size), tc.getMemoryCacheSize());
+
+    // Invalidating must drop the tiles from memory too.
+    tc.invalidateTiles("invalidatetiles: part=0 x=0 y=0 width=3000 height=3000");
+    CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tc.lookupTile(tile1));
+    CPPUNIT_ASSERT_MESSAGE("tile not found when expected", !!tc.lookupTile(tile3));
+
+    tc.invalidateTiles("invalidatetiles: EMPTY");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), tc.getMemoryCacheSize());
+    CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tc.lookupTile(tile3));
+}
+
+void TileCacheTests::testSlabStore()
+{
+    if (!UnitWSD::init(UnitWSD::UnitType::TYPE_WSD, ""))
+    {
+        throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    const Poco::Timestamp modifiedTime;
+    TileDesc tile1(0, 256, 256, 0, 0, 3840, 3840);
+    TileDesc tile2(0, 256, 256, 3840, 0, 3840, 3840);
+    const auto data1 = genRandomData(1024);
+    const auto data2 = genRandomData(2048);
+
+    {
+        TileCache tc("doc.ods", modifiedTime, "/tmp/tile_cache_tests_slab", 0, "slab");
+        CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tc.lookupTile(tile1));
+
+        tc.saveTileAndNotify(tile1, data1.data(), data1.size(), true);
+        tc.saveTileAndNotify(tile2, data2.data(), data2.size(), true);
+
+        auto tile = tc.lookupTile(tile1);
+        CPPUNIT_ASSERT_MESSAGE("tile not found when expected", tile && data1 == *tile);
+
+        tc.invalidateTiles("invalidatetiles: part=0 x=0 y=0 width=100 height=100");
+        CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tc.lookupTile(tile1));
+    }
+
+    // Reopen: the slab survives, removals included.
+    {
+        TileCache tc("doc.ods", modifiedTime, "/tmp/tile_cache_tests_slab", 0, "slab");
+        CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tc.lookupTile(tile1));
+
+        auto tile = tc.lookupTile(tile2);
+        CPPUNIT_ASSERT_MESSAGE("tile not found when expected", tile && data2 == *tile);
+
+        tc.invalidateTiles("invalidatetiles: EMPTY");
+        CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tc.lookupTile(tile2));
+    }
+}
+
+void TileCacheTests::testBlobStore()
+{
+    if (!UnitWSD::init(UnitWSD::UnitType::TYPE_WSD, ""))
+    {
+        throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    const std::string blobsDir = "/tmp/tile_cache_tests_blobs";
+    const std::string cacheDir1 = "/tmp/tile_cache_tests_blobs_1";
+    const std::string cacheDir2 = "/tmp/tile_cache_tests_blobs_2";
+    Util::removeFile(blobsDir, true);
+    const auto getInode = [](const std::string& path)
+        {
+            struct stat st;
+            return (stat(path.c_str(), &st) == 0 ? st.st_ino : 0);
+        };
+
+    const Poco::Timestamp modifiedTime;
+    TileDesc tile1(0, 256, 256, 0, 0, 3840, 3840);
+    TileDesc tile2(0, 256, 256, 3840, 0, 3840, 3840);
+    const auto blank = genRandomData(1024);
+    const auto data = genRandomData(2048);
+    const auto name1 = TileCache::cacheFileName(tile1);
+    const auto name2 = TileCache::cacheFileName(tile2);
+
+    {
+        TileCache tc1("doc1.ods", modifiedTime, cacheDir1, 0, "blobs", -1, blobsDir);
+        TileCache tc2("doc2.ods", modifiedTime, cacheDir2, 0, "blobs", -1, blobsDir);
+        tc1.saveTileAndNotify(tile1, blank.data(), blank.size(), true);
+        tc1.saveTileAndNotify(tile2, data.data(), data.size(), true);
+        tc2.saveTileAndNotify(tile1, blank.data(), blank.size(), true);
+
+        // The same tile of both documents is stored once.
+        CPPUNIT_ASSERT(getInode(cacheDir1 + "/" + name1) != 0);
+        CPPUNIT_ASSERT_EQUAL(getInode(cacheDir1 + "/" + name1), getInode(cacheDir2 + "/" + name1));
+        CPPUNIT_ASSERT(getInode(cacheDir1 + "/" + name1) != getInode(cacheDir1 + "/" + name2));
+
+        auto tile = tc2.lookupTile(tile1);
+        CPPUNIT_ASSERT_MESSAGE("tile not found when expected", tile && blank == *tile);
+
+        // Replaced in one, it is kept in the other.
+        tc2.saveTileAndNotify(tile1, data.data(), data.size(), true);
+        CPPUNIT_ASSERT_EQUAL(getInode(cacheDir1 + "/" + name2), getInode(cacheDir2 + "/" + name1));
+        tile = tc1.lookupTile(tile1);
+        CPPUNIT_ASSERT_MESSAGE("tile not found when expected", tile && blank == *tile);
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), BlobTileStore::collect(blobsDir));
+
+        tc1.invalidateTiles("invalidatetiles: part=0 x=0 y=0 width=100 height=100");
+        CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tc1.lookupTile(tile1));
+        tile = tc2.lookupTile(tile1);
+        CPPUNIT_ASSERT_MESSAGE("tile not found when expected", tile && data == *tile);
+    }
+
+    // The blobs go once no tile refers to them.
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), BlobTileStore::collect(blobsDir));
+    Util::removeFile(cacheDir1, true);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), BlobTileStore::collect(blobsDir));
+    Util::removeFile(cacheDir2, true);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), BlobTileStore::collect(blobsDir));
+    Util::removeFile(blobsDir, true);
+}
+
+void TileCacheTests::testManifest()
+{
+    if (!UnitWSD::init(UnitWSD::UnitType::TYPE_WSD, ""))
+    {
+        throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    const std::string cacheDir = "/tmp/tile_cache_tests_manifest";
+    const std::string manifest = cacheDir + "/manifest.txt";
+    Util::removeFile(cacheDir, true);
+
+    const Poco::Timestamp modifiedTime;
+    TileDesc tile1(0, 256, 256, 0, 0, 3840, 3840, 7);
+    TileDesc tile2(0, 256, 256, 3840, 0, 3840, 3840, 8);
+    const auto data1 = genRandomData(1024);
+    const auto data2 = genRandomData(2048);
+
+    {
+        TileCache tc("doc.ods", modifiedTime, cacheDir);
+        tc.saveTileAndNotify(tile1, data1.data(), data1.size(), true);
+        tc.saveTileAndNotify(tile2, data2.data(), data2.size(), true);
+    }
+
+    CPPUNIT_ASSERT(Poco::File(manifest).exists());
+
+    // Opening it indexes nothing, until first accessed, which consumes the manifest.
+    {
+        TileCache tc("doc.ods", modifiedTime, cacheDir);
+        CPPUNIT_ASSERT(Poco::File(manifest).exists());
+
+        auto tile = tc.lookupTile(tile2);
+        CPPUNIT_ASSERT_MESSAGE("tile not found when expected", tile && data2 == *tile);
+        CPPUNIT_ASSERT(!Poco::File(manifest).exists());
+        CPPUNIT_ASSERT(tc.hasTile(tile1));
+
+        // With the render versions, lost when listing the store.
+        CPPUNIT_ASSERT_EQUAL(7, tc.getRenderVersion(tile1));
+        CPPUNIT_ASSERT_EQUAL(8, tc.getRenderVersion(tile2));
+
+        tc.invalidateTiles("invalidatetiles: part=0 x=0 y=0 width=100 height=100");
+    }
+
+    // Not accessed, the manifest is left as it was.
+    {
+        TileCache tc("doc.ods", modifiedTime, cacheDir);
+    }
+
+    {
+        TileCache tc("doc.ods", modifiedTime, cacheDir);
+        CPPUNIT_ASSERT(!tc.hasTile(tile1));
+        CPPUNIT_ASSERT_EQUAL(8, tc.getRenderVersion(tile2));
+    }
+
+    // Without a manifest, as after a crash, the store is listed.
+    Poco::File(manifest).remove();
+    {
+        TileCache tc("doc.ods", modifiedTime, cacheDir);
+        CPPUNIT_ASSERT(tc.hasTile(tile2));
+        CPPUNIT_ASSERT_EQUAL(-1, tc.getRenderVersion(tile2));
+    }
+
+    // Nor is it used once the document changed.
+    {
+        TileCache tc("doc.ods", modifiedTime + 1000000, cacheDir);
+        CPPUNIT_ASSERT(!tc.hasTile(tile2));
+    }
+}
+
+void TileCacheTests::testRecompression()
+{
+    if (!UnitWSD::init(UnitWSD::UnitType::TYPE_WSD, ""))
+    {
+        throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    // A tile with some structure, encoded the fast way.
+    const int width = 256;
+    const int height = 256;
+    std::vector<unsigned char> pixmap(width * height * 4);
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            unsigned char* pixel = &pixmap[(y * width + x) * 4];
+            pixel[0] = ((x / 16 + y / 16) % 2 ? 0xff : 0x20);
+            pixel[1] = static_cast<unsigned char>(y / 32 * 32);
+            pixel[2] = 0x80;
+            pixel[3] = 0xff;
+        }
+    }
+
+    png::EncodeOptions fast;
+    fast.compressionLevel = 1;
+    fast.filters = PNG_FILTER_NONE;
+    std::vector<char> data;
+    CPPUNIT_ASSERT(png::encodeBufferToPNG(pixmap.data(), width, height, data, LOK_TILEMODE_RGBA, fast));
+
+    const Poco::Timestamp modifiedTime;
+    TileDesc tile(0, width, height, 0, 0, 3840, 3840);
+    {
+        TileCache tc("doc.ods", modifiedTime, "/tmp/tile_cache_tests_recompress", 0, "files", 9);
+        tc.saveTileAndNotify(tile, data.data(), data.size(), true);
+
+        // Served as rendered until stored.
+        auto cached = tc.lookupTile(tile);
+        CPPUNIT_ASSERT_MESSAGE("tile not found when expected", !!cached);
+
+        tc.waitForRecompression();
+    }
+
+    TileCache tc("doc.ods", modifiedTime, "/tmp/tile_cache_tests_recompress", 0, "files", 9);
+    auto stored = tc.lookupTile(tile);
+    CPPUNIT_ASSERT_MESSAGE("tile not found when expected", !!stored);
+    CPPUNIT_ASSERT(stored->size() < data.size());
+
+    std::vector<unsigned char> decoded;
+    int decodedWidth = 0;
+    int decodedHeight = 0;
+    CPPUNIT_ASSERT(png::decodePNG(stored->data(), stored->size(), decoded, decodedWidth, decodedHeight));
+    CPPUNIT_ASSERT_EQUAL(width, decodedWidth);
+    CPPUNIT_ASSERT_EQUAL(height, decodedHeight);
+    CPPUNIT_ASSERT(pixmap == decoded);
+
+    tc.invalidateTiles("invalidatetiles: EMPTY");
+}
+
+void TileCacheTests::testSolidTiles()
+{
+    if (!UnitWSD::init(UnitWSD::UnitType::TYPE_WSD, ""))
+    {
+        throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    const Poco::Timestamp modifiedTime;
+    TileDesc tile1(0, 256, 256, 0, 0, 3840, 3840);
+    TileDesc tile2(0, 256, 256, 3840, 0, 3840, 3840);
+    tile1.setSolid(true);
+    tile2.setSolid(true);
+    const auto data = genRandomData(128);
+
+    {
+        TileCache tc("doc.ods", modifiedTime, "/tmp/tile_cache_tests_solid", 1024);
+        tc.saveTileAndNotify(tile1, data.data(), data.size(), true);
+        tc.saveTileAndNotify(tile2, data.data(), data.size(), true);
+
+        // Both share the one copy, outside of the memory cache.
+        auto cached1 = tc.lookupTile(tile1);
+        auto cached2 = tc.lookupTile(tile2);
+        CPPUNIT_ASSERT_MESSAGE("tile not found when expected", cached1 && data == *cached1);
+        CPPUNIT_ASSERT(cached1 == cached2);
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), tc.getMemoryCacheSize());
+
+        tc.invalidateTiles("invalidatetiles: part=0 x=0 y=0 width=100 height=100");
+        CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tc.lookupTile(tile1));
+        CPPUNIT_ASSERT_MESSAGE("tile not found when expected", !!tc.lookupTile(tile2));
+    }
+
+    // Never written to disk.
+    TileCache tc("doc.ods", modifiedTime, "/tmp/tile_cache_tests_solid", 1024);
+    CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tc.lookupTile(tile2));
+}
+
+void TileCacheTests::testCancelTiles()
+{
+    TileCache tc("doc.ods", Poco::Timestamp(), "/tmp/tile_cache_tests_cancel");
+
+    // Rendered ahead at two zooms, and a preview, for no one yet.
+    TileDesc tile1(0, 256, 256, 0, 0, 3840, 3840, 1);
+    TileDesc tile2(0, 256, 256, 3840, 0, 3840, 3840, 1);
+    TileDesc zoomed(0, 256, 256, 0, 0, 1920, 1920, 2);
+    TileDesc preview(0, 180, 135, 0, 0, 15875, 11906, 3, 0, 0);
+    for (const auto& tile : { tile1, tile2, zoomed, preview })
+    {
+        CPPUNIT_ASSERT_EQUAL(tile.getVersion(), tc.isTileBeingRenderedIfSoSubscribe(tile, nullptr));
+    }
+
+    // No view's cancellation drops them, they are for all views.
+    CPPUNIT_ASSERT(tc.cancelTiles(nullptr, [](const TileDesc&) { return true; }).empty());
+
+    // Still coming, not to render again.
+    TileDesc again(0, 256, 256, 0, 0, 3840, 3840, 5);
+    CPPUNIT_ASSERT_EQUAL(0, tc.isTileBeingRenderedIfSoSubscribe(again, nullptr));
+    CPPUNIT_ASSERT(tc.cancelTiles(nullptr, [](const TileDesc& tile) { return tile.getTileWidth() != 3840; }).empty());
+}
+
+void TileCacheTests::testPlaceholders()
+{
+    if (!UnitWSD::init(UnitWSD::UnitType::TYPE_WSD, ""))
+    {
+        throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    // Red on the left, blue on the right, at 100%.
+    const int size = 256;
+    std::vector<unsigned char> pixmap(size * size * 4);
+    for (int y = 0; y < size; ++y)
+    {
+        for (int x = 0; x < size; ++x)
+        {
+            unsigned char* pixel = &pixmap[(y * size + x) * 4];
+            pixel[0] = (x < size / 2 ? 0xff : 0);
+            pixel[1] = 0;
+            pixel[2] = (x < size / 2 ? 0 : 0xff);
+            pixel[3] = 0xff;
+        }
+    }
+
+    std::vector<char> data;
+    CPPUNIT_ASSERT(png::encodeBufferToPNG(pixmap.data(), size, size, data, LOK_TILEMODE_RGBA));
+
+    TileCache tc("doc.ods", Poco::Timestamp(), "/tmp/tile_cache_tests_placeholders");
+    tc.saveTileAndNotify(TileDesc(0, size, size, 0, 0, 3840, 3840), data.data(), data.size(), true);
+
+    // Zoomed in to 200%, each half of it scaled up; nothing past it.
+    const std::vector<TileDesc> tiles = { TileDesc(0, size, size, 0, 0, 1920, 1920),
+                                          TileDesc(0, size, size, 1920, 1920, 1920, 1920),
+                                          TileDesc(0, size, size, 7680, 0, 1920, 1920) };
+    const auto placeholders = tc.getPlaceholders(tiles);
+    CPPUNIT_ASSERT_EQUAL(tiles.size(), placeholders.size());
+    CPPUNIT_ASSERT(!placeholders[2]);
+
+    for (int i = 0; i < 2; ++i)
+    {
+        CPPUNIT_ASSERT_MESSAGE("no placeholder when expected", !!placeholders[i]);
+        std::vector<unsigned char> decoded;
+        int width = 0;
+        int height = 0;
+        CPPUNIT_ASSERT(png::decodePNG(placeholders[i]->data(), placeholders[i]->size(), decoded, width, height));
+        CPPUNIT_ASSERT_EQUAL(size, width);
+        CPPUNIT_ASSERT_EQUAL(size, height);
+        CPPUNIT_ASSERT_EQUAL(i == 0 ? 0xff : 0, static_cast<int>(decoded[0]));
+        CPPUNIT_ASSERT_EQUAL(i == 0 ? 0 : 0xff, static_cast<int>(decoded[decoded.size() - 2]));
+    }
+
+    // Not from the tiles at the same zoom, those are the cache hits.
+    CPPUNIT_ASSERT(!tc.getPlaceholders({ TileDesc(0, size, size, 0, 0, 3840, 3840) })[0]);
+
+    tc.invalidateTiles("invalidatetiles: EMPTY");
+}
+
+void TileCacheTests::testThumbnails()
+{
+    if (!UnitWSD::init(UnitWSD::UnitType::TYPE_WSD, ""))
+    {
+        throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    // The thumbnails of the slides, whole parts at 180 pixels wide.
+    std::vector<TileDesc> thumbnails;
+    for (int part = 0; part < 3; ++part)
+    {
+        thumbnails.emplace_back(part, 180, 135, 0, 0, 28000, 21000, -1, 0, part);
+    }
+
+    const auto data = genRandomData(1024);
+    {
+        TileCache tc("doc.odp", Poco::Timestamp(), "/tmp/tile_cache_tests_thumbnails");
+        tc.invalidateTiles("invalidatetiles: EMPTY");
+        for (const auto& thumbnail : thumbnails)
+        {
+            CPPUNIT_ASSERT(!tc.hasTile(thumbnail));
+            tc.saveTileAndNotify(thumbnail, data.data(), data.size(), false);
+        }
+    }
+
+    // Kept for the next session, each gone with a change of its part only.
+    TileCache tc("doc.odp", Poco::Timestamp(), "/tmp/tile_cache_tests_thumbnails");
+    CPPUNIT_ASSERT(tc.hasTile(thumbnails[0]) && tc.hasTile(thumbnails[1]) && tc.hasTile(thumbnails[2]));
+    tc.invalidateTiles("invalidatetiles: part=1 x=1000 y=1000 width=500 height=500");
+    CPPUNIT_ASSERT(tc.hasTile(thumbnails[0]));
+    CPPUNIT_ASSERT(!tc.hasTile(thumbnails[1]));
+    CPPUNIT_ASSERT(tc.hasTile(thumbnails[2]));
+
+    tc.invalidateTiles("invalidatetiles: EMPTY");
+    CPPUNIT_ASSERT(!tc.hasTile(thumbnails[0]) && !tc.hasTile(thumbnails[2]));
+}
+
+void TileCacheTests::testCacheScalability()
+{
+    if (!UnitWSD::init(UnitWSD::UnitType::TYPE_WSD, ""))
+    {
+        throw std::runtime_error("Failed to load wsd unit test library.");
+    }
+
+    // 10^4 tiles by default, 10^6 and more when asked for.
+    const char* tiles = std::getenv("LOOL_TILECACHE_BENCH_TILES");
+    const int count = std::max(tiles ? std::atoi(tiles) : 10000, 100);
+    for (const std::string storeType : { "files", "slab" })
+    {
+        benchCache(storeType, count);
+    }
+}
+
+void TileCacheTests::benchCache(const std::string& storeType, const int count)
+{
+    // Spread over the parts and zooms, as a presentation viewed at each.
+    const int parts = 4;
+    const int zooms[] = { 1920, 3840, 7680 };
+    const int columns = 16;
+    std::vector<TileDesc> tiles;
+    for (int i = 0; i < count; ++i)
+    {
+        const int twips = zooms[(i / parts) % 3];
+        const int index = i / (parts * 3);
+        tiles.emplace_back(i % parts, 256, 256, (index % columns) * twips, (index / columns) * twips, twips, twips);
+    }
+
+    // Small, to keep the disk usage at bay, and a quarter of them fit in memory.
+    const size_t size = 256;
+    const auto data = genRandomData(size);
+    TileCache tc("doc.odp", Poco::Timestamp(), "/tmp/tile_cache_tests_bench_" + storeType, count * size / 4, storeType);
+
+    const auto time = [](const int iterations, const std::function<void(int)>& func)
+        {
+            const auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; ++i)
+            {
+                func(i);
+            }
+
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / iterations;
+        };
+
+    const auto save = time(count, [&](int i) { tc.saveTileAndNotify(tiles[i], data.data(), size, true); });
+
+    // In random order, so most come from the disk.
+    std::vector<int> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    std::shuffle(order.begin(), order.end(), std::mt19937(count));
+    int found = 0;
+    const auto lookup = time(count, [&](int i) { found += !!tc.lookupTile(tiles[order[i]]); });
+    CPPUNIT_ASSERT_EQUAL(count, found);
+
+    // The same positions at another size are not cached.
+    const auto miss = time(count, [&](int i)
+        {
+            const auto& tile = tiles[order[i]];
+            found -= !tc.lookupTile(TileDesc(tile.getPart(), 128, 128, tile.getTilePosX(), tile.getTilePosY(),
+                                             tile.getTileWidth(), tile.getTileHeight()));
+        });
+    CPPUNIT_ASSERT_EQUAL(0, found);
+
+    // Typing: a small area of a part, each dropping a tile at each zoom.
+    const int rows = count / (parts * 3 * columns) + 1;
+    std::vector<std::string> rectangles;
+    for (int i = 0; i < std::min(100, count / 10); ++i)
+    {
+        rectangles.push_back("invalidatetiles: part=" + std::to_string(i % parts) +
+                             " x=" + std::to_string(order[i] % columns * 1920 + 1) +
+                             " y=" + std::to_string(order[i] % rows * 1920 + 1) +
+                             " width=100 height=100");
+    }
+
+    const auto rectangle = time(rectangles.size(), [&](int i) { tc.invalidateTiles(rectangles[i]); });
+    const auto empty = time(1, [&](int) { tc.invalidateTiles("invalidatetiles: EMPTY"); });
+    CPPUNIT_ASSERT_MESSAGE("found tile when none was expected", !tc.lookupTile(tiles[0]));
+
+    // Rendering, as the broker does for each tile: subscribe, save and look up,
+    // by one thread then by several at once, each their own tiles. Without
+    // sessions, as those need a broker; their notification is not measured.
+    std::atomic<int> rendered;
+    const auto render = [&](const int threads)
+        {
+            rendered = 0;
+            const auto start = std::chrono::steady_clock::now();
+            std::vector<std::thread> workers;
+            for (int thread = 0; thread < threads; ++thread)
+            {
+                workers.emplace_back([&, thread]()
+                    {
+                        for (int i = thread; i < count; i += threads)
+                        {
+                            TileDesc tile(tiles[i]);
+                            tile.setVersion(tc.isTileBeingRenderedIfSoSubscribe(tile, nullptr));
+                            tc.saveTileAndNotify(tile, data.data(), size, false);
+                            rendered += !!tc.lookupTile(tile);
+                        }
+                    });
+            }
+
+            for (auto& worker : workers)
+            {
+                worker.join();
+            }
+
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            CPPUNIT_ASSERT_EQUAL(count, rendered.load());
+            tc.invalidateTiles("invalidatetiles: EMPTY");
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / count;
+        };
+
+    const int threads = std::max(2U, std::min(8U, std::thread::hardware_concurrency()));
+    const auto single = render(1);
+    const auto concurrent = render(threads);
+
+    std::cerr << "TileCache of " << count << " tiles, " << storeType << " store: save " << save
+              << " ns, lookup " << lookup << " ns, miss " << miss << " ns, invalidate rectangle "
+              << rectangle << " ns, EMPTY " << empty << " ns; subscribe, save and lookup "
+              << single << " ns a tile on 1 thread, " << concurrent << " ns on " << threads
+              << " threads." << std::endl;
+}
+
 void TileCacheTests::testSimpleCombine()
 {
     std::string documentPath, documentURL;
@@ -0,0 +1,88 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#include <atomic>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#include <Poco/Net/WebSocket.h>
+#include <Poco/URI.h>
+
+#include "Log.hpp"
+#include "Unit.hpp"
+#include "helpers.hpp"
+
+/// Times the cold path: wsd launched to its kits ready, and the load of the
+/// first document to its first tile. The report, a line of JSON, is printed
+/// to compare between builds.
+class UnitStartup : public UnitWSD
+{
+    std::atomic<bool> _started;
+    std::thread _client;
+    std::shared_ptr<Poco::Net::WebSocket> _ws;
+
+public:
+    UnitStartup() :
+        _started(false)
+    {
+        setTimeout(60 * 1000);
+    }
+
+    ~UnitStartup()
+    {
+        if (_client.joinable())
+        {
+            _client.join();
+        }
+    }
+
+    virtual void invokeTest() override
+    {
+        if (_started.exchange(true))
+        {
+            return;
+        }
+
+        // The first client: loads a document, then asks for its first tile.
+        _client = std::thread([this]()
+            {
+                try
+                {
+                    std::string documentPath, documentURL;
+                    helpers::getDocumentPathAndURL("hello.odt", documentPath, documentURL);
+                    _ws = helpers::loadDocAndGetSocket(Poco::URI(helpers::getTestServerURI()), documentURL, "startup ");
+                    helpers::sendTextFrame(_ws, "tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840", "startup ");
+                }
+                catch (const std::exception& exc)
+                {
+                    Log::error(std::string("UnitStartup failed to load: ") + exc.what());
+                    exitTest(TestResult::TEST_FAILED);
+                }
+            });
+    }
+
+    virtual void onStartupReport(const std::string& report) override
+    {
+        std::cerr << "Startup: " << report << std::endl;
+
+        // Both spans are measured, from phases of each process.
+        const bool complete = (report.find("\"startup_ms\":-") == std::string::npos &&
+                               report.find("\"first_tile_ms\":-") == std::string::npos &&
+                               report.find("\"first_paint\":") != std::string::npos);
+        exitTest(complete ? TestResult::TEST_OK : TestResult::TEST_FAILED);
+    }
+};
+
+UnitBase *unit_create_wsd(void)
+{
+    return new UnitStartup();
+}
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */
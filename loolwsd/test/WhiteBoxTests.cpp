@@ -9,10 +9,68 @@
 
 #include "config.h"
 
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#include <zlib.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+
 #include <cppunit/extensions/HelperMacros.h>
 
+#include <Poco/AutoPtr.h>
+#include <Poco/Channel.h>
+#include <Poco/Crypto/Crypto.h>
+#include <Poco/Net/NetException.h>
+#include <Poco/StringTokenizer.h>
+
+#include <AssetCache.hpp>
+#include <Auth.hpp>
+#include <BrokerRegistry.hpp>
+#include <Cluster.hpp>
+#include <Command.hpp>
 #include <Common.hpp>
+#include <ConnectionPool.hpp>
+#include <ConversionCache.hpp>
+#include <ConversionQueue.hpp>
+#include <ExpiringCache.hpp>
+#include <IoUtil.hpp>
+#include <FontCache.hpp>
+#include <KitPlacement.hpp>
+#include <LOOLProtocol.hpp>
+#include <Log.hpp>
+#include <MemoryPressure.hpp>
+#include <MessageQueue.hpp>
+#include <Metrics.hpp>
+#include <Png.hpp>
+#include <Prefault.hpp>
+#include <PrespawnControl.hpp>
+#include <RenderBudget.hpp>
+#include <SessionRecord.hpp>
+#include <Startup.hpp>
+#include <TaskPool.hpp>
+#include <TileCacheQuota.hpp>
+#include <TileCoalescer.hpp>
+#include <TileDesc.hpp>
+#include <TileIndex.hpp>
+#include <TileInvalidation.hpp>
+#include <Trace.hpp>
 #include <Util.hpp>
+#include <WebSocketDeflate.hpp>
+#include <WorkQueue.hpp>
 
 /// WhiteBox unit-tests.
 class WhiteBoxTests : public CPPUNIT_NS::TestFixture
@@ -21,13 +79,269 @@ class WhiteBoxTests : public CPPUNIT_NS::TestFixture
 
     CPPUNIT_TEST(testRegexListMatcher);
     CPPUNIT_TEST(testRegexListMatcher_Init);
+    CPPUNIT_TEST(testTileIndex);
+    CPPUNIT_TEST(testTaskPool);
+    CPPUNIT_TEST(testWorkQueue);
+    CPPUNIT_TEST(testBrokerRegistry);
+    CPPUNIT_TEST(testPrespawnControl);
+    CPPUNIT_TEST(testMemoryStats);
+    CPPUNIT_TEST(testCpuTime);
+    CPPUNIT_TEST(testMemoryPressure);
+    CPPUNIT_TEST(testKitPlacement);
+    CPPUNIT_TEST(testCluster);
+    CPPUNIT_TEST(testConnectionPool);
+    CPPUNIT_TEST(testExpiringCache);
+    CPPUNIT_TEST(testConversionQueue);
+    CPPUNIT_TEST(testConversionCache);
+    CPPUNIT_TEST(testTileCacheQuota);
+    CPPUNIT_TEST(testAssetCache);
+    CPPUNIT_TEST(testFontCache);
+    CPPUNIT_TEST(testUnpremultiply);
+    CPPUNIT_TEST(testSolidTiles);
+    CPPUNIT_TEST(testChangedArea);
+    CPPUNIT_TEST(testTileCoalescer);
+    CPPUNIT_TEST(testRenderBudget);
+    CPPUNIT_TEST(testTileQueuePriority);
+    CPPUNIT_TEST(testTilePrefetch);
+    CPPUNIT_TEST(testMPSCMessageQueue);
+    CPPUNIT_TEST(testMouseMoveCoalescing);
+    CPPUNIT_TEST(testInputLatency);
+    CPPUNIT_TEST(testTypingLatencyBench);
+    CPPUNIT_TEST(testTileQueueShedding);
+    CPPUNIT_TEST(testTileQueueCancel);
+    CPPUNIT_TEST(testTileQueueMerge);
+    CPPUNIT_TEST(testTileQueuePreviews);
+    CPPUNIT_TEST(testFrameHeader);
+    CPPUNIT_TEST(testFrameParse);
+    CPPUNIT_TEST(testWebSocketDeflate);
+    CPPUNIT_TEST(testTileDescParseFuzz);
+    CPPUNIT_TEST(testTileDescParseBench);
+    CPPUNIT_TEST(testTrace);
+    CPPUNIT_TEST(testCommands);
+    CPPUNIT_TEST(testMetrics);
+    CPPUNIT_TEST(testStartup);
+    CPPUNIT_TEST(testPrefault);
+    CPPUNIT_TEST(testSessionRecord);
+    CPPUNIT_TEST(testTileInvalidation);
+    CPPUNIT_TEST(testLogBench);
+    CPPUNIT_TEST(testJWTAuthBench);
 
     CPPUNIT_TEST_SUITE_END();
 
     void testRegexListMatcher();
     void testRegexListMatcher_Init();
+    void testTileIndex();
+    void testTaskPool();
+    void testWorkQueue();
+    void testBrokerRegistry();
+    void testPrespawnControl();
+    void testMemoryStats();
+    void testCpuTime();
+    void testMemoryPressure();
+    void testKitPlacement();
+    void testCluster();
+    void testConnectionPool();
+    void testExpiringCache();
+    void testConversionQueue();
+    void testConversionCache();
+    void testTileCacheQuota();
+    void testAssetCache();
+    void testFontCache();
+    void testUnpremultiply();
+    void testSolidTiles();
+    void testChangedArea();
+    void testTileCoalescer();
+    void testRenderBudget();
+    void testTileQueuePriority();
+    void testTilePrefetch();
+    void testMPSCMessageQueue();
+    void testMouseMoveCoalescing();
+    void testInputLatency();
+    void testTypingLatencyBench();
+    void testTileQueueShedding();
+    void testTileQueueCancel();
+    void testTileQueueMerge();
+    void testTileQueuePreviews();
+    void testFrameHeader();
+    void testFrameParse();
+    void testWebSocketDeflate();
+    void testTileDescParseFuzz();
+    void testTileDescParseBench();
+    void testTrace();
+    void testCommands();
+    void testMetrics();
+    void testStartup();
+    void testPrefault();
+    void testSessionRecord();
+    void testTileInvalidation();
+    void testLogBench();
+    void testJWTAuthBench();
 };
 
+namespace
+{
+    /// The tokenizing TileDesc and TileCombined parsers and serializers,
+    /// as they were before going allocation-free, for reference.
+    namespace Legacy
+    {
+        std::string parseTile(const std::string& message)
+        {
+            Poco::StringTokenizer tokens(message, " ",
+                                         Poco::StringTokenizer::TOK_IGNORE_EMPTY |
+                                         Poco::StringTokenizer::TOK_TRIM);
+            std::map<std::string, int> pairs;
+            pairs["ver"] = -1;
+            pairs["imgsize"] = 0;
+            pairs["id"] = -1;
+            pairs["solid"] = 0;
+            for (size_t i = 0; i < tokens.count(); ++i)
+            {
+                std::string name;
+                int value = -1;
+                if (LOOLProtocol::parseNameIntegerPair(tokens[i], name, value))
+                {
+                    pairs[name] = value;
+                }
+            }
+
+            // Validates.
+            TileDesc(pairs["part"], pairs["width"], pairs["height"],
+                     pairs["tileposx"], pairs["tileposy"],
+                     pairs["tilewidth"], pairs["tileheight"],
+                     pairs["ver"], pairs["imgsize"], pairs["id"], pairs["solid"] != 0);
+
+            std::ostringstream oss;
+            oss << "tile:"
+                << " part=" << pairs["part"]
+                << " width=" << pairs["width"]
+                << " height=" << pairs["height"]
+                << " tileposx=" << pairs["tileposx"]
+                << " tileposy=" << pairs["tileposy"]
+                << " tilewidth=" << pairs["tilewidth"]
+                << " tileheight=" << pairs["tileheight"]
+                << " ver=" << pairs["ver"]
+                << " imgsize=" << pairs["imgsize"];
+            if (pairs["id"] >= 0)
+            {
+                oss << " id=" << pairs["id"];
+            }
+
+            if (pairs["solid"] != 0)
+            {
+                oss << " solid=1";
+            }
+
+            return oss.str();
+        }
+
+        /// Returns an empty string when there are no tiles.
+        std::string parseTileCombined(const std::string& message)
+        {
+            const int flags = Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM;
+            Poco::StringTokenizer tokens(message, " ", flags);
+            std::map<std::string, int> pairs;
+            pairs["ver"] = -1;
+            pairs["id"] = -1;
+            std::map<std::string, std::string> lists;
+            for (size_t i = 0; i < tokens.count(); ++i)
+            {
+                std::string name;
+                std::string value;
+                if (LOOLProtocol::parseNameValuePair(tokens[i], name, value))
+                {
+                    if (name == "tileposx" || name == "tileposy" || name == "imgsize" || name == "solid")
+                    {
+                        lists[name] = value;
+                    }
+                    else
+                    {
+                        int v = 0;
+                        if (LOOLProtocol::stringToInteger(value, v))
+                        {
+                            pairs[name] = v;
+                        }
+                    }
+                }
+            }
+
+            if (pairs["part"] < 0 || pairs["width"] <= 0 || pairs["height"] <= 0 ||
+                pairs["tilewidth"] <= 0 || pairs["tileheight"] <= 0)
+            {
+                throw BadArgumentException("Invalid tilecombine descriptor.");
+            }
+
+            Poco::StringTokenizer positionXtokens(lists["tileposx"], ",", flags);
+            Poco::StringTokenizer positionYtokens(lists["tileposy"], ",", flags);
+            Poco::StringTokenizer sizeTokens(lists["imgsize"], ",", flags);
+            Poco::StringTokenizer solidTokens(lists["solid"], ",", flags);
+            const auto count = positionYtokens.count();
+            if (count != positionXtokens.count() ||
+                (!lists["imgsize"].empty() && count != sizeTokens.count()) ||
+                (!lists["solid"].empty() && count != solidTokens.count()))
+            {
+                throw BadArgumentException("Invalid tilecombine descriptor. Uneven number of tiles.");
+            }
+
+            std::ostringstream x, y, sizes, solids;
+            bool anySolid = false;
+            for (size_t i = 0; i < count; ++i)
+            {
+                int values[4] = { 0, 0, 0, 0 };
+                if (!LOOLProtocol::stringToInteger(positionXtokens[i], values[0]) ||
+                    !LOOLProtocol::stringToInteger(positionYtokens[i], values[1]) ||
+                    (sizeTokens.count() && !LOOLProtocol::stringToInteger(sizeTokens[i], values[2])) ||
+                    (solidTokens.count() && !LOOLProtocol::stringToInteger(solidTokens[i], values[3])))
+                {
+                    throw BadArgumentException("Invalid tilecombine descriptor.");
+                }
+
+                // Validates.
+                TileDesc(pairs["part"], pairs["width"], pairs["height"], values[0], values[1],
+                         pairs["tilewidth"], pairs["tileheight"], pairs["ver"], values[2], pairs["id"], values[3] != 0);
+
+                const char *separator = (i ? "," : "");
+                x << separator << values[0];
+                y << separator << values[1];
+                sizes << separator << values[2];
+                solids << separator << (values[3] != 0 ? 1 : 0);
+                anySolid = anySolid || values[3] != 0;
+            }
+
+            if (count == 0)
+            {
+                return std::string();
+            }
+
+            std::ostringstream oss;
+            oss << "tilecombine:"
+                << " part=" << pairs["part"]
+                << " width=" << pairs["width"]
+                << " height=" << pairs["height"]
+                << " tileposx=" << x.str()
+                << " tileposy=" << y.str()
+                << " imgsize=" << sizes.str();
+            if (anySolid)
+            {
+                oss << " solid=" << solids.str();
+            }
+
+            oss << " tilewidth=" << pairs["tilewidth"]
+                << " tileheight=" << pairs["tileheight"];
+            if (pairs["ver"] >= 0)
+            {
+                oss << " ver=" << pairs["ver"];
+            }
+
+            if (pairs["id"] >= 0)
+            {
+                oss << " id=" << pairs["id"];
+            }
+
+            return oss.str();
+        }
+    }
+}
+
 void WhiteBoxTests::testRegexListMatcher()
 {
     Util::RegexListMatcher matcher;
@@ -102,6 +416,2215 @@ void WhiteBoxTests::testRegexListMatcher_Init()
     CPPUNIT_ASSERT(matcher.match("192.168.."));
 }
 
+void WhiteBoxTests::testTileIndex()
+{
+    TileIndex index;
+
+    index.insert("a", 0, 0, 0, 3840, 3840);
+    index.insert("b", 0, 3840, 0, 3840, 3840);
+    index.insert("c", 1, 0, 0, 3840, 3840);
+    index.insert("d", 0, 0, 38400, 3840, 3840);
+    index.insert("e", 0, 0, 0, 15360, 15360);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(5), index.size());
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), index.intersecting(0, 0, 0, 100, 100).size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), index.intersecting(1, 0, 0, 100, 100).size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), index.intersecting(-1, 0, 0, 100, 100).size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), index.intersecting(0, 0, 30000, 100, 10000).size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(5), index.intersecting(-1, 0, 0, INT_MAX, INT_MAX).size());
+
+    // Touching edges intersect.
+    const auto found = index.intersecting(0, 3840, 3840, 0, 0);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), found.size());
+
+    // Moving a tile re-indexes it.
+    index.insert("d", 0, 100000, 100000, 3840, 3840);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), index.intersecting(0, 0, 30000, 100, 10000).size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), index.intersecting(0, 100000, 100000, 1, 1).size());
+
+    index.remove("e");
+    index.remove("a");
+    CPPUNIT_ASSERT(!index.contains("a"));
+    CPPUNIT_ASSERT(index.contains("b"));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), index.intersecting(0, 0, 0, 100, 100).size());
+
+    index.clear();
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), index.size());
+}
+
+void WhiteBoxTests::testTaskPool()
+{
+    TaskPool pool("test_pool", 4);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), pool.getThreadCount());
+
+    for (int batch = 0; batch < 10; ++batch)
+    {
+        std::vector<int> results(100, 0);
+        std::vector<TaskPool::Task> tasks;
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            tasks.emplace_back([&results, i]() { results[i] = i * i; });
+        }
+
+        pool.run(tasks);
+
+        for (size_t i = 0; i < results.size(); ++i)
+        {
+            CPPUNIT_ASSERT_EQUAL(static_cast<int>(i * i), results[i]);
+        }
+    }
+
+    // The caller does all the work when single-threaded.
+    TaskPool single("test_single", 1);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), single.getThreadCount());
+
+    int count = 0;
+    single.run(std::vector<TaskPool::Task>(5, [&count]() { ++count; }));
+    CPPUNIT_ASSERT_EQUAL(5, count);
+}
+
+void WhiteBoxTests::testWorkQueue()
+{
+    // Tasks run in order, and those pending when destroyed still run.
+    std::vector<int> order;
+    {
+        WorkQueue queue("test_work");
+        for (int i = 0; i < 1000; ++i)
+        {
+            queue.post([&order, i]() { order.push_back(i); });
+        }
+    }
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1000), order.size());
+    for (size_t i = 0; i < order.size(); ++i)
+    {
+        CPPUNIT_ASSERT_EQUAL(static_cast<int>(i), order[i]);
+    }
+
+    // A task may hold the last reference to the owner of the queue.
+    struct Owner
+    {
+        Owner() : _queue("test_owner") {}
+        WorkQueue _queue;
+    };
+
+    std::promise<void> done;
+    auto owner = std::make_shared<Owner>();
+    owner->_queue.post([owner, &done]() { done.set_value(); });
+    owner->_queue.post([]() { throw std::runtime_error("Logged and ignored."); });
+    owner.reset();
+    CPPUNIT_ASSERT(done.get_future().wait_for(std::chrono::seconds(5)) == std::future_status::ready);
+
+    // With more threads, tasks run in parallel, and all still run.
+    std::atomic<int> ran(0);
+    {
+        WorkQueue pool("test_pool", 4);
+        std::promise<void> release;
+        auto released = release.get_future().share();
+        std::atomic<int> waiting(0);
+        for (int i = 0; i < 4; ++i)
+        {
+            pool.post([&waiting, &ran, released]() { ++waiting; released.wait(); ++ran; });
+        }
+
+        for (int i = 0; i < 100; ++i)
+        {
+            pool.post([&ran]() { ++ran; });
+        }
+
+        // All four wait at once, which a single thread couldn't.
+        for (int i = 0; i < 500 && waiting < 4; ++i)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+
+        CPPUNIT_ASSERT_EQUAL(4, waiting.load());
+        release.set_value();
+    }
+
+    CPPUNIT_ASSERT_EQUAL(104, ran.load());
+}
+
+void WhiteBoxTests::testBrokerRegistry()
+{
+    BrokerRegistry<int> registry;
+    bool opened = false;
+
+    // While one document is being opened, others open without waiting for it.
+    std::promise<void> release;
+    auto released = release.get_future().share();
+    std::atomic<int> opens(0);
+    auto openSlow = [&opens, released]()
+        {
+            ++opens;
+            released.wait();
+            return std::make_shared<int>(1);
+        };
+
+    auto first = std::async(std::launch::async, [&registry, &openSlow]()
+        {
+            bool firstOpened = false;
+            return std::make_pair(registry.findOrOpen("slow", openSlow, firstOpened), firstOpened);
+        });
+    while (opens == 0)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    auto second = std::async(std::launch::async, [&registry, &openSlow]()
+        {
+            bool secondOpened = false;
+            return std::make_pair(registry.findOrOpen("slow", openSlow, secondOpened), secondOpened);
+        });
+
+    const auto other = registry.findOrOpen("other", []() { return std::make_shared<int>(2); }, opened);
+    CPPUNIT_ASSERT(opened);
+    CPPUNIT_ASSERT_EQUAL(2, *other);
+    CPPUNIT_ASSERT(!registry.find("slow"));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), registry.size());
+
+    // Those asking for the same one get what the first opened.
+    release.set_value();
+    const auto firstResult = first.get();
+    const auto secondResult = second.get();
+    CPPUNIT_ASSERT_EQUAL(1, opens.load());
+    CPPUNIT_ASSERT(firstResult.second);
+    CPPUNIT_ASSERT(!secondResult.second);
+    CPPUNIT_ASSERT(firstResult.first == secondResult.first);
+    CPPUNIT_ASSERT(registry.find("slow") == firstResult.first);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), registry.getAll().size());
+
+    // Failures leave nothing behind.
+    CPPUNIT_ASSERT_THROW(registry.findOrOpen("bad", []() -> std::shared_ptr<int> { throw std::runtime_error("bad"); }, opened),
+                         std::runtime_error);
+    CPPUNIT_ASSERT(!registry.findOrOpen("null", []() { return std::shared_ptr<int>(); }, opened));
+    CPPUNIT_ASSERT(!opened);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), registry.size());
+
+    // Only the registered one is erased.
+    CPPUNIT_ASSERT(!registry.insert("other", std::make_shared<int>(3)));
+    CPPUNIT_ASSERT(!registry.erase("other", std::make_shared<int>(2)));
+    CPPUNIT_ASSERT(registry.erase("other", other));
+    CPPUNIT_ASSERT(registry.erase("slow", firstResult.first));
+    CPPUNIT_ASSERT(registry.empty());
+}
+
+void WhiteBoxTests::testPrespawnControl()
+{
+    PrespawnControl control(1, 4);
+    auto now = std::chrono::steady_clock::now();
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), control.getTarget(now));
+
+    // Children take 2 seconds to get ready.
+    control.recordFork(1, now);
+    now += std::chrono::seconds(2);
+    control.recordReady(now);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), control.getTarget(now));
+
+    // An open per second keeps two more waiting.
+    for (int i = 0; i < 30; ++i)
+    {
+        control.recordRequest(i == 0, now);
+    }
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), control.getTarget(now));
+    CPPUNIT_ASSERT_EQUAL(std::string("target=3 min=1 max=4 open_rate=1.00 ready_ms=2000 hits=1 misses=29"),
+                         control.getStats(now));
+
+    // Within the bounds.
+    for (int i = 0; i < 100; ++i)
+    {
+        control.recordRequest(false, now);
+    }
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), control.getTarget(now));
+
+    // And back down when the opens stop.
+    now += std::chrono::minutes(5);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), control.getTarget(now));
+}
+
+void WhiteBoxTests::testMemoryStats()
+{
+    // Two mappings, in the smaps format.
+    std::istringstream smaps(
+        "00400000-00452000 r-xp 00000000 08:02 173521      /usr/bin/loolforkit\n"
+        "Size:                328 kB\n"
+        "Rss:                 300 kB\n"
+        "Pss:                 100 kB\n"
+        "Shared_Clean:        280 kB\n"
+        "Shared_Dirty:          0 kB\n"
+        "Private_Clean:        20 kB\n"
+        "Private_Dirty:         0 kB\n"
+        "Referenced:          300 kB\n"
+        "Swap:                  0 kB\n"
+        "VmFlags: rd ex mr mw me dw sd\n"
+        "7f5c00000000-7f5c00021000 rw-p 00000000 00:00 0 \n"
+        "Size:                132 kB\n"
+        "Rss:                  64 kB\n"
+        "Pss:                  60 kB\n"
+        "Shared_Clean:          0 kB\n"
+        "Shared_Dirty:          8 kB\n"
+        "Private_Clean:         0 kB\n"
+        "Private_Dirty:        56 kB\n"
+        "Swap:                 12 kB\n"
+        "VmFlags: rd wr mr mw me nr sd\n");
+
+    Util::MemoryStats stats;
+    CPPUNIT_ASSERT(Util::parseMemoryStats(smaps, stats));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(364), stats.rss);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(160), stats.pss);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(76), stats.uss);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(288), stats.shared);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(12), stats.swap);
+
+    // smaps_rollup has one set of totals, after the range.
+    std::istringstream rollup(
+        "00400000-7ffc2d9f6000 ---p 00000000 00:00 0                          [rollup]\n"
+        "Rss:               51200 kB\n"
+        "Pss:               20480 kB\n"
+        "Pss_Anon:          10240 kB\n"
+        "Shared_Clean:      30720 kB\n"
+        "Shared_Dirty:          0 kB\n"
+        "Private_Clean:      2048 kB\n"
+        "Private_Dirty:     18432 kB\n"
+        "Swap:                  0 kB\n");
+
+    Util::MemoryStats totals;
+    CPPUNIT_ASSERT(Util::parseMemoryStats(rollup, totals));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(20480), totals.pss);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(20480), totals.uss);
+    CPPUNIT_ASSERT_EQUAL(totals.rss, totals.uss + totals.shared);
+
+    // This process, which is readable.
+    Util::MemoryStats self;
+    CPPUNIT_ASSERT(Util::getMemoryStats(Poco::Process::id(), self));
+    CPPUNIT_ASSERT(self.pss > 0 && self.pss <= self.rss);
+    CPPUNIT_ASSERT(Util::getResidentMemory(Poco::Process::id()) > 0);
+
+    std::istringstream garbage("not smaps\n");
+    Util::MemoryStats none;
+    CPPUNIT_ASSERT(!Util::parseMemoryStats(garbage, none));
+}
+
+void WhiteBoxTests::testCpuTime()
+{
+    const long ticksPerSecond = sysconf(_SC_CLK_TCK);
+
+    // The name may have spaces and parentheses, utime and stime follow 11 fields after it.
+    const std::string stat = "1234 (kit (a) b) S 1 1234 1234 0 -1 4194560 2048 0 0 0 " +
+                             std::to_string(3 * ticksPerSecond) + " " + std::to_string(ticksPerSecond) +
+                             " 0 0 20 0 5 0 100 1000000 200 18446744073709551615";
+    CPPUNIT_ASSERT_EQUAL(4000L, Util::parseCpuTime(stat));
+
+    CPPUNIT_ASSERT_EQUAL(-1L, Util::parseCpuTime("1234 (kit) S 1 2"));
+    CPPUNIT_ASSERT_EQUAL(-1L, Util::parseCpuTime("not stat"));
+
+    // This process, which has run.
+    CPPUNIT_ASSERT(Util::getCpuTime(Poco::Process::id()) >= 0);
+}
+
+void WhiteBoxTests::testMemoryPressure()
+{
+    typedef MemoryPressure::Level Level;
+
+    MemoryPressure pressure(1000);
+    CPPUNIT_ASSERT(pressure.update(500) == Level::None);
+    CPPUNIT_ASSERT(pressure.update(700) == Level::ShrinkTileCaches);
+    CPPUNIT_ASSERT(pressure.update(850) == Level::TrimKits);
+    CPPUNIT_ASSERT(pressure.update(950) == Level::UnloadDocuments);
+
+    // Each level is left only a margin below it.
+    CPPUNIT_ASSERT(pressure.update(870) == Level::UnloadDocuments);
+    CPPUNIT_ASSERT(pressure.update(849) == Level::TrimKits);
+    CPPUNIT_ASSERT(pressure.update(760) == Level::TrimKits);
+    CPPUNIT_ASSERT(pressure.update(600) == Level::None);
+    CPPUNIT_ASSERT(pressure.update(660) == Level::None);
+    CPPUNIT_ASSERT_EQUAL(std::string("level=none used_kb=660 limit_kb=1000"), pressure.getStats());
+
+    // Up to its limit, and beyond, directly.
+    CPPUNIT_ASSERT(pressure.update(1200) == Level::UnloadDocuments);
+
+    // Disabled.
+    pressure.setLimit(0);
+    CPPUNIT_ASSERT(pressure.update(1200) == Level::None);
+}
+
+void WhiteBoxTests::testKitPlacement()
+{
+    const std::vector<int> cpus = KitPlacement::parseCpuList("8-11,0-3,5,");
+    CPPUNIT_ASSERT_EQUAL(std::string("0-3,5,8-11"), KitPlacement::toCpuList(cpus));
+    CPPUNIT_ASSERT(KitPlacement::parseCpuList("").empty());
+
+    KitPlacement::Node node0;
+    node0._id = 0;
+    node0._cpus = KitPlacement::parseCpuList("0-3");
+    KitPlacement::Node node1;
+    node1._id = 1;
+    node1._cpus = KitPlacement::parseCpuList("4-7");
+    const std::vector<KitPlacement::Node> nodes = { node0, node1 };
+
+    // Alternating the nodes, then the least used CPUs of each.
+    KitPlacement placement(nodes, 2);
+    std::vector<std::string> placed;
+    for (int pid = 1; pid <= 4; ++pid)
+    {
+        const auto kit = placement.choose();
+        placement.add(pid, kit);
+        placed.push_back(KitPlacement::describe(kit._cpus, nodes));
+    }
+
+    CPPUNIT_ASSERT_EQUAL(std::string("0:0-1"), placed[0]);
+    CPPUNIT_ASSERT_EQUAL(std::string("1:4-5"), placed[1]);
+    CPPUNIT_ASSERT_EQUAL(std::string("0:2-3"), placed[2]);
+    CPPUNIT_ASSERT_EQUAL(std::string("1:6-7"), placed[3]);
+
+    placement.remove(1);
+    placement.remove(4);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), placement.getKitCount(0));
+    CPPUNIT_ASSERT_EQUAL(std::string("0:0-1"), KitPlacement::describe(placement.choose()._cpus, nodes));
+
+    // Across the nodes, or all of a single one, is not pinned.
+    CPPUNIT_ASSERT_EQUAL(std::string("-"), KitPlacement::describe(KitPlacement::parseCpuList("3-4"), nodes));
+    CPPUNIT_ASSERT_EQUAL(std::string("-"), KitPlacement::describe(node0._cpus, { node0 }));
+    CPPUNIT_ASSERT(!KitPlacement::readNodes().empty());
+}
+
+void WhiteBoxTests::testCluster()
+{
+    Cluster::Load load;
+    CPPUNIT_ASSERT(Cluster::Load::parse("spare_kits=2 free_kb=-1 documents=5", load));
+    CPPUNIT_ASSERT_EQUAL(std::string("spare_kits=2 free_kb=-1 documents=5"), load.serialize());
+    CPPUNIT_ASSERT(load.hasRoom());
+    CPPUNIT_ASSERT(!Cluster::Load::parse("spare_kits=2 documents=5", load));
+
+    // Every node finds the same owners, spread over all of them.
+    const std::vector<std::string> nodes = { "http://a:9980", "http://b:9980", "http://c:9980" };
+    Cluster a(nodes[0], nodes, 10000);
+    Cluster b(nodes[1], nodes, 10000);
+    std::map<std::string, std::string> owners;
+    std::map<std::string, int> owned;
+    for (int i = 0; i < 3000; ++i)
+    {
+        const std::string docKey = "/wopi/files/" + std::to_string(i);
+        owners[docKey] = a.getOwner(docKey);
+        CPPUNIT_ASSERT_EQUAL(owners[docKey], b.getOwner(docKey));
+        ++owned[owners[docKey]];
+    }
+
+    for (const auto& node : nodes)
+    {
+        CPPUNIT_ASSERT(owned[node] > 500);
+    }
+
+    // Once one is down, only its documents change owner.
+    a.setDown(nodes[2]);
+    CPPUNIT_ASSERT(!a.isUp(nodes[2]));
+    for (const auto& it : owners)
+    {
+        const auto owner = a.getOwner(it.first);
+        CPPUNIT_ASSERT(owner != nodes[2]);
+        CPPUNIT_ASSERT(it.second == nodes[2] || owner == it.second);
+    }
+
+    // Heard of again, it is back.
+    const auto now = std::chrono::steady_clock::now();
+    Cluster::Load busy;
+    Cluster::Load idle;
+    idle._spareKits = 1;
+    idle._documents = 1;
+    Cluster::Load full = idle;
+    full._documents = 0;
+    full._freeKb = 1024;
+    a.setLoad(nodes[0], busy, now);
+    a.setLoad(nodes[1], idle, now);
+    a.setLoad(nodes[2], full, now);
+    CPPUNIT_ASSERT(a.isUp(nodes[2]));
+    CPPUNIT_ASSERT_EQUAL(owners.begin()->second, a.getOwner(owners.begin()->first));
+
+    // Placed where there is room, and kept there while held.
+    CPPUNIT_ASSERT_EQUAL(nodes[1], a.place("doc", now));
+    idle._documents = 10;
+    a.setLoad(nodes[1], idle, now);
+    a.release("doc", now);
+    CPPUNIT_ASSERT_EQUAL(nodes[1], a.place("doc", now));
+    a.release("doc", now);
+
+    // Forgotten once released for long, and placed here when none has room.
+    a.expire(now + std::chrono::minutes(2));
+    CPPUNIT_ASSERT(!a.isUp(nodes[1]));
+    CPPUNIT_ASSERT_EQUAL(nodes[0], a.place("doc", now));
+    CPPUNIT_ASSERT(a.getStats().find("self=http://a:9980 placements=1\n") == 0);
+
+    // The secret the nodes authenticate with.
+    CPPUNIT_ASSERT(Util::equalsConstantTime("secret", "secret"));
+    CPPUNIT_ASSERT(!Util::equalsConstantTime("secret", "secreT"));
+    CPPUNIT_ASSERT(!Util::equalsConstantTime("secret", "secret2"));
+    CPPUNIT_ASSERT(!Util::equalsConstantTime("", "secret"));
+    CPPUNIT_ASSERT(Util::equalsConstantTime("", ""));
+}
+
+void WhiteBoxTests::testConnectionPool()
+{
+    struct Session
+    {
+        std::string _key;
+        int _id;
+    };
+
+    int created = 0;
+    ConnectionPool<Session> pool([&created](const std::string& key)
+                                 {
+                                     return std::unique_ptr<Session>(new Session{ key, ++created });
+                                 }, 2, 1000);
+
+    const auto start = std::chrono::steady_clock::now();
+    bool reused = true;
+    auto a = pool.acquire("host:443", start, reused);
+    CPPUNIT_ASSERT(!reused);
+    auto b = pool.acquire("host:443", start, reused);
+    auto c = pool.acquire("host:443", start, reused);
+    auto other = pool.acquire("other:80", start, reused);
+    CPPUNIT_ASSERT_EQUAL(4, created);
+
+    // Only as many kept per host, the last given back reused first.
+    pool.release("host:443", std::move(a), start);
+    pool.release("host:443", std::move(b), start);
+    pool.release("host:443", std::move(c), start);
+    pool.release("other:80", std::move(other), start);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), pool.getIdleCount());
+
+    a = pool.acquire("host:443", start, reused);
+    CPPUNIT_ASSERT(reused);
+    CPPUNIT_ASSERT_EQUAL(3, a->_id);
+    CPPUNIT_ASSERT_EQUAL(std::string("host:443"), a->_key);
+
+    // Not once idle for too long.
+    a = pool.acquire("host:443", start + std::chrono::milliseconds(1000), reused);
+    CPPUNIT_ASSERT(!reused);
+    CPPUNIT_ASSERT_EQUAL(5, a->_id);
+    CPPUNIT_ASSERT_EQUAL(std::string("hosts=1 idle=1 created=5 reused=1"), pool.getStats());
+
+    // None kept when disabled.
+    pool.setLimits(0, 1000);
+    pool.release("host:443", std::move(a), start);
+    a = pool.acquire("host:443", start, reused);
+    CPPUNIT_ASSERT(!reused);
+}
+
+void WhiteBoxTests::testExpiringCache()
+{
+    ExpiringCache<int> cache(1000, 2);
+    const auto start = std::chrono::steady_clock::now();
+    int value = 0;
+    CPPUNIT_ASSERT(!cache.get("a", value, start));
+
+    cache.put("a", 1, start);
+    cache.put("b", 2, start + std::chrono::milliseconds(100));
+    CPPUNIT_ASSERT(cache.get("a", value, start + std::chrono::milliseconds(999)));
+    CPPUNIT_ASSERT_EQUAL(1, value);
+    CPPUNIT_ASSERT(!cache.get("a", value, start + std::chrono::milliseconds(1000)));
+
+    // Full, the oldest goes.
+    cache.put("a", 3, start + std::chrono::milliseconds(200));
+    cache.put("c", 4, start + std::chrono::milliseconds(300));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), cache.size());
+    CPPUNIT_ASSERT(!cache.get("b", value, start + std::chrono::milliseconds(300)));
+    CPPUNIT_ASSERT(cache.get("a", value, start + std::chrono::milliseconds(300)));
+    CPPUNIT_ASSERT_EQUAL(3, value);
+
+    cache.erase("a");
+    CPPUNIT_ASSERT(!cache.get("a", value, start + std::chrono::milliseconds(300)));
+    CPPUNIT_ASSERT_EQUAL(std::string("entries=1 hits=2 misses=4"), cache.getStats());
+
+    // Nothing kept when disabled.
+    cache.setLimits(0, 2);
+    cache.put("a", 1, start);
+    CPPUNIT_ASSERT(!cache.get("a", value, start));
+}
+
+void WhiteBoxTests::testConversionQueue()
+{
+    ConversionQueue queue(1, 1);
+    size_t queueMs = 0;
+    CPPUNIT_ASSERT(queue.enter(0, queueMs));
+
+    // The next waits its turn, the one after is turned away.
+    std::promise<bool> second;
+    std::thread waiter([&queue, &second]()
+        {
+            size_t waitedMs = 0;
+            second.set_value(queue.enter(5000, waitedMs));
+        });
+
+    auto admitted = second.get_future();
+    CPPUNIT_ASSERT(admitted.wait_for(std::chrono::milliseconds(50)) == std::future_status::timeout);
+    while (queue.getStats().find("queued=1") == std::string::npos)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    CPPUNIT_ASSERT(!queue.enter(5000, queueMs));
+
+    queue.leave(true, 10);
+    CPPUNIT_ASSERT(admitted.get());
+    waiter.join();
+
+    // Not its turn in time.
+    CPPUNIT_ASSERT(!queue.enter(10, queueMs));
+    queue.leave(false, 30);
+    CPPUNIT_ASSERT(queue.enter(0, queueMs));
+    queue.leave(true, 20);
+
+    const auto stats = queue.getStats();
+    CPPUNIT_ASSERT(stats.find("running=0 queued=0 done=2 failed=1 rejected=2 ") == 0);
+    CPPUNIT_ASSERT(stats.find(" convert_ms_avg=20 convert_ms_max=30") != std::string::npos);
+}
+
+void WhiteBoxTests::testConversionCache()
+{
+    char dirTemplate[] = "/tmp/lool-convert-XXXXXX";
+    const std::string dir = mkdtemp(dirTemplate);
+    const auto write = [&dir](const std::string& name, const std::string& data)
+        {
+            std::ofstream(dir + '/' + name) << data;
+            return dir + '/' + name;
+        };
+
+    const auto source = write("source.odt", "document");
+    const auto keyPdf = ConversionCache::getKey(source, "pdf", "");
+    CPPUNIT_ASSERT(!keyPdf.empty());
+    CPPUNIT_ASSERT(keyPdf != ConversionCache::getKey(source, "png", ""));
+    CPPUNIT_ASSERT(keyPdf != ConversionCache::getKey(source, "pdf", "x"));
+    CPPUNIT_ASSERT_EQUAL(keyPdf, ConversionCache::getKey(write("copy.odt", "document"), "pdf", ""));
+
+    {
+        ConversionCache cache(dir + "/cache", 10);
+        CPPUNIT_ASSERT(cache.find(keyPdf).empty());
+        CPPUNIT_ASSERT(cache.add(keyPdf, write("a.pdf", "aaaa")));
+        CPPUNIT_ASSERT(cache.add("b", write("b.pdf", "bbbb")));
+        CPPUNIT_ASSERT(!cache.add("large", write("large.pdf", "01234567890")));
+
+        const auto path = cache.find(keyPdf);
+        std::ifstream file(path);
+        std::string data;
+        file >> data;
+        CPPUNIT_ASSERT_EQUAL(std::string("aaaa"), data);
+
+        // Over the limit, the least recently used goes.
+        CPPUNIT_ASSERT(cache.add("c", write("c.pdf", "cccc")));
+        CPPUNIT_ASSERT(cache.find("b").empty());
+        CPPUNIT_ASSERT(!cache.find(keyPdf).empty());
+        CPPUNIT_ASSERT_EQUAL(std::string("entries=2 bytes=8 hits=2 misses=2 evicted=1"), cache.getStats());
+    }
+
+    // Those kept before are found again.
+    ConversionCache cache(dir + "/cache", 10);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), cache.size());
+    CPPUNIT_ASSERT(!cache.find("c").empty());
+
+    Util::removeFile(dir, true);
+}
+
+void WhiteBoxTests::testTileCacheQuota()
+{
+    char dirTemplate[] = "/tmp/lool-quota-XXXXXX";
+    const std::string root = mkdtemp(dirTemplate);
+    const auto exists = [](const std::string& path)
+        {
+            struct stat st;
+            return stat(path.c_str(), &st) == 0;
+        };
+    const auto makeCache = [&root](const std::string& path, const time_t modified)
+        {
+            std::string dir = root;
+            for (const auto& name : Poco::StringTokenizer(path, "/"))
+            {
+                dir += '/' + name;
+                mkdir(dir.c_str(), S_IRWXU);
+            }
+
+            std::ofstream(dir + "/tile.png") << std::string(64 * 1024, 't');
+            const struct utimbuf times = { modified, modified };
+            utime((dir + "/tile.png").c_str(), &times);
+            utime(dir.c_str(), &times);
+            return dir;
+        };
+
+    const auto a = makeCache("1/2/3/aaa", 1000);
+    const auto b = makeCache("1/2/4/bbb", 2000);
+    const auto c = makeCache("5/6/7/ccc", 3000);
+    // Not a tile cache.
+    const auto convert = makeCache("convert/x", 0);
+
+    TileCacheQuota quota(root, 0);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), quota.scan());
+    const size_t bytes = quota.getBytes() / 3;
+    CPPUNIT_ASSERT(bytes >= 64 * 1024);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), quota.update());
+
+    // Over the quota, the least recently used closed goes, not the one open.
+    quota.setQuota(root, 2 * bytes + bytes / 2);
+    quota.open(a, 4000);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), quota.update());
+    CPPUNIT_ASSERT(exists(a));
+    CPPUNIT_ASSERT(!exists(b));
+    CPPUNIT_ASSERT(exists(c));
+    CPPUNIT_ASSERT(exists(root + "/1/2"));
+
+    // Once closed, it is used after the others.
+    quota.close(a, 5000);
+    quota.setQuota(root, bytes);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), quota.update());
+    CPPUNIT_ASSERT(exists(a));
+    CPPUNIT_ASSERT(!exists(c));
+    CPPUNIT_ASSERT(!exists(root + "/5"));
+    CPPUNIT_ASSERT(exists(convert));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), quota.size());
+    CPPUNIT_ASSERT_EQUAL(bytes, quota.getBytes());
+    CPPUNIT_ASSERT_EQUAL("documents=1 open=0 bytes=" + std::to_string(bytes) +
+                         " open_bytes=0 quota=" + std::to_string(bytes) +
+                         " evicted=2 evicted_bytes=" + std::to_string(2 * bytes), quota.getStats());
+
+    // Removed by hand, it is forgotten.
+    Util::removeFile(a, true);
+    quota.open(a, 6000);
+    quota.close(a, 6000);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), quota.update());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), quota.size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), quota.getBytes());
+
+    Util::removeFile(root, true);
+}
+
+void WhiteBoxTests::testAssetCache()
+{
+    const AssetCache::Template page("<a href=\"/%VERSION%/x.css\">100% %NOT SET% %HOST%</a>%ACCESS_TOKEN%");
+    std::map<std::string, std::string> values;
+    values["VERSION"] = "v1";
+    values["ACCESS_TOKEN"] = "token";
+    CPPUNIT_ASSERT_EQUAL(std::string("<a href=\"/v1/x.css\">100% %NOT SET% %HOST%</a>token"), page.render(values));
+    CPPUNIT_ASSERT_EQUAL(std::string("50%"), AssetCache::Template("50%").render(values));
+
+    CPPUNIT_ASSERT(AssetCache::accepts("gzip, deflate, br", "br"));
+    CPPUNIT_ASSERT(AssetCache::accepts("deflate;q=0.5, gzip;q=1.0", "gzip"));
+    CPPUNIT_ASSERT(!AssetCache::accepts("gzip;q=0, deflate", "gzip"));
+    CPPUNIT_ASSERT(!AssetCache::accepts("x-gzip", "gzip"));
+    CPPUNIT_ASSERT(!AssetCache::accepts("", "gzip"));
+
+    char dirTemplate[] = "/tmp/lool-assets-XXXXXX";
+    const std::string root = mkdtemp(dirTemplate);
+    mkdir((root + "/dist").c_str(), S_IRWXU);
+    mkdir((root + "/dist/images").c_str(), S_IRWXU);
+    std::ofstream(root + "/dist/app.js") << std::string(1000, 'a');
+    std::ofstream(root + "/dist/app.js.br") << "brotli";
+    std::ofstream(root + "/dist/images/x.png") << "png";
+    std::ofstream(root + "/dist/large.js") << std::string(2000, 'b');
+
+    AssetCache cache;
+    cache.load(root, "/dist", 1500);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), cache.size());
+    CPPUNIT_ASSERT(cache.find("/dist/large.js") == nullptr);
+    CPPUNIT_ASSERT(cache.find("/dist/app.js.br") == nullptr);
+
+    const auto image = cache.find("/dist/images/x.png");
+    CPPUNIT_ASSERT(image != nullptr);
+    CPPUNIT_ASSERT_EQUAL(std::string("image/png"), image->_mimeType);
+    CPPUNIT_ASSERT(image->_gzip.empty());
+
+    const auto script = cache.find("/dist/app.js");
+    CPPUNIT_ASSERT(script != nullptr);
+    CPPUNIT_ASSERT_EQUAL(std::string("application/javascript"), script->_mimeType);
+    CPPUNIT_ASSERT(!script->_gzip.empty() && script->_gzip.size() < script->_content.size());
+
+    std::string encoding;
+    CPPUNIT_ASSERT_EQUAL(std::string("brotli"), script->select("gzip, br", encoding));
+    CPPUNIT_ASSERT_EQUAL(std::string("br"), encoding);
+    CPPUNIT_ASSERT_EQUAL(script->_gzip, script->select("gzip", encoding));
+    CPPUNIT_ASSERT_EQUAL(std::string("gzip"), encoding);
+    CPPUNIT_ASSERT_EQUAL(script->_content, script->select("", encoding));
+    CPPUNIT_ASSERT(encoding.empty());
+
+    // Strong, and distinct per variant.
+    const auto etag = script->getETag("");
+    CPPUNIT_ASSERT(etag.size() > 2 && etag.front() == '"' && etag.back() == '"');
+    CPPUNIT_ASSERT(etag != script->getETag("gzip"));
+    CPPUNIT_ASSERT(cache.isNotModified(etag, etag));
+    CPPUNIT_ASSERT(cache.isNotModified("\"other\", W/" + etag, etag));
+    CPPUNIT_ASSERT(!cache.isNotModified(script->getETag("gzip"), etag));
+    CPPUNIT_ASSERT(!cache.isNotModified("", etag));
+
+    Util::removeFile(root, true);
+}
+
+void WhiteBoxTests::testFontCache()
+{
+    FontCache cache(10);
+
+    // Built once, by the first asking.
+    CPPUNIT_ASSERT(cache.startBuilding());
+    CPPUNIT_ASSERT(!cache.startBuilding());
+
+    // Kept by name, decoded, whichever way a client or a kit encoded it.
+    CPPUNIT_ASSERT_EQUAL(std::string("Liberation Sans (Bold)"), FontCache::getName("Liberation%20Sans%20%28Bold%29"));
+    CPPUNIT_ASSERT_EQUAL(FontCache::getName("DejaVu%20Sans"), FontCache::getName("DejaVu Sans"));
+    CPPUNIT_ASSERT(!cache.lookup("DejaVu Sans"));
+
+    CPPUNIT_ASSERT(cache.add("DejaVu Sans", "abcd", 4));
+    CPPUNIT_ASSERT(!cache.add("DejaVu Sans", "efgh", 4));
+    const auto preview = cache.lookup("DejaVu Sans");
+    CPPUNIT_ASSERT(preview);
+    CPPUNIT_ASSERT_EQUAL(std::string("abcd"), std::string(preview->begin(), preview->end()));
+
+    // Nothing past the limit, nor empty.
+    CPPUNIT_ASSERT(cache.add("Carlito", "ijklmn", 6));
+    CPPUNIT_ASSERT(!cache.add("Caladea", "o", 1));
+    CPPUNIT_ASSERT(!cache.add("Gentium", "", 0));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), cache.size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(10), cache.getBytes());
+}
+
+void WhiteBoxTests::testUnpremultiply()
+{
+    // Mostly opaque, as in document tiles, with odd lengths to hit the tails.
+    for (size_t pixels = 0; pixels < 70; ++pixels)
+    {
+        std::vector<unsigned char> data(pixels * 4);
+        for (size_t i = 0; i < pixels; ++i)
+        {
+            const uint8_t alpha = (i % 5 == 3 ? Util::rng::getNext() % 256 : 255);
+            data[i * 4 + 0] = Util::rng::getNext() % (alpha + 1);
+            data[i * 4 + 1] = Util::rng::getNext() % (alpha + 1);
+            data[i * 4 + 2] = Util::rng::getNext() % (alpha + 1);
+            data[i * 4 + 3] = alpha;
+        }
+
+        std::vector<unsigned char> expected(data);
+        for (size_t i = 0; i < pixels; ++i)
+        {
+            unsigned char* b = &expected[i * 4];
+            const unsigned alpha = b[3];
+            const unsigned blue = b[0];
+            const unsigned green = b[1];
+            const unsigned red = b[2];
+            b[0] = (alpha == 0 ? 0 : (red * 255 + alpha / 2) / alpha);
+            b[1] = (alpha == 0 ? 0 : (green * 255 + alpha / 2) / alpha);
+            b[2] = (alpha == 0 ? 0 : (blue * 255 + alpha / 2) / alpha);
+        }
+
+        std::vector<unsigned char> scalar(data);
+        png::unpremultiplyPixelsScalar(scalar.data(), pixels);
+        CPPUNIT_ASSERT(expected == scalar);
+
+        png::unpremultiplyPixels(data.data(), pixels);
+        CPPUNIT_ASSERT(expected == data);
+    }
+}
+
+void WhiteBoxTests::testSolidTiles()
+{
+    // A 4x2 tile at (1, 1) in a 6x4 buffer, surrounded by other colours.
+    std::vector<uint32_t> pixmap(6 * 4, 0xff000000);
+    for (int y = 1; y < 3; ++y)
+    {
+        for (int x = 1; x < 5; ++x)
+        {
+            pixmap[y * 6 + x] = 0xffffffff;
+        }
+    }
+
+    const auto data = reinterpret_cast<const unsigned char*>(pixmap.data());
+    uint32_t colour = 0;
+    CPPUNIT_ASSERT(png::isUniform(data, 1, 1, 4, 2, 6, colour));
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint32_t>(0xffffffff), colour);
+    CPPUNIT_ASSERT(!png::isUniform(data, 0, 1, 4, 2, 6, colour));
+    CPPUNIT_ASSERT(!png::isUniform(data, 1, 1, 4, 3, 6, colour));
+
+    TileDesc tile(0, 256, 256, 0, 3840, 3840, 3840, 5, 100);
+    CPPUNIT_ASSERT(!TileDesc::parse(tile.serialize("tile:")).isSolid());
+    tile.setSolid(true);
+    CPPUNIT_ASSERT(TileDesc::parse(tile.serialize("tile:")).isSolid());
+
+    auto tileCombined = TileCombined::parse("tilecombine: part=0 width=256 height=256 tileposx=0,3840,7680 "
+                                            "tileposy=0,0,0 imgsize=10,20,30 tilewidth=3840 tileheight=3840");
+    CPPUNIT_ASSERT(tileCombined.serialize().find("solid=") == std::string::npos);
+    tileCombined.getTiles()[1].setSolid(true);
+
+    const auto parsed = TileCombined::parse(tileCombined.serialize("tilecombine:"));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), parsed.getTiles().size());
+    CPPUNIT_ASSERT(!parsed.getTiles()[0].isSolid());
+    CPPUNIT_ASSERT(parsed.getTiles()[1].isSolid());
+    CPPUNIT_ASSERT(!parsed.getTiles()[2].isSolid());
+    CPPUNIT_ASSERT_EQUAL(20, parsed.getTiles()[1].getImgSize());
+}
+
+void WhiteBoxTests::testChangedArea()
+{
+    // A 5x4 tile at (2, 1) in a 10x8 buffer, and its previous render.
+    std::vector<uint32_t> pixmap(10 * 8, 0xffffffff);
+    std::vector<uint32_t> previous(5 * 4, 0xffffffff);
+    const auto data = reinterpret_cast<unsigned char*>(pixmap.data());
+    const auto previousData = reinterpret_cast<const unsigned char*>(previous.data());
+
+    int x = -1;
+    int y = -1;
+    int width = -1;
+    int height = -1;
+    CPPUNIT_ASSERT(!png::getChangedArea(previousData, data, 2, 1, 5, 4, 10, x, y, width, height));
+
+    // Outside of the tile.
+    pixmap[0] = 0xff000000;
+    CPPUNIT_ASSERT(!png::getChangedArea(previousData, data, 2, 1, 5, 4, 10, x, y, width, height));
+
+    pixmap[(1 + 1) * 10 + 2 + 1] = 0xff000000;
+    pixmap[(1 + 2) * 10 + 2 + 3] = 0xff0000ff;
+    CPPUNIT_ASSERT(png::getChangedArea(previousData, data, 2, 1, 5, 4, 10, x, y, width, height));
+    CPPUNIT_ASSERT_EQUAL(1, x);
+    CPPUNIT_ASSERT_EQUAL(1, y);
+    CPPUNIT_ASSERT_EQUAL(3, width);
+    CPPUNIT_ASSERT_EQUAL(2, height);
+}
+
+void WhiteBoxTests::testTileCoalescer()
+{
+    const int size = 3840;
+    std::vector<TileDesc> tiles;
+    const auto addTile = [&](const int column, const int row)
+        {
+            tiles.emplace_back(0, 256, 256, column * size, row * size, size, size);
+        };
+
+    // A 3x3 square, in no particular order.
+    for (int row = 2; row >= 0; --row)
+    {
+        for (int column = 0; column < 3; ++column)
+        {
+            addTile(column, row);
+        }
+    }
+
+    // A row with a gap, below the square.
+    addTile(0, 3);
+    addTile(2, 3);
+
+    auto groups = TileCoalescer::coalesce(tiles, 16 * 256 * 256);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), groups.size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(9), groups[0].size());
+    CPPUNIT_ASSERT_EQUAL(0, groups[0].front().getTilePosY());
+    CPPUNIT_ASSERT_EQUAL(2 * size, groups[0].back().getTilePosY());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), groups[1].size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), groups[2].size());
+
+    // Under a budget of 4 tiles, the square is split by rows.
+    groups = TileCoalescer::coalesce(tiles, 4 * 256 * 256);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(5), groups.size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), groups[0].size());
+
+    // Every tile is in exactly one group.
+    size_t count = 0;
+    for (const auto& group : groups)
+    {
+        count += group.size();
+    }
+
+    CPPUNIT_ASSERT_EQUAL(tiles.size(), count);
+}
+
+void WhiteBoxTests::testRenderBudget()
+{
+    RenderBudget budget(100, 3);
+    const auto key = RenderBudget::getKey(0, 0, 3840, 3840, 3840);
+    CPPUNIT_ASSERT_EQUAL(0., budget.estimate(key));
+
+    // Averaged with the last render of the tile.
+    budget.record(key, 400);
+    CPPUNIT_ASSERT_EQUAL(400., budget.estimate(key));
+    budget.record(key, 200);
+    CPPUNIT_ASSERT_EQUAL(300., budget.estimate(key));
+    CPPUNIT_ASSERT_EQUAL(0., budget.estimate(RenderBudget::getKey(0, 0, 3840, 1920, 1920)));
+
+    // The tiles first recorded go first.
+    for (int i = 1; i <= 3; ++i)
+    {
+        budget.record(RenderBudget::getKey(0, i * 3840, 0, 3840, 3840), 10);
+    }
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), budget.size());
+    CPPUNIT_ASSERT_EQUAL(0., budget.estimate(key));
+
+    // A quarter of the pixels for each halving of the resolution.
+    CPPUNIT_ASSERT_EQUAL(1, budget.getScale(100));
+    CPPUNIT_ASSERT_EQUAL(2, budget.getScale(101));
+    CPPUNIT_ASSERT_EQUAL(2, budget.getScale(400));
+    CPPUNIT_ASSERT_EQUAL(4, budget.getScale(401));
+    CPPUNIT_ASSERT_EQUAL(8, budget.getScale(100000));
+    CPPUNIT_ASSERT_EQUAL(1, RenderBudget(0).getScale(100000));
+
+    // Each pixel to its nearest.
+    const unsigned char source[] = { 1, 1, 1, 1,  2, 2, 2, 2,
+                                     3, 3, 3, 3,  4, 4, 4, 4 };
+    std::vector<unsigned char> target(4 * 4 * 4);
+    RenderBudget::upscale(source, 2, 2, target.data(), 4, 4);
+    const unsigned char expected[] = { 1, 1, 2, 2,
+                                       1, 1, 2, 2,
+                                       3, 3, 4, 4,
+                                       3, 3, 4, 4 };
+    for (size_t i = 0; i < target.size(); ++i)
+    {
+        CPPUNIT_ASSERT_EQUAL(expected[i / 4], target[i]);
+    }
+}
+
+void WhiteBoxTests::testTileQueuePriority()
+{
+    const auto tileAt = [](const int x, const int y)
+        {
+            return "tile part=0 width=256 height=256 tileposx=" + std::to_string(x) +
+                   " tileposy=" + std::to_string(y) + " tilewidth=3840 tileheight=3840";
+        };
+    const auto get = [](TileQueue& queue)
+        {
+            const auto payload = queue.get();
+            return std::string(payload.data(), payload.size());
+        };
+
+    TileQueue queue;
+    const std::string preview = tileAt(0, 0) + " id=1";
+    const std::string far = tileAt(0, 38400);
+    const std::string near = tileAt(3840, 0);
+    queue.put(preview);
+    queue.put(far);
+    queue.put(near);
+    queue.put(near);
+    queue.put("uno .uno:Bold");
+
+    // Without any view, requests are in order, but other messages first.
+    CPPUNIT_ASSERT_EQUAL(std::string("uno .uno:Bold"), get(queue));
+
+    // The tile right of the cursor, then the one further down, the preview last.
+    queue.updateCursorPosition(1, 4000, 100, 10, 200);
+    CPPUNIT_ASSERT_EQUAL(near, get(queue));
+    CPPUNIT_ASSERT_EQUAL(far, get(queue));
+    CPPUNIT_ASSERT_EQUAL(preview, get(queue));
+
+    // Inside the visible area of a view beats near the cursor of another.
+    queue.updateVisibleArea(2, 0, 30000, 20000, 15000);
+    queue.put(near);
+    queue.put(far);
+    CPPUNIT_ASSERT_EQUAL(far, get(queue));
+    CPPUNIT_ASSERT_EQUAL(near, get(queue));
+
+    // Once the view is gone, the cursor rules again.
+    queue.removeView(2);
+    queue.put(far);
+    queue.put(near);
+    CPPUNIT_ASSERT_EQUAL(near, get(queue));
+    CPPUNIT_ASSERT_EQUAL(far, get(queue));
+
+    // Cancelling keeps the previews.
+    queue.put(near);
+    queue.put(preview);
+    queue.put("canceltiles");
+    CPPUNIT_ASSERT_EQUAL(std::string("canceltiles"), get(queue));
+    CPPUNIT_ASSERT_EQUAL(preview, get(queue));
+}
+
+void WhiteBoxTests::testTilePrefetch()
+{
+    TileQueue queue;
+
+    // Idle, and nothing to prefetch without the zoom of a view.
+    CPPUNIT_ASSERT(queue.get(std::chrono::milliseconds(1)).empty());
+    queue.put("tilecombine part=2 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840");
+    queue.get();
+    queue.updateVisibleArea(1, 0, 0, 7680, 7680);
+    CPPUNIT_ASSERT(queue.getPrefetchRequest(100000, 100000).empty());
+
+    // The two rows below, of the part last requested, once.
+    queue.updateZoom(1, 256, 256, 3840, 3840);
+    CPPUNIT_ASSERT_EQUAL(std::string("tilecombine part=2 width=256 height=256 tileposx=0,3840,0,3840 "
+                                     "tileposy=7680,7680,11520,11520 tilewidth=3840 tileheight=3840"),
+                         queue.getPrefetchRequest(100000, 100000));
+    CPPUNIT_ASSERT(queue.getPrefetchRequest(100000, 100000).empty());
+
+    // Scrolled up to the top: nothing above.
+    queue.updateVisibleArea(1, 0, 3840, 7680, 7680);
+    queue.updateVisibleArea(1, 0, 0, 7680, 7680);
+    CPPUNIT_ASSERT(queue.getPrefetchRequest(100000, 100000).empty());
+
+    // Scrolled right: the columns to the right, within the document.
+    queue.updateVisibleArea(1, 7680, 0, 7680, 7680);
+    CPPUNIT_ASSERT_EQUAL(std::string("tilecombine part=2 width=256 height=256 tileposx=15360,15360 "
+                                     "tileposy=0,3840 tilewidth=3840 tileheight=3840"),
+                         queue.getPrefetchRequest(19000, 100000));
+
+    // Zoomed in: again, at the new size of the tiles.
+    queue.updateZoom(1, 256, 256, 1920, 1920);
+    CPPUNIT_ASSERT(queue.getPrefetchRequest(100000, 100000).find(" tilewidth=1920 ") != std::string::npos);
+}
+
+void WhiteBoxTests::testMPSCMessageQueue()
+{
+    // Small enough for the producers to fill it.
+    MPSCMessageQueue queue(16);
+
+    const int producers = 4;
+    const int messages = 1000;
+    std::vector<std::thread> threads;
+    for (int producer = 0; producer < producers; ++producer)
+    {
+        threads.emplace_back([&queue, producer, messages]()
+            {
+                for (int i = 0; i < messages; ++i)
+                {
+                    queue.put(std::to_string(producer) + ' ' + std::to_string(i));
+                }
+            });
+    }
+
+    // Each producer's messages arrive in order.
+    std::vector<int> next(producers, 0);
+    for (int i = 0; i < producers * messages; ++i)
+    {
+        const auto payload = queue.get();
+        std::istringstream iss(std::string(payload.data(), payload.size()));
+        int producer = -1;
+        int index = -1;
+        iss >> producer >> index;
+        CPPUNIT_ASSERT(producer >= 0 && producer < producers);
+        CPPUNIT_ASSERT_EQUAL(next[producer], index);
+        ++next[producer];
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    // Cleared messages are skipped.
+    queue.put("one");
+    queue.put("two");
+    queue.clear();
+    queue.put("eof");
+    const auto payload = queue.get();
+    CPPUNIT_ASSERT_EQUAL(std::string("eof"), std::string(payload.data(), payload.size()));
+}
+
+void WhiteBoxTests::testMouseMoveCoalescing()
+{
+    MPSCMessageQueue queue(16, MPSCMessageQueue::isSupersededMove);
+    const auto getText = [&queue]()
+        {
+            const auto payload = queue.get();
+            return std::string(payload.data(), payload.size());
+        };
+
+    // A drag: the moves between the clicks go but the last, the keys all stay.
+    queue.put("mouse type=buttondown x=10 y=10 count=1 buttons=1 modifier=0");
+    queue.put("mouse type=move x=11 y=10 count=1 buttons=1 modifier=0");
+    queue.put("mouse type=move x=12 y=11 count=1 buttons=1 modifier=0");
+    queue.put("mouse type=move x=13 y=12 count=1 buttons=1 modifier=0");
+    queue.put("key type=input char=97 key=0");
+    queue.put("key type=input char=97 key=0");
+    queue.put("mouse type=move x=14 y=12 count=1 buttons=1 modifier=0");
+    queue.put("mouse type=move x=15 y=12 count=1 buttons=1 modifier=4096");
+    queue.put("mouse type=buttonup x=15 y=12 count=1 buttons=1 modifier=0");
+    queue.put("mouse type=move x=16 y=12 count=1");
+    queue.put("mouse type=move x=17 y=13 count=1");
+
+    CPPUNIT_ASSERT_EQUAL(std::string("mouse type=buttondown x=10 y=10 count=1 buttons=1 modifier=0"), getText());
+    CPPUNIT_ASSERT_EQUAL(std::string("mouse type=move x=13 y=12 count=1 buttons=1 modifier=0"), getText());
+    CPPUNIT_ASSERT_EQUAL(std::string("key type=input char=97 key=0"), getText());
+    CPPUNIT_ASSERT_EQUAL(std::string("key type=input char=97 key=0"), getText());
+
+    // Not with other modifiers.
+    CPPUNIT_ASSERT_EQUAL(std::string("mouse type=move x=14 y=12 count=1 buttons=1 modifier=0"), getText());
+    CPPUNIT_ASSERT_EQUAL(std::string("mouse type=move x=15 y=12 count=1 buttons=1 modifier=4096"), getText());
+    CPPUNIT_ASSERT_EQUAL(std::string("mouse type=buttonup x=15 y=12 count=1 buttons=1 modifier=0"), getText());
+
+    // The last one queued is kept, whatever comes after.
+    CPPUNIT_ASSERT_EQUAL(std::string("mouse type=move x=17 y=13 count=1"), getText());
+    queue.put("mouse type=move x=18 y=13 count=1");
+    CPPUNIT_ASSERT_EQUAL(std::string("mouse type=move x=18 y=13 count=1"), getText());
+}
+
+void WhiteBoxTests::testInputLatency()
+{
+    const auto isInput = [](const std::string& message)
+        {
+            return TileQueue::isInput(MessageQueue::Payload(message.begin(), message.end()));
+        };
+    CPPUNIT_ASSERT(isInput("key type=input char=97 key=0"));
+    CPPUNIT_ASSERT(isInput("uno .uno:Bold"));
+    CPPUNIT_ASSERT(!isInput("tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840"));
+    CPPUNIT_ASSERT(!isInput("clientvisiblearea x=0 y=0 width=100 height=100"));
+
+    {
+        // Renders go on without input, and under input never handled, once the wait is over.
+        TileQueue queue;
+        CPPUNIT_ASSERT(queue.waitForInputHandled(std::chrono::milliseconds(0)));
+        queue.inputQueued();
+        queue.inputQueued();
+        CPPUNIT_ASSERT(!queue.waitForInputHandled(std::chrono::milliseconds(0)));
+        queue.inputHandled();
+        CPPUNIT_ASSERT(!queue.waitForInputHandled(std::chrono::milliseconds(0)));
+
+        // Dropped, more than were counted.
+        queue.inputHandled(5);
+        CPPUNIT_ASSERT(queue.waitForInputHandled(std::chrono::milliseconds(0)));
+
+        // A render waiting between paints takes the lock only once the input is handled.
+        std::mutex orderMutex;
+        std::vector<std::string> order;
+        bool handledInTime = false;
+        queue.inputQueued();
+        std::thread render([&]()
+            {
+                handledInTime = queue.waitForInputHandled(std::chrono::seconds(60));
+                std::unique_lock<std::mutex> lock(orderMutex);
+                order.push_back("paint");
+            });
+
+        {
+            std::unique_lock<std::mutex> lock(orderMutex);
+            order.push_back("input");
+        }
+
+        queue.inputHandled();
+        render.join();
+        CPPUNIT_ASSERT(handledInTime);
+        CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), order.size());
+        CPPUNIT_ASSERT_EQUAL(std::string("input"), order[0]);
+        CPPUNIT_ASSERT_EQUAL(std::string("paint"), order[1]);
+    }
+
+    // As the kit: a render thread painting a backlog of tiles, each under the
+    // lock that the input of the views is handled under too. Only reported,
+    // the times depending on the load of the machine.
+    constexpr int PaintMs = 10;
+    constexpr int Tiles = 100;
+    constexpr int Keys = 20;
+
+    TileQueue queue;
+    for (int i = 0; i < Tiles; ++i)
+    {
+        queue.put("tile part=0 width=256 height=256 tileposx=" + std::to_string((i % 20) * 3840) +
+                  " tileposy=" + std::to_string((i / 20) * 3840) + " tilewidth=3840 tileheight=3840");
+    }
+
+    std::recursive_mutex lokLock;
+    std::atomic<int> painted(0);
+    std::thread render([&]()
+        {
+            while (true)
+            {
+                const auto payload = queue.get();
+                if (std::string(payload.data(), payload.size()) == "eof")
+                {
+                    break;
+                }
+
+                queue.waitForInputHandled(std::chrono::milliseconds(TileQueue::MaxInputWaitMs));
+                std::unique_lock<std::recursive_mutex> lock(lokLock);
+                std::this_thread::sleep_for(std::chrono::milliseconds(PaintMs));
+                ++painted;
+            }
+        });
+
+    // Keystrokes, from when they are read off the socket to when handled.
+    double totalMs = 0;
+    double maxMs = 0;
+    for (int i = 0; i < Keys; ++i)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(PaintMs / 2 + i % PaintMs));
+        const auto start = std::chrono::steady_clock::now();
+        queue.inputQueued();
+        {
+            std::unique_lock<std::recursive_mutex> lock(lokLock);
+        }
+
+        queue.inputHandled();
+        const double ms = std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now() - start).count() / 1000.;
+        totalMs += ms;
+        maxMs = std::max(maxMs, ms);
+    }
+
+    const int paintedWhileTyping = painted;
+    queue.clear();
+    queue.put("eof");
+    render.join();
+
+    std::cerr << "Keystroke latency under " << Tiles << " tiles queued, painted in "
+              << PaintMs << " ms each: mean " << totalMs / Keys << " ms, max " << maxMs
+              << " ms, " << paintedWhileTyping << " tiles painted meanwhile." << std::endl;
+}
+
+void WhiteBoxTests::testTypingLatencyBench()
+{
+    // As the kit: a view scrolling, its tilecombines rendered one after the
+    // other, while another view types, its keys handled under the lock LOK
+    // is called under, ChildSession::getLock(). The paint is mocked, the
+    // encoding is real. The render holds the lock across painting, encoding
+    // and sending, as it did, then only across painting, as it does.
+    // Only reported, the times depending on the load of the machine.
+    constexpr int PaintMs = 5;
+    constexpr int TileSize = 256;
+    constexpr int TilesPerRender = 4;
+    constexpr int Keys = 40;
+
+    struct Result
+    {
+        double meanMs;
+        double maxMs;
+        int renders;
+    };
+
+    const auto bench = [&](const bool narrowLock)
+        {
+            std::recursive_mutex lokLock;
+            std::atomic<bool> stop(false);
+            std::atomic<int> renders(0);
+            std::thread render([&]()
+                {
+                    std::vector<unsigned char> pixmap(TileSize * TileSize * 4 * TilesPerRender);
+                    std::vector<char> output;
+                    std::vector<char> sent;
+                    for (int iteration = 0; !stop; ++iteration)
+                    {
+                        std::unique_lock<std::recursive_mutex> lock(lokLock);
+
+                        // paintPartTile.
+                        std::this_thread::sleep_for(std::chrono::milliseconds(PaintMs));
+                        for (size_t i = 0; i < pixmap.size(); i += 4)
+                        {
+                            const size_t pixel = i / 4;
+                            pixmap[i] = static_cast<unsigned char>((pixel % TileSize) / 8 * 8 + iteration);
+                            pixmap[i + 1] = static_cast<unsigned char>(pixel / TileSize / 16 * 16);
+                            pixmap[i + 2] = 0x80;
+                            pixmap[i + 3] = 0xff;
+                        }
+
+                        if (narrowLock)
+                        {
+                            lock.unlock();
+                        }
+
+                        output.clear();
+                        for (int tile = 0; tile < TilesPerRender; ++tile)
+                        {
+                            CPPUNIT_ASSERT(png::encodeBufferToPNG(pixmap.data() + tile * TileSize * TileSize * 4,
+                                                                  TileSize, TileSize, output, LOK_TILEMODE_RGBA));
+                        }
+
+                        // The send, to a socket that keeps up.
+                        sent.assign(output.begin(), output.end());
+                        ++renders;
+                    }
+                });
+
+            // Keystrokes, from when they are read off the socket to when handled.
+            Result result = { 0, 0, 0 };
+            for (int i = 0; i < Keys; ++i)
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(PaintMs / 2 + i % PaintMs));
+                const auto start = std::chrono::steady_clock::now();
+                {
+                    std::unique_lock<std::recursive_mutex> lock(lokLock);
+                }
+
+                const double ms = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start).count() / 1000.;
+                result.meanMs += ms / Keys;
+                result.maxMs = std::max(result.maxMs, ms);
+            }
+
+            stop = true;
+            render.join();
+            result.renders = renders;
+            return result;
+        };
+
+    const Result wide = bench(false);
+    const Result narrow = bench(true);
+    CPPUNIT_ASSERT(wide.renders > 0);
+    CPPUNIT_ASSERT(narrow.renders > 0);
+
+    std::cerr << "Keystroke latency while another view renders " << TilesPerRender << " tiles at a time, "
+              << "the lock held across painting, encoding and sending: mean " << wide.meanMs
+              << " ms, max " << wide.maxMs << " ms, " << wide.renders << " renders; "
+              << "across painting only: mean " << narrow.meanMs << " ms, max " << narrow.maxMs
+              << " ms, " << narrow.renders << " renders." << std::endl;
+}
+
+void WhiteBoxTests::testTileQueueShedding()
+{
+    const auto tileAt = [](const int x, const int y)
+        {
+            return "tile part=0 width=256 height=256 tileposx=" + std::to_string(x) +
+                   " tileposy=" + std::to_string(y) + " tilewidth=3840 tileheight=3840";
+        };
+    const auto get = [](BasicTileQueue& queue)
+        {
+            const auto payload = queue.get();
+            return std::string(payload.data(), payload.size());
+        };
+
+    BasicTileQueue queue;
+
+    // The same tile again replaces the pending one, but not at another zoom.
+    const std::string zoomed = "tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=1920 tileheight=1920";
+    queue.put(tileAt(0, 0));
+    queue.put(zoomed);
+    queue.put("uno .uno:Bold");
+    queue.put(tileAt(0, 0));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), queue.size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), queue.getDroppedCount());
+    CPPUNIT_ASSERT_EQUAL(zoomed, get(queue));
+    CPPUNIT_ASSERT_EQUAL(std::string("uno .uno:Bold"), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tileAt(0, 0), get(queue));
+
+    // A tilecombine covering them supersedes the single tiles, previews stay.
+    const std::string preview = tileAt(0, 0) + " id=1";
+    const std::string combined = "tilecombine part=0 width=256 height=256 tileposx=0,3840 tileposy=0,0 tilewidth=3840 tileheight=3840";
+    queue.put(tileAt(0, 0));
+    queue.put(preview);
+    queue.put(tileAt(3840, 0));
+    queue.put(combined);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), queue.getDroppedCount());
+    CPPUNIT_ASSERT_EQUAL(preview, get(queue));
+    CPPUNIT_ASSERT_EQUAL(combined, get(queue));
+
+    // Beyond the limit, the oldest requests go.
+    const int count = BasicTileQueue::MaxTileRequests + 10;
+    for (int i = 0; i < count; ++i)
+    {
+        queue.put(tileAt(i * 3840, 0));
+    }
+
+    CPPUNIT_ASSERT_EQUAL(BasicTileQueue::MaxTileRequests, queue.size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(13), queue.getDroppedCount());
+    CPPUNIT_ASSERT_EQUAL(tileAt(10 * 3840, 0), get(queue));
+}
+
+void WhiteBoxTests::testTileQueueCancel()
+{
+    const auto get = [](MessageQueue& queue)
+        {
+            const auto payload = queue.get();
+            return std::string(payload.data(), payload.size());
+        };
+
+    const std::string tile1 = "tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 ver=1";
+    const std::string combined2 = "tilecombine part=0 width=256 height=256 tileposx=0,3840 tileposy=3840,3840 "
+                                  "tilewidth=3840 tileheight=3840 ver=2";
+    const std::string tile3 = "tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=1920 tileheight=1920 ver=3";
+    const std::string preview = "tile part=0 width=180 height=135 tileposx=0 tileposy=0 tilewidth=15875 tileheight=11906 ver=4 id=0";
+
+    // The versions listed only, tiles or tilecombines, never the previews.
+    TileQueue queue;
+    queue.put(tile1);
+    queue.put(combined2);
+    queue.put(tile3);
+    queue.put(preview);
+    queue.put("canceltiles ver=2,3,4");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), queue.getCancelledCount());
+    CPPUNIT_ASSERT_EQUAL(std::string("canceltiles ver=2,3,4"), get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile1, get(queue));
+    CPPUNIT_ASSERT_EQUAL(preview, get(queue));
+
+    // All of them, as the clients ask.
+    BasicTileQueue clientQueue;
+    clientQueue.put(tile1);
+    clientQueue.put(combined2);
+    clientQueue.put(preview);
+    clientQueue.put("uno .uno:Bold");
+    clientQueue.put("canceltiles");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), clientQueue.getCancelledCount());
+    CPPUNIT_ASSERT_EQUAL(std::string("canceltiles"), get(clientQueue));
+    CPPUNIT_ASSERT_EQUAL(preview, get(clientQueue));
+    CPPUNIT_ASSERT_EQUAL(std::string("uno .uno:Bold"), get(clientQueue));
+}
+
+void WhiteBoxTests::testTileQueueMerge()
+{
+    const auto get = [](TileQueue& queue)
+        {
+            const auto payload = queue.get();
+            return std::string(payload.data(), payload.size());
+        };
+
+    const std::string tile1 = "tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 ver=1";
+    const std::string tile2 = "tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 ver=2";
+    const std::string combined3 = "tilecombine part=0 width=256 height=256 tileposx=0,3840 tileposy=0,0 "
+                                  "tilewidth=3840 tileheight=3840 ver=3";
+    const std::string tile4 = "tile part=0 width=256 height=256 tileposx=3840 tileposy=0 tilewidth=3840 tileheight=3840 ver=4";
+    const std::string preview = "tile part=0 width=180 height=135 tileposx=0 tileposy=0 tilewidth=15875 tileheight=11906 ver=5 id=0";
+
+    // The same tile again, in another version, is painted once.
+    TileQueue queue;
+    queue.put(tile1);
+    queue.put(tile2);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), queue.size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), queue.getDroppedCount());
+
+    // Also within a tilecombine of them, but not the other way round.
+    queue.put(preview);
+    queue.put(combined3);
+    queue.put(tile4);
+    queue.put(preview);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), queue.size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), queue.getDroppedCount());
+    CPPUNIT_ASSERT_EQUAL(combined3, get(queue));
+    CPPUNIT_ASSERT_EQUAL(tile4, get(queue));
+    CPPUNIT_ASSERT_EQUAL(preview, get(queue));
+}
+
+void WhiteBoxTests::testTileQueuePreviews()
+{
+    const auto get = [](TileQueue& queue, const int timeoutMs)
+        {
+            const auto payload = queue.get(std::chrono::milliseconds(timeoutMs));
+            return std::string(payload.data(), payload.size());
+        };
+
+    const std::string tile = "tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 ver=1";
+    const auto previewOf = [](const int part)
+        {
+            return "tile part=" + std::to_string(part) + " width=180 height=135 tileposx=0 tileposy=0 "
+                   "tilewidth=15875 tileheight=11906 ver=2 id=" + std::to_string(part);
+        };
+
+    // The tiles of the views first, whenever they come.
+    TileQueue queue;
+    queue.put(previewOf(1));
+    queue.put(previewOf(2));
+    queue.put(previewOf(3));
+    queue.put(tile);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), queue.size());
+    CPPUNIT_ASSERT_EQUAL(tile, get(queue, 0));
+    CPPUNIT_ASSERT_EQUAL(previewOf(1), get(queue, 0));
+
+    // Then spaced out, still after the tiles.
+    CPPUNIT_ASSERT_EQUAL(std::string(), get(queue, 1));
+    queue.put(tile);
+    CPPUNIT_ASSERT_EQUAL(tile, get(queue, 1));
+    const auto start = std::chrono::steady_clock::now();
+    CPPUNIT_ASSERT_EQUAL(previewOf(2), get(queue, 1000));
+    CPPUNIT_ASSERT(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(TileQueue::PreviewIntervalMs + 500));
+
+    // Not cancelled with the tiles.
+    queue.put(tile);
+    queue.put("canceltiles");
+    CPPUNIT_ASSERT_EQUAL(std::string("canceltiles"), get(queue, 0));
+    CPPUNIT_ASSERT_EQUAL(previewOf(3), get(queue, 1000));
+}
+
+void WhiteBoxTests::testFrameHeader()
+{
+    const auto getHeader = [](const int flags, const uint64_t length)
+        {
+            unsigned char header[IoUtil::MaxFrameHeaderSize];
+            const size_t size = IoUtil::writeFrameHeader(header, flags, length);
+            return std::vector<unsigned char>(header, header + size);
+        };
+
+    // The length in the second byte, then in the next 2 or 8, most significant first.
+    CPPUNIT_ASSERT((std::vector<unsigned char>{ 0x82, 5 }) == getHeader(Poco::Net::WebSocket::FRAME_BINARY, 5));
+    CPPUNIT_ASSERT((std::vector<unsigned char>{ 0x81, 125 }) == getHeader(Poco::Net::WebSocket::FRAME_TEXT, 125));
+    CPPUNIT_ASSERT((std::vector<unsigned char>{ 0x82, 126, 0, 126 }) == getHeader(Poco::Net::WebSocket::FRAME_BINARY, 126));
+    CPPUNIT_ASSERT((std::vector<unsigned char>{ 0x82, 126, 0xff, 0xff }) == getHeader(Poco::Net::WebSocket::FRAME_BINARY, 65535));
+    CPPUNIT_ASSERT((std::vector<unsigned char>{ 0x82, 127, 0, 0, 0, 0, 0, 1, 0, 0 }) ==
+                   getHeader(Poco::Net::WebSocket::FRAME_BINARY, 65536));
+    CPPUNIT_ASSERT((std::vector<unsigned char>{ 0x82, 127, 0, 0, 0, 1, 0x23, 0x45, 0x67, 0x89 }) ==
+                   getHeader(Poco::Net::WebSocket::FRAME_BINARY, 0x123456789));
+}
+
+void WhiteBoxTests::testFrameParse()
+{
+    // Parsed whole, or not at all, however many bytes are short.
+    for (const size_t length : { 5, 300, 70000 })
+    {
+        std::vector<char> frame(IoUtil::MaxFrameHeaderSize);
+        frame.resize(IoUtil::writeFrameHeader(reinterpret_cast<unsigned char*>(frame.data()),
+                                              Poco::Net::WebSocket::FRAME_BINARY, length));
+        std::vector<char> data(length);
+        for (size_t i = 0; i < length; ++i)
+        {
+            data[i] = static_cast<char>(i * 7);
+        }
+
+        frame.insert(frame.end(), data.begin(), data.end());
+
+        int flags = 0;
+        std::vector<char> payload;
+        for (const size_t size : { size_t(0), size_t(1), size_t(2), frame.size() - length, frame.size() - 1 })
+        {
+            CPPUNIT_ASSERT_EQUAL(size_t(0), IoUtil::parseFrame(frame.data(), size, flags, payload));
+            CPPUNIT_ASSERT(payload.empty());
+        }
+
+        CPPUNIT_ASSERT_EQUAL(frame.size(), IoUtil::parseFrame(frame.data(), frame.size(), flags, payload));
+        CPPUNIT_ASSERT_EQUAL(static_cast<int>(Poco::Net::WebSocket::FRAME_BINARY), flags);
+        CPPUNIT_ASSERT(data == payload);
+    }
+
+    // Masked, as the clients send them, and followed by the next frame:
+    // the single-frame masked text message of RFC 6455, 5.7.
+    const std::vector<char> frames = { '\x81', '\x85', '\x37', '\xfa', '\x21', '\x3d', '\x7f', '\x9f', '\x4d', '\x51', '\x58',
+                                       '\x82', '\x01' };
+    int flags = 0;
+    std::vector<char> payload = { '>' };
+    CPPUNIT_ASSERT_EQUAL(size_t(11), IoUtil::parseFrame(frames.data(), frames.size(), flags, payload));
+    CPPUNIT_ASSERT_EQUAL(static_cast<int>(Poco::Net::WebSocket::FRAME_TEXT), flags);
+    CPPUNIT_ASSERT_EQUAL(std::string(">Hello"), std::string(payload.begin(), payload.end()));
+
+    // Not waited for, past what Poco receives.
+    const std::vector<char> huge = { '\x82', '\x7f', 0, 0, 0, 1, 0, 0, 0, 0 };
+    CPPUNIT_ASSERT_THROW(IoUtil::parseFrame(huge.data(), huge.size(), flags, payload), Poco::Net::WebSocketException);
+}
+
+void WhiteBoxTests::testWebSocketDeflate()
+{
+    bool noContextTakeover = true;
+    int windowBits = 0;
+    CPPUNIT_ASSERT_EQUAL(std::string("permessage-deflate; client_no_context_takeover"),
+                         WebSocketDeflate::negotiate("permessage-deflate; client_max_window_bits", noContextTakeover, windowBits));
+    CPPUNIT_ASSERT(!noContextTakeover);
+    CPPUNIT_ASSERT_EQUAL(15, windowBits);
+
+    // The first offer acceptable, zlib deflating with 9 window bits at least.
+    CPPUNIT_ASSERT_EQUAL(std::string("permessage-deflate; client_no_context_takeover; server_no_context_takeover; server_max_window_bits=10"),
+                         WebSocketDeflate::negotiate("x-webkit-deflate-frame, permessage-deflate; server_max_window_bits=8, "
+                                                     "permessage-deflate; server_no_context_takeover; server_max_window_bits=\"10\"",
+                                                     noContextTakeover, windowBits));
+    CPPUNIT_ASSERT(noContextTakeover);
+    CPPUNIT_ASSERT_EQUAL(10, windowBits);
+
+    // Unknown or repeated parameters.
+    CPPUNIT_ASSERT_EQUAL(std::string(), WebSocketDeflate::negotiate("permessage-deflate; foo", noContextTakeover, windowBits));
+    CPPUNIT_ASSERT_EQUAL(std::string(), WebSocketDeflate::negotiate("permessage-deflate; client_no_context_takeover; client_no_context_takeover",
+                                                                    noContextTakeover, windowBits));
+
+    // Inflates as a browser does, keeping the context across the messages.
+    z_stream client;
+    std::memset(&client, 0, sizeof(client));
+    CPPUNIT_ASSERT_EQUAL(Z_OK, inflateInit2(&client, -15));
+    const auto inflateMessage = [&client](std::vector<char> data)
+        {
+            const char tail[] = { 0, 0, '\xff', '\xff' };
+            data.insert(data.end(), tail, tail + sizeof(tail));
+            std::string out(1024 * 1024, '\0');
+            client.next_in = reinterpret_cast<Bytef*>(data.data());
+            client.avail_in = data.size();
+            client.next_out = reinterpret_cast<Bytef*>(&out[0]);
+            client.avail_out = out.size();
+            const int result = inflate(&client, Z_SYNC_FLUSH);
+            CPPUNIT_ASSERT(result == Z_OK || result == Z_BUF_ERROR);
+            out.resize(out.size() - client.avail_out);
+            return out;
+        };
+
+    WebSocketDeflate deflate(6, 64);
+    const std::string message = "commandvalues: {\"commandName\":\".uno:CharFontName\",\"commandValues\":\"" + std::string(500, 'a') + "\"}";
+    CPPUNIT_ASSERT(!deflate.isCompressible("short", 5));
+    CPPUNIT_ASSERT(deflate.isCompressible(message.data(), message.size()));
+    const std::string tile = "tile: part=0 width=256 height=256\n\x89PNG" + std::string(200, 'x');
+    CPPUNIT_ASSERT(!deflate.isCompressible(tile.data(), tile.size()));
+
+    // Each message the smaller for referring to those before.
+    std::vector<char> out;
+    size_t previous = message.size();
+    for (int i = 0; i < 3; ++i)
+    {
+        CPPUNIT_ASSERT(deflate.compress(message.data(), message.size(), out));
+        CPPUNIT_ASSERT(out.size() < previous);
+        CPPUNIT_ASSERT_EQUAL(message, inflateMessage(out));
+        previous = out.size();
+    }
+
+    // Random data doesn't get smaller, and is sent as is, the context staying in step.
+    std::mt19937 random(1);
+    std::string noise;
+    for (int i = 0; i < 2000; ++i)
+    {
+        noise += static_cast<char>(random());
+    }
+
+    CPPUNIT_ASSERT(!deflate.compress(noise.data(), noise.size(), out));
+    CPPUNIT_ASSERT(deflate.compress(message.data(), message.size(), out));
+    CPPUNIT_ASSERT_EQUAL(message, inflateMessage(out));
+
+    // A message in fragments.
+    const std::string large = std::string(100000, 'b') + "end";
+    std::vector<char> fragments;
+    CPPUNIT_ASSERT(deflate.compressPart(large.data(), 50000, out, false));
+    fragments.insert(fragments.end(), out.begin(), out.end());
+    CPPUNIT_ASSERT(deflate.compressPart(large.data() + 50000, large.size() - 50000, out, true));
+    fragments.insert(fragments.end(), out.begin(), out.end());
+    CPPUNIT_ASSERT_EQUAL(large, inflateMessage(fragments));
+    CPPUNIT_ASSERT(deflate.compress(message.data(), message.size(), out));
+    CPPUNIT_ASSERT_EQUAL(message, inflateMessage(out));
+    inflateEnd(&client);
+
+    // The messages of the client, without context, bounded in size.
+    WebSocketDeflate clientDeflate(6, 0, true);
+    for (int i = 0; i < 2; ++i)
+    {
+        CPPUNIT_ASSERT(clientDeflate.compress(message.data(), message.size(), out));
+        std::vector<char> payload(out);
+        CPPUNIT_ASSERT(deflate.decompress(payload, 1024 * 1024));
+        CPPUNIT_ASSERT_EQUAL(message, std::string(payload.begin(), payload.end()));
+
+        payload = out;
+        CPPUNIT_ASSERT(!deflate.decompress(payload, 100));
+    }
+
+    std::vector<char> junk = { '\xff', '\xfe', '\x01' };
+    CPPUNIT_ASSERT(!deflate.decompress(junk, 1000));
+}
+
+void WhiteBoxTests::testTileDescParseFuzz()
+{
+    // Fields, both ours and unknown, with valid and broken values.
+    const std::vector<std::string> names = { "part", "width", "height", "tileposx", "tileposy",
+                                             "tilewidth", "tileheight", "ver", "imgsize", "id",
+                                             "solid", "foo", "" };
+    const std::vector<std::string> values = { "0", "1", "256", "3840", "-1", "+7", "12x", "x12",
+                                              "", "-", "99999999999", "-2147483648", "2147483647",
+                                              "0,3840", "0,,3840,", ",", " 5", "1,x", "1=2" };
+
+    std::mt19937 random(1);
+    const auto pick = [&random](const std::vector<std::string>& from)
+        {
+            return from[std::uniform_int_distribution<size_t>(0, from.size() - 1)(random)];
+        };
+
+    const auto outcome = [](const std::function<std::string()>& func)
+        {
+            try
+            {
+                return func();
+            }
+            catch (const std::exception&)
+            {
+                return std::string("<exception>");
+            }
+        };
+
+    for (int i = 0; i < 20000; ++i)
+    {
+        const bool combined = (i % 2 == 1);
+        std::string message = (combined ? "tilecombine" : "tile");
+
+        // Mostly valid ones, to get past the validation.
+        if (random() % 2)
+        {
+            message += (combined
+                        ? " part=0 width=256 height=256 tileposx=0,3840 tileposy=0,0 tilewidth=3840 tileheight=3840"
+                        : " part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840");
+        }
+
+        const int fields = std::uniform_int_distribution<int>(0, 6)(random);
+        for (int field = 0; field < fields; ++field)
+        {
+            message += std::string(std::uniform_int_distribution<int>(1, 2)(random), ' ');
+            const auto name = pick(names);
+            auto value = pick(values);
+
+            // Unlike before, unknown fields are ignored whatever their value.
+            if ((name == "foo" || name.empty()) && value == "99999999999")
+            {
+                value = "1";
+            }
+
+            message += (random() % 16 ? name + '=' + value : value);
+        }
+
+        if (combined)
+        {
+            const auto expected = outcome([&message]() { return Legacy::parseTileCombined(message); });
+            const auto actual = outcome([&message]()
+                {
+                    const auto tileCombined = TileCombined::parse(message);
+                    return (tileCombined.getTiles().empty() ? std::string() : tileCombined.serialize("tilecombine:"));
+                });
+            CPPUNIT_ASSERT_EQUAL_MESSAGE(message, expected, actual);
+        }
+        else
+        {
+            const auto expected = outcome([&message]() { return Legacy::parseTile(message); });
+            const auto actual = outcome([&message]() { return TileDesc::parse(message).serialize("tile:"); });
+            CPPUNIT_ASSERT_EQUAL_MESSAGE(message, expected, actual);
+
+            // The tokenized variant agrees.
+            const auto tokenized = outcome([&message]()
+                {
+                    Poco::StringTokenizer tokens(message, " ", Poco::StringTokenizer::TOK_IGNORE_EMPTY |
+                                                               Poco::StringTokenizer::TOK_TRIM);
+                    return TileDesc::parse(tokens).serialize("tile:");
+                });
+            CPPUNIT_ASSERT_EQUAL_MESSAGE(message, expected, tokenized);
+        }
+    }
+}
+
+void WhiteBoxTests::testTileDescParseBench()
+{
+    const std::string tile = "tile part=0 width=256 height=256 tileposx=7680 tileposy=11520 "
+                             "tilewidth=3840 tileheight=3840 ver=12 imgsize=4096";
+    const std::string combined = "tilecombine part=0 width=256 height=256 tileposx=0,3840,7680,11520 "
+                                 "tileposy=0,0,0,0 imgsize=100,200,300,400 tilewidth=3840 tileheight=3840 ver=12";
+
+    const auto time = [](const std::function<void()>& func)
+        {
+            const int iterations = 20000;
+            const auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; ++i)
+            {
+                func();
+            }
+
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / iterations;
+        };
+
+    size_t sink = 0;
+    const auto legacyTile = time([&]() { sink += Legacy::parseTile(tile).size(); });
+    const auto newTile = time([&]() { sink += TileDesc::parse(tile).serialize("tile:").size(); });
+    const auto legacyCombined = time([&]() { sink += Legacy::parseTileCombined(combined).size(); });
+    const auto newCombined = time([&]() { sink += TileCombined::parse(combined).serialize("tilecombine:").size(); });
+    CPPUNIT_ASSERT(sink > 0);
+
+    std::cerr << "Parse and serialize tile: " << legacyTile << " ns tokenized, "
+              << newTile << " ns single-pass; tilecombine of 4: " << legacyCombined
+              << " ns tokenized, " << newCombined << " ns single-pass." << std::endl;
+}
+
+
+void WhiteBoxTests::testTrace()
+{
+    // The trace id goes through the tile messages, unlike id= it doesn't make previews.
+    auto tile = TileDesc::parse("tile part=0 width=256 height=256 tileposx=0 tileposy=0 tilewidth=3840 tileheight=3840 trace=7");
+    CPPUNIT_ASSERT_EQUAL(7, tile.getTraceId());
+    CPPUNIT_ASSERT(tile.serialize("tile").find(" trace=7") != std::string::npos);
+    CPPUNIT_ASSERT(tile.serialize("tile").find(" id=") == std::string::npos);
+
+    auto combined = TileCombined::parse("tilecombine part=0 width=256 height=256 tileposx=0,3840 tileposy=0,0 tilewidth=3840 tileheight=3840");
+    CPPUNIT_ASSERT_EQUAL(-1, combined.getTraceId());
+    CPPUNIT_ASSERT(combined.serialize("tilecombine").find("trace=") == std::string::npos);
+    combined.setTraceId(8);
+    CPPUNIT_ASSERT_EQUAL(8, combined.getTiles()[1].getTraceId());
+    CPPUNIT_ASSERT_EQUAL(8, TileCombined::parse(combined.serialize("tilecombine")).getTraceId());
+
+    // Untraced requests record nothing.
+    Trace::takeEvents();
+    Trace::record(-1, Trace::Stage::ClientRequest);
+    CPPUNIT_ASSERT(Trace::takeEvents().empty());
+
+    // Those of another thread, as sent by a kit, are kept as they were.
+    std::thread([]() { Trace::record(9, Trace::Stage::RenderStart); }).join();
+    const auto events = Trace::takeEvents();
+    CPPUNIT_ASSERT(events.find(" 9,4,") == 0);
+    CPPUNIT_ASSERT(Trace::takeEvents().empty());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), Trace::mergeEvents(events + " 9,4 x,1,2,3,4 9,99,1,2,3"));
+    Trace::record(9, Trace::Stage::ClientRequest);
+
+    const auto json = Trace::dumpJson();
+    CPPUNIT_ASSERT(json.find("{\"traceEvents\":[") == 0);
+    CPPUNIT_ASSERT(json.find("\"name\":\"render_start\"") != std::string::npos);
+    CPPUNIT_ASSERT(json.find("\"name\":\"tile 9\",\"cat\":\"tile\",\"ph\":\"b\"") != std::string::npos);
+    CPPUNIT_ASSERT(json.find("\"ph\":\"e\",\"id\":9") != std::string::npos);
+}
+
+void WhiteBoxTests::testCommands()
+{
+    using namespace LOOLProtocol;
+
+    // Every name classifies as its command, alone or with arguments.
+    for (size_t i = 1; i < static_cast<size_t>(Command::Count); ++i)
+    {
+        const Command command = static_cast<Command>(i);
+        const std::string name = getCommandName(command);
+        CPPUNIT_ASSERT(command == getCommand(name.data(), name.size()));
+        const std::string message = name + " part=0\nbody";
+        CPPUNIT_ASSERT(command == getCommand(message.data(), message.size()));
+        const std::string line = name + "\nbody";
+        CPPUNIT_ASSERT(command == getCommand(line.data(), line.size()));
+    }
+
+    // Neither prefixes, nor extensions, nor the names without their colon.
+    for (const std::string token : { "", " tile", "til", "tiles", "tile:x", "statusindicator:",
+                                     "textselectioncontent:", "Tile", "partpagerectanglesx" })
+    {
+        CPPUNIT_ASSERT(Command::Unknown == getCommand(token.data(), token.size()));
+    }
+
+    const std::string message = "tilecombine part=0";
+    CPPUNIT_ASSERT(Command::Tile == getCommand(message.data(), 4));
+
+    CPPUNIT_ASSERT(isUserInteraction(Command::Key));
+    CPPUNIT_ASSERT(isUserInteraction(Command::UnoCommandResultMessage));
+    CPPUNIT_ASSERT(!isUserInteraction(Command::TileCombine));
+    CPPUNIT_ASSERT(!isUserInteraction(Command::StatusMessage));
+    CPPUNIT_ASSERT(!isUserInteraction(Command::Unknown));
+
+    // Counted by command, as exported.
+    const uint64_t keys = getCommandCounts()[static_cast<size_t>(Command::Key)];
+    countCommand(Command::Key);
+    countCommand(Command::Count);
+    CPPUNIT_ASSERT_EQUAL(keys + 1, getCommandCounts()[static_cast<size_t>(Command::Key)].load());
+
+    Metrics metrics;
+    metrics.addLabelledCallback("test_messages_total", "Test messages.", "counter", "command",
+                                []() { return std::vector<std::pair<std::string, double>>{ { "key", 2 }, { "tile", 3 } }; });
+    const auto text = metrics.serialize();
+    CPPUNIT_ASSERT(text.find("# TYPE test_messages_total counter\ntest_messages_total{command=\"key\"} 2\n"
+                             "test_messages_total{command=\"tile\"} 3\n") != std::string::npos);
+}
+
+void WhiteBoxTests::testMetrics()
+{
+    Metrics metrics;
+    Histogram& histogram = metrics.histogram("test_seconds", "Test durations.");
+    CPPUNIT_ASSERT(histogram.takeDelta().empty());
+
+    // As the kits take theirs, and wsd merges them.
+    Histogram kit;
+    kit.observe(0.2);
+    kit.observe(3);
+    kit.observe(60000);
+    const auto delta = kit.takeDelta();
+    CPPUNIT_ASSERT(kit.takeDelta().empty());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), metrics.mergeDeltas(" test_seconds=" + delta + " other=1,2 test_seconds=1,2"));
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(3), histogram.getCount());
+    CPPUNIT_ASSERT_DOUBLES_EQUAL(60003.2, histogram.getSumMs(), 0.001);
+
+    ++metrics.counter("test_total", "Test events.");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), metrics.mergeDeltas(" test_total=2 test_total=x"));
+    metrics.addCallback("test_depth", "Test depth.", "gauge", []() { return 4; });
+
+    const auto text = metrics.serialize();
+    CPPUNIT_ASSERT(text.find("# TYPE test_seconds histogram\n") != std::string::npos);
+    CPPUNIT_ASSERT(text.find("test_seconds_bucket{le=\"0.0005\"} 1\n") != std::string::npos);
+    CPPUNIT_ASSERT(text.find("test_seconds_bucket{le=\"0.005\"} 2\n") != std::string::npos);
+    CPPUNIT_ASSERT(text.find("test_seconds_bucket{le=\"+Inf\"} 3\n") != std::string::npos);
+    CPPUNIT_ASSERT(text.find("test_seconds_count 3\n") != std::string::npos);
+    CPPUNIT_ASSERT(text.find("# TYPE test_total counter\ntest_total 3\n") != std::string::npos);
+    CPPUNIT_ASSERT(text.find("# TYPE test_depth gauge\ntest_depth 4\n") != std::string::npos);
+}
+
+void WhiteBoxTests::testStartup()
+{
+    // Only the first time a phase is reached counts.
+    CPPUNIT_ASSERT(Startup::record(Startup::Phase::WsdStart, 1000));
+    CPPUNIT_ASSERT(!Startup::record(Startup::Phase::WsdStart, 2000));
+
+    // Those of a kit are kept, but for those reached here.
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), Startup::merge(" wsd_start=3000 fork=1500 kits_ready=4000 bogus=1 first_paint=x"));
+    CPPUNIT_ASSERT(Startup::serialize().find(" wsd_start=1000 fork=1500 kits_ready=4000") == 0);
+
+    const auto report = Startup::getReport();
+    CPPUNIT_ASSERT(report.find("{\"startup_ms\":3.000,\"first_tile_ms\":-1.000,\"phases\":{") == 0);
+    CPPUNIT_ASSERT(report.find("\"wsd_start\":0.000,\"fork\":0.500,\"kits_ready\":3.000}}") != std::string::npos);
+
+    // The memory of the first kit measured only.
+    CPPUNIT_ASSERT(Startup::recordKitMemory(20480, 12288));
+    CPPUNIT_ASSERT(!Startup::recordKitMemory(40960, 24576));
+    CPPUNIT_ASSERT(Startup::getReport().find("\"kits_ready\":3.000},\"kit_uss_kb\":20480,\"kit_pss_kb\":12288}") != std::string::npos);
+}
+
+void WhiteBoxTests::testPrefault()
+{
+    Prefault::Mapping mapping;
+    CPPUNIT_ASSERT(Prefault::parseMapping("7f1c2a000000-7f1c2a200000 r-xp 00001000 08:01 1234   /opt/lo/program/libmergedlo.so", mapping));
+    CPPUNIT_ASSERT_EQUAL(static_cast<uintptr_t>(0x7f1c2a000000), mapping._start);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uintptr_t>(0x7f1c2a200000), mapping._end);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(0x1000), mapping._offset);
+    CPPUNIT_ASSERT_EQUAL(std::string("/opt/lo/program/libmergedlo.so"), mapping._path);
+    CPPUNIT_ASSERT(Prefault::isWarmed(mapping, "/opt/lo"));
+    CPPUNIT_ASSERT(!Prefault::isWarmed(mapping, "/opt/l"));
+
+    // Neither the anonymous memory, nor what can't be read, nor the files deleted.
+    CPPUNIT_ASSERT(Prefault::parseMapping("7ffd1000-7ffd2000 rw-p 00000000 00:00 0", mapping));
+    CPPUNIT_ASSERT(mapping._path.empty());
+    CPPUNIT_ASSERT(!Prefault::isWarmed(mapping, "/opt/lo"));
+    CPPUNIT_ASSERT(Prefault::parseMapping("1000-2000 ---p 00000000 08:01 99 /opt/lo/program/types.rdb", mapping));
+    CPPUNIT_ASSERT(!Prefault::isWarmed(mapping, "/opt/lo"));
+    CPPUNIT_ASSERT(Prefault::parseMapping("1000-2000 r--p 00000000 08:01 99 /opt/lo/program/types.rdb (deleted)", mapping));
+    CPPUNIT_ASSERT(!Prefault::isWarmed(mapping, "/opt/lo"));
+
+    // The fonts wherever they are.
+    CPPUNIT_ASSERT(Prefault::parseMapping("1000-2000 r--s 00000000 08:01 99 /usr/share/fonts/Some Font.ttf", mapping));
+    CPPUNIT_ASSERT_EQUAL(std::string("/usr/share/fonts/Some Font.ttf"), mapping._path);
+    CPPUNIT_ASSERT(Prefault::isWarmed(mapping, "/opt/lo"));
+    CPPUNIT_ASSERT(!Prefault::parseMapping("bogus", mapping));
+
+    // The mappings of this executable, as if those of LibreOffice.
+    char exe[PATH_MAX] = {};
+    CPPUNIT_ASSERT(readlink("/proc/self/exe", exe, sizeof(exe) - 1) > 0);
+    const std::string dir(exe, std::strrchr(exe, '/'));
+    const auto stats = Prefault::warm(dir, false);
+    CPPUNIT_ASSERT(stats._mappings > 0);
+    CPPUNIT_ASSERT(stats._pages >= stats._mappings);
+}
+
+void WhiteBoxTests::testSessionRecord()
+{
+    char pathTemplate[] = "/tmp/lool-record-XXXXXX";
+    const int fd = mkstemp(pathTemplate);
+    CPPUNIT_ASSERT(fd >= 0);
+    close(fd);
+    {
+        SessionRecord record(pathTemplate, "0001", "/lool/ws/file:///tmp/hello.odt");
+        CPPUNIT_ASSERT(record.isOpen());
+        const std::string load = "load url=file:///tmp/hello.odt";
+        record.record(load.data(), load.size());
+        const std::string paste = "paste mimetype=text/plain;charset=utf-8\nhello\nworld";
+        record.record(paste.data(), paste.size());
+    }
+
+    std::ifstream file(pathTemplate, std::ios::binary);
+    std::string sessionId;
+    std::string uri;
+    CPPUNIT_ASSERT(SessionRecord::readHeader(file, sessionId, uri));
+    CPPUNIT_ASSERT_EQUAL(std::string("0001"), sessionId);
+    CPPUNIT_ASSERT_EQUAL(std::string("/lool/ws/file:///tmp/hello.odt"), uri);
+
+    // The messages of several lines whole.
+    SessionRecord::Entry load;
+    SessionRecord::Entry paste;
+    SessionRecord::Entry entry;
+    CPPUNIT_ASSERT(SessionRecord::readEntry(file, load));
+    CPPUNIT_ASSERT_EQUAL(std::string("load url=file:///tmp/hello.odt"), load._message);
+    CPPUNIT_ASSERT(SessionRecord::readEntry(file, paste));
+    CPPUNIT_ASSERT_EQUAL(std::string("paste mimetype=text/plain;charset=utf-8\nhello\nworld"), paste._message);
+    CPPUNIT_ASSERT(load._ms > 0 && paste._ms >= load._ms);
+    CPPUNIT_ASSERT(!SessionRecord::readEntry(file, entry));
+    unlink(pathTemplate);
+
+    std::istringstream cut("1000 20\nload url=");
+    CPPUNIT_ASSERT(!SessionRecord::readEntry(cut, entry));
+    std::istringstream notRecord("loolclient 0.1\n");
+    CPPUNIT_ASSERT(!SessionRecord::readHeader(notRecord, sessionId, uri));
+
+    // Only the value of the token replaced.
+    CPPUNIT_ASSERT_EQUAL(std::string("load part=0 url=file:///tmp/copy.odt lang=en"),
+                         SessionRecord::setToken("load part=0 url=file:///tmp/hello.odt lang=en", "url", "file:///tmp/copy.odt"));
+    CPPUNIT_ASSERT_EQUAL(std::string("load url=b\nurl=a"), SessionRecord::setToken("load url=a\nurl=a", "url", "b"));
+    CPPUNIT_ASSERT_EQUAL(std::string("load xurl=a"), SessionRecord::setToken("load xurl=a", "url", "b"));
+
+    // A reply awaited per tile combined, the placeholders not it.
+    const std::string tile = "part=0 width=256 height=256 tileposx=3840 tileposy=0 tilewidth=3840 tileheight=3840";
+    const auto keys = SessionRecord::getAwaitedReplies("tilecombine part=0 width=256 height=256 tileposx=0,3840 "
+                                                       "tileposy=0,0 tilewidth=3840 tileheight=3840");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), keys.size());
+    CPPUNIT_ASSERT_EQUAL(keys[1], SessionRecord::getReplyKey("tile: " + tile + " ver=5 imgsize=100"));
+    CPPUNIT_ASSERT_EQUAL(keys[1], SessionRecord::getReplyKey("tiledelta: " + tile + " ver=6 imgsize=10"));
+    CPPUNIT_ASSERT_EQUAL(std::string(), SessionRecord::getReplyKey("tile: " + tile + " ver=0 imgsize=100"));
+    CPPUNIT_ASSERT(SessionRecord::getAwaitedReplies("key type=up char=0 key=0").empty());
+    CPPUNIT_ASSERT(SessionRecord::getAwaitedReplies("mouse type=move x=0 y=0 count=1 buttons=0 modifier=0").empty());
+
+    SessionRecord::Replies replies;
+    const auto start = std::chrono::steady_clock::now();
+    replies.sent("tile " + tile, start);
+    replies.sent("key type=input char=97 key=0", start);
+    replies.sent("key type=input char=98 key=0", start + std::chrono::milliseconds(10));
+    replies.sent("status", start);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(4), replies.size());
+    CPPUNIT_ASSERT(replies.received("tile: " + tile + " ver=0 imgsize=100", start).empty());
+
+    auto latencies = replies.received("tile: " + tile + " ver=7 imgsize=100", start + std::chrono::milliseconds(20));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), latencies.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("tile"), latencies[0].first);
+    CPPUNIT_ASSERT(latencies[0].second == std::chrono::milliseconds(20));
+
+    // A repaint for all the keystrokes typed since the last.
+    latencies = replies.received("invalidatetiles: part=0 x=0 y=0 width=100 height=100", start + std::chrono::milliseconds(30));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), latencies.size());
+    CPPUNIT_ASSERT_EQUAL(std::string("key"), latencies[1].first);
+    CPPUNIT_ASSERT(latencies[0].second == std::chrono::milliseconds(30));
+    CPPUNIT_ASSERT(latencies[1].second == std::chrono::milliseconds(20));
+
+    // The status never came.
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), replies.expire(start + std::chrono::seconds(1), std::chrono::seconds(10)));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), replies.expire(start + std::chrono::seconds(11), std::chrono::seconds(10)));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), replies.size());
+}
+
+void WhiteBoxTests::testTileInvalidation()
+{
+    // The lines the kit merged, sent together.
+    const auto areas = TileInvalidation::parseAll("invalidatetiles: part=0 x=0 y=0 width=100 height=100\n"
+                                                  "invalidatetiles: part=0 x=7680 y=3840 width=10 height=10\n"
+                                                  "invalidatetiles: part=0 x=1 y=2\n"
+                                                  "invalidatetiles: EMPTY");
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), areas.size());
+    CPPUNIT_ASSERT_EQUAL(7680, areas[1]._x);
+    CPPUNIT_ASSERT_EQUAL(-1, areas[2]._part);
+    CPPUNIT_ASSERT_EQUAL(INT_MAX, areas[2]._width);
+
+    TileInvalidation::Area area;
+    CPPUNIT_ASSERT(!TileInvalidation::parse("invalidatecursor: 0, 0, 10, 10", area));
+    CPPUNIT_ASSERT(!TileInvalidation::parse("invalidatetiles: part=0 x=0 y=0 width=10 height=99999999999", area));
+
+    // Unknown until the client tells what it shows.
+    TileInvalidation::View view;
+    CPPUNIT_ASSERT(TileInvalidation::getVisibleTiles(areas, view, 100).empty());
+
+    view._visibleArea = TileInvalidation::Area(0, 0, 0, 3 * 3840, 2 * 3840);
+    view._tilePixelWidth = 256;
+    view._tilePixelHeight = 256;
+    view._tileTwipWidth = 3840;
+    view._tileTwipHeight = 3840;
+
+    // The first tile, and the four the second area touches, at their corner.
+    // Those of the whole document are left to the client.
+    auto tiles = TileInvalidation::getVisibleTiles(areas, view, 100);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(5), tiles.size());
+    CPPUNIT_ASSERT_EQUAL(0, tiles[0]._x);
+    CPPUNIT_ASSERT_EQUAL(0, tiles[0]._y);
+    CPPUNIT_ASSERT_EQUAL(3840, tiles[0]._width);
+    CPPUNIT_ASSERT_EQUAL(3840, tiles[1]._x);
+    CPPUNIT_ASSERT_EQUAL(0, tiles[1]._y);
+    CPPUNIT_ASSERT_EQUAL(7680, tiles[2]._x);
+    CPPUNIT_ASSERT_EQUAL(3840, tiles[3]._x);
+    CPPUNIT_ASSERT_EQUAL(3840, tiles[3]._y);
+    CPPUNIT_ASSERT_EQUAL(7680, tiles[4]._x);
+    CPPUNIT_ASSERT_EQUAL(3840, tiles[4]._y);
+
+    // Each tile once, however many areas touch it.
+    const std::vector<TileInvalidation::Area> overlapping = {
+        TileInvalidation::Area(1, 0, 0, 1000, 1000),
+        TileInvalidation::Area(1, 500, 500, 1000, 1000) };
+    tiles = TileInvalidation::getVisibleTiles(overlapping, view, 100);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), tiles.size());
+    CPPUNIT_ASSERT_EQUAL(1, tiles[0]._part);
+
+    // Outside of the view.
+    tiles = TileInvalidation::getVisibleTiles({ TileInvalidation::Area(0, 20000, 0, 100, 100) }, view, 100);
+    CPPUNIT_ASSERT(tiles.empty());
+
+    // Too many, for the client to ask for those it wants.
+    view._visibleArea = TileInvalidation::Area(0, 0, 0, INT_MAX, INT_MAX);
+    view._tileTwipWidth = 1;
+    view._tileTwipHeight = 1;
+    tiles = TileInvalidation::getVisibleTiles({ TileInvalidation::Area(0, 0, 0, INT_MAX, INT_MAX) }, view, 100);
+    CPPUNIT_ASSERT(tiles.empty());
+}
+
+namespace
+{
+    /// Counts the messages of the logging benchmark written.
+    class CountingChannel : public Poco::Channel
+    {
+    public:
+        CountingChannel() : _count(0) {}
+
+        void log(const Poco::Message& message) override
+        {
+            if (message.getText().find("Rendered tile ") != std::string::npos)
+            {
+                ++_count;
+            }
+        }
+
+        size_t getCount() const { return _count; }
+
+    private:
+        std::atomic<size_t> _count;
+    };
+}
+
+void WhiteBoxTests::testLogBench()
+{
+    const int iterations = 20000;
+    const auto bench = [iterations](const bool async, const std::string& level, size_t& written)
+        {
+            Log::initialize("bench", async);
+            Log::flush();
+            Poco::AutoPtr<CountingChannel> channel(new CountingChannel());
+            Log::logger().setChannel(channel);
+            Log::setLevel(level);
+
+            const auto start = std::chrono::steady_clock::now();
+            for (int i = 0; i < iterations; ++i)
+            {
+                Log::trace() << "Rendered tile " << i << " in " << 1.5 << " ms." << Log::end;
+            }
+
+            const auto elapsed = std::chrono::steady_clock::now() - start;
+            Log::flush();
+            written = channel->getCount();
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / iterations;
+        };
+
+    size_t written = 0;
+    const auto disabled = bench(false, "debug", written);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), written);
+    const auto sync = bench(false, "trace", written);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(iterations), written);
+    const auto async = bench(true, "trace", written);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(iterations), written);
+
+    // Not to leave the writer to the tests after.
+    Log::shutdown();
+    Log::setLevel("information");
+
+    std::cerr << "Log::trace() per call: " << disabled << " ns disabled, "
+              << sync << " ns synchronous, " << async << " ns asynchronous." << std::endl;
+}
+
+void WhiteBoxTests::testJWTAuthBench()
+{
+    Poco::Crypto::initializeCrypto();
+    const std::string keyPath = TDOC "/../../etc/key.pem";
+
+    JWTAuth::clearVerified();
+    const std::string token = JWTAuth(keyPath, "admin", "admin", "admin").getAccessToken();
+    std::string forged = token;
+    forged[forged.size() - 1] = (forged.back() == 'A' ? 'B' : 'A');
+
+    // Each admin request constructs the agent, loading the key, to verify the cookie.
+    const int iterations = 200;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+    {
+        JWTAuth::clearVerified();
+        CPPUNIT_ASSERT(!JWTAuth::isVerified(keyPath, "admin", token));
+        CPPUNIT_ASSERT(JWTAuth(keyPath, "admin", "admin", "admin").verify(token));
+    }
+
+    const auto uncached = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count() / iterations;
+
+    // Verified once, the token is then found by its digest.
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i)
+    {
+        CPPUNIT_ASSERT(JWTAuth::isVerified(keyPath, "admin", token));
+    }
+
+    const auto cached = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count() / iterations;
+
+    // Another token isn't taken for the one verified.
+    CPPUNIT_ASSERT(!JWTAuth::isVerified(keyPath, "admin", forged));
+    CPPUNIT_ASSERT(!JWTAuth(keyPath, "admin", "admin", "admin").verify(forged));
+    CPPUNIT_ASSERT(!JWTAuth::isVerified(keyPath, "admin", forged));
+
+    // Nor is it verified for another audience, or with another key.
+    CPPUNIT_ASSERT(!JWTAuth::isVerified(keyPath, "storage", token));
+    CPPUNIT_ASSERT(!JWTAuth::isVerified(TDOC "/../../etc/cert.pem", "admin", token));
+
+    JWTAuth::clearVerified();
+    CPPUNIT_ASSERT(!JWTAuth::isVerified(keyPath, "admin", token));
+    Poco::Crypto::uninitializeCrypto();
+
+    std::cerr << "JWT verification per request: " << uncached << " us uncached, "
+              << cached << " us cached." << std::endl;
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(WhiteBoxTests);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
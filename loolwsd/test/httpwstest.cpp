@@ -20,6 +20,8 @@
 #include <Poco/JSON/JSON.h>
 #include <Poco/JSON/Parser.h>
 #include <Poco/Net/AcceptCertificateHandler.h>
+#include <Poco/Net/FilePartSource.h>
+#include <Poco/Net/HTMLForm.h>
 #include <Poco/Net/HTTPClientSession.h>
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/Net/HTTPResponse.h>
@@ -67,6 +69,7 @@ class HTTPWSTest : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testExcelLoad);
     CPPUNIT_TEST(testPaste);
     CPPUNIT_TEST(testLargePaste);
+    CPPUNIT_TEST(testLargeTextSelection);
     CPPUNIT_TEST(testRenderingOptions);
     CPPUNIT_TEST(testPasswordProtectedDocumentWithoutPassword);
     CPPUNIT_TEST(testPasswordProtectedDocumentWithWrongPassword);
@@ -82,6 +85,7 @@ class HTTPWSTest : public CPPUNIT_NS::TestFixture
     CPPUNIT_TEST(testEditAnnotationWriter);
     CPPUNIT_TEST(testInsertAnnotationCalc);
     CPPUNIT_TEST(testFontList);
+    CPPUNIT_TEST(testConvertTo);
 
     CPPUNIT_TEST_SUITE_END();
 
@@ -97,6 +101,7 @@ class HTTPWSTest : public CPPUNIT_NS::TestFixture
     void testExcelLoad();
     void testPaste();
     void testLargePaste();
+    void testLargeTextSelection();
     void testRenderingOptions();
     void testPasswordProtectedDocumentWithoutPassword();
     void testPasswordProtectedDocumentWithWrongPassword();
@@ -113,6 +118,7 @@ class HTTPWSTest : public CPPUNIT_NS::TestFixture
     void testEditAnnotationWriter();
     void testInsertAnnotationCalc();
     void testFontList();
+    void testConvertTo();
 
     void loadDoc(const std::string& documentURL);
 
@@ -692,6 +698,70 @@ void HTTPWSTest::testLargePaste()
     }
 }
 
+void HTTPWSTest::testLargeTextSelection()
+{
+    try
+    {
+        std::string documentPath, documentURL;
+        getDocumentPathAndURL("hello.odt", documentPath, documentURL);
+
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, documentURL);
+        Poco::Net::WebSocket socket = *connectLOKit(_uri, request, _response);
+
+        // Large replies are streamed to the clients that need no 'nextmessage:'.
+        sendTextFrame(socket, "loolclient " + LOOLProtocol::GetProtocolVersion());
+        assertResponseLine(socket, "loolserver");
+
+        sendTextFrame(socket, "load url=" + documentURL);
+        sendTextFrame(socket, "status");
+        CPPUNIT_ASSERT_MESSAGE("cannot load the document " + documentURL, isDocumentLoaded(socket));
+
+        sendTextFrame(socket, "uno .uno:SelectAll");
+        sendTextFrame(socket, "uno .uno:Delete");
+
+        // Text over a few fragments.
+        std::ostringstream oss;
+        for (auto i = 0; i < 3 * MESSAGE_FRAGMENT_SIZE / 6; ++i)
+        {
+            oss << Util::encodeId(Util::rng::getNext(), 6);
+        }
+        const auto documentContents = oss.str();
+        sendTextFrame(socket, "paste mimetype=text/html\n" + documentContents);
+
+        sendTextFrame(socket, "uno .uno:SelectAll");
+        sendTextFrame(socket, "gettextselection mimetype=text/plain;charset=utf-8");
+
+        // Joins the fragments of the reply, as browsers do, skipping the other messages.
+        std::string selection;
+        int fragments = 0;
+        int flags = 0;
+        std::vector<char> buffer(MESSAGE_FRAGMENT_SIZE * 4);
+        socket.setReceiveTimeout(Poco::Timespan(COMMAND_TIMEOUT_MS * 1000));
+        do
+        {
+            const int bytes = socket.receiveFrame(buffer.data(), buffer.size(), flags);
+            CPPUNIT_ASSERT(bytes > 0);
+            CPPUNIT_ASSERT((flags & Poco::Net::WebSocket::FRAME_OP_BITMASK) != Poco::Net::WebSocket::FRAME_OP_CLOSE);
+            const bool continuation = ((flags & Poco::Net::WebSocket::FRAME_OP_BITMASK) == Poco::Net::WebSocket::FRAME_OP_CONT);
+            if (continuation || LOOLProtocol::getFirstToken(buffer.data(), bytes) == "textselectioncontent:")
+            {
+                selection.append(buffer.data(), bytes);
+                ++fragments;
+            }
+        }
+        while (fragments == 0 || (flags & Poco::Net::WebSocket::FRAME_FLAG_FIN) == 0);
+
+        std::cerr << "Got the selection of " << selection.size() << " bytes in " << fragments << " fragments." << std::endl;
+        CPPUNIT_ASSERT(fragments > 1);
+        CPPUNIT_ASSERT_MESSAGE("Pasted text was either corrupted or couldn't be read back",
+                               "textselectioncontent: " + documentContents == selection);
+    }
+    catch (const Poco::Exception& exc)
+    {
+        CPPUNIT_FAIL(exc.displayText());
+    }
+}
+
 void HTTPWSTest::testRenderingOptions()
 {
     try
@@ -1576,6 +1646,45 @@ void HTTPWSTest::testFontList()
     }
 }
 
+void HTTPWSTest::testConvertTo()
+{
+    try
+    {
+        std::string documentPath, documentURL;
+        getDocumentPathAndURL("hello.odt", documentPath, documentURL);
+
+        // Twice, the second may be served from the conversion cache.
+        for (int i = 0; i < 2; ++i)
+        {
+            std::unique_ptr<Poco::Net::HTTPClientSession> session(helpers::createSession(_uri));
+            session->setTimeout(Poco::Timespan(COMMAND_TIMEOUT_MS * 1000 * 10));
+
+            Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, "/lool/convert-to");
+            Poco::Net::HTMLForm form;
+            form.setEncoding(Poco::Net::HTMLForm::ENCODING_MULTIPART);
+            form.set("format", "txt");
+            form.addPart("data", new Poco::Net::FilePartSource(documentPath));
+            form.prepareSubmit(request);
+            form.write(session->sendRequest(request));
+
+            // The headers come first, then exactly as much as they announce.
+            Poco::Net::HTTPResponse response;
+            std::istream& rs = session->receiveResponse(response);
+            CPPUNIT_ASSERT_EQUAL(Poco::Net::HTTPResponse::HTTP_OK, response.getStatus());
+            CPPUNIT_ASSERT(response.hasContentLength());
+
+            std::string content;
+            Poco::StreamCopier::copyToString(rs, content);
+            CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(response.getContentLength()), content.size());
+            CPPUNIT_ASSERT(content.find("Hello world") != std::string::npos);
+        }
+    }
+    catch (const Poco::Exception& exc)
+    {
+        CPPUNIT_FAIL(exc.displayText());
+    }
+}
+
 CPPUNIT_TEST_SUITE_REGISTRATION(HTTPWSTest);
 
 /* vim:set shiftwidth=4 softtabstop=4 expandtab: */
@@ -0,0 +1,75 @@
+/* -*- Mode: C++; tab-width: 4; indent-tabs-mode: nil; c-basic-offset: 4; fill-column: 100 -*- */
+/*
+ * This file is part of the LibreOffice project.
+ *
+ * This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ */
+
+#ifndef INCLUDED_LATENCIES_HPP
+#define INCLUDED_LATENCIES_HPP
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+typedef std::chrono::steady_clock Clock;
+
+/// The latencies observed by all the users, or sessions replayed, by kind.
+class Latencies
+{
+public:
+    void add(const std::string& kind, const Clock::duration latency)
+    {
+        const double ms = std::chrono::duration_cast<std::chrono::microseconds>(latency).count() / 1000.;
+        std::unique_lock<std::mutex> lock(_mutex);
+        _samples[kind].push_back(ms);
+    }
+
+    /// Prints a JSON object per kind: the count, the throughput and the percentiles.
+    void report(const double seconds)
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        for (auto& it : _samples)
+        {
+            auto& samples = it.second;
+            std::sort(samples.begin(), samples.end());
+            std::cout << std::fixed << std::setprecision(3)
+                      << "{\"metric\":\"" << it.first << "\""
+                      << ",\"count\":" << samples.size()
+                      << ",\"per_second\":" << samples.size() / seconds
+                      << ",\"p50_ms\":" << getPercentile(samples, 50)
+                      << ",\"p95_ms\":" << getPercentile(samples, 95)
+                      << ",\"p99_ms\":" << getPercentile(samples, 99)
+                      << ",\"max_ms\":" << (samples.empty() ? 0 : samples.back())
+                      << "}" << std::endl;
+        }
+    }
+
+private:
+    /// By the nearest rank.
+    static double getPercentile(const std::vector<double>& sorted, const unsigned percent)
+    {
+        if (sorted.empty())
+        {
+            return 0;
+        }
+
+        const size_t rank = (sorted.size() * percent + 99) / 100;
+        return sorted[std::max(rank, static_cast<size_t>(1)) - 1];
+    }
+
+private:
+    std::mutex _mutex;
+    std::map<std::string, std::vector<double>> _samples;
+};
+
+#endif
+
+/* vim:set shiftwidth=4 softtabstop=4 expandtab: */